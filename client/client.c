@@ -37,8 +37,8 @@
 
 #define SERVER_READ_BUF_LEN 4096
 
-static char *opt_list = "s:vr";
-static int verbose, restricted, once;
+static char *opt_list = "s:vrb";
+static int verbose, restricted, once, batch;
 static char *init_cmd;
 
 static char *server_path = PATH_CONTROL_SOCKET;
@@ -53,13 +53,24 @@ int interactive;	/* Whether stdin is terminal */
 static int num_lines, skip_input;
 int term_lns, term_cls;
 
+/*
+ * In batch mode, commands are read from stdin and at most BATCH_WINDOW of them
+ * are sent to the server ahead of replies. Replies come in the same order, so
+ * each reply line is tagged by the input line number of its command.
+ */
+#define BATCH_WINDOW 64
+
+static uint batch_line[BATCH_WINDOW];	/* Input line numbers of pending commands */
+static uint batch_sent, batch_done;	/* Number of sent and replied commands */
+static int batch_failed;		/* Some command failed */
+
 
 /*** Parsing of arguments ***/
 
 static void
 usage(char *name)
 {
-  fprintf(stderr, "Usage: %s [-s <control-socket>] [-v] [-r]\n", name);
+  fprintf(stderr, "Usage: %s [-s <control-socket>] [-v] [-r] [-b]\n", name);
   exit(1);
 }
 
@@ -80,11 +91,18 @@ parse_args(int argc, char **argv)
       case 'r':
 	restricted = 1;
 	break;
+      case 'b':
+	batch = 1;
+	interactive = 0;
+	break;
       default:
 	usage(argv[0]);
       }
 
   /* If some arguments are not options, we take it as commands */
+  if ((optind < argc) && batch)
+    usage(argv[0]);
+
   if (optind < argc)
     {
       char *tmp;
@@ -166,6 +184,8 @@ submit_command(char *cmd_raw)
   free(cmd);
 }
 
+static void batch_loop(void);
+
 static void
 init_commands(void)
 {
@@ -192,6 +212,9 @@ init_commands(void)
       exit(0);
     }
 
+  if (batch)
+    batch_loop();
+
   input_init();
 
   term_lns = (term_lns > 0) ? term_lns : 25;
@@ -264,27 +287,37 @@ server_got_reply(char *x)
 {
   int code;
   int len = 0;
+  char tag[16] = "";
+
+  if (batch && !init && (*x != '+'))
+    sprintf(tag, "%u: ", batch_line[batch_done % BATCH_WINDOW]);
 
   if (*x == '+')                        /* Async reply */
     PRINTF(len, ">>> %s\n", x+1);
   else if (x[0] == ' ')                 /* Continuation */
-    PRINTF(len, "%s%s\n", verbose ? "     " : "", x+1);
+    PRINTF(len, "%s%s%s\n", tag, verbose ? "     " : "", x+1);
   else if (strlen(x) > 4 &&
            sscanf(x, "%d", &code) == 1 && code >= 0 && code < 10000 &&
            (x[4] == ' ' || x[4] == '-'))
     {
       if (code)
-        PRINTF(len, "%s\n", verbose ? x : x+5);
+        PRINTF(len, "%s%s\n", tag, verbose ? x : x+5);
 
       if (x[4] == ' ')
       {
+        if (batch && !init)
+        {
+          batch_done++;
+          batch_failed |= (code >= 8000);
+        }
+
         busy = 0;
         skip_input = 0;
         return;
       }
     }
   else
-    PRINTF(len, "??? <%s>\n", x);
+    PRINTF(len, "%s??? <%s>\n", tag, x);
 
   if (interactive && busy && !skip_input && !init && (len > 0))
     {
@@ -377,6 +410,63 @@ select_loop(void)
     }
 }
 
+static void
+batch_loop(void)
+{
+  char *line = NULL;
+  size_t size = 0;
+  uint lino = 0;
+  int eof = 0;
+
+  init = 0;
+  while (!eof || (batch_done < batch_sent))
+    {
+      /* Send commands ahead until the window is full */
+      while (!eof && (batch_sent - batch_done < BATCH_WINDOW))
+	{
+	  ssize_t len = getline(&line, &size, stdin);
+	  if (len < 0)
+	    {
+	      eof = 1;
+	      break;
+	    }
+
+	  lino++;
+	  while (len && ((line[len-1] == '\n') || (line[len-1] == '\r')))
+	    line[--len] = 0;
+
+	  char *cmd = line + strspn(line, " \t");
+	  if (!*cmd || (*cmd == '#'))
+	    continue;
+
+	  batch_line[batch_sent++ % BATCH_WINDOW] = lino;
+	  server_send(cmd);
+	}
+
+      if (batch_done == batch_sent)
+	continue;
+
+      fd_set select_fds;
+      FD_ZERO(&select_fds);
+      FD_SET(server_fd, &select_fds);
+
+      int rv = select(server_fd+1, &select_fds, NULL, NULL, NULL);
+      if (rv < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  else
+	    die("select: %m");
+	}
+
+      if (FD_ISSET(server_fd, &select_fds))
+	server_read();
+    }
+
+  fflush(stdout);
+  exit(batch_failed ? 1 : 0);
+}
+
 static void
 wait_for_write(int fd)
 {
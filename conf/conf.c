@@ -95,14 +95,41 @@ config_alloc(byte *name)
   c->pool = p;
   cfg_mem = c->mem = l;
   c->file_name = cfg_strdup(name);
+  init_list(&c->files);
   c->load_time = now;
   c->tf_route = c->tf_proto = (struct timeformat){"%T", "%F", 20*3600};
   c->tf_base = c->tf_log = (struct timeformat){"%F %T", NULL, 0};
   c->gr_wait = DEFAULT_GR_WAIT;
+  c->feed_limit = DEFAULT_FEED_LIMIT;
+  c->table_threads = 1;
 
   return c;
 }
 
+static void
+config_log_profile(struct config *c, btime parse, btime post)
+{
+  uint chains = 0, longest = 0, i;
+
+  for (i = 0; c->sym_hash.data && (i < HASH_SIZE(c->sym_hash)); i++)
+    {
+      struct symbol *s;
+      uint len = 0;
+
+      for (s = c->sym_hash.data[i]; s; s = s->next)
+	len++;
+
+      chains += !!len;
+      longest = MAX(longest, len);
+    }
+
+  log(L_INFO "Parsed %s in %u ms (grammar %u ms, postconfig %u ms)", c->file_name,
+      (uint) ((parse + post) / 1000), (uint) (parse / 1000), (uint) (post / 1000));
+  log(L_INFO "Config uses %u kB, %u symbols in %u of %u hash chains, longest %u",
+      (uint) (rmemsize(c->pool) >> 10), c->sym_hash.count, chains,
+      c->sym_hash.data ? HASH_SIZE(c->sym_hash) : 0, longest);
+}
+
 /**
  * config_parse - parse a configuration
  * @c: configuration
@@ -119,24 +146,31 @@ config_alloc(byte *name)
 int
 config_parse(struct config *c)
 {
+  btime t0, t1, t2;
+
   DBG("Parsing configuration file `%s'\n", c->file_name);
   new_config = c;
   cfg_mem = c->mem;
   if (setjmp(conf_jmpbuf))
     return 0;
+  t0 = precise_time();
   cf_lex_init(0, c);
   sysdep_preconfig(c);
   protos_preconfig(c);
   rt_preconfig(c);
   roa_preconfig(c);
   cf_parse();
+  t1 = precise_time();
   protos_postconfig(c);
+  t2 = precise_time();
   if (EMPTY_LIST(c->protos))
     cf_error("No protocol is specified in the config file");
 #ifdef IPV6
   if (!c->router_id)
     cf_error("Router ID must be configured manually on IPv6 routers");
 #endif
+  if (c->parse_debug)
+    config_log_profile(c, t1 - t0, t2 - t1);
   return 1;
 }
 
@@ -151,7 +185,7 @@ int
 cli_parse(struct config *c)
 {
   new_config = c;
-  c->sym_fallback = config->sym_hash;
+  c->fallback = config;
   cfg_mem = c->mem;
   if (setjmp(conf_jmpbuf))
     return 0;
@@ -229,6 +263,9 @@ config_do_commit(struct config *c, int type)
   else
     config_free(old_config);
 
+  /* Cached results may refer to filters of freed configs */
+  f_cache_flush();
+
   old_config = config;
   old_cftype = type;
   config = c;
@@ -244,6 +281,7 @@ config_do_commit(struct config *c, int type)
   if (old_config)
     old_config->obstacle_count++;
 
+  btime t0 = precise_time();
   DBG("sysdep_commit\n");
   int force_restart = sysdep_commit(c, old_config);
   DBG("global_commit\n");
@@ -254,6 +292,9 @@ config_do_commit(struct config *c, int type)
   DBG("protos_commit\n");
   protos_commit(c, old_config, force_restart, type);
 
+  if (c->parse_debug)
+    log(L_INFO "Committed %s in %u ms", c->file_name, (uint) ((precise_time() - t0) / 1000));
+
   /* Just to be sure nobody uses that now */
   new_config = NULL;
 
@@ -434,6 +475,59 @@ config_undo(void)
   return CONF_PROGRESS;
 }
 
+/**
+ * config_keep - keep the current configuration
+ *
+ * This function may be called instead of parsing and committing a new
+ * configuration, when it is known to be the same as the current one. That is
+ * possible only if no reconfiguration is in progress or queued and no undo
+ * timer is running, otherwise the request has to be processed as usual.
+ * As the current configuration is not replaced, it cannot be undone then.
+ *
+ * Result: 1 if the current configuration is kept, 0 otherwise.
+ */
+int
+config_keep(void)
+{
+  if (shutting_down || configuring || future_cftype || config_timer->expires)
+    return 0;
+
+  undo_available = 0;
+  return 1;
+}
+
+/**
+ * cf_add_file - record a config file
+ * @c: configuration
+ * @name: file name
+ *
+ * The lexer records each file it reads, so it can be later found whether the
+ * files are unchanged. Contents of the files are hashed by cf_hash_data() into
+ * the returned record as they are read.
+ */
+struct cf_file *
+cf_add_file(struct config *c, char *name)
+{
+  struct cf_file *f = lp_allocz(c->mem, sizeof(struct cf_file));
+
+  f->name = name;
+  f->hash = 0xcbf29ce484222325ULL;
+  add_tail(&c->files, &f->n);
+  return f;
+}
+
+/* FNV-1a, so the data may be hashed in chunks of any size */
+u64
+cf_hash_data(u64 h, const byte *buf, uint len)
+{
+  const byte *end = buf + len;
+
+  while (buf < end)
+    h = (h ^ *buf++) * 0x100000001b3ULL;
+
+  return h;
+}
+
 extern void cmd_reconfig_undo_notify(void);
 
 static void
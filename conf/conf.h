@@ -11,6 +11,7 @@
 
 #include "lib/resource.h"
 #include "lib/timer.h"
+#include "lib/hash.h"
 
 
 /* Configuration structure */
@@ -22,6 +23,7 @@ struct config {
   list tables;				/* Configured routing tables (struct rtable_config) */
   list roa_tables;			/* Configured ROA tables (struct roa_table_config) */
   list logfiles;			/* Configured log fils (sysdep) */
+  list affinity;			/* Configured CPU sets of thread classes (sysdep) */
 
   int mrtdump_file;			/* Configured MRTDump file (sysdep, fd in unix) */
   char *syslog_name;			/* Name used for syslog (NULL -> no syslog) */
@@ -39,24 +41,41 @@ struct config {
   struct timeformat tf_log;		/* Time format for the logfile */
   struct timeformat tf_base;		/* Time format for other purposes */
   u32 gr_wait;				/* Graceful restart wait timeout */
+  uint feed_limit;			/* Max number of protocols fed at once, 0 for unlimited */
+  uint table_threads;			/* Number of threads for bulk walks of routing tables */
 
   int cli_debug;			/* Tracing of CLI connections and commands */
+  int parse_debug;			/* Log profile of config parsing */
   int latency_debug;			/* I/O loop tracks duration of each event */
   u32 latency_limit;			/* Events with longer duration are logged (us) */
   u32 watchdog_warning;			/* I/O loop watchdog limit for warning (us) */
   u32 watchdog_timeout;			/* Watchdog timeout (in seconds, 0 = disabled) */
+  u32 work_budget;			/* Max time of bulk work events in one I/O loop cycle (us) */
+  u32 cli_budget;			/* Max time of CLI events in one I/O loop cycle (us) */
+  int cpu_accounting;			/* CPU time of hooks is charged to protocols */
   char *err_msg;			/* Parser error message */
   int err_lino;				/* Line containing error */
   char *err_file_name;			/* File name containing error */
   char *file_name;			/* Name of main configuration file */
   int file_fd;				/* File descriptor of main configuration file */
-  struct symbol **sym_hash;		/* Lexer: symbol hash table */
-  struct symbol **sym_fallback;		/* Lexer: fallback symbol hash table */
+  list files;				/* Files the config was read from (struct cf_file) */
+  int files_globbed;			/* Some files were found by a wildcard include */
+  int skip_unchanged;			/* Reconfiguration with unchanged files is skipped */
+  HASH(struct symbol) sym_hash;		/* Lexer: symbol hash table */
+  struct config *fallback;		/* Lexer: config with fallback symbol hash table */
   int obstacle_count;			/* Number of items blocking freeing of this config */
   int shutdown;				/* This is a pseudo-config for daemon shutdown */
   bird_clock_t load_time;		/* When we've got this configuration */
 };
 
+/* File the config was read from */
+struct cf_file {
+  node n;
+  char *name;
+  u64 hash;				/* Content hash, see cf_hash_data() */
+  int missing;				/* File was not found */
+};
+
 /* Please don't use these variables in protocols. Use proto_config->global instead. */
 extern struct config *config;		/* Currently active configuration */
 extern struct config *new_config;	/* Configuration being parsed */
@@ -66,6 +85,9 @@ int config_parse(struct config *);
 int cli_parse(struct config *);
 void config_free(struct config *);
 int config_commit(struct config *, int type, int timeout);
+int config_keep(void);
+struct cf_file *cf_add_file(struct config *c, char *name);
+u64 cf_hash_data(u64 h, const byte *buf, uint len);
 int config_confirm(void);
 int config_undo(void);
 void config_init(void);
@@ -136,6 +158,7 @@ struct include_file_stack {
   int fd;				/* File descriptor */
   int lino;				/* Current line num */
   int depth;				/* Include depth, 0 = cannot include */
+  struct cf_file *file;			/* Record of the file in the config */
 
   struct include_file_stack *prev;	/* Previous record in stack */
   struct include_file_stack *up;	/* Parent (who included this file) */
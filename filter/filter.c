@@ -33,16 +33,21 @@
 
 #undef LOCAL_DEBUG
 
+#include <stdlib.h>
+
 #include "nest/bird.h"
 #include "lib/lists.h"
+#include "lib/probe.h"
 #include "lib/resource.h"
 #include "lib/socket.h"
 #include "lib/string.h"
 #include "lib/unaligned.h"
+#include "lib/hash.h"
 #include "nest/route.h"
 #include "nest/protocol.h"
 #include "nest/iface.h"
 #include "nest/attrs.h"
+#include "nest/cli.h"
 #include "conf/conf.h"
 #include "filter/filter.h"
 #include "proto/bgp/bgp.h"
@@ -459,6 +464,7 @@ val_format(struct f_val v, buffer *buf)
 static struct rte **f_rte;
 static net *f_net = NULL;
 static struct rta *f_old_rta;
+static struct ea_list *f_mods;
 static struct ea_list **f_tmp_attrs;
 static struct linpool *f_pool;
 static struct buffer f_buf;
@@ -493,6 +499,61 @@ f_rta_cow(void)
   (*f_rte)->attrs = rta_do_cow((*f_rte)->attrs, f_pool);
 }
 
+/*
+ * Attributes set by a filter are collected in one list on top of the eattrs of
+ * the rta copy, instead of a new single-attribute list for each assignment.
+ * Repeated assignments of the same attribute overwrite its entry in place.
+ * The list is allocated from f_pool and merged to the rest when the rta is
+ * cached at the end of f_run(), as before.
+ */
+#define F_MODS_MAX 4
+
+static inline int
+f_ea_same(eattr *o, eattr *a)
+{
+  if (!o)
+    return (a->type & EAF_TYPE_MASK) == EAF_TYPE_UNDEF;
+
+  if ((o->flags != a->flags) || (o->type != a->type))
+    return 0;
+
+  if (a->type & EAF_EMBEDDED)
+    return o->u.data == a->u.data;
+
+  return (o->u.ptr == a->u.ptr) || (o->u.ptr && a->u.ptr && adata_same(o->u.ptr, a->u.ptr));
+}
+
+static void
+f_ea_set(eattr *a)
+{
+  struct ea_list *m = f_mods;
+  int i;
+
+  /* The list is not on top if the rta copy is new */
+  if (m && ((*f_rte)->attrs->eattrs == m))
+  {
+    for (i = 0; i < m->count; i++)
+      if (m->attrs[i].id == a->id)
+      {
+	m->attrs[i] = *a;
+	return;
+      }
+
+    if (m->count < F_MODS_MAX)
+    {
+      m->attrs[m->count++] = *a;
+      return;
+    }
+  }
+
+  m = lp_alloc(f_pool, sizeof(struct ea_list) + F_MODS_MAX * sizeof(eattr));
+  m->next = (*f_rte)->attrs->eattrs;
+  m->flags = 0;
+  m->count = 1;
+  m->attrs[0] = *a;
+  (*f_rte)->attrs->eattrs = f_mods = m;
+}
+
 static struct tbf rl_runtime_err = TBF_DEFAULT_LOG_LIMITS;
 
 #define runtime(x) do { \
@@ -507,9 +568,11 @@ static struct tbf rl_runtime_err = TBF_DEFAULT_LOG_LIMITS;
 	if (x.type & T_RETURN) \
 		return x;
 
-#define ONEARG ARG(v1, a1.p)
-#define TWOARGS ARG(v1, a1.p) \
-		ARG(v2, a2.p)
+/* With @args (see f_vm_exec()), operands are already evaluated */
+#define ONEARG \
+	if (args) v1 = args[0]; else { ARG(v1, a1.p) }
+#define TWOARGS \
+	if (args) v1 = args[0], v2 = args[1]; else { ARG(v1, a1.p) ARG(v2, a2.p) }
 #define TWOARGS_C TWOARGS \
                   if (v1.type != v2.type) \
 		    runtime( "Can't operate with values of incompatible types" );
@@ -519,25 +582,45 @@ static struct tbf rl_runtime_err = TBF_DEFAULT_LOG_LIMITS;
 #define BITFIELD_MASK(what) \
   (1u << (what->a2.i >> 24))
 
+static inline eattr *
+f_ea_find(u16 code)
+{
+  eattr *e = NULL;
+
+  if (!(f_flags & FF_FORCE_TMPATTR))
+    e = ea_find((*f_rte)->attrs->eattrs, code);
+  if (!e)
+    e = ea_find((*f_tmp_attrs), code);
+  if ((!e) && (f_flags & FF_FORCE_TMPATTR))
+    e = ea_find((*f_rte)->attrs->eattrs, code);
+
+  return e;
+}
+
+static struct f_val interpret(struct f_inst *what);
+static void f_count_line(uint line);
+
 /**
- * interpret
- * @what: filter to interpret
+ * interpret_inst
+ * @what: instruction to interpret
+ * @args: values of operands, or NULL
  *
- * Interpret given tree of filter instructions. This is core function
- * of filter system and does all the hard work.
+ * Interpret given instruction of a tree of filter instructions. This is core
+ * function of filter system and does all the hard work.
  *
  * Each instruction has 4 fields: code (which is instruction code),
  * aux (which is extension to instruction code, typically type),
  * arg1 and arg2 - arguments. Depending on instruction, arguments
  * are either integers, or pointers to instruction trees. Common
  * instructions like +, that have two expressions as arguments use
- * TWOARGS macro to get both of them evaluated.
+ * TWOARGS macro to get both of them evaluated, unless their values
+ * are already given in @args by the bytecode interpreter.
  *
  * &f_val structures are copied around, so there are no problems with
  * memory managment.
  */
 static struct f_val
-interpret(struct f_inst *what)
+interpret_inst(struct f_inst *what, const struct f_val *args)
 {
   struct symbol *sym;
   struct f_val v1, v2, res, *vp;
@@ -713,7 +796,7 @@ interpret(struct f_inst *what)
 
   /* Set to indirect value, a1 = variable, a2 = value */
   case 's':
-    ARG(v2, a2.p);
+    if (args) v2 = args[1]; else { ARG(v2, a2.p) }
     sym = what->a1.p;
     vp = sym->def;
     if ((sym->class != (SYM_VARIABLE | v2.type)) && (v2.type != T_VOID)) {
@@ -874,15 +957,7 @@ interpret(struct f_inst *what)
   case P('e','a'):	/* Access to extended attributes */
     ACCESS_RTE;
     {
-      eattr *e = NULL;
-      u16 code = what->a2.i;
-
-      if (!(f_flags & FF_FORCE_TMPATTR))
-	e = ea_find((*f_rte)->attrs->eattrs, code);
-      if (!e)
-	e = ea_find((*f_tmp_attrs), code);
-      if ((!e) && (f_flags & FF_FORCE_TMPATTR))
-	e = ea_find((*f_rte)->attrs->eattrs, code);
+      eattr *e = f_ea_find(what->a2.i);
 
       if (!e) {
 	/* A special case: undefined int_set looks like empty int_set */
@@ -950,35 +1025,32 @@ interpret(struct f_inst *what)
     ACCESS_RTE;
     ONEARG;
     {
-      struct ea_list *l = lp_alloc(f_pool, sizeof(struct ea_list) + sizeof(eattr));
+      eattr a;
       u16 code = what->a2.i;
 
-      l->next = NULL;
-      l->flags = EALF_SORTED;
-      l->count = 1;
-      l->attrs[0].id = code;
-      l->attrs[0].flags = 0;
-      l->attrs[0].type = what->aux | EAF_ORIGINATED;
+      a.id = code;
+      a.flags = 0;
+      a.type = what->aux | EAF_ORIGINATED;
 
       switch (what->aux & EAF_TYPE_MASK) {
       case EAF_TYPE_INT:
 	if (v1.type != T_INT)
 	  runtime( "Setting int attribute to non-int value" );
-	l->attrs[0].u.data = v1.val.i;
+	a.u.data = v1.val.i;
 	break;
 
       case EAF_TYPE_ROUTER_ID:
 #ifndef IPV6
 	/* IP->Quad implicit conversion */
 	if (v1.type == T_IP) {
-	  l->attrs[0].u.data = ipa_to_u32(v1.val.px.ip);
+	  a.u.data = ipa_to_u32(v1.val.px.ip);
 	  break;
 	}
 #endif
 	/* T_INT for backward compatibility */
 	if ((v1.type != T_QUAD) && (v1.type != T_INT))
 	  runtime( "Setting quad attribute to non-quad value" );
-	l->attrs[0].u.data = v1.val.i;
+	a.u.data = v1.val.i;
 	break;
 
       case EAF_TYPE_OPAQUE:
@@ -991,57 +1063,58 @@ interpret(struct f_inst *what)
 	struct adata *ad = lp_alloc(f_pool, sizeof(struct adata) + len);
 	ad->length = len;
 	(* (ip_addr *) ad->data) = v1.val.px.ip;
-	l->attrs[0].u.ptr = ad;
+	a.u.ptr = ad;
 	break;
       case EAF_TYPE_AS_PATH:
 	if (v1.type != T_PATH)
 	  runtime( "Setting path attribute to non-path value" );
-	l->attrs[0].u.ptr = v1.val.ad;
+	a.u.ptr = v1.val.ad;
 	break;
       case EAF_TYPE_BITFIELD:
 	if (v1.type != T_BOOL)
 	  runtime( "Setting bit in bitfield attribute to non-bool value" );
 	{
 	  /* First, we have to find the old value */
-	  eattr *e = NULL;
-	  if (!(f_flags & FF_FORCE_TMPATTR))
-	    e = ea_find((*f_rte)->attrs->eattrs, code);
-	  if (!e)
-	    e = ea_find((*f_tmp_attrs), code);
-	  if ((!e) && (f_flags & FF_FORCE_TMPATTR))
-	    e = ea_find((*f_rte)->attrs->eattrs, code);
+	  eattr *e = f_ea_find(code);
 	  u32 data = e ? e->u.data : 0;
 
 	  if (v1.val.i)
-	    l->attrs[0].u.data = data | BITFIELD_MASK(what);
+	    a.u.data = data | BITFIELD_MASK(what);
 	  else
-	    l->attrs[0].u.data = data & ~BITFIELD_MASK(what);;
+	    a.u.data = data & ~BITFIELD_MASK(what);;
 	}
 	break;
       case EAF_TYPE_INT_SET:
 	if (v1.type != T_CLIST)
 	  runtime( "Setting clist attribute to non-clist value" );
-	l->attrs[0].u.ptr = v1.val.ad;
+	a.u.ptr = v1.val.ad;
 	break;
       case EAF_TYPE_EC_SET:
 	if (v1.type != T_ECLIST)
 	  runtime( "Setting eclist attribute to non-eclist value" );
-	l->attrs[0].u.ptr = v1.val.ad;
+	a.u.ptr = v1.val.ad;
 	break;
       case EAF_TYPE_UNDEF:
 	if (v1.type != T_VOID)
 	  runtime( "Setting void attribute to non-void value" );
-	l->attrs[0].u.data = 0;
+	a.u.data = 0;
 	break;
       default: bug("Unknown type in e,S");
       }
 
       if (!(what->aux & EAF_TEMP) && (!(f_flags & FF_FORCE_TMPATTR))) {
+	/* Setting the current value changes nothing, the rta need not be copied */
+	if (f_ea_same(ea_find((*f_rte)->attrs->eattrs, code | EA_ALLOW_UNDEF), &a))
+	  break;
+
 	f_rta_cow();
-	l->next = (*f_rte)->attrs->eattrs;
-	(*f_rte)->attrs->eattrs = l;
+	f_ea_set(&a);
       } else {
+	struct ea_list *l = lp_alloc(f_pool, sizeof(struct ea_list) + sizeof(eattr));
 	l->next = (*f_tmp_attrs);
+	l->flags = EALF_SORTED;
+	l->count = 1;
+	l->attrs[0] = a;
 	(*f_tmp_attrs) = l;
       }
     }
@@ -1058,6 +1131,8 @@ interpret(struct f_inst *what)
       runtime( "Can't set preference to non-integer" );
     if (v1.val.i > 0xFFFF)
       runtime( "Setting preference value out of bounds" );
+    if ((*f_rte)->pref == v1.val.i)
+      break;
     f_rte_cow();
     (*f_rte)->pref = v1.val.i;
     break;
@@ -1328,188 +1403,1274 @@ interpret(struct f_inst *what)
   default:
     bug( "Unknown instruction %d (%c)", what->code, what->code & 0xff);
   }
-  if (what->next)
-    return interpret(what->next);
   return res;
 }
 
-#undef ARG
-#define ARG(x,y) \
-	if (!i_same(f1->y, f2->y)) \
-		return 0;
+/*
+ * interpret - interpret a sequence of instructions, returns the value of the
+ * last one unless some of them forced a return.
+ */
+static struct f_val
+interpret(struct f_inst *what)
+{
+  struct f_val res = { .type = T_VOID };
 
-#define ONEARG ARG(v1, a1.p)
-#define TWOARGS ARG(v1, a1.p) \
-		ARG(v2, a2.p)
+  for (; what; what = what->next)
+  {
+    if (f_profile)
+      f_count_line(what->lineno);
 
-#define A2_SAME if (f1->a2.i != f2->a2.i) return 0;
+    res = interpret_inst(what, NULL);
+    if (res.type & T_RETURN)
+      return res;
+  }
+
+  return res;
+}
 
 /*
- * i_same - function that does real comparing of instruction trees, you should call filter_same from outside
+ * Filter bytecode
+ *
+ * Filters are lowered by f_compile() to a linear code for a stack machine.
+ * Operands of common instructions are computed by preceding ops and passed
+ * on the value stack, control flow of &, |, if and function calls is done by
+ * jumps, so a filter is mostly executed without recursion through the tree
+ * of instructions. Constant subexpressions are folded in advance and access
+ * to int attributes is handled by a specialized op. The usual matches of
+ * route data with constant sets and masks are fused to single ops, see
+ * f_compile_match(). Other instructions are
+ * executed by interpret_inst() with operands from the stack (%FO_EXEC), bodies
+ * of case statements are still interpreted from the tree.
  */
-int
-i_same(struct f_inst *f1, struct f_inst *f2)
+
+enum f_opcode {
+  FO_END,		/* Return value on top of stack */
+  FO_CONST,		/* Push constant p.val */
+  FO_VAR,		/* Push variable p.val */
+  FO_POP,		/* Drop value on top of stack */
+  FO_PUSH_BOOL,		/* Push bool arg */
+  FO_EXEC,		/* Execute p.inst, operands in mask (bit 0 - a1, bit 1 - a2) */
+  FO_JMP,		/* Jump to arg */
+  FO_SHORT,		/* Jump to arg if top is bool mask, otherwise drop it */
+  FO_BOOL,		/* Check that top is bool */
+  FO_IF,		/* Pop condition, if false push bool 1 and jump to arg */
+  FO_CALL,		/* Call function p.prog */
+  FO_EQ,
+  FO_NE,
+  FO_LT,
+  FO_LE,
+  FO_EA_INT,		/* Push int attribute arg of type mask */
+  FO_NET_MATCH,		/* Push whether net of route matches prefix set p.val */
+  FO_PATH_MATCH,	/* Push whether path attribute arg matches mask p.val */
+  FO_CLIST_HAS,		/* Push whether clist attribute arg contains p.val */
+  FO_MAX
+};
+
+struct f_op {
+  u16 code;
+  u16 mask;
+  int arg;
+  union {
+    struct f_inst *inst;
+    struct f_val *val;
+    struct f_prog *prog;
+  } p;
+  struct f_inst *inst;			/* Source instruction, for error messages */
+};
+
+struct f_prog {
+  struct f_op *code;
+  uint len;
+  uint max_stack;
+  u16 *attrs;				/* Attributes read or set by a cacheable filter */
+  uint attr_count;
+  u8 cacheable;				/* Result depends only on rta, see f_run_cached() */
+  u8 net_match, net_nomatch;		/* Results of the net test, see f_compile_net_test() */
+  struct f_trie *net_trie;		/* The filter just tests net for this set */
+};
+
+#define vm_runtime(x) do { \
+    log_rl(&rl_runtime_err, L_ERR "filters, line %d: %s", op->inst->lineno, x); \
+    res.type = T_RETURN; \
+    res.val.i = F_ERROR; \
+    return res; \
+  } while(0)
+
+#ifdef __GNUC__
+#define VM_OP(x)	L_##x:
+#define VM_JUMP()	goto *vm_labels[op->code]
+#else
+#define VM_OP(x)	case x:
+#define VM_JUMP()	continue
+#endif
+
+#define VM_NEXT		{ op++; VM_JUMP(); }
+#define VM_GOTO(n)	{ op = prog->code + (n); VM_JUMP(); }
+
+/*
+ * f_vm_exec - execute filter bytecode, returns the same value as interpret()
+ * of the original instructions.
+ */
+static struct f_val
+f_vm_exec(struct f_prog *prog)
 {
-  if ((!!f1) != (!!f2))
-    return 0;
-  if (!f1)
-    return 1;
-  if (f1->aux != f2->aux)
-    return 0;
-  if (f1->code != f2->code)
+#ifdef __GNUC__
+  static const void *vm_labels[FO_MAX] = {
+    [FO_END] = &&L_FO_END,
+    [FO_CONST] = &&L_FO_CONST,
+    [FO_VAR] = &&L_FO_VAR,
+    [FO_POP] = &&L_FO_POP,
+    [FO_PUSH_BOOL] = &&L_FO_PUSH_BOOL,
+    [FO_EXEC] = &&L_FO_EXEC,
+    [FO_JMP] = &&L_FO_JMP,
+    [FO_SHORT] = &&L_FO_SHORT,
+    [FO_BOOL] = &&L_FO_BOOL,
+    [FO_IF] = &&L_FO_IF,
+    [FO_CALL] = &&L_FO_CALL,
+    [FO_EQ] = &&L_FO_EQ,
+    [FO_NE] = &&L_FO_NE,
+    [FO_LT] = &&L_FO_LT,
+    [FO_LE] = &&L_FO_LE,
+    [FO_EA_INT] = &&L_FO_EA_INT,
+    [FO_NET_MATCH] = &&L_FO_NET_MATCH,
+    [FO_PATH_MATCH] = &&L_FO_PATH_MATCH,
+    [FO_CLIST_HAS] = &&L_FO_CLIST_HAS,
+  };
+#endif
+
+  struct f_val stack[prog->max_stack];
+  struct f_val *sp = stack;
+  struct f_op *op = prog->code;
+  struct f_val res, args[2];
+  eattr *e;
+  int i;
+
+#ifdef __GNUC__
+  VM_JUMP();
+#else
+  for (;;) switch (op->code) {
+#endif
+
+  VM_OP(FO_END)
+    return sp[-1];
+
+  VM_OP(FO_CONST)
+  VM_OP(FO_VAR)
+    *sp++ = *op->p.val;
+    VM_NEXT;
+
+  VM_OP(FO_POP)
+    sp--;
+    VM_NEXT;
+
+  VM_OP(FO_PUSH_BOOL)
+    sp->type = T_BOOL;
+    sp->val.i = op->arg;
+    sp++;
+    VM_NEXT;
+
+  VM_OP(FO_EXEC)
+    if (op->mask & 2)
+      args[1] = *--sp;
+    if (op->mask & 1)
+      args[0] = *--sp;
+    res = interpret_inst(op->p.inst, op->mask ? args : NULL);
+    if (res.type & T_RETURN)
+      return res;
+    *sp++ = res;
+    VM_NEXT;
+
+  VM_OP(FO_JMP)
+    VM_GOTO(op->arg);
+
+  VM_OP(FO_SHORT)
+    if (sp[-1].type != T_BOOL)
+      vm_runtime( "Can't do boolean operation on non-booleans" );
+    if (sp[-1].val.i == op->mask)
+      VM_GOTO(op->arg);
+    sp--;
+    VM_NEXT;
+
+  VM_OP(FO_BOOL)
+    if (sp[-1].type != T_BOOL)
+      vm_runtime( "Can't do boolean operation on non-booleans" );
+    VM_NEXT;
+
+  VM_OP(FO_IF)
+    sp--;
+    if (sp->type != T_BOOL)
+      vm_runtime( "If requires boolean expression" );
+    if (sp->val.i)
+      VM_NEXT;
+    sp->val.i = 1;
+    sp++;
+    VM_GOTO(op->arg);
+
+  VM_OP(FO_CALL)
+    res = f_vm_exec(op->p.prog);
+    if (res.type == T_RETURN)
+      return res;
+    res.type &= ~T_RETURN;
+    *sp++ = res;
+    VM_NEXT;
+
+  VM_OP(FO_EQ)
+  VM_OP(FO_NE)
+    sp--;
+    i = val_same(sp[-1], sp[0]);
+    sp[-1].type = T_BOOL;
+    sp[-1].val.i = (op->code == FO_EQ) ? i : !i;
+    VM_NEXT;
+
+  VM_OP(FO_LT)
+  VM_OP(FO_LE)
+    sp--;
+    i = val_compare(sp[-1], sp[0]);
+    if (i == CMP_ERROR)
+      vm_runtime( "Can't compare values of incompatible types" );
+    sp[-1].type = T_BOOL;
+    sp[-1].val.i = (op->code == FO_LT) ? (i == -1) : (i != 1);
+    VM_NEXT;
+
+  VM_OP(FO_EA_INT)
+    if (!f_rte)
+      vm_runtime( "No route to access" );
+    e = f_ea_find(op->arg);
+    sp->type = e ? op->mask : T_VOID;
+    sp->val.i = e ? e->u.data : 0;
+    sp++;
+    VM_NEXT;
+
+  VM_OP(FO_NET_MATCH)
+    if (!f_rte)
+      vm_runtime( "No route to access" );
+    sp->type = T_BOOL;
+    sp->val.i = !!trie_match_prefix(op->p.val->val.ti, (*f_rte)->net->n.prefix, (*f_rte)->net->n.pxlen);
+    sp++;
+    VM_NEXT;
+
+  VM_OP(FO_PATH_MATCH)
+    if (!f_rte)
+      vm_runtime( "No route to access" );
+    if (!(e = f_ea_find(op->arg)))
+      vm_runtime( "~ applied on unknown type pair" );
+    sp->type = T_BOOL;
+    sp->val.i = !!as_path_match(e->u.ptr, op->p.val->val.path_mask);
+    sp++;
+    VM_NEXT;
+
+  VM_OP(FO_CLIST_HAS)
+    if (!f_rte)
+      vm_runtime( "No route to access" );
+    e = f_ea_find(op->arg);
+    sp->type = T_BOOL;
+    sp->val.i = e && int_set_contains(e->u.ptr, op->p.val->val.i);
+    sp++;
+    VM_NEXT;
+
+#ifndef __GNUC__
+  default:
+    bug("Unknown filter op %d", op->code);
+  }
+#endif
+}
+
+#undef VM_OP
+#undef VM_JUMP
+#undef VM_NEXT
+#undef VM_GOTO
+
+struct f_call {
+  struct f_call *next;
+  struct f_inst *body;
+  struct f_prog *prog;
+};
+
+struct f_compiler {
+  struct f_op *code;
+  uint len, size;
+  int depth, max_depth;
+  struct f_call **calls;		/* Function bodies compiled for the filter */
+};
+
+static void f_compile_prog(struct f_prog *prog, struct f_inst *root, struct f_call **calls);
+
+static struct f_op *
+f_emit(struct f_compiler *c, uint code, struct f_inst *inst, int pop, int push)
+{
+  if (c->len == c->size)
+  {
+    c->size = c->size ? 2 * c->size : 32;
+    c->code = xrealloc(c->code, c->size * sizeof(struct f_op));
+  }
+
+  c->depth += push - pop;
+  c->max_depth = MAX(c->max_depth, c->depth);
+
+  struct f_op *op = &c->code[c->len++];
+  memset(op, 0, sizeof(struct f_op));
+  op->code = code;
+  op->inst = inst;
+  return op;
+}
+
+static inline void
+f_emit_const(struct f_compiler *c, struct f_inst *inst, struct f_val v)
+{
+  struct f_op *op = f_emit(c, FO_CONST, inst, 0, 1);
+  op->p.val = cfg_alloc(sizeof(struct f_val));
+  *op->p.val = v;
+}
+
+/*
+ * f_fold - evaluate constant instruction @i to @v, returns 0 if it is not
+ * constant or if its evaluation could fail at run time.
+ */
+static int
+f_fold(struct f_inst *i, struct f_val *v)
+{
+  struct f_val args[2];
+  int n = 0;
+
+  if (!i)
     return 0;
-  if (f1 == f2)		/* It looks strange, but it is possible with call rewriting trickery */
+
+  switch (i->code)
+  {
+  case 'c':
+  case 'C':
+    *v = interpret_inst(i, NULL);
     return 1;
 
-  switch(f1->code) {
-  case ',': /* fall through */
+  case '!':
+  case P('d','e'):
+    n = 1;
+    break;
+
   case '+':
   case '-':
   case '*':
   case '/':
-  case '|':
-  case '&':
   case P('m','p'):
-  case P('m','c'):
-  case P('!','='):
   case P('=','='):
+  case P('!','='):
   case '<':
-  case P('<','='): TWOARGS; break;
-
-  case '!': ONEARG; break;
-  case '~': TWOARGS; break;
-  case P('d','e'): ONEARG; break;
-
-  case 's':
-    ARG(v2, a2.p);
-    {
-      struct symbol *s1, *s2;
-      s1 = f1->a1.p;
-      s2 = f2->a1.p;
-      if (strcmp(s1->name, s2->name))
-	return 0;
-      if (s1->class != s2->class)
-	return 0;
-    }
+  case P('<','='):
+    n = 2;
     break;
 
-  case 'c':
-    switch (f1->aux) {
-
-    case T_PREFIX_SET:
-      if (!trie_same(f1->a2.p, f2->a2.p))
-	return 0;
-      break;
-
-    case T_SET:
-      if (!same_tree(f1->a2.p, f2->a2.p))
-	return 0;
-      break;
-
-    case T_STRING:
-      if (strcmp(f1->a2.p, f2->a2.p))
-	return 0;
-      break;
+  default:
+    return 0;
+  }
 
-    default:
-      A2_SAME;
-    }
-    break;
+  if (i->a1.p == NULL || ((struct f_inst *) i->a1.p)->next || !f_fold(i->a1.p, &args[0]))
+    return 0;
+  if (n == 2 && (i->a2.p == NULL || ((struct f_inst *) i->a2.p)->next || !f_fold(i->a2.p, &args[1])))
+    return 0;
 
-  case 'C':
-    if (!val_same(* (struct f_val *) f1->a1.p, * (struct f_val *) f2->a1.p))
+  /* Leave anything that could raise a runtime error to run time */
+  switch (i->code)
+  {
+  case '!':
+    if (args[0].type != T_BOOL)
       return 0;
     break;
 
-  case 'V':
-    if (strcmp((char *) f1->a2.p, (char *) f2->a2.p))
+  case '/':
+    if ((args[1].type == T_INT) && !args[1].val.i)
+      return 0;
+    /* fall through */
+  case '+':
+  case '-':
+  case '*':
+  case P('m','p'):
+    if ((args[0].type != T_INT) || (args[1].type != T_INT))
+      return 0;
+    if ((i->code == P('m','p')) && ((args[0].val.i > 0xFFFF) || (args[1].val.i > 0xFFFF)))
       return 0;
     break;
-  case 'p': case 'L': ONEARG; break;
-  case '?': TWOARGS; break;
-  case '0': case 'E': break;
-  case P('p',','): ONEARG; A2_SAME; break;
-  case 'P':
-  case 'a': A2_SAME; break;
-  case P('e','a'): A2_SAME; break;
-  case P('P','S'):
-  case P('a','S'):
-  case P('e','S'): ONEARG; A2_SAME; break;
 
-  case 'r': ONEARG; break;
-  case P('c','p'): ONEARG; break;
-  case P('c','a'): /* Call rewriting trickery to avoid exponential behaviour */
-             ONEARG;
-	     if (!i_same(f1->a2.p, f2->a2.p))
-	       return 0;
-	     f2->a2.p = f1->a2.p;
-	     break;
-  case P('c','v'): break; /* internal instruction */
-  case P('S','W'): ONEARG; if (!same_tree(f1->a2.p, f2->a2.p)) return 0; break;
-  case P('i','M'): TWOARGS; break;
-  case P('A','p'): TWOARGS; break;
-  case P('C','a'): TWOARGS; break;
-  case P('a','f'):
-  case P('a','l'): ONEARG; break;
-  case P('R','C'):
-    TWOARGS;
-    /* Does not really make sense - ROA check resuls may change anyway */
-    if (strcmp(((struct f_inst_roa_check *) f1)->rtc->name,
-	       ((struct f_inst_roa_check *) f2)->rtc->name))
+  case '<':
+  case P('<','='):
+    if (val_compare(args[0], args[1]) == CMP_ERROR)
       return 0;
     break;
-  default:
-    bug( "Unknown instruction %d in same (%c)", f1->code, f1->code & 0xff);
   }
-  return i_same(f1->next, f2->next);
+
+  *v = interpret_inst(i, args);
+  return !(v->type & T_RETURN);
 }
 
-/**
- * f_run - run a filter for a route
- * @filter: filter to run
- * @rte: route being filtered, may be modified
- * @tmp_attrs: temporary attributes, prepared by caller or generated by f_run()
- * @tmp_pool: all filter allocations go from this pool
- * @flags: flags
- *
- * If filter needs to modify the route, there are several
- * posibilities. @rte might be read-only (with REF_COW flag), in that
- * case rw copy is obtained by rte_cow() and @rte is replaced. If
- * @rte is originally rw, it may be directly modified (and it is never
- * copied).
- *
- * The returned rte may reuse the (possibly cached, cloned) rta, or
- * (if rta was modificied) contains a modified uncached rta, which
- * uses parts allocated from @tmp_pool and parts shared from original
- * rta. There is one exception - if @rte is rw but contains a cached
- * rta and that is modified, rta in returned rte is also cached.
- *
- * Ownership of cached rtas is consistent with rte, i.e.
- * if a new rte is returned, it has its own clone of cached rta
- * (and cached rta of read-only source rte is intact), if rte is
- * modified in place, old cached rta is possibly freed.
- */
-int
-f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, int flags)
-{
-  if (filter == FILTER_ACCEPT)
-    return F_ACCEPT;
+static void f_compile_inst(struct f_compiler *c, struct f_inst *i);
 
-  if (filter == FILTER_REJECT)
-    return F_REJECT;
+static inline int
+f_ea_type(struct f_inst *i, int type)
+{
+  return i && !i->next && (i->code == P('e','a')) && ((i->aux & EAF_TYPE_MASK) == type);
+}
+
+/*
+ * f_compile_match - compile '~' of route data and a constant to a fused op,
+ * returns 0 if the operands do not allow it. The most frequent matches in
+ * export filters are net ~ [ prefix set ], bgp_path ~ [= mask =] and
+ * (asn, value) ~ bgp_community.
+ */
+static int
+f_compile_match(struct f_compiler *c, struct f_inst *i)
+{
+  struct f_inst *a1 = i->a1.p, *a2 = i->a2.p;
+  struct f_val v;
+  struct f_op *op;
+
+  if (a1 && !a1->next && (a1->code == 'a') && (a1->a2.i == SA_NET) &&
+      f_fold(a2, &v) && (v.type == T_PREFIX_SET) && !a2->next)
+  {
+    op = f_emit(c, FO_NET_MATCH, i, 0, 1);
+    goto done;
+  }
+
+  if (f_ea_type(a1, EAF_TYPE_AS_PATH) && f_fold(a2, &v) && (v.type == T_PATH_MASK) && !a2->next)
+  {
+    op = f_emit(c, FO_PATH_MATCH, i, 0, 1);
+    op->arg = a1->a2.i;
+    goto done;
+  }
+
+  if (f_ea_type(a2, EAF_TYPE_INT_SET) && f_fold(a1, &v) && !a1->next &&
+      ((v.type == T_PAIR) || (v.type == T_QUAD)))
+  {
+    op = f_emit(c, FO_CLIST_HAS, i, 0, 1);
+    op->arg = a2->a2.i;
+    goto done;
+  }
+
+  return 0;
+
+done:
+  op->p.val = cfg_alloc(sizeof(struct f_val));
+  *op->p.val = v;
+  return 1;
+}
+
+/* Compile sequence of instructions, leaving value of the last one on stack */
+static void
+f_compile_chain(struct f_compiler *c, struct f_inst *i)
+{
+  if (!i)
+  {
+    f_emit_const(c, NULL, (struct f_val) { .type = T_VOID });
+    return;
+  }
+
+  for (; i; i = i->next)
+  {
+    f_compile_inst(c, i);
+    if (i->next)
+      f_emit(c, FO_POP, i, 1, 0);
+  }
+}
+
+/* Which operands of an instruction are passed on stack to FO_EXEC */
+static int
+f_operand_mask(struct f_inst *i)
+{
+  switch (i->code)
+  {
+  case ',':
+  case '+':
+  case '-':
+  case '*':
+  case '/':
+  case P('m','p'):
+  case P('m','c'):
+  case '~':
+  case P('i','M'):
+  case P('A','p'):
+  case P('C','a'):
+    return 3;
+
+  case P('R','C'):
+    return i->arg1 ? 3 : 0;
+
+  case '!':
+  case P('d','e'):
+  case 'p':
+  case P('p',','):
+  case P('a','S'):
+  case P('e','S'):
+  case P('P','S'):
+  case 'L':
+  case P('c','p'):
+  case P('a','f'):
+  case P('a','l'):
+  case 'r':
+  case P('S','W'):
+    return 1;
+
+  case 's':
+    return 2;
+
+  default:
+    /* No operands, or interpret_inst() evaluates them from the tree */
+    return 0;
+  }
+}
+
+static void
+f_compile_inst(struct f_compiler *c, struct f_inst *i)
+{
+  struct f_op *op;
+  struct f_val v;
+  struct f_call *call;
+  uint pos;
+  int mask;
+
+  if (f_fold(i, &v))
+  {
+    f_emit_const(c, i, v);
+    return;
+  }
+
+  switch (i->code)
+  {
+  case 'V':
+    op = f_emit(c, FO_VAR, i, 0, 1);
+    op->p.val = i->a1.p;
+    return;
+
+  case '&':
+  case '|':
+    /* The first operand is left on stack when the second one is skipped */
+    f_compile_chain(c, i->a1.p);
+    f_emit(c, FO_SHORT, i, 1, 0)->mask = (i->code == '|');
+    pos = c->len - 1;
+    f_compile_chain(c, i->a2.p);
+    f_emit(c, FO_BOOL, i, 0, 0);
+    c->code[pos].arg = c->len;
+    return;
+
+  case '?':
+    /* Result is bool 1 if the condition was false, see interpret_inst() */
+    f_compile_chain(c, i->a1.p);
+    f_emit(c, FO_IF, i, 1, 0);
+    pos = c->len - 1;
+    f_compile_chain(c, i->a2.p);
+    f_emit(c, FO_POP, i, 1, 0);
+    f_emit(c, FO_PUSH_BOOL, i, 0, 1)->arg = 0;
+    c->code[pos].arg = c->len;
+    return;
+
+  case P('c','a'):
+    f_compile_chain(c, i->a1.p);
+    f_emit(c, FO_POP, i, 1, 0);
+
+    for (call = *c->calls; call; call = call->next)
+      if (call->body == i->a2.p)
+	break;
+
+    if (!call)
+    {
+      /* Registered before compiling, so that recursive calls find it */
+      call = cfg_allocz(sizeof(struct f_call));
+      call->body = i->a2.p;
+      call->prog = cfg_allocz(sizeof(struct f_prog));
+      call->next = *c->calls;
+      *c->calls = call;
+      f_compile_prog(call->prog, i->a2.p, c->calls);
+    }
+
+    f_emit(c, FO_CALL, i, 0, 1)->p.prog = call->prog;
+    return;
+
+  case P('=','='):
+  case P('!','='):
+  case '<':
+  case P('<','='):
+    f_compile_chain(c, i->a1.p);
+    f_compile_chain(c, i->a2.p);
+    f_emit(c, (i->code == P('=','=')) ? FO_EQ :
+	      (i->code == P('!','=')) ? FO_NE :
+	      (i->code == '<') ? FO_LT : FO_LE, i, 2, 1);
+    return;
+
+  case P('e','a'):
+    if ((i->aux & EAF_TYPE_MASK) == EAF_TYPE_INT ||
+	(i->aux & EAF_TYPE_MASK) == EAF_TYPE_ROUTER_ID)
+    {
+      op = f_emit(c, FO_EA_INT, i, 0, 1);
+      op->arg = i->a2.i;
+      op->mask = ((i->aux & EAF_TYPE_MASK) == EAF_TYPE_INT) ? T_INT : T_QUAD;
+      return;
+    }
+    break;
+
+  case '~':
+    if (f_compile_match(c, i))
+      return;
+    break;
+  }
+
+  mask = f_operand_mask(i);
+  if (mask & 1)
+    f_compile_chain(c, i->a1.p);
+  if (mask & 2)
+    f_compile_chain(c, i->a2.p);
+
+  op = f_emit(c, FO_EXEC, i, (mask & 1) + !!(mask & 2), 1);
+  op->mask = mask;
+  op->p.inst = i;
+}
+
+static void
+f_compile_prog(struct f_prog *prog, struct f_inst *root, struct f_call **calls)
+{
+  struct f_compiler c = { .calls = calls };
+
+  f_compile_chain(&c, root);
+  f_emit(&c, FO_END, NULL, 1, 0);
+
+  prog->len = c.len;
+  prog->max_stack = MAX(c.max_depth, 1);
+  prog->code = cfg_alloc(c.len * sizeof(struct f_op));
+  memcpy(prog->code, c.code, c.len * sizeof(struct f_op));
+  xfree(c.code);
+}
+
+struct f_scan {
+  u16 *attrs;
+  uint count, size;
+  struct f_call *bodies;		/* Visited function bodies */
+};
+
+static void
+f_scan_attr(struct f_scan *s, u16 code)
+{
+  uint i;
+
+  for (i = 0; i < s->count; i++)
+    if (s->attrs[i] == code)
+      return;
+
+  if (s->count == s->size)
+  {
+    s->size = s->size ? 2 * s->size : 8;
+    s->attrs = xrealloc(s->attrs, s->size * sizeof(u16));
+  }
+
+  s->attrs[s->count++] = code;
+}
+
+static int f_scan_chain(struct f_scan *s, struct f_inst *i);
+
+static int
+f_scan_tree(struct f_scan *s, struct f_tree *t)
+{
+  return !t || (f_scan_tree(s, t->left) && f_scan_tree(s, t->right) && f_scan_chain(s, t->data));
+}
+
+/*
+ * f_scan_inst - check that instruction @i reads nothing but the rta and has no
+ * other side effect than setting of temporary attributes, and collect codes
+ * of accessed extended attributes.
+ */
+static int
+f_scan_inst(struct f_scan *s, struct f_inst *i)
+{
+  struct f_call *b;
+
+  switch (i->code)
+  {
+  case 'c':
+  case 'C':
+  case 'V':
+  case 'E':
+  case '0':
+  case P('c','v'):
+    return 1;
+
+  case 'a':
+    return i->a2.i != SA_NET;
+
+  case P('e','a'):
+    f_scan_attr(s, i->a2.i);
+    return 1;
+
+  case P('e','S'):
+    f_scan_attr(s, i->a2.i);
+    return f_scan_chain(s, i->a1.p);
+
+  case P('p',','):
+    /* Printing is a side effect */
+    return !i->a1.p && ((i->a2.i == F_ACCEPT) || (i->a2.i == F_REJECT) || (i->a2.i == F_ERROR));
+
+  case '!':
+  case P('d','e'):
+  case 'p':
+  case 'L':
+  case P('c','p'):
+  case P('a','f'):
+  case P('a','l'):
+  case 'r':
+    return f_scan_chain(s, i->a1.p);
+
+  case 's':
+    return f_scan_chain(s, i->a2.p);
+
+  case P('S','W'):
+    return f_scan_chain(s, i->a1.p) && f_scan_tree(s, i->a2.p);
+
+  case P('c','a'):
+    for (b = s->bodies; b; b = b->next)
+      if (b->body == i->a2.p)
+	return f_scan_chain(s, i->a1.p);
+
+    b = cfg_allocz(sizeof(struct f_call));
+    b->body = i->a2.p;
+    b->next = s->bodies;
+    s->bodies = b;
+    return f_scan_chain(s, i->a1.p) && f_scan_chain(s, i->a2.p);
+
+  case ',':
+  case '+':
+  case '-':
+  case '*':
+  case '/':
+  case '&':
+  case '|':
+  case '?':
+  case '~':
+  case P('m','p'):
+  case P('m','c'):
+  case P('=','='):
+  case P('!','='):
+  case '<':
+  case P('<','='):
+  case P('i','M'):
+  case P('A','p'):
+  case P('C','a'):
+    return f_scan_chain(s, i->a1.p) && f_scan_chain(s, i->a2.p);
+
+  default:
+    /* Access to net, rte or ROA tables, modification of rta */
+    return 0;
+  }
+}
+
+static int
+f_scan_chain(struct f_scan *s, struct f_inst *i)
+{
+  for (; i; i = i->next)
+    if (!f_scan_inst(s, i))
+      return 0;
+
+  return 1;
+}
+
+/**
+ * f_compile - compile filter to bytecode
+ * @f: filter
+ *
+ * This function is called by the config parser for each filter. It lowers
+ * the instructions of the filter to a program for the bytecode interpreter,
+ * which is then used by f_run(). It also finds whether the filter is
+ * cacheable by f_run_cached().
+ */
+static inline int
+f_is_verdict(struct f_inst *i)
+{
+  return i && !i->next && (i->code == P('p',',')) && !i->a1.p &&
+    ((i->a2.i == F_ACCEPT) || (i->a2.i == F_REJECT));
+}
+
+/*
+ * Filters 'where net ~ <prefix set>' and their explicit equivalents decide
+ * just by the test of net, which f_run_batch() does without the interpreter.
+ */
+static void
+f_compile_net_test(struct filter *f)
+{
+  struct f_inst *i = f->root, *m, *a, *b;
+  struct f_val v;
+
+  if (!i || (i->code != '?') || !f_is_verdict(i->a2.p) || !f_is_verdict(i->next))
+    return;
+
+  m = i->a1.p;
+  if (!m || m->next || (m->code != '~') || !(a = m->a1.p) || !(b = m->a2.p) ||
+      a->next || (a->code != 'a') || (a->a2.i != SA_NET) || b->next ||
+      !f_fold(b, &v) || (v.type != T_PREFIX_SET))
+    return;
+
+  f->prog->net_trie = v.val.ti;
+  f->prog->net_match = ((struct f_inst *) i->a2.p)->a2.i;
+  f->prog->net_nomatch = i->next->a2.i;
+}
+
+/*
+ * Filter hashes
+ *
+ * Each filter gets a structural hash of its instruction tree when it is
+ * compiled. Filters with different hashes are surely different, so most changed
+ * filters are told apart by filter_same() without the deep comparison. The hash
+ * does not cover contents of sets and bodies of called functions, to keep it
+ * linear, therefore equal hashes are confirmed by i_same(). A positive result is
+ * remembered in the new filter, as a filter shared by many protocols is
+ * compared with the same old one for each of them. The memo is invalidated by
+ * f_cache_flush(), which is called before configs are freed.
+ */
+
+static uint f_same_epoch = 1;
+
+static inline u64
+f_hash_mix(u64 h, u64 v)
+{
+  h = (h ^ v) * 0x100000001b3ULL;
+  return h ^ (h >> 29);
+}
+
+static u64
+f_hash_str(u64 h, const char *s)
+{
+  while (*s)
+    h = f_hash_mix(h, (byte) *s++);
+  return f_hash_mix(h, 0);
+}
+
+/* Like i_same(), it has to know which arguments are instructions */
+static u64
+i_hash(u64 h, struct f_inst *i)
+{
+  for (; i; i = i->next)
+  {
+    h = f_hash_mix(h, ((u64) i->code << 16) | i->aux);
+
+    switch (i->code)
+    {
+    case ',': case '+': case '-': case '*': case '/': case '|': case '&':
+    case P('m','p'): case P('m','c'): case P('!','='): case P('=','='):
+    case '<': case P('<','='): case '~': case '?':
+    case P('i','M'): case P('A','p'): case P('C','a'):
+      h = i_hash(h, i->a1.p);
+      h = i_hash(h, i->a2.p);
+      break;
+
+    case '!': case P('d','e'): case 'p': case 'L': case 'r': case P('c','p'):
+    case P('a','f'): case P('a','l'): case P('S','W'): case P('c','a'):
+      h = i_hash(h, i->a1.p);
+      break;
+
+    case 's':
+      h = f_hash_str(h, ((struct symbol *) i->a1.p)->name);
+      h = i_hash(h, i->a2.p);
+      break;
+
+    case 'c':
+      if (i->aux == T_STRING)
+	h = f_hash_str(h, i->a2.p);
+      else if ((i->aux != T_SET) && (i->aux != T_PREFIX_SET))
+	h = f_hash_mix(h, (u32) i->a2.i);
+      break;
+
+    case 'C':
+      h = f_hash_mix(h, ((struct f_val *) i->a1.p)->type);
+      break;
+
+    case 'V':
+      h = f_hash_str(h, i->a2.p);
+      break;
+
+    case P('p',','): case P('P','S'): case P('a','S'): case P('e','S'):
+      h = i_hash(h, i->a1.p);
+      /* fall through */
+    case 'P': case 'a': case P('e','a'):
+      h = f_hash_mix(h, (u32) i->a2.i);
+      break;
+
+    case P('R','C'):
+      h = i_hash(h, i->a1.p);
+      h = i_hash(h, i->a2.p);
+      h = f_hash_str(h, ((struct f_inst_roa_check *) i)->rtc->name);
+      break;
+    }
+  }
+
+  return f_hash_mix(h, 0);
+}
+
+void
+f_compile(struct filter *f)
+{
+  struct f_call *calls = NULL;
+  struct f_scan s = {};
+
+  f->prog = cfg_allocz(sizeof(struct f_prog));
+  f_compile_prog(f->prog, f->root, &calls);
+
+  if (f_scan_chain(&s, f->root))
+  {
+    f->prog->cacheable = 1;
+    f->prog->attr_count = s.count;
+    f->prog->attrs = cfg_alloc(s.count * sizeof(u16));
+    memcpy(f->prog->attrs, s.attrs, s.count * sizeof(u16));
+  }
+
+  xfree(s.attrs);
+  f_compile_net_test(f);
+  f->hash = i_hash(0xcbf29ce484222325ULL, f->root);
+}
+
+#undef ARG
+#undef ONEARG
+#undef TWOARGS
+#define ARG(x,y) \
+	if (!i_same(f1->y, f2->y)) \
+		return 0;
+
+#define ONEARG ARG(v1, a1.p)
+#define TWOARGS ARG(v1, a1.p) \
+		ARG(v2, a2.p)
+
+#define A2_SAME if (f1->a2.i != f2->a2.i) return 0;
+
+/*
+ * i_same - function that does real comparing of instruction trees, you should call filter_same from outside
+ */
+int
+i_same(struct f_inst *f1, struct f_inst *f2)
+{
+  if ((!!f1) != (!!f2))
+    return 0;
+  if (!f1)
+    return 1;
+  if (f1->aux != f2->aux)
+    return 0;
+  if (f1->code != f2->code)
+    return 0;
+  if (f1 == f2)		/* It looks strange, but it is possible with call rewriting trickery */
+    return 1;
+
+  switch(f1->code) {
+  case ',': /* fall through */
+  case '+':
+  case '-':
+  case '*':
+  case '/':
+  case '|':
+  case '&':
+  case P('m','p'):
+  case P('m','c'):
+  case P('!','='):
+  case P('=','='):
+  case '<':
+  case P('<','='): TWOARGS; break;
+
+  case '!': ONEARG; break;
+  case '~': TWOARGS; break;
+  case P('d','e'): ONEARG; break;
+
+  case 's':
+    ARG(v2, a2.p);
+    {
+      struct symbol *s1, *s2;
+      s1 = f1->a1.p;
+      s2 = f2->a1.p;
+      if (strcmp(s1->name, s2->name))
+	return 0;
+      if (s1->class != s2->class)
+	return 0;
+    }
+    break;
+
+  case 'c':
+    switch (f1->aux) {
+
+    case T_PREFIX_SET:
+      if (!trie_same(f1->a2.p, f2->a2.p))
+	return 0;
+      break;
+
+    case T_SET:
+      if (!same_tree(f1->a2.p, f2->a2.p))
+	return 0;
+      break;
+
+    case T_STRING:
+      if (strcmp(f1->a2.p, f2->a2.p))
+	return 0;
+      break;
+
+    default:
+      A2_SAME;
+    }
+    break;
+
+  case 'C':
+    if (!val_same(* (struct f_val *) f1->a1.p, * (struct f_val *) f2->a1.p))
+      return 0;
+    break;
+
+  case 'V':
+    if (strcmp((char *) f1->a2.p, (char *) f2->a2.p))
+      return 0;
+    break;
+  case 'p': case 'L': ONEARG; break;
+  case '?': TWOARGS; break;
+  case '0': case 'E': break;
+  case P('p',','): ONEARG; A2_SAME; break;
+  case 'P':
+  case 'a': A2_SAME; break;
+  case P('e','a'): A2_SAME; break;
+  case P('P','S'):
+  case P('a','S'):
+  case P('e','S'): ONEARG; A2_SAME; break;
+
+  case 'r': ONEARG; break;
+  case P('c','p'): ONEARG; break;
+  case P('c','a'): /* Call rewriting trickery to avoid exponential behaviour */
+             ONEARG;
+	     if (!i_same(f1->a2.p, f2->a2.p))
+	       return 0;
+	     f2->a2.p = f1->a2.p;
+	     break;
+  case P('c','v'): break; /* internal instruction */
+  case P('S','W'): ONEARG; if (!same_tree(f1->a2.p, f2->a2.p)) return 0; break;
+  case P('i','M'): TWOARGS; break;
+  case P('A','p'): TWOARGS; break;
+  case P('C','a'): TWOARGS; break;
+  case P('a','f'):
+  case P('a','l'): ONEARG; break;
+  case P('R','C'):
+    TWOARGS;
+    /* Does not really make sense - ROA check resuls may change anyway */
+    if (strcmp(((struct f_inst_roa_check *) f1)->rtc->name,
+	       ((struct f_inst_roa_check *) f2)->rtc->name))
+      return 0;
+    break;
+  default:
+    bug( "Unknown instruction %d in same (%c)", f1->code, f1->code & 0xff);
+  }
+  return i_same(f1->next, f2->next);
+}
+
+/*
+ * Filter profiling
+ *
+ * When enabled by f_profile_set(), each run of a filter is timed and counted
+ * together with its result in the &f_stats of the filter, and each executed
+ * instruction is counted at its config line. Profiled filters are executed by
+ * the tree interpreter, where line counting is done, instead of bytecode.
+ * With profiling disabled, the cost is a test of &f_profile in f_run() and
+ * interpret(). Line counts belong to the current config and they are dropped
+ * when it changes.
+ */
+
+int f_profile;
+
+static u64 *f_line_hits;
+static uint f_line_size;
+static struct config *f_line_config;
+
+static void
+f_count_line(uint line)
+{
+  if (line >= f_line_size)
+  {
+    uint size = MAX(2 * f_line_size, line + 64);
+    f_line_hits = xrealloc(f_line_hits, size * sizeof(u64));
+    memset(f_line_hits + f_line_size, 0, (size - f_line_size) * sizeof(u64));
+    f_line_size = size;
+  }
+
+  f_line_hits[line]++;
+}
+
+static struct f_val
+f_run_profiled(struct filter *filter)
+{
+  if (f_line_config != config)
+  {
+    if (f_line_hits)
+      memset(f_line_hits, 0, f_line_size * sizeof(u64));
+    f_line_config = config;
+  }
+
+  u64 t0 = precise_time_ns();
+  struct f_val res = interpret(filter->root);
+  struct f_stats *st = &filter->stats;
+
+  st->time += precise_time_ns() - t0;
+  st->runs++;
+
+  if ((res.type == T_RETURN) && (res.val.i == F_ACCEPT))
+    st->accepts++;
+  else if ((res.type == T_RETURN) && (res.val.i == F_REJECT))
+    st->rejects++;
+  else
+    st->errors++;
+
+  return res;
+}
+
+/**
+ * f_profile_set - enable or disable filter profiling
+ * @on: new state
+ *
+ * Profiling counts runs and their results and measures time spent in each
+ * filter, and counts executed instructions per config line. The statistics
+ * are kept when profiling is disabled, see f_stats_reset().
+ */
+void
+f_profile_set(int on)
+{
+  f_profile = on;
+}
+
+static void
+f_stats_reset_filter(struct filter *f)
+{
+  if ((f != FILTER_ACCEPT) && (f != FILTER_REJECT))
+    memset(&f->stats, 0, sizeof(struct f_stats));
+}
+
+/**
+ * f_stats_reset - reset filter profiling statistics
+ *
+ * This function clears statistics of all filters of the current config, that
+ * is named filters and filters attached to protocols, and line counts.
+ */
+void
+f_stats_reset(void)
+{
+  struct proto_config *pc;
+  struct symbol *sym = NULL;
+  int pos = 0;
+
+  while (sym = cf_walk_symbols(config, sym, &pos))
+    if (sym->class == SYM_FILTER)
+      f_stats_reset_filter(sym->def);
+
+  WALK_LIST(pc, config->protos)
+  {
+    f_stats_reset_filter(pc->in_filter);
+    f_stats_reset_filter(pc->out_filter);
+  }
+
+  if (f_line_hits)
+    memset(f_line_hits, 0, f_line_size * sizeof(u64));
+}
+
+static void
+f_stats_show_filter(struct filter *f, const char *name, const char *dir)
+{
+  struct f_stats *st = &f->stats;
+
+  if ((f == FILTER_ACCEPT) || (f == FILTER_REJECT) || (dir && f->name))
+    return;
+
+  cli_msg(-1023, "%-16s %-6s %10lu %10lu %10lu %8lu %10lu %8lu",
+	  name, dir ? dir : "", (unsigned long) st->runs, (unsigned long) st->accepts, (unsigned long) st->rejects,
+	  (unsigned long) st->errors, (unsigned long) (st->time / 1000), (unsigned long) (st->runs ? st->time / st->runs : 0));
+}
+
+/**
+ * f_stats_show - show filter profiling statistics
+ * @sym: filter to show or NULL for all
+ *
+ * This function prints statistics of named filters and of anonymous filters
+ * attached to protocols (by protocol name and direction), followed by
+ * instruction counts of config lines.
+ */
+void
+f_stats_show(struct symbol *sym)
+{
+  struct proto_config *pc;
+  uint i;
+
+  if (sym && (sym->class != SYM_FILTER))
+  {
+    cli_msg(9002, "%s is not a filter", sym->name);
+    return;
+  }
+
+  cli_msg(-1023, "Filter profiling is %s", f_profile ? "enabled" : "disabled");
+  cli_msg(-1023, "%-23s %10s %10s %10s %8s %10s %8s",
+	  "Filter", "Runs", "Accepted", "Rejected", "Errors", "Time [us]", "Avg [ns]");
+
+  if (sym)
+  {
+    f_stats_show_filter(sym->def, sym->name, NULL);
+    cli_msg(0, "");
+    return;
+  }
+
+  int pos = 0;
+  while (sym = cf_walk_symbols(config, sym, &pos))
+    if (sym->class == SYM_FILTER)
+      f_stats_show_filter(sym->def, sym->name, NULL);
+
+  WALK_LIST(pc, config->protos)
+  {
+    f_stats_show_filter(pc->in_filter, pc->name, "import");
+    f_stats_show_filter(pc->out_filter, pc->name, "export");
+  }
+
+  if (f_line_config == config)
+  {
+    cli_msg(-1023, "");
+    cli_msg(-1023, "%-8s %12s", "Line", "Executed");
+    for (i = 0; i < f_line_size; i++)
+      if (f_line_hits[i])
+	cli_msg(-1023, "%-8u %12lu", i, (unsigned long) f_line_hits[i]);
+  }
+
+  cli_msg(0, "");
+}
 
+/**
+ * f_run - run a filter for a route
+ * @filter: filter to run
+ * @rte: route being filtered, may be modified
+ * @tmp_attrs: temporary attributes, prepared by caller or generated by f_run()
+ * @tmp_pool: all filter allocations go from this pool
+ * @flags: flags
+ *
+ * If filter needs to modify the route, there are several
+ * posibilities. @rte might be read-only (with REF_COW flag), in that
+ * case rw copy is obtained by rte_cow() and @rte is replaced. If
+ * @rte is originally rw, it may be directly modified (and it is never
+ * copied).
+ *
+ * The returned rte may reuse the (possibly cached, cloned) rta, or
+ * (if rta was modificied) contains a modified uncached rta, which
+ * uses parts allocated from @tmp_pool and parts shared from original
+ * rta. There is one exception - if @rte is rw but contains a cached
+ * rta and that is modified, rta in returned rte is also cached.
+ *
+ * Ownership of cached rtas is consistent with rte, i.e.
+ * if a new rte is returned, it has its own clone of cached rta
+ * (and cached rta of read-only source rte is intact), if rte is
+ * modified in place, old cached rta is possibly freed.
+ */
+/* One run of f_run() or f_run_batch(), f_pool and f_flags are already set */
+static int
+f_run_one(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs)
+{
   int rte_cow = ((*rte)->flags & REF_COW);
   DBG( "Running filter `%s'...", filter->name );
+  PROBE1(filter_entry, filter->name);
 
   f_rte = rte;
   f_old_rta = NULL;
+  f_mods = NULL;
   f_tmp_attrs = tmp_attrs;
-  f_pool = tmp_pool;
-  f_flags = flags;
 
   LOG_BUFFER_INIT(f_buf);
 
-  struct f_val res = interpret(filter->root);
+  struct f_val res;
+  if (!f_profile)
+    res = filter->prog ? f_vm_exec(filter->prog) : interpret(filter->root);
+  else
+    res = f_run_profiled(filter);
 
   if (f_old_rta) {
     /*
@@ -1533,15 +2694,418 @@ f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struc
 
   if (res.type != T_RETURN) {
     log_rl(&rl_runtime_err, L_ERR "Filter %s did not return accept nor reject. Make up your mind", filter->name);
+    PROBE2(filter_return, filter->name, F_ERROR);
     return F_ERROR;
   }
   DBG( "done (%u)\n", res.val.i );
+  PROBE2(filter_return, filter->name, res.val.i);
   return res.val.i;
 }
 
+int
+f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, int flags)
+{
+  if (filter == FILTER_ACCEPT)
+    return F_ACCEPT;
+
+  if (filter == FILTER_REJECT)
+    return F_REJECT;
+
+  f_pool = tmp_pool;
+  f_flags = flags;
+
+  return f_run_one(filter, rte, tmp_attrs);
+}
+
+/**
+ * f_run_batch - run a filter for a vector of routes
+ * @filter: filter to run
+ * @rtes: array of routes, each one may be modified and replaced like by f_run()
+ * @tmp_attrs: array of temporary attribute lists of the routes
+ * @res: array for results
+ * @count: number of routes
+ * @tmp_pool: all filter allocations go from this pool
+ * @flags: flags
+ *
+ * This function is equivalent to calling f_run() for each route, but the
+ * common setup is done once. A filter which just tests whether the net of the
+ * route is in a prefix set (like 'where net ~ [...]') is not executed at all,
+ * its test is evaluated for all the routes in one simple loop.
+ */
+void
+f_run_batch(struct filter *filter, struct rte **rtes, struct ea_list **tmp_attrs, int *res, uint count, struct linpool *tmp_pool, int flags)
+{
+  uint i;
+
+  if ((filter == FILTER_ACCEPT) || (filter == FILTER_REJECT))
+  {
+    for (i = 0; i < count; i++)
+      res[i] = (filter == FILTER_ACCEPT) ? F_ACCEPT : F_REJECT;
+    return;
+  }
+
+  struct f_prog *prog = filter->prog;
+  if (!f_profile && prog && prog->net_trie)
+  {
+    for (i = 0; i < count; i++)
+    {
+      net *n = rtes[i]->net;
+
+      if (i + 4 < count)
+	__builtin_prefetch(rtes[i + 4]->net);
+
+      res[i] = trie_match_prefix(prog->net_trie, n->n.prefix, n->n.pxlen) ?
+	prog->net_match : prog->net_nomatch;
+    }
+    return;
+  }
+
+  f_pool = tmp_pool;
+  f_flags = flags;
+
+  for (i = 0; i < count; i++)
+    res[i] = f_run_one(filter, &rtes[i], &tmp_attrs[i]);
+}
+
+/*
+ * Memoization of filter results
+ *
+ * Export filters run for each route and announce hook, although many routes
+ * share one cached rta. When a filter reads nothing but the rta (see
+ * f_scan_inst()), its result and temporary attributes it has set are kept per
+ * (filter, rta) in a bounded LRU cache. Entries lock their rtas. The cache is
+ * flushed on reconfiguration, when old filters may be freed, and when a
+ * protocol goes down, as locked rtas would keep its sources and hostentries.
+ */
+
+#define FC_ORDER		12
+#define FC_MAX			(1 << FC_ORDER)
+
+struct f_cache_entry {
+  struct f_cache_entry *next;		/* Next in hash chain */
+  node n;				/* Node in f_cache_lru */
+  struct filter *filter;
+  rta *rta;				/* Locked */
+  ea_list *attrs;			/* Copy of set temporary attributes */
+  int result;
+};
+
+#define FC_KEY(n)		n->filter, n->rta
+#define FC_NEXT(n)		n->next
+#define FC_EQ(f1,r1,f2,r2)	f1 == f2 && r1 == r2
+#define FC_FN(f,r)		u32_hash(r->hash_key ^ (u32) ((uintptr_t) (f) >> 4))
+
+static pool *f_cache_pool;
+static slab *f_cache_slab;
+static HASH(struct f_cache_entry) f_cache_hash;
+static list f_cache_lru;		/* Least recently used first */
+static uint f_cache_count;
+
+/* Copy ea_lists from @l up to @end, including data, and append @next to them */
+static ea_list *
+f_cache_copy_attrs(ea_list *l, ea_list *end, ea_list *next, linpool *lp)
+{
+  ea_list *x, *first = next, **last = &first;
+  uint size = 0;
+  int i;
+
+  for (x = l; x != end; x = x->next)
+  {
+    size += BIRD_ALIGN(sizeof(ea_list) + x->count * sizeof(eattr), CPU_STRUCT_ALIGN);
+    for (i = 0; i < x->count; i++)
+      if (!(x->attrs[i].type & EAF_EMBEDDED))
+	size += BIRD_ALIGN(sizeof(struct adata) + x->attrs[i].u.ptr->length, CPU_STRUCT_ALIGN);
+  }
+
+  if (!size)
+    return next;
+
+  byte *pos = lp ? lp_alloc(lp, size) : mb_alloc(f_cache_pool, size);
+
+  for (x = l; x != end; x = x->next)
+  {
+    uint len = sizeof(ea_list) + x->count * sizeof(eattr);
+    ea_list *y = (ea_list *) pos;
+
+    memcpy(y, x, len);
+    pos += BIRD_ALIGN(len, CPU_STRUCT_ALIGN);
+
+    for (i = 0; i < x->count; i++)
+      if (!(x->attrs[i].type & EAF_EMBEDDED))
+      {
+	len = sizeof(struct adata) + x->attrs[i].u.ptr->length;
+	memcpy(pos, x->attrs[i].u.ptr, len);
+	y->attrs[i].u.ptr = (struct adata *) pos;
+	pos += BIRD_ALIGN(len, CPU_STRUCT_ALIGN);
+      }
+
+    *last = y;
+    last = &y->next;
+  }
+
+  *last = next;
+  return first;
+}
+
+static void
+f_cache_remove(struct f_cache_entry *e)
+{
+  HASH_REMOVE(f_cache_hash, FC, e);
+  rem_node(&e->n);
+  rta_free(e->rta);
+  mb_free(e->attrs);
+  sl_free(f_cache_slab, e);
+  f_cache_count--;
+}
+
+/**
+ * f_cache_flush - flush cached filter results
+ *
+ * This function drops all results memoized by f_run_cached(). It is called
+ * when filters or protocols are going away.
+ */
+void
+f_cache_flush(void)
+{
+  node *n, *nn;
+
+  /* Results of filter_same() are cached too */
+  f_same_epoch++;
+
+  if (!f_cache_pool)
+    return;
+
+  WALK_LIST_DELSAFE(n, nn, f_cache_lru)
+    f_cache_remove(SKIP_BACK(struct f_cache_entry, n, n));
+}
+
+/**
+ * f_run_cached - run a filter for a route, with memoization
+ * @filter: filter to run
+ * @rte: route being filtered
+ * @tmp_attrs: temporary attributes, prepared by caller
+ * @tmp_pool: all filter allocations go from this pool
+ * @flags: flags
+ *
+ * This function is equivalent to f_run(), but for filters depending only on
+ * the rta of @rte, it returns the remembered result of a previous run with
+ * the same rta and prepends the same temporary attributes to @tmp_attrs. It is
+ * applicable only with %FF_FORCE_TMPATTR, when such filters do not modify the
+ * route itself.
+ */
+int
+f_run_cached(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, int flags)
+{
+  struct f_prog *prog = filter->prog;
+  struct f_cache_entry *e;
+  rta *a = (*rte)->attrs;
+  uint i;
+
+  if (!prog || !prog->cacheable || !(flags & FF_FORCE_TMPATTR) || !rta_is_cached(a))
+    return f_run(filter, rte, tmp_attrs, tmp_pool, flags);
+
+  /* Attributes in temporary ones of the route would be read instead of rta */
+  for (i = 0; i < prog->attr_count; i++)
+    if (ea_find(*tmp_attrs, prog->attrs[i]))
+      return f_run(filter, rte, tmp_attrs, tmp_pool, flags);
+
+  if (!f_cache_pool)
+  {
+    f_cache_pool = rp_new(&root_pool, "Filter cache");
+    f_cache_slab = sl_new(f_cache_pool, sizeof(struct f_cache_entry));
+    HASH_INIT(f_cache_hash, f_cache_pool, FC_ORDER);
+    init_list(&f_cache_lru);
+  }
+
+  e = HASH_FIND(f_cache_hash, FC, filter, a);
+  if (e)
+  {
+    rem_node(&e->n);
+    add_tail(&f_cache_lru, &e->n);
+    *tmp_attrs = f_cache_copy_attrs(e->attrs, NULL, *tmp_attrs, tmp_pool);
+    return e->result;
+  }
+
+  ea_list *old = *tmp_attrs;
+  int res = f_run(filter, rte, tmp_attrs, tmp_pool, flags);
+
+  /* Errors are not cached, so that they are logged */
+  if ((res != F_ACCEPT) && (res != F_REJECT))
+    return res;
+
+  if (f_cache_count >= FC_MAX)
+    f_cache_remove(SKIP_BACK(struct f_cache_entry, n, HEAD(f_cache_lru)));
+
+  e = sl_alloc(f_cache_slab);
+  e->filter = filter;
+  e->rta = rta_clone(a);
+  e->attrs = f_cache_copy_attrs(*tmp_attrs, old, NULL, NULL);
+  e->result = res;
+
+  HASH_INSERT(f_cache_hash, FC, e);
+  add_tail(&f_cache_lru, &e->n);
+  f_cache_count++;
+
+  return res;
+}
+
+/* Role returned by a single 'prefix_role' or 'return' of a constant */
+static int
+rm_const_role(struct f_inst *i, int *role)
+{
+  if (!i || i->next || (i->code != 'r'))
+    return 0;
+
+  i = i->a1.p;
+  if ((i->code != 'c') || (i->aux != T_ROLE))
+    return 0;
+
+  *role = i->a2.i;
+  return 1;
+}
+
+/* Trie for 'net_prefix ~ <prefix or prefix set>' condition */
+static struct f_trie *
+rm_cond_trie(struct f_inst *i, struct f_trie *t)
+{
+  struct f_inst *a, *b;
+  struct f_val *v;
+
+  if (i->code != '~')
+    return NULL;
+
+  a = i->a1.p;
+  b = i->a2.p;
+  if (a->code != P('n','p'))
+    return NULL;
+
+  if ((b->code == 'c') && (b->aux == T_PREFIX_SET))
+    return t ? NULL : b->a2.p;
+
+  if (b->code != 'C')
+    return NULL;
+
+  v = b->a1.p;
+  if (v->type != T_PREFIX)
+    return NULL;
+
+  /* Prefix contains net if net is its subnet */
+  if (!t)
+    t = f_new_trie(cfg_mem, sizeof(struct f_trie_node));
+  trie_add_prefix(t, v->val.px.ip, v->val.px.len, v->val.px.len, MAX_PREFIX_LENGTH);
+  return t;
+}
+
+/**
+ * rm_compile - compile role map into a lookup table
+ * @role_map: role map to compile
+ *
+ * Role maps usually consist of a sequence of conditions testing the net
+ * prefix against a constant prefix or prefix set, each followed by a
+ * constant role. Such role maps are converted into a list of tries checked
+ * in order, so rm_run() does not need to invoke the filter interpreter.
+ * Consecutive single prefixes with the same role are merged into one trie.
+ * Role maps with any other statements are left to the interpreter.
+ */
+void
+rm_compile(struct role_map *rm)
+{
+  struct f_inst *i = rm->root->a2.p;
+  struct f_inst *cond, *j;
+  struct rm_rule *rules;
+  uint n = 0, max = 0;
+  int role, last = -1;
+  struct f_trie *t;
+
+  rm->rules = NULL;
+  rm->rule_count = 0;
+  rm->cache = NULL;
+
+  for (j = i; j; j = j->next)
+    max++;
+  rules = cfg_allocz(max * sizeof(struct rm_rule));
+
+  /* Clearing of local variables has no effect on constant rules */
+  if (i->code == P('c','v'))
+    i = i->next;
+
+  for (; i; i = i->next)
+    {
+      /* Unconditional role ends the role map, the default one is appended */
+      if (rm_const_role(i, &role))
+	break;
+
+      if ((i->code == 'c') && (i->aux == T_ROLE))
+	{
+	  role = i->a2.i;
+	  break;
+	}
+
+      if ((i->code != '?') || !rm_const_role(i->a2.p, &role))
+	return;
+
+      cond = i->a1.p;
+      if (cond->code != '~')
+	return;
+
+      /* Consecutive plain prefixes with the same role share one trie */
+      int plain = ((struct f_inst *) cond->a2.p)->code == 'C';
+      int merge = plain && (role == last);
+
+      if (!(t = rm_cond_trie(cond, merge ? rules[n-1].trie : NULL)))
+	return;
+
+      if (!merge)
+	{
+	  rules[n].trie = t;
+	  rules[n].role = role;
+	  n++;
+	}
+
+      last = plain ? role : -1;
+    }
+
+  if (!i)
+    return;
+
+  for (max = 0; max < n; max++)
+    if (!rules[max].trie->mroot)
+      trie_compile(rules[max].trie);
+
+  rm->rules = rules;
+  rm->rule_count = n;
+  rm->default_role = role;
+  rm->cache = cfg_allocz(RM_CACHE_SIZE * sizeof(struct rm_cache));
+}
+
+static int
+rm_lookup(struct role_map *rm, net *n)
+{
+  ip_addr px = n->n.prefix;
+  int pxlen = n->n.pxlen;
+  struct rm_cache *c = &rm->cache[(ipa_hash32(px) ^ u32_hash(pxlen)) & (RM_CACHE_SIZE - 1)];
+  uint i;
+
+  if (c->valid && (c->pxlen == pxlen) && ipa_equal(c->prefix, px))
+    return c->role;
+
+  for (i = 0; i < rm->rule_count; i++)
+    if (trie_match_prefix(rm->rules[i].trie, px, pxlen))
+      break;
+
+  c->prefix = px;
+  c->pxlen = pxlen;
+  c->role = (i < rm->rule_count) ? rm->rules[i].role : rm->default_role;
+  c->valid = 1;
+  return c->role;
+}
+
 int
 rm_run(struct role_map *role_map, net *net_entry)
 {
+  if (role_map->cache && net_entry)
+    return rm_lookup(role_map, net_entry);
+
   DBG( "Running role_map `%s'...", role_map->name );
 
   f_rte = NULL;
@@ -1573,6 +3137,7 @@ f_eval_rte(struct f_inst *expr, struct rte **rte, struct linpool *tmp_pool)
 
   f_rte = rte;
   f_old_rta = NULL;
+  f_mods = NULL;
   f_tmp_attrs = &tmp_attrs;
   f_pool = tmp_pool;
   f_flags = 0;
@@ -1639,5 +3204,133 @@ filter_same(struct filter *new, struct filter *old)
   if (old == FILTER_ACCEPT || old == FILTER_REJECT ||
       new == FILTER_ACCEPT || new == FILTER_REJECT)
     return 0;
-  return i_same(new->root, old->root);
+  if (new->hash != old->hash)
+    return 0;
+  if ((new->same_as == old) && (new->same_epoch == f_same_epoch))
+    return 1;
+  if (!i_same(new->root, old->root))
+    return 0;
+
+  new->same_as = old;
+  new->same_epoch = f_same_epoch;
+  return 1;
+}
+
+#define F_USES_ROA_DEPTH 16
+
+static int i_uses_roa(struct f_inst *i, struct roa_table *t, int depth);
+
+static int
+tree_uses_roa(struct f_tree *tr, struct roa_table *t, int depth)
+{
+  for (; tr; tr = tr->right)
+    if (i_uses_roa(tr->data, t, depth) || tree_uses_roa(tr->left, t, depth))
+      return 1;
+
+  return 0;
+}
+
+/* Like i_same(), it has to know which arguments are instructions */
+static int
+i_uses_roa(struct f_inst *i, struct roa_table *t, int depth)
+{
+  /* Too deep, probably a recursive function, be conservative */
+  if (depth > F_USES_ROA_DEPTH)
+    return 1;
+
+  for (; i; i = i->next)
+    switch (i->code)
+    {
+    case P('R','C'):
+      if (((struct f_inst_roa_check *) i)->rtc->table == t)
+	return 1;
+      /* fall through */
+
+    case ',':
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '|':
+    case '&':
+    case P('m','p'):
+    case P('m','c'):
+    case P('!','='):
+    case P('=','='):
+    case '<':
+    case P('<','='):
+    case '~':
+    case '?':
+    case P('i','M'):
+    case P('A','p'):
+    case P('C','a'):
+      if (i_uses_roa(i->a1.p, t, depth + 1) || i_uses_roa(i->a2.p, t, depth + 1))
+	return 1;
+      break;
+
+    case '!':
+    case P('d','e'):
+    case 'p':
+    case 'L':
+    case P('p',','):
+    case P('P','S'):
+    case P('a','S'):
+    case P('e','S'):
+    case 'r':
+    case P('c','p'):
+    case P('a','f'):
+    case P('a','l'):
+      if (i_uses_roa(i->a1.p, t, depth + 1))
+	return 1;
+      break;
+
+    case 's':
+      if (i_uses_roa(i->a2.p, t, depth + 1))
+	return 1;
+      break;
+
+    case P('c','a'):
+      if (i_uses_roa(i->a1.p, t, depth + 1) || i_uses_roa(i->a2.p, t, depth + 1))
+	return 1;
+      break;
+
+    case P('S','W'):
+      if (i_uses_roa(i->a1.p, t, depth + 1) || tree_uses_roa(i->a2.p, t, depth + 1))
+	return 1;
+      break;
+
+    case 'c':
+    case 'C':
+    case 'V':
+    case '0':
+    case 'E':
+    case 'P':
+    case 'a':
+    case P('e','a'):
+    case P('c','v'):
+      break;
+
+    default:
+      return 1;
+    }
+
+  return 0;
+}
+
+/**
+ * f_uses_roa - check whether a filter depends on a ROA table
+ * @f: filter
+ * @t: ROA table
+ *
+ * Returns 1 if the filter may call roa_check() on ROA table @t, so its
+ * results may change when the table changes. Unknown constructs are treated
+ * as dependent.
+ */
+int
+f_uses_roa(struct filter *f, struct roa_table *t)
+{
+  if (f == FILTER_ACCEPT || f == FILTER_REJECT)
+    return 0;
+
+  return i_uses_roa(f->root, t, 0);
 }
@@ -63,14 +63,43 @@ struct f_val {
   } val;
 };
 
+struct f_stats {
+  u64 runs;				/* Profiled runs, see f_profile */
+  u64 accepts, rejects, errors;
+  u64 time;				/* Total duration of runs in ns */
+};
+
 struct filter {
   char *name;
   struct f_inst *root;
+  struct f_prog *prog;			/* Compiled bytecode, see f_compile() */
+  struct f_stats stats;
+  u64 hash;				/* Structural hash, see filter_same() */
+  struct filter *same_as;		/* Old filter found same by filter_same() */
+  uint same_epoch;			/* When same_as was set */
 };
 
+struct rm_rule {
+  struct f_trie *trie;			/* Prefixes the rule matches */
+  int role;
+};
+
+struct rm_cache {
+  ip_addr prefix;
+  u8 pxlen;
+  u8 role;
+  u8 valid;
+};
+
+#define RM_CACHE_SIZE	256
+
 struct role_map {
   char *name;
   struct f_inst *root;
+  struct rm_rule *rules;		/* Compiled lookup table, see rm_compile() */
+  uint rule_count;
+  int default_role;
+  struct rm_cache *cache;		/* Memoized lookups, NULL if not compiled */
 };
 
 struct f_inst *f_new_inst(void);
@@ -85,11 +114,34 @@ struct f_tree *find_tree(struct f_tree *t, struct f_val val);
 int same_tree(struct f_tree *t1, struct f_tree *t2);
 void tree_format(struct f_tree *t, buffer *buf);
 
+struct f_trie_node;
 struct f_trie *f_new_trie(linpool *lp, uint node_size);
 void *trie_add_prefix(struct f_trie *t, ip_addr px, int plen, int l, int h);
+void trie_compile(struct f_trie *t);
 int trie_match_prefix(struct f_trie *t, ip_addr px, int plen);
+uint trie_find_covering(struct f_trie *t, ip_addr px, int plen, struct f_trie_node **nodes);
 int trie_same(struct f_trie *t1, struct f_trie *t2);
 void trie_format(struct f_trie *t, buffer *buf);
+void trie_walk_ranges(struct f_trie *t, void (*hook)(ip_addr px, int plen, void *data), void *data);
+
+struct prefix_set {
+  uint uc;				/* Use count */
+  linpool *lp;				/* Pool holding the set and its trie */
+  struct f_trie *trie;
+};
+
+struct prefix_set *prefix_set_new(pool *p);
+struct prefix_set *prefix_set_copy(pool *p, struct f_trie *t);
+void prefix_set_unlock(struct prefix_set *s);
+
+static inline void prefix_set_lock(struct prefix_set *s)
+{ s->uc++; }
+
+static inline void prefix_set_add(struct prefix_set *s, ip_addr px, int plen, int l, int h)
+{ trie_add_prefix(s->trie, px, plen, l, h); }
+
+static inline int prefix_set_match(struct prefix_set *s, ip_addr px, int plen)
+{ return trie_match_prefix(s->trie, px, plen); }
 
 void fprefix_get_bounds(struct f_prefix *px, int *l, int *h);
 
@@ -111,7 +163,17 @@ trie_match_fprefix(struct f_trie *t, struct f_prefix *px)
 struct ea_list;
 struct rte;
 
+void f_compile(struct filter *f);
 int f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, int flags);
+int f_run_cached(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, int flags);
+void f_run_batch(struct filter *filter, struct rte **rtes, struct ea_list **tmp_attrs, int *res, uint count, struct linpool *tmp_pool, int flags);
+void f_cache_flush(void);
+
+extern int f_profile;
+void f_profile_set(int on);
+void f_stats_reset(void);
+void f_stats_show(struct symbol *sym);
+void rm_compile(struct role_map *role_map);
 int rm_run(struct role_map *role_map, net *net_entry);
 struct f_val f_eval_rte(struct f_inst *expr, struct rte **rte, struct linpool *tmp_pool);
 struct f_val f_eval(struct f_inst *expr, struct linpool *tmp_pool);
@@ -120,6 +182,7 @@ u32 f_eval_asn(struct f_inst *expr);
 
 char *filter_name(struct filter *filter);
 int filter_same(struct filter *new, struct filter *old);
+int f_uses_roa(struct filter *f, struct roa_table *t);
 
 int i_same(struct f_inst *f1, struct f_inst *f2);
 
@@ -199,6 +262,14 @@ struct f_tree {
   struct f_tree *left, *right;
   struct f_val from, to;
   void *data;
+  struct f_tree_index *index;		/* Flat form, in root only, see build_tree() */
+};
+
+struct f_tree_index {
+  int type;				/* Type of all values */
+  uint count;
+  u64 *from, *to;			/* Sorted disjoint intervals */
+  struct f_tree **nodes;		/* Tree nodes of intervals */
 };
 
 struct f_trie_node
@@ -208,11 +279,20 @@ struct f_trie_node
   struct f_trie_node *c[2];
 };
 
+struct f_trie_mnode			/* Multibit node, see trie_compile() */
+{
+  struct f_trie_mnode *child;		/* Array of present children */
+  ip_addr tail;				/* Accept mask for longer prefixes under absent children */
+  u16 child_map;			/* Bitmap of present children */
+  u16 local;				/* Accept bits of prefixes ending in the node */
+};
+
 struct f_trie
 {
   linpool *lp;
   int zero;
   uint node_size;
+  struct f_trie_mnode *mroot;		/* Read-optimized form, NULL if not compiled */
   struct f_trie_node root[0];		/* Root trie node follows */
 };
 
@@ -11,6 +11,52 @@
 #include "conf/conf.h"
 #include "filter/filter.h"
 
+/* Integer key of a value of integral type, ordered like val_compare() */
+static inline int
+tree_index_key(struct f_val v, u64 *key)
+{
+  switch (v.type)
+  {
+  case T_INT:
+  case T_BOOL:
+  case T_PAIR:
+  case T_QUAD:
+  case T_ROLE:
+    *key = v.val.i;
+    return 1;
+
+  case T_EC:
+    *key = v.val.ec;
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+static struct f_tree *
+find_tree_index(struct f_tree_index *idx, struct f_val val)
+{
+  const u64 *base = idx->from;
+  uint n = idx->count;
+  u64 key;
+
+  /* Does not fail, as find_tree() checks the type */
+  if (!tree_index_key(val, &key))
+    return NULL;
+
+  /* Branchless search for the last interval starting at or below key */
+  while (n > 1)
+  {
+    uint half = n / 2;
+    base = (base[half] <= key) ? base + half : base;
+    n -= half;
+  }
+
+  uint i = base - idx->from;
+  return ((idx->from[i] <= key) && (key <= idx->to[i])) ? idx->nodes[i] : NULL;
+}
+
 /**
  * find_tree
  * @t: tree to search in
@@ -21,13 +67,16 @@
  * either single value (then t->from==t->to) or range is present.
  *
  * Both set matching and |switch() { }| construction is implemented using this function,
- * thus both are as fast as they can be.
+ * thus both are as fast as they can be. Large sets of integral values are searched in
+ * their flat form (see build_tree_index()), when @val has the same type.
  */
 struct f_tree *
 find_tree(struct f_tree *t, struct f_val val)
 {
   if (!t)
     return NULL;
+  if (t->index && (t->index->type == val.type))
+    return find_tree_index(t->index, val);
   if ((val_compare(t->from, val) != 1) &&
       (val_compare(t->to, val) != -1))
     return t;
@@ -59,6 +108,52 @@ tree_compare(const void *p1, const void *p2)
   return val_compare((* (struct f_tree **) p1)->from, (* (struct f_tree **) p2)->from);
 }
 
+/*
+ * Large sets of integral values (ints, pairs, quads, ECs) are searched in
+ * sorted arrays of intervals instead of the tree, which is still used for
+ * other types and for sets with overlapping ranges, where the result of tree
+ * search depends on its shape.
+ */
+#define TREE_INDEX_MIN 16
+
+static struct f_tree_index *
+build_tree_index(struct f_tree **buf, int len)
+{
+  struct f_tree_index *idx;
+  int type = buf[0]->from.type;
+  u64 from, to, last = 0;
+  int i;
+
+  if (len < TREE_INDEX_MIN)
+    return NULL;
+
+  for (i = 0; i < len; i++)
+  {
+    if ((buf[i]->from.type != type) || (buf[i]->to.type != type) ||
+	!tree_index_key(buf[i]->from, &from) || !tree_index_key(buf[i]->to, &to) ||
+	(from > to) || (i && (from <= last)))
+      return NULL;
+
+    last = to;
+  }
+
+  idx = cfg_alloc(sizeof(struct f_tree_index));
+  idx->type = type;
+  idx->count = len;
+  idx->from = cfg_alloc(len * sizeof(u64));
+  idx->to = cfg_alloc(len * sizeof(u64));
+  idx->nodes = cfg_alloc(len * sizeof(struct f_tree *));
+
+  for (i = 0; i < len; i++)
+  {
+    tree_index_key(buf[i]->from, &idx->from[i]);
+    tree_index_key(buf[i]->to, &idx->to[i]);
+    idx->nodes[i] = buf[i];
+  }
+
+  return idx;
+}
+
 /**
  * build_tree
  * @from: degenerated tree (linked by @tree->left) to be transformed into form suitable for find_tree()
@@ -92,6 +187,7 @@ build_tree(struct f_tree *from)
   qsort(buf, len, sizeof(struct f_tree *), tree_compare);
 
   root = build_tree_rec(buf, 0, len);
+  root->index = build_tree_index(buf, len);
 
   if (len > 1024)
     free(buf);
@@ -108,6 +204,7 @@ f_new_tree(void)
   ret->from.type = ret->to.type = T_VOID;
   ret->from.val.i = ret->to.val.i = 0;
   ret->data = NULL;
+  ret->index = NULL;
   return ret;
 }
 
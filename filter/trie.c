@@ -67,9 +67,20 @@
  *
  * The walking code in trie_match_prefix() is structured according to
  * these cases.
+ *
+ * Tries of prefix sets from the configuration do not change once they are
+ * built, so trie_compile() converts them to a read-optimized multibit trie
+ * with stride %TRIE_STRIDE. Each multibit node covers %TRIE_STRIDE levels of
+ * the binary trie. Its &local bitmap tells for each of the 15 prefixes that
+ * end inside the node whether they match the set. Its present children are
+ * stored in one array, indexed by popcount of lower bits of &child_map. For
+ * longer prefixes under an absent child, the result depends only on the
+ * prefix length, given by the &tail mask. These are the accept masks M1 of
+ * nodes on the path, as there are no more nodes below.
  */
 
 #include "nest/bird.h"
+#include "lib/bitops.h"
 #include "lib/string.h"
 #include "conf/conf.h"
 #include "filter/filter.h"
@@ -126,6 +137,9 @@ attach_node(struct f_trie_node *parent, struct f_trie_node *child)
 void *
 trie_add_prefix(struct f_trie *t, ip_addr px, int plen, int l, int h)
 {
+  /* The multibit form is no longer valid */
+  t->mroot = NULL;
+
   if (l == 0)
     t->zero = 1;
   else
@@ -196,6 +210,188 @@ trie_add_prefix(struct f_trie *t, ip_addr px, int plen, int l, int h)
   return a;
 }
 
+#define TRIE_STRIDE	4
+#define TRIE_FANOUT	(1 << TRIE_STRIDE)
+
+/* Get @n bits of @a from bit @pos, not crossing 32-bit boundary */
+static inline uint
+trie_getbits(ip_addr a, uint pos, uint n)
+{
+  if (!n)
+    return 0;
+
+#ifdef IPV6
+  u32 w = a.addr[pos / 32];
+#else
+  u32 w = _I(a);
+#endif
+
+  return (w >> (32 - (pos % 32) - n)) & ((1u << n) - 1);
+}
+
+/* Set @n bits of @a from bit @pos to @v, not crossing 32-bit boundary */
+static inline ip_addr
+trie_setbits(ip_addr a, uint pos, uint n, uint v)
+{
+  if (!n)
+    return a;
+
+  uint shift = 32 - (pos % 32) - n;
+  u32 mask = ((1u << n) - 1) << shift;
+
+#ifdef IPV6
+  a.addr[pos / 32] = (a.addr[pos / 32] & ~mask) | (v << shift);
+#else
+  a = _MI4((_I(a) & ~mask) | (v << shift));
+#endif
+
+  return a;
+}
+
+/*
+ * Walk the binary trie from node @n along address @a to depth @d, adding M1
+ * parts of accept masks of passed nodes to @acc. Returns the first node of
+ * depth at least @d on the path, or NULL.
+ */
+static struct f_trie_node *
+trie_walk(struct f_trie_node *n, ip_addr a, int d, ip_addr *acc)
+{
+  while (n && (n->plen < d))
+  {
+    if (ipa_compare(ipa_and(a, n->mask), n->addr))
+      return NULL;
+
+    *acc = ipa_or(*acc, ipa_and(n->accept, ipa_not(n->mask)));
+    n = n->c[ipa_getbit(a, n->plen) ? 1 : 0];
+  }
+
+  if (n && ipa_compare(ipa_and(a, ipa_mkmask(d)), ipa_and(n->addr, ipa_mkmask(d))))
+    return NULL;
+
+  return n;
+}
+
+/*
+ * Fill multibit node @m for prefix @path/@base. Node @n is the first binary
+ * node of depth at least @base on the path, @acc are accumulated M1 masks of
+ * binary nodes above it.
+ */
+static void
+trie_compile_node(struct f_trie *t, struct f_trie_mnode *m, struct f_trie_node *n,
+		  ip_addr path, int base, ip_addr acc)
+{
+  struct f_trie_node *cn[TRIE_FANOUT];
+  ip_addr cacc[TRIE_FANOUT], p, a;
+  uint r, s, i;
+
+  m->tail = acc;
+
+  /*
+   * Without binary nodes in the range of the node, results outside of the path
+   * to the next binary node depend only on prefix length. That is the usual
+   * case in deeper parts of the trie.
+   */
+  if (!n || (n->plen >= base + TRIE_STRIDE))
+  {
+    for (r = 0; (r < TRIE_STRIDE) && (base + r <= MAX_PREFIX_LENGTH); r++)
+    {
+      int d = base + r;
+      if (!d)
+	continue;
+
+      if (ipa_getbit(acc, d - 1))
+	m->local |= ((1 << (1 << r)) - 1) << (1 << r);
+      else if (n && ipa_getbit(n->accept, d - 1))
+	m->local |= 1 << ((1 << r) | trie_getbits(n->addr, base, r));
+    }
+
+    if (!n)
+      return;
+
+    i = trie_getbits(n->addr, base, TRIE_STRIDE);
+    m->child_map = 1 << i;
+    m->child = lp_allocz(t->lp, sizeof(struct f_trie_mnode));
+    trie_compile_node(t, m->child, n, trie_setbits(path, base, TRIE_STRIDE, i),
+		      base + TRIE_STRIDE, acc);
+    return;
+  }
+
+  for (r = 0; (r < TRIE_STRIDE) && (base + r <= MAX_PREFIX_LENGTH); r++)
+    for (s = 0; s < (1u << r); s++)
+    {
+      int d = base + r;
+      if (!d)
+	continue;
+
+      a = acc;
+      p = trie_setbits(path, base, r, s);
+      struct f_trie_node *x = trie_walk(n, p, d, &a);
+
+      if (ipa_getbit(a, d - 1) || (x && ipa_getbit(x->accept, d - 1)))
+	m->local |= 1 << ((1 << r) | s);
+    }
+
+  if (base + TRIE_STRIDE > MAX_PREFIX_LENGTH)
+    return;
+
+  /* Children are needed where the binary trie continues or adds M1 masks */
+  for (i = 0; i < TRIE_FANOUT; i++)
+  {
+    cacc[i] = acc;
+    cn[i] = trie_walk(n, trie_setbits(path, base, TRIE_STRIDE, i), base + TRIE_STRIDE, &cacc[i]);
+
+    if (cn[i] || ipa_compare(cacc[i], acc))
+      m->child_map |= 1 << i;
+  }
+
+  if (!m->child_map)
+    return;
+
+  m->child = lp_allocz(t->lp, u32_popcount(m->child_map) * sizeof(struct f_trie_mnode));
+
+  struct f_trie_mnode *c = m->child;
+  for (i = 0; i < TRIE_FANOUT; i++)
+    if (m->child_map & (1 << i))
+      trie_compile_node(t, c++, cn[i], trie_setbits(path, base, TRIE_STRIDE, i),
+			base + TRIE_STRIDE, cacc[i]);
+}
+
+/**
+ * trie_compile - build read-optimized form of a trie
+ * @t: trie
+ *
+ * Builds multibit form of trie @t, which is then used by trie_match_prefix().
+ * It should be called when all prefixes are added to the trie, as the form is
+ * dropped by trie_add_prefix().
+ */
+void
+trie_compile(struct f_trie *t)
+{
+  t->mroot = lp_allocz(t->lp, sizeof(struct f_trie_mnode));
+  trie_compile_node(t, t->mroot, t->root, IPA_NONE, 0, IPA_NONE);
+}
+
+static int
+trie_match_multibit(struct f_trie_mnode *m, ip_addr px, int plen)
+{
+  int base = 0;
+
+  for (;;)
+  {
+    int r = plen - base;
+
+    if (r < TRIE_STRIDE)
+      return (m->local >> ((1 << r) | trie_getbits(px, base, r))) & 1;
+
+    uint c = trie_getbits(px, base, TRIE_STRIDE);
+    if (!(m->child_map & (1 << c)))
+      return !!ipa_getbit(m->tail, plen - 1);
+
+    m = m->child + u32_popcount(m->child_map & ((1 << c) - 1));
+    base += TRIE_STRIDE;
+  }
+}
+
 /**
  * trie_match_prefix
  * @t: trie
@@ -209,12 +405,15 @@ trie_add_prefix(struct f_trie *t, ip_addr px, int plen, int l, int h)
 int
 trie_match_prefix(struct f_trie *t, ip_addr px, int plen)
 {
-  ip_addr pmask = ipa_mkmask(plen);
-  ip_addr paddr = ipa_and(px, pmask);
-
   if (plen == 0)
     return t->zero;
 
+  if (t->mroot)
+    return trie_match_multibit(t->mroot, px, plen);
+
+  ip_addr pmask = ipa_mkmask(plen);
+  ip_addr paddr = ipa_and(px, pmask);
+
   int plentest = plen - 1;
   struct f_trie_node *n = t->root;
 
@@ -241,6 +440,40 @@ trie_match_prefix(struct f_trie *t, ip_addr px, int plen)
   return 0;
 }
 
+/**
+ * trie_find_covering - find nodes of prefixes covering a given prefix
+ * @t: trie
+ * @px: prefix address
+ * @plen: prefix length
+ * @nodes: array for at least %MAX_PREFIX_LENGTH + 1 nodes
+ *
+ * Walks the binary trie along @px/@plen and stores all nodes, whose
+ * prefixes are equal to or shorter than @px/@plen and cover it, to @nodes,
+ * from the shortest one. The root node is always included. Accept masks are
+ * ignored, the function is intended for tries used as an index with user
+ * data in nodes (see f_new_trie()), where branching nodes are recognized
+ * by the user data. Returns the number of stored nodes.
+ */
+uint
+trie_find_covering(struct f_trie *t, ip_addr px, int plen, struct f_trie_node **nodes)
+{
+  struct f_trie_node *n = t->root;
+  uint cnt = 0;
+
+  while (n && (n->plen <= plen) &&
+	 !ipa_compare(ipa_and(px, n->mask), n->addr))
+    {
+      nodes[cnt++] = n;
+
+      if (n->plen == plen)
+	break;
+
+      n = n->c[ipa_getbit(px, n->plen) ? 1 : 0];
+    }
+
+  return cnt;
+}
+
 static int
 trie_node_same(struct f_trie_node *t1, struct f_trie_node *t2)
 {
@@ -271,6 +504,49 @@ trie_same(struct f_trie *t1, struct f_trie *t2)
   return (t1->zero == t2->zero) && trie_node_same(t1->root, t2->root);
 }
 
+static void
+trie_node_walk_ranges(struct f_trie_node *n, void (*hook)(ip_addr px, int plen, void *data), void *data)
+{
+  if (!n)
+    return;
+
+  /*
+   * Accept mask of a node covers lengths of all prefixes matched in its
+   * subtree, therefore these are below its prefix shortened to the lowest
+   * accepted length. Descendants of an accepting node need not be examined.
+   * Subtrees of different accepting nodes without an accepting ancestor do not
+   * overlap, as their common ancestor would accept the lengths, too.
+   */
+  if (ipa_nonzero(n->accept))
+    {
+      int len = MIN(ipa_pxlen(IPA_NONE, n->accept) + 1, n->plen);
+      hook(ipa_and(n->addr, ipa_mkmask(len)), len, data);
+      return;
+    }
+
+  trie_node_walk_ranges(n->c[0], hook, data);
+  trie_node_walk_ranges(n->c[1], hook, data);
+}
+
+/**
+ * trie_walk_ranges - walk prefixes covering a prefix set
+ * @t: trie
+ * @hook: function called for prefixes
+ * @data: argument of @hook
+ *
+ * Calls @hook for disjoint prefixes, such that each prefix matching
+ * the trie is equal to or covered by one of them. It is used to find
+ * networks possibly matching the set without examining all of them.
+ */
+void
+trie_walk_ranges(struct f_trie *t, void (*hook)(ip_addr px, int plen, void *data), void *data)
+{
+  if (t->zero)
+    hook(IPA_NONE, 0, data);
+  else
+    trie_node_walk_ranges(t->root, hook, data);
+}
+
 static void
 trie_node_format(struct f_trie_node *t, buffer *buf)
 {
@@ -306,3 +582,75 @@ trie_format(struct f_trie *t, buffer *buf)
 
   buffer_puts(buf, "]");
 }
+
+/**
+ * prefix_set_new - create a shared set of prefix patterns
+ * @p: pool to allocate the set from
+ *
+ * Prefix sets are tries with their own linear pool and a reference count,
+ * they are used to pass sets of networks, whose routes should be processed
+ * again, to asynchronous consumers (see &reload_prefixes hook of protocols).
+ * The creator holds the first reference. A set must not be changed after it
+ * is passed to others.
+ */
+struct prefix_set *
+prefix_set_new(pool *p)
+{
+  linpool *lp = lp_new(p, 4080);
+  struct prefix_set *s = lp_allocz(lp, sizeof(struct prefix_set));
+
+  s->uc = 1;
+  s->lp = lp;
+  s->trie = f_new_trie(lp, sizeof(struct f_trie_node));
+  return s;
+}
+
+static struct f_trie_node *
+trie_copy_node(struct f_trie *t, struct f_trie_node *n)
+{
+  if (!n)
+    return NULL;
+
+  struct f_trie_node *m = new_node(t, n->plen, n->addr, n->mask, n->accept);
+  m->c[0] = trie_copy_node(t, n->c[0]);
+  m->c[1] = trie_copy_node(t, n->c[1]);
+  return m;
+}
+
+/**
+ * prefix_set_copy - create a shared set from a trie
+ * @p: pool to allocate the set from
+ * @t: trie of prefix patterns
+ *
+ * Like prefix_set_new(), but the set gets a compiled copy of trie @t,
+ * for example of a prefix set given in a CLI command.
+ */
+struct prefix_set *
+prefix_set_copy(pool *p, struct f_trie *t)
+{
+  struct prefix_set *s = prefix_set_new(p);
+  struct f_trie *st = s->trie;
+
+  st->zero = t->zero;
+  *st->root = *t->root;
+  st->root->c[0] = trie_copy_node(st, t->root->c[0]);
+  st->root->c[1] = trie_copy_node(st, t->root->c[1]);
+  trie_compile(st);
+  return s;
+}
+
+/**
+ * prefix_set_unlock - release a reference to a prefix set
+ * @s: prefix set
+ *
+ * The set is freed when the last reference is released.
+ */
+void
+prefix_set_unlock(struct prefix_set *s)
+{
+  if (--s->uc)
+    return;
+
+  /* The set itself is in the linpool */
+  rfree(s->lp);
+}
@@ -9,6 +9,26 @@
 #ifndef _BIRD_BIRDLIB_H_
 #define _BIRD_BIRDLIB_H_
 
+/* Microsecond time */
+
+typedef s64 btime;
+
+#define S_	*1000000
+#define MS_	*1000
+#define US_	*1
+#define TO_S	/1000000
+#define TO_MS	/1000
+#define TO_US	/1
+
+btime precise_time(void);		/* Monotonic time in microseconds, see sysdep/unix/io.c */
+u64 precise_time_ns(void);		/* The same in nanoseconds */
+
+#ifndef PARSER
+#define S	S_
+#define MS	MS_
+#define US	US_
+#endif
+
 #include "timer.h"
 #include "alloca.h"
 
@@ -61,24 +81,6 @@
 #define UNUSED __attribute__((unused))
 
 
-/* Microsecond time */
-
-typedef s64 btime;
-
-#define S_	*1000000
-#define MS_	*1000
-#define US_	*1
-#define TO_S	/1000000
-#define TO_MS	/1000
-#define TO_US	/1
-
-#ifndef PARSER
-#define S	S_
-#define MS	MS_
-#define US	US_
-#endif
-
-
 /* Rate limiting */
 
 struct tbf {
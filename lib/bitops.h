@@ -23,6 +23,9 @@ int u32_masklen(u32 x);
 
 u32 u32_log2(u32 v);
 
+static inline uint u32_popcount(u32 v) { return __builtin_popcount(v); }
+static inline uint u32_ctz(u32 v) { return __builtin_ctz(v); }	/* Undefined for zero */
+
 static inline u32 u32_hash(u32 v) { return v * 2902958171u; }
 
 #endif
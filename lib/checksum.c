@@ -15,17 +15,9 @@
 #include "nest/bird.h"
 #include "checksum.h"
 
-static inline u32
-add32(u32 sum, u32 x)
-{
-  u32 z = sum + x;
-//  return z + (z < sum);
-
- /* add carry */
-  if (z < x)
-    z++;
-  return z;
-}
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 static u16
 ipsum_calc_block(u32 *buf, uint len, u16 isum)
@@ -39,7 +31,10 @@ ipsum_calc_block(u32 *buf, uint len, u16 isum)
    *	o  It's word size independent.
    *
    *  This gives us a neat 32-bits-at-a-time algorithm which respects
-   *  usual alignment requirements and is reasonably fast.
+   *  usual alignment requirements and is reasonably fast. The words are
+   *  summed into 64-bit accumulators, so carries are deferred to the end
+   *  and there is no dependency on them in the loop, which also allows
+   *  to sum four words at once with SSE2.
    */
 
   ASSERT(!(len % 4));
@@ -47,12 +42,33 @@ ipsum_calc_block(u32 *buf, uint len, u16 isum)
     return isum;
 
   u32 *end = buf + (len >> 2);
-  u32 sum = isum;
+  u64 sum = isum;
+
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; buf + 4 <= end; buf += 4)
+  {
+    __m128i d = _mm_loadu_si128((const __m128i *) buf);
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(d, zero));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(d, zero));
+  }
+
+  u64 part[2];
+  _mm_storeu_si128((__m128i *) part, acc);
+  sum += part[0];
+  sum += part[1];
+#endif
+
   while (buf < end)
-    sum = add32(sum, *buf++);
+    sum += *buf++;
 
-  sum = (sum >> 16) + (sum & 0xffff);    /* add high-16 to low-16 */
-  sum += (sum >> 16); /* add carry */
+  /* Fold to 16 bits, each step adds the carry */
+  sum = (sum >> 32) + (sum & 0xffffffff);
+  sum = (sum >> 32) + (sum & 0xffffffff);
+  sum = (sum >> 16) + (sum & 0xffff);
+  sum = (sum >> 16) + (sum & 0xffff);
   return sum;
 }
 
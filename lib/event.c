@@ -17,12 +17,27 @@
  *
  * You can also define your own event lists (the &event_list structure), enqueue your
  * events in them and explicitly ask to run them.
+ *
+ * Long running bulk work (like feeding of routes to protocols) should be split
+ * to events scheduled by ev_schedule_work(). These are kept in a separate list
+ * and they are run only in a limited time slice (the work budget) in each
+ * iteration of the main loop, so regular events, timers and sockets are not
+ * starved even if many such tasks are pending. Routing table maintenance
+ * (rt_maint_run()) and feeding of protocols are scheduled this way.
+ *
+ * Events of CLI sessions are scheduled by ev_schedule_cli() to another list,
+ * which is run after the bulk work. While some bulk work is pending, just one
+ * CLI event is run in each iteration, so heavy show commands cannot delay
+ * convergence, but they are not starved either.
  */
 
 #include "nest/bird.h"
 #include "lib/event.h"
+#include "lib/probe.h"
 
 event_list global_event_list;
+event_list global_work_list;
+event_list global_cli_list;
 
 inline void
 ev_postpone(event *e)
@@ -65,6 +80,7 @@ event *
 ev_new(pool *p)
 {
   event *e = ralloc(p, &ev_class);
+  e->acct = rp_account(p);
   return e;
 }
 
@@ -81,8 +97,13 @@ ev_new(pool *p)
 inline void
 ev_run(event *e)
 {
+  /* The event may be freed by its hook */
+  void (*hook)(void *) = e->hook;
+
   ev_postpone(e);
-  e->hook(e->data);
+  PROBE1(event_entry, hook);
+  hook(e->data);
+  PROBE1(event_return, hook);
 }
 
 /**
@@ -114,7 +135,34 @@ ev_schedule(event *e)
   ev_enqueue(&global_event_list, e);
 }
 
-void io_log_event(void *hook, void *data);
+/**
+ * ev_schedule_work - schedule a bulk work event
+ * @e: an event
+ *
+ * This function schedules an event like ev_schedule(), but to the list of
+ * bulk work, which has lower priority than regular events, timers and
+ * sockets.
+ */
+void
+ev_schedule_work(event *e)
+{
+  ev_enqueue(&global_work_list, e);
+}
+
+/**
+ * ev_schedule_cli - schedule a CLI event
+ * @e: an event
+ *
+ * This function schedules an event of a CLI session, it has lower priority
+ * than bulk work (see ev_schedule_work()).
+ */
+void
+ev_schedule_cli(event *e)
+{
+  ev_enqueue(&global_cli_list, e);
+}
+
+void io_log_event(void *hook, void *data, struct cpu_account *acct);
 
 /**
  * ev_run_list - run an event list
@@ -128,6 +176,8 @@ ev_run_list(event_list *l)
   node *n;
   list tmp_list;
 
+  PROBE1(ev_run_list_entry, l);
+
   init_list(&tmp_list);
   add_tail_list(&tmp_list, l);
   init_list(l);
@@ -137,9 +187,58 @@ ev_run_list(event_list *l)
 
       /* This is ugly hack, we want to log just events executed from the main I/O loop */
       if (l == &global_event_list)
-	io_log_event(e->hook, e->data);
+	io_log_event(e->hook, e->data, e->acct);
+
+      ev_run(e);
+    }
+
+  PROBE1(ev_run_list_return, l);
+  return !EMPTY_LIST(*l);
+}
+
+/**
+ * ev_run_list_limited - run a part of an event list
+ * @l: an event list
+ * @limit: maximal number of events to run
+ *
+ * This function calls ev_run() for at most @limit events from the head of
+ * the list @l. Events enqueued during the run are appended to the list and
+ * wait for the next call. Returns nonzero if some events are still pending.
+ */
+int
+ev_run_list_limited(event_list *l, uint limit)
+{
+  node *n;
+  list tmp_list;
+
+  if (EMPTY_LIST(*l))
+    return 0;
+
+  init_list(&tmp_list);
+  add_tail_list(&tmp_list, l);
+  init_list(l);
+
+  WALK_LIST_FIRST(n, tmp_list)
+    {
+      event *e = SKIP_BACK(event, n, n);
+
+      if (!limit)
+	break;
+
+      io_log_event(e->hook, e->data, e->acct);
 
       ev_run(e);
+      limit--;
+    }
+
+  /* Put back events that were not run, before the newly enqueued ones */
+  if (!EMPTY_LIST(tmp_list))
+    {
+      if (!EMPTY_LIST(*l))
+	add_tail_list(&tmp_list, l);
+      init_list(l);
+      add_tail_list(l, &tmp_list);
     }
+
   return !EMPTY_LIST(*l);
 }
@@ -16,11 +16,14 @@ typedef struct event {
   void (*hook)(void *);
   void *data;
   node n;				/* Internal link */
+  struct cpu_account *acct;		/* Charged for the hook, from the pool */
 } event;
 
 typedef list event_list;
 
 extern event_list global_event_list;
+extern event_list global_work_list;
+extern event_list global_cli_list;
 
 event *ev_new(pool *);
 void ev_run(event *);
@@ -29,6 +32,13 @@ void ev_enqueue(event_list *, event *);
 void ev_schedule(event *);
 void ev_postpone(event *);
 int ev_run_list(event_list *);
+int ev_run_list_limited(event_list *, uint);
+void ev_schedule_work(event *);
+void ev_schedule_cli(event *);
+
+/* Events passed to the main loop from other threads, see sysdep/unix/io.c */
+void ev_send_main(event *);
+void ev_postpone_main(event *);
 
 static inline int
 ev_active(event *e)
@@ -0,0 +1,195 @@
+/*
+ *	BIRD Library -- Fletcher-16 checksum of long data
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/*
+ * Long data are processed in blocks using a closed form of the passing sums.
+ * When a block of n bytes b[0..n-1] is processed with initial sums c0 and c1,
+ * c0 grows by the sum S of all b[i] and c1 grows by n * c0 plus the weighted
+ * sum W of all (n - i) * b[i]. Both S and W are independent of the context,
+ * therefore they may be computed for many bytes at once by SIMD instructions
+ * and there is no dependency chain between consecutive bytes. The endianity
+ * swap of fletcher16_update_n32() just permutes weights of bytes in each u32.
+ *
+ * On x86-64, SSE2 is always available and AVX2 is used when detected at
+ * runtime. Other architectures use the byte-by-byte code of the header, as
+ * the block form is not faster unless vectorized.
+ */
+
+#include "nest/bird.h"
+#include "lib/fletcher16.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FLETCHER16_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * The block length must be a multiple of the chunk size of all kernels and
+ * small enough so that W of a block of 0xff bytes fits in u32.
+ */
+#define FLETCHER16_BLOCK 4096
+#define FLETCHER16_CHUNK 32
+
+typedef void (*fletcher16_kernel)(const u8 *buf, uint len, int swap, u32 *s, u32 *w);
+
+/* Weight of byte @i in a chunk of @n bytes, for processing order with or without swap */
+static inline uint
+fletcher16_weight(uint n, uint i, int swap)
+{
+  return n - (swap ? ((i & ~3) + 3 - (i & 3)) : i);
+}
+
+#ifdef FLETCHER16_X86
+
+static void
+fletcher16_update_blocks(struct fletcher16_context *ctx, const u8* buf, int len, int n32, fletcher16_kernel kernel)
+{
+#ifdef CPU_BIG_ENDIAN
+  /* Network order is the host order, see fletcher16_update_n32() */
+  int swap = 0;
+#else
+  int swap = n32;
+#endif
+
+  /* Context sums are always reduced (below 255) between updates */
+  while (len >= FLETCHER16_CHUNK)
+  {
+    uint blen = MIN(len, FLETCHER16_BLOCK) & ~(FLETCHER16_CHUNK - 1);
+    u32 s, w;
+
+    kernel(buf, blen, swap, &s, &w);
+    ctx->c1 = (ctx->c1 + (u64) blen * ctx->c0 + w) % 255;
+    ctx->c0 = (ctx->c0 + s) % 255;
+
+    buf += blen;
+    len -= blen;
+  }
+
+  if (n32)
+    fletcher16_update_n32_scalar(ctx, buf, len);
+  else
+    fletcher16_update_scalar(ctx, buf, len);
+}
+
+static inline u32
+fletcher16_hsum_sse2(__m128i v)
+{
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4e));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xb1));
+  return _mm_cvtsi128_si32(v);
+}
+
+static void
+fletcher16_block_sse2(const u8 *buf, uint len, int swap, u32 *s, u32 *w)
+{
+  const __m128i zero = _mm_setzero_si128();
+  u16 wt[16];
+  uint i;
+
+  for (i = 0; i < 16; i++)
+    wt[i] = fletcher16_weight(16, i, swap);
+
+  __m128i wl = _mm_loadu_si128((const __m128i *) wt);
+  __m128i wh = _mm_loadu_si128((const __m128i *) (wt + 8));
+
+  /* vs - sum of bytes, vp - sum of vs before each chunk, vw - weighted sums in chunks */
+  __m128i vs = zero, vp = zero, vw = zero;
+
+  for (i = 0; i < len; i += 16)
+  {
+    __m128i d = _mm_loadu_si128((const __m128i *) (buf + i));
+
+    vp = _mm_add_epi32(vp, vs);
+    vs = _mm_add_epi32(vs, _mm_sad_epu8(d, zero));
+    vw = _mm_add_epi32(vw, _mm_madd_epi16(_mm_unpacklo_epi8(d, zero), wl));
+    vw = _mm_add_epi32(vw, _mm_madd_epi16(_mm_unpackhi_epi8(d, zero), wh));
+  }
+
+  *s = fletcher16_hsum_sse2(vs);
+  *w = 16 * fletcher16_hsum_sse2(vp) + fletcher16_hsum_sse2(vw);
+}
+
+__attribute__((target("avx2")))
+static inline u32
+fletcher16_hsum_avx2(__m256i v)
+{
+  return fletcher16_hsum_sse2(_mm_add_epi32(_mm256_castsi256_si128(v),
+					    _mm256_extracti128_si256(v, 1)));
+}
+
+__attribute__((target("avx2")))
+static void
+fletcher16_block_avx2(const u8 *buf, uint len, int swap, u32 *s, u32 *w)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  u8 wt[32];
+  uint i;
+
+  for (i = 0; i < 32; i++)
+    wt[i] = fletcher16_weight(32, i, swap);
+
+  /* Weights fit in signed bytes, so the products may be summed by maddubs */
+  __m256i vt = _mm256_loadu_si256((const __m256i *) wt);
+  __m256i vs = zero, vp = zero, vw = zero;
+
+  for (i = 0; i < len; i += 32)
+  {
+    __m256i d = _mm256_loadu_si256((const __m256i *) (buf + i));
+
+    vp = _mm256_add_epi32(vp, vs);
+    vs = _mm256_add_epi32(vs, _mm256_sad_epu8(d, zero));
+    vw = _mm256_add_epi32(vw, _mm256_madd_epi16(_mm256_maddubs_epi16(d, vt), ones));
+  }
+
+  *s = fletcher16_hsum_avx2(vs);
+  *w = 32 * fletcher16_hsum_avx2(vp) + fletcher16_hsum_avx2(vw);
+}
+
+static fletcher16_kernel fletcher16_block;
+
+static fletcher16_kernel
+fletcher16_select(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return fletcher16_block_avx2;
+
+  return fletcher16_block_sse2;
+}
+
+/**
+ * fletcher16_update_long - process long data to Fletcher-16 context
+ * @ctx: the context
+ * @buf: data buffer
+ * @len: data length
+ * @n32: whether to apply 32-bit endianity swap like fletcher16_update_n32()
+ *
+ * This function is called by fletcher16_update() and fletcher16_update_n32()
+ * for data of at least %FLETCHER16_LONG bytes. It processes them by the best
+ * available vectorized kernel, chosen on the first call.
+ */
+void
+fletcher16_update_long(struct fletcher16_context *ctx, const u8* buf, int len, int n32)
+{
+  if (!fletcher16_block)
+    fletcher16_block = fletcher16_select();
+
+  fletcher16_update_blocks(ctx, buf, len, n32, fletcher16_block);
+}
+
+#else
+
+void
+fletcher16_update_long(struct fletcher16_context *ctx, const u8* buf, int len, int n32)
+{
+  if (n32)
+    fletcher16_update_n32_scalar(ctx, buf, len);
+  else
+    fletcher16_update_scalar(ctx, buf, len);
+}
+
+#endif
@@ -45,18 +45,14 @@ fletcher16_init(struct fletcher16_context *ctx)
   ctx->c0 = ctx->c1 = 0;
 }
 
-/**
- * fletcher16_update - process data to Fletcher-16 context
- * @ctx: the context
- * @buf: data buffer
- * @len: data length
- *
- * fletcher16_update() reads data from the buffer @buf and updates passing sums
- * in the context @ctx. It may be used multiple times for multiple blocks of
- * checksummed data.
- */
+/* Data of at least this length are processed by fletcher16_update_long() */
+#define FLETCHER16_LONG 64
+
+void fletcher16_update_long(struct fletcher16_context *ctx, const u8* buf, int len, int n32);
+
+/* Byte-by-byte version of fletcher16_update(), used for short data */
 static inline void
-fletcher16_update(struct fletcher16_context *ctx, const u8* buf, int len)
+fletcher16_update_scalar(struct fletcher16_context *ctx, const u8* buf, int len)
 {
   /*
    * The Fletcher-16 sum is essentially a sequence of
@@ -97,24 +93,11 @@ fletcher16_update(struct fletcher16_context *ctx, const u8* buf, int len)
 }
 
 
-/**
- * fletcher16_update_n32 - process data to Fletcher-16 context, with endianity adjustment
- * @ctx: the context
- * @buf: data buffer
- * @len: data length
- *
- * fletcher16_update_n32() works like fletcher16_update(), except it applies
- * 32-bit host/network endianity swap to the data before they are processed.
- * I.e., it assumes that the data is a sequence of u32 that must be converted by
- * ntohl() or htonl() before processing. The @buf need not to be aligned, but
- * its length (@len) must be multiple of 4. Note that on big endian systems the
- * host endianity is the same as the network endianity, therefore there is no
- * endianity swap.
- */
+/* Byte-by-byte version of fletcher16_update_n32(), used for short data */
 static inline void
-fletcher16_update_n32(struct fletcher16_context *ctx, const u8* buf, int len)
+fletcher16_update_n32_scalar(struct fletcher16_context *ctx, const u8* buf, int len)
 {
-  /* See fletcher16_update() for details */
+  /* See fletcher16_update_scalar() for details */
 
   int blen, i;
 
@@ -144,6 +127,49 @@ fletcher16_update_n32(struct fletcher16_context *ctx, const u8* buf, int len)
   } while (len);
 }
 
+/**
+ * fletcher16_update - process data to Fletcher-16 context
+ * @ctx: the context
+ * @buf: data buffer
+ * @len: data length
+ *
+ * fletcher16_update() reads data from the buffer @buf and updates passing sums
+ * in the context @ctx. It may be used multiple times for multiple blocks of
+ * checksummed data. Longer data are processed by vectorized code, see
+ * lib/fletcher16.c.
+ */
+static inline void
+fletcher16_update(struct fletcher16_context *ctx, const u8* buf, int len)
+{
+  if (len >= FLETCHER16_LONG)
+    fletcher16_update_long(ctx, buf, len, 0);
+  else
+    fletcher16_update_scalar(ctx, buf, len);
+}
+
+/**
+ * fletcher16_update_n32 - process data to Fletcher-16 context, with endianity adjustment
+ * @ctx: the context
+ * @buf: data buffer
+ * @len: data length
+ *
+ * fletcher16_update_n32() works like fletcher16_update(), except it applies
+ * 32-bit host/network endianity swap to the data before they are processed.
+ * I.e., it assumes that the data is a sequence of u32 that must be converted by
+ * ntohl() or htonl() before processing. The @buf need not to be aligned, but
+ * its length (@len) must be multiple of 4. Note that on big endian systems the
+ * host endianity is the same as the network endianity, therefore there is no
+ * endianity swap.
+ */
+static inline void
+fletcher16_update_n32(struct fletcher16_context *ctx, const u8* buf, int len)
+{
+  if (len >= FLETCHER16_LONG)
+    fletcher16_update_long(ctx, buf, len, 1);
+  else
+    fletcher16_update_n32_scalar(ctx, buf, len);
+}
+
 /**
  * fletcher16_final - compute final Fletcher-16 checksum value
  * @ctx: the context
@@ -0,0 +1,268 @@
+/*
+ *	BIRD Library -- Open Addressing Hash Tables
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/*
+ * The current table is kept in Robin Hood order: each node lies at or after
+ * its home slot and the distances never decrease by more than one along a
+ * run of occupied slots. Insertion displaces nodes closer to their home and
+ * removal shifts the rest of the run back, so no tombstones are needed.
+ *
+ * The old table during migration receives no inserts. Nodes removed from it
+ * or migrated to the current table are replaced by tombstones keeping their
+ * hash, so the probe sequences of the remaining nodes stay intact.
+ */
+
+#include "nest/bird.h"
+#include "lib/resource.h"
+#include "lib/hash.h"
+
+#define OA_HI_MARK(order)	(3U << ((order) - 2))	/* 3/4 full */
+#define OA_LO_MARK(order)	(1U << ((order) - 3))	/* 1/8 full */
+#define OA_MAX_ORDER		30
+#define OA_MIGRATE_STEP		8	/* Old slots migrated per operation */
+
+/**
+ * oa_hash_init - initialize an open addressing hash table
+ * @t: the table
+ * @p: pool for the table memory
+ * @order: initial and minimal order of the table size
+ *
+ * This function is usually called through OA_HASH_INIT() on a typed
+ * OA_HASH() structure.
+ */
+void
+oa_hash_init(struct oa_hash *t, pool *p, uint order)
+{
+  t->pool = p;
+  t->count = 0;
+  t->order = t->min_order = MAX(order, 3);
+  t->data = mb_allocz(p, sizeof(struct oa_slot) << t->order);
+  t->old = NULL;
+}
+
+/**
+ * oa_hash_free - free an open addressing hash table
+ * @t: the table
+ *
+ * The nodes are not touched.
+ */
+void
+oa_hash_free(struct oa_hash *t)
+{
+  mb_free(t->data);
+  if (t->old)
+    mb_free(t->old);
+
+  t->data = t->old = NULL;
+  t->count = 0;
+}
+
+static void
+oa_put(struct oa_hash *t, u32 hash, void *node)
+{
+  uint mask = (1U << t->order) - 1;
+  uint pos = oa_home(hash, t->order);
+  uint dist = 0;
+
+  for (;; pos = (pos + 1) & mask, dist++)
+  {
+    struct oa_slot *s = t->data + pos;
+
+    if (!s->ptr)
+    {
+      s->hash = hash;
+      s->ptr = node;
+      return;
+    }
+
+    /* Take the slot from a node closer to its home */
+    uint d = oa_dist(s, pos, t->order);
+    if (d < dist)
+    {
+      struct oa_slot x = *s;
+      s->hash = hash;
+      s->ptr = node;
+      hash = x.hash;
+      node = x.ptr;
+      dist = d;
+    }
+  }
+}
+
+static void
+oa_migrate(struct oa_hash *t, uint step)
+{
+  uint size = 1U << t->old_order;
+
+  for (; step && (t->old_pos < size); step--, t->old_pos++)
+  {
+    struct oa_slot *s = t->old + t->old_pos;
+
+    if (s->ptr && (s->ptr != OA_TOMBSTONE))
+    {
+      oa_put(t, s->hash, s->ptr);
+      s->ptr = OA_TOMBSTONE;
+    }
+  }
+
+  if (t->old_pos >= size)
+  {
+    mb_free(t->old);
+    t->old = NULL;
+  }
+}
+
+static void
+oa_resize(struct oa_hash *t, uint order)
+{
+  /* Finish the previous migration first */
+  if (t->old)
+    oa_migrate(t, ~0);
+
+  t->old = t->data;
+  t->old_order = t->order;
+  t->old_pos = 0;
+
+  t->order = order;
+  t->data = mb_allocz(t->pool, sizeof(struct oa_slot) << order);
+}
+
+/**
+ * oa_hash_insert - insert a node to an open addressing hash table
+ * @t: the table
+ * @hash: hash value of the node key
+ * @node: the node
+ *
+ * The node must not be already present in the table. This function is
+ * usually called through OA_HASH_INSERT().
+ */
+void
+oa_hash_insert(struct oa_hash *t, u32 hash, void *node)
+{
+  if ((t->count >= OA_HI_MARK(t->order)) && (t->order < OA_MAX_ORDER))
+    oa_resize(t, t->order + 1);
+  else if (t->old)
+    oa_migrate(t, OA_MIGRATE_STEP);
+
+  oa_put(t, hash, node);
+  t->count++;
+}
+
+/**
+ * oa_hash_remove - remove a node from an open addressing hash table
+ * @t: the table
+ * @hash: hash value of the node key
+ * @node: the node
+ *
+ * This function removes the node and returns it, or NULL if it was not found.
+ * It is usually called through OA_HASH_REMOVE().
+ */
+void *
+oa_hash_remove(struct oa_hash *t, u32 hash, void *node)
+{
+  uint mask = (1U << t->order) - 1;
+  uint pos = oa_home(hash, t->order);
+  uint dist = 0;
+  struct oa_slot *s;
+
+  for (;; pos = (pos + 1) & mask, dist++)
+  {
+    s = t->data + pos;
+
+    if (!s->ptr || (oa_dist(s, pos, t->order) < dist))
+      goto old;
+
+    if (s->ptr == node)
+      break;
+  }
+
+  /* Shift the rest of the run back */
+  for (;;)
+  {
+    uint next = (pos + 1) & mask;
+    struct oa_slot *n = t->data + next;
+
+    if (!n->ptr || !oa_dist(n, next, t->order))
+      break;
+
+    *s = *n;
+    s = n;
+    pos = next;
+  }
+
+  s->ptr = NULL;
+  goto done;
+
+old:
+  if (!t->old)
+    return NULL;
+
+  mask = (1U << t->old_order) - 1;
+  pos = oa_home(hash, t->old_order);
+  dist = 0;
+
+  for (;; pos = (pos + 1) & mask, dist++)
+  {
+    s = t->old + pos;
+
+    if (!s->ptr || (oa_dist(s, pos, t->old_order) < dist))
+      return NULL;
+
+    if (s->ptr == node)
+      break;
+  }
+
+  s->ptr = OA_TOMBSTONE;
+
+done:
+  t->count--;
+
+  if ((t->count < OA_LO_MARK(t->order)) && (t->order > t->min_order))
+    oa_resize(t, t->order - 1);
+  else if (t->old)
+    oa_migrate(t, OA_MIGRATE_STEP);
+
+  return node;
+}
+
+/**
+ * oa_hash_histogram - compute histogram of probe distances
+ * @t: the table
+ * @hist: array of @max + 1 counters, the last one is for longer distances
+ * @max: histogram size
+ * @longest: storage for the longest distance
+ *
+ * The counters in @hist and @longest are not cleared, so statistics of
+ * more tables may be gathered.
+ */
+void
+oa_hash_histogram(struct oa_hash *t, uint *hist, uint max, uint *longest)
+{
+  struct oa_slot *data = t->data;
+  uint order = t->order, from = 0;
+
+  for (;;)
+  {
+    for (uint i = from; i < (1U << order); i++)
+    {
+      struct oa_slot *s = data + i;
+
+      if (s->ptr && (s->ptr != OA_TOMBSTONE))
+      {
+	uint d = oa_dist(s, i, order);
+	hist[MIN(d, max)]++;
+	*longest = MAX(*longest, d);
+      }
+    }
+
+    if ((data != t->data) || !t->old)
+      return;
+
+    data = t->old;
+    order = t->old_order;
+    from = t->old_pos;
+  }
+}
@@ -1,3 +1,6 @@
+#ifndef _BIRD_HASH_H_
+#define _BIRD_HASH_H_
+
 
 
 #define HASH(type)		struct { type **data; uint count, order; }
@@ -178,3 +181,161 @@
 
 #define HASH_WALK_FILTER_END } while (0)
 
+
+
+/*
+ *	Open addressing hash tables
+ *
+ *	OA_HASH() is a table of pointers to nodes, which keeps the hash value of
+ *	each node next to the pointer. A lookup therefore usually touches just
+ *	one cache line of the table and then the matching node itself, instead
+ *	of walking a chain of nodes. The table uses linear probing with Robin Hood
+ *	ordering, so probe sequences stay short even at high load, and a
+ *	lookup for a missing key stops as soon as it reaches a slot closer to
+ *	its home position. Nodes need no link field.
+ *
+ *	The table grows and shrinks incrementally: a new table is allocated and
+ *	a few slots of the old one are migrated on each insert or remove, so there
+ *	is no stall for rehashing of big tables. Lookups search both tables while
+ *	the migration is running.
+ *
+ *	Keys are described by id##_KEY(), id##_EQ() and id##_FN() like for
+ *	HASH(); id##_FN() has to return a well mixed 32-bit value, whose top bits
+ *	are used as the index. The walks are not safe against modifications of
+ *	the table.
+ */
+
+struct oa_slot {
+  u32 hash;				/* Hash value of the node */
+  void *ptr;				/* The node, NULL for empty slot */
+};
+
+struct oa_hash {
+  struct oa_slot *data;			/* Current table */
+  struct oa_slot *old;			/* Table being migrated from, NULL if none */
+  pool *pool;
+  uint count;				/* Nodes in both tables */
+  uint order, old_order, min_order;
+  uint old_pos;				/* Slots of the old table below are migrated */
+};
+
+struct oa_iter {
+  struct oa_hash *t;
+  struct oa_slot *data;
+  uint order, pos, dist;
+  u32 hash;
+};
+
+/* Deleted or migrated slot in the old table, keeps the hash for probing */
+#define OA_TOMBSTONE		((void *) 1)
+
+void oa_hash_init(struct oa_hash *t, pool *p, uint order);
+void oa_hash_free(struct oa_hash *t);
+void oa_hash_insert(struct oa_hash *t, u32 hash, void *node);
+void *oa_hash_remove(struct oa_hash *t, u32 hash, void *node);
+void oa_hash_histogram(struct oa_hash *t, uint *hist, uint max, uint *longest);
+
+static inline uint oa_home(u32 hash, uint order)
+{ return hash >> (32 - order); }
+
+static inline uint oa_dist(struct oa_slot *s, uint pos, uint order)
+{ return (pos - oa_home(s->hash, order)) & ((1U << order) - 1); }
+
+static inline struct oa_iter
+oa_iter_start(struct oa_hash *t, u32 hash)
+{
+  return (struct oa_iter) {
+    .t = t, .data = t->data, .order = t->order,
+    .pos = oa_home(hash, t->order), .hash = hash
+  };
+}
+
+static inline void *
+oa_iter_next(struct oa_iter *it)
+{
+  for (;;)
+  {
+    struct oa_slot *s = it->data + it->pos;
+
+    if (!s->ptr || (oa_dist(s, it->pos, it->order) < it->dist))
+    {
+      /* End of the probe sequence, continue with the old table */
+      if ((it->data != it->t->data) || !it->t->old)
+	return NULL;
+
+      it->data = it->t->old;
+      it->order = it->t->old_order;
+      it->pos = oa_home(it->hash, it->order);
+      it->dist = 0;
+      continue;
+    }
+
+    it->pos = (it->pos + 1) & ((1U << it->order) - 1);
+    it->dist++;
+
+    if ((s->hash == it->hash) && (s->ptr != OA_TOMBSTONE))
+      return s->ptr;
+  }
+}
+
+static inline struct oa_iter
+oa_iter_all(struct oa_hash *t)
+{
+  return (struct oa_iter) { .t = t, .data = t->data, .order = t->order };
+}
+
+static inline void *
+oa_iter_next_all(struct oa_iter *it)
+{
+  for (;;)
+  {
+    if (it->pos >= (1U << it->order))
+    {
+      if ((it->data != it->t->data) || !it->t->old)
+	return NULL;
+
+      it->data = it->t->old;
+      it->order = it->t->old_order;
+      it->pos = it->t->old_pos;
+      continue;
+    }
+
+    struct oa_slot *s = it->data + it->pos++;
+    if (s->ptr && (s->ptr != OA_TOMBSTONE))
+      return s->ptr;
+  }
+}
+
+#define OA_HASH(type)		struct { struct oa_hash t; type *_type[0]; }
+#define OA_HASH_TYPE(v)		typeof(* (v)._type[0])
+#define OA_HASH_SIZE(v)		(1 << (v).t.order)
+#define OA_HASH_COUNT(v)	((v).t.count)
+
+#define OA_HASH_INIT(v,pool,init_order)	oa_hash_init(&(v).t, pool, init_order)
+#define OA_HASH_FREE(v)			oa_hash_free(&(v).t)
+
+/* Walk nodes with given hash value, the caller checks the key */
+#define OA_HASH_WALK_HASH(v,hash,n)					\
+  for (struct oa_iter _it = oa_iter_start(&(v).t, hash);		\
+       (n = oa_iter_next(&_it)); )
+
+#define OA_HASH_WALK(v,n)						\
+  for (struct oa_iter _it = oa_iter_all(&(v).t);			\
+       (n = oa_iter_next_all(&_it)); )
+
+#define OA_HASH_FIND(v,id,key...)					\
+  ({									\
+    OA_HASH_TYPE(v) *_n;						\
+    OA_HASH_WALK_HASH(v, id##_FN(key), _n)				\
+      if (id##_EQ(id##_KEY(_n), key))					\
+	break;								\
+    _n;									\
+  })
+
+#define OA_HASH_INSERT(v,id,node)					\
+  oa_hash_insert(&(v).t, id##_FN(id##_KEY((node))), node)
+
+#define OA_HASH_REMOVE(v,id,node)					\
+  ((OA_HASH_TYPE(v) *) oa_hash_remove(&(v).t, id##_FN(id##_KEY((node))), node))
+
+#endif
@@ -19,6 +19,7 @@
 
 #include "nest/bird.h"
 #include "lib/ip.h"
+#include "lib/bitops.h"
 
 
 int
@@ -160,61 +161,98 @@ ip6_classify(ip6_addr *a)
  */
 
 
-char *
-ip4_ntop(ip4_addr a, char *b)
+/*
+ * Decimal octets are taken from a table, zero words of IPv6 addresses are
+ * found as bits of a mask. The first three bytes of a table entry are digits,
+ * the last one is their count. Entries are copied whole, bytes after a short
+ * octet are overwritten by the rest of the string. After the last octet, up
+ * to two bytes past the terminating zero may be written, but never past the
+ * place of the zero for the longest IPv4 address, so buffers of the usual size
+ * are enough.
+ */
+
+#define OCT(x) { \
+  ((x) >= 100) ? '0' + (x) / 100 : ((x) >= 10) ? '0' + (x) / 10 : '0' + (x), \
+  ((x) >= 100) ? '0' + (x) / 10 % 10 : ((x) >= 10) ? '0' + (x) % 10 : 0, \
+  ((x) >= 100) ? '0' + (x) % 10 : 0, \
+  ((x) >= 100) ? 3 : ((x) >= 10) ? 2 : 1 }
+#define OCT4(x) OCT(x), OCT((x)+1), OCT((x)+2), OCT((x)+3)
+#define OCT16(x) OCT4(x), OCT4((x)+4), OCT4((x)+8), OCT4((x)+12)
+#define OCT64(x) OCT16(x), OCT16((x)+16), OCT16((x)+32), OCT16((x)+48)
+
+static const byte ip4_octets[256][4] = { OCT64(0), OCT64(64), OCT64(128), OCT64(192) };
+
+static const char ip6_hex[16] = "0123456789abcdef";
+
+static inline char *
+ip4_put_octet(char *b, uint x)
 {
-  u32 x = _I(a);
-  return b + bsprintf(b, "%d.%d.%d.%d", (x >> 24) & 0xff, (x >> 16) & 0xff, (x >> 8) & 0xff, x & 0xff);
+  memcpy(b, ip4_octets[x], 4);
+  return b + ip4_octets[x][3];
 }
 
+static inline char *
+ip4_put(char *b, u32 x)
+{
+  b = ip4_put_octet(b, x >> 24);
+  *b++ = '.';
+  b = ip4_put_octet(b, (x >> 16) & 0xff);
+  *b++ = '.';
+  b = ip4_put_octet(b, (x >> 8) & 0xff);
+  *b++ = '.';
+  return ip4_put_octet(b, x & 0xff);
+}
 
-char *
-ip6_ntop(ip6_addr a, char *b)
+static inline char *
+ip6_put_word(char *b, uint w)
+{
+  if (w >= 0x1000)
+    *b++ = ip6_hex[w >> 12];
+  if (w >= 0x100)
+    *b++ = ip6_hex[(w >> 8) & 0xf];
+  if (w >= 0x10)
+    *b++ = ip6_hex[(w >> 4) & 0xf];
+  *b++ = ip6_hex[w & 0xf];
+  return b;
+}
+
+static char *
+ip6_put(char *b, ip6_addr a)
 {
   u16 words[8];
-  int bestpos, bestlen, curpos, curlen, i;
+  uint zeros = 0, runs, best = 0, bestpos, bestlen = 0;
+  int i;
 
-  /* First of all, preprocess the address and find the longest run of zeros */
-  bestlen = bestpos = curpos = curlen = 0;
-  for (i=0; i<8; i++)
+  for (i = 0; i < 8; i++)
   {
-    u32 x = a.addr[i/2];
-    words[i] = ((i%2) ? x : (x >> 16)) & 0xffff;
-    if (words[i])
-      curlen = 0;
-    else
-    {
-      if (!curlen)
-	curpos = i;
-      curlen++;
-      if (curlen > bestlen)
-      {
-	bestpos = curpos;
-	bestlen = curlen;
-      }
-    }
+    words[i] = (a.addr[i/2] >> ((i % 2) ? 0 : 16)) & 0xffff;
+    zeros |= (!words[i]) << i;
   }
 
-  if (bestlen < 2)
-    bestpos = -1;
+  /*
+   * Find the first longest run of zero words. A bit stays in @runs if the
+   * run starting there is longer than the number of steps done.
+   */
+  for (runs = zeros; runs; runs &= runs >> 1)
+  {
+    best = runs;
+    bestlen++;
+  }
+
+  bestpos = (bestlen >= 2) ? u32_ctz(best) : 8;
 
   /* Is it an encapsulated IPv4 address? */
   if (!bestpos && ((bestlen == 5 && a.addr[2] == 0xffff) || (bestlen == 6)))
   {
-    u32 x = a.addr[3];
-    b += bsprintf(b, "::%s%d.%d.%d.%d",
-		  a.addr[2] ? "ffff:" : "",
-		  (x >> 24) & 0xff,
-		  (x >> 16) & 0xff,
-		  (x >> 8) & 0xff,
-		  x & 0xff);
-    return b;
+    memcpy(b, "::ffff:", 7);
+    b += a.addr[2] ? 7 : 2;
+    return ip4_put(b, a.addr[3]);
   }
 
   /* Normal IPv6 formatting, compress the largest sequence of zeros */
-  for (i=0; i<8; i++)
+  for (i = 0; i < 8; i++)
   {
-    if (i == bestpos)
+    if (i == (int) bestpos)
     {
       i += bestlen - 1;
       *b++ = ':';
@@ -225,13 +263,63 @@ ip6_ntop(ip6_addr a, char *b)
     {
       if (i)
 	*b++ = ':';
-      b += bsprintf(b, "%x", words[i]);
+      b = ip6_put_word(b, words[i]);
     }
   }
+
+  return b;
+}
+
+static inline char *
+ip_put_pxlen(char *b, uint pxlen)
+{
+  *b++ = '/';
+  if (pxlen >= 100)
+    *b++ = '0' + pxlen / 100;
+  if (pxlen >= 10)
+    *b++ = '0' + pxlen / 10 % 10;
+  *b++ = '0' + pxlen % 10;
+  *b = 0;
+  return b;
+}
+
+char *
+ip4_ntop(ip4_addr a, char *b)
+{
+  b = ip4_put(b, _I(a));
+  *b = 0;
+  return b;
+}
+
+char *
+ip6_ntop(ip6_addr a, char *b)
+{
+  b = ip6_put(b, a);
   *b = 0;
   return b;
 }
 
+/**
+ * ip4_ntop_px - convert IPv4 prefix to textual representation
+ * @a: IPv4 address
+ * @pxlen: prefix length
+ * @b: buffer of size at least %STD_PREFIX_P_LENGTH + 1
+ *
+ * Writes the prefix as address/length in one pass and returns the end
+ * of the string. ip6_ntop_px() is the same for IPv6.
+ */
+char *
+ip4_ntop_px(ip4_addr a, uint pxlen, char *b)
+{
+  return ip_put_pxlen(ip4_put(b, _I(a)), pxlen);
+}
+
+char *
+ip6_ntop_px(ip6_addr a, uint pxlen, char *b)
+{
+  return ip_put_pxlen(ip6_put(b, a), pxlen);
+}
+
 int
 ip4_pton(char *a, ip4_addr *o)
 {
@@ -37,11 +37,13 @@
 #define MAX_PREFIX_LENGTH 128
 #define BITS_PER_IP_ADDRESS 128
 #define STD_ADDRESS_P_LENGTH 39
+#define STD_PREFIX_P_LENGTH 43
 #define SIZE_OF_IP_HEADER 40
 #else
 #define MAX_PREFIX_LENGTH 32
 #define BITS_PER_IP_ADDRESS 32
 #define STD_ADDRESS_P_LENGTH 15
+#define STD_PREFIX_P_LENGTH 18
 #define SIZE_OF_IP_HEADER 24
 #endif
 
@@ -439,6 +441,8 @@ static inline void * put_ip6(void *buf, ip6_addr a)
 
 char *ip4_ntop(ip4_addr a, char *b);
 char *ip6_ntop(ip6_addr a, char *b);
+char *ip4_ntop_px(ip4_addr a, uint pxlen, char *b);
+char *ip6_ntop_px(ip6_addr a, uint pxlen, char *b);
 
 static inline char * ip4_ntox(ip4_addr a, char *b)
 { return b + bsprintf(b, "%08x", _I(a)); }
@@ -452,10 +456,12 @@ int ip6_pton(char *a, ip6_addr *o);
 // XXXX these functions must be redesigned or removed
 #ifdef IPV6
 #define ipa_ntop(x,y) ip6_ntop(x,y)
+#define ipa_ntop_px(x,l,y) ip6_ntop_px(x,l,y)
 #define ipa_ntox(x,y) ip6_ntox(x,y)
 #define ipa_pton(x,y) ip6_pton(x,y)
 #else
 #define ipa_ntop(x,y) ip4_ntop(x,y)
+#define ipa_ntop_px(x,l,y) ip4_ntop_px(x,l,y)
 #define ipa_ntox(x,y) ip4_ntox(x,y)
 #define ipa_pton(x,y) ip4_pton(x,y)
 #endif
@@ -16,6 +16,18 @@
  * Example: Each configuration is described by a complex system of structures,
  * linked lists and function trees which are all allocated from a single linear
  * pool, thus they can be freed at once when the configuration is no longer used.
+ *
+ * Chunks have power-of-two sizes (including their header) and when not
+ * needed by a linpool, they are kept in a global cache shared by all linpools,
+ * where they may be picked up by another linpool (or the same one after
+ * lp_flush()) without calling the system allocator. Hot temporary pools,
+ * which are flushed after each use, therefore don't allocate any memory in the
+ * steady state. As allocations larger than 3/4 of the chunk size get their own
+ * chunks, the chunk size of a pool which needed such allocations is increased
+ * during lp_flush(), up to %LP_MAX_CHUNK_ORDER.
+ *
+ * Linear pools themselves are not thread-safe, each thread should use its own
+ * ones. The chunk cache is protected by a lock.
  */
 
 #include <stdlib.h>
@@ -25,6 +37,10 @@
 #include "lib/resource.h"
 #include "lib/string.h"
 
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
 struct lp_chunk {
   struct lp_chunk *next;
   uint size;
@@ -38,8 +54,29 @@ struct linpool {
   struct lp_chunk *first, *current, **plast;	/* Normal (reusable) chunks */
   struct lp_chunk *first_large;			/* Large chunks */
   uint chunk_size, threshold, total, total_large;
+  uint max_large;				/* Largest allocation since lp_flush() */
 };
 
+#define LP_MIN_ORDER		8	/* Smallest cached chunk with header */
+#define LP_MAX_CHUNK_ORDER	16	/* Limit for adaptive growth of chunk size */
+#define LP_MAX_ORDER		20	/* Larger chunks are not cached */
+#define LP_CACHE_BYTES		(1 << 22) /* Cache limit for each order */
+#define LP_CACHE_MIN_COUNT	4	/* Cache limit for large orders */
+
+#define LP_CHUNK_CAPACITY(order)	((1U << (order)) - (uint) sizeof(struct lp_chunk))
+
+static struct lp_chunk *lp_cache[LP_MAX_ORDER + 1];
+static uint lp_cache_count[LP_MAX_ORDER + 1];
+
+#ifdef USE_PTHREADS
+static pthread_mutex_t lp_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static inline void lp_cache_lock(void) { pthread_mutex_lock(&lp_cache_mutex); }
+static inline void lp_cache_unlock(void) { pthread_mutex_unlock(&lp_cache_mutex); }
+#else
+static inline void lp_cache_lock(void) { }
+static inline void lp_cache_unlock(void) { }
+#endif
+
 static void lp_free(resource *);
 static void lp_dump(resource *);
 static resource *lp_lookup(resource *, unsigned long);
@@ -54,22 +91,106 @@ static struct resclass lp_class = {
   lp_memsize
 };
 
+/* Order of the smallest chunk with at least @size bytes of data */
+static inline uint
+lp_order(uint size)
+{
+  uint total = size + sizeof(struct lp_chunk);
+  return (total <= (1U << LP_MIN_ORDER)) ? LP_MIN_ORDER : u32_log2(total - 1) + 1;
+}
+
+static struct lp_chunk *
+lp_get_chunk(uint size)
+{
+  struct lp_chunk *c = NULL;
+  uint order = lp_order(size);
+
+  if (order > LP_MAX_ORDER)
+    {
+      c = xmalloc(sizeof(struct lp_chunk) + size);
+      c->size = size;
+      return c;
+    }
+
+  lp_cache_lock();
+  if (c = lp_cache[order])
+    {
+      lp_cache[order] = c->next;
+      lp_cache_count[order]--;
+    }
+  lp_cache_unlock();
+
+  if (!c)
+    {
+      c = xmalloc(1U << order);
+      c->size = LP_CHUNK_CAPACITY(order);
+    }
+
+  return c;
+}
+
+static void
+lp_put_chunk(struct lp_chunk *c)
+{
+  uint order = lp_order(c->size);
+
+  if (order <= LP_MAX_ORDER)
+    {
+      lp_cache_lock();
+      if (lp_cache_count[order] < MAX(LP_CACHE_BYTES >> order, LP_CACHE_MIN_COUNT))
+	{
+	  c->next = lp_cache[order];
+	  lp_cache[order] = c;
+	  lp_cache_count[order]++;
+	  c = NULL;
+	}
+      lp_cache_unlock();
+    }
+
+  if (c)
+    xfree(c);
+}
+
+static void
+lp_put_chunks(struct lp_chunk *c)
+{
+  struct lp_chunk *n;
+
+  for (; c; c = n)
+    {
+      n = c->next;
+      lp_put_chunk(c);
+    }
+}
+
+static inline void
+lp_set_chunk_size(linpool *m, uint order)
+{
+  m->chunk_size = LP_CHUNK_CAPACITY(order);
+  m->threshold = 3*m->chunk_size/4;
+}
+
 /**
  * lp_new - create a new linear memory pool
  * @p: pool
  * @blk: block size
  *
  * lp_new() creates a new linear memory pool resource inside the pool @p.
- * The linear pool consists of a list of memory chunks of size at least
- * @blk.
+ * The linear pool consists of a list of memory chunks of size about @blk,
+ * rounded to fit a power-of-two allocation.
  */
 linpool
 *lp_new(pool *p, uint blk)
 {
   linpool *m = ralloc(p, &lp_class);
+  uint order = lp_order(blk);
+
+  /* Prefer a slightly smaller chunk to a twice larger one */
+  if ((order > LP_MIN_ORDER) && (LP_CHUNK_CAPACITY(order - 1) >= blk - blk/8))
+    order--;
+
   m->plast = &m->first;
-  m->chunk_size = blk;
-  m->threshold = 3*blk/4;
+  lp_set_chunk_size(m, order);
   return m;
 }
 
@@ -85,7 +206,8 @@ linpool
  * associated with the &linpool and creating a new chunk of the standard
  * size (as specified during lp_new()) if the free space is too small
  * to satisfy the allocation. If @size is too large to fit in a standard
- * size chunk, an "overflow" chunk is created for it instead.
+ * size chunk, an "overflow" chunk is created for it instead. Chunks are taken
+ * from the global chunk cache when possible.
  */
 void *
 lp_alloc(linpool *m, uint size)
@@ -104,11 +226,11 @@ lp_alloc(linpool *m, uint size)
       if (size >= m->threshold)
 	{
 	  /* Too large => allocate large chunk */
-	  c = xmalloc(sizeof(struct lp_chunk) + size);
-	  m->total_large += size;
+	  c = lp_get_chunk(size);
+	  m->total_large += c->size;
+	  m->max_large = MAX(m->max_large, size);
 	  c->next = m->first_large;
 	  m->first_large = c;
-	  c->size = size;
 	}
       else
 	{
@@ -121,15 +243,14 @@ lp_alloc(linpool *m, uint size)
 	  else
 	    {
 	      /* Need to allocate a new chunk */
-	      c = xmalloc(sizeof(struct lp_chunk) + m->chunk_size);
-	      m->total += m->chunk_size;
+	      c = lp_get_chunk(m->chunk_size);
+	      m->total += c->size;
 	      *m->plast = c;
 	      m->plast = &c->next;
 	      c->next = NULL;
-	      c->size = m->chunk_size;
 	    }
 	  m->ptr = c->data + size;
-	  m->end = c->data + m->chunk_size;
+	  m->end = c->data + c->size;
 	}
       return c->data;
     }
@@ -181,40 +302,65 @@ lp_allocz(linpool *m, uint size)
  * @m: linear memory pool
  *
  * This function frees the whole contents of the given &linpool @m,
- * but leaves the pool itself.
+ * but leaves the pool itself. When large allocations were made since
+ * the last flush, the chunk size of the pool is increased so that they fit
+ * in normal chunks next time.
  */
 void
 lp_flush(linpool *m)
 {
-  struct lp_chunk *c;
+  /* Return all large chunks to the cache */
+  lp_put_chunks(m->first_large);
+  m->first_large = NULL;
+  m->total_large = 0;
 
-  /* Relink all normal chunks to free list and free all large chunks */
-  m->ptr = m->end = NULL;
-  m->current = m->first;
-  while (c = m->first_large)
+  if ((m->max_large >= m->threshold) && (m->chunk_size < LP_CHUNK_CAPACITY(LP_MAX_CHUNK_ORDER)))
     {
-      m->first_large = c->next;
-      xfree(c);
+      uint order = lp_order(m->chunk_size) + 1;
+      while ((order < LP_MAX_CHUNK_ORDER) && (3*LP_CHUNK_CAPACITY(order)/4 <= m->max_large))
+	order++;
+
+      /* Normal chunks are too small now */
+      lp_set_chunk_size(m, order);
+      lp_put_chunks(m->first);
+      m->first = NULL;
+      m->plast = &m->first;
+      m->total = 0;
     }
-  m->total_large = 0;
+  m->max_large = 0;
+
+  /* Relink all normal chunks to free list */
+  m->ptr = m->end = NULL;
+  m->current = m->first;
 }
 
 static void
 lp_free(resource *r)
 {
   linpool *m = (linpool *) r;
-  struct lp_chunk *c, *d;
 
-  for(d=m->first; d; d = c)
-    {
-      c = d->next;
-      xfree(d);
-    }
-  for(d=m->first_large; d; d = c)
-    {
-      c = d->next;
-      xfree(d);
-    }
+  lp_put_chunks(m->first);
+  lp_put_chunks(m->first_large);
+}
+
+/**
+ * lp_cache_memsize - memory held by the linpool chunk cache
+ *
+ * This function returns the amount of memory in chunks cached for
+ * reuse by linpools, which is not accounted to any pool.
+ */
+size_t
+lp_cache_memsize(void)
+{
+  size_t sum = 0;
+  uint i;
+
+  lp_cache_lock();
+  for (i = LP_MIN_ORDER; i <= LP_MAX_ORDER; i++)
+    sum += (size_t) lp_cache_count[i] << i;
+  lp_cache_unlock();
+
+  return sum;
 }
 
 static void
@@ -0,0 +1,40 @@
+/*
+ *	BIRD Library -- Prefix Encoding in NLRI Format
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: NLRI prefix encoding
+ *
+ * Routing protocols (BGP, and MRT dumps) transfer prefixes as a length byte
+ * followed by the significant bytes of the address. The functions in
+ * |lib/nlri.h| convert whole addresses at once between host and network
+ * order, using SSE2/SSSE3 or NEON where available, and clear host bits by
+ * a mask taken from a precomputed table instead of building it by shifts.
+ * Both directions always access %NLRI_MAX_LENGTH bytes, so the length of
+ * the copy does not depend on the prefix length.
+ *
+ * The mask for prefix length @l is a 16-byte window into row @l % 8 of
+ * &nlri_mask_win, starting @l / 8 bytes before the partial byte, so the
+ * table has just 264 bytes.
+ */
+
+#include "nest/bird.h"
+#include "lib/nlri.h"
+
+#define FF4	0xff, 0xff, 0xff, 0xff
+#define FF16	FF4, FF4, FF4, FF4
+#define Z4	0, 0, 0, 0
+#define Z16	Z4, Z4, Z4, Z4
+
+const byte nlri_mask_win[8][33] = {
+  { FF16, 0x00, Z16 },
+  { FF16, 0x80, Z16 },
+  { FF16, 0xc0, Z16 },
+  { FF16, 0xe0, Z16 },
+  { FF16, 0xf0, Z16 },
+  { FF16, 0xf8, Z16 },
+  { FF16, 0xfc, Z16 },
+  { FF16, 0xfe, Z16 },
+};
@@ -0,0 +1,206 @@
+/*
+ *	BIRD Library -- Prefix Encoding in NLRI Format
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_NLRI_H_
+#define _BIRD_NLRI_H_
+
+#include "lib/ip.h"
+
+#ifndef CPU_BIG_ENDIAN
+#if defined(__SSE2__)
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+#define NLRI_SSE
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define NLRI_NEON
+#endif
+#endif
+
+/*
+ * Prefixes are encoded as a length byte followed by the significant bytes
+ * of the address [RFC 4271 4.3]. Host bits of the last byte are zero.
+ */
+
+#define NLRI_MAX_LENGTH		(1 + BITS_PER_IP_ADDRESS / 8)
+
+#define NLRI_SHORT		-1	/* Prefix is truncated */
+#define NLRI_BAD_LENGTH		-2	/* Prefix length is out of range */
+
+/* Windows of masks in network order, see nlri_mask() */
+extern const byte nlri_mask_win[8][33];
+
+/* Mask covering first @pxlen bits, in network order */
+static inline const byte *
+nlri_mask(uint pxlen)
+{
+  return nlri_mask_win[pxlen & 7] + 16 - (pxlen >> 3);
+}
+
+#ifdef IPV6
+
+#if defined(NLRI_SSE)
+
+static inline __m128i
+nlri_bswap(__m128i x)
+{
+#ifdef __SSSE3__
+  return _mm_shuffle_epi8(x, _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3));
+#else
+  x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1);
+  return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+#endif
+}
+
+static inline void
+nlri_put_addr(byte *buf, ip_addr a, uint pxlen)
+{
+  __m128i v = nlri_bswap(_mm_loadu_si128((__m128i *) &a));
+  v = _mm_and_si128(v, _mm_loadu_si128((__m128i *) nlri_mask(pxlen)));
+  _mm_storeu_si128((__m128i *) buf, v);
+}
+
+static inline ip_addr
+nlri_get_addr(const byte *buf, uint pxlen)
+{
+  ip_addr a;
+  __m128i v = _mm_loadu_si128((__m128i *) buf);
+  v = _mm_and_si128(v, _mm_loadu_si128((__m128i *) nlri_mask(pxlen)));
+  _mm_storeu_si128((__m128i *) &a, nlri_bswap(v));
+  return a;
+}
+
+#elif defined(NLRI_NEON)
+
+static inline void
+nlri_put_addr(byte *buf, ip_addr a, uint pxlen)
+{
+  uint8x16_t v = vrev32q_u8(vld1q_u8((const u8 *) &a));
+  vst1q_u8(buf, vandq_u8(v, vld1q_u8(nlri_mask(pxlen))));
+}
+
+static inline ip_addr
+nlri_get_addr(const byte *buf, uint pxlen)
+{
+  ip_addr a;
+  uint8x16_t v = vandq_u8(vld1q_u8(buf), vld1q_u8(nlri_mask(pxlen)));
+  vst1q_u8((u8 *) &a, vrev32q_u8(v));
+  return a;
+}
+
+#else
+
+static inline void
+nlri_put_addr(byte *buf, ip_addr a, uint pxlen)
+{
+  const byte *m = nlri_mask(pxlen);
+  uint i;
+
+  a = ip6_hton(a);
+  memcpy(buf, &a, 16);
+  for (i = 0; i < 16; i++)
+    buf[i] &= m[i];
+}
+
+static inline ip_addr
+nlri_get_addr(const byte *buf, uint pxlen)
+{
+  const byte *m = nlri_mask(pxlen);
+  byte b[16];
+  ip_addr a;
+  uint i;
+
+  for (i = 0; i < 16; i++)
+    b[i] = buf[i] & m[i];
+  memcpy(&a, b, 16);
+  return ip6_ntoh(a);
+}
+
+#endif
+
+#else	/* IPv4 */
+
+static inline void
+nlri_put_addr(byte *buf, ip_addr a, uint pxlen)
+{
+  u32 m, v = htonl(ipa_to_u32(a));
+  memcpy(&m, nlri_mask(pxlen), 4);
+  v &= m;
+  memcpy(buf, &v, 4);
+}
+
+static inline ip_addr
+nlri_get_addr(const byte *buf, uint pxlen)
+{
+  u32 m, v;
+  memcpy(&m, nlri_mask(pxlen), 4);
+  memcpy(&v, buf, 4);
+  return ipa_from_u32(ntohl(v & m));
+}
+
+#endif
+
+/**
+ * nlri_put_prefix - encode a prefix
+ * @buf: output buffer, must have room for %NLRI_MAX_LENGTH bytes
+ * @px: prefix
+ * @pxlen: prefix length
+ *
+ * Result: number of bytes used.
+ */
+static inline uint
+nlri_put_prefix(byte *buf, ip_addr px, uint pxlen)
+{
+  buf[0] = pxlen;
+  nlri_put_addr(buf + 1, px, pxlen);
+  return 1 + (pxlen + 7) / 8;
+}
+
+/**
+ * nlri_get_prefix - decode a prefix
+ * @buf: input buffer
+ * @len: length of data in @buf
+ * @px: decoded prefix, with host bits cleared
+ * @pxlen: decoded prefix length
+ *
+ * Result: number of bytes consumed, or a negative error code
+ * (%NLRI_SHORT or %NLRI_BAD_LENGTH).
+ */
+static inline int
+nlri_get_prefix(const byte *buf, uint len, ip_addr *px, int *pxlen)
+{
+  byte tmp[NLRI_MAX_LENGTH - 1];
+  uint b, q;
+
+  if (len < 1)
+    return NLRI_SHORT;
+
+  b = buf[0];
+  if (b > BITS_PER_IP_ADDRESS)
+    return NLRI_BAD_LENGTH;
+
+  q = (b + 7) / 8;
+  if (len < q + 1)
+    return NLRI_SHORT;
+
+  /* The whole address may be read directly unless it is at the very end */
+  if (len >= NLRI_MAX_LENGTH)
+    *px = nlri_get_addr(buf + 1, b);
+  else
+    {
+      memset(tmp, 0, sizeof(tmp));
+      memcpy(tmp, buf + 1, q);
+      *px = nlri_get_addr(tmp, b);
+    }
+
+  *pxlen = b;
+  return q + 1;
+}
+
+#endif
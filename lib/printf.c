@@ -123,6 +123,8 @@ static char * number(char * str, long num, int base, int size, int precision,
  * format specifiers: |%I| for formatting of IP addresses (any non-zero
  * width is automatically replaced by standard IP address width which
  * depends on whether we use IPv4 or IPv6; |%#I| gives hexadecimal format),
+ * |%N| for IP prefixes (takes two arguments, IP address and prefix length,
+ * and formats them as address/length),
  * |%R| for Router / Network ID (u32 value printed as IPv4 address)
  * and |%m| resp. |%M| for error messages (uses strerror() to translate @errno code to
  * message text). On the other hand, it doesn't support floating
@@ -139,7 +141,8 @@ int bvsnprintf(char *buf, int size, const char *fmt, va_list args)
 	u32 x;
 	char *str, *start;
 	const char *s;
-	char ipbuf[STD_ADDRESS_P_LENGTH+1];
+	char ipbuf[STD_PREFIX_P_LENGTH+1];
+	ip_addr ip;
 	struct iface *iface;
 
 	int flags;		/* flags to number() */
@@ -243,6 +246,7 @@ int bvsnprintf(char *buf, int size, const char *fmt, va_list args)
 
 		str:
 			len = strlen(s);
+		str_len:
 			if (precision >= 0 && len > precision)
 				len = precision;
 			if (len > size)
@@ -283,14 +287,23 @@ int bvsnprintf(char *buf, int size, const char *fmt, va_list args)
 		/* IP address */
 		case 'I':
 			if (flags & SPECIAL)
-				ipa_ntox(va_arg(args, ip_addr), ipbuf);
+				len = ipa_ntox(va_arg(args, ip_addr), ipbuf) - ipbuf;
 			else {
-				ipa_ntop(va_arg(args, ip_addr), ipbuf);
+				len = ipa_ntop(va_arg(args, ip_addr), ipbuf) - ipbuf;
 				if (field_width == 1)
 					field_width = STD_ADDRESS_P_LENGTH;
 			}
 			s = ipbuf;
-			goto str;
+			goto str_len;
+
+		/* IP prefix, address and length */
+		case 'N':
+			ip = va_arg(args, ip_addr);
+			len = ipa_ntop_px(ip, va_arg(args, int), ipbuf) - ipbuf;
+			if (field_width == 1)
+				field_width = STD_PREFIX_P_LENGTH;
+			s = ipbuf;
+			goto str_len;
 
 		/* Interface scope after link-local IP address */
 		case 'J':
@@ -310,13 +323,9 @@ int bvsnprintf(char *buf, int size, const char *fmt, va_list args)
 		/* Router/Network ID - essentially IPv4 address in u32 value */
 		case 'R':
 			x = va_arg(args, u32);
-			bsprintf(ipbuf, "%d.%d.%d.%d",
-				 ((x >> 24) & 0xff),
-				 ((x >> 16) & 0xff),
-				 ((x >> 8) & 0xff),
-				 (x & 0xff));
+			len = ip4_ntop(ip4_from_u32(x), ipbuf) - ipbuf;
 			s = ipbuf;
-			goto str;
+			goto str_len;
 
 		/* integer number formats - set up the flags and "break" */
 		case 'o':
@@ -0,0 +1,65 @@
+/*
+ *	BIRD Library -- Static Tracing Probes
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_PROBE_H_
+#define _BIRD_PROBE_H_
+
+/*
+ * Static probes for bpftrace, perf and SystemTap, all in the provider 'bird'.
+ * With --enable-usdt, each probe compiles to a single NOP and a note in the
+ * ELF file describing locations of its arguments, which tracers replace by
+ * a breakpoint when attached. Arguments should be just cheap values already at
+ * hand, as they are computed even when nothing is attached. Without the
+ * option, probes compile to nothing.
+ *
+ * Paired probes are named *_entry and *_return, so durations are measured by
+ * the difference of their timestamps in the same thread. Names of protocols,
+ * tables and filters are passed as C strings, prefixes as a pointer to
+ * ip_addr and a length.
+ *
+ *   rte_update_entry	protocol, prefix, pxlen, route (NULL for withdraw)
+ *   rte_update_return	protocol
+ *   rte_announce	table, RA_* type, prefix, pxlen
+ *   filter_entry	filter
+ *   filter_return	filter, F_* result
+ *   bgp_rx_update_entry protocol, message length
+ *   bgp_rx_update_return protocol
+ *   bgp_fire_tx_entry	protocol
+ *   bgp_fire_tx_return	protocol, bytes passed to the socket
+ *   ospf_rt_spf_entry	protocol, whether only external routes are calculated
+ *   ospf_rt_spf_return	protocol
+ *   nl_send_route	protocol, prefix, pxlen, whether an old route is replaced
+ *   krt_prune_entry	protocol, networks in the table
+ *   krt_prune_return	protocol
+ *   timer_entry	hook (also for precise timers)
+ *   timer_return	hook
+ *   event_entry	hook
+ *   event_return	hook
+ *   ev_run_list_entry	event list
+ *   ev_run_list_return	event list
+ */
+
+#ifdef CONFIG_USDT
+
+#include <sys/sdt.h>
+
+#define PROBE(name)			DTRACE_PROBE(bird, name)
+#define PROBE1(name, a)			DTRACE_PROBE1(bird, name, a)
+#define PROBE2(name, a, b)		DTRACE_PROBE2(bird, name, a, b)
+#define PROBE3(name, a, b, c)		DTRACE_PROBE3(bird, name, a, b, c)
+#define PROBE4(name, a, b, c, d)	DTRACE_PROBE4(bird, name, a, b, c, d)
+
+#else
+
+#define PROBE(name)			do { } while (0)
+#define PROBE1(name, a)			do { } while (0)
+#define PROBE2(name, a, b)		do { } while (0)
+#define PROBE3(name, a, b, c)		do { } while (0)
+#define PROBE4(name, a, b, c, d)	do { } while (0)
+
+#endif
+
+#endif
@@ -14,6 +14,25 @@
 #include "lib/resource.h"
 #include "lib/string.h"
 
+/*
+ * Resources may be allocated and freed by other threads than the main one,
+ * so the lists of resources in pools are protected by a global lock. The lock
+ * is held just during the list operations, the memory itself is allocated by
+ * the system allocator, which keeps per-thread caches on its own. Note that
+ * other operations with a pool (like dumping or freeing it) must not run
+ * concurrently with allocations from the pool.
+ */
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+static pthread_mutex_t resource_mutex = PTHREAD_MUTEX_INITIALIZER;
+static inline void res_lock(void) { pthread_mutex_lock(&resource_mutex); }
+static inline void res_unlock(void) { pthread_mutex_unlock(&resource_mutex); }
+#else
+static inline void res_lock(void) { }
+static inline void res_unlock(void) { }
+#endif
+
 /**
  * DOC: Resource pools
  *
@@ -32,6 +51,7 @@ struct pool {
   resource r;
   list inside;
   char *name;
+  struct cpu_account *acct;		/* Inherited by sub-pools, see rp_set_account() */
 };
 
 static void pool_dump(resource *);
@@ -65,10 +85,36 @@ rp_new(pool *p, char *name)
 {
   pool *z = ralloc(p, &pool_class);
   z->name = name;
+  z->acct = p ? p->acct : NULL;
   init_list(&z->inside);
   return z;
 }
 
+/**
+ * rp_set_account - set CPU time accounting of a pool
+ * @p: resource pool
+ * @a: account to charge
+ *
+ * CPU time of hooks of sockets, timers and events allocated from @p or its
+ * sub-pools created later is charged to @a, when CPU accounting is enabled.
+ * Objects allocated before are not affected.
+ */
+void
+rp_set_account(pool *p, struct cpu_account *a)
+{
+  p->acct = a;
+}
+
+/**
+ * rp_account - get CPU time accounting of a pool
+ * @p: resource pool, may be NULL
+ */
+struct cpu_account *
+rp_account(pool *p)
+{
+  return p ? p->acct : NULL;
+}
+
 static void
 pool_free(resource *P)
 {
@@ -136,9 +182,11 @@ void rmove(void *res, pool *p)
 
   if (r)
     {
+      res_lock();
       if (r->n.next)
         rem_node(&r->n);
       add_tail(&p->inside, &r->n);
+      res_unlock();
     }
 }
 
@@ -161,7 +209,11 @@ rfree(void *res)
     return;
 
   if (r->n.next)
-    rem_node(&r->n);
+    {
+      res_lock();
+      rem_node(&r->n);
+      res_unlock();
+    }
   r->class->free(r);
   xfree(r);
 }
@@ -221,7 +273,11 @@ ralloc(pool *p, struct resclass *c)
 
   r->class = c;
   if (p)
-    add_tail(&p->inside, &r->n);
+    {
+      res_lock();
+      add_tail(&p->inside, &r->n);
+      res_unlock();
+    }
   return r;
 }
 
@@ -339,8 +395,10 @@ mb_alloc(pool *p, unsigned size)
   struct mblock *b = xmalloc(sizeof(struct mblock) + size);
 
   b->r.class = &mb_class;
-  add_tail(&p->inside, &b->r.n);
   b->size = size;
+  res_lock();
+  add_tail(&p->inside, &b->r.n);
+  res_unlock();
   return b->data;
 }
 
@@ -385,6 +443,8 @@ mb_realloc(void *m, unsigned size)
 {
   struct mblock *ob = NULL;
 
+  /* The node is relinked, so the lock is held during realloc() */
+  res_lock();
   if (m)
     {
       ob = SKIP_BACK(struct mblock, data, m);
@@ -394,6 +454,7 @@ mb_realloc(void *m, unsigned size)
 
   struct mblock *b = xrealloc(ob, sizeof(struct mblock) + size);
   replace_node(&b->r.n, &b->r.n);
+  res_unlock();
   b->size = size;
   return b->data;
 }
@@ -48,6 +48,21 @@ void *ralloc(pool *, struct resclass *);
 
 extern pool root_pool;
 
+/* CPU time accounting, see io_log_event() */
+
+struct cpu_account {
+  u64 time;				/* CPU time of hooks run for the owner (ns) */
+  u64 last;				/* @time at the last update of averages */
+  u32 avg1, avg5;			/* Moving averages of CPU usage, 1.0 = CPU_FIXED_1 */
+};
+
+#define CPU_FSHIFT		11
+#define CPU_FIXED_1		(1 << CPU_FSHIFT)
+
+void rp_set_account(pool *p, struct cpu_account *a);	/* Account hooks of new sockets, timers and events */
+struct cpu_account *rp_account(pool *p);
+void cpu_account_drop(struct cpu_account *a);	/* Before @a is freed (sysdep) */
+
 /* Normal memory blocks */
 
 void *mb_alloc(pool *, unsigned size);
@@ -64,6 +79,7 @@ void *lp_alloc(linpool *, unsigned size);	/* Aligned */
 void *lp_allocu(linpool *, unsigned size);	/* Unaligned */
 void *lp_allocz(linpool *, unsigned size);	/* With clear */
 void lp_flush(linpool *);			/* Free everything, but leave linpool */
+size_t lp_cache_memsize(void);		/* Memory in cached free chunks */
 
 /* Slabs */
 
@@ -72,6 +88,7 @@ typedef struct slab slab;
 slab *sl_new(pool *, unsigned size);
 void *sl_alloc(slab *);
 void sl_free(slab *, void *);
+void sl_free_bulk(slab *, void **, uint);
 
 /*
  * Low-level memory allocation functions, please don't use
@@ -80,6 +97,22 @@ void sl_free(slab *, void *);
 
 void buffer_realloc(void **buf, unsigned *size, unsigned need, unsigned item_size);
 
+/* Pages for slabs, see sysdep/unix/alloc.c */
+
+#define PAGE_ALLOC_SIZE		4096
+#define PAGE_CHUNK_SIZE		(2 << 20)	/* Huge page on most platforms */
+
+struct page_stats {
+  uint chunks;				/* Mapped chunks of PAGE_CHUNK_SIZE */
+  uint used;				/* Allocated pages */
+  uint free;				/* Free pages in partially used chunks */
+  uint spare;				/* Free pages in the spare chunks */
+};
+
+void *alloc_page(void);
+void free_page(void *);
+void page_alloc_stats(struct page_stats *s);
+
 
 #ifdef HAVE_LIBDMALLOC
 /*
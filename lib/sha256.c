@@ -0,0 +1,329 @@
+/*
+ *	BIRD Library -- SHA-256 and HMAC-SHA-256
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/*
+ * SHA-256 is defined in FIPS 180-4, HMAC in RFC 2104. Blocks are compressed
+ * by a kernel chosen on the first use. On x86-64, SHA extensions are used
+ * when detected at runtime, they are several times faster than the portable
+ * code. Full blocks are compressed directly from the data, without copying.
+ */
+
+#include "nest/bird.h"
+#include "lib/sha256.h"
+#include "lib/unaligned.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef void (*sha256_kernel)(u32 *h, const byte *data, uint blocks);
+
+static const u32 sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const u32 sha256_iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)	((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z)	(((x) & (y)) | ((z) & ((x) | (y))))
+#define S0(x)		(ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x)		(ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define s0(x)		(ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define s1(x)		(ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+static void
+sha256_blocks_generic(u32 *h, const byte *data, uint blocks)
+{
+  u32 w[64];
+  uint i;
+
+  for (; blocks; blocks--, data += SHA256_BLOCK_SIZE)
+  {
+    for (i = 0; i < 16; i++)
+      w[i] = get_u32((void *) (data + 4 * i));
+
+    for (i = 16; i < 64; i++)
+      w[i] = s1(w[i-2]) + w[i-7] + s0(w[i-15]) + w[i-16];
+
+    u32 a = h[0], b = h[1], c = h[2], d = h[3];
+    u32 e = h[4], f = h[5], g = h[6], k = h[7];
+
+    for (i = 0; i < 64; i++)
+    {
+      u32 t1 = k + S1(e) + CH(e, f, g) + sha256_k[i] + w[i];
+      u32 t2 = S0(a) + MAJ(a, b, c);
+      k = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+  }
+}
+
+#ifdef SHA256_X86
+
+/*
+ * The SHA extensions keep the state in two vectors, ABEF and CDGH, and do two
+ * rounds per instruction. Message words are scheduled four at once.
+ */
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_blocks_shani(u32 *h, const byte *data, uint blocks)
+{
+  const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i st0, st1, tmp;
+  uint i;
+
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) h), 0xb1);
+  st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (h + 4)), 0x1b);
+  st0 = _mm_alignr_epi8(tmp, st1, 8);
+  st1 = _mm_blend_epi16(st1, tmp, 0xf0);
+
+  for (; blocks; blocks--, data += SHA256_BLOCK_SIZE)
+  {
+    __m128i abef = st0, cdgh = st1;
+    __m128i w0, w1, w2, w3, m;
+
+    w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 0)), bswap);
+    w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), bswap);
+    w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), bswap);
+    w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), bswap);
+
+    for (i = 0; i < 64; i += 16)
+    {
+#define SHA256_ROUNDS4(w, j) do {						\
+      m = _mm_add_epi32(w, _mm_loadu_si128((const __m128i *) (sha256_k + i + j)));	\
+      st1 = _mm_sha256rnds2_epu32(st1, st0, m);					\
+      st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(m, 0x0e)); } while (0)
+
+#define SHA256_SCHEDULE(wa, wb, wc, wd)						\
+      wa = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(wa, wb),	\
+					      _mm_alignr_epi8(wd, wc, 4)), wd)
+
+      SHA256_ROUNDS4(w0, 0);
+      SHA256_ROUNDS4(w1, 4);
+      SHA256_ROUNDS4(w2, 8);
+      SHA256_ROUNDS4(w3, 12);
+
+      if (i < 48)
+      {
+	SHA256_SCHEDULE(w0, w1, w2, w3);
+	SHA256_SCHEDULE(w1, w2, w3, w0);
+	SHA256_SCHEDULE(w2, w3, w0, w1);
+	SHA256_SCHEDULE(w3, w0, w1, w2);
+      }
+
+#undef SHA256_ROUNDS4
+#undef SHA256_SCHEDULE
+    }
+
+    st0 = _mm_add_epi32(st0, abef);
+    st1 = _mm_add_epi32(st1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(st0, 0x1b);
+  st1 = _mm_shuffle_epi32(st1, 0xb1);
+  _mm_storeu_si128((__m128i *) h, _mm_blend_epi16(tmp, st1, 0xf0));
+  _mm_storeu_si128((__m128i *) (h + 4), _mm_alignr_epi8(st1, tmp, 8));
+}
+
+static int
+sha256_shani_available(void)
+{
+  uint a, b, c, d;
+
+  if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1))
+    return 0;
+
+  return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA);
+}
+
+#endif
+
+static sha256_kernel sha256_blocks_fn;
+
+static void
+sha256_blocks(u32 *h, const byte *data, uint blocks)
+{
+  if (!sha256_blocks_fn)
+  {
+#ifdef SHA256_X86
+    if (sha256_shani_available())
+      sha256_blocks_fn = sha256_blocks_shani;
+    else
+#endif
+      sha256_blocks_fn = sha256_blocks_generic;
+  }
+
+  sha256_blocks_fn(h, data, blocks);
+}
+
+
+/**
+ * sha256_init - initialize SHA-256 context
+ * @ctx: the context
+ */
+void
+sha256_init(struct sha256_context *ctx)
+{
+  memcpy(ctx->h, sha256_iv, sizeof(ctx->h));
+  ctx->len = 0;
+}
+
+/**
+ * sha256_update - process data to SHA-256 context
+ * @ctx: the context
+ * @buf: data buffer
+ * @len: data length
+ *
+ * It may be called multiple times for consecutive parts of the data.
+ */
+void
+sha256_update(struct sha256_context *ctx, const byte *buf, uint len)
+{
+  uint used = ctx->len % SHA256_BLOCK_SIZE;
+
+  ctx->len += len;
+
+  if (used)
+  {
+    uint n = MIN(len, SHA256_BLOCK_SIZE - used);
+    memcpy(ctx->buf + used, buf, n);
+    buf += n;
+    len -= n;
+
+    if (used + n < SHA256_BLOCK_SIZE)
+      return;
+
+    sha256_blocks(ctx->h, ctx->buf, 1);
+  }
+
+  if (len >= SHA256_BLOCK_SIZE)
+  {
+    uint blocks = len / SHA256_BLOCK_SIZE;
+    sha256_blocks(ctx->h, buf, blocks);
+    buf += blocks * SHA256_BLOCK_SIZE;
+    len -= blocks * SHA256_BLOCK_SIZE;
+  }
+
+  memcpy(ctx->buf, buf, len);
+}
+
+/**
+ * sha256_final - compute the SHA-256 hash
+ * @ctx: the context
+ * @hash: buffer for %SHA256_SIZE bytes of the hash
+ *
+ * The context must be initialized again before further use.
+ */
+void
+sha256_final(struct sha256_context *ctx, byte *hash)
+{
+  uint used = ctx->len % SHA256_BLOCK_SIZE;
+  u64 bits = ctx->len * 8;
+  uint i;
+
+  ctx->buf[used++] = 0x80;
+
+  if (used > SHA256_BLOCK_SIZE - 8)
+  {
+    memset(ctx->buf + used, 0, SHA256_BLOCK_SIZE - used);
+    sha256_blocks(ctx->h, ctx->buf, 1);
+    used = 0;
+  }
+
+  memset(ctx->buf + used, 0, SHA256_BLOCK_SIZE - 8 - used);
+  put_u32(ctx->buf + SHA256_BLOCK_SIZE - 8, bits >> 32);
+  put_u32(ctx->buf + SHA256_BLOCK_SIZE - 4, bits);
+  sha256_blocks(ctx->h, ctx->buf, 1);
+
+  for (i = 0; i < 8; i++)
+    put_u32(hash + 4 * i, ctx->h[i]);
+}
+
+/**
+ * sha256_hmac_key - prepare a key for HMAC-SHA-256
+ * @key: the prepared key
+ * @data: the key
+ * @len: length of the key
+ *
+ * Keys longer than the block size are hashed first, as specified by RFC 2104.
+ * Protocols that treat keys differently (e.g. RFC 5709) must do it before.
+ */
+void
+sha256_hmac_key(struct sha256_hmac_key *key, const byte *data, uint len)
+{
+  byte pad[SHA256_BLOCK_SIZE];
+  uint i;
+
+  memset(pad, 0, sizeof(pad));
+
+  if (len > SHA256_BLOCK_SIZE)
+  {
+    struct sha256_context ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, pad);
+  }
+  else
+    memcpy(pad, data, len);
+
+  for (i = 0; i < SHA256_BLOCK_SIZE; i++)
+    pad[i] ^= 0x36;
+
+  memcpy(key->inner, sha256_iv, sizeof(key->inner));
+  sha256_blocks(key->inner, pad, 1);
+
+  for (i = 0; i < SHA256_BLOCK_SIZE; i++)
+    pad[i] ^= 0x36 ^ 0x5c;
+
+  memcpy(key->outer, sha256_iv, sizeof(key->outer));
+  sha256_blocks(key->outer, pad, 1);
+}
+
+/**
+ * sha256_hmac_init - initialize context for HMAC-SHA-256
+ * @ctx: the context
+ * @key: key prepared by sha256_hmac_key()
+ */
+void
+sha256_hmac_init(struct sha256_context *ctx, const struct sha256_hmac_key *key)
+{
+  memcpy(ctx->h, key->inner, sizeof(ctx->h));
+  ctx->len = SHA256_BLOCK_SIZE;
+}
+
+/**
+ * sha256_hmac_final - compute the HMAC-SHA-256 MAC
+ * @ctx: the context, initialized by sha256_hmac_init()
+ * @key: the same key as for sha256_hmac_init()
+ * @mac: buffer for %SHA256_SIZE bytes of the MAC
+ */
+void
+sha256_hmac_final(struct sha256_context *ctx, const struct sha256_hmac_key *key, byte *mac)
+{
+  byte inner[SHA256_SIZE];
+
+  sha256_final(ctx, inner);
+
+  memcpy(ctx->h, key->outer, sizeof(ctx->h));
+  ctx->len = SHA256_BLOCK_SIZE;
+  sha256_update(ctx, inner, SHA256_SIZE);
+  sha256_final(ctx, mac);
+}
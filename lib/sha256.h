@@ -0,0 +1,49 @@
+/*
+ *	BIRD Library -- SHA-256 and HMAC-SHA-256
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: SHA-256 and HMAC-SHA-256
+ *
+ * To compute the SHA-256 hash of data, initialize the context by
+ * sha256_init(), process the data by sha256_update() and get the hash by
+ * sha256_final().
+ *
+ * HMAC-SHA-256 uses a key prepared in advance by sha256_hmac_key(), which
+ * keeps hash states after the inner and the outer padded key. The context is
+ * initialized by sha256_hmac_init(), the data are processed by sha256_update()
+ * and the MAC is computed by sha256_hmac_final(). Therefore, each MAC costs
+ * just one compression of a block besides blocks of the data.
+ */
+
+#ifndef _BIRD_SHA256_H_
+#define _BIRD_SHA256_H_
+
+#include "nest/bird.h"
+
+#define SHA256_SIZE		32
+#define SHA256_BLOCK_SIZE	64
+
+struct sha256_context
+{
+  u32 h[8];
+  u64 len;				/* Processed bytes */
+  byte buf[SHA256_BLOCK_SIZE];
+};
+
+struct sha256_hmac_key
+{
+  u32 inner[8], outer[8];		/* States after the padded key blocks */
+};
+
+void sha256_init(struct sha256_context *ctx);
+void sha256_update(struct sha256_context *ctx, const byte *buf, uint len);
+void sha256_final(struct sha256_context *ctx, byte *hash);
+
+void sha256_hmac_key(struct sha256_hmac_key *key, const byte *data, uint len);
+void sha256_hmac_init(struct sha256_context *ctx, const struct sha256_hmac_key *key);
+void sha256_hmac_final(struct sha256_context *ctx, const struct sha256_hmac_key *key, byte *mac);
+
+#endif
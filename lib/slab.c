@@ -22,6 +22,18 @@
  * newly allocated and freed blocks with a special pattern to make detection
  * of use of uninitialized or already freed memory easier.
  *
+ * Memory of slabs is allocated by pages from the page allocator (see
+ * alloc_page()), completely free pages are returned there, except for one
+ * per slab.
+ *
+ * When BIRD is built with threads, each thread allocates from and frees to
+ * its own small cache of objects (a magazine) per slab, so the common case
+ * needs no locking. The slab itself is locked just when the magazine is
+ * refilled or flushed. If the slab is busy during a flush, the objects are
+ * pushed to a lock-free list of returned objects, which is drained by the
+ * next thread holding the lock. Objects may be freed by another thread than
+ * the one which allocated them.
+ *
  * Example: Nodes of a FIB are allocated from a per-FIB Slab.
  */
 
@@ -32,6 +44,10 @@
 #include "lib/resource.h"
 #include "lib/string.h"
 
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
 #undef FAKE_SLAB	/* Turn on if you want to debug memory allocations */
 
 #ifdef DEBUGGING
@@ -97,6 +113,13 @@ sl_free(slab *s, void *oo)
   xfree(o);
 }
 
+void
+sl_free_bulk(slab *s, void **objs, uint n)
+{
+  while (n--)
+    sl_free(s, *objs++);
+}
+
 static void
 slab_free(resource *r)
 {
@@ -139,13 +162,29 @@ slab_memsize(resource *r)
  *  Real efficient version.
  */
 
-#define SLAB_SIZE 4096
+#define SLAB_SIZE PAGE_ALLOC_SIZE
 #define MAX_EMPTY_HEADS 1
 
+#ifdef USE_PTHREADS
+#define SL_MAGAZINE_SIZE 32		/* Objects cached per thread and slab */
+#define SL_MAX_THREADS 16		/* Other threads use the slab directly */
+
+struct sl_magazine {
+  uint count;
+  void *objs[SL_MAGAZINE_SIZE];
+};
+#endif
+
 struct slab {
   resource r;
   uint obj_size, head_size, objs_per_slab, num_empty_heads, data_size;
+  uint num_objs;			/* Allocated objects incl. cached ones, for debug dumps */
   list empty_heads, partial_heads, full_heads;
+#ifdef USE_PTHREADS
+  pthread_mutex_t lock;			/* Protects all the fields above */
+  struct sl_obj *returned;		/* Objects freed while the slab was locked */
+  struct sl_magazine *mag[SL_MAX_THREADS]; /* Per-thread caches */
+#endif
 };
 
 static struct resclass sl_class = {
@@ -202,16 +241,22 @@ sl_new(pool *p, uint size)
   if (!s->objs_per_slab)
     bug("Slab: object too large");
   s->num_empty_heads = 0;
+  s->num_objs = 0;
   init_list(&s->empty_heads);
   init_list(&s->partial_heads);
   init_list(&s->full_heads);
+#ifdef USE_PTHREADS
+  pthread_mutex_init(&s->lock, NULL);
+  s->returned = NULL;
+  memset(s->mag, 0, sizeof(s->mag));
+#endif
   return s;
 }
 
 static struct sl_head *
 sl_new_head(slab *s)
 {
-  struct sl_head *h = xmalloc(SLAB_SIZE);
+  struct sl_head *h = alloc_page();
   struct sl_obj *o = (struct sl_obj *)((byte *)h+s->head_size);
   struct sl_obj *no;
   uint n = s->objs_per_slab;
@@ -228,15 +273,8 @@ sl_new_head(slab *s)
   return h;
 }
 
-/**
- * sl_alloc - allocate an object from Slab
- * @s: slab
- *
- * sl_alloc() allocates space for a single object from the
- * Slab and returns a pointer to the object.
- */
-void *
-sl_alloc(slab *s)
+static void *
+sl_alloc_locked(slab *s)
 {
   struct sl_head *h;
   struct sl_obj *o;
@@ -251,9 +289,7 @@ okay:
     goto full_partial;
   h->first_free = o->u.next;
   h->num_full++;
-#ifdef POISON
-  memset(o->u.data, 0xcd, s->data_size);
-#endif
+  s->num_objs++;
   return o->u.data;
 
 full_partial:
@@ -275,30 +311,20 @@ no_partial:
   goto okay;
 }
 
-/**
- * sl_free - return a free object back to a Slab
- * @s: slab
- * @oo: object returned by sl_alloc()
- *
- * This function frees memory associated with the object @oo
- * and returns it back to the Slab @s.
- */
-void
-sl_free(slab *s, void *oo)
+static void
+sl_free_locked(slab *s, void *oo)
 {
   struct sl_obj *o = SKIP_BACK(struct sl_obj, u.data, oo);
   struct sl_head *h = o->slab;
 
-#ifdef POISON
-  memset(oo, 0xdb, s->data_size);
-#endif
   o->u.next = h->first_free;
   h->first_free = o;
+  s->num_objs--;
   if (!--h->num_full)
     {
       rem_node(&h->n);
       if (s->num_empty_heads >= MAX_EMPTY_HEADS)
-	xfree(h);
+	free_page(h);
       else
 	{
 	  add_head(&s->empty_heads, &h->n);
@@ -312,6 +338,219 @@ sl_free(slab *s, void *oo)
     }
 }
 
+static void
+sl_free_bulk_locked(slab *s, void **objs, uint n)
+{
+  struct sl_head *h;
+  struct sl_obj *o;
+  int was_full;
+  uint k;
+
+  while (n)
+    {
+      h = SKIP_BACK(struct sl_obj, u.data, *objs)->slab;
+      was_full = !h->first_free;
+
+      for (k = 0; n && ((o = SKIP_BACK(struct sl_obj, u.data, *objs))->slab == h); k++, objs++, n--)
+	{
+	  o->u.next = h->first_free;
+	  h->first_free = o;
+	}
+
+      s->num_objs -= k;
+      if (!(h->num_full -= k))
+	{
+	  rem_node(&h->n);
+	  if (s->num_empty_heads >= MAX_EMPTY_HEADS)
+	    free_page(h);
+	  else
+	    {
+	      add_head(&s->empty_heads, &h->n);
+	      s->num_empty_heads++;
+	    }
+	}
+      else if (was_full)
+	{
+	  rem_node(&h->n);
+	  add_head(&s->partial_heads, &h->n);
+	}
+    }
+}
+
+#ifdef USE_PTHREADS
+
+static uint sl_threads;			/* Number of threads with a slot */
+static __thread uint sl_thread_slot;	/* Slot of this thread plus one, 0 if not assigned */
+
+static inline struct sl_magazine *
+sl_magazine(slab *s)
+{
+  if (!sl_thread_slot)
+    sl_thread_slot = __atomic_add_fetch(&sl_threads, 1, __ATOMIC_RELAXED);
+
+  uint slot = sl_thread_slot - 1;
+  if (slot >= SL_MAX_THREADS)
+    return NULL;
+
+  /* Only this thread ever touches its slot */
+  if (!s->mag[slot])
+    {
+      s->mag[slot] = xmalloc(sizeof(struct sl_magazine));
+      s->mag[slot]->count = 0;
+    }
+
+  return s->mag[slot];
+}
+
+static inline void sl_lock(slab *s) { pthread_mutex_lock(&s->lock); }
+
+/* Must be called with the slab locked */
+static void
+sl_unlock(slab *s)
+{
+  struct sl_obj *o = __atomic_exchange_n(&s->returned, NULL, __ATOMIC_ACQUIRE);
+  struct sl_obj *next;
+
+  for (; o; o = next)
+    {
+      next = o->u.next;
+      sl_free_locked(s, o->u.data);
+    }
+
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void
+sl_refill(slab *s, struct sl_magazine *m)
+{
+  sl_lock(s);
+  while (m->count < SL_MAGAZINE_SIZE / 2)
+    m->objs[m->count++] = sl_alloc_locked(s);
+  sl_unlock(s);
+}
+
+static void
+sl_flush(slab *s, struct sl_magazine *m)
+{
+  uint n = SL_MAGAZINE_SIZE / 2;
+  void **objs = m->objs + m->count - n;
+  m->count -= n;
+
+  /* Never wait for the lock here, just pass the objects to its holder */
+  if (!pthread_mutex_trylock(&s->lock))
+    {
+      sl_free_bulk_locked(s, objs, n);
+      sl_unlock(s);
+      return;
+    }
+
+  struct sl_obj *first = SKIP_BACK(struct sl_obj, u.data, objs[0]);
+  struct sl_obj *last = first;
+  for (uint i = 1; i < n; i++)
+    last = last->u.next = SKIP_BACK(struct sl_obj, u.data, objs[i]);
+
+  last->u.next = __atomic_load_n(&s->returned, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&s->returned, &last->u.next, first, 1,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+}
+
+#else
+
+static inline void sl_lock(slab *s UNUSED) { }
+static inline void sl_unlock(slab *s UNUSED) { }
+
+#endif
+
+/**
+ * sl_alloc - allocate an object from Slab
+ * @s: slab
+ *
+ * sl_alloc() allocates space for a single object from the
+ * Slab and returns a pointer to the object.
+ */
+void *
+sl_alloc(slab *s)
+{
+  void *o;
+
+#ifdef USE_PTHREADS
+  struct sl_magazine *m = sl_magazine(s);
+  if (m)
+    {
+      if (!m->count)
+	sl_refill(s, m);
+      o = m->objs[--m->count];
+    }
+  else
+#endif
+    {
+      sl_lock(s);
+      o = sl_alloc_locked(s);
+      sl_unlock(s);
+    }
+
+#ifdef POISON
+  memset(o, 0xcd, s->data_size);
+#endif
+  return o;
+}
+
+/**
+ * sl_free - return a free object back to a Slab
+ * @s: slab
+ * @oo: object returned by sl_alloc()
+ *
+ * This function frees memory associated with the object @oo
+ * and returns it back to the Slab @s.
+ */
+void
+sl_free(slab *s, void *oo)
+{
+#ifdef POISON
+  memset(oo, 0xdb, s->data_size);
+#endif
+
+#ifdef USE_PTHREADS
+  struct sl_magazine *m = sl_magazine(s);
+  if (m)
+    {
+      if (m->count == SL_MAGAZINE_SIZE)
+	sl_flush(s, m);
+      m->objs[m->count++] = oo;
+      return;
+    }
+#endif
+
+  sl_lock(s);
+  sl_free_locked(s, oo);
+  sl_unlock(s);
+}
+
+/**
+ * sl_free_bulk - return a batch of objects back to a Slab
+ * @s: slab
+ * @objs: array of objects returned by sl_alloc()
+ * @n: number of objects
+ *
+ * This function works like calling sl_free() for each of the objects, but
+ * runs of objects belonging to the same slab page (which is common for
+ * objects allocated together) are returned at once, updating the page
+ * state just once per run. The objects bypass the per-thread cache.
+ */
+void
+sl_free_bulk(slab *s, void **objs, uint n)
+{
+#ifdef POISON
+  for (uint i = 0; i < n; i++)
+    memset(objs[i], 0xdb, s->data_size);
+#endif
+
+  sl_lock(s);
+  sl_free_bulk_locked(s, objs, n);
+  sl_unlock(s);
+}
+
 static void
 slab_free(resource *r)
 {
@@ -319,11 +558,19 @@ slab_free(resource *r)
   struct sl_head *h, *g;
 
   WALK_LIST_DELSAFE(h, g, s->empty_heads)
-    xfree(h);
+    free_page(h);
   WALK_LIST_DELSAFE(h, g, s->partial_heads)
-    xfree(h);
+    free_page(h);
   WALK_LIST_DELSAFE(h, g, s->full_heads)
-    xfree(h);
+    free_page(h);
+
+#ifdef USE_PTHREADS
+  /* Cached objects lie in the pages freed above */
+  for (uint i = 0; i < SL_MAX_THREADS; i++)
+    if (s->mag[i])
+      xfree(s->mag[i]);
+  pthread_mutex_destroy(&s->lock);
+#endif
 }
 
 static void
@@ -333,13 +580,16 @@ slab_dump(resource *r)
   int ec=0, pc=0, fc=0;
   struct sl_head *h;
 
+  sl_lock(s);
   WALK_LIST(h, s->empty_heads)
     ec++;
   WALK_LIST(h, s->partial_heads)
     pc++;
   WALK_LIST(h, s->full_heads)
     fc++;
-  debug("(%de+%dp+%df blocks per %d objs per %d bytes)\n", ec, pc, fc, s->objs_per_slab, s->obj_size);
+  sl_unlock(s);
+  debug("(%de+%dp+%df blocks per %d objs per %d bytes, %u objs used)\n",
+	ec, pc, fc, s->objs_per_slab, s->obj_size, s->num_objs);
 }
 
 static size_t
@@ -349,16 +599,20 @@ slab_memsize(resource *r)
   size_t heads = 0;
   struct sl_head *h;
 
+  sl_lock(s);
   WALK_LIST(h, s->empty_heads)
     heads++;
   WALK_LIST(h, s->partial_heads)
     heads++;
   WALK_LIST(h, s->full_heads)
     heads++;
+  sl_unlock(s);
 
-  return ALLOC_OVERHEAD + sizeof(struct slab) + heads * (ALLOC_OVERHEAD + SLAB_SIZE);
+  /* Pages have no allocator overhead */
+  return ALLOC_OVERHEAD + sizeof(struct slab) + heads * SLAB_SIZE;
 }
 
+
 static resource *
 slab_lookup(resource *r, unsigned long a)
 {
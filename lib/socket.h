@@ -30,6 +30,8 @@ typedef struct birdsock {
   byte *rbuf, *rpos;			/* NULL=allocate automatically */
   uint rbsize;
   int (*rx_hook)(struct birdsock *, int size); /* NULL=receiving turned off, returns 1 to clear rx buffer */
+  uint rx_batch;				/* Max datagrams received by one syscall, 0=default (one) */
+  u8 io_class;				/* Scheduling class in the main loop (SK_CLASS_*) */
 
   byte *tbuf, *tpos;			/* NULL=allocate automatically */
   byte *ttx;				/* Internal */
@@ -47,24 +49,35 @@ typedef struct birdsock {
   int af;				/* Address family (AF_INET, AF_INET6 or 0 for non-IP) of fd */
   int fd;				/* System-dependent data */
   int index;				/* Index in poll buffer */
+  u32 trace_id;				/* ID in the input trace, 0 if not traced (internal) */
+  u32 poll_events;			/* Events watched by the main I/O loop (internal) */
   int rcv_ttl;				/* TTL of last received datagram */
+  btime rcv_tstamp;			/* Kernel RX timestamp (real time) of last received datagram, 0 if unknown */
   node n;
   void *rbuf_alloc, *tbuf_alloc;
+  uint rbuf_ring;			/* Size of mirrored RX ring mapping, 0 if none */
+  void *rx_batch_buf;			/* Buffer for additional datagrams of a batch */
+  uint rx_batch_size;
   char *password;			/* Password for MD5 authentication */
   char *err;				/* Error message */
+  struct cpu_account *acct;		/* Charged for hooks, from the pool */
 } sock;
 
 sock *sock_new(pool *);			/* Allocate new socket */
 #define sk_new(X) sock_new(X)		/* Wrapper to avoid name collision with OpenSSL */
 
 int sk_open(sock *);			/* Open socket */
+int sk_adopt(sock *, int fd);		/* Open socket from descriptor passed by handoff */
 int sk_rx_ready(sock *s);
 int sk_send(sock *, uint len);		/* Send data, <0=err, >0=ok, 0=sleep */
 int sk_send_to(sock *, uint len, ip_addr to, uint port); /* sk_send to given destination */
+int sk_send_to_many(sock *, uint len, ip_addr *to, uint count, uint port); /* The same data to more destinations */
+int sk_send_batch(sock *, byte *data, uint len, ip_addr *to, uint count, uint port); /* Packets of the same length to more destinations */
 void sk_reallocate(sock *);		/* Free and allocate tbuf & rbuf */
 void sk_set_rbsize(sock *s, uint val);	/* Resize RX buffer */
 void sk_set_tbsize(sock *s, uint val);	/* Resize TX buffer, keeping content */
 void sk_set_tbuf(sock *s, void *tbuf);	/* Switch TX buffer, NULL-> return to internal */
+void sk_rx_consume(sock *s, uint len);	/* Drop processed data from the start of RX buffer */
 void sk_dump_all(void);
 
 static inline int sk_send_buffer_empty(sock *sk)
@@ -86,6 +99,7 @@ int sk_leave_group(sock *s, ip_addr maddr);	/* Leave multicast group on sk iface
 int sk_setup_broadcast(sock *s);
 int sk_set_ttl(sock *s, int ttl);	/* Set transmit TTL for given socket */
 int sk_set_min_ttl(sock *s, int ttl);	/* Set minimal accepted TTL for given socket */
+int sk_set_reuseport_steering(sock *s, uint offset, uint n);	/* Steer packets in SKF_REUSEPORT group by payload */
 int sk_set_md5_auth(sock *s, ip_addr a, struct iface *ifa, char *passwd);
 int sk_set_ipv6_checksum(sock *s, int offset);
 int sk_set_icmp6_filter(sock *s, int p1, int p2);
@@ -104,11 +118,23 @@ extern int sk_priority_control;		/* Suggested priority for control traffic, shou
 #define SKF_TTL_RX	0x08	/* Report TTL / Hop Limit for RX packets */
 #define SKF_BIND	0x10	/* Bind datagram socket to given source address */
 #define SKF_HIGH_PORT	0x20	/* Choose port from high range if possible */
+#define SKF_REUSEPORT	0x40	/* Share bound port with other sockets, see sk_set_reuseport_steering() */
+#define SKF_TSTAMP_RX	0x80	/* Report kernel RX timestamp for RX packets */
 
 #define SKF_THREAD	0x100	/* Socked used in thread, Do not add to main loop */
 #define SKF_TRUNCATED	0x200	/* Received packet was truncated, set by IO layer */
 #define SKF_HDRINCL	0x400	/* Used internally */
 #define SKF_PKTINFO	0x800	/* Used internally */
+#define SKF_RX_RING	0x1000	/* Stream socket uses mirrored RX ring, see sk_rx_consume() */
+#define SKF_REPLAY	0x2000	/* Inputs are replayed from a trace, no file descriptor */
+
+/*
+ *	Scheduling classes of socket reads in the main loop, see io_poll()
+ */
+
+#define SK_CLASS_CONTROL 0	/* Latency sensitive protocol packets (default) */
+#define SK_CLASS_BULK	1	/* Bulk data streams, e.g. BGP sessions */
+#define SK_CLASS_MAX	2
 
 /*
  *	Socket types		     SA SP DA DP IF  TTL SendTo	(?=may, -=must not, *=must)
@@ -0,0 +1,160 @@
+/*
+ *	BIRD Library -- Hierarchical Timer Wheel
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Timer wheel
+ *
+ * Timer wheels are used by modules which need to track expiration of a large
+ * number of objects with one second resolution, where a &timer per object
+ * would be too expensive. The wheel has %WHEEL_LEVELS levels of %WHEEL_SLOTS
+ * slots. Nodes expiring in less than %WHEEL_SLOTS seconds are kept in the
+ * slot of their expiration second on the lowest level, later ones on higher
+ * levels in coarser slots. Whenever the lowest level wraps around, a slot of
+ * the next level is cascaded down. Adding and removing a node are O(1) and
+ * each node is moved at most %WHEEL_LEVELS times before it expires.
+ *
+ * The wheel is driven by a single &timer, which runs only while some nodes
+ * are queued. Expired nodes are removed from the wheel before the hook is
+ * called, so the hook is free to queue them again or to free them.
+ */
+
+#include "nest/bird.h"
+#include "lib/wheel.h"
+
+static void wheel_tick(timer *t);
+
+/**
+ * wheel_init - initialize a timer wheel
+ * @w: wheel
+ * @p: pool for the driving timer
+ * @hook: function called for expired nodes
+ * @data: user data available as @w->data
+ */
+void
+wheel_init(struct wheel *w, pool *p, void (*hook)(struct wheel *, struct wheel_node *), void *data)
+{
+  uint i, j;
+
+  for (i = 0; i < WHEEL_LEVELS; i++)
+    for (j = 0; j < WHEEL_SLOTS; j++)
+      init_list(&w->slots[i][j]);
+
+  w->time = now;
+  w->timer = tm_new_set(p, wheel_tick, w, 0, 0);
+  w->hook = hook;
+  w->data = data;
+  w->count = 0;
+}
+
+static void
+wheel_link(struct wheel *w, struct wheel_node *n)
+{
+  bird_clock_t delta = n->expires - w->time;
+  uint level;
+
+  if (delta <= 0)
+    n->expires = w->time + (delta = 1);
+  if (delta > WHEEL_MAX)
+    n->expires = w->time + (delta = WHEEL_MAX);
+
+  for (level = 0; delta >= (1 << (WHEEL_BITS * (level + 1))); level++)
+    ;
+
+  uint slot = (n->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+  add_tail(&w->slots[level][slot], &n->n);
+}
+
+/**
+ * wheel_add - queue a node
+ * @w: wheel
+ * @n: node
+ * @expires: time when the hook should be called for the node
+ *
+ * If the node is already queued, it is moved to the new position. Times in
+ * the past expire on the next tick, times too far in the future are clamped
+ * to %WHEEL_MAX seconds from now.
+ */
+void
+wheel_add(struct wheel *w, struct wheel_node *n, bird_clock_t expires)
+{
+  if (wheel_queued(n))
+    rem_node(&n->n);
+  else if (!w->count++ && !tm_active(w->timer))
+    w->time = now;			/* Catch up if the wheel was idle */
+
+  n->expires = expires;
+  wheel_link(w, n);
+
+  if (!tm_active(w->timer))
+    tm_start(w->timer, 1);
+}
+
+/**
+ * wheel_remove - dequeue a node
+ * @w: wheel
+ * @n: node, it does not have to be queued
+ */
+void
+wheel_remove(struct wheel *w, struct wheel_node *n)
+{
+  if (!wheel_queued(n))
+    return;
+
+  rem_node(&n->n);
+  n->expires = 0;
+  w->count--;
+
+  if (!w->count)
+    tm_stop(w->timer);
+}
+
+static void
+wheel_cascade(struct wheel *w, uint level)
+{
+  list *l = &w->slots[level][(w->time >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+  struct wheel_node *n;
+  node *nxt;
+
+  WALK_LIST_DELSAFE(n, nxt, *l)
+    {
+      rem_node(&n->n);
+      wheel_link(w, n);
+    }
+}
+
+static void
+wheel_tick(timer *t)
+{
+  struct wheel *w = t->data;
+  struct wheel_node *n;
+  list *l;
+  uint level;
+
+  while (w->count && (w->time < now))
+    {
+      w->time++;
+
+      /* Cascade from the highest level whose slot boundary was crossed */
+      for (level = 1; (level < WHEEL_LEVELS) &&
+	     !(w->time & ((1 << (WHEEL_BITS * level)) - 1)); level++)
+	;
+      while (--level > 0)
+	wheel_cascade(w, level);
+
+      l = &w->slots[0][w->time & (WHEEL_SLOTS - 1)];
+      while (n = HEAD(*l), NODE_VALID(n))
+	{
+	  rem_node(&n->n);
+	  n->expires = 0;
+	  w->count--;
+	  w->hook(w, n);
+	}
+    }
+
+  w->time = now;
+  if (w->count)
+    tm_start(w->timer, 1);
+}
@@ -0,0 +1,40 @@
+/*
+ *	BIRD Library -- Hierarchical Timer Wheel
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_WHEEL_H_
+#define _BIRD_WHEEL_H_
+
+#include "lib/resource.h"
+#include "lib/lists.h"
+#include "lib/timer.h"
+
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_LEVELS	3		/* Covers 2^18 seconds, about three days */
+#define WHEEL_MAX	((1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct wheel_node {
+  node n;				/* Node in wheel slot */
+  bird_clock_t expires;			/* Expiration time, 0 if not queued */
+};
+
+struct wheel {
+  list slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  bird_clock_t time;			/* All nodes up to this time have been fired */
+  timer *timer;				/* Ticks once a second while nodes are queued */
+  void (*hook)(struct wheel *, struct wheel_node *);
+  void *data;
+  uint count;				/* Number of queued nodes */
+};
+
+void wheel_init(struct wheel *w, pool *p, void (*hook)(struct wheel *, struct wheel_node *), void *data);
+void wheel_add(struct wheel *w, struct wheel_node *n, bird_clock_t expires);
+void wheel_remove(struct wheel *w, struct wheel_node *n);
+
+static inline int wheel_queued(struct wheel_node *n)
+{ return n->expires != 0; }
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ *	BIRD Library -- Pool of Worker Threads
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_WORKER_H_
+#define _BIRD_WORKER_H_
+
+#include "lib/resource.h"
+
+typedef struct worker_pool worker_pool;
+typedef void (*work_hook)(void *data, uint i);
+
+worker_pool *wp_new(pool *p, uint threads);
+void wp_run(worker_pool *wp, work_hook hook, void *data, uint count);
+uint wp_threads(worker_pool *wp);
+
+/* Thread classes, CPU affinity can be configured for each of them */
+#define THREAD_MAIN	0
+#define THREAD_BFD	1		/* BFD loops */
+#define THREAD_BGP	2		/* BGP receive threads */
+#define THREAD_OSPF	3		/* OSPF hello loops */
+#define THREAD_WORKER	4		/* Worker pools */
+#define THREAD_LOG	5		/* Log writer */
+#define THREAD_KERNEL	6		/* Kernel route sync */
+#define THREAD_METRICS	7		/* Metrics server */
+#define THREAD_MAX	8
+
+#define THREAD_MAX_CPUS	1024
+
+struct thread_affinity {
+  node n;
+  uint class;				/* THREAD_* */
+  u64 cpus[THREAD_MAX_CPUS / 64];	/* Bitmap of allowed CPUs */
+};
+
+void thread_start(uint class);
+void thread_stop(void);
+void thread_set_affinity(list *l);
+int thread_parse_cpus(const char *s, u64 *cpus);
+
+#endif
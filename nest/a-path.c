@@ -7,12 +7,15 @@
  *	Can be freely distributed and used under the terms of the GNU GPL.
  */
 
+#include <stdlib.h>
+
 #include "nest/bird.h"
 #include "nest/route.h"
 #include "nest/attrs.h"
 #include "lib/resource.h"
 #include "lib/unaligned.h"
 #include "lib/string.h"
+#include "conf/conf.h"
 #include "filter/filter.h"
 
 // static inline void put_as(byte *data, u32 as) { put_u32(data, as); }
@@ -180,6 +183,10 @@ as_path_getlen_int(struct adata *path, int bs)
   u8 *q = p+path->length;
   int len;
 
+  /* Common case of a single AS_SEQUENCE segment */
+  if ((path->length > 2) && (p[0] == AS_PATH_SEQUENCE) && (path->length == 2 + bs * p[1]))
+    return p[1];
+
   while (p<q)
     {
       switch (*p++)
@@ -201,6 +208,13 @@ as_path_get_last(struct adata *path, u32 *orig_as)
   u8 *q = p+path->length;
   int len;
 
+  /* Common case of a single AS_SEQUENCE segment, the last AS ends the path */
+  if ((path->length > 2) && (p[0] == AS_PATH_SEQUENCE) && (path->length == 2 + BS * p[1]))
+    {
+      *orig_as = get_as(q - BS);
+      return 1;
+    }
+
   while (p<q)
     {
       switch (*p++)
@@ -466,8 +480,8 @@ pm_mark(struct pm_pos *pos, int i, int plen, int *nl, int *nh)
  * is marked.
  */
 
-int
-as_path_match(struct adata *path, struct f_path_mask *mask)
+static int
+as_path_match_general(struct adata *path, struct f_path_mask *mask)
 {
   struct pm_pos pos[2048 + 1];
   int plen = parse_path(path, pos);
@@ -526,3 +540,213 @@ as_path_match(struct adata *path, struct f_path_mask *mask)
 
   return pos[plen].mark;
 }
+
+
+/*
+ * Paths without AS sets, which are the vast majority, are matched by a
+ * compiled form of the mask. It is a nondeterministic automaton where states
+ * are positions in the mask and input symbols are ASNs of the path, just the
+ * opposite of the general algorithm above. The set of active states is kept
+ * as a bit vector, so the path is processed in one pass in constant time per
+ * ASN (Shift-And algorithm). State 0 is the initial one, state k follows the
+ * k-th item of the mask. An ASN moves each active state to the next one if
+ * the corresponding item accepts the ASN, and asterisk states also stay
+ * active. Asterisks may match no ASN, so their states are activated together
+ * with their predecessors. Consecutive asterisks are merged to one state,
+ * therefore one shift computes the closure.
+ */
+
+#define PM_NFA_MAX	63	/* States of items, state 0 is extra */
+
+struct pm_nfa_asn {
+  u32 asn;
+  u64 mask;				/* States entered by the ASN */
+};
+
+struct pm_nfa_expr {
+  struct f_inst *expr;
+  u64 mask;
+};
+
+struct pm_nfa {
+  u64 init;				/* Initial states, with closure */
+  u64 any;				/* States entered by any ASN */
+  u64 loop;				/* States of asterisks */
+  u64 final;				/* The accepting state */
+  uint asns, exprs;
+  struct pm_nfa_asn *asn;		/* Sorted by ASN, without duplicates */
+  struct pm_nfa_expr *expr;		/* ASNs evaluated for each match */
+};
+
+static inline u64
+pm_nfa_closure(struct pm_nfa *nfa, u64 d)
+{
+  return d | ((d << 1) & nfa->loop);
+}
+
+static int
+pm_nfa_asn_cmp(const void *a, const void *b)
+{
+  u32 x = ((const struct pm_nfa_asn *) a)->asn;
+  u32 y = ((const struct pm_nfa_asn *) b)->asn;
+  return (x > y) - (x < y);
+}
+
+/**
+ * as_path_compile - compile an AS path mask
+ * @mask: path mask
+ *
+ * This function prepares the mask for as_path_match() and attaches the result
+ * to its first item. It is called by the config parser for each mask. Long
+ * masks are left uncompiled and they are matched by the general algorithm.
+ */
+void
+as_path_compile(struct f_path_mask *mask)
+{
+  struct f_path_mask *m;
+  uint states = 0, asns = 0, exprs = 0;
+  int star = 0;
+
+  for (m = mask; m; m = m->next)
+  {
+    if ((m->kind == PM_ASTERISK) && star)
+      continue;
+
+    star = (m->kind == PM_ASTERISK);
+    asns += (m->kind == PM_ASN);
+    exprs += (m->kind == PM_ASN_EXPR);
+    states++;
+  }
+
+  if (!mask || (states > PM_NFA_MAX))
+    return;
+
+  struct pm_nfa *nfa = cfg_allocz(sizeof(struct pm_nfa));
+  nfa->asn = cfg_alloc(asns * sizeof(struct pm_nfa_asn));
+  nfa->expr = cfg_alloc(exprs * sizeof(struct pm_nfa_expr));
+
+  uint j = 0;
+  star = 0;
+  for (m = mask; m; m = m->next)
+  {
+    if ((m->kind == PM_ASTERISK) && star)
+      continue;
+
+    u64 bit = 1ULL << ++j;
+    star = 0;
+
+    switch (m->kind)
+    {
+    case PM_ASTERISK:
+      nfa->loop |= bit;
+      nfa->any |= bit;
+      star = 1;
+      break;
+
+    case PM_QUESTION:
+      nfa->any |= bit;
+      break;
+
+    case PM_ASN:
+      nfa->asn[nfa->asns++] = (struct pm_nfa_asn) { .asn = m->val, .mask = bit };
+      break;
+
+    case PM_ASN_EXPR:
+      nfa->expr[nfa->exprs++] = (struct pm_nfa_expr) { .expr = (struct f_inst *) m->val, .mask = bit };
+      break;
+    }
+  }
+
+  /* Merge repeated ASNs */
+  qsort(nfa->asn, nfa->asns, sizeof(struct pm_nfa_asn), pm_nfa_asn_cmp);
+
+  uint i, k = 0;
+  for (i = 0; i < nfa->asns; i++)
+    if (k && (nfa->asn[k-1].asn == nfa->asn[i].asn))
+      nfa->asn[k-1].mask |= nfa->asn[i].mask;
+    else
+      nfa->asn[k++] = nfa->asn[i];
+  nfa->asns = k;
+
+  nfa->final = 1ULL << j;
+  nfa->init = pm_nfa_closure(nfa, 1);
+  mask->nfa = nfa;
+}
+
+static inline u64
+pm_nfa_lookup(struct pm_nfa_asn *a, uint n, u32 asn)
+{
+  while (n > 1)
+  {
+    uint half = n / 2;
+    a += (a[half - 1].asn < asn) ? half : 0;
+    n -= half;
+  }
+
+  return (n && (a->asn == asn)) ? a->mask : 0;
+}
+
+/* Returns -1 if the path contains sets, the general algorithm must be used then */
+static int
+as_path_match_nfa(struct adata *path, struct pm_nfa *nfa)
+{
+  u8 *p = path->data;
+  u8 *q = p + path->length;
+  struct pm_nfa_asn ex[nfa->exprs];
+  u64 d = nfa->init;
+  uint i, len;
+
+  for (i = 0; i < nfa->exprs; i++)
+  {
+    ex[i].asn = f_eval_asn(nfa->expr[i].expr);
+    ex[i].mask = nfa->expr[i].mask;
+  }
+
+  while (p < q)
+  {
+    if (p[0] != AS_PATH_SEQUENCE)
+      return -1;
+
+    len = p[1];
+    p += 2;
+
+    for (; len; len--, p += BS)
+    {
+      u32 asn = get_as(p);
+      u64 b = nfa->any | pm_nfa_lookup(nfa->asn, nfa->asns, asn);
+
+      for (i = 0; i < nfa->exprs; i++)
+	if (ex[i].asn == asn)
+	  b |= ex[i].mask;
+
+      d = pm_nfa_closure(nfa, ((d << 1) & b) | (d & nfa->loop));
+
+      /* Without active states, the rest of the path does not matter */
+      if (!d)
+	return 0;
+    }
+  }
+
+  return !!(d & nfa->final);
+}
+
+/**
+ * as_path_match - match AS path against a path mask
+ * @path: AS path
+ * @mask: path mask, compiled by as_path_compile() or not
+ *
+ * This function returns 1 if the path matches the mask. Paths with AS sets
+ * and uncompiled masks are matched by the general algorithm.
+ */
+int
+as_path_match(struct adata *path, struct f_path_mask *mask)
+{
+  if (mask && mask->nfa)
+  {
+    int res = as_path_match_nfa(path, mask->nfa);
+    if (res >= 0)
+      return res;
+  }
+
+  return as_path_match_general(path, mask);
+}
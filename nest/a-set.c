@@ -141,130 +141,496 @@ ec_set_format(struct adata *set, int from, byte *buf, uint size)
   return 0;
 }
 
+/*
+ * Community lists of routes from transit providers often have hundreds of
+ * entries and they are searched many times by filters and protocols. On x86-64,
+ * they are scanned by SSE2 (always available there), comparing four communities
+ * or two extended communities per instruction. Other architectures use simple
+ * loops. Both kinds of lists are just arrays of u32, an extended community is
+ * stored as its high and low half, see ec_get().
+ */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define INT_SET_SSE2
+#include <emmintrin.h>
+#endif
+
+#define INT_SET_MATCH_MAX 32
+
+/* Position of first @val in an array of @len u32 values, or -1 */
+static inline int
+int_set_find(const u32 *l, int len, u32 val)
+{
+  int i = 0;
+
+#ifdef INT_SET_SSE2
+  const __m128i v = _mm_set1_epi32(val);
+
+  for (; i + 8 <= len; i += 8)
+  {
+    __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (l + i)), v);
+    __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (l + i + 4)), v);
+    u32 m = _mm_movemask_epi8(a) | (_mm_movemask_epi8(b) << 16);
+
+    if (m)
+      return i + __builtin_ctz(m) / 4;
+  }
+
+  if (i + 4 <= len)
+  {
+    __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (l + i)), v);
+    u32 m = _mm_movemask_epi8(a);
+
+    if (m)
+      return i + __builtin_ctz(m) / 4;
+
+    i += 4;
+  }
+#endif
+
+  for (; i < len; i++)
+    if (l[i] == val)
+      return i;
+
+  return -1;
+}
+
+/* Position of first extended community (@eh, @el) in an array of @len u32 values, or -1 */
+static inline int
+ec_set_find(const u32 *l, int len, u32 eh, u32 el)
+{
+  int i = 0;
+
+#ifdef INT_SET_SSE2
+  const __m128i v = _mm_set_epi32(el, eh, el, eh);
+
+  for (; i + 4 <= len; i += 4)
+  {
+    /* Both halves of a matching community must be equal */
+    __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (l + i)), v);
+    a = _mm_and_si128(a, _mm_shuffle_epi32(a, 0xb1));
+    u32 m = _mm_movemask_epi8(a);
+
+    if (m)
+      return i + __builtin_ctz(m) / 4;
+  }
+#endif
+
+  for (; i < len; i += 2)
+    if (l[i] == eh && l[i+1] == el)
+      return i;
+
+  return -1;
+}
+
 int
 int_set_contains(struct adata *list, u32 val)
 {
   if (!list)
     return 0;
 
-  u32 *l = (u32 *) list->data;
+  return int_set_find(int_set_get_data(list), int_set_get_size(list), val) >= 0;
+}
+
+int
+ec_set_contains(struct adata *list, u64 val)
+{
+  if (!list)
+    return 0;
+
+  return ec_set_find(int_set_get_data(list), int_set_get_size(list), ec_hi(val), ec_lo(val)) >= 0;
+}
+
+/**
+ * int_set_match - test a set for several values at once
+ * @list: set attribute, may be NULL
+ * @vals: array of values
+ * @n: number of values, at most 32
+ *
+ * This function scans the set attribute only once and checks every entry
+ * against all @vals, which is faster than separate int_set_contains() calls
+ * when more well-known communities are tested. It returns a bitmap with bit
+ * i set if @vals[i] is in the set.
+ */
+u32
+int_set_match(struct adata *list, const u32 *vals, uint n)
+{
+  ASSERT(n <= INT_SET_MATCH_MAX);
+
+  if (!list)
+    return 0;
+
+  u32 *l = int_set_get_data(list);
+  int len = int_set_get_size(list);
+  u32 res = 0;
+  uint j;
+  int i = 0;
+
+#ifdef INT_SET_SSE2
+  /* Values are tested in groups of four, so all vectors fit in registers */
+  for (j = 0; (j < n) && (len >= 4); j += 4)
+  {
+    uint g = MIN(n - j, 4);
+    const __m128i v0 = _mm_set1_epi32(vals[j]);
+    const __m128i v1 = _mm_set1_epi32(vals[j + ((g > 1) ? 1 : 0)]);
+    const __m128i v2 = _mm_set1_epi32(vals[j + ((g > 2) ? 2 : 0)]);
+    const __m128i v3 = _mm_set1_epi32(vals[j + ((g > 3) ? 3 : 0)]);
+    __m128i a0, a1, a2, a3;
+
+    a0 = a1 = a2 = a3 = _mm_setzero_si128();
+    for (i = 0; i + 4 <= len; i += 4)
+    {
+      __m128i d = _mm_loadu_si128((const __m128i *) (l + i));
+
+      a0 = _mm_or_si128(a0, _mm_cmpeq_epi32(d, v0));
+      a1 = _mm_or_si128(a1, _mm_cmpeq_epi32(d, v1));
+      a2 = _mm_or_si128(a2, _mm_cmpeq_epi32(d, v2));
+      a3 = _mm_or_si128(a3, _mm_cmpeq_epi32(d, v3));
+    }
+
+    u32 m = (!!_mm_movemask_epi8(a0)) | (!!_mm_movemask_epi8(a1) << 1) |
+      (!!_mm_movemask_epi8(a2) << 2) | (!!_mm_movemask_epi8(a3) << 3);
+
+    res |= (m & ((1u << g) - 1)) << j;
+  }
+#endif
+
+  for (; i < len; i++)
+    for (j = 0; j < n; j++)
+      if (l[i] == vals[j])
+	res |= 1u << j;
+
+  return res;
+}
+
+/*
+ * Community lists are normalized (sorted and deduplicated) when received by
+ * BGP and the operations below keep them normalized, so unions are merges and
+ * additions use binary search.
+ * Normalization is not recorded in the set, it is tested by a sequential scan
+ * where the operation is linear anyway. Other sets (e.g. cluster lists) keep
+ * their order and are handled by the generic code.
+ */
+
+/**
+ * int_set_normalized - test whether a set is normalized
+ * @list: set attribute, may be NULL
+ *
+ * Returns 1 if values of the set are strictly increasing.
+ */
+int
+int_set_normalized(struct adata *list)
+{
+  if (!list)
+    return 1;
+
+  u32 *l = int_set_get_data(list);
   int len = int_set_get_size(list);
   int i;
 
-  for (i = 0; i < len; i++)
-    if (*l++ == val)
-      return 1;
+  for (i = 1; i < len; i++)
+    if (l[i-1] >= l[i])
+      return 0;
 
-  return 0;
+  return 1;
 }
 
+/* Like int_set_normalized(), but for sets of extended communities */
 int
-ec_set_contains(struct adata *list, u64 val)
+ec_set_normalized(struct adata *list)
 {
   if (!list)
-    return 0;
+    return 1;
 
   u32 *l = int_set_get_data(list);
   int len = int_set_get_size(list);
-  u32 eh = ec_hi(val);
-  u32 el = ec_lo(val);
   int i;
 
-  for (i=0; i < len; i += 2)
-    if (l[i] == eh && l[i+1] == el)
-      return 1;
+  for (i = 2; i < len; i += 2)
+    if (ec_get(l, i-2) >= ec_get(l, i))
+      return 0;
 
-  return 0;
+  return 1;
 }
 
-struct adata *
-int_set_add(struct linpool *pool, struct adata *list, u32 val)
+/*
+ * Position of the first value not lower than @val in a normalized set. The
+ * search has no unpredictable branches, which matters for short sets.
+ */
+static inline int
+int_set_lower(const u32 *l, int len, u32 val)
 {
-  struct adata *res;
-  int len;
+  const u32 *b = l;
 
-  if (int_set_contains(list, val))
-    return list;
+  if (!len)
+    return 0;
+
+  while (len > 1)
+  {
+    int half = len / 2;
+    b = (b[half] < val) ? b + half : b;
+    len -= half;
+  }
+
+  return (b - l) + (*b < val);
+}
+
+/* Like int_set_lower(), @len and the result are in u32 units */
+static inline int
+ec_set_lower(const u32 *l, int len, u64 val)
+{
+  const u32 *b = l;
+
+  len /= 2;
+  if (!len)
+    return 0;
+
+  while (len > 1)
+  {
+    int half = len / 2;
+    b = (ec_get(b, 2 * half) < val) ? b + 2 * half : b;
+    len -= half;
+  }
+
+  return (b - l) + 2 * (ec_get(b, 0) < val);
+}
+
+/* Copy of @list with @n u32 values @vals inserted at @pos */
+static struct adata *
+int_set_insert(struct linpool *pool, struct adata *list, int pos, const u32 *vals, int n)
+{
+  int olen = list ? list->length : 0;
+  struct adata *res = lp_alloc(pool, sizeof(struct adata) + olen + 4 * n);
+  u32 *k = int_set_get_data(res);
+
+  res->length = olen + 4 * n;
 
-  len = list ? list->length : 0;
-  res = lp_alloc(pool, sizeof(struct adata) + len + 4);
-  res->length = len + 4;
-  * (u32 *) res->data = val;
   if (list)
-    memcpy((char *) res->data + 4, list->data, list->length);
+  {
+    u32 *l = int_set_get_data(list);
+    memcpy(k, l, pos * 4);
+    memcpy(k + pos + n, l + pos, olen - pos * 4);
+  }
+
+  memcpy(k + pos, vals, n * 4);
   return res;
 }
 
+/**
+ * int_set_add - add a value to a set
+ * @pool: pool for the result
+ * @list: set attribute, may be NULL
+ * @val: the value
+ *
+ * Returns a set containing @val, which is @list if it was already there.
+ * Normalized sets stay normalized, the value is put first into other ones.
+ */
 struct adata *
-ec_set_add(struct linpool *pool, struct adata *list, u64 val)
+int_set_add(struct linpool *pool, struct adata *list, u32 val)
 {
-  if (ec_set_contains(list, val))
+  if (!int_set_normalized(list))
+    return int_set_prepend(pool, list, val);
+
+  u32 *l = list ? int_set_get_data(list) : NULL;
+  int len = list ? int_set_get_size(list) : 0;
+  int pos = int_set_lower(l, len, val);
+
+  if ((pos < len) && (l[pos] == val))
     return list;
 
-  int olen = list ? list->length : 0;
-  struct adata *res = lp_alloc(pool, sizeof(struct adata) + olen + 8);
-  res->length = olen + 8;
+  return int_set_insert(pool, list, pos, &val, 1);
+}
 
-  if (list)
-    memcpy(res->data, list->data, list->length);
+/**
+ * int_set_prepend - add a value to the beginning of a set
+ * @pool: pool for the result
+ * @list: set attribute, may be NULL
+ * @val: the value
+ *
+ * Like int_set_add(), but the order of the set is always kept and the new
+ * value is put first. It is used for ordered lists like CLUSTER_LIST.
+ */
+struct adata *
+int_set_prepend(struct linpool *pool, struct adata *list, u32 val)
+{
+  if (int_set_contains(list, val))
+    return list;
 
-  u32 *l = (u32 *) (res->data + res->length - 8);
-  l[0] = ec_hi(val);
-  l[1] = ec_lo(val);
+  return int_set_insert(pool, list, 0, &val, 1);
+}
 
-  return res;
+/* Like int_set_add(), but the value is appended to sets that are not normalized */
+struct adata *
+ec_set_add(struct linpool *pool, struct adata *list, u64 val)
+{
+  u32 *l = list ? int_set_get_data(list) : NULL;
+  int len = list ? int_set_get_size(list) : 0;
+  u32 v[2] = { ec_hi(val), ec_lo(val) };
+  int pos;
+
+  if (ec_set_normalized(list))
+  {
+    pos = ec_set_lower(l, len, val);
+
+    if ((pos < len) && (ec_get(l, pos) == val))
+      return list;
+  }
+  else
+  {
+    if (ec_set_contains(list, val))
+      return list;
+
+    pos = len;
+  }
+
+  return int_set_insert(pool, list, pos, v, 2);
 }
 
 
 struct adata *
 int_set_del(struct linpool *pool, struct adata *list, u32 val)
 {
-  if (!int_set_contains(list, val))
+  if (!list)
+    return list;
+
+  u32 *l = int_set_get_data(list);
+  int len = int_set_get_size(list);
+  int pos = int_set_find(l, len, val);
+
+  if (pos < 0)
     return list;
 
   struct adata *res;
   res = lp_alloc(pool, sizeof(struct adata) + list->length - 4);
-  res->length = list->length - 4;
 
-  u32 *l = int_set_get_data(list);
+  /* Entries before the first occurrence are copied at once */
   u32 *k = int_set_get_data(res);
-  int len = int_set_get_size(list);
-  int i;
+  memcpy(k, l, pos * 4);
+  k += pos;
 
-  for (i = 0; i < len; i++)
+  int i;
+  for (i = pos + 1; i < len; i++)
     if (l[i] != val)
       *k++ = l[i];
 
+  res->length = (k - int_set_get_data(res)) * 4;
   return res;
 }
 
 struct adata *
 ec_set_del(struct linpool *pool, struct adata *list, u64 val)
 {
-  if (!ec_set_contains(list, val))
+  if (!list)
     return list;
 
-  struct adata *res;
-  res = lp_alloc(pool, sizeof(struct adata) + list->length - 8);
-  res->length = list->length - 8;
-
   u32 *l = int_set_get_data(list);
-  u32 *k = int_set_get_data(res);
   int len = int_set_get_size(list);
   u32 eh = ec_hi(val);
   u32 el = ec_lo(val);
-  int i;
+  int pos = ec_set_find(l, len, eh, el);
 
-  for (i=0; i < len; i += 2)
+  if (pos < 0)
+    return list;
+
+  struct adata *res;
+  res = lp_alloc(pool, sizeof(struct adata) + list->length - 8);
+
+  u32 *k = int_set_get_data(res);
+  memcpy(k, l, pos * 4);
+  k += pos;
+
+  int i;
+  for (i = pos + 2; i < len; i += 2)
     if (! (l[i] == eh && l[i+1] == el))
       {
 	*k++ = l[i];
 	*k++ = l[i+1];
       }
 
+  res->length = (k - int_set_get_data(res)) * 4;
+  return res;
+}
+
+
+/*
+ * Union of normalized sets, the result is normalized. Positions of new values
+ * are found by binary search in the rest of @l1, then runs of @l1 between
+ * them are copied at once. It is O(m log n + n) for the usual case of a few
+ * values added to a longer set.
+ */
+static struct adata *
+int_set_merge(struct linpool *pool, struct adata *l1, struct adata *l2)
+{
+  u32 *a = int_set_get_data(l1), *b = int_set_get_data(l2);
+  int n = int_set_get_size(l1), m = int_set_get_size(l2);
+  int pos[m], new[m];
+  int i, j, k = 0;
+
+  for (i = j = 0; j < m; j++)
+  {
+    i += int_set_lower(a + i, n - i, b[j]);
+    if ((i == n) || (a[i] != b[j]))
+    {
+      pos[k] = i;
+      new[k++] = j;
+    }
+  }
+
+  if (!k)
+    return l1;
+
+  struct adata *res = lp_alloc(pool, sizeof(struct adata) + (n + k) * 4);
+  u32 *d = int_set_get_data(res);
+  res->length = (n + k) * 4;
+
+  for (i = j = 0; j < k; j++)
+  {
+    while (i < pos[j])
+      *d++ = a[i++];
+    *d++ = b[new[j]];
+  }
+
+  memcpy(d, a + i, (n - i) * 4);
   return res;
 }
 
+/* Like int_set_merge(), but for sets of extended communities */
+static struct adata *
+ec_set_merge(struct linpool *pool, struct adata *l1, struct adata *l2)
+{
+  u32 *a = int_set_get_data(l1), *b = int_set_get_data(l2);
+  int n = int_set_get_size(l1), m = int_set_get_size(l2);
+  int pos[m / 2], new[m / 2];
+  int i, j, k = 0;
+
+  for (i = j = 0; j < m; j += 2)
+  {
+    i += ec_set_lower(a + i, n - i, ec_get(b, j));
+    if ((i == n) || (ec_get(a, i) != ec_get(b, j)))
+    {
+      pos[k] = i;
+      new[k++] = j;
+    }
+  }
+
+  if (!k)
+    return l1;
+
+  struct adata *res = lp_alloc(pool, sizeof(struct adata) + (n + 2 * k) * 4);
+  u32 *d = int_set_get_data(res);
+  res->length = (n + 2 * k) * 4;
+
+  for (i = j = 0; j < k; j++)
+  {
+    while (i < pos[j])
+      *d++ = a[i++];
+    *d++ = b[new[j]];
+    *d++ = b[new[j] + 1];
+  }
+
+  memcpy(d, a + i, (n - i) * 4);
+  return res;
+}
 
 struct adata *
 int_set_union(struct linpool *pool, struct adata *l1, struct adata *l2)
@@ -274,6 +640,9 @@ int_set_union(struct linpool *pool, struct adata *l1, struct adata *l2)
   if (!l2)
     return l1;
 
+  if (int_set_normalized(l1) && int_set_normalized(l2))
+    return int_set_merge(pool, l1, l2);
+
   struct adata *res;
   int len = int_set_get_size(l2);
   u32 *l = int_set_get_data(l2);
@@ -304,6 +673,9 @@ ec_set_union(struct linpool *pool, struct adata *l1, struct adata *l2)
   if (!l2)
     return l1;
 
+  if (ec_set_normalized(l1) && ec_set_normalized(l2))
+    return ec_set_merge(pool, l1, l2);
+
   struct adata *res;
   int len = int_set_get_size(l2);
   u32 *l = int_set_get_data(l2);
@@ -49,8 +49,10 @@ struct f_path_mask {
   struct f_path_mask *next;
   int kind;
   uintptr_t val;
+  struct pm_nfa *nfa;			/* Compiled mask, set in the first item only */
 };
 
+void as_path_compile(struct f_path_mask *mask);
 int as_path_match(struct adata *path, struct f_path_mask *mask);
 
 /* a-set.c */
@@ -100,7 +102,11 @@ int ec_format(byte *buf, u64 ec);
 int ec_set_format(struct adata *set, int from, byte *buf, uint size);
 int int_set_contains(struct adata *list, u32 val);
 int ec_set_contains(struct adata *list, u64 val);
+u32 int_set_match(struct adata *list, const u32 *vals, uint n);
+int int_set_normalized(struct adata *list);
+int ec_set_normalized(struct adata *list);
 struct adata *int_set_add(struct linpool *pool, struct adata *list, u32 val);
+struct adata *int_set_prepend(struct linpool *pool, struct adata *list, u32 val);
 struct adata *ec_set_add(struct linpool *pool, struct adata *list, u64 val);
 struct adata *int_set_del(struct linpool *pool, struct adata *list, u32 val);
 struct adata *ec_set_del(struct linpool *pool, struct adata *list, u64 val);
@@ -0,0 +1,32 @@
+/*
+ *	BIRD -- BGP Monitoring Protocol Interface
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_NBMP_H_
+#define _BIRD_NBMP_H_
+
+struct bgp_proto;
+
+#ifdef CONFIG_BMP
+
+extern uint bmp_stations;		/* Number of connected monitoring stations */
+
+void bmp_peer_up(struct bgp_proto *p);
+void bmp_peer_down(struct bgp_proto *p);
+void bmp_route_monitor_rx(struct bgp_proto *p, byte *pkt, uint len);
+
+/* Received UPDATE message @pkt is passed to stations as a pre-policy route */
+static inline void bmp_rx_update(struct bgp_proto *p, byte *pkt, uint len)
+{ if (bmp_stations) bmp_route_monitor_rx(p, pkt, len); }
+
+#else
+
+static inline void bmp_peer_up(struct bgp_proto *p) { }
+static inline void bmp_peer_down(struct bgp_proto *p) { }
+static inline void bmp_rx_update(struct bgp_proto *p, byte *pkt, uint len) { }
+
+#endif /* CONFIG_BMP */
+
+#endif /* _BIRD_NBMP_H_ */
@@ -70,6 +70,14 @@
 
 pool *cli_pool;
 
+struct cli_batch {
+  byte *buf, *pos, *end;		/* Commands to be executed */
+  uint line;				/* Line number of the last command */
+  uint cmds, failed;			/* Executed and failed commands */
+  int running;				/* Command was started and has not been counted */
+  int code;				/* Final reply code of that command */
+};
+
 static byte *
 cli_alloc_out(cli *c, int size)
 {
@@ -116,36 +124,55 @@ cli_alloc_out(cli *c, int size)
  * If you want to write to the current CLI output, you can use the cli_msg()
  * macro instead.
  */
-void
-cli_printf(cli *c, int code, char *msg, ...)
+/* Reply line prefix, returns its length */
+static int
+cli_reply_prefix(cli *c, int code, byte *buf, int *errcode)
 {
-  va_list args;
-  byte buf[CLI_LINE_SIZE];
   int cd = code;
-  int errcode;
-  int size, cnt;
+  int cont = (cd < 0);
+  int size;
+
+  if (cont)
+    cd = -cd;
+  else if (c->batch && (cd != CLI_ASYNC_CODE))
+    {
+      /* Final lines of commands in a batch just continue the batch reply */
+      c->batch->code = cd;
+      cont = 1;
+    }
 
-  if (cd < 0)
+  if (cont)
     {
-      cd = -cd;
       if (cd == c->last_reply)
 	size = bsprintf(buf, " ");
       else
 	size = bsprintf(buf, "%04d-", cd);
-      errcode = -8000;
+      *errcode = -8000;
     }
   else if (cd == CLI_ASYNC_CODE)
     {
       size = 1; buf[0] = '+'; 
-      errcode = cd;
+      *errcode = cd;
     }
   else
     {
       size = bsprintf(buf, "%04d ", cd);
-      errcode = 8000;
+      *errcode = 8000;
     }
 
   c->last_reply = cd;
+  return size;
+}
+
+void
+cli_printf(cli *c, int code, char *msg, ...)
+{
+  va_list args;
+  byte buf[CLI_LINE_SIZE];
+  int errcode;
+  int size, cnt;
+
+  size = cli_reply_prefix(c, code, buf, &errcode);
   va_start(args, msg);
   cnt = bvsnprintf(buf+size, sizeof(buf)-size-1, msg, args);
   va_end(args);
@@ -159,6 +186,37 @@ cli_printf(cli *c, int code, char *msg, ...)
   memcpy(cli_alloc_out(c, size), buf, size);
 }
 
+/**
+ * cli_write_line - send preformatted reply to a CLI connection
+ * @c: CLI connection
+ * @code: numeric code of the reply, negative for continuation lines
+ * @msg: text of the reply line
+ * @len: length of @msg
+ *
+ * This function works like cli_printf() with a "%s" format, but it allows
+ * lines up to %CLI_LONG_LINE_SIZE, which is useful for machine-readable
+ * output that cannot be split to more lines.
+ */
+void
+cli_write_line(cli *c, int code, byte *msg, uint len)
+{
+  byte pfx[16];
+  int errcode;
+  int size = cli_reply_prefix(c, code, pfx, &errcode);
+  byte *buf;
+
+  if (size + len + 1 > CLI_LONG_LINE_SIZE)
+    {
+      cli_printf(c, errcode, "<line overflow>");
+      return;
+    }
+
+  buf = cli_alloc_out(c, size + len + 1);
+  memcpy(buf, pfx, size);
+  memcpy(buf + size, msg, len);
+  buf[size + len] = '\n';
+}
+
 static void
 cli_copy_message(cli *c)
 {
@@ -225,7 +283,7 @@ void
 cli_written(cli *c)
 {
   cli_free_out(c);
-  ev_schedule(c->event);
+  ev_schedule_cli(c->event);
 }
 
 
@@ -260,6 +318,7 @@ cli_command(struct cli *c)
   if (config->cli_debug > 1)
     log(L_TRACE "CLI: %s", c->rx_buf);
   bzero(&f, sizeof(f));
+  f.pool = c->pool;
   f.mem = c->parser_pool;
   cf_read_hook = cli_cmd_read_hook;
   cli_rh_pos = c->rx_buf;
@@ -268,10 +327,105 @@ cli_command(struct cli *c)
   this_cli = c;
   lp_flush(c->parser_pool);
   res = cli_parse(&f);
+  if (f.sym_hash.data)
+    mb_free(f.sym_hash.data);
   if (!res)
     cli_printf(c, 9001, f.err_msg);
 }
 
+/*
+ * Batches of commands are executed from a buffer, each command is parsed
+ * separately as if it was received from the connection. Replies of all commands
+ * form one reply, each is preceded by a line with the line number of the
+ * command and its final line is turned to a continuation line. A command with
+ * continuation (e.g. show route) suspends the batch until it is finished.
+ */
+
+/**
+ * cli_batch - execute a batch of commands
+ * @c: CLI connection
+ * @buf: buffer allocated from the pool of @c, one command per line
+ * @len: length of data in @buf
+ *
+ * The buffer is owned by the batch then. Commands are executed in cli_event(),
+ * at most %CLI_BATCH_STEP of them in one event. Empty lines and lines starting
+ * with a hash are ignored.
+ */
+void
+cli_batch(cli *c, byte *buf, uint len)
+{
+  struct cli_batch *b = mb_allocz(c->pool, sizeof(struct cli_batch));
+
+  b->buf = b->pos = buf;
+  b->end = buf + len;
+  c->batch = b;
+}
+
+static void
+cli_batch_step(cli *c)
+{
+  struct cli_batch *b = c->batch;
+  uint max = CLI_BATCH_STEP;
+
+  for (;;)
+    {
+      /* The last command continues in the next events */
+      if (c->cont)
+	return;
+
+      if (b->running)
+	{
+	  b->running = 0;
+	  b->cmds++;
+	  if (b->code >= 8000)
+	    b->failed++;
+	}
+
+      if (b->pos >= b->end)
+	break;
+
+      if (!max--)
+	{
+	  ev_schedule_cli(c->event);
+	  return;
+	}
+
+      byte *d = c->rx_buf;
+      byte *dend = c->rx_buf + CLI_RX_BUF_SIZE - 2;
+
+      while ((b->pos < b->end) && (*b->pos != '\n'))
+	{
+	  if ((*b->pos != '\r') && (d < dend))
+	    *d++ = *b->pos;
+	  b->pos++;
+	}
+      *d = 0;
+      b->pos++;
+      b->line++;
+
+      byte *t = c->rx_buf;
+      while ((*t == ' ') || (*t == '\t'))
+	t++;
+
+      if (!*t || (*t == '#'))
+	continue;
+
+      cli_printf(c, -27, "Line %u", b->line);
+      b->code = 0;
+      b->running = 1;
+
+      if (d < dend)
+	cli_command(c);
+      else
+	cli_printf(c, 9000, "Command too long");
+    }
+
+  c->batch = NULL;
+  cli_printf(c, 28, "Batch finished, %u commands, %u failed", b->cmds, b->failed);
+  mb_free(b->buf);
+  mb_free(b);
+}
+
 static void
 cli_event(void *data)
 {
@@ -286,6 +440,8 @@ cli_event(void *data)
     ;
   else if (c->cont)
     c->cont(c);
+  else if (c->batch)
+    cli_batch_step(c);
   else
     {
       err = cli_get_command(c);
@@ -315,7 +471,7 @@ cli_new(void *priv)
   c->cont = cli_hello;
   c->parser_pool = lp_new(c->pool, 4096);
   c->rx_buf = mb_alloc(c->pool, CLI_RX_BUF_SIZE);
-  ev_schedule(c->event);
+  ev_schedule_cli(c->event);
   return c;
 }
 
@@ -323,7 +479,7 @@ void
 cli_kick(cli *c)
 {
   if (!c->cont && !c->tx_pos)
-    ev_schedule(c->event);
+    ev_schedule_cli(c->event);
 }
 
 static list cli_log_hooks;
@@ -375,7 +531,7 @@ cli_echo(uint class, byte *msg)
 	  continue;
 	}
       if (c->ring_read == c->ring_write)
-	ev_schedule(c->event);
+	ev_schedule_cli(c->event);
       m = msg;
       l = len;
       while (l)
@@ -11,6 +11,7 @@
 
 #include "lib/resource.h"
 #include "lib/event.h"
+#include "lib/buffer.h"
 
 #define CLI_RX_BUF_SIZE 4096
 #define CLI_TX_BUF_SIZE 4096
@@ -18,6 +19,8 @@
 
 #define CLI_MSG_SIZE 500
 #define CLI_LINE_SIZE 512
+#define CLI_LONG_LINE_SIZE 2048
+#define CLI_BATCH_STEP 64
 
 struct cli_out {
   struct cli_out *next;
@@ -29,7 +32,9 @@ typedef struct cli {
   node n;				/* Node in list of all log hooks */
   pool *pool;
   void *priv;				/* Private to sysdep layer */
-  byte *rx_buf, *rx_pos, *rx_aux;	/* sysdep */
+  byte *rx_buf, *rx_pos;		/* sysdep */
+  BUFFER(byte) rx_queue;		/* sysdep, received data not yet read as commands */
+  uint rx_qpos;				/* sysdep, read position in rx_queue */
   struct cli_out *tx_buf, *tx_pos, *tx_write;
   event *event;
   void (*cont)(struct cli *c);
@@ -44,6 +49,7 @@ typedef struct cli {
   uint log_mask;			/* Mask of allowed message levels */
   uint log_threshold;			/* When free < log_threshold, store only important messages */
   uint async_msg_size;			/* Total size of async messages queued in tx_buf */
+  struct cli_batch *batch;		/* Batch of commands being executed, see cli_batch() */
 } cli;
 
 extern pool *cli_pool;
@@ -54,8 +60,10 @@ extern struct cli *this_cli;		/* Used during parsing */
 /* Functions to be called by command handlers */
 
 void cli_printf(cli *, int, char *, ...);
+void cli_write_line(cli *, int, byte *, uint);
 #define cli_msg(x...) cli_printf(this_cli, x)
 void cli_set_log_echo(cli *, uint mask, uint size);
+void cli_batch(cli *, byte *buf, uint len);
 
 /* Functions provided to sysdep layer */
 
@@ -92,6 +92,47 @@ cmd_show_memory(void)
   print_size("ROA tables:", rmemsize(roa_pool));
   print_size("Protocols:", rmemsize(proto_pool));
   print_size("Total:", rmemsize(&root_pool));
+
+  struct page_stats ps;
+  page_alloc_stats(&ps);
+  print_size("Slab pages:", (size_t) ps.used * PAGE_ALLOC_SIZE);
+  cli_msg(-1018, "  %u chunks, %u pages used, %u free in used chunks, %u spare",
+	  ps.chunks, ps.used, ps.free, ps.spare);
+  print_size("Linpool cache:", lp_cache_memsize());
+  cli_msg(0, "");
+}
+
+void
+cmd_show_memory_table(struct rtable_config *tc)
+{
+  struct rt_memory_usage u;
+  struct announce_hook *a;
+  rtable *t = tc->table;
+
+  rt_memory_usage(t, &u);
+
+  cli_msg(-1018, "Table %s memory usage", t->name);
+  cli_msg(-1018, "%-17s %u", "Networks:", u.nets);
+  cli_msg(-1018, "%-17s %u", "Routes:", u.routes);
+  print_size("Network entries:", u.fib);
+  print_size("Route entries:", u.rtes);
+  print_size("Route indices:", u.indices);
+  print_size("Export journal:", u.journal);
+  print_size("Hostcache:", u.hostcache);
+  print_size("Total:", u.fib + u.rtes + u.indices + u.journal + u.hostcache);
+
+  cli_msg(-1018, "Route attributes by protocol:");
+  WALK_LIST(a, t->hooks)
+    {
+      struct proto *p = a->proto;
+      char dsc[64];
+      size_t bytes;
+      uint count;
+
+      rt_source_usage(p, &count, &bytes);
+      bsnprintf(dsc, sizeof(dsc), "  %s (%u):", p->name, count);
+      print_size(dsc, bytes);
+    }
   cli_msg(0, "");
 }
 
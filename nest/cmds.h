@@ -12,8 +12,10 @@ struct sym_show_data {
 };
 
 struct f_inst;
+struct rtable_config;
 
 void cmd_show_status(void);
 void cmd_show_symbols(struct sym_show_data *sym);
 void cmd_show_memory(void);
+void cmd_show_memory_table(struct rtable_config *tc);
 void cmd_eval(struct f_inst *expr);
@@ -21,6 +21,12 @@
  * The interface module keeps a `soft-up' state for each &iface which
  * is a conjunction of link being up, the interface being of a `sane'
  * type and at least one IP address assigned to it.
+ *
+ * Besides the list of all interfaces (&iface_list), interfaces are indexed
+ * by hash tables by name and by index, so the platform dependent code can
+ * pass thousands of interfaces in a scan without walking the list for each.
+ * The index is not unique as interfaces which disappeared are kept, so the
+ * lookup by index skips those with %IF_SHUTDOWN flag.
  */
 
 #undef LOCAL_DEBUG
@@ -31,12 +37,60 @@
 #include "nest/cli.h"
 #include "lib/resource.h"
 #include "lib/string.h"
+#include "lib/hash.h"
 #include "conf/conf.h"
 
 static pool *if_pool;
 
 list iface_list;
 
+static HASH(struct iface) iface_name_hash, iface_index_hash;
+static int if_scanning;			/* Between if_start_update() and if_end_update() */
+
+static inline u32
+if_name_hash(const char *name)
+{
+  u32 h = 0;
+
+  while (*name)
+    h = (h ^ (byte) *name++) * 16777619;
+
+  return u32_hash(h);
+}
+
+#define IFN_KEY(n)		n->name
+#define IFN_NEXT(n)		n->next_name
+#define IFN_EQ(a,b)		!strcmp(a, b)
+#define IFN_FN(k)		if_name_hash(k)
+#define IFN_ORDER		6
+#define IFN_REHASH		if_name_rehash
+#define IFN_PARAMS		/8, *2, 2, 2, 6, 20
+
+#define IFI_KEY(n)		n->index
+#define IFI_NEXT(n)		n->next_index
+#define IFI_EQ(a,b)		a == b
+#define IFI_FN(k)		u32_hash(k)
+#define IFI_ORDER		6
+#define IFI_REHASH		if_index_rehash
+#define IFI_PARAMS		/8, *2, 2, 2, 6, 20
+
+HASH_DEFINE_REHASH_FN(IFN, struct iface)
+HASH_DEFINE_REHASH_FN(IFI, struct iface)
+
+static inline void
+if_hash_add(struct iface *i)
+{
+  HASH_INSERT2(iface_name_hash, IFN, if_pool, i);
+  HASH_INSERT2(iface_index_hash, IFI, if_pool, i);
+}
+
+static inline void
+if_hash_remove(struct iface *i)
+{
+  HASH_REMOVE(iface_name_hash, IFN, i);
+  HASH_REMOVE(iface_index_hash, IFI, i);
+}
+
 /**
  * ifa_dump - dump interface address
  * @a: interface address descriptor
@@ -295,8 +349,7 @@ if_update(struct iface *new)
   struct iface *i;
   unsigned c;
 
-  WALK_LIST(i, iface_list)
-    if (!strcmp(new->name, i->name))
+  if (i = if_find_by_name(new->name))
       {
 	new->addr = i->addr;
 	new->flags = if_recalc_flags(new, new->flags);
@@ -306,6 +359,7 @@ if_update(struct iface *new)
 	    DBG("Interface %s changed too much -- forcing down/up transition\n", i->name);
 	    if_change_flags(i, i->flags | IF_TMP_DOWN);
 	    rem_node(&i->n);
+	    if_hash_remove(i);
 	    new->addr = i->addr;
 	    memcpy(&new->addrs, &i->addrs, sizeof(i->addrs));
 	    memcpy(i, new, sizeof(*i));
@@ -317,7 +371,8 @@ if_update(struct iface *new)
 	if (c)
 	  if_notify_change(c, i);
 
-	i->flags |= IF_UPDATED;
+	if (if_scanning)
+	  i->flags |= IF_UPDATED;
 	return i;
       }
   i = mb_alloc(if_pool, sizeof(struct iface));
@@ -325,23 +380,21 @@ if_update(struct iface *new)
   init_list(&i->addrs);
 newif:
   init_list(&i->neighbors);
-  i->flags |= IF_UPDATED | IF_TMP_DOWN;		/* Tmp down as we don't have addresses yet */
+  i->flags &= ~IF_UPDATED;
+  i->flags |= (if_scanning ? IF_UPDATED : 0) | IF_TMP_DOWN; /* Tmp down as we don't have addresses yet */
   add_tail(&iface_list, &i->n);
+  if_hash_add(i);
   return i;
 }
 
+/*
+ * The %IF_UPDATED flags of interfaces and addresses are set only during the
+ * scan and cleared at its end, so there is nothing to reset at its start.
+ */
 void
 if_start_update(void)
 {
-  struct iface *i;
-  struct ifa *a;
-
-  WALK_LIST(i, iface_list)
-    {
-      i->flags &= ~IF_UPDATED;
-      WALK_LIST(a, i->addrs)
-	a->flags &= ~IF_UPDATED;
-    }
+  if_scanning = 1;
 }
 
 void
@@ -357,15 +410,24 @@ if_end_update(void)
   struct iface *i;
   struct ifa *a, *b;
 
+  if_scanning = 0;
+
   WALK_LIST(i, iface_list)
     {
       if (!(i->flags & IF_UPDATED))
-	if_change_flags(i, (i->flags & ~IF_ADMIN_UP) | IF_SHUTDOWN);
+	{
+	  WALK_LIST(a, i->addrs)
+	    a->flags &= ~IF_UPDATED;
+	  if_change_flags(i, (i->flags & ~IF_ADMIN_UP) | IF_SHUTDOWN);
+	}
       else
 	{
+	  i->flags &= ~IF_UPDATED;
 	  WALK_LIST_DELSAFE(a, b, i->addrs)
 	    if (!(a->flags & IF_UPDATED))
 	      ifa_delete(a);
+	    else
+	      a->flags &= ~IF_UPDATED;
 	  if_end_partial_update(i);
 	}
     }
@@ -416,9 +478,9 @@ if_feed_baby(struct proto *p)
 struct iface *
 if_find_by_index(unsigned idx)
 {
-  struct iface *i;
+  struct iface *i = iface_index_hash.data[HASH_FN(iface_index_hash, IFI, idx)];
 
-  WALK_LIST(i, iface_list)
+  for (; i; i = i->next_index)
     if (i->index == idx && !(i->flags & IF_SHUTDOWN))
       return i;
   return NULL;
@@ -435,12 +497,7 @@ if_find_by_index(unsigned idx)
 struct iface *
 if_find_by_name(char *name)
 {
-  struct iface *i;
-
-  WALK_LIST(i, iface_list)
-    if (!strcmp(i->name, name))
-      return i;
-  return NULL;
+  return HASH_FIND(iface_name_hash, IFN, name);
 }
 
 struct iface *
@@ -458,6 +515,7 @@ if_get_by_name(char *name)
   init_list(&i->addrs);
   init_list(&i->neighbors);
   add_tail(&iface_list, &i->n);
+  if_hash_add(i);
   return i;
 }
 
@@ -527,7 +585,8 @@ ifa_update(struct ifa *a)
 	    b->scope == a->scope &&
 	    !((b->flags ^ a->flags) & IA_PEER))
 	  {
-	    b->flags |= IF_UPDATED;
+	    if (if_scanning)
+	      b->flags |= IF_UPDATED;
 	    return b;
 	  }
 	ifa_delete(b);
@@ -640,6 +699,8 @@ if_init(void)
 {
   if_pool = rp_new(&root_pool, "Interfaces");
   init_list(&iface_list);
+  HASH_INIT(iface_name_hash, if_pool, IFN_ORDER);
+  HASH_INIT(iface_index_hash, if_pool, IFI_ORDER);
   neigh_init(if_pool);
 }
 
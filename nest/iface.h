@@ -37,6 +37,8 @@ struct iface {
   list addrs;				/* Addresses assigned to this interface */
   struct ifa *addr;			/* Primary address */
   list neighbors;			/* All neighbors on this interface */
+  struct iface *next_name;		/* Next in the hash table by name */
+  struct iface *next_index;		/* Next in the hash table by index */
 };
 
 #define IF_UP 1				/* IF_ADMIN_UP and IP address known */
@@ -105,7 +107,8 @@ void ifa_recalc_all_primary_addresses(void);
 /* The Neighbor Cache */
 
 typedef struct neighbor {
-  node n;				/* Node in global neighbor list */
+  node n;				/* Node in list of inactive sticky neighbors */
+  struct neighbor *next;		/* Next in the hash table of active neighbors */
   node if_n;				/* Node in per-interface neighbor list */
   ip_addr addr;				/* Address of the neighbor */
   struct ifa *ifa;			/* Ifa on related iface */
@@ -24,9 +24,10 @@
  * single protocol.
  *
  * Active entries represent known neighbors and are stored in a hash
- * table (to allow fast retrieval based on the IP address of the node) and
- * two linked lists: one global and one per-interface (allowing quick
- * processing of interface change events). Inactive entries exist only
+ * table (to allow fast retrieval based on the IP address of the node),
+ * which is resized according to the number of entries, and in a
+ * per-interface list (allowing quick processing of interface change
+ * events). Inactive entries exist only
  * when the protocol has explicitly requested it via the %NEF_STICKY
  * flag because it wishes to be notified when the node will again become
  * a neighbor. Such entries are enqueued in a special list which is walked
@@ -43,17 +44,22 @@
 #include "nest/iface.h"
 #include "nest/protocol.h"
 #include "lib/resource.h"
+#include "lib/hash.h"
 
-#define NEIGH_HASH_SIZE 256
+#define NH_KEY(n)		n->proto, n->addr
+#define NH_NEXT(n)		n->next
+#define NH_EQ(p1,a1,p2,a2)	p1 == p2 && ipa_equal(a1, a2)
+#define NH_FN(p,a)		u32_hash(p->hash_key ^ ipa_hash32(a))
+#define NH_ORDER		8
+#define NH_REHASH		neigh_rehash
+#define NH_PARAMS		/8, *2, 2, 2, 8, 20
 
+static pool *neigh_pool;
 static slab *neigh_slab;
-static list sticky_neigh_list, neigh_hash_table[NEIGH_HASH_SIZE];
+static list sticky_neigh_list;
+static HASH(neighbor) neigh_hash;
 
-static inline uint
-neigh_hash(struct proto *p, ip_addr *a)
-{
-  return (p->hash_key ^ ipa_hash(*a)) & (NEIGH_HASH_SIZE-1);
-}
+HASH_DEFINE_REHASH_FN(NH, neighbor)
 
 static int
 if_connected(ip_addr *a, struct iface *i, struct ifa **ap)
@@ -126,11 +132,11 @@ neigh_find2(struct proto *p, ip_addr *a, struct iface *ifa, unsigned flags)
 {
   neighbor *n;
   int class, scope = -1;
-  uint h = neigh_hash(p, a);
   struct iface *i;
   struct ifa *addr;
 
-  WALK_LIST(n, neigh_hash_table[h])	/* Search the cache */
+  /* Search the cache, there may be more entries for one address on different ifaces */
+  for (n = neigh_hash.data[HASH_FN(neigh_hash, NH, p, *a)]; n; n = n->next)
     if (n->proto == p && ipa_equal(*a, n->addr) && (!ifa || (ifa == n->iface)))
       return n;
 
@@ -166,9 +172,10 @@ neigh_find2(struct proto *p, ip_addr *a, struct iface *ifa, unsigned flags)
 
   n = sl_alloc(neigh_slab);
   n->addr = *a;
+  n->proto = p;
   if (scope >= 0)
     {
-      add_tail(&neigh_hash_table[h], &n->n);
+      HASH_INSERT2(neigh_hash, NH, neigh_pool, n);
       add_tail(&ifa->neighbors, &n->if_n);
     }
   else
@@ -178,7 +185,6 @@ neigh_find2(struct proto *p, ip_addr *a, struct iface *ifa, unsigned flags)
     }
   n->iface = ifa;
   n->ifa = addr;
-  n->proto = p;
   n->data = NULL;
   n->aux = 0;
   n->flags = flags;
@@ -217,14 +223,13 @@ void
 neigh_dump_all(void)
 {
   neighbor *n;
-  int i;
 
   debug("Known neighbors:\n");
   WALK_LIST(n, sticky_neigh_list)
     neigh_dump(n);
-  for(i=0; i<NEIGH_HASH_SIZE; i++)
-    WALK_LIST(n, neigh_hash_table[i])
-      neigh_dump(n);
+  HASH_WALK(neigh_hash, next, nn)
+    neigh_dump(nn);
+  HASH_WALK_END;
   debug("\n");
 }
 
@@ -236,7 +241,7 @@ neigh_up(neighbor *n, struct iface *i, int scope, struct ifa *a)
   n->scope = scope;
   add_tail(&i->neighbors, &n->if_n);
   rem_node(&n->n);
-  add_tail(&neigh_hash_table[neigh_hash(n->proto, &n->addr)], &n->n);
+  HASH_INSERT2(neigh_hash, NH, neigh_pool, n);
   DBG("Waking up sticky neighbor %I\n", n->addr);
   if (n->proto->neigh_notify && n->proto->core_state != FS_FLUSHING)
     n->proto->neigh_notify(n);
@@ -253,7 +258,7 @@ neigh_down(neighbor *n)
   n->scope = -1;
   if (n->proto->neigh_notify && n->proto->core_state != FS_FLUSHING)
     n->proto->neigh_notify(n);
-  rem_node(&n->n);
+  HASH_REMOVE2(neigh_hash, NH, neigh_pool, n);
   if (n->flags & NEF_STICKY)
     {
       add_tail(&sticky_neigh_list, &n->n);
@@ -366,16 +371,6 @@ neigh_ifa_update(struct ifa *a)
   neigh_if_up(i);
 }
 
-static inline void
-neigh_prune_one(neighbor *n)
-{
-  if (n->proto->proto_state != PS_DOWN)
-    return;
-  rem_node(&n->n);
-  if (n->scope >= 0)
-    rem_node(&n->if_n);
-  sl_free(neigh_slab, n);
-}
 
 /**
  * neigh_prune - prune neighbor cache
@@ -389,14 +384,24 @@ neigh_prune(void)
 {
   neighbor *n;
   node *m;
-  int i;
 
   DBG("Pruning neighbors\n");
-  for(i=0; i<NEIGH_HASH_SIZE; i++)
-    WALK_LIST_DELSAFE(n, m, neigh_hash_table[i])
-      neigh_prune_one(n);
+  HASH_WALK_DELSAFE(neigh_hash, next, nn)
+    if (nn->proto->proto_state == PS_DOWN)
+      {
+	HASH_REMOVE(neigh_hash, NH, nn);
+	rem_node(&nn->if_n);
+	sl_free(neigh_slab, nn);
+      }
+  HASH_WALK_DELSAFE_END;
+  HASH_MAY_RESIZE_DOWN(neigh_hash, NH, neigh_pool);
+
   WALK_LIST_DELSAFE(n, m, sticky_neigh_list)
-    neigh_prune_one(n);
+    if (n->proto->proto_state == PS_DOWN)
+      {
+	rem_node(&n->n);
+	sl_free(neigh_slab, n);
+      }
 }
 
 /**
@@ -409,10 +414,8 @@ neigh_prune(void)
 void
 neigh_init(pool *if_pool)
 {
-  int i;
-
+  neigh_pool = if_pool;
   neigh_slab = sl_new(if_pool, sizeof(neighbor));
   init_list(&sticky_neigh_list);
-  for(i=0; i<NEIGH_HASH_SIZE; i++)
-    init_list(&neigh_hash_table[i]);
+  HASH_INIT(neigh_hash, if_pool, NH_ORDER);
 }
@@ -9,6 +9,7 @@
 
 #include "nest/bird.h"
 #include "nest/password.h"
+#include "conf/conf.h"
 #include "lib/string.h"
 
 struct password_item *last_password_item = NULL;
@@ -51,3 +52,51 @@ password_find_by_id(list *l, int id)
   return NULL;
 }
 
+
+/**
+ * password_prepare - prepare key of a password
+ * @pi: the password
+ *
+ * Called after the password is parsed, it precomputes the HMAC key state, so
+ * it is not derived from the password for each packet. As specified by RFC 5709
+ * and RFC 4822, keys longer than the hash are hashed first.
+ */
+void
+password_prepare(struct password_item *pi)
+{
+  const byte *key = (const byte *) pi->password;
+  uint len = strlen(pi->password);
+  byte hash[SHA256_SIZE];
+
+  if (pi->alg != ALG_HMAC_SHA256)
+    return;
+
+  if (len > SHA256_SIZE)
+  {
+    struct sha256_context ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, key, len);
+    sha256_final(&ctx, hash);
+    key = hash;
+    len = SHA256_SIZE;
+  }
+
+  pi->hmac_key = cfg_alloc(sizeof(struct sha256_hmac_key));
+  sha256_hmac_key(pi->hmac_key, key, len);
+}
+
+/* Maximal MAC length of passwords in the list @l, 0 for no passwords */
+uint
+password_max_mac_length(list *l)
+{
+  struct password_item *pi;
+  uint max = 0;
+
+  if (!l)
+    return 0;
+
+  WALK_LIST(pi, *l)
+    max = MAX(max, password_mac_length(pi));
+
+  return max;
+}
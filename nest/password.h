@@ -10,6 +10,7 @@
 #ifndef PASSWORD_H
 #define PASSWORD_H
 #include "lib/timer.h"
+#include "lib/sha256.h"
 
 #define MD5_AUTH_SIZE 16
 
@@ -17,13 +18,24 @@ struct password_item {
   node n;
   char *password;
   int id;
+  int alg;				/* Cryptographic algorithm, ALG_* */
+  struct sha256_hmac_key *hmac_key;	/* Prepared key for ALG_HMAC_SHA256 */
   bird_clock_t accfrom, accto, genfrom, gento;
 };
 
+#define ALG_KEYED_MD5	1
+#define ALG_HMAC_SHA256	2
+
 extern struct password_item *last_password_item;
 
 struct password_item *password_find(list *l, int first_fit);
 struct password_item *password_find_by_id(list *l, int id);
+void password_prepare(struct password_item *pi);
+uint password_max_mac_length(list *l);
+
+/* Length of the MAC (digest) generated with the password */
+static inline uint password_mac_length(struct password_item *pi)
+{ return (pi->alg == ALG_HMAC_SHA256) ? SHA256_SIZE : MD5_AUTH_SIZE; }
 
 static inline int password_verify(struct password_item *p1, char *p2, uint size)
 {
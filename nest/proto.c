@@ -36,6 +36,11 @@ static struct proto *initial_device_proto;
 static event *proto_flush_event;
 static timer *proto_shutdown_timer;
 static timer *gr_wait_timer;
+static timer *proto_cpu_timer;		/* Updates averages of CPU usage */
+
+#define CPU_TICK	5		/* Interval of updates of CPU averages (s) */
+#define CPU_EXP_1	1884		/* CPU_FIXED_1 / exp(5 s / 1 min) */
+#define CPU_EXP_5	2014		/* CPU_FIXED_1 / exp(5 s / 5 min) */
 
 #define GRS_NONE	0
 #define GRS_INIT	1
@@ -48,12 +53,17 @@ static u32 graceful_restart_locks;
 static char *p_states[] = { "DOWN", "START", "UP", "STOP" };
 static char *c_states[] = { "HUNGRY", "???", "HAPPY", "FLUSHING" };
 
+static list proto_feed_queue;		/* Protocols waiting for admission to feeding */
+static uint proto_feeding;		/* Number of protocols admitted to feeding */
+
 static void proto_flush_loop(void *);
 static void proto_shutdown_loop(struct timer *);
+static void proto_cpu_tick(struct timer *);
 static void proto_rethink_goal(struct proto *p);
 static void proto_want_export_up(struct proto *p);
 static void proto_fell_down(struct proto *p);
-static char *proto_state_name(struct proto *p);
+static void proto_feed_next(void);
+static void proto_feed_release(struct proto *p);
 
 static void
 proto_relink(struct proto *p)
@@ -129,13 +139,17 @@ proto_new(struct proto_config *c, unsigned size)
   return p;
 }
 
+static void proto_feed_timeout(timer *t);
+
 static void
 proto_init_instance(struct proto *p)
 {
   /* Here we cannot use p->cf->name since it won't survive reconfiguration */
   p->pool = rp_new(proto_pool, p->proto->name);
+  rp_set_account(p->pool, &p->cpu);
   p->attn = ev_new(p->pool);
   p->attn->data = p;
+  p->feed_timer = tm_new_set(p->pool, proto_feed_timeout, p, 0, 0);
 
   if (graceful_restart_state == GRS_INIT)
     p->gr_recovery = 1;
@@ -178,6 +192,7 @@ proto_add_announce_hook(struct proto *p, struct rtable *t, struct proto_stats *s
   h->table = t;
   h->proto = p;
   h->stats = stats;
+  proto_set_export_rate(h, p->cf->export_rate);
 
   h->next = p->ahooks;
   p->ahooks = h;
@@ -223,7 +238,10 @@ proto_unlink_ahooks(struct proto *p)
 
   if (p->rt_notify)
     for(h=p->ahooks; h; h=h->next)
+    {
       rem_node(&h->n);
+      rt_export_cache_flush(h);
+    }
 }
 
 static void
@@ -234,6 +252,7 @@ proto_free_ahooks(struct proto *p)
   for(h = p->ahooks; h; h = hn)
   {
     hn = h->next;
+    rt_export_cache_flush(h);
     mb_free(h);
   }
 
@@ -438,10 +457,12 @@ proto_reconfigure(struct proto *p, struct proto_config *oc, struct proto_config
       struct announce_hook *ah = p->main_ahook;
       ah->in_filter = nc->in_filter;
       ah->out_filter = nc->out_filter;
+      rt_export_cache_flush(ah);
       ah->rx_limit = nc->rx_limit;
       ah->in_limit = nc->in_limit;
       ah->out_limit = nc->out_limit;
       ah->in_keep_filtered = nc->in_keep_filtered;
+      proto_set_export_rate(ah, nc->export_rate);
       proto_verify_limits(ah);
     }
 
@@ -592,6 +613,9 @@ protos_commit(struct config *new, struct config *old, int force_reconfig, int ty
   /* Start all other protocols */
   WALK_LIST_DELSAFE(p, n, initial_proto_list)
     proto_rethink_goal(p);
+
+  /* Feed limit may have been raised */
+  proto_feed_next();
 }
 
 static void
@@ -608,6 +632,7 @@ proto_rethink_goal(struct proto *p)
       config_del_obstacle(p->cf->global);
       rem_node(&p->n);
       rem_node(&p->glob_node);
+      cpu_account_drop(&p->cpu);
       mb_free(p);
       if (!nc)
 	return;
@@ -856,6 +881,24 @@ protos_dump_all(void)
     debug("  flushing %s\n", p->name);
 }
 
+/**
+ * protos_handoff - pass sessions of protocols to a new process
+ *
+ * Called by the platform code when the daemon is handed off to a new process
+ * (see sysdep/unix/handoff.c). Protocols with a handoff() hook pass there the
+ * state of their running instances. The daemon exits right after that, the
+ * protocols are not shut down.
+ */
+void
+protos_handoff(void)
+{
+  struct protocol *p;
+
+  WALK_LIST(p, protocol_list)
+    if (p->handoff)
+      p->handoff();
+}
+
 /**
  * proto_build - make a single protocol available
  * @p: the protocol
@@ -896,7 +939,9 @@ protos_build(void)
   init_list(&inactive_proto_list);
   init_list(&initial_proto_list);
   init_list(&flush_proto_list);
+  init_list(&proto_feed_queue);
   proto_build(&proto_device);
+  proto_build(&proto_snapshot);
 #ifdef CONFIG_RADV
   proto_build(&proto_radv);
 #endif
@@ -919,12 +964,23 @@ protos_build(void)
   proto_build(&proto_bfd);
   bfd_init_all();
 #endif
+#ifdef CONFIG_BMP
+  proto_build(&proto_bmp);
+#endif
+#ifdef CONFIG_RPKI
+  proto_build(&proto_rpki);
+#endif
+#ifdef CONFIG_METRICS
+  proto_build(&proto_metrics);
+#endif
 
   proto_pool = rp_new(&root_pool, "Protocols");
   proto_flush_event = ev_new(proto_pool);
   proto_flush_event->hook = proto_flush_loop;
   proto_shutdown_timer = tm_new(proto_pool);
   proto_shutdown_timer->hook = proto_shutdown_loop;
+  proto_cpu_timer = tm_new_set(proto_pool, proto_cpu_tick, NULL, 0, CPU_TICK);
+  tm_start(proto_cpu_timer, CPU_TICK);
 }
 
 static void
@@ -936,22 +992,36 @@ proto_feed_more(void *P)
     return;
 
   DBG("Feeding protocol %s continued\n", p->name);
-  if (rt_feed_baby(p))
+  switch (rt_feed_baby(p))
     {
+    case 1:
       DBG("Feeding protocol %s finished\n", p->name);
+      proto_feed_release(p);
       p->export_state = ES_READY;
       proto_log_state_change(p);
 
       if (p->feed_end)
 	p->feed_end(p);
-    }
-  else
-    {
+      break;
+
+    case 0:
       p->attn->hook = proto_feed_more;
-      ev_schedule(p->attn);		/* Will continue later... */
+      ev_schedule_work(p->attn);	/* Will continue later... */
+      break;
+
+    default:
+      DBG("Feeding protocol %s paced\n", p->name);
+      tm_start(p->feed_timer, 1);	/* Wait for new tokens */
+      break;
     }
 }
 
+static void
+proto_feed_timeout(timer *t)
+{
+  proto_feed_more(t->data);
+}
+
 static void
 proto_feed_initial(void *P)
 {
@@ -966,6 +1036,55 @@ proto_feed_initial(void *P)
   proto_feed_more(P);
 }
 
+/*
+ * Feeding of many protocols at once (e.g. after startup with many BGP
+ * sessions) makes all of them progress slowly, as their feeds are
+ * interleaved in the main loop. Therefore, at most config->feed_limit
+ * protocols are admitted to feeding at a time, others wait in
+ * proto_feed_queue in order of their requests. A protocol keeps its
+ * admission when its feeding is restarted.
+ */
+
+static void
+proto_feed_admit(struct proto *p)
+{
+  p->feed_admitted = 1;
+  proto_feeding++;
+  ev_schedule(p->attn);
+}
+
+static void
+proto_feed_next(void)
+{
+  struct proto *p;
+
+  while (!EMPTY_LIST(proto_feed_queue) &&
+	 (!config->feed_limit || (proto_feeding < config->feed_limit)))
+    {
+      p = SKIP_BACK(struct proto, feed_node, HEAD(proto_feed_queue));
+      rem_node(&p->feed_node);
+      p->feed_node.next = NULL;
+      proto_feed_admit(p);
+    }
+}
+
+static void
+proto_feed_release(struct proto *p)
+{
+  if (p->feed_node.next)
+    {
+      rem_node(&p->feed_node);
+      p->feed_node.next = NULL;
+    }
+
+  if (p->feed_admitted)
+    {
+      p->feed_admitted = 0;
+      proto_feeding--;
+      proto_feed_next();
+    }
+}
+
 static void
 proto_schedule_feed(struct proto *p, int initial)
 {
@@ -975,7 +1094,17 @@ proto_schedule_feed(struct proto *p, int initial)
   p->refeeding = !initial;
 
   p->attn->hook = initial ? proto_feed_initial : proto_feed_more;
-  ev_schedule(p->attn);
+  tm_stop(p->feed_timer);
+
+  if (p->feed_admitted)
+    ev_schedule(p->attn);
+  else if (!p->feed_node.next)
+    {
+      if (config->feed_limit && (proto_feeding >= config->feed_limit))
+	add_tail(&proto_feed_queue, &p->feed_node);
+      else
+	proto_feed_admit(p);
+    }
 
   if (p->feed_begin)
     p->feed_begin(p, initial);
@@ -1104,6 +1233,24 @@ proto_schedule_down(struct proto *p, byte restart, byte code)
  */
 void
 proto_request_feeding(struct proto *p)
+{
+  proto_request_partial_feeding(p, NULL);
+}
+
+/**
+ * proto_request_partial_feeding - request feeding routes of some networks
+ * @p: given protocol
+ * @set: networks to be refed, NULL for all
+ *
+ * Like proto_request_feeding(), but just routes for networks matching @set
+ * are sent again, e.g. after a change of export policy for some prefixes.
+ * Export limits are not reset and the feeding is not announced to the
+ * protocol as a complete one (like for BGP enhanced route refresh). The
+ * function locks @set for the time of feeding. When feeding is already
+ * running, it is restarted for all networks.
+ */
+void
+proto_request_partial_feeding(struct proto *p, struct prefix_set *set)
 {
   ASSERT(p->proto_state == PS_UP);
 
@@ -1119,15 +1266,24 @@ proto_request_feeding(struct proto *p)
 	return;
 
       rt_feed_baby_abort(p);
+      set = NULL;
     }
 
-  /* FIXME: This should be changed for better support of multitable protos */
-  struct announce_hook *ah;
-  for (ah = p->ahooks; ah; ah = ah->next)
-    proto_reset_limit(ah->out_limit);
+  if (set)
+    {
+      prefix_set_lock(set);
+      p->feed_set = set;
+    }
+  else
+    {
+      /* FIXME: This should be changed for better support of multitable protos */
+      struct announce_hook *ah;
+      for (ah = p->ahooks; ah; ah = ah->next)
+	proto_reset_limit(ah->out_limit);
 
-  /* Hack: reset exp_routes during refeed, and do not decrease it later */
-  p->stats.exp_routes = 0;
+      /* Hack: reset exp_routes during refeed, and do not decrease it later */
+      p->stats.exp_routes = 0;
+    }
 
   proto_schedule_feed(p, 0);
   proto_log_state_change(p);
@@ -1257,7 +1413,10 @@ proto_want_export_down(struct proto *p)
 
   /* Need to abort feeding */
   if (p->export_state == ES_FEEDING)
-    rt_feed_baby_abort(p);
+    {
+      rt_feed_baby_abort(p);
+      proto_feed_release(p);
+    }
 
   p->export_state = ES_DOWN;
   proto_unlink_ahooks(p);
@@ -1300,6 +1459,7 @@ proto_fell_down(struct proto *p)
 
   bzero(&p->stats, sizeof(struct proto_stats));
   proto_free_ahooks(p);
+  f_cache_flush();
 
   if (! p->proto->multitable)
     rt_unlock_table(p->table);
@@ -1406,7 +1566,7 @@ proto_notify_state(struct proto *p, unsigned ps)
  *  CLI Commands
  */
 
-static char *
+char *
 proto_state_name(struct proto *p)
 {
 #define P(x,y) ((x << 4) | y)
@@ -1466,6 +1626,50 @@ proto_show_limit(struct proto_limit *l, const char *dsc)
   cli_msg(-1006, "    Action:       %s", proto_limit_name(l));
 }
 
+/*
+ *  CPU time of protocols is measured by the I/O loop (see io_log_event())
+ *  when 'cpu accounting' is enabled. Moving averages of CPU usage are updated
+ *  every %CPU_TICK seconds the same way as load averages of the kernel.
+ */
+
+static inline u32
+cpu_avg(u32 avg, u32 exp, u32 usage)
+{
+  return ((u64) avg * exp + (u64) usage * (CPU_FIXED_1 - exp)) >> CPU_FSHIFT;
+}
+
+static void
+proto_cpu_tick(struct timer *t UNUSED)
+{
+  struct proto *p;
+  node *n;
+
+  if (!config || !config->cpu_accounting)
+    return;
+
+  WALK_LIST2(p, n, proto_list, glob_node)
+    {
+      struct cpu_account *a = &p->cpu;
+      u32 usage = ((a->time - a->last) << CPU_FSHIFT) / (CPU_TICK * 1000000000ULL);
+
+      a->last = a->time;
+      a->avg1 = cpu_avg(a->avg1, CPU_EXP_1, usage);
+      a->avg5 = cpu_avg(a->avg5, CPU_EXP_5, usage);
+    }
+}
+
+static void
+proto_show_cpu(struct cpu_account *a)
+{
+  u64 ms = a->time / 1000000;
+  u32 avg1 = (a->avg1 * 10000) >> CPU_FSHIFT;
+  u32 avg5 = (a->avg5 * 10000) >> CPU_FSHIFT;
+
+  cli_msg(-1006, "  CPU time:       %u.%03u s, %u.%02u%% (1 min), %u.%02u%% (5 min)",
+	  (uint) (ms / 1000), (uint) (ms % 1000),
+	  avg1 / 100, avg1 % 100, avg5 / 100, avg5 % 100);
+}
+
 void
 proto_show_basic_info(struct proto *p)
 {
@@ -1483,6 +1687,13 @@ proto_show_basic_info(struct proto *p)
   proto_show_limit(p->cf->in_limit, "Import limit:");
   proto_show_limit(p->cf->out_limit, "Export limit:");
 
+  if (p->cf->export_rate)
+    cli_msg(-1006, "  Export rate:    %u routes/s%s", p->cf->export_rate,
+	    (p->export_state == ES_FEEDING) && tm_active(p->feed_timer) ? " [paced]" : "");
+
+  if (p->feed_node.next)
+    cli_msg(-1006, "  Feeding:        queued");
+
   if (p->proto_state != PS_DOWN)
     proto_show_stats(&p->stats, p->cf->in_keep_filtered);
 }
@@ -1513,6 +1724,8 @@ proto_cmd_show(struct proto *p, uint verbose, int cnt)
 	cli_msg(-1006, "  Description:    %s", p->cf->dsc);
       if (p->cf->router_id)
 	cli_msg(-1006, "  Router ID:      %R", p->cf->router_id);
+      if (config->cpu_accounting)
+	proto_show_cpu(&p->cpu);
 
       if (p->proto->show_proto_info)
 	p->proto->show_proto_info(p);
@@ -1572,6 +1785,8 @@ proto_cmd_restart(struct proto *p, uint arg UNUSED, int cnt UNUSED)
   cli_msg(-12, "%s: restarted", p->name);
 }
 
+static struct prefix_set *proto_reload_set;	/* Networks to be refed by proto_cmd_reload() */
+
 void
 proto_cmd_reload(struct proto *p, uint dir, int cnt UNUSED)
 {
@@ -1609,11 +1824,35 @@ proto_cmd_reload(struct proto *p, uint dir, int cnt UNUSED)
 
   /* re-exporting routes */
   if (dir != CMD_RELOAD_IN)
-    proto_request_feeding(p);
+    proto_request_partial_feeding(p, proto_reload_set);
 
   cli_msg(-15, "%s: reloading", p->name);
 }
 
+/**
+ * proto_apply_reload - apply reload command to protocols
+ * @ps: protocol specification
+ * @dir: %CMD_RELOAD, %CMD_RELOAD_IN or %CMD_RELOAD_OUT
+ * @trie: networks to be refed, NULL for all
+ *
+ * Like proto_apply_cmd() with proto_cmd_reload(), but exported routes are
+ * sent again just for networks matching @trie. The trie is usually allocated
+ * from the temporary CLI configuration, therefore a copy is shared by
+ * the protocols.
+ */
+void
+proto_apply_reload(struct proto_spec ps, uint dir, struct f_trie *trie)
+{
+  if (trie)
+    proto_reload_set = prefix_set_copy(proto_pool, trie);
+
+  proto_apply_cmd(ps, proto_cmd_reload, 1, dir);
+
+  if (proto_reload_set)
+    prefix_set_unlock(proto_reload_set);
+  proto_reload_set = NULL;
+}
+
 void
 proto_cmd_debug(struct proto *p, uint mask, int cnt UNUSED)
 {
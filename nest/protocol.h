@@ -12,6 +12,8 @@
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/timer.h"
+#include "lib/buffer.h"
+#include "lib/hash.h"
 #include "conf/conf.h"
 
 struct iface;
@@ -28,6 +30,9 @@ struct event;
 struct ea_list;
 struct eattr;
 struct symbol;
+struct prefix_set;
+struct f_trie;
+struct prefix_set;
 
 /*
  *	Routing Protocol
@@ -57,6 +62,7 @@ struct protocol {
   int (*get_attr)(struct eattr *, byte *buf, int buflen);	/* ASCIIfy dynamic attribute (returns GA_*) */
   void (*show_proto_info)(struct proto *);	/* Show protocol info (for `show protocols all' command) */
   void (*copy_config)(struct proto_config *, struct proto_config *);	/* Copy config from given protocol instance */
+  void (*handoff)(void);			/* Pass sessions of all instances to a new process */
 };
 
 void protos_build(void);
@@ -65,6 +71,7 @@ void protos_preconfig(struct config *);
 void protos_postconfig(struct config *);
 void protos_commit(struct config *new, struct config *old, int force_restart, int type);
 void protos_dump_all(void);
+void protos_handoff(void);
 
 #define GA_UNKNOWN	0		/* Attribute not recognized */
 #define GA_NAME		1		/* Result = name */
@@ -76,7 +83,7 @@ void protos_dump_all(void);
 
 extern struct protocol
   proto_device, proto_radv, proto_rip, proto_static,
-  proto_ospf, proto_pipe, proto_bgp, proto_bfd;
+  proto_ospf, proto_pipe, proto_bgp, proto_bfd, proto_bmp, proto_metrics, proto_rpki, proto_snapshot;
 
 /*
  *	Routing Protocol Instance
@@ -100,6 +107,7 @@ struct proto_config {
 					   (relevant when in_keep_filtered is active) */
   struct proto_limit *in_limit;		/* Limit for importing routes from protocol */
   struct proto_limit *out_limit;	/* Limit for exporting routes to protocol */
+  uint export_rate;			/* Max routes per second during feeding, 0 for unlimited */
 
   /* Check proto_reconfigure() and proto_copy_config() after changing struct proto_config */
 
@@ -132,6 +140,11 @@ struct proto_stats {
   u32 exp_withdraws_accepted;	/* Number of route withdraws accepted and processed */
 };
 
+struct feed_net {			/* Network to be fed, see rt_feed_baby() */
+  ip_addr prefix;
+  uint pxlen;
+};
+
 struct proto {
   node n;				/* Node in *_proto_list */
   node glob_node;			/* Node in global proto_list */
@@ -140,18 +153,22 @@ struct proto {
   struct proto_config *cf_new;		/* Configuration we want to switch to after shutdown (NULL=delete) */
   pool *pool;				/* Pool containing local objects */
   struct event *attn;			/* "Pay attention" event */
+  timer *feed_timer;			/* Resumes feeding paced by export rate */
+  node feed_node;			/* Node in queue of protocols waiting for feeding */
 
   char *name;				/* Name of this instance (== cf->name) */
   u32 debug;				/* Debugging flags */
   u32 mrtdump;				/* MRTDump flags */
   unsigned preference;			/* Default route preference */
   byte accept_ra_types;			/* Which types of route announcements are accepted (RA_OPTIMAL or RA_ANY) */
+  byte ra_best_paths;			/* Limit RA_ANY announcements to that number of best routes, 0 for all */
   byte disabled;			/* Manually disabled */
   byte proto_state;			/* Protocol state machine (PS_*, see below) */
   byte core_state;			/* Core state machine (FS_*, see below) */
   byte export_state;			/* Route export state (ES_*, see below) */
   byte reconfiguring;			/* We're shutting down due to reconfiguration */
   byte refeeding;			/* We are refeeding (valid only if export_state == ES_FEEDING) */
+  byte feed_admitted;			/* Protocol is admitted to feeding, see proto_schedule_feed() */
   byte flushing;			/* Protocol is flushed in current flush loop round */
   byte gr_recovery;			/* Protocol should participate in graceful restart recovery */
   byte gr_lock;				/* Graceful restart mechanism should wait for this proto */
@@ -163,6 +180,7 @@ struct proto {
   bird_clock_t last_state_change;	/* Time of last state transition */
   char *last_state_name_announced;	/* Last state name we've announced to the user */
   struct proto_stats stats;		/* Current protocol statistics */
+  struct cpu_account cpu;		/* CPU time of hooks of the protocol */
 
   /*
    *	General protocol hooks:
@@ -180,6 +198,10 @@ struct proto {
    *	   reload_routes   Request protocol to reload all its routes to the core
    *			(using rte_update()). Returns: 0=reload cannot be done,
    *			1= reload is scheduled and will happen (asynchronously).
+   *	   reload_prefixes Like reload_routes, but only routes for networks matching
+   *			the prefix set need to be reloaded. The set may be locked
+   *			and kept until the reload is done. Optional, 0 means that
+   *			reload_routes is used instead.
    *	   feed_begin	Notify protocol about beginning of route feeding.
    *	   feed_end	Notify protocol about finish of route feeding.
    */
@@ -192,6 +214,7 @@ struct proto {
   void (*store_tmp_attrs)(struct rte *rt, struct ea_list *attrs);
   int (*import_control)(struct proto *, struct rte **rt, struct ea_list **attrs, struct linpool *pool);
   int (*reload_routes)(struct proto *);
+  int (*reload_prefixes)(struct proto *, struct prefix_set *set);
   void (*feed_begin)(struct proto *, int initial);
   void (*feed_end)(struct proto *);
 
@@ -204,6 +227,9 @@ struct proto {
    *       rte_mergable	Compare two rte's and decide whether they could be merged (1=yes, 0=no).
    *	   rte_insert	Called whenever a rte is inserted to a routing table.
    *	   rte_remove	Called whenever a rte is removed from the routing table.
+   *	   rta_prepare	Called when a rta enters the attribute cache to fill its decision keys.
+   *	   rte_modify	Called to modify a stale route, see rt_modify_stale(). Returns the
+   *			modified route, the original one or NULL to remove it.
    */
 
   int (*rte_recalculate)(struct rtable *, struct network *, struct rte *, struct rte *, struct rte *);
@@ -212,6 +238,8 @@ struct proto {
   int (*rte_mergable)(struct rte *, struct rte *);
   void (*rte_insert)(struct network *, struct rte *);
   void (*rte_remove)(struct network *, struct rte *);
+  void (*rta_prepare)(struct rta *);
+  struct rte *(*rte_modify)(struct rte *, struct linpool *);
 
   struct rtable *table;			/* Our primary routing table */
   struct rte_src *main_source;		/* Primary route source */
@@ -220,6 +248,9 @@ struct proto {
 
   struct fib_iterator *feed_iterator;	/* Routing table iterator used during protocol feeding */
   struct announce_hook *feed_ahook;	/* Announce hook we currently feed */
+  struct prefix_set *feed_set;		/* Networks to be refed, NULL for all */
+  BUFFER(struct feed_net) feed_nets;	/* Listed networks of feed_set in the fed table, see rt_feed_baby() */
+  uint feed_pos;			/* Next network in feed_nets */
 
   /* Hic sunt protocol-specific data */
 };
@@ -248,6 +279,7 @@ void *proto_new(struct proto_config *, unsigned size);
 void *proto_config_new(struct protocol *, int class);
 void proto_copy_config(struct proto_config *dest, struct proto_config *src);
 void proto_request_feeding(struct proto *p);
+void proto_request_partial_feeding(struct proto *p, struct prefix_set *set);
 
 static inline void
 proto_copy_rest(struct proto_config *dest, struct proto_config *src, unsigned size)
@@ -260,9 +292,11 @@ void proto_graceful_restart_lock(struct proto *p);
 void proto_graceful_restart_unlock(struct proto *p);
 
 #define DEFAULT_GR_WAIT	240
+#define DEFAULT_FEED_LIMIT	8
 
 void proto_show_limit(struct proto_limit *l, const char *dsc);
 void proto_show_basic_info(struct proto *p);
+char *proto_state_name(struct proto *p);
 
 void proto_cmd_show(struct proto *, uint, int);
 void proto_cmd_disable(struct proto *, uint, int);
@@ -273,6 +307,7 @@ void proto_cmd_debug(struct proto *, uint, int);
 void proto_cmd_mrtdump(struct proto *, uint, int);
 
 void proto_apply_cmd(struct proto_spec ps, void (* cmd)(struct proto *, uint, int), int restricted, uint arg);
+void proto_apply_reload(struct proto_spec ps, uint dir, struct f_trie *trie);
 struct proto *proto_get_named(struct symbol *, struct protocol *);
 
 #define CMD_RELOAD	0
@@ -454,7 +489,76 @@ struct announce_hook {
   struct proto_limit *out_limit;	/* Output limit */
   struct proto_stats *stats;		/* Per-table protocol statistics */
   struct announce_hook *next;		/* Next hook for the same protocol */
+  struct export_group *group;		/* Export group the hook belongs to, see below */
   int in_keep_filtered;			/* Routes rejected in import filter are kept */
+  struct tbf feed_tbf;			/* Pacing of feeding, see rt_feed_baby() */
+  u32 refresh_gen;			/* Current refresh cycle, see rt_refresh_begin() */
+  u32 refresh_stale;			/* Routes from older cycles than this one are stale */
+  uint refresh_routes;			/* Routes seen in the current refresh cycle */
+  HASH(struct export_cache_entry) export_cache; /* Last exports by network, see below */
+  slab *export_cache_slab;		/* Slab for export_cache entries, NULL if not used yet */
+};
+
+static inline void
+proto_set_export_rate(struct announce_hook *ah, uint rate)
+{
+  if (ah->feed_tbf.rate != rate)
+    ah->feed_tbf = (struct tbf) { .rate = rate, .burst = rate, .count = rate };
+}
+
+/*
+ *	Export groups
+ *
+ *	Hooks of protocols which are known to produce the same export results
+ *	for any route (i.e. the same export filter and an import_control() hook
+ *	which does not depend on the particular instance) may be gathered by the
+ *	protocol to an export group. During one rte_announce() round, the export
+ *	filter is then evaluated just once per group and the result is reused by
+ *	the other members. Routes originated by a group member are always filtered
+ *	separately.
+ */
+
+struct export_group_entry {
+  struct rte *src;			/* Route the cached result belongs to */
+  struct rte *out;			/* Filtered route, NULL if rejected */
+  struct rte *out_free;		/* Temporary rte to be freed at the end of round */
+  struct ea_list *tmpa;			/* Temporary attributes of the filtered route */
+  u32 round;				/* rte_announce() round of the entry */
+  byte verdict;				/* How the route was accepted or rejected, EGV_* */
+};
+
+struct export_group {
+  struct export_group_entry e[2];	/* Cached results for new and old route */
+  uint hits, misses;			/* Number of reused and evaluated results */
+};
+
+#define EGV_ACCEPT	0		/* Accepted by filter */
+#define EGV_FORCE	1		/* Forced accept by protocol */
+#define EGV_REJECT	2		/* Rejected by protocol */
+#define EGV_DROP	3		/* Silently dropped by protocol */
+#define EGV_FILTER	4		/* Filtered out */
+
+/*
+ *	Export cache
+ *
+ *	Hooks accepting RA_ACCEPTED or RA_MERGED announcements keep for each
+ *	exported network the route the exported one was made of. Routes before
+ *	it in a sorted table are known to be rejected, so just the changed route
+ *	has to be filtered when it is not after it. For RA_MERGED, the cache keeps
+ *	also accepted mergeable routes, whose next hops are then merged without
+ *	filtering them again. Routes modified by the export filter are not kept,
+ *	such networks are not cached. The cache is flushed when the hook is
+ *	unlinked from the table or its filter changes.
+ */
+
+#define EXPORT_CACHE_MERGED	8	/* Max merged routes of a cached network */
+
+struct export_cache_entry {
+  struct export_cache_entry *next;	/* Next in hash chain */
+  struct network *net;
+  struct rte *best;			/* Route the exported one was made of */
+  uint count;				/* Number of routes in merged[] */
+  struct rte *merged[0];		/* Other merged routes (only for RA_MERGED) */
 };
 
 struct announce_hook *proto_add_announce_hook(struct proto *p, struct rtable *t, struct proto_stats *stats);
@@ -12,6 +12,7 @@
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/timer.h"
+#include "lib/hash.h"
 #include "nest/protocol.h"
 
 struct protocol;
@@ -19,6 +20,7 @@ struct proto;
 struct symbol;
 struct filter;
 struct cli;
+struct worker_pool;
 
 /*
  *	Generic data structure for storing network prefixes. Also used
@@ -47,11 +49,17 @@ struct fib_iterator {			/* See lib/slists.h for an explanation */
   byte efef;				/* 0xff to distinguish between iterator and node */
   byte pad[3];
   struct fib_node *node;		/* Or NULL if freshly merged */
-  uint hash;
+  uint hash;				/* Position of current hash chain, see fib_chain() */
 };
 
 typedef void (*fib_init_func)(struct fib_node *);
 
+struct fib_trie_node {			/* Node of optional LPM trie, see rt-fib.c */
+  struct fib_trie_node *c[2];
+  struct fib_node *node;		/* FIB node with exactly this prefix or NULL */
+  byte plen;				/* Address is given by FIB nodes below */
+};
+
 struct fib {
   pool *fib_pool;			/* Pool holding all our data */
   slab *fib_slab;			/* Slab holding all fib nodes */
@@ -62,40 +70,72 @@ struct fib {
   uint entries;				/* Number of entries */
   uint entries_min, entries_max;	/* Entry count limits (else start rehashing) */
   fib_init_func init;			/* Constructor */
+  struct fib_node **old_table;		/* Hash table being migrated to hash_table, or NULL */
+  uint old_order, old_shift;		/* Parameters of old_table */
+  uint rehash_pos;			/* Primary keys below this one are already migrated */
+  slab *trie_slab;			/* Slab for trie nodes, NULL if trie is not used */
+  struct fib_trie_node *trie_root;	/* Root of LPM trie */
 };
 
 void fib_init(struct fib *, pool *, unsigned node_size, unsigned hash_order, fib_init_func init);
 void *fib_find(struct fib *, ip_addr *, int);	/* Find or return NULL if doesn't exist */
 void *fib_get(struct fib *, ip_addr *, int); 	/* Find or create new if nonexistent */
 void *fib_route(struct fib *, ip_addr, int);	/* Longest-match routing lookup */
+void *fib_route_valid(struct fib *, ip_addr, int, int (*valid)(struct fib_node *));	/* Longest-match of acceptable nodes */
+void fib_enable_trie(struct fib *);	/* Index FIB with trie for fast fib_route() */
+void fib_walk_below(struct fib *, ip_addr, int, int (*hook)(struct fib_node *, void *), void *);	/* Walk covered nodes, needs trie */
+void fib_walk_parallel(struct fib *, struct worker_pool *, void (*hook)(struct fib_node *, void *, uint), void *);	/* Walk by worker threads */
+uint fib_collect_parallel(struct fib *, struct worker_pool *, int (*pred)(struct fib_node *, void *), void *, struct fib_node ***);	/* Find nodes by worker threads */
 void fib_delete(struct fib *, void *);	/* Remove fib entry */
 void fib_free(struct fib *);		/* Destroy the fib */
+size_t fib_memsize(struct fib *);	/* Memory used by the fib */
 void fib_check(struct fib *);		/* Consistency check for debugging */
 
 void fit_init(struct fib_iterator *, struct fib *); /* Internal functions, don't call */
+void fit_init_after(struct fib_iterator *, struct fib *, u32 uid);
 struct fib_node *fit_get(struct fib *, struct fib_iterator *);
 void fit_put(struct fib_iterator *, struct fib_node *);
 
+/*
+ *	Hash chains are addressed by their first primary (16-bit) hash key, as
+ *	during incremental rehash they are spread over two hash tables.
+ */
+
+#define FIB_HASH_SPACE (1 << 16)
+#define FIB_WALK_JOBS 64		/* Parallel walks are split to this many jobs */
+
+static inline uint fib_chain_shift(struct fib *f, uint h)
+{ return (f->old_table && (h >= f->rehash_pos)) ? f->old_shift : f->hash_shift; }
+
+static inline struct fib_node **fib_chain(struct fib *f, uint h)
+{ return ((f->old_table && (h >= f->rehash_pos)) ? f->old_table : f->hash_table) + (h >> fib_chain_shift(f, h)); }
+
+static inline uint fib_chain_pos(struct fib *f, uint h)
+{ uint s = fib_chain_shift(f, h); return (h >> s) << s; }
+
+static inline uint fib_chain_next(struct fib *f, uint pos)
+{ return pos + (1 << fib_chain_shift(f, pos)); }
+
 #define FIB_WALK(fib, z) do {					\
-	struct fib_node *z, **ff = (fib)->hash_table;		\
-	uint count = (fib)->hash_size;				\
-	while (count--)						\
-	  for(z = *ff++; z; z=z->next)
+	struct fib_node *z;					\
+	uint fpos;						\
+	for(fpos = 0; fpos < FIB_HASH_SPACE; fpos = fib_chain_next(fib, fpos)) \
+	  for(z = *fib_chain(fib, fpos); z; z=z->next)
 
 #define FIB_WALK_END } while (0)
 
 #define FIB_ITERATE_INIT(it, fib) fit_init(it, fib)
+#define FIB_ITERATE_INIT_AFTER(it, fib, uid) fit_init_after(it, fib, uid)
 
 #define FIB_ITERATE_START(fib, it, z) do {			\
 	struct fib_node *z = fit_get(fib, it);			\
-	uint count = (fib)->hash_size;				\
 	uint hpos = (it)->hash;					\
 	for(;;) {						\
 	  if (!z)						\
             {							\
-	       if (++hpos >= count)				\
+	       if ((hpos = fib_chain_next(fib, hpos)) >= FIB_HASH_SPACE) \
 		 break;						\
-	       z = (fib)->hash_table[hpos];			\
+	       z = *fib_chain(fib, hpos);			\
 	       continue;					\
 	    }
 
@@ -122,6 +162,8 @@ struct rtable_config {
   int gc_max_ops;			/* Maximum number of operations before GC is run */
   int gc_min_time;			/* Minimum time between two consecutive GC runs */
   byte sorted;				/* Routes of network are sorted according to rte_better() */
+  byte trie;				/* FIB is indexed by a trie for longest-prefix match */
+  byte coalesce;			/* Optimal route changes are exported through journal */
 };
 
 typedef struct rtable {
@@ -129,7 +171,7 @@ typedef struct rtable {
   struct fib fib;
   char *name;				/* Name of this table */
   list hooks;				/* List of announcement hooks */
-  int pipe_busy;			/* Pipe loop detection */
+  struct pipe_path *pipe_path;		/* Pipe update being propagated, for loop detection */
   int use_count;			/* Number of protocols using this table */
   struct hostcache *hostcache;
   struct rtable_config *config;		/* Configuration of this table */
@@ -137,15 +179,24 @@ typedef struct rtable {
 					 * delete as soon as use_count becomes 0 and remove
 					 * obstacle from this routing table.
 					 */
-  struct event *rt_event;		/* Routing table event */
+  struct rtable *maint_next;		/* Next in queue of tables scheduled for maintenance */
+  byte maint_queued;			/* Table is queued for maintenance */
+  byte coalesce;			/* Optimal route changes go through journal */
   int gc_counter;			/* Number of operations since last GC */
   bird_clock_t gc_time;			/* Time of last GC */
   byte gc_scheduled;			/* GC is scheduled */
   byte prune_state;			/* Table prune state, 1 -> scheduled, 2-> running */
   byte hcu_scheduled;			/* Hostcache update is scheduled */
-  byte nhu_state;			/* Next Hop Update state */
   struct fib_iterator prune_fit;	/* Rtable prune FIB iterator */
-  struct fib_iterator nhu_fit;		/* Next Hop Update FIB iterator */
+  slab *journal_slab;			/* Export journal entries, NULL if not used yet */
+  struct rt_journal_entry *journal_first, **journal_last; /* Export journal (FIFO) */
+  uint journal_count;			/* Number of nets with pending export */
+  HASH(struct rte_index_entry) src_index; /* Route lookup by (net, source) for nets with many routes */
+  slab *src_index_slab;			/* Slab for src_index entries, NULL if not used yet */
+  HASH(struct hostentry_dep) he_deps;	/* Networks depending on hostentries */
+  slab *he_dep_slab;			/* Slab for he_deps entries, NULL if not used yet */
+  struct hostentry *nhu_first, **nhu_last; /* Queue of changed hostentries for Next Hop Update */
+  node *nhu_pos;			/* Position in deps of the first queued hostentry */
 } rtable;
 
 #define RPS_NONE	0
@@ -166,7 +217,11 @@ struct hostcache {
   linpool *lp;				/* Linpool for trie */
   struct f_trie *trie;			/* Trie of prefixes that might affect hostentries */
   list hostentries;			/* List of all hostentries */
-  byte update_hostcache;
+  struct fib addrs;			/* Hostentries indexed by address (struct hc_addr) */
+  struct hc_update *pending;		/* Prefixes changed since the last update */
+  uint pending_count, pending_size;
+  uint stale;				/* Estimate of unused ranges in the trie */
+  byte update_full;			/* Too many changes, update all hostentries */
 };
 
 struct hostentry {
@@ -176,12 +231,25 @@ struct hostentry {
 					   if host is directly attached */
   struct rtable *tab;			/* Dependent table, part of key*/
   struct hostentry *next;		/* Next in hash chain */
+  struct hostentry *addr_next;		/* Next with the same address, see struct hc_addr */
   unsigned hash_key;			/* Hash key */
   unsigned uc;				/* Use count */
   struct rta *src;			/* Source rta entry */
   ip_addr gw;				/* Chosen next hop */
   byte dest;				/* Chosen route destination type (RTD_...) */
+  byte nhu_queued;			/* Queued for Next Hop Update in the dependent table */
+  byte pxlen;				/* Length of the resolving prefix, HE_NO_RANGE if not in trie */
   u32 igp_metric;			/* Chosen route IGP metric */
+  list deps;				/* Dependent networks (struct hostentry_dep) */
+  struct hostentry *nhu_next;		/* Next in Next Hop Update queue */
+};
+
+struct hostentry_dep {
+  node n;				/* Node in hostentry->deps */
+  struct hostentry_dep *next;		/* Next in hash chain */
+  struct hostentry *he;
+  net *net;
+  uint uc;				/* Number of routes of the network using the hostentry */
 };
 
 typedef struct rte {
@@ -192,6 +260,7 @@ typedef struct rte {
   byte flags;				/* Flags (REF_...) */
   byte pflags;				/* Protocol-specific flags */
   word pref;				/* Route preference */
+  u32 refresh_gen;			/* Refresh cycle of the sender it was last seen in */
   bird_clock_t lastmod;			/* Last modified */
   union {				/* Protocol-dependent data (metrics etc.) */
 #ifdef CONFIG_RIP
@@ -226,9 +295,9 @@ typedef struct rte {
 
 #define REF_COW		1		/* Copy this rte on write */
 #define REF_FILTERED	2		/* Route is rejected by import filter */
-#define REF_STALE	4		/* Route is stale in a refresh cycle */
 #define REF_DISCARD	8		/* Route is scheduled for discard */
 #define REF_LEAKED 16       /* Route is leaked; TODO: shouldn't it be first BGP protocol specific flag? */
+#define REF_MODIFY	32		/* Route is scheduled for modification, see rt_modify_stale() */
 
 /* Route is valid for propagation (may depend on other flags in the future), accepts NULL */
 static inline int rte_is_valid(rte *r) { return r && !(r->flags & REF_FILTERED); }
@@ -252,8 +321,28 @@ static inline int rte_is_leaked(rte *r) {return !!(r->flags & REF_LEAKED); }
 #define RIC_REJECT	-1		/* Rejected by protocol */
 #define RIC_DROP	-2		/* Silently dropped by protocol */
 
+/*
+ *	Batch of route updates, see rte_batch_start()
+ */
+
+#define RTE_BATCH_SIZE	64		/* Max number of pending updates before flush */
+
+struct rte_batch {
+  struct announce_hook *ah;		/* Announce hook the updates are sent by */
+  uint count;				/* Number of pending updates */
+  struct rte_batch_item {
+    net *net;
+    rte *new;
+    struct rte_src *src;
+    struct ea_list *tmpa;		/* Temporary attributes for the import filter */
+    int filter;				/* Import filter is pending */
+  } items[RTE_BATCH_SIZE];
+};
+
 struct config;
 
+extern struct worker_pool *rt_workers;	/* Threads for bulk walks of tables, or NULL */
+
 void rt_init(void);
 void rt_preconfig(struct config *);
 void rt_commit(struct config *new, struct config *old);
@@ -266,17 +355,33 @@ rte *rte_find(net *net, struct rte_src *src);
 rte *rte_get_temp(struct rta *);
 void rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src);
 static inline void rte_update(struct proto *p, net *net, rte *new) { rte_update2(p->main_ahook, net, new, p->main_source); }
+void rte_batch_start(struct rte_batch *b, struct announce_hook *ah);
+void rte_batch_update(struct rte_batch *b, net *net, rte *new, struct rte_src *src);
+void rte_batch_end(struct rte_batch *b);
 void rte_discard(rtable *tab, rte *old);
 int rt_examine(rtable *t, ip_addr prefix, int pxlen, struct proto *p, struct filter *filter);
 rte *rt_export_merged(struct announce_hook *ah, net *net, rte **rt_free, struct ea_list **tmpa, int silent);
+void rt_export_cache_flush(struct announce_hook *ah);
 void rt_refresh_begin(rtable *t, struct announce_hook *ah);
 void rt_refresh_end(rtable *t, struct announce_hook *ah);
+void rt_modify_stale(rtable *t, struct announce_hook *ah);
 void rte_dump(rte *);
 void rte_free(rte *);
 rte *rte_do_cow(rte *);
 static inline rte * rte_cow(rte *r) { return (r->flags & REF_COW) ? rte_do_cow(r) : r; }
 rte *rte_cow_rta(rte *r, linpool *lp);
 void rt_dump(rtable *);
+
+struct rt_memory_usage {
+  uint nets, routes;			/* Number of networks and routes */
+  size_t fib;				/* FIB nodes, hash tables and trie */
+  size_t rtes;				/* Route entries */
+  size_t indices;			/* Source and hostentry dependency indices */
+  size_t journal;			/* Export journal */
+  size_t hostcache;			/* Hostcache of the table */
+};
+
+void rt_memory_usage(rtable *, struct rt_memory_usage *);
 void rt_dump_all(void);
 int rt_feed_baby(struct proto *p);
 void rt_feed_baby_abort(struct proto *p);
@@ -305,6 +410,11 @@ struct rt_show_data {
   struct config *running_on_config;
   int net_counter, rt_counter, show_counter;
   int stats, show_for;
+  int show_in;				/* Walk networks in prefix/pxlen range */
+  int json;				/* Machine-readable output, one route per line */
+  int use_cursor;			/* Start the walk after the cursor */
+  u32 cursor;				/* Network uid from previous 'Cursor' reply */
+  uint limit, net_shown;		/* Networks shown before a cursor is returned */
 };
 void rt_show(struct rt_show_data *);
 
@@ -336,11 +446,30 @@ struct rte_src {
   u32 private_id;			/* Private ID, assigned by the protocol */
   u32 global_id;			/* Globally unique ID of the source */
   unsigned uc;				/* Use count */
+  uint rta_count;			/* Number of cached rta's based on the source */
+  size_t rta_bytes;			/* Memory used by these rta's, excluding interned data */
 };
 
 
+/*
+ *	Decision keys are precomputed by the rta_prepare() hook of the source
+ *	protocol when the rta enters the attribute cache, so the best route
+ *	selection does not have to search the extended attribute list. Their
+ *	meaning is protocol-specific and they are valid only in cached rta's.
+ */
+struct rta_keys {
+  u64 rank;				/* Packed leading criteria, higher is better */
+  u32 pref;				/* Preference (BGP: LOCAL_PREF) */
+  u32 metric;				/* Metric (BGP: MULTI_EXIT_DISC) */
+  u32 neighbor;				/* Neighbor (BGP: first AS in AS_PATH) */
+  u32 originator;			/* Originating router (BGP: ORIGINATOR_ID, 0 if missing) */
+  u16 length;				/* Path length (BGP: AS_PATH length) */
+  u16 hops;				/* Hops in the local domain (BGP: CLUSTER_LIST length) */
+  byte origin;				/* Origin (BGP: ORIGIN) */
+  byte stale;				/* Stale route (BGP: LLGR_STALE community) */
+};
+
 typedef struct rta {
-  struct rta *next, **pprev;		/* Hash chain */
   struct rte_src *src;			/* Route source that created the route */
   unsigned uc;				/* Use count */
   byte source;				/* Route source (RTS_...) */
@@ -349,8 +478,9 @@ typedef struct rta {
   byte dest;				/* Route destination type (RTD_...) */
   byte flags;				/* Route flags (RTF_...), now unused */
   byte aflags;				/* Attribute cache flags (RTAF_...) */
-  u16 hash_key;				/* Hash over important fields */
+  u32 hash_key;				/* Hash over important fields */
   u32 igp_metric;			/* IGP metric to next hop (for iBGP routes) */
+  struct rta_keys keys;			/* Precomputed decision keys, see above */
   ip_addr gw;				/* Next hop */
   ip_addr from;				/* Advertising router */
   struct hostentry *hostentry;		/* Hostentry for recursive next-hops */
@@ -386,9 +516,11 @@ typedef struct rta {
 #define RTD_MULTIPATH 5			/* Multipath route (nexthops != NULL) */
 #define RTD_NONE 6			/* Invalid RTD */
 
-					/* Flags for net->n.flags, used by kernel syncer */
+					/* Flags for net->n.flags, mostly used by kernel syncer */
 #define KRF_INSTALLED 0x80		/* This route should be installed in the kernel */
 #define KRF_SYNC_ERROR 0x40		/* Error during kernel table synchronization */
+#define NF_JOURNAL 0x20			/* Network has pending entry in export journal */
+#define NF_INDEXED 0x10			/* Routes of the network are in the table source index */
 
 #define RTAF_CACHED 1			/* This is a cached rta */
 
@@ -459,7 +591,7 @@ static inline int adata_same(struct adata *a, struct adata *b)
 typedef struct ea_list {
   struct ea_list *next;			/* In case we have an override list */
   byte flags;				/* Flags: EALF_... */
-  byte rfu;
+  byte index_class;			/* Attribute class of the direct index (EALF_INDEXED) */
   word count;				/* Number of attributes */
   eattr attrs[0];			/* Attribute definitions themselves */
 } ea_list;
@@ -467,12 +599,23 @@ typedef struct ea_list {
 #define EALF_SORTED 1			/* Attributes are sorted by code */
 #define EALF_BISECT 2			/* Use interval bisection for searching */
 #define EALF_CACHED 4			/* Attributes belonging to cached rta */
+#define EALF_INDEXED 8			/* Direct index follows the attributes */
+
+/*
+ * Cached lists of enough attributes carry a direct index for the low IDs of
+ * their dominant attribute class (e.g. ORIGIN .. eOTC for BGP), placed just
+ * after the attribute array. Entries are positions in @attrs plus one.
+ */
+#define EA_INDEX_SIZE 32
+#define EA_INDEX_MIN 4
+#define ea_index(e) ((byte *) &(e)->attrs[(e)->count])
 
 struct rte_src *rt_find_source(struct proto *p, u32 id);
 struct rte_src *rt_get_source(struct proto *p, u32 id);
 static inline void rt_lock_source(struct rte_src *src) { src->uc++; }
 static inline void rt_unlock_source(struct rte_src *src) { src->uc--; }
 void rt_prune_sources(void);
+void rt_source_usage(struct proto *p, uint *count, size_t *bytes);
 
 struct ea_walk_state {
   ea_list *eattrs;			/* Ccurrent ea_list, initially set by caller */
@@ -484,11 +627,12 @@ eattr *ea_find(ea_list *, unsigned ea);
 eattr *ea_walk(struct ea_walk_state *s, uint id, uint max);
 int ea_get_int(ea_list *, unsigned ea, int def);
 void ea_dump(ea_list *);
+void ea_format(eattr *e, byte *buf, uint size);
 void ea_sort(ea_list *);		/* Sort entries in all sub-lists */
 unsigned ea_scan(ea_list *);		/* How many bytes do we need for merged ea_list */
 void ea_merge(ea_list *from, ea_list *to); /* Merge sub-lists to allocated buffer */
 int ea_same(ea_list *x, ea_list *y);	/* Test whether two ea_lists are identical */
-uint ea_hash(ea_list *e);	/* Calculate 16-bit hash value */
+uint ea_hash(ea_list *e);	/* Calculate 32-bit hash value */
 ea_list *ea_append(ea_list *to, ea_list *what);
 void ea_format_bitfield(struct eattr *a, byte *buf, int bufsize, const char **names, int min, int max);
 
@@ -507,6 +651,7 @@ rta *rta_do_cow(rta *o, linpool *lp);
 static inline rta * rta_cow(rta *r, linpool *lp) { return rta_is_cached(r) ? rta_do_cow(r, lp) : r; }
 void rta_dump(rta *);
 void rta_dump_all(void);
+void rta_show_stats(void);
 void rta_show(struct cli *, rta *, ea_list *);
 void rta_set_recursive_next_hop(rtable *dep, rta *a, rtable *tab, ip_addr *gw, ip_addr *ll);
 
@@ -543,6 +688,7 @@ extern struct protocol *attr_class_to_protocol[EAP_MAX];
 #define DEF_PREF_BGP		100	/* BGP */
 #define DEF_PREF_PIPE		70	/* Routes piped from other tables */
 #define DEF_PREF_INHERITED	10	/* Routes inherited from other routing daemons */
+#define DEF_PREF_SNAPSHOT	5	/* Routes restored from a table snapshot */
 
 
 /*
@@ -553,18 +699,46 @@ struct roa_item {
   u32 asn;
   byte maxlen;
   byte src;
+  byte stale;				/* To be removed by roa_flush_stale() */
   struct roa_item *next;
 };
 
 struct roa_node {
   struct fib_node n;
   struct roa_item *items;
-  // u32 cached_asn;
 };
 
+struct roa_cache {			/* Memoized result of roa_check() */
+  ip_addr prefix;
+  u32 asn;
+  u32 epoch;				/* Value of roa_table->epoch when validated */
+  byte pxlen;
+  byte result;				/* ROA_* value */
+  byte valid;
+};
+
+struct roa_change {			/* Changed prefix, see roa_cache_valid() */
+  ip_addr prefix;
+  byte pxlen;
+};
+
+#define ROA_CACHE_ORDER	16
+#define ROA_CACHE_SIZE	(1 << ROA_CACHE_ORDER)
+#define ROA_CHANGE_LOG	64		/* Must be a power of two */
+
+struct f_trie;
+struct prefix_set;
+
 struct roa_table {
   node n;				/* Node in roa_table_list */
   struct fib fib;
+  struct f_trie *trie;			/* Index of ROA prefixes for roa_check() */
+  linpool *trie_lp;			/* Nodes of the trie */
+  struct prefix_set *changes;		/* Prefixes affected by changes since last roa_notify() */
+  struct event *notify_event;		/* Revalidation of routes, see roa_notify() */
+  struct roa_cache *cache;		/* Results of roa_check(), NULL until used */
+  struct roa_change log[ROA_CHANGE_LOG];	/* Last changed prefixes, indexed by epoch */
+  u32 epoch;				/* Number of changes */
   char *name;				/* Name of this ROA table */
   struct roa_table_config *cf;		/* Configuration of this ROA table */
 };
@@ -612,9 +786,12 @@ struct roa_show_data {
 
 extern struct roa_table *roa_table_default;
 
-void roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src);
-void roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src);
-void roa_flush(struct roa_table *t, byte src);
+int roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src);
+int roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src);
+uint roa_flush(struct roa_table *t, byte src);
+void roa_mark_stale(struct roa_table *t, byte src);
+uint roa_flush_stale(struct roa_table *t, byte src);
+void roa_notify(struct roa_table *t);
 byte roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn);
 struct roa_table_config * roa_new_table_config(struct symbol *s);
 void roa_add_item_config(struct roa_table_config *rtc, ip_addr prefix, byte pxlen, byte maxlen, u32 asn);
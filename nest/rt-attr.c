@@ -167,6 +167,8 @@ rt_get_source(struct proto *p, u32 id)
   src->private_id = id;
   src->global_id = rte_src_alloc_id();
   src->uc = 0;
+  src->rta_count = 0;
+  src->rta_bytes = 0;
 
   HASH_INSERT2(src_hash, RSH, rta_pool, src);
 
@@ -190,6 +192,30 @@ rt_prune_sources(void)
   HASH_MAY_RESIZE_DOWN(src_hash, RSH, rta_pool);
 }
 
+/**
+ * rt_source_usage - account cached rta's of a protocol
+ * @p: protocol
+ * @count: number of cached rta's is stored here
+ * @bytes: memory used by them is stored here
+ *
+ * The counters are kept in route sources, as sources (and rta's based on
+ * them) may outlive their protocol.
+ */
+void
+rt_source_usage(struct proto *p, uint *count, size_t *bytes)
+{
+  *count = 0;
+  *bytes = 0;
+
+  HASH_WALK(src_hash, next, src)
+    if (src->proto == p)
+    {
+      *count += src->rta_count;
+      *bytes += src->rta_bytes;
+    }
+  HASH_WALK_END;
+}
+
 
 /*
  *	Multipath Next Hop
@@ -350,7 +376,14 @@ ea__find(ea_list *e, unsigned id)
 
   while (e)
     {
-      if (e->flags & EALF_BISECT)
+      if ((e->flags & EALF_INDEXED) && (EA_PROTO(id) == e->index_class) &&
+	  (EA_ID(id) < EA_INDEX_SIZE))
+	{
+	  m = ea_index(e)[EA_ID(id)];
+	  if (m)
+	    return &e->attrs[m-1];
+	}
+      else if (e->flags & EALF_BISECT)
 	{
 	  l = 0;
 	  r = e->count - 1;
@@ -638,6 +671,107 @@ ea_merge(ea_list *e, ea_list *t)
     }
 }
 
+/*
+ *	Interned attribute data
+ *
+ *	Non-embedded attribute data of cached &ea_list's are kept in a global
+ *	table of reference counted blobs, so equal data (e.g. the same AS path
+ *	received from many peers) share one allocation. Cached lists can be
+ *	then compared just by their data pointers.
+ */
+
+struct adata_entry {
+  struct adata_entry *next;		/* Hash chain */
+  u32 hash;				/* Hash of the data */
+  uint uc;				/* Number of cached lists using it */
+  struct adata ad;			/* Data itself, must be the last */
+};
+
+#define ADI_KEY(n)		&n->ad, n->hash
+#define ADI_NEXT(n)		n->next
+#define ADI_EQ(a1,h1,a2,h2)	h1 == h2 && adata_same(a1, a2)
+#define ADI_FN(a,h)		h
+
+#define ADI_REHASH		adata_rehash
+#define ADI_PARAMS		/8, *2, 2, 2, 8, 24
+#define ADI_INIT_ORDER		8
+
+static HASH(struct adata_entry) adata_hash_tab;
+static uint adata_refs;
+
+HASH_DEFINE_REHASH_FN(ADI, struct adata_entry)
+
+static inline u32
+ea_hash_mix(u32 h, u32 v)
+{
+  h ^= u32_hash(v);
+  return ((h << 13) | (h >> 19)) * 5 + 0xe6546b64;
+}
+
+static inline u32
+ea_hash_final(u32 h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+static u32
+adata_hash(struct adata *d)
+{
+  u32 h = ea_hash_mix(0, d->length);
+  int size = d->length;
+  byte *z = d->data;
+  u32 v;
+
+  while (size >= 4)
+    {
+      memcpy(&v, z, 4);
+      h = ea_hash_mix(h, v);
+      z += 4;
+      size -= 4;
+    }
+  for (v = 0; size--; )
+    v = (v << 8) | *z++;
+  return ea_hash_final(ea_hash_mix(h, v));
+}
+
+static struct adata *
+adata_intern(struct adata *d)
+{
+  u32 h = adata_hash(d);
+  struct adata_entry *e = HASH_FIND(adata_hash_tab, ADI, d, h);
+
+  if (!e)
+    {
+      e = mb_alloc(rta_pool, sizeof(struct adata_entry) + d->length);
+      e->hash = h;
+      e->uc = 0;
+      memcpy(&e->ad, d, sizeof(struct adata) + d->length);
+      HASH_INSERT2(adata_hash_tab, ADI, rta_pool, e);
+    }
+
+  e->uc++;
+  adata_refs++;
+  return &e->ad;
+}
+
+static void
+adata_release(struct adata *d)
+{
+  struct adata_entry *e = SKIP_BACK(struct adata_entry, ad, d);
+
+  adata_refs--;
+  if (--e->uc)
+    return;
+
+  HASH_REMOVE2(adata_hash_tab, ADI, rta_pool, e);
+  mb_free(e);
+}
+
 /**
  * ea_same - compare two &ea_list's
  * @x: attribute list
@@ -649,13 +783,17 @@ ea_merge(ea_list *e, ea_list *t)
 int
 ea_same(ea_list *x, ea_list *y)
 {
-  int c;
+  int c, interned;
 
   if (!x || !y)
     return x == y;
   ASSERT(!x->next && !y->next);
   if (x->count != y->count)
     return 0;
+
+  /* Data of two cached lists are equal iff they are shared */
+  interned = x->flags & y->flags & EALF_CACHED;
+
   for(c=0; c<x->count; c++)
     {
       eattr *a = &x->attrs[c];
@@ -664,7 +802,8 @@ ea_same(ea_list *x, ea_list *y)
       if (a->id != b->id ||
 	  a->flags != b->flags ||
 	  a->type != b->type ||
-	  ((a->type & EAF_EMBEDDED) ? a->u.data != b->u.data : !adata_same(a->u.ptr, b->u.ptr)))
+	  ((a->type & EAF_EMBEDDED) ? a->u.data != b->u.data :
+	   (a->u.ptr != b->u.ptr) && (interned || !adata_same(a->u.ptr, b->u.ptr))))
 	return 0;
     }
   return 1;
@@ -674,25 +813,33 @@ static inline ea_list *
 ea_list_copy(ea_list *o)
 {
   ea_list *n;
-  unsigned i, len;
+  unsigned i, len, idx;
 
   if (!o)
     return NULL;
   ASSERT(!o->next);
   len = sizeof(ea_list) + sizeof(eattr) * o->count;
-  n = mb_alloc(rta_pool, len);
+  idx = (o->count >= EA_INDEX_MIN) && (o->count < 256);
+  n = mb_alloc(rta_pool, len + (idx ? EA_INDEX_SIZE : 0));
   memcpy(n, o, len);
-  n->flags |= EALF_CACHED;
+  n->flags = (n->flags & ~EALF_INDEXED) | EALF_CACHED;
   for(i=0; i<o->count; i++)
     {
       eattr *a = &n->attrs[i];
       if (!(a->type & EAF_EMBEDDED))
-	{
-	  unsigned size = sizeof(struct adata) + a->u.ptr->length;
-	  struct adata *d = mb_alloc(rta_pool, size);
-	  memcpy(d, a->u.ptr, size);
-	  a->u.ptr = d;
-	}
+	a->u.ptr = adata_intern(a->u.ptr);
+    }
+
+  /* The list is sorted, the last attribute has the most specific class */
+  if (idx)
+    {
+      byte *x = ea_index(n);
+      bzero(x, EA_INDEX_SIZE);
+      n->index_class = EA_PROTO(n->attrs[n->count-1].id);
+      for(i=0; i<n->count; i++)
+	if ((EA_PROTO(n->attrs[i].id) == n->index_class) && (EA_ID(n->attrs[i].id) < EA_INDEX_SIZE))
+	  x[EA_ID(n->attrs[i].id)] = i + 1;
+      n->flags |= EALF_INDEXED;
     }
   return n;
 }
@@ -709,7 +856,7 @@ ea_free(ea_list *o)
 	{
 	  eattr *a = &o->attrs[i];
 	  if (!(a->type & EAF_EMBEDDED))
-	    mb_free(a->u.ptr);
+	    adata_release(a->u.ptr);
 	}
       mb_free(o);
     }
@@ -800,6 +947,95 @@ ea_show_ec_set(struct cli *c, struct adata *ad, byte *pos, byte *buf, byte *end)
     }
 }
 
+/* Attribute name, followed by ': ' if the value is to be formatted by the caller */
+static byte *
+ea_format_name(eattr *e, byte *pos, byte *end, int *status)
+{
+  struct protocol *p;
+
+  *status = GA_UNKNOWN;
+  if (p = attr_class_to_protocol[EA_PROTO(e->id)])
+    {
+      pos += bsprintf(pos, "%s.", p->name);
+      if (p->get_attr)
+	*status = p->get_attr(e, pos, end - pos);
+      pos += strlen(pos);
+    }
+  else if (EA_PROTO(e->id))
+    pos += bsprintf(pos, "%02x.", EA_PROTO(e->id));
+  else
+    *status = get_generic_attr(e, &pos, end - pos);
+
+  if (*status < GA_NAME)
+    pos += bsprintf(pos, "%02x", EA_ID(e->id));
+  if (*status < GA_FULL)
+    {
+      *pos++ = ':';
+      *pos++ = ' ';
+      *pos = 0;
+    }
+
+  return pos;
+}
+
+/* Value of a simple (non-set) attribute */
+static void
+ea_format_value(eattr *e, byte *pos, byte *end)
+{
+  struct adata *ad = (e->type & EAF_EMBEDDED) ? NULL : e->u.ptr;
+
+  switch (e->type & EAF_TYPE_MASK)
+    {
+    case EAF_TYPE_INT:
+      bsprintf(pos, "%u", e->u.data);
+      break;
+    case EAF_TYPE_OPAQUE:
+      opaque_format(ad, pos, end - pos);
+      break;
+    case EAF_TYPE_IP_ADDRESS:
+      bsprintf(pos, "%I", *(ip_addr *) ad->data);
+      break;
+    case EAF_TYPE_ROUTER_ID:
+      bsprintf(pos, "%R", e->u.data);
+      break;
+    case EAF_TYPE_AS_PATH:
+      as_path_format(ad, pos, end - pos);
+      break;
+    case EAF_TYPE_BITFIELD:
+      bsprintf(pos, "%08x", e->u.data);
+      break;
+    case EAF_TYPE_INT_SET:
+      int_set_format(ad, 1, -1, pos, end - pos);
+      break;
+    case EAF_TYPE_EC_SET:
+      ec_set_format(ad, -1, pos, end - pos);
+      break;
+    case EAF_TYPE_UNDEF:
+    default:
+      bsprintf(pos, "<type %02x>", e->type);
+    }
+}
+
+/**
+ * ea_format - format an &eattr to a buffer
+ * @e: attribute to be formatted
+ * @buf: destination buffer
+ * @size: buffer size, at least %CLI_MSG_SIZE
+ *
+ * This function formats the attribute like ea_show(), that is the name followed
+ * by ': ' and the value, on a single line. Long sets are truncated.
+ */
+void
+ea_format(eattr *e, byte *buf, uint size)
+{
+  byte *end = buf + size;
+  int status;
+  byte *pos = ea_format_name(e, buf, end, &status);
+
+  if (status < GA_FULL)
+    ea_format_value(e, pos, end);
+}
+
 /**
  * ea_show - print an &eattr to CLI
  * @c: destination CLI
@@ -814,61 +1050,24 @@ ea_show_ec_set(struct cli *c, struct adata *ad, byte *pos, byte *buf, byte *end)
 void
 ea_show(struct cli *c, eattr *e)
 {
-  struct protocol *p;
-  int status = GA_UNKNOWN;
+  int status;
   struct adata *ad = (e->type & EAF_EMBEDDED) ? NULL : e->u.ptr;
   byte buf[CLI_MSG_SIZE];
   byte *pos = buf, *end = buf + sizeof(buf);
 
-  if (p = attr_class_to_protocol[EA_PROTO(e->id)])
-    {
-      pos += bsprintf(pos, "%s.", p->name);
-      if (p->get_attr)
-	status = p->get_attr(e, pos, end - pos);
-      pos += strlen(pos);
-    }
-  else if (EA_PROTO(e->id))
-    pos += bsprintf(pos, "%02x.", EA_PROTO(e->id));
-  else
-    status = get_generic_attr(e, &pos, end - pos);
-
-  if (status < GA_NAME)
-    pos += bsprintf(pos, "%02x", EA_ID(e->id));
+  pos = ea_format_name(e, pos, end, &status);
   if (status < GA_FULL)
-    {
-      *pos++ = ':';
-      *pos++ = ' ';
-      switch (e->type & EAF_TYPE_MASK)
-	{
-	case EAF_TYPE_INT:
-	  bsprintf(pos, "%u", e->u.data);
-	  break;
-	case EAF_TYPE_OPAQUE:
-	  opaque_format(ad, pos, end - pos);
-	  break;
-	case EAF_TYPE_IP_ADDRESS:
-	  bsprintf(pos, "%I", *(ip_addr *) ad->data);
-	  break;
-	case EAF_TYPE_ROUTER_ID:
-	  bsprintf(pos, "%R", e->u.data);
-	  break;
-	case EAF_TYPE_AS_PATH:
-	  as_path_format(ad, pos, end - pos);
-	  break;
-	case EAF_TYPE_BITFIELD:
-	  bsprintf(pos, "%08x", e->u.data);
-	  break;
-	case EAF_TYPE_INT_SET:
-	  ea_show_int_set(c, ad, 1, pos, buf, end);
-	  return;
-	case EAF_TYPE_EC_SET:
-	  ea_show_ec_set(c, ad, pos, buf, end);
-	  return;
-	case EAF_TYPE_UNDEF:
-	default:
-	  bsprintf(pos, "<type %02x>", e->type);
-	}
-    }
+    switch (e->type & EAF_TYPE_MASK)
+      {
+      case EAF_TYPE_INT_SET:
+	ea_show_int_set(c, ad, 1, pos, buf, end);
+	return;
+      case EAF_TYPE_EC_SET:
+	ea_show_ec_set(c, ad, pos, buf, end);
+	return;
+      default:
+	ea_format_value(e, pos, end);
+      }
   cli_printf(c, -1012, "\t%s", buf);
 }
 
@@ -891,10 +1090,11 @@ ea_dump(ea_list *e)
     }
   while (e)
     {
-      debug("[%c%c%c]",
+      debug("[%c%c%c%c]",
 	    (e->flags & EALF_SORTED) ? 'S' : 's',
 	    (e->flags & EALF_BISECT) ? 'B' : 'b',
-	    (e->flags & EALF_CACHED) ? 'C' : 'c');
+	    (e->flags & EALF_CACHED) ? 'C' : 'c',
+	    (e->flags & EALF_INDEXED) ? 'I' : 'i');
       for(i=0; i<e->count; i++)
 	{
 	  eattr *a = &e->attrs[i];
@@ -923,8 +1123,11 @@ ea_dump(ea_list *e)
  * ea_hash - calculate an &ea_list hash key
  * @e: attribute list
  *
- * ea_hash() takes an extended attribute list and calculated a hopefully
- * uniformly distributed hash value from its contents.
+ * ea_hash() takes an extended attribute list and calculates a uniformly
+ * distributed 32-bit hash value from its contents. Every word of the
+ * attribute data is mixed in, so lists differing only in a few bits
+ * (e.g. in one AS path element) do not collide. Hashes of interned data
+ * of cached lists are not recomputed.
  */
 inline uint
 ea_hash(ea_list *e)
@@ -937,27 +1140,15 @@ ea_hash(ea_list *e)
       for(i=0; i<e->count; i++)
 	{
 	  struct eattr *a = &e->attrs[i];
-	  h ^= a->id;
+	  h = ea_hash_mix(h, a->id | (a->flags << 16) | (a->type << 24));
 	  if (a->type & EAF_EMBEDDED)
-	    h ^= a->u.data;
+	    h = ea_hash_mix(h, a->u.data);
+	  else if (e->flags & EALF_CACHED)
+	    h = ea_hash_mix(h, SKIP_BACK(struct adata_entry, ad, a->u.ptr)->hash);
 	  else
-	    {
-	      struct adata *d = a->u.ptr;
-	      int size = d->length;
-	      byte *z = d->data;
-	      while (size >= 4)
-		{
-		  h ^= *(u32 *)z;
-		  z += 4;
-		  size -= 4;
-		}
-	      while (size--)
-		h = (h >> 24) ^ (h << 8) ^ *z++;
-	    }
+	    h = ea_hash_mix(h, adata_hash(a->u.ptr));
 	}
-      h ^= h >> 16;
-      h ^= h >> 6;
-      h &= 0xffff;
+      h = ea_hash_final(h);
     }
   return h;
 }
@@ -988,28 +1179,22 @@ ea_append(ea_list *to, ea_list *what)
  *	rta's
  */
 
-static uint rta_cache_count;
-static uint rta_cache_size = 32;
-static uint rta_cache_limit;
-static uint rta_cache_mask;
-static rta **rta_hash_table;
+/*
+ * The attribute cache is an open addressing hash table keyed by the hash of
+ * the attributes, which is also kept in &rta.hash_key. The table is resized
+ * incrementally, see lib/hash.h.
+ */
 
-static void
-rta_alloc_hash(void)
-{
-  rta_hash_table = mb_allocz(rta_pool, sizeof(rta *) * rta_cache_size);
-  if (rta_cache_size < 32768)
-    rta_cache_limit = rta_cache_size * 2;
-  else
-    rta_cache_limit = ~0;
-  rta_cache_mask = rta_cache_size - 1;
-}
+static OA_HASH(rta) rta_cache;
 
 static inline uint
 rta_hash(rta *a)
 {
-  return (((uint) (uintptr_t) a->src) ^ ipa_hash(a->gw) ^
-	  mpnh_hash(a->nexthops) ^ ea_hash(a->eattrs)) & 0xffff;
+  u32 h = ea_hash(a->eattrs);
+  h = ea_hash_mix(h, (u32) (uintptr_t) a->src);
+  h = ea_hash_mix(h, ipa_hash(a->gw));
+  h = ea_hash_mix(h, mpnh_hash(a->nexthops));
+  return ea_hash_final(h);
 }
 
 static inline int
@@ -1042,35 +1227,21 @@ rta_copy(rta *o)
   return r;
 }
 
-static inline void
-rta_insert(rta *r)
+/* Memory used by a cached rta, as accounted to its source protocol */
+static size_t
+rta_memsize(rta *a)
 {
-  uint h = r->hash_key & rta_cache_mask;
-  r->next = rta_hash_table[h];
-  if (r->next)
-    r->next->pprev = &r->next;
-  r->pprev = &rta_hash_table[h];
-  rta_hash_table[h] = r;
-}
+  size_t size = sizeof(rta);
+  struct mpnh *nh;
 
-static void
-rta_rehash(void)
-{
-  uint ohs = rta_cache_size;
-  uint h;
-  rta *r, *n;
-  rta **oht = rta_hash_table;
-
-  rta_cache_size = 2*rta_cache_size;
-  DBG("Rehashing rta cache from %d to %d entries.\n", ohs, rta_cache_size);
-  rta_alloc_hash();
-  for(h=0; h<ohs; h++)
-    for(r=oht[h]; r; r=n)
-      {
-	n = r->next;
-	rta_insert(r);
-      }
-  mb_free(oht);
+  for (nh = a->nexthops; nh; nh = nh->next)
+    size += sizeof(struct mpnh);
+
+  if (a->eattrs)
+    size += ALLOC_OVERHEAD + sizeof(ea_list) + sizeof(eattr) * a->eattrs->count +
+      ((a->eattrs->flags & EALF_INDEXED) ? EA_INDEX_SIZE : 0);
+
+  return size;
 }
 
 /**
@@ -1084,7 +1255,8 @@ rta_rehash(void)
  * set to 1.
  *
  * The extended attribute lists attached to the &rta are automatically
- * converted to the normalized form.
+ * converted to the normalized form. Decision keys of a new entry are
+ * filled by the rta_prepare() hook of the source protocol.
  */
 rta *
 rta_lookup(rta *o)
@@ -1105,19 +1277,20 @@ rta_lookup(rta *o)
     }
 
   h = rta_hash(o);
-  for(r=rta_hash_table[h & rta_cache_mask]; r; r=r->next)
-    if (r->hash_key == h && rta_same(r, o))
+  OA_HASH_WALK_HASH(rta_cache, h, r)
+    if (rta_same(r, o))
       return rta_clone(r);
 
   r = rta_copy(o);
   r->hash_key = h;
   r->aflags = RTAF_CACHED;
+  if (r->src->proto->rta_prepare)
+    r->src->proto->rta_prepare(r);
   rt_lock_source(r->src);
   rt_lock_hostentry(r->hostentry);
-  rta_insert(r);
-
-  if (++rta_cache_count > rta_cache_limit)
-    rta_rehash();
+  oa_hash_insert(&rta_cache.t, h, r);
+  r->src->rta_count++;
+  r->src->rta_bytes += rta_memsize(r);
 
   return r;
 }
@@ -1125,12 +1298,12 @@ rta_lookup(rta *o)
 void
 rta__free(rta *a)
 {
-  ASSERT(rta_cache_count && (a->aflags & RTAF_CACHED));
-  rta_cache_count--;
-  *a->pprev = a->next;
-  if (a->next)
-    a->next->pprev = a->pprev;
+  ASSERT(a->aflags & RTAF_CACHED);
+  if (!oa_hash_remove(&rta_cache.t, a->hash_key, a))
+    bug("rta__free: Cached rta not found");
   a->aflags = 0;		/* Poison the entry */
+  a->src->rta_count--;
+  a->src->rta_bytes -= rta_memsize(a);
   rt_unlock_hostentry(a->hostentry);
   rt_unlock_source(a->src);
   mpnh_free(a->nexthops);
@@ -1164,7 +1337,7 @@ rta_dump(rta *a)
   static char *rtc[] = { "", " BC", " MC", " AC" };
   static char *rtd[] = { "", " DEV", " HOLE", " UNREACH", " PROHIBIT" };
 
-  debug("p=%s uc=%d %s %s%s%s h=%04x",
+  debug("p=%s uc=%d %s %s%s%s h=%08x",
 	a->src->proto->name, a->uc, rts[a->source], ip_scope_text(a->scope), rtc[a->cast],
 	rtd[a->dest], a->hash_key);
   if (!(a->aflags & RTAF_CACHED))
@@ -1191,19 +1364,49 @@ void
 rta_dump_all(void)
 {
   rta *a;
-  uint h;
 
-  debug("Route attribute cache (%d entries, rehash at %d):\n", rta_cache_count, rta_cache_limit);
-  for(h=0; h<rta_cache_size; h++)
-    for(a=rta_hash_table[h]; a; a=a->next)
-      {
-	debug("%p ", a);
-	rta_dump(a);
-	debug("\n");
-      }
+  debug("Route attribute cache (%d entries, %d slots):\n", OA_HASH_COUNT(rta_cache), OA_HASH_SIZE(rta_cache));
+  OA_HASH_WALK(rta_cache, a)
+    {
+      debug("%p ", a);
+      rta_dump(a);
+      debug("\n");
+    }
   debug("\n");
 }
 
+#define RTA_HIST_MAX 8
+
+/**
+ * rta_show_stats - show attribute cache statistics
+ *
+ * This function prints the size of the route attribute cache and a
+ * histogram of probe distances in its hash table to the CLI.
+ */
+void
+rta_show_stats(void)
+{
+  uint hist[RTA_HIST_MAX + 1] = {};
+  uint longest = 0;
+  uint i;
+
+  oa_hash_histogram(&rta_cache.t, hist, RTA_HIST_MAX, &longest);
+
+  cli_msg(-1021, "Route attribute cache:");
+  cli_msg(-1021, "  Entries:        %u", OA_HASH_COUNT(rta_cache));
+  cli_msg(-1021, "  Hash size:      %u", OA_HASH_SIZE(rta_cache));
+  if (rta_cache.t.old)
+    cli_msg(-1021, "  Rehashing:      %u of %u slots left",
+	    (1U << rta_cache.t.old_order) - rta_cache.t.old_pos, 1U << rta_cache.t.old_order);
+  cli_msg(-1021, "  Longest probe:  %u", longest);
+  cli_msg(-1021, "  Interned data:  %u blobs, %u references", adata_hash_tab.count, adata_refs);
+  cli_msg(-1021, "  Probe distances:");
+  for (i = 0; i <= RTA_HIST_MAX; i++)
+    if (hist[i])
+      cli_msg(-1021, "    %u%s\t%u", i, (i == RTA_HIST_MAX) ? "+" : "", hist[i]);
+  cli_msg(0, "");
+}
+
 void
 rta_show(struct cli *c, rta *a, ea_list *eal)
 {
@@ -1232,8 +1435,9 @@ rta_init(void)
   rta_pool = rp_new(&root_pool, "Attributes");
   rta_slab = sl_new(rta_pool, sizeof(rta));
   mpnh_slab = sl_new(rta_pool, sizeof(struct mpnh));
-  rta_alloc_hash();
+  OA_HASH_INIT(rta_cache, rta_pool, 5);
   rte_src_init();
+  HASH_INIT(adata_hash_tab, rta_pool, ADI_INIT_ORDER);
 }
 
 /*
@@ -25,20 +25,43 @@
  * key, hence if we keep the total number of buckets to be a power of two,
  * re-hashing of the structure keeps the relative order of the nodes.
  *
+ * Re-hashing is done incrementally to keep latency of insertions bounded even
+ * for very large tables. When the table has to grow or shrink, a new hash table
+ * is allocated and the old one is kept. Each fib_get() and fib_delete() then
+ * migrates a few buckets of the old table, starting from the lowest primary keys.
+ * Until the migration is finished, nodes with primary keys below a boundary
+ * (&rehash_pos) are in the new table and the others are in the old one. Hash
+ * chains are therefore addressed by their first primary key (see fib_chain()),
+ * which is independent on the table size and keeps the canonical reading order.
+ *
  * To get the asynchronous reading consistent over node deletions, we need to
  * keep a list of readers for each node. When a node gets deleted, its readers
  * are automatically moved to the next node in the table.
  *
+ * Optionally, a FIB may be indexed by a path-compressed binary trie (see
+ * fib_enable_trie()). The trie contains one node for each prefix present in
+ * the FIB and a branching node wherever two paths diverge, so fib_route() can
+ * find the longest matching prefix in a single descent instead of probing the
+ * hash table once for each prefix length. The hash table is kept as the primary
+ * structure, therefore node lookup by prefix and asynchronous reading are not
+ * affected. Trie nodes do not keep copies of addresses, they are compared with
+ * the FIB nodes instead, which makes IPv6 trie nodes a third smaller.
+ *
  * Basic FIB operations are performed by functions defined by this module,
  * enumerating of FIB contents is accomplished by using the FIB_WALK() macro
- * or FIB_ITERATE_START() if you want to do it asynchronously.
+ * or FIB_ITERATE_START() if you want to do it asynchronously. Large FIBs may
+ * be walked by worker threads using fib_walk_parallel() or
+ * fib_collect_parallel(), when the walk does not modify the FIB itself.
  */
 
 #undef LOCAL_DEBUG
 
+#include <stdlib.h>
+
 #include "nest/bird.h"
 #include "nest/route.h"
 #include "lib/string.h"
+#include "lib/worker.h"
 
 #define HASH_DEF_ORDER 10
 #define HASH_HI_MARK *4
@@ -47,6 +70,7 @@
 #define HASH_LO_MARK /5
 #define HASH_LO_STEP 2
 #define HASH_LO_MIN 10
+#define HASH_MIGRATE_STEP 8		/* Buckets migrated per fib_get() / fib_delete() */
 
 static void
 fib_ht_alloc(struct fib *f)
@@ -72,10 +96,10 @@ fib_ht_free(struct fib_node **h)
   mb_free(h);
 }
 
-static inline unsigned
+static inline struct fib_node **
 fib_hash(struct fib *f, ip_addr *a)
 {
-  return ipa_hash(*a) >> f->hash_shift;
+  return fib_chain(f, ipa_hash(*a));
 }
 
 static void
@@ -108,49 +132,417 @@ fib_init(struct fib *f, pool *p, unsigned node_size, unsigned hash_order, fib_in
   f->entries = 0;
   f->entries_min = 0;
   f->init = init ? : fib_dummy_init;
+  f->old_table = NULL;
+  f->trie_slab = NULL;
+  f->trie_root = NULL;
+}
+
+static inline struct fib_trie_node *
+fib_trie_new_node(struct fib *f, int plen, struct fib_node *fn)
+{
+  struct fib_trie_node *t = sl_alloc(f->trie_slab);
+  t->c[0] = t->c[1] = NULL;
+  t->node = fn;
+  t->plen = plen;
+  return t;
+}
+
+static inline int
+fib_trie_bit(ip_addr a, int pos)
+{
+  return ipa_getbit(a, pos) ? 1 : 0;
+}
+
+/*
+ * Trie nodes do not store their addresses, the address of a node is given by
+ * any FIB node below it. Branching nodes always have both children, therefore
+ * the leftmost path ends in a FIB node.
+ */
+static inline struct fib_node *
+fib_trie_leaf(struct fib_trie_node *t)
+{
+  while (!t->node)
+    t = t->c[0];
+
+  return t->node;
 }
 
 static void
-fib_rehash(struct fib *f, int step)
+fib_trie_insert(struct fib *f, struct fib_node *e)
 {
-  unsigned old, new, oldn, newn, ni, nh;
-  struct fib_node **n, *e, *x, **t, **m, **h;
+  struct fib_trie_node **tp = &f->trie_root;
+  struct fib_trie_node *t, *n;
+  struct fib_node *r;
+  ip_addr x, y;
+  int l, d;
 
-  old = f->hash_order;
-  oldn = f->hash_size;
-  new = old + step;
-  m = h = f->hash_table;
-  DBG("Re-hashing FIB from order %d to %d\n", old, new);
-  f->hash_order = new;
-  fib_ht_alloc(f);
-  t = n = f->hash_table;
-  newn = f->hash_size;
-  ni = 0;
+  if (!*tp)
+    {
+      *tp = fib_trie_new_node(f, e->pxlen, e);
+      return;
+    }
+
+  /* Descend along our bits to find a prefix sharing the most with ours */
+  t = *tp;
+  while ((t->plen < e->pxlen) && t->c[fib_trie_bit(e->prefix, t->plen)])
+    t = t->c[fib_trie_bit(e->prefix, t->plen)];
+
+  r = fib_trie_leaf(t);
+  l = MIN(e->pxlen, r->pxlen);
+  x = ipa_and(e->prefix, ipa_mkmask(l));
+  y = ipa_and(r->prefix, ipa_mkmask(l));
+  d = ipa_equal(x, y) ? l : ipa_pxlen(x, y);
+
+  /* Nodes with plen up to d are our ancestors, r is below the next one */
+  while ((t = *tp) && (t->plen < e->pxlen) && (t->plen <= d))
+    tp = &t->c[fib_trie_bit(e->prefix, t->plen)];
+
+  if (!t)
+    *tp = fib_trie_new_node(f, e->pxlen, e);
+  else if (t->plen == e->pxlen && d == e->pxlen)
+    {
+      /* Branching node for our prefix already exists */
+      t->node = e;
+    }
+  else if (d == e->pxlen)
+    {
+      /* New node is an ancestor of the current one */
+      n = fib_trie_new_node(f, e->pxlen, e);
+      n->c[fib_trie_bit(r->prefix, d)] = t;
+      *tp = n;
+    }
+  else
+    {
+      /* Paths diverge before both prefixes end, add a branching node */
+      struct fib_trie_node *b = fib_trie_new_node(f, d, NULL);
+      n = fib_trie_new_node(f, e->pxlen, e);
+      b->c[fib_trie_bit(r->prefix, d)] = t;
+      b->c[fib_trie_bit(e->prefix, d)] = n;
+      *tp = b;
+    }
+}
+
+static void
+fib_trie_remove(struct fib *f, struct fib_node *e)
+{
+  struct fib_trie_node **tp = &f->trie_root;
+  struct fib_trie_node **pp = NULL;
+  struct fib_trie_node *t, *p;
+
+  while ((t = *tp) && (t->plen < e->pxlen))
+    {
+      pp = tp;
+      tp = &t->c[fib_trie_bit(e->prefix, t->plen)];
+    }
+
+  if (!t || (t->node != e))
+    bug("fib_trie_remove() called for node not in trie");
+
+  t->node = NULL;
+  if (t->c[0] && t->c[1])
+    return;		/* Still needed as a branching node */
+
+  *tp = t->c[0] ? : t->c[1];
+  sl_free(f->trie_slab, t);
+
+  /* Parent may have been a pure branching node which is now redundant */
+  if (pp && (p = *pp) && !p->node && !(p->c[0] && p->c[1]))
+    {
+      *pp = p->c[0] ? : p->c[1];
+      sl_free(f->trie_slab, p);
+    }
+}
+
+/**
+ * fib_enable_trie - index FIB by a trie
+ * @f: FIB to be indexed
+ *
+ * This function creates a trie containing all nodes of the FIB. The trie is
+ * maintained by fib_get() and fib_delete() from now on and it is used by
+ * fib_route() to find the longest matching prefix in one trie descent.
+ */
+void
+fib_enable_trie(struct fib *f)
+{
+  if (f->trie_slab)
+    return;
+
+  f->trie_slab = sl_new(f->fib_pool, sizeof(struct fib_trie_node));
+  FIB_WALK(f, n)
+    {
+      fib_trie_insert(f, n);
+    }
+  FIB_WALK_END;
+}
+
+static void
+fib_trie_walk(struct fib_trie_node *t, int (*hook)(struct fib_node *, void *), void *data)
+{
+  if (t->node && hook(t->node, data))
+    return;
+
+  if (t->c[0])
+    fib_trie_walk(t->c[0], hook, data);
+  if (t->c[1])
+    fib_trie_walk(t->c[1], hook, data);
+}
+
+/**
+ * fib_walk_below - walk nodes covered by a prefix
+ * @f: FIB indexed by a trie
+ * @a: IP address of the prefix
+ * @len: prefix length
+ * @hook: function called for nodes
+ * @data: argument of @hook
+ *
+ * This function calls @hook for all nodes with prefixes strictly covered by
+ * the given one, in the order of the trie. When @hook returns nonzero, nodes
+ * covered by the current one are skipped. The FIB must not be modified during
+ * the walk.
+ */
+void
+fib_walk_below(struct fib *f, ip_addr a, int len, int (*hook)(struct fib_node *, void *), void *data)
+{
+  struct fib_trie_node *t = f->trie_root;
+
+  ASSERT(f->trie_slab);
+
+  /* Find the topmost trie node not shorter than the prefix */
+  while (t && (t->plen < len))
+    {
+      if (t->node && !ipa_equal(ipa_and(a, ipa_mkmask(t->plen)), t->node->prefix))
+	return;
+      t = t->c[fib_trie_bit(a, t->plen)];
+    }
+
+  if (!t || !ipa_equal(ipa_and(fib_trie_leaf(t)->prefix, ipa_mkmask(len)), a))
+    return;
+
+  if (t->plen > len)
+    {
+      fib_trie_walk(t, hook, data);
+      return;
+    }
+
+  /* The node of the prefix itself is skipped */
+  if (t->c[0])
+    fib_trie_walk(t->c[0], hook, data);
+  if (t->c[1])
+    fib_trie_walk(t->c[1], hook, data);
+}
+
+/*
+ * A parallel walk splits the primary hash space into %FIB_WALK_JOBS ranges of
+ * the same size. Each job walks the chains whose first primary key is in its
+ * range, so every chain is walked by exactly one job even during rehashing,
+ * and the jobs taken in order give the canonical reading order.
+ */
+
+#define FIB_WALK_MIN	8192		/* Smaller FIBs are walked by the caller */
+
+struct fib_walk {
+  struct fib *fib;
+  void (*hook)(struct fib_node *, void *, uint);
+  void *data;
+};
+
+static void
+fib_walk_job(void *W, uint job)
+{
+  struct fib_walk *w = W;
+  struct fib *f = w->fib;
+  uint from = job * (FIB_HASH_SPACE / FIB_WALK_JOBS);
+  uint to = from + FIB_HASH_SPACE / FIB_WALK_JOBS;
+  uint pos = fib_chain_pos(f, from);
+  struct fib_node *n;
+
+  /* The chain started in the previous range */
+  if (pos < from)
+    pos = fib_chain_next(f, pos);
+
+  for (; pos < to; pos = fib_chain_next(f, pos))
+    for (n = *fib_chain(f, pos); n; n = n->next)
+      w->hook(n, w->data, job);
+}
+
+/**
+ * fib_walk_parallel - walk all nodes by worker threads
+ * @f: FIB
+ * @wp: worker pool, may be NULL
+ * @hook: function called for each node
+ * @data: argument of @hook
+ *
+ * This function calls @hook(node, @data, job) for all nodes of the FIB, with
+ * the nodes split to %FIB_WALK_JOBS jobs run in parallel by the worker pool.
+ * Nodes of one job are walked in the order of FIB_WALK(), so per-job results
+ * concatenated by job numbers keep that order. The hook must not modify the
+ * FIB and it follows the rules of wp_run(), it may modify just the walked node
+ * and data private to its job. Small FIBs or walks without @wp are done by the
+ * calling thread, with the same job numbers.
+ */
+void
+fib_walk_parallel(struct fib *f, worker_pool *wp, void (*hook)(struct fib_node *, void *, uint), void *data)
+{
+  struct fib_walk w = { .fib = f, .hook = hook, .data = data };
+  uint i;
+
+  if (wp && (f->entries >= FIB_WALK_MIN))
+    {
+      wp_run(wp, fib_walk_job, &w, FIB_WALK_JOBS);
+      return;
+    }
+
+  for (i = 0; i < FIB_WALK_JOBS; i++)
+    fib_walk_job(&w, i);
+}
+
+struct fib_collect {
+  int (*pred)(struct fib_node *, void *);
+  void *data;
+  struct fib_collect_buf {
+    struct fib_node **nodes;
+    uint count, size;
+  } buf[FIB_WALK_JOBS];
+};
+
+static void
+fib_collect_node(struct fib_node *n, void *C, uint job)
+{
+  struct fib_collect *c = C;
+  struct fib_collect_buf *b = &c->buf[job];
+
+  if (!c->pred(n, c->data))
+    return;
+
+  /* Workers may use just the system allocator */
+  if (b->count == b->size)
+    {
+      b->size = b->size ? 2 * b->size : 64;
+      b->nodes = xrealloc(b->nodes, b->size * sizeof(struct fib_node *));
+    }
+
+  b->nodes[b->count++] = n;
+}
+
+/**
+ * fib_collect_parallel - find nodes by worker threads
+ * @f: FIB
+ * @wp: worker pool, may be NULL
+ * @pred: predicate called for each node
+ * @data: argument of @pred
+ * @nodes: pointer to the result
+ *
+ * This function calls @pred for all nodes of the FIB by fib_walk_parallel()
+ * and collects nodes for which it returns nonzero to per-job buffers. They are
+ * merged to an array of nodes in the order of FIB_WALK(), which is stored to
+ * @nodes and must be freed by xfree(). The function returns its length, for
+ * no nodes found the array is NULL. @pred must follow the same rules as the
+ * hook of fib_walk_parallel(). It is intended for bulk operations on sparse
+ * subsets of large tables, which are then done by the caller alone.
+ */
+uint
+fib_collect_parallel(struct fib *f, worker_pool *wp, int (*pred)(struct fib_node *, void *), void *data, struct fib_node ***nodes)
+{
+  struct fib_collect *c = xmalloc(sizeof(struct fib_collect));
+  uint i, count = 0;
+
+  bzero(c, sizeof(struct fib_collect));
+  c->pred = pred;
+  c->data = data;
+
+  fib_walk_parallel(f, wp, fib_collect_node, c);
+
+  for (i = 0; i < FIB_WALK_JOBS; i++)
+    count += c->buf[i].count;
+
+  *nodes = count ? xmalloc(count * sizeof(struct fib_node *)) : NULL;
+
+  for (i = 0, count = 0; i < FIB_WALK_JOBS; i++)
+    {
+      struct fib_collect_buf *b = &c->buf[i];
+
+      if (b->count)
+	memcpy(*nodes + count, b->nodes, b->count * sizeof(struct fib_node *));
+
+      count += b->count;
+      xfree(b->nodes);
+    }
+
+  xfree(c);
+  return count;
+}
+
+static void
+fib_migrate(struct fib *f, uint max)
+{
+  struct fib_node **t, **oc, *e, *x;
+  uint n, cn;
 
-  while (oldn--)
+  while (f->old_table && max--)
     {
-      x = *h++;
-      while (e = x)
+      oc = f->old_table + (f->rehash_pos >> f->old_shift);
+      if (f->hash_order > f->old_order)
 	{
-	  x = e->next;
-	  nh = fib_hash(f, &e->prefix);
-	  while (nh > ni)
+	  /* Split one old chain to several new ones, they are still sorted */
+	  t = NULL;
+	  cn = ~0;
+	  x = *oc;
+	  while (e = x)
 	    {
-	      *t = NULL;
-	      ni++;
-	      t = ++n;
+	      x = e->next;
+	      n = ipa_hash(e->prefix) >> f->hash_shift;
+	      if (n != cn)
+		{
+		  if (t)
+		    *t = NULL;
+		  t = f->hash_table + n;
+		  cn = n;
+		}
+	      *t = e;
+	      t = &e->next;
 	    }
-	  *t = e;
-	  t = &e->next;
+	  if (t)
+	    *t = NULL;
+	  *oc = NULL;
+	  f->rehash_pos += 1 << f->old_shift;
+	}
+      else
+	{
+	  /* Concatenate several old chains to a new one */
+	  t = f->hash_table + (f->rehash_pos >> f->hash_shift);
+	  for (n = 1 << (f->old_order - f->hash_order); n--; oc++)
+	    {
+	      *t = *oc;
+	      while (*t)
+		t = &(*t)->next;
+	      *oc = NULL;
+	    }
+	  f->rehash_pos += 1 << f->hash_shift;
+	}
+
+      if (f->rehash_pos >= FIB_HASH_SPACE)
+	{
+	  DBG("Re-hashing FIB to order %d finished\n", f->hash_order);
+	  fib_ht_free(f->old_table);
+	  f->old_table = NULL;
 	}
     }
-  while (ni < newn)
-    {
-      *t = NULL;
-      ni++;
-      t = ++n;
-    }
-  fib_ht_free(m);
+}
+
+static void
+fib_rehash(struct fib *f, int step)
+{
+  /* Finish previous re-hashing, if any */
+  fib_migrate(f, ~0);
+
+  DBG("Re-hashing FIB from order %d to %d\n", f->hash_order, f->hash_order + step);
+  f->old_table = f->hash_table;
+  f->old_order = f->hash_order;
+  f->old_shift = f->hash_shift;
+  f->rehash_pos = 0;
+  f->hash_order += step;
+  fib_ht_alloc(f);
+  bzero(f->hash_table, f->hash_size * sizeof(struct fib_node *));
 }
 
 /**
@@ -165,7 +557,7 @@ fib_rehash(struct fib *f, int step)
 void *
 fib_find(struct fib *f, ip_addr *a, int len)
 {
-  struct fib_node *e = f->hash_table[fib_hash(f, a)];
+  struct fib_node *e = *fib_hash(f, a);
 
   while (e && (e->pxlen != len || !ipa_equal(*a, e->prefix)))
     e = e->next;
@@ -207,7 +599,7 @@ void *
 fib_get(struct fib *f, ip_addr *a, int len)
 {
   uint h = ipa_hash(*a);
-  struct fib_node **ee = f->hash_table + (h >> f->hash_shift);
+  struct fib_node **ee = fib_chain(f, h);
   struct fib_node *g, *e = *ee;
   u32 uid = h << 16;
 
@@ -241,8 +633,12 @@ fib_get(struct fib *f, ip_addr *a, int len)
   *ee = e;
   e->readers = NULL;
   f->init(e);
+  if (f->trie_slab)
+    fib_trie_insert(f, e);
   if (f->entries++ > f->entries_max)
     fib_rehash(f, HASH_HI_STEP);
+  else
+    fib_migrate(f, HASH_MIGRATE_STEP);
 
   return e;
 }
@@ -259,15 +655,57 @@ fib_get(struct fib *f, ip_addr *a, int len)
  */
 void *
 fib_route(struct fib *f, ip_addr a, int len)
+{
+  return fib_route_valid(f, a, len, NULL);
+}
+
+/**
+ * fib_route_valid - CIDR routing lookup of acceptable nodes
+ * @f: FIB to search in
+ * @a: IP address of the prefix
+ * @len: prefix length
+ * @valid: function deciding whether a node is acceptable, or %NULL
+ *
+ * Like fib_route(), but nodes for which @valid returns zero are skipped,
+ * so the longest matching prefix among the remaining ones is returned.
+ */
+void *
+fib_route_valid(struct fib *f, ip_addr a, int len, int (*valid)(struct fib_node *))
 {
   ip_addr a0;
-  void *t;
+  struct fib_node *t;
+
+  if (f->trie_slab)
+    {
+      struct fib_trie_node *n = f->trie_root;
+      t = NULL;
+
+      /*
+       * Deeper matches are found later, so the last one is the longest. Only
+       * nodes with a FIB node are checked, as a mismatch in a branching node
+       * implies a mismatch in all nodes below it.
+       */
+      while (n && (n->plen <= len))
+	{
+	  if (n->node)
+	    {
+	      if (!ipa_equal(ipa_and(a, ipa_mkmask(n->plen)), n->node->prefix))
+		break;
+	      if (!valid || valid(n->node))
+		t = n->node;
+	    }
+	  if (n->plen == len)
+	    break;
+	  n = n->c[fib_trie_bit(a, n->plen)];
+	}
+      return t;
+    }
 
   while (len >= 0)
     {
       a0 = ipa_and(a, ipa_mkmask(len));
       t = fib_find(f, &a0, len);
-      if (t)
+      if (t && (!valid || valid(t)))
 	return t;
       len--;
     }
@@ -321,8 +759,8 @@ void
 fib_delete(struct fib *f, void *E)
 {
   struct fib_node *e = E;
-  uint h = fib_hash(f, &e->prefix);
-  struct fib_node **ee = f->hash_table + h;
+  uint h = fib_chain_pos(f, ipa_hash(e->prefix));
+  struct fib_node **ee = fib_chain(f, h);
   struct fib_iterator *it;
 
   while (*ee)
@@ -335,17 +773,21 @@ fib_delete(struct fib *f, void *E)
 	      struct fib_node *l = e->next;
 	      while (!l)
 		{
-		  h++;
-		  if (h >= f->hash_size)
+		  h = fib_chain_next(f, h);
+		  if (h >= FIB_HASH_SPACE)
 		    break;
 		  else
-		    l = f->hash_table[h];
+		    l = *fib_chain(f, h);
 		}
 	      fib_merge_readers(it, l);
 	    }
+	  if (f->trie_slab)
+	    fib_trie_remove(f, e);
 	  sl_free(f->fib_slab, e);
 	  if (f->entries-- < f->entries_min)
 	    fib_rehash(f, -HASH_LO_STEP);
+	  else
+	    fib_migrate(f, HASH_MIGRATE_STEP);
 	  return;
 	}
       ee = &((*ee)->next);
@@ -364,7 +806,32 @@ void
 fib_free(struct fib *f)
 {
   fib_ht_free(f->hash_table);
+  if (f->old_table)
+    fib_ht_free(f->old_table);
   rfree(f->fib_slab);
+  if (f->trie_slab)
+    rfree(f->trie_slab);
+}
+
+/**
+ * fib_memsize - memory used by a FIB
+ * @f: FIB to examine
+ *
+ * This function returns the amount of memory used by the FIB, i.e. by its
+ * nodes, hash tables and the trie.
+ */
+size_t
+fib_memsize(struct fib *f)
+{
+  size_t size = rmemsize(f->fib_slab);
+
+  size += ALLOC_OVERHEAD + f->hash_size * sizeof(struct fib_node *);
+  if (f->old_table)
+    size += ALLOC_OVERHEAD + (1 << f->old_order) * sizeof(struct fib_node *);
+  if (f->trie_slab)
+    size += rmemsize(f->trie_slab);
+
+  return size;
 }
 
 void
@@ -374,8 +841,8 @@ fit_init(struct fib_iterator *i, struct fib *f)
   struct fib_node *n;
 
   i->efef = 0xff;
-  for(h=0; h<f->hash_size; h++)
-    if (n = f->hash_table[h])
+  for(h=0; h<FIB_HASH_SPACE; h=fib_chain_next(f, h))
+    if (n = *fib_chain(f, h))
       {
 	i->prev = (struct fib_iterator *) n;
 	if (i->next = n->readers)
@@ -389,6 +856,30 @@ fit_init(struct fib_iterator *i, struct fib *f)
   i->node = NULL;
 }
 
+/*
+ * Like fit_init(), but the iteration starts after the node with given @uid,
+ * which does not need to exist anymore. As nodes are walked in order of their
+ * uids, this allows to resume a walk from a position returned earlier.
+ */
+void
+fit_init_after(struct fib_iterator *i, struct fib *f, u32 uid)
+{
+  unsigned h;
+  struct fib_node *n;
+
+  i->efef = 0xff;
+  for(h=fib_chain_pos(f, uid >> 16); h<FIB_HASH_SPACE; h=fib_chain_next(f, h))
+    for(n = *fib_chain(f, h); n; n = n->next)
+      if (n->uid > uid)
+	{
+	  fit_put(i, n);
+	  return;
+	}
+  /* No more nodes */
+  i->prev = i->next = NULL;
+  i->node = NULL;
+}
+
 struct fib_node *
 fit_get(struct fib *f, struct fib_iterator *i)
 {
@@ -398,7 +889,7 @@ fit_get(struct fib *f, struct fib_iterator *i)
   if (!i->prev)
     {
       /* We are at the end */
-      i->hash = ~0 - 1;
+      i->hash = FIB_HASH_SPACE;
       return NULL;
     }
   if (!(n = i->node))
@@ -413,7 +904,7 @@ fit_get(struct fib *f, struct fib_iterator *i)
   if (k = i->next)
     k->prev = j;
   j->next = k;
-  i->hash = fib_hash(f, &n->prefix);
+  i->hash = fib_chain_pos(f, ipa_hash(n->prefix));
   return n;
 }
 
@@ -432,6 +923,34 @@ fit_put(struct fib_iterator *i, struct fib_node *n)
 
 #ifdef DEBUGGING
 
+static uint
+fib_trie_check(struct fib_trie_node *t, struct fib_trie_node *parent, int side)
+{
+  struct fib_node *l, *pl;
+
+  if (!t)
+    return 0;
+
+  if (!t->node && !(t->c[0] && t->c[1]))
+    bug("fib_check: redundant trie node");
+  if (t->node && (t->node->pxlen != t->plen))
+    bug("fib_check: trie node mismatch");
+
+  if (parent)
+    {
+      l = fib_trie_leaf(t);
+      pl = fib_trie_leaf(parent);
+
+      if (t->plen <= parent->plen)
+	bug("fib_check: trie nodes out of order");
+      if (!net_in_net(l->prefix, l->pxlen, pl->prefix, parent->plen) ||
+	  (fib_trie_bit(l->prefix, parent->plen) != side))
+	bug("fib_check: trie node misplaced");
+    }
+
+  return (t->node ? 1 : 0) + fib_trie_check(t->c[0], t, 0) + fib_trie_check(t->c[1], t, 1);
+}
+
 /**
  * fib_check - audit a FIB
  * @f: FIB to be checked
@@ -445,18 +964,18 @@ fib_check(struct fib *f)
   uint i, ec, lo, nulls;
 
   ec = 0;
-  for(i=0; i<f->hash_size; i++)
+  for(i=0; i<FIB_HASH_SPACE; i=fib_chain_next(f, i))
     {
       struct fib_node *n;
       lo = 0;
-      for(n=f->hash_table[i]; n; n=n->next)
+      for(n=*fib_chain(f, i); n; n=n->next)
 	{
 	  struct fib_iterator *j, *j0;
 	  uint h0 = ipa_hash(n->prefix);
 	  if (h0 < lo)
 	    bug("fib_check: discord in hash chains");
 	  lo = h0;
-	  if ((h0 >> f->hash_shift) != i)
+	  if (fib_chain_pos(f, h0) != i)
 	    bug("fib_check: mishashed %x->%x (order %d)", h0, i, f->hash_order);
 	  j0 = (struct fib_iterator *) n;
 	  nulls = 0;
@@ -477,6 +996,13 @@ fib_check(struct fib *f)
     }
   if (ec != f->entries)
     bug("fib_check: invalid entry count (%d != %d)", ec, f->entries);
+
+  if (f->trie_slab)
+    {
+      ec = fib_trie_check(f->trie_root, NULL, 0);
+      if (ec != f->entries)
+	bug("fib_check: invalid trie entry count (%d != %d)", ec, f->entries);
+    }
 }
 
 #endif
@@ -484,6 +1010,7 @@ fib_check(struct fib *f)
 #ifdef TEST
 
 #include "lib/resource.h"
+#include "lib/unix.h"
 
 struct fib f;
 
@@ -492,11 +1019,11 @@ void dump(char *m)
   uint i;
 
   debug("%s ... order=%d, size=%d, entries=%d\n", m, f.hash_order, f.hash_size, f.hash_size);
-  for(i=0; i<f.hash_size; i++)
+  for(i=0; i<FIB_HASH_SPACE; i=fib_chain_next(&f, i))
     {
       struct fib_node *n;
       struct fib_iterator *j;
-      for(n=f.hash_table[i]; n; n=n->next)
+      for(n=*fib_chain(&f, i); n; n=n->next)
 	{
 	  debug("%04x %04x %p %I/%2d", i, ipa_hash(n->prefix), n, n->prefix, n->pxlen);
 	  for(j=n->readers; j; j=j->next)
@@ -519,27 +1046,34 @@ int main(void)
   ip_addr a;
   int c;
 
-  log_init_debug(NULL);
+  log_init_debug("");
   resource_init();
   fib_init(&f, &root_pool, sizeof(struct fib_node), 4, init);
   dump("init");
 
-  a = ipa_from_u32(0x01020304); n = fib_get(&f, &a, 32);
-  a = ipa_from_u32(0x02030405); n = fib_get(&f, &a, 32);
-  a = ipa_from_u32(0x03040506); n = fib_get(&f, &a, 32);
-  a = ipa_from_u32(0x00000000); n = fib_get(&f, &a, 32);
-  a = ipa_from_u32(0x00000c01); n = fib_get(&f, &a, 32);
-  a = ipa_from_u32(0xffffffff); n = fib_get(&f, &a, 32);
+  a = ipa_from_u32(0x01020304); n = fib_get(&f, &a, MAX_PREFIX_LENGTH);
+  a = ipa_from_u32(0x02030405); n = fib_get(&f, &a, MAX_PREFIX_LENGTH);
+  a = ipa_from_u32(0x03040506); n = fib_get(&f, &a, MAX_PREFIX_LENGTH);
+  a = ipa_from_u32(0x00000000); n = fib_get(&f, &a, MAX_PREFIX_LENGTH);
+  a = ipa_from_u32(0x00000c01); n = fib_get(&f, &a, MAX_PREFIX_LENGTH);
+  a = ipa_from_u32(0xffffffff); n = fib_get(&f, &a, MAX_PREFIX_LENGTH);
   dump("fill");
 
   fit_init(&i, &f);
   dump("iter init");
 
   fib_rehash(&f, 1);
-  dump("rehash up");
+  dump("rehash up started");
+
+  fib_migrate(&f, ~0);
+  dump("rehash up finished");
 
   fib_rehash(&f, -1);
-  dump("rehash down");
+  fib_migrate(&f, 1);
+  dump("rehash down started");
+
+  fib_migrate(&f, ~0);
+  dump("rehash down finished");
 
 next:
   c = 0;
@@ -564,10 +1098,10 @@ next:
   n = fit_get(&f, &i);
   dump("iter step 2");
 
-  fit_put(&i, n->next);
+  fit_put(&i, n->next ? : n);
   dump("iter step 3");
 
-  a = ipa_from_u32(0xffffffff); n = fib_get(&f, &a, 32);
+  a = ipa_from_u32(0xffffffff); n = fib_get(&f, &a, MAX_PREFIX_LENGTH);
   fib_delete(&f, n);
   dump("iter step 3");
 
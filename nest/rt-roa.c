@@ -9,12 +9,14 @@
 
 #include "nest/bird.h"
 #include "nest/route.h"
+#include "nest/protocol.h"
 #include "nest/cli.h"
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/event.h"
 #include "lib/string.h"
 #include "conf/conf.h"
+#include "filter/filter.h"
 
 
 pool *roa_pool;
@@ -22,10 +24,53 @@ static slab *roa_slab;			/* Slab of struct roa_item */
 static list roa_table_list;		/* List of struct roa_table */
 struct roa_table *roa_table_default;	/* The first ROA table in the config */
 
+/*
+ * ROA entries are stored in the FIB of the table, which is used for exact
+ * lookups and listing. For validation, the prefixes are also indexed by a
+ * binary trie (see filter/trie.c) whose nodes point to FIB nodes, so one
+ * descent finds all covering ROAs instead of a FIB lookup for each prefix
+ * length. Trie nodes, like FIB nodes, are kept until the table is removed.
+ *
+ * Results of roa_check() are memoized in a direct-mapped cache keyed by the
+ * prefix and the origin AS, as filters of many peers check the same pairs
+ * in a short time. Each change of the table increments its epoch and stores
+ * the changed prefix to a log of the last %ROA_CHANGE_LOG changes. A cached
+ * result is valid if no change since its epoch was in a covering prefix, or
+ * it is recomputed when the log does not reach that far.
+ */
+
+struct roa_trie_node {
+  struct f_trie_node tn;
+  struct roa_node *rn;			/* NULL for branching nodes */
+};
+
 static inline int
 src_match(struct roa_item *it, byte src)
 { return !src || it->src == src; }
 
+static inline struct roa_node *
+roa_trie_node(struct f_trie_node *n)
+{ return ((struct roa_trie_node *) n)->rn; }
+
+/*
+ * Prefixes of changed ROA entries, together with all their subprefixes, are
+ * collected to a prefix set. When the source of the changes calls
+ * roa_notify(), import filters of protocols depending on the table are
+ * re-evaluated just for routes in the set, see roa_revalidate().
+ */
+static inline void
+roa_changed(struct roa_table *t, ip_addr prefix, byte pxlen)
+{
+  struct roa_change *c = &t->log[++t->epoch & (ROA_CHANGE_LOG - 1)];
+  c->prefix = prefix;
+  c->pxlen = pxlen;
+
+  if (!t->changes)
+    t->changes = prefix_set_new(roa_pool);
+
+  prefix_set_add(t->changes, prefix, pxlen, pxlen, MAX_PREFIX_LENGTH);
+}
+
 /**
  * roa_add_item - add a ROA entry
  * @t: ROA table
@@ -36,28 +81,40 @@ src_match(struct roa_item *it, byte src)
  * @src: source of the ROA entry (ROA_SRC_*)
  *
  * The function adds a new ROA entry to the ROA table. If the same ROA
- * is already in the table, nothing is added. @src field is used to
- * distinguish different sources of ROAs.
+ * is already in the table, nothing is added, just its stale flag is
+ * cleared. @src field is used to distinguish different sources of ROAs.
+ *
+ * Result: 1 if the entry was added, 0 if it was already there.
  */
-void
+int
 roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src)
 {
   struct roa_node *n = fib_get(&t->fib, &prefix, pxlen);
 
-  // if ((n->items == NULL) && (n->n.x0 != ROA_INVALID))
-  // t->cached_items--;
+  if (!n->items)
+    {
+      struct roa_trie_node *tn = trie_add_prefix(t->trie, prefix, pxlen, pxlen, pxlen);
+      tn->rn = n;
+    }
 
   struct roa_item *it;
   for (it = n->items; it; it = it->next)
     if ((it->maxlen == maxlen) && (it->asn == asn) && src_match(it, src))
-      return;
+      {
+	it->stale = 0;
+	return 0;
+      }
 
   it = sl_alloc(roa_slab);
   it->asn = asn;
   it->maxlen = maxlen;
   it->src = src;
+  it->stale = 0;
   it->next = n->items;
   n->items = it;
+
+  roa_changed(t, prefix, pxlen);
+  return 1;
 }
 
 /**
@@ -72,14 +129,16 @@ roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 a
  * The function removes a specified ROA entry from the ROA table and
  * frees it. If @src field is not ROA_SRC_ANY, only entries from
  * that source are considered.
+ *
+ * Result: 1 if the entry was removed, 0 if it was not found.
  */
-void
+int
 roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src)
 {
   struct roa_node *n = fib_find(&t->fib, &prefix, pxlen);
 
   if (!n)
-    return;
+    return 0;
 
   struct roa_item *it, **itp;
   for (itp = &n->items; it = *itp; itp = &it->next)
@@ -87,82 +146,212 @@ roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u3
       break;
 
   if (!it)
-    return;
+    return 0;
 
   *itp = it->next;
   sl_free(roa_slab, it);
 
-  // if ((n->items == NULL) && (n->n.x0 != ROA_INVALID))
-  // t->cached_items++;
+  roa_changed(t, prefix, pxlen);
+  return 1;
 }
 
-
-/**
- * roa_flush - flush a ROA table
- * @t: ROA table
- * @src: source of ROA entries (ROA_SRC_*)
- *
- * The function removes and frees ROA entries from the ROA table. If
- * @src is ROA_SRC_ANY, all entries in the table are removed,
- * otherwise only all entries from that source are removed.
- */
-void
-roa_flush(struct roa_table *t, byte src)
+static uint
+roa_flush_items(struct roa_table *t, byte src, int stale)
 {
   struct roa_item *it, **itp;
   struct roa_node *n;
+  uint removed = 0, changed;
 
   FIB_WALK(&t->fib, fn)
     {
       n = (struct roa_node *) fn;
+      changed = 0;
 
       itp = &n->items;
       while (it = *itp)
-	if (src_match(it, src))
+	if (src_match(it, src) && (!stale || it->stale))
 	  {
 	    *itp = it->next;
 	    sl_free(roa_slab, it);
+	    changed = 1;
+	    removed++;
 	  }
 	else
 	  itp = &it->next;
+
+      if (changed)
+	roa_changed(t, n->n.prefix, n->n.pxlen);
     }
   FIB_WALK_END;
 
   // TODO add cleanup of roa_nodes
+
+  return removed;
 }
 
+/**
+ * roa_flush - flush a ROA table
+ * @t: ROA table
+ * @src: source of ROA entries (ROA_SRC_*)
+ *
+ * The function removes and frees ROA entries from the ROA table. If
+ * @src is ROA_SRC_ANY, all entries in the table are removed,
+ * otherwise only all entries from that source are removed.
+ *
+ * Result: the number of removed entries.
+ */
+uint
+roa_flush(struct roa_table *t, byte src)
+{
+  return roa_flush_items(t, src, 0);
+}
 
+/**
+ * roa_mark_stale - mark ROA entries as stale
+ * @t: ROA table
+ * @src: source of ROA entries (ROA_SRC_*)
+ *
+ * The function marks all ROA entries from source @src as stale. A source,
+ * which is going to add its complete set of ROAs again, may call it before
+ * and roa_flush_stale() after, so that unchanged entries are kept in the
+ * table during the refresh and just the difference is propagated.
+ */
+void
+roa_mark_stale(struct roa_table *t, byte src)
+{
+  FIB_WALK(&t->fib, fn)
+    {
+      struct roa_item *it;
+      for (it = ((struct roa_node *) fn)->items; it; it = it->next)
+	if (src_match(it, src))
+	  it->stale = 1;
+    }
+  FIB_WALK_END;
+}
 
-/*
-byte
-roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
+/**
+ * roa_flush_stale - remove stale ROA entries
+ * @t: ROA table
+ * @src: source of ROA entries (ROA_SRC_*)
+ *
+ * The function removes ROA entries from source @src still marked by
+ * roa_mark_stale(), i.e. which were not added again since.
+ *
+ * Result: the number of removed entries.
+ */
+uint
+roa_flush_stale(struct roa_table *t, byte src)
 {
-  struct roa_node *n = fib_find(&t->fib, &prefix, pxlen);
+  return roa_flush_items(t, src, 1);
+}
 
-  if (n && n->n.x0 == ROA_UNKNOWN)
-    return ROA_UNKNOWN;
+/**
+ * roa_notify - propagate changes of a ROA table
+ * @t: ROA table
+ *
+ * The function should be called by a source of ROA entries after a batch of
+ * changes. It schedules revalidation of routes of all protocols with import
+ * filters calling roa_check() on the table. Only routes for networks covered
+ * by changed ROA entries are processed again, if the protocol supports it.
+ */
+void
+roa_notify(struct roa_table *t)
+{
+  if (t->changes)
+    ev_schedule(t->notify_event);
+}
 
-  if (n && n->n.x0 == ROA_VALID && asn == n->cached_asn)
-    return ROA_VALID;
+static void
+roa_revalidate(void *T)
+{
+  struct roa_table *t = T;
+  struct prefix_set *set = t->changes;
+  struct announce_hook *a;
+  struct proto *p;
 
-  byte rv = roa_match(t, n, prefix, pxlen, asn);
+  if (!set)
+    return;
+
+  t->changes = NULL;
+  trie_compile(set->trie);
+
+  WALK_LIST(p, active_proto_list)
+    {
+      if (p->proto_state != PS_UP)
+	continue;
+
+      for (a = p->ahooks; a; a = a->next)
+	if (f_uses_roa(a->in_filter, t))
+	  break;
+
+      if (!a)
+	continue;
+
+      if (p->debug & D_EVENTS)
+	log(L_TRACE "%s: Revalidating routes after change of ROA table %s", p->name, t->name);
+
+      if (!(p->reload_prefixes && p->reload_prefixes(p, set)) &&
+	  !(p->reload_routes && p->reload_routes(p)))
+	log(L_WARN "%s: Cannot revalidate routes after change of ROA table %s", p->name, t->name);
+    }
+
+  prefix_set_unlock(set);
+}
+
+
+static byte
+roa_match(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
+{
+  struct f_trie_node *nodes[MAX_PREFIX_LENGTH + 1];
+  uint cnt = trie_find_covering(t->trie, prefix, pxlen, nodes);
+  struct roa_node *n;
+  byte anything = 0;
+  uint i;
 
-  if (rv != ROA_INVALID)
+  for (i = 0; i < cnt; i++)
     {
+      n = roa_trie_node(nodes[i]);
+
       if (!n)
+	continue;
+
+      struct roa_item *it;
+      for (it = n->items; it; it = it->next)
 	{
-	  if (t->cached_items >= t->cached_items_max)
-	  n = fib_get(&t->fib, &prefix, pxlen);
-	  t->cached_items++;
+	  anything = 1;
+	  if ((it->maxlen >= pxlen) && (it->asn == asn) && asn)
+	    return ROA_VALID;
 	}
+    }
+
+  return anything ? ROA_INVALID : ROA_UNKNOWN;
+}
+
+static inline uint
+roa_cache_index(ip_addr prefix, byte pxlen, u32 asn)
+{
+  /* Only high-order bits are well mixed */
+  return u32_hash(ipa_hash32(prefix) ^ u32_hash(asn ^ (pxlen << 24))) >> (32 - ROA_CACHE_ORDER);
+}
+
+/* No change since the cached result may affect it */
+static inline int
+roa_cache_valid(struct roa_table *t, struct roa_cache *c)
+{
+  u32 e;
 
-      n->cached_asn = asn;
-      n->n.x0 = rv;
+  if (t->epoch - c->epoch > ROA_CHANGE_LOG)
+    return 0;
+
+  for (e = c->epoch + 1; e != t->epoch + 1; e++)
+    {
+      struct roa_change *ch = &t->log[e & (ROA_CHANGE_LOG - 1)];
+      if (net_in_net(c->prefix, c->pxlen, ch->prefix, ch->pxlen))
+	return 0;
     }
 
-  return rv;
+  return 1;
 }
-*/
 
 /**
  * roa_check - check validity of route origination in a ROA table 
@@ -178,34 +367,32 @@ roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
  * ASN and maxlen field greater than or equal to the given prefix
  * length, return ROA_VALID. Otherwise return ROA_INVALID. If caller
  * cannot determine origin AS, 0 could be used (in that case ROA_VALID
- * cannot happen).
+ * cannot happen). Results are memoized, see the comment at the
+ * beginning of the file.
  */
 byte
 roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
 {
-  struct roa_node *n;
-  ip_addr px;
-  byte anything = 0;
+  if (!t->cache)
+    t->cache = mb_allocz(roa_pool, ROA_CACHE_SIZE * sizeof(struct roa_cache));
 
-  int len;
-  for (len = pxlen; len >= 0; len--)
-    {
-      px = ipa_and(prefix, ipa_mkmask(len));
-      n = fib_find(&t->fib, &px, len);
+  struct roa_cache *c = &t->cache[roa_cache_index(prefix, pxlen, asn)];
 
-      if (!n)
-	continue;
-
-      struct roa_item *it;
-      for (it = n->items; it; it = it->next)
-	{
-	  anything = 1;
-	  if ((it->maxlen >= pxlen) && (it->asn == asn) && asn)
-	    return ROA_VALID;
-	}
+  if (c->valid && (c->asn == asn) && (c->pxlen == pxlen) && ipa_equal(c->prefix, prefix) &&
+      roa_cache_valid(t, c))
+    {
+      /* Later checks do not need to go through the same changes again */
+      c->epoch = t->epoch;
+      return c->result;
     }
 
-  return anything ? ROA_INVALID : ROA_UNKNOWN;
+  c->prefix = prefix;
+  c->pxlen = pxlen;
+  c->asn = asn;
+  c->epoch = t->epoch;
+  c->result = roa_match(t, prefix, pxlen, asn);
+  c->valid = 1;
+  return c->result;
 }
 
 static void
@@ -230,6 +417,11 @@ roa_new_table(struct roa_table_config *cf)
 
   t = mb_allocz(roa_pool, sizeof(struct roa_table));
   fib_init(&t->fib, roa_pool, sizeof(struct roa_node), 0, roa_node_init);
+  t->trie_lp = lp_new(roa_pool, 4080);
+  t->trie = f_new_trie(t->trie_lp, sizeof(struct roa_trie_node));
+  t->notify_event = ev_new(roa_pool);
+  t->notify_event->hook = roa_revalidate;
+  t->notify_event->data = t;
   t->name = cf->name;
   t->cf = cf;
 
@@ -237,6 +429,7 @@ roa_new_table(struct roa_table_config *cf)
   add_tail(&roa_table_list, &t->n);
 
   roa_populate(t);
+  roa_notify(t);
 }
 
 struct roa_table_config *
@@ -320,9 +513,11 @@ roa_commit(struct config *new, struct config *old)
 	    t->name = cf->name;
 	    t->cf = cf;
 
-	    /* Reconfigure it */
-	    roa_flush(t, ROA_SRC_CONFIG);
+	    /* Reconfigure it, just the difference is propagated */
+	    roa_mark_stale(t, ROA_SRC_CONFIG);
 	    roa_populate(t);
+	    roa_flush_stale(t, ROA_SRC_CONFIG);
+	    roa_notify(t);
 	  }
 	else
 	  {
@@ -332,6 +527,11 @@ roa_commit(struct config *new, struct config *old)
 	    roa_flush(t, ROA_SRC_ANY);
 	    rem_node(&t->n);
 	    fib_free(&t->fib);
+	    rfree(t->trie_lp);
+	    rfree(t->notify_event);
+	    mb_free(t->cache);
+	    if (t->changes)
+	      prefix_set_unlock(t->changes);
 	    mb_free(t);
 	  }
       }
@@ -398,9 +598,9 @@ roa_show_cleanup(struct cli *c)
 void
 roa_show(struct roa_show_data *d)
 {
+  struct f_trie_node *nodes[MAX_PREFIX_LENGTH + 1];
   struct roa_node *rn;
-  ip_addr px;
-  int len;
+  int i;
 
   switch (d->mode)
     {
@@ -424,10 +624,9 @@ roa_show(struct roa_show_data *d)
       break;
 
     case ROA_SHOW_FOR:
-      for (len = d->pxlen; len >= 0; len--)
+      for (i = trie_find_covering(d->table->trie, d->prefix, d->pxlen, nodes) - 1; i >= 0; i--)
 	{
-	  px = ipa_and(d->prefix, ipa_mkmask(len));
-	  rn = fib_find(&d->table->fib, &px, len);
+	  rn = roa_trie_node(nodes[i]);
 
 	  if (!rn)
 	    continue;
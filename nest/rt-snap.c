@@ -0,0 +1,651 @@
+/*
+ *	BIRD -- Routing Table Snapshots
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Routing table snapshots
+ *
+ * The snapshot protocol checkpoints best routes of its routing table to a
+ * binary file and restores them when it starts, so the table (and the kernel
+ * and other protocols fed by it) is not empty until the real sources of the
+ * routes come back after a daemon restart. Restored routes belong to the
+ * snapshot protocol, they have a low preference, so any real route wins over
+ * them, and they are dropped when the hold time expires. They keep their
+ * original attributes including the route source, but BGP does not export
+ * them, as they may be arbitrarily stale.
+ *
+ * The file is a header followed by a sequence of records. An attribute record
+ * describes one &rta (with its next hops and extended attributes), a network
+ * record refers to some earlier attribute record by its index, so attributes
+ * shared by many routes are stored just once. All values are in host byte
+ * order, the file is meant to be read by the same build that wrote it. The
+ * checkpoint is written to a temporary file which is then renamed, so an
+ * interrupted write never replaces a good snapshot.
+ */
+
+#undef LOCAL_DEBUG
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "nest/bird.h"
+#include "nest/iface.h"
+#include "nest/cli.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "nest/rt-snap.h"
+#include "conf/conf.h"
+#include "lib/resource.h"
+#include "lib/string.h"
+
+#define SNAP_MAGIC	0x42534e50	/* "BSNP" */
+#define SNAP_VERSION	1
+
+#define SNAP_REC_RTA	1
+#define SNAP_REC_NET	2
+
+struct snap_header {
+  u32 magic;
+  u16 version;
+  byte ip_version;
+  byte ip_size;
+};
+
+struct snap_rta {
+  byte tag;
+  byte source, scope, cast, dest;
+  byte recursive;			/* gw is the recursive next hop, ll its link-local part */
+  u16 nh_count;
+  u16 ea_count;
+  u32 igp_metric;
+  ip_addr gw, ll, from;
+  char ifname[16];
+};
+
+struct snap_nh {
+  ip_addr gw;
+  char ifname[16];
+  u32 weight;
+};
+
+struct snap_ea {
+  u16 id;
+  byte flags, type;
+  u32 data;				/* Embedded value or data length */
+};
+
+struct snap_net {
+  byte tag;
+  byte pxlen;
+  u32 rta;				/* Index of attribute record */
+  ip_addr prefix;
+};
+
+#define SNAP_ALIGN(x) BIRD_ALIGN(x, 4)
+
+
+/*
+ *	Checkpoint
+ */
+
+struct snap_idx {
+  struct snap_idx *next;
+  rta *a;
+  u32 idx;
+};
+
+#define SIX_KEY(n)		n->a
+#define SIX_NEXT(n)		n->next
+#define SIX_EQ(a1,a2)		a1 == a2
+#define SIX_FN(a)		u32_hash((u32) ((uintptr_t) (a) >> 4))
+
+#define SIX_REHASH		snap_idx_rehash
+#define SIX_PARAMS		/8, *2, 2, 2, 10, 24
+
+HASH_DEFINE_REHASH_FN(SIX, struct snap_idx)
+
+static inline int
+snap_route_wanted(struct snap_proto *p, rte *e)
+{
+  if (!rte_is_valid(e))
+    return 0;
+
+  /* Routes of these sources are recovered immediately after restart */
+  switch (e->attrs->source)
+    {
+    case RTS_DUMMY:
+    case RTS_INHERIT:
+    case RTS_DEVICE:
+    case RTS_STATIC_DEVICE:
+      return 0;
+    }
+
+  /* Routes restored by us are written again while they are still in use */
+  return (e->attrs->src->proto == &p->p) || (e->attrs->src->proto->proto != &proto_snapshot);
+}
+
+/* Interface names fit, but the field is terminated explicitly anyway */
+static inline void
+snap_put_ifname(char dst[16], const char *name)
+{
+  uint len = MIN(strlen(name), 15);
+  memcpy(dst, name, len);
+  dst[len] = 0;
+}
+
+static void
+snap_write_rta(FILE *f, rta *a)
+{
+  struct snap_rta r;
+  struct mpnh *nh;
+  ea_list *l;
+  int i;
+
+  bzero(&r, sizeof(r));
+  r.tag = SNAP_REC_RTA;
+  r.source = a->source;
+  r.scope = a->scope;
+  r.cast = a->cast;
+  r.dest = a->dest;
+  r.igp_metric = a->igp_metric;
+  r.gw = a->gw;
+  r.from = a->from;
+  if (a->iface)
+    snap_put_ifname(r.ifname, a->iface->name);
+  if (a->hostentry)
+    {
+      r.recursive = 1;
+      r.gw = a->hostentry->addr;
+      r.ll = a->hostentry->link;
+      r.ifname[0] = 0;
+    }
+
+  for (nh = a->nexthops; nh; nh = nh->next)
+    r.nh_count++;
+  for (l = a->eattrs; l; l = l->next)
+    r.ea_count += l->count;
+
+  fwrite(&r, sizeof(r), 1, f);
+
+  for (nh = a->nexthops; nh; nh = nh->next)
+    {
+      struct snap_nh n;
+      bzero(&n, sizeof(n));
+      n.gw = nh->gw;
+      snap_put_ifname(n.ifname, nh->iface->name);
+      n.weight = nh->weight;
+      fwrite(&n, sizeof(n), 1, f);
+    }
+
+  for (l = a->eattrs; l; l = l->next)
+    for (i = 0; i < l->count; i++)
+      {
+	eattr *e = &l->attrs[i];
+	struct snap_ea x = { .id = e->id, .flags = e->flags, .type = e->type };
+	static const byte pad[4];
+
+	if (e->type & EAF_EMBEDDED)
+	  {
+	    x.data = e->u.data;
+	    fwrite(&x, sizeof(x), 1, f);
+	  }
+	else
+	  {
+	    x.data = e->u.ptr->length;
+	    fwrite(&x, sizeof(x), 1, f);
+	    fwrite(e->u.ptr->data, x.data, 1, f);
+	    fwrite(pad, SNAP_ALIGN(x.data) - x.data, 1, f);
+	  }
+      }
+}
+
+static int
+snap_save(struct snap_proto *p)
+{
+  struct snap_config *cf = (void *) p->p.cf;
+  struct snap_header h = { .magic = SNAP_MAGIC, .version = SNAP_VERSION,
+			   .ip_version = IP_VERSION, .ip_size = sizeof(ip_addr) };
+  HASH(struct snap_idx) idx;
+  linpool *lp;
+  char tmp[256];
+  uint rtas = 0, nets = 0;
+  FILE *f;
+  int err;
+
+  if (!p->p.main_ahook)
+    return 0;
+
+  bsnprintf(tmp, sizeof(tmp), "%s.tmp", cf->file);
+  if (!(f = fopen(tmp, "w")))
+    {
+      log(L_ERR "%s: Cannot create snapshot %s: %m", p->p.name, tmp);
+      return -1;
+    }
+
+  lp = lp_new(p->p.pool, 4080);
+  HASH_INIT(idx, p->p.pool, 10);
+
+  fwrite(&h, sizeof(h), 1, f);
+
+  FIB_WALK(&p->p.table->fib, fn)
+    {
+      net *n = (net *) fn;
+      rte *e = n->routes;
+      struct snap_idx *x;
+
+      if (!snap_route_wanted(p, e))
+	continue;
+
+      if (!(x = HASH_FIND(idx, SIX, e->attrs)))
+	{
+	  x = lp_alloc(lp, sizeof(struct snap_idx));
+	  x->a = e->attrs;
+	  x->idx = rtas++;
+	  HASH_INSERT2(idx, SIX, p->p.pool, x);
+	  snap_write_rta(f, e->attrs);
+	}
+
+      struct snap_net r;
+      bzero(&r, sizeof(r));
+      r.tag = SNAP_REC_NET;
+      r.pxlen = n->n.pxlen;
+      r.rta = x->idx;
+      r.prefix = n->n.prefix;
+      fwrite(&r, sizeof(r), 1, f);
+      nets++;
+    }
+  FIB_WALK_END;
+
+  mb_free(idx.data);
+  rfree(lp);
+
+  err = ferror(f);
+  if (fclose(f) || err || rename(tmp, cf->file))
+    {
+      log(L_ERR "%s: Cannot write snapshot %s: %m", p->p.name, cf->file);
+      unlink(tmp);
+      return -1;
+    }
+
+  p->saved = nets;
+  p->save_time = now;
+  DBG("%s: Saved %u routes with %u attribute sets\n", p->p.name, nets, rtas);
+  return 0;
+}
+
+
+/*
+ *	Restore
+ */
+
+struct snap_buf {
+  byte *pos, *end;
+};
+
+static void *
+snap_get(struct snap_buf *b, uint len)
+{
+  byte *d = b->pos;
+
+  if ((uint) (b->end - b->pos) < len)
+    return NULL;
+
+  b->pos += len;
+  return d;
+}
+
+static struct iface *
+snap_iface(char *name)
+{
+  name[15] = 0;
+  return name[0] ? if_find_by_name(name) : NULL;
+}
+
+/* Parse one attribute record, returns cached rta, NULL for an unusable one, or -1 on error */
+static rta *
+snap_read_rta(struct snap_proto *p, struct snap_buf *b, linpool *lp)
+{
+  struct snap_config *cf = (void *) p->p.cf;
+  struct snap_rta *r = snap_get(b, sizeof(struct snap_rta));
+  struct mpnh *nhs = NULL, **nhp = &nhs;
+  ea_list *l = NULL;
+  int usable = 1;
+  rta a;
+  int i;
+
+  if (!r)
+    return (rta *) -1;
+
+  bzero(&a, sizeof(a));
+  a.src = p->p.main_source;
+  a.source = r->source;
+  a.scope = r->scope;
+  a.cast = r->cast;
+  a.dest = r->dest;
+  a.igp_metric = r->igp_metric;
+  a.gw = r->gw;
+  a.from = r->from;
+  a.iface = snap_iface(r->ifname);
+
+  /* The next hop must be still usable */
+  if (((a.dest == RTD_ROUTER) || (a.dest == RTD_DEVICE)) && !r->recursive && !a.iface)
+    usable = 0;
+
+  for (i = 0; i < r->nh_count; i++)
+    {
+      struct snap_nh *n = snap_get(b, sizeof(struct snap_nh));
+      struct mpnh *nh;
+
+      if (!n)
+	return (rta *) -1;
+
+      nh = lp_alloc(lp, sizeof(struct mpnh));
+      nh->gw = n->gw;
+      nh->iface = snap_iface(n->ifname);
+      nh->weight = n->weight;
+      nh->next = NULL;
+
+      if (!nh->iface)
+	usable = 0;
+
+      *nhp = nh;
+      nhp = &nh->next;
+    }
+  a.nexthops = nhs;
+
+  if (r->ea_count)
+    {
+      l = lp_allocz(lp, sizeof(ea_list) + r->ea_count * sizeof(eattr));
+      l->flags = EALF_SORTED;
+      l->count = r->ea_count;
+    }
+
+  for (i = 0; i < r->ea_count; i++)
+    {
+      struct snap_ea *x = snap_get(b, sizeof(struct snap_ea));
+      eattr *e = &l->attrs[i];
+
+      if (!x)
+	return (rta *) -1;
+
+      e->id = x->id;
+      e->flags = x->flags;
+      e->type = x->type;
+
+      if (e->type & EAF_EMBEDDED)
+	e->u.data = x->data;
+      else
+	{
+	  byte *d = snap_get(b, SNAP_ALIGN(x->data));
+	  if (!d)
+	    return (rta *) -1;
+
+	  e->u.ptr = lp_alloc(lp, sizeof(struct adata) + x->data);
+	  e->u.ptr->length = x->data;
+	  memcpy(e->u.ptr->data, d, x->data);
+	}
+    }
+  a.eattrs = l;
+
+  if (!usable)
+    return NULL;
+
+  if (r->recursive)
+    {
+      rtable *igp = cf->igp_table ? cf->igp_table->table : p->p.table;
+      rta_set_recursive_next_hop(p->p.table, &a, igp, &r->gw, &r->ll);
+    }
+
+  return rta_lookup(&a);
+}
+
+static void
+snap_restore(struct snap_proto *p)
+{
+  struct snap_config *cf = (void *) p->p.cf;
+  struct snap_header *h;
+  struct snap_buf b;
+  rta **rtas = NULL;
+  uint rtas_count = 0, rtas_size = 0;
+  linpool *lp;
+  byte *data;
+  long len;
+  FILE *f;
+  uint i;
+
+  if (!(f = fopen(cf->file, "r")))
+    {
+      log(L_WARN "%s: Cannot open snapshot %s: %m", p->p.name, cf->file);
+      return;
+    }
+
+  if ((fseek(f, 0, SEEK_END) < 0) || ((len = ftell(f)) < 0) || (fseek(f, 0, SEEK_SET) < 0))
+    {
+      log(L_ERR "%s: Cannot read snapshot %s: %m", p->p.name, cf->file);
+      fclose(f);
+      return;
+    }
+
+  data = mb_alloc(p->p.pool, len + 1);
+  if (fread(data, 1, len, f) != (size_t) len)
+    {
+      log(L_ERR "%s: Cannot read snapshot %s: %m", p->p.name, cf->file);
+      fclose(f);
+      mb_free(data);
+      return;
+    }
+  fclose(f);
+
+  b.pos = data;
+  b.end = data + len;
+
+  h = snap_get(&b, sizeof(struct snap_header));
+  if (!h || (h->magic != SNAP_MAGIC) || (h->version != SNAP_VERSION) ||
+      (h->ip_version != IP_VERSION) || (h->ip_size != sizeof(ip_addr)))
+    {
+      log(L_ERR "%s: Snapshot %s has invalid format", p->p.name, cf->file);
+      mb_free(data);
+      return;
+    }
+
+  lp = lp_new(p->p.pool, 4080);
+
+  while (b.pos < b.end)
+    switch (*b.pos)
+      {
+      case SNAP_REC_RTA:
+	{
+	  rta *a = snap_read_rta(p, &b, lp);
+	  if (a == (rta *) -1)
+	    goto bad;
+
+	  if (rtas_count == rtas_size)
+	    {
+	      rtas_size = rtas_size ? 2 * rtas_size : 256;
+	      rtas = rtas ? mb_realloc(rtas, rtas_size * sizeof(rta *)) :
+		mb_alloc(p->p.pool, rtas_size * sizeof(rta *));
+	    }
+	  rtas[rtas_count++] = a;
+	  lp_flush(lp);
+	  break;
+	}
+
+      case SNAP_REC_NET:
+	{
+	  struct snap_net *r = snap_get(&b, sizeof(struct snap_net));
+	  net *n;
+	  rte *e;
+
+	  if (!r || (r->rta >= rtas_count) || (r->pxlen > BITS_PER_IP_ADDRESS))
+	    goto bad;
+
+	  if (!rtas[r->rta])
+	    break;
+
+	  n = net_get(p->p.table, r->prefix, r->pxlen);
+	  e = rte_get_temp(rta_clone(rtas[r->rta]));
+	  e->net = n;
+	  e->pflags = 0;
+	  rte_update(&p->p, n, e);
+	  p->restored++;
+	  break;
+	}
+
+      default:
+	goto bad;
+      }
+
+  if (0)
+    {
+    bad:
+      log(L_ERR "%s: Snapshot %s is corrupted", p->p.name, cf->file);
+    }
+
+  for (i = 0; i < rtas_count; i++)
+    if (rtas[i])
+      rta_free(rtas[i]);
+
+  if (rtas)
+    mb_free(rtas);
+  rfree(lp);
+  mb_free(data);
+
+  log(L_INFO "%s: Restored %u routes from %s", p->p.name, p->restored, cf->file);
+}
+
+
+/*
+ *	Protocol glue
+ */
+
+static void
+snap_hold_timeout(timer *t)
+{
+  struct snap_proto *p = t->data;
+
+  if (!p->p.main_ahook)
+    return;
+
+  /* Start and finish a refresh cycle without any route, all restored routes become stale */
+  DBG("%s: Dropping restored routes\n", p->p.name);
+  rt_refresh_begin(p->p.table, p->p.main_ahook);
+  rt_refresh_end(p->p.table, p->p.main_ahook);
+  p->restored = 0;
+}
+
+static void
+snap_save_timeout(timer *t)
+{
+  snap_save(t->data);
+}
+
+static int
+snap_start(struct proto *P)
+{
+  struct snap_proto *p = (void *) P;
+  struct snap_config *cf = (void *) P->cf;
+
+  if (cf->igp_table)
+    rt_lock_table(cf->igp_table->table);
+
+  p->hold_timer = tm_new_set(P->pool, snap_hold_timeout, p, 0, 0);
+  p->save_timer = tm_new_set(P->pool, snap_save_timeout, p, 0, cf->save_interval);
+
+  /* We have to go UP before routes could be installed */
+  proto_notify_state(P, PS_UP);
+
+  snap_restore(p);
+  if (p->restored)
+    tm_start(p->hold_timer, cf->hold_time);
+
+  if (cf->save_interval)
+    tm_start(p->save_timer, cf->save_interval);
+
+  return PS_UP;
+}
+
+static int
+snap_shutdown(struct proto *P)
+{
+  snap_save((struct snap_proto *) P);
+  return PS_DOWN;
+}
+
+static void
+snap_cleanup(struct proto *P)
+{
+  struct snap_config *cf = (void *) P->cf;
+
+  if (cf->igp_table)
+    rt_unlock_table(cf->igp_table->table);
+}
+
+static struct proto *
+snap_init(struct proto_config *c)
+{
+  return proto_new(c, sizeof(struct snap_proto));
+}
+
+static int
+snap_reconfigure(struct proto *P, struct proto_config *new)
+{
+  struct snap_proto *p = (void *) P;
+  struct snap_config *o = (void *) P->cf;
+  struct snap_config *n = (void *) new;
+
+  if (strcmp(o->file, n->file) || (o->igp_table != n->igp_table) ||
+      ((o->igp_table && n->igp_table) && (o->igp_table->table != n->igp_table->table)))
+    return 0;
+
+  if (n->save_interval != o->save_interval)
+    {
+      p->save_timer->recurrent = n->save_interval;
+      if (n->save_interval)
+	tm_start(p->save_timer, n->save_interval);
+      else
+	tm_stop(p->save_timer);
+    }
+
+  return 1;
+}
+
+static void
+snap_get_status(struct proto *P, byte *buf)
+{
+  struct snap_proto *p = (void *) P;
+
+  if (P->proto_state == PS_UP)
+    bsprintf(buf, "%u restored", p->restored);
+}
+
+static void
+snap_show_proto_info(struct proto *P)
+{
+  struct snap_proto *p = (void *) P;
+  struct snap_config *cf = (void *) P->cf;
+  byte tim[TM_DATETIME_BUFFER_SIZE];
+
+  cli_msg(-1006, "  Snapshot:       %s", cf->file);
+  cli_msg(-1006, "  Restored:       %u routes", p->restored);
+  if (p->save_time)
+    {
+      tm_format_datetime(tim, &config->tf_base, p->save_time);
+      cli_msg(-1006, "  Last saved:     %s, %u routes", tim, p->saved);
+    }
+}
+
+struct protocol proto_snapshot = {
+  .name = 		"Snapshot",
+  .template = 		"snapshot%d",
+  .preference = 	DEF_PREF_SNAPSHOT,
+  .config_size =	sizeof(struct snap_config),
+  .init = 		snap_init,
+  .start = 		snap_start,
+  .shutdown = 		snap_shutdown,
+  .cleanup = 		snap_cleanup,
+  .reconfigure = 	snap_reconfigure,
+  .get_status = 	snap_get_status,
+  .show_proto_info =	snap_show_proto_info
+};
@@ -0,0 +1,31 @@
+/*
+ *	BIRD -- Routing Table Snapshots
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_RT_SNAP_H_
+#define _BIRD_RT_SNAP_H_
+
+#include "nest/protocol.h"
+
+struct snap_config {
+  struct proto_config c;
+  char *file;				/* Snapshot file name */
+  struct rtable_config *igp_table;	/* Table used for recursive next hops */
+  int hold_time;			/* How long restored routes are kept */
+  int save_interval;			/* Period of checkpoints, 0 for just on shutdown */
+};
+
+struct snap_proto {
+  struct proto p;
+  timer *hold_timer;			/* Restored routes are dropped when it fires */
+  timer *save_timer;			/* Periodic checkpoint timer */
+  uint restored;			/* Number of restored routes */
+  uint saved;				/* Number of routes in the last checkpoint */
+  bird_clock_t save_time;		/* Time of the last checkpoint */
+};
+
+#define SNAP_DEFAULT_HOLD_TIME	240
+
+#endif
@@ -30,13 +30,17 @@
 
 #undef LOCAL_DEBUG
 
+#include <stdlib.h>
+
 #include "nest/bird.h"
 #include "nest/route.h"
 #include "nest/protocol.h"
 #include "nest/cli.h"
 #include "nest/iface.h"
+#include "lib/probe.h"
 #include "lib/resource.h"
 #include "lib/event.h"
+#include "lib/worker.h"
 #include "lib/string.h"
 #include "conf/conf.h"
 #include "filter/filter.h"
@@ -44,12 +48,26 @@
 #include "lib/alloca.h"
 
 pool *rt_table_pool;
+worker_pool *rt_workers;
 
 static slab *rte_slab;
 static linpool *rte_update_pool;
 
 static list routing_tables;
 
+/*
+ * Maintenance of routing tables (journal draining, pruning, garbage collection,
+ * hostcache and next hop updates) is done by one event for all tables. Tables
+ * needing it are queued and served in a round-robin manner, limited number of
+ * them per one run, so thousands of mostly idle tables neither hold their own
+ * events nor churn the work list.
+ */
+static event *rt_maint_event;
+static rtable *rt_maint_first, **rt_maint_last = &rt_maint_first;
+
+#define RT_MAINT_TABLES		16	/* Tables maintained in one run of rt_maint_event */
+#define RT_FIB_ORDER		4	/* Initial hash order of table FIBs, they grow on demand */
+
 static void rt_format_via(rte *e, byte *via);
 static void rt_free_hostcache(rtable *tab);
 static void rt_notify_hostcache(rtable *tab, net *net);
@@ -58,6 +76,7 @@ static void rt_next_hop_update(rtable *tab);
 static inline int rt_prune_table(rtable *tab);
 static inline void rt_schedule_gc(rtable *tab);
 static inline void rt_schedule_prune(rtable *tab);
+static void rt_schedule(rtable *tab);
 
 
 static inline struct ea_list *
@@ -68,22 +87,17 @@ make_tmp_attrs(struct rte *rt, struct linpool *pool)
   return mta ? mta(rt, rte_update_pool) : NULL;
 }
 
+static int
+net_route_valid(struct fib_node *n)
+{
+  return rte_is_valid(((net *) n)->routes);
+}
+
 /* Like fib_route(), but skips empty net entries */
-static net *
+static inline net *
 net_route(rtable *tab, ip_addr a, int len)
 {
-  ip_addr a0;
-  net *n;
-
-  while (len >= 0)
-    {
-      a0 = ipa_and(a, ipa_mkmask(len));
-      n = fib_find(&tab->fib, &a0, len);
-      if (n && rte_is_valid(n->routes))
-	return n;
-      len--;
-    }
-  return NULL;
+  return fib_route_valid(&tab->fib, a, len, net_route_valid);
 }
 
 static void
@@ -230,7 +244,7 @@ rte_trace(struct proto *p, rte *e, int dir, char *msg)
   byte via[STD_ADDRESS_P_LENGTH+32];
 
   rt_format_via(e, via);
-  log(L_TRACE "%s %c %s %I/%d %s", p->name, dir, msg, e->net->n.prefix, e->net->n.pxlen, via);
+  log(L_TRACE "%s %c %s %N %s", p->name, dir, msg, e->net->n.prefix, e->net->n.pxlen, via);
 }
 
 static inline void
@@ -247,64 +261,186 @@ rte_trace_out(uint flag, struct proto *p, rte *e, char *msg)
     rte_trace(p, e, '<', msg);
 }
 
-static rte *
-export_filter(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa, int silent)
+static int
+export_filter_run(struct announce_hook *ah, rte **rt, ea_list **tmpa)
 {
   struct proto *p = ah->proto;
   struct filter *filter = ah->out_filter;
+  int v;
+
+  *tmpa = make_tmp_attrs(*rt, rte_update_pool);
+
+  v = p->import_control ? p->import_control(p, rt, tmpa, rte_update_pool) : 0;
+  if (v < 0)
+    return (v == RIC_REJECT) ? EGV_REJECT : EGV_DROP;
+  if (v > 0)
+    return EGV_FORCE;
+
+  v = filter && ((filter == FILTER_REJECT) ||
+		 (f_run_cached(filter, rt, tmpa, rte_update_pool, FF_FORCE_TMPATTR) > F_ACCEPT));
+  return v ? EGV_FILTER : EGV_ACCEPT;
+}
+
+static void
+export_filter_account(struct announce_hook *ah, rte *rt, int verdict, int silent)
+{
+  struct proto *p = ah->proto;
   struct proto_stats *stats = ah->stats;
+
+  if (silent)
+    return;
+
+  switch (verdict)
+    {
+    case EGV_FORCE:
+      rte_trace_out(D_FILTERS, p, rt, "forced accept by protocol");
+      break;
+
+    case EGV_REJECT:
+      stats->exp_updates_rejected++;
+      rte_trace_out(D_FILTERS, p, rt, "rejected by protocol");
+      break;
+
+    case EGV_DROP:
+      stats->exp_updates_rejected++;
+      break;
+
+    case EGV_FILTER:
+      stats->exp_updates_filtered++;
+      rte_trace_out(D_FILTERS, p, rt, "filtered out");
+      break;
+    }
+}
+
+static rte *
+export_filter(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa, int silent)
+{
   ea_list *tmpb = NULL;
-  rte *rt;
+  rte *rt = rt0;
   int v;
 
-  rt = rt0;
   *rt_free = NULL;
 
   if (!tmpa)
     tmpa = &tmpb;
 
-  *tmpa = make_tmp_attrs(rt, rte_update_pool);
+  v = export_filter_run(ah, &rt, tmpa);
+  export_filter_account(ah, rt, v, silent);
 
-  v = p->import_control ? p->import_control(p, &rt, tmpa, rte_update_pool) : 0;
-  if (v < 0)
+  if (v >= EGV_REJECT)
     {
-      if (silent)
-	goto reject;
-
-      stats->exp_updates_rejected++;
-      if (v == RIC_REJECT)
-	rte_trace_out(D_FILTERS, p, rt, "rejected by protocol");
-      goto reject;
+      /* Discard temporary rte */
+      if (rt != rt0)
+	rte_free(rt);
+      return NULL;
     }
-  if (v > 0)
+
+  if (rt != rt0)
+    *rt_free = rt;
+  return rt;
+}
+
+static u32 rt_export_round;		/* Current rte_announce() round, 0 outside of it */
+static u32 rt_export_round_seq;
+
+static inline int
+export_group_usable(struct announce_hook *ah, rte *rt)
+{
+  /* Routes from group members may be subject to poison reverse etc. */
+  struct announce_hook *sh = rt->attrs->src->proto->main_ahook;
+  return ah->group && rt_export_round && !(sh && (sh->group == ah->group));
+}
+
+/*
+ * export_filter_group - export_filter() sharing the result within the export group
+ *
+ * The first member of the group evaluating the route in the current round
+ * stores the result, the other ones just account it. The filtered route
+ * stays owned by the group until the end of the round.
+ */
+static rte *
+export_filter_group(struct announce_hook *ah, rte *rt0, ea_list **tmpa, int silent)
+{
+  struct export_group *g = ah->group;
+  struct export_group_entry *e = &g->e[silent ? 1 : 0];
+
+  if ((e->round != rt_export_round) || (e->src != rt0))
     {
-      if (!silent)
-	rte_trace_out(D_FILTERS, p, rt, "forced accept by protocol");
-      goto accept;
+      ea_list *tmpb = NULL;
+      rte *rt = rt0;
+
+      if (e->out_free)
+	rte_free(e->out_free);
+
+      e->verdict = export_filter_run(ah, &rt, &tmpb);
+      if (e->verdict >= EGV_REJECT)
+	{
+	  if (rt != rt0)
+	    rte_free(rt);
+	  rt = NULL;
+	  tmpb = NULL;
+	}
+
+      e->src = rt0;
+      e->out = rt;
+      e->out_free = (rt != rt0) ? rt : NULL;
+      e->tmpa = tmpb;
+      e->round = rt_export_round;
+      g->misses++;
     }
+  else
+    g->hits++;
 
-  v = filter && ((filter == FILTER_REJECT) ||
-		 (f_run(filter, &rt, tmpa, rte_update_pool, FF_FORCE_TMPATTR) > F_ACCEPT));
-  if (v)
+  export_filter_account(ah, e->out ?: rt0, e->verdict, silent);
+
+  if (tmpa)
+    *tmpa = e->tmpa;
+  return e->out;
+}
+
+static void
+export_group_release(struct export_group *g)
+{
+  int i;
+
+  for (i = 0; i < 2; i++)
     {
-      if (silent)
-	goto reject;
+      struct export_group_entry *e = &g->e[i];
 
-      stats->exp_updates_filtered++;
-      rte_trace_out(D_FILTERS, p, rt, "filtered out");
-      goto reject;
+      if (e->round != rt_export_round)
+	continue;
+
+      if (e->out_free)
+	rte_free(e->out_free);
+
+      e->src = e->out = e->out_free = NULL;
+      e->tmpa = NULL;
+      e->round = 0;
     }
+}
 
- accept:
-  if (rt != rt0)
-    *rt_free = rt;
-  return rt;
+static inline u32
+rt_export_round_begin(void)
+{
+  u32 saved = rt_export_round;
 
- reject:
-  /* Discard temporary rte */
-  if (rt != rt0)
-    rte_free(rt);
-  return NULL;
+  if (!++rt_export_round_seq)
+    rt_export_round_seq++;
+
+  rt_export_round = rt_export_round_seq;
+  return saved;
+}
+
+static void
+rt_export_round_end(rtable *tab, u32 saved)
+{
+  struct announce_hook *a;
+
+  WALK_LIST(a, tab->hooks)
+    if (a->group)
+      export_group_release(a->group);
+
+  rt_export_round = saved;
 }
 
 static void
@@ -344,7 +480,7 @@ do_rt_notify(struct announce_hook *ah, net *net, rte *new, rte *old, ea_list *tm
   struct proto_limit *l = ah->out_limit;
   if (l && new)
     {
-      if ((!old || refeed) && (stats->exp_routes >= l->limit))
+      if ((!old || (refeed && !p->feed_set)) && (stats->exp_routes >= l->limit))
 	proto_notify_limit(ah, l, PLD_OUT, stats->exp_routes);
 
       if (l->state == PLS_BLOCKED)
@@ -366,10 +502,11 @@ do_rt_notify(struct announce_hook *ah, net *net, rte *new, rte *old, ea_list *tm
     stats->exp_withdraws_accepted++;
 
   /* Hack: We do not decrease exp_routes during refeed, we instead
-     reset exp_routes at the start of refeed. */
+     reset exp_routes at the start of refeed. Partial refeed keeps
+     the counter, so refed routes are counted as replaced. */
   if (new)
     stats->exp_routes++;
-  if (old && !refeed)
+  if (old && (!refeed || p->feed_set))
     stats->exp_routes--;
 
   if (p->debug & D_ROUTES)
@@ -434,10 +571,14 @@ rt_notify_basic(struct announce_hook *ah, net *net, rte *new0, rte *old0, int re
    */
 
   if (new)
-    new = export_filter(ah, new, &new_free, &tmpa, 0);
+    new = export_group_usable(ah, new) ?
+      export_filter_group(ah, new, &tmpa, 0) :
+      export_filter(ah, new, &new_free, &tmpa, 0);
 
   if (old && !refeed)
-    old = export_filter(ah, old, &old_free, NULL, 1);
+    old = export_group_usable(ah, old) ?
+      export_filter_group(ah, old, NULL, 1) :
+      export_filter(ah, old, &old_free, NULL, 1);
 
   if (!new && !old)
   {
@@ -469,6 +610,149 @@ rt_notify_basic(struct announce_hook *ah, net *net, rte *new0, rte *old0, int re
     rte_free(old_free);
 }
 
+/*
+ *	Export cache, see protocol.h
+ */
+
+#define ECE_KEY(n)		n->net
+#define ECE_NEXT(n)		n->next
+#define ECE_EQ(n1,n2)		n1 == n2
+#define ECE_FN(n)		u32_hash((u32) ((uintptr_t) (n) >> 4))
+
+#define ECE_REHASH		rt_export_cache_rehash
+#define ECE_PARAMS		/8, *2, 2, 2, 10, 24
+
+HASH_DEFINE_REHASH_FN(ECE, struct export_cache_entry)
+
+static inline struct export_cache_entry *
+rt_export_cache_find(struct announce_hook *ah, net *net)
+{
+  return ah->export_cache_slab ? HASH_FIND(ah->export_cache, ECE, net) : NULL;
+}
+
+static struct export_cache_entry *
+rt_export_cache_get(struct announce_hook *ah, net *net)
+{
+  struct export_cache_entry *e;
+
+  if (!ah->export_cache_slab)
+    {
+      uint merged = (ah->proto->accept_ra_types == RA_MERGED) ? EXPORT_CACHE_MERGED : 0;
+      HASH_INIT(ah->export_cache, rt_table_pool, 10);
+      ah->export_cache_slab = sl_new(rt_table_pool, sizeof(struct export_cache_entry) + merged * sizeof(rte *));
+    }
+
+  if (e = HASH_FIND(ah->export_cache, ECE, net))
+    return e;
+
+  e = sl_alloc(ah->export_cache_slab);
+  e->net = net;
+  e->best = NULL;
+  e->count = 0;
+  HASH_INSERT2(ah->export_cache, ECE, rt_table_pool, e);
+  return e;
+}
+
+static void
+rt_export_cache_remove(struct announce_hook *ah, net *net)
+{
+  struct export_cache_entry *e = rt_export_cache_find(ah, net);
+
+  if (!e)
+    return;
+
+  HASH_REMOVE2(ah->export_cache, ECE, rt_table_pool, e);
+  sl_free(ah->export_cache_slab, e);
+}
+
+/**
+ * rt_export_cache_flush - drop the export cache of a hook
+ * @ah: announce hook
+ *
+ * This function is called when the hook is unlinked from its table or when
+ * its export filter changes, so the cache cannot hold freed routes or stale
+ * verdicts.
+ */
+void
+rt_export_cache_flush(struct announce_hook *ah)
+{
+  if (!ah->export_cache_slab)
+    return;
+
+  mb_free(ah->export_cache.data);
+  rfree(ah->export_cache_slab);
+  ah->export_cache.data = NULL;
+  ah->export_cache_slab = NULL;
+}
+
+/* Set the source of the route exported to @ah for @net, NULL if none */
+static void
+rt_export_cache_set(struct announce_hook *ah, net *net, rte *best)
+{
+  if (best)
+    rt_export_cache_get(ah, net)->best = best;
+  else
+    rt_export_cache_remove(ah, net);
+}
+
+/* Networks changed without RA_ACCEPTED and RA_MERGED announcements */
+static void
+rt_export_cache_invalidate(rtable *tab, net *net)
+{
+  struct announce_hook *a;
+
+  WALK_LIST(a, tab->hooks)
+    if (a->export_cache_slab)
+      rt_export_cache_remove(a, net);
+}
+
+/*
+ * With a cached source of the previously exported route, routes before it are
+ * known to be rejected, except @new_changed. If the source is @old_changed,
+ * that holds just for routes up to @before_old. Therefore, only these routes
+ * and routes after the unknown boundary are filtered.
+ */
+static void
+rt_notify_accepted_cached(struct announce_hook *ah, net *net, rte *new_changed, rte *old_changed,
+			  rte *before_old, struct export_cache_entry *ce)
+{
+  rte *r;
+  rte *b = ce->best;
+  rte *new_best = NULL;
+  rte *old_best = NULL;
+  rte *new_free = NULL;
+  rte *old_free = NULL;
+  ea_list *tmpa = NULL;
+  int gone = (old_changed == b);
+  int known = !gone || before_old;
+
+  for (r = net->routes; rte_is_valid(r); r = r->next)
+    {
+      /* The previous source is still the first accepted one */
+      if ((r == b) && known)
+	return;
+
+      if ((r == new_changed) || !known)
+	if (new_best = export_filter(ah, r, &new_free, &tmpa, 0))
+	  break;
+
+      if (gone && (r == before_old))
+	known = 0;
+    }
+
+  old_best = export_filter(ah, gone ? old_changed : b, &old_free, NULL, 1);
+  rt_export_cache_set(ah, net, new_best ? r : NULL);
+
+  if (new_best || old_best)
+    do_rt_notify(ah, net, new_best, old_best, tmpa, 0);
+
+  /* Discard temporary rte's */
+  if (new_free)
+    rte_free(new_free);
+  if (old_free)
+    rte_free(old_free);
+}
+
 static void
 rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *old_changed, rte *before_old, int feed)
 {
@@ -480,7 +764,10 @@ rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *ol
   rte *old_best = NULL;
   rte *new_free = NULL;
   rte *old_free = NULL;
+  rte *new_src = NULL;
   ea_list *tmpa = NULL;
+  struct export_cache_entry *ce;
+  int cache = ah->table->config->sorted;
 
   /* Used to track whether we met old_changed position. If before_old is NULL
      old_changed was the first and we met it implicitly before current best route. */
@@ -495,11 +782,20 @@ rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *ol
   else
     stats->exp_withdraws_received++;
 
+  if (cache && !feed && (ce = rt_export_cache_find(ah, net)))
+    {
+      rt_notify_accepted_cached(ah, net, new_changed, old_changed, before_old, ce);
+      return;
+    }
+
   /* First, find the new_best route - first accepted by filters */
   for (r=net->routes; rte_is_valid(r); r=r->next)
     {
       if (new_best = export_filter(ah, r, &new_free, &tmpa, 0))
-	break;
+	{
+	  new_src = r;
+	  break;
+	}
 
       /* Note if we walked around the position of old_changed route */
       if (r == before_old)
@@ -520,12 +816,18 @@ rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *ol
       else
 	old_best = NULL;
 
+      if (cache)
+	rt_export_cache_set(ah, net, new_src);
+
       if (!new_best && !old_best)
 	return;
 
       goto found;
     }
 
+  if (cache)
+    rt_export_cache_set(ah, net, new_src);
+
   /*
    * Now, we find the old_best route. Generally, it is the same as the
    * new_best, unless new_best is the same as new_changed or
@@ -596,12 +898,34 @@ mpnh_merge_rta(struct mpnh *nhs, rta *a, int max)
   return mpnh_merge(nhs, nh2, 1, 0, max, rte_update_pool);
 }
 
-rte *
-rt_export_merged(struct announce_hook *ah, net *net, rte **rt_free, ea_list **tmpa, int silent)
+static rte *
+rt_export_merge_best(struct announce_hook *ah, rte *best, struct mpnh *nhs)
+{
+  if (nhs)
+  {
+    nhs = mpnh_merge_rta(nhs, best->attrs, ah->proto->merge_limit);
+
+    if (nhs->next)
+    {
+      best = rte_cow_rta(best, rte_update_pool);
+      best->attrs->dest = RTD_MULTIPATH;
+      best->attrs->nexthops = nhs;
+    }
+  }
+
+  return best;
+}
+
+/* Like rt_export_merged(), the routes used are stored in @ce if possible */
+static rte *
+rt_export_merged_(struct announce_hook *ah, net *net, rte **rt_free, ea_list **tmpa, int silent,
+		  struct export_cache_entry **ce)
 {
   // struct proto *p = ah->proto;
   struct mpnh *nhs = NULL;
   rte *best0, *best, *rt0, *rt, *tmp;
+  rte *merged[EXPORT_CACHE_MERGED];
+  int count = 0;
 
   best0 = net->routes;
   *rt_free = NULL;
@@ -625,61 +949,156 @@ rt_export_merged(struct announce_hook *ah, net *net, rte **rt_free, ea_list **tm
       continue;
 
     if (rte_is_reachable(rt))
+    {
       nhs = mpnh_merge_rta(nhs, rt->attrs, ah->proto->merge_limit);
 
+      /* Modified routes would have to be filtered again */
+      if ((rt != rt0) || (count == EXPORT_CACHE_MERGED))
+	count = -1;
+      else if (count >= 0)
+	merged[count++] = rt0;
+    }
+
     if (tmp)
       rte_free(tmp);
   }
 
-  if (nhs)
+  if (ce && (count >= 0))
   {
-    nhs = mpnh_merge_rta(nhs, best->attrs, ah->proto->merge_limit);
-
-    if (nhs->next)
-    {
-      best = rte_cow_rta(best, rte_update_pool);
-      best->attrs->dest = RTD_MULTIPATH;
-      best->attrs->nexthops = nhs;
-    }
+    *ce = rt_export_cache_get(ah, net);
+    (*ce)->best = best0;
+    (*ce)->count = count;
+    memcpy((*ce)->merged, merged, count * sizeof(rte *));
   }
 
+  best = rt_export_merge_best(ah, best, nhs);
+
   if (best != best0)
     *rt_free = best;
 
   return best;
 }
 
-
-static void
-rt_notify_merged(struct announce_hook *ah, net *net, rte *new_changed, rte *old_changed,
-		 rte *new_best, rte*old_best, int refeed)
+rte *
+rt_export_merged(struct announce_hook *ah, net *net, rte **rt_free, ea_list **tmpa, int silent)
 {
-  // struct proto *p = ah->proto;
+  return rt_export_merged_(ah, net, rt_free, tmpa, silent, NULL);
+}
 
-  rte *new_best_free = NULL;
-  rte *old_best_free = NULL;
-  rte *new_changed_free = NULL;
-  rte *old_changed_free = NULL;
+/*
+ * Update of the cached merged route, when the best route is the same and at
+ * least one of the changed routes is merged (or was merged) to it. Only the
+ * new route and the best one are filtered. Returns 0 when the cache cannot be
+ * used.
+ */
+static int
+rt_notify_merged_cached(struct announce_hook *ah, net *net, rte *new_changed, rte *old_changed,
+			rte *best0, struct export_cache_entry *ce)
+{
+  struct mpnh *nhs = NULL;
+  rte *new_free = NULL, *old_free = NULL, *tmp = NULL;
+  rte *best, *old, *rt = NULL;
   ea_list *tmpa = NULL;
+  uint i, pos = ce->count;
+  int modified = 0;
 
-  /* We assume that all rte arguments are either NULL or rte_is_valid() */
+  for (i = 0; i < ce->count; i++)
+    if (ce->merged[i] == old_changed)
+      pos = i;
 
-  /* This check should be done by the caller */
-  if (!new_best && !old_best)
-    return;
+  if (rte_mergable(best0, new_changed) && (rt = export_filter(ah, new_changed, &tmp, NULL, 1)))
+    {
+      modified = (rt != new_changed);
+      rt = rte_is_reachable(rt) ? new_changed : NULL;
 
-  /* Check whether the change is relevant to the merged route */
-  if ((new_best == old_best) && !refeed)
-  {
-    new_changed = rte_mergable(new_best, new_changed) ?
-      export_filter(ah, new_changed, &new_changed_free, NULL, 1) : NULL;
+      if (tmp)
+	rte_free(tmp);
+    }
 
-    old_changed = rte_mergable(old_best, old_changed) ?
-      export_filter(ah, old_changed, &old_changed_free, NULL, 1) : NULL;
+  /* Modified or too many routes, such network is not cached */
+  if (rt && (modified || ((pos == ce->count) && (ce->count == EXPORT_CACHE_MERGED))))
+    {
+      rt_export_cache_remove(ah, net);
+      return 0;
+    }
 
-    if (!new_changed && !old_changed)
-      return;
-  }
+  /* Irrelevant change */
+  if (!rt && (pos == ce->count))
+    return 1;
+
+  if (pos < ce->count)
+    ce->merged[pos] = ce->merged[--ce->count];
+  if (rt)
+    ce->merged[ce->count++] = rt;
+
+  ah->stats->exp_updates_received++;
+
+  best = export_filter(ah, best0, &new_free, &tmpa, 0);
+  if (best && rte_is_reachable(best))
+    {
+      for (i = 0; i < ce->count; i++)
+	nhs = mpnh_merge_rta(nhs, ce->merged[i]->attrs, ah->proto->merge_limit);
+
+      best = rt_export_merge_best(ah, best, nhs);
+      if (best != best0)
+	new_free = best;
+    }
+  else
+    rt_export_cache_remove(ah, net);
+
+  old = export_filter(ah, best0, &old_free, NULL, 1);
+
+  if (best || old)
+    do_rt_notify(ah, net, best, old, tmpa, 0);
+
+  /* Discard temporary rte's */
+  if (new_free)
+    rte_free(new_free);
+  if (old_free)
+    rte_free(old_free);
+
+  return 1;
+}
+
+
+static void
+rt_notify_merged(struct announce_hook *ah, net *net, rte *new_changed, rte *old_changed,
+		 rte *new_best, rte*old_best, int refeed)
+{
+  // struct proto *p = ah->proto;
+
+  rte *new_best_free = NULL;
+  rte *old_best_free = NULL;
+  rte *new_changed_free = NULL;
+  rte *old_changed_free = NULL;
+  ea_list *tmpa = NULL;
+  struct export_cache_entry *ce;
+
+  /* We assume that all rte arguments are either NULL or rte_is_valid() */
+
+  /* This check should be done by the caller */
+  if (!new_best && !old_best)
+    return;
+
+  /* Check whether the change is relevant to the merged route */
+  if ((new_best == old_best) && !refeed)
+  {
+    ce = rt_export_cache_find(ah, net);
+
+    if (ce && (ce->best != new_best))
+      rt_export_cache_remove(ah, net);
+    else if (ce && rt_notify_merged_cached(ah, net, new_changed, old_changed, new_best, ce))
+      return;
+
+    new_changed = rte_mergable(new_best, new_changed) ?
+      export_filter(ah, new_changed, &new_changed_free, NULL, 1) : NULL;
+
+    old_changed = rte_mergable(old_best, old_changed) ?
+      export_filter(ah, old_changed, &old_changed_free, NULL, 1) : NULL;
+
+    if (!new_changed && !old_changed)
+      return;
+  }
 
   if (new_best)
     ah->stats->exp_updates_received++;
@@ -687,8 +1106,9 @@ rt_notify_merged(struct announce_hook *ah, net *net, rte *new_changed, rte *old_
     ah->stats->exp_withdraws_received++;
 
   /* Prepare new merged route */
+  rt_export_cache_remove(ah, net);
   if (new_best)
-    new_best = rt_export_merged(ah, net, &new_best_free, &tmpa, 0);
+    new_best = rt_export_merged_(ah, net, &new_best_free, &tmpa, 0, &ce);
 
   /* Prepare old merged route (without proper merged next hops) */
   /* There are some issues with running filter on old route - see rt_notify_basic() */
@@ -710,6 +1130,102 @@ rt_notify_merged(struct announce_hook *ah, net *net, rte *new_changed, rte *old_
 }
 
 
+/*
+ *	Export of N best routes
+ *
+ *	A protocol accepting RA_ANY announcements may limit them to the best
+ *	@ra_best_paths routes of each network. The set is ranked by rte_better()
+ *	with ties broken by the global source ID. As rte_better() is not
+ *	necessarily transitive, valid routes are first put into a canonical order
+ *	by source ID, so the same set of routes always gives the same selection.
+ *	Then the previously exported set can be computed from the current list
+ *	with the changed route swapped back and the difference is announced.
+ */
+
+static int
+rte_src_cmp(const void *a, const void *b)
+{
+  u32 x = (*(rte **) a)->attrs->src->global_id;
+  u32 y = (*(rte **) b)->attrs->src->global_id;
+  return (x > y) - (x < y);
+}
+
+static uint
+rt_select_best_n(net *net, rte *skip, rte *extra, rte **best, uint max)
+{
+  uint i, j, n = 0, cnt = 0;
+  rte *e;
+
+  for (e = net->routes; e; e = e->next)
+    n++;
+
+  rte **all = lp_alloc(rte_update_pool, (n + 1) * sizeof(rte *));
+  n = 0;
+  for (e = net->routes; e; e = e->next)
+    if ((e != skip) && rte_is_valid(e))
+      all[n++] = e;
+  if (extra)
+    all[n++] = extra;
+
+  qsort(all, n, sizeof(rte *), rte_src_cmp);
+
+  for (i = 0; i < n; i++)
+    {
+      for (j = 0; j < cnt; j++)
+	if (rte_better(all[i], best[j]))
+	  break;
+
+      if (j >= max)
+	continue;
+
+      memmove(best + j + 1, best + j, (MIN(cnt, max - 1) - j) * sizeof(rte *));
+      best[j] = all[i];
+      cnt = MIN(cnt + 1, max);
+    }
+
+  return cnt;
+}
+
+static inline int
+rt_best_n_has(rte **set, uint cnt, rte *e)
+{
+  uint i;
+  for (i = 0; i < cnt; i++)
+    if (set[i] == e)
+      return 1;
+  return 0;
+}
+
+static void
+rt_notify_best_n(struct announce_hook *ah, net *net, rte *new_changed, rte *old_changed)
+{
+  uint max = ah->proto->ra_best_paths;
+  rte *cur[max], *prev[max];
+  uint i, nc, np;
+
+  nc = rt_select_best_n(net, NULL, NULL, cur, max);
+  np = rt_select_best_n(net, new_changed, old_changed, prev, max);
+
+  int old_in = old_changed && rt_best_n_has(prev, np, old_changed);
+
+  for (i = 0; i < nc; i++)
+    if (!rt_best_n_has(prev, np, cur[i]))
+      {
+	if ((cur[i] == new_changed) && old_in)
+	  {
+	    rt_notify_basic(ah, net, new_changed, old_changed, 0);
+	    old_in = 0;
+	  }
+	else
+	  rt_notify_basic(ah, net, cur[i], NULL, 0);
+      }
+
+  for (i = 0; i < np; i++)
+    if (!rt_best_n_has(cur, nc, prev[i]) && ((prev[i] != old_changed) || old_in))
+      rt_notify_basic(ah, net, NULL, prev[i], 0);
+}
+
+
 /**
  * rte_announce - announce a routing table change
  * @tab: table the route has been added to
@@ -738,10 +1254,71 @@ rt_notify_merged(struct announce_hook *ah, net *net, rte *new_changed, rte *old_
  * export filter and if it accepts the route, the rt_notify() hook of
  * the protocol gets called.
  */
+
+/*
+ *	Export journal
+ *
+ *	When a table has the coalesce option, changes of optimal routes are not
+ *	announced to RA_OPTIMAL hooks immediately. Instead, the first change of a
+ *	network records the previous optimal route to the journal and the journal
+ *	is drained later from the table event in bounded steps. The announcement
+ *	then contains the current optimal route and the recorded one, therefore
+ *	all intermediate changes are collapsed and flaps returning the network to
+ *	the original state are not announced at all.
+ *
+ *	The cost of draining is dominated by export filters, so the drain step is
+ *	bounded by the number of hook notifications rather than by the number of
+ *	nets. A table with hundreds of export hooks thus drains fewer nets in one
+ *	step and returns to the main loop in roughly the same time as a table with
+ *	a few hooks, keeping the import path and other events responsive.
+ */
+
+#define RT_JOURNAL_STEP 2048		/* Max work units (nets and notifications) in one step */
+
+struct rt_journal_entry {
+  struct rt_journal_entry *next;
+  net *net;
+  rte *old;				/* Private copy of previous optimal route, or NULL */
+};
+
+static void
+rt_journal_record(rtable *tab, net *net, rte *old)
+{
+  struct rt_journal_entry *je;
+
+  if (net->n.flags & NF_JOURNAL)
+    return;
+
+  if (!tab->journal_slab)
+    tab->journal_slab = sl_new(tab->fib.fib_pool, sizeof(struct rt_journal_entry));
+
+  je = sl_alloc(tab->journal_slab);
+  je->next = NULL;
+  je->net = net;
+  je->old = NULL;
+
+  if (old)
+    {
+      je->old = sl_alloc(rte_slab);
+      memcpy(je->old, old, sizeof(rte));
+      je->old->attrs = rta_clone(old->attrs);
+      je->old->next = NULL;
+    }
+
+  net->n.flags |= NF_JOURNAL;
+  *tab->journal_last = je;
+  tab->journal_last = &je->next;
+  tab->journal_count++;
+
+  rt_schedule(tab);
+}
+
 static void
 rte_announce(rtable *tab, unsigned type, net *net, rte *new, rte *old,
 	     rte *new_best, rte *old_best, rte *before_old)
 {
+  PROBE4(rte_announce, tab->name, type, &net->n.prefix, net->n.pxlen);
+
   if (!rte_is_valid(new))
     new = NULL;
 
@@ -766,9 +1343,16 @@ rte_announce(rtable *tab, unsigned type, net *net, rte *new, rte *old,
 
       if (tab->hostcache)
 	rt_notify_hostcache(tab, net);
+
+      if (tab->coalesce)
+	{
+	  rt_journal_record(tab, net, old);
+	  return;
+	}
     }
 
   struct announce_hook *a;
+  u32 round = rt_export_round_begin();
   WALK_LIST(a, tab->hooks)
     {
       ASSERT(a->proto->export_state != ES_DOWN);
@@ -777,9 +1361,12 @@ rte_announce(rtable *tab, unsigned type, net *net, rte *new, rte *old,
 	  rt_notify_accepted(a, net, new, old, before_old, 0);
 	else if (type == RA_MERGED)
 	  rt_notify_merged(a, net, new, old, new_best, old_best, 0);
+	else if ((type == RA_ANY) && a->proto->ra_best_paths)
+	  rt_notify_best_n(a, net, new, old);
 	else
 	  rt_notify_basic(a, net, new, old, 0);
     }
+  rt_export_round_end(tab, round);
 }
 
 static inline int
@@ -820,11 +1407,38 @@ rte_free(rte *e)
   sl_free(rte_slab, e);
 }
 
+/*
+ * While pruning, freed rtes are collected and returned to the slab in
+ * batches. Routes of a flushed protocol were mostly allocated together,
+ * so sl_free_bulk() handles them per slab page.
+ */
+#define RTE_FREE_BATCH 64
+
+static void *rte_free_batch[RTE_FREE_BATCH];
+static uint rte_free_count;
+static int rte_free_deferred;
+
+static void
+rte_free_flush(void)
+{
+  sl_free_bulk(rte_slab, rte_free_batch, rte_free_count);
+  rte_free_count = 0;
+}
+
 static inline void
 rte_free_quick(rte *e)
 {
   rta_free(e->attrs);
-  sl_free(rte_slab, e);
+
+  if (!rte_free_deferred)
+    {
+      sl_free(rte_slab, e);
+      return;
+    }
+
+  rte_free_batch[rte_free_count++] = e;
+  if (rte_free_count == RTE_FREE_BATCH)
+    rte_free_flush();
 }
 
 static int
@@ -840,6 +1454,235 @@ rte_same(rte *x, rte *y)
 
 static inline int rte_is_ok(rte *e) { return e && !rte_is_filtered(e); }
 
+static int rte_update_nest_cnt;		/* Nesting counter to allow recursive updates */
+
+static inline void
+rte_update_lock(void)
+{
+  rte_update_nest_cnt++;
+}
+
+static inline void
+rte_update_unlock(void)
+{
+  if (!--rte_update_nest_cnt)
+    lp_flush(rte_update_pool);
+}
+
+/* Drains journal entries using at most *limit work units, returns 1 when the journal is empty */
+static int
+rt_journal_drain(rtable *tab, int *limit)
+{
+  struct rt_journal_entry *je;
+  struct announce_hook *a;
+
+  rte_update_lock();
+  while ((je = tab->journal_first) && (*limit > 0))
+    {
+      net *net = je->net;
+      rte *new = rte_is_valid(net->routes) ? net->routes : NULL;
+      rte *old = je->old;
+
+      if (!(tab->journal_first = je->next))
+	tab->journal_last = &tab->journal_first;
+      tab->journal_count--;
+      net->n.flags &= ~NF_JOURNAL;
+      (*limit)--;
+
+      /* Nothing changed from the view of exports */
+      if ((new && old && (new->sender == old->sender) && rte_same(new, old)) || (!new && !old))
+	goto done;
+
+      u32 round = rt_export_round_begin();
+      WALK_LIST(a, tab->hooks)
+	{
+	  ASSERT(a->proto->export_state != ES_DOWN);
+	  if (a->proto->accept_ra_types == RA_OPTIMAL)
+	    {
+	      rt_notify_basic(a, net, new, old, 0);
+	      (*limit)--;
+	    }
+	}
+      rt_export_round_end(tab, round);
+
+    done:
+      if (old)
+	rte_free_quick(old);
+      sl_free(tab->journal_slab, je);
+    }
+  rte_update_unlock();
+
+  return !tab->journal_first;
+}
+
+/*
+ *	Hostentry dependencies
+ *
+ *	For each hostentry, the dependent table keeps a list of networks having
+ *	routes resolved through it. Entries are reference counted by the routes
+ *	of the network and kept in a hash keyed by (hostentry, net), so they can
+ *	be found when a route is removed. When a hostentry changes, Next Hop
+ *	Update walks just its list instead of the whole table.
+ */
+
+#define HED_KEY(n)		n->he, n->net
+#define HED_NEXT(n)		n->next
+#define HED_EQ(h1,n1,h2,n2)	h1 == h2 && n1 == n2
+#define HED_FN(h,n)		u32_hash((h)->hash_key ^ (u32) ((uintptr_t) (n) >> 4))
+
+#define HED_REHASH		rt_dep_rehash
+#define HED_PARAMS		/8, *2, 2, 2, 10, 24
+
+HASH_DEFINE_REHASH_FN(HED, struct hostentry_dep)
+
+static void
+rt_dep_add(rtable *tab, net *net, struct hostentry *he)
+{
+  struct hostentry_dep *d;
+
+  if (!tab->he_dep_slab)
+    {
+      HASH_INIT(tab->he_deps, tab->fib.fib_pool, 10);
+      tab->he_dep_slab = sl_new(tab->fib.fib_pool, sizeof(struct hostentry_dep));
+    }
+
+  if (d = HASH_FIND(tab->he_deps, HED, he, net))
+    {
+      d->uc++;
+      return;
+    }
+
+  d = sl_alloc(tab->he_dep_slab);
+  d->he = he;
+  d->net = net;
+  d->uc = 1;
+  add_tail(&he->deps, &d->n);
+  HASH_INSERT2(tab->he_deps, HED, tab->fib.fib_pool, d);
+}
+
+static void
+rt_dep_remove(rtable *tab, net *net, struct hostentry *he)
+{
+  struct hostentry_dep *d = HASH_FIND(tab->he_deps, HED, he, net);
+
+  ASSERT(d);
+  if (--d->uc)
+    return;
+
+  /* Keep the Next Hop Update position valid */
+  if (tab->nhu_pos == &d->n)
+    tab->nhu_pos = d->n.next;
+
+  rem_node(&d->n);
+  HASH_REMOVE2(tab->he_deps, HED, tab->fib.fib_pool, d);
+  sl_free(tab->he_dep_slab, d);
+}
+
+static inline struct hostentry *
+rte_dep_hostentry(rtable *tab, rte *e)
+{
+  /* Routes propagated through pipes are updated via their original table */
+  struct hostentry *he = e ? e->attrs->hostentry : NULL;
+  return (he && (he->tab == tab)) ? he : NULL;
+}
+
+static inline void
+rt_update_deps(rtable *tab, net *net, rte *new, rte *old)
+{
+  struct hostentry *nh = rte_dep_hostentry(tab, new);
+  struct hostentry *oh = rte_dep_hostentry(tab, old);
+
+  if (nh == oh)
+    return;
+
+  if (oh)
+    rt_dep_remove(tab, net, oh);
+  if (nh)
+    rt_dep_add(tab, net, nh);
+}
+
+/*
+ *	Source index
+ *
+ *	Finding the route of a given source in a network requires a walk through
+ *	the route list, which is slow for networks with many routes (e.g. a route
+ *	server with hundreds of peers). When the list of a network grows over
+ *	RT_INDEX_MIN routes, its routes are entered to a per-table hash keyed by
+ *	(net, source) and the network is marked by NF_INDEXED. The flag is removed
+ *	when the network loses all its routes.
+ */
+
+struct rte_index_entry {
+  struct rte_index_entry *next;
+  net *net;
+  struct rte_src *src;
+  rte *rte;
+};
+
+#define RT_INDEX_MIN		16
+
+#define RIX_KEY(n)		n->net, n->src
+#define RIX_NEXT(n)		n->next
+#define RIX_EQ(n1,s1,n2,s2)	n1 == n2 && s1 == s2
+#define RIX_FN(n,s)		u32_hash((u32) ((uintptr_t) (n) >> 4) ^ u32_hash((s)->global_id))
+
+#define RIX_REHASH		rt_index_rehash
+#define RIX_PARAMS		/8, *2, 2, 2, 10, 24
+
+HASH_DEFINE_REHASH_FN(RIX, struct rte_index_entry)
+
+static inline rte *
+rt_index_find(rtable *tab, net *net, struct rte_src *src)
+{
+  struct rte_index_entry *ie = HASH_FIND(tab->src_index, RIX, net, src);
+  return ie ? ie->rte : NULL;
+}
+
+static void
+rt_index_add(rtable *tab, rte *e)
+{
+  struct rte_index_entry *ie = sl_alloc(tab->src_index_slab);
+
+  ie->net = e->net;
+  ie->src = e->attrs->src;
+  ie->rte = e;
+  HASH_INSERT2(tab->src_index, RIX, tab->fib.fib_pool, ie);
+}
+
+static void
+rt_index_update(rtable *tab, net *net, struct rte_src *src, rte *new)
+{
+  struct rte_index_entry *ie = HASH_FIND(tab->src_index, RIX, net, src);
+
+  if (ie && new)
+    ie->rte = new;
+  else if (ie)
+    {
+      HASH_REMOVE2(tab->src_index, RIX, tab->fib.fib_pool, ie);
+      sl_free(tab->src_index_slab, ie);
+    }
+  else if (new)
+    rt_index_add(tab, new);
+}
+
+static void
+rt_index_net(rtable *tab, net *net)
+{
+  rte *e;
+
+  if (!tab->src_index_slab)
+    {
+      HASH_INIT(tab->src_index, tab->fib.fib_pool, 10);
+      tab->src_index_slab = sl_new(tab->fib.fib_pool, sizeof(struct rte_index_entry));
+    }
+
+  for (e = net->routes; e; e = e->next)
+    if (!HASH_FIND(tab->src_index, RIX, net, e->attrs->src))
+      rt_index_add(tab, e);
+
+  net->n.flags |= NF_INDEXED;
+}
+
 static void
 rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
 {
@@ -851,56 +1694,72 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
   rte *old_best = net->routes;
   rte *old = NULL;
   rte **k;
+  uint count = 0;
 
   k = &net->routes;			/* Find and remove original route from the same protocol */
-  while (old = *k)
-    {
+  if (net->n.flags & NF_INDEXED)
+    old = rt_index_find(table, net, src);
+  else
+    for (; old = *k; k = &old->next, before_old = old, count++)
       if (old->attrs->src == src)
+	break;
+
+  if (old)
+    {
+      /* If there is the same route in the routing table but from
+       * a different sender, then there are two paths from the
+       * source protocol to this routing table through transparent
+       * pipes, which is not allowed.
+       *
+       * We log that and ignore the route. If it is withdraw, we
+       * ignore it completely (there might be 'spurious withdraws',
+       * see FIXME in do_rte_announce())
+       */
+      if (old->sender->proto != p)
 	{
-	  /* If there is the same route in the routing table but from
-	   * a different sender, then there are two paths from the
-	   * source protocol to this routing table through transparent
-	   * pipes, which is not allowed.
-	   *
-	   * We log that and ignore the route. If it is withdraw, we
-	   * ignore it completely (there might be 'spurious withdraws',
-	   * see FIXME in do_rte_announce())
-	   */
-	  if (old->sender->proto != p)
+	  if (new)
 	    {
-	      if (new)
-		{
-		  log_rl(&rl_pipe, L_ERR "Pipe collision detected when sending %I/%d to table %s",
-		      net->n.prefix, net->n.pxlen, table->name);
-		  rte_free_quick(new);
-		}
-	      return;
+	      log_rl(&rl_pipe, L_ERR "Pipe collision detected when sending %I/%d to table %s",
+		  net->n.prefix, net->n.pxlen, table->name);
+	      rte_free_quick(new);
 	    }
+	  return;
+	}
 
-	  if (new && rte_same(old, new))
+      if (new && rte_same(old, new))
+	{
+	  /* No changes, ignore the new route, but mark the old one as refreshed */
+	  if (old->refresh_gen != ah->refresh_gen)
 	    {
-	      /* No changes, ignore the new route */
+	      old->refresh_gen = ah->refresh_gen;
+	      ah->refresh_routes++;
+	    }
 
-	      if (!rte_is_filtered(new))
-		{
-		  stats->imp_updates_ignored++;
-		  rte_trace_in(D_ROUTES, p, new, "ignored");
-		}
+	  if (!rte_is_filtered(new))
+	    {
+	      stats->imp_updates_ignored++;
+	      rte_trace_in(D_ROUTES, p, new, "ignored");
+	    }
 
-	      rte_free_quick(new);
+	  rte_free_quick(new);
 #ifdef CONFIG_RIP
-	      /* lastmod is used internally by RIP as the last time
-		 when the route was received. */
-	      if (src->proto->proto == &proto_rip)
-		old->lastmod = now;
+	  /* lastmod is used internally by RIP as the last time
+	     when the route was received. */
+	  if (src->proto->proto == &proto_rip)
+	    old->lastmod = now;
 #endif
-	      return;
-	    }
-	  *k = old->next;
-	  break;
+	  return;
 	}
-      k = &old->next;
-      before_old = old;
+
+      /* Find the predecessor, the list stays authoritative */
+      if (net->n.flags & NF_INDEXED)
+	for (; *k && (*k != old); k = &(*k)->next)
+	  before_old = *k;
+
+      if (*k)
+	*k = old->next;
+      else
+	old = NULL;
     }
 
   if (!old)
@@ -1065,6 +1924,27 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
   if (new)
     new->lastmod = now;
 
+  if (new)
+    new->refresh_gen = ah->refresh_gen;
+  if (old && (old->refresh_gen == ah->refresh_gen))
+    ah->refresh_routes--;
+  if (new)
+    ah->refresh_routes++;
+
+  rt_update_deps(table, net, new, old);
+
+  /* Update the source index */
+  if (net->n.flags & NF_INDEXED)
+    {
+      if (new || old)
+	rt_index_update(table, net, src, new);
+
+      if (!net->routes)
+	net->n.flags &= ~NF_INDEXED;
+    }
+  else if (new && !old && (count >= RT_INDEX_MIN))
+    rt_index_net(table, net);
+
   /* Log the route change */
   if (p->debug & D_ROUTES)
     {
@@ -1103,21 +1983,6 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
     rte_free_quick(old);
 }
 
-static int rte_update_nest_cnt;		/* Nesting counter to allow recursive updates */
-
-static inline void
-rte_update_lock(void)
-{
-  rte_update_nest_cnt++;
-}
-
-static inline void
-rte_update_unlock(void)
-{
-  if (!--rte_update_nest_cnt)
-    lp_flush(rte_update_pool);
-}
-
 static inline void
 rte_hide_dummy_routes(net *net, rte **dummy)
 {
@@ -1180,27 +2045,65 @@ rte_unhide_dummy_routes(net *net, rte **dummy)
  * finishes.
  */
 
-void
-rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
+static inline int
+rte_import_validate(struct announce_hook *ah, rte *new)
+{
+  new->sender = ah;
+
+  ah->stats->imp_updates_received++;
+  if (!rte_validate(new))
+    {
+      rte_trace_in(D_FILTERS, ah->proto, new, "invalid");
+      ah->stats->imp_updates_invalid++;
+      return 0;
+    }
+
+  return 1;
+}
+
+/* Processing of import filter result @fr, returns 0 if the route should be dropped */
+static inline int
+rte_import_verdict(struct announce_hook *ah, rte *new, struct rte_src *src, int fr, ea_list *tmpa, ea_list *old_tmpa)
+{
+  if (fr > F_ACCEPT)
+    {
+      ah->stats->imp_updates_filtered++;
+      rte_trace_in(D_FILTERS, ah->proto, new, "filtered out");
+
+      if (! ah->in_keep_filtered)
+	return 0;
+
+      new->flags |= REF_FILTERED;
+    }
+
+  if (tmpa != old_tmpa && src->proto->store_tmp_attrs)
+    src->proto->store_tmp_attrs(new, tmpa);
+
+  return 1;
+}
+
+static inline void
+rte_import_finish(rte *new)
+{
+  if (!rta_is_cached(new->attrs)) /* Need to copy attributes */
+    new->attrs = rta_lookup(new->attrs);
+  new->flags |= REF_COW;
+}
+
+/* Validation and import filtering part of rte_update2(), returns 0 if the update should be ignored */
+static int
+rte_import(struct announce_hook *ah, net *net, rte **new_p, struct rte_src *src)
 {
   struct proto *p = ah->proto;
   struct proto_stats *stats = ah->stats;
   struct filter *filter = ah->in_filter;
   ea_list *tmpa = NULL;
-  rte *dummy = NULL;
+  rte *new = *new_p;
 
-  rte_update_lock();
   if (new)
     {
-      new->sender = ah;
-
-      stats->imp_updates_received++;
-      if (!rte_validate(new))
-	{
-	  rte_trace_in(D_FILTERS, p, new, "invalid");
-	  stats->imp_updates_invalid++;
-	  goto drop;
-	}
+      if (!rte_import_validate(ah, new))
+	goto drop;
 
       if (filter == FILTER_REJECT)
 	{
@@ -1220,23 +2123,11 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
 	    {
 	      ea_list *old_tmpa = tmpa;
 	      int fr = f_run(filter, &new, &tmpa, rte_update_pool, 0);
-	      if (fr > F_ACCEPT)
-		{
-		  stats->imp_updates_filtered++;
-		  rte_trace_in(D_FILTERS, p, new, "filtered out");
-
-		  if (! ah->in_keep_filtered)
-		    goto drop;
-
-		  new->flags |= REF_FILTERED;
-		}
-	      if (tmpa != old_tmpa && src->proto->store_tmp_attrs)
-		src->proto->store_tmp_attrs(new, tmpa);
+	      if (!rte_import_verdict(ah, new, src, fr, tmpa, old_tmpa))
+		goto drop;
 	    }
 	}
-      if (!rta_is_cached(new->attrs)) /* Need to copy attributes */
-	new->attrs = rta_lookup(new->attrs);
-      new->flags |= REF_COW;
+      rte_import_finish(new);
     }
   else
     {
@@ -1245,22 +2136,206 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
       if (!net || !src)
 	{
 	  stats->imp_withdraws_ignored++;
-	  rte_update_unlock();
-	  return;
+	  return 0;
 	}
     }
 
- recalc:
-  rte_hide_dummy_routes(net, &dummy);
-  rte_recalculate(ah, net, new, src);
-  rte_unhide_dummy_routes(net, &dummy);
+  *new_p = new;
+  return 1;
+
+ drop:
+  rte_free(new);
+  *new_p = NULL;
+  return 1;
+}
+
+static inline void
+rte_import_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
+{
+  rte *dummy = NULL;
+
+  rte_hide_dummy_routes(net, &dummy);
+  rte_recalculate(ah, net, new, src);
+  rte_unhide_dummy_routes(net, &dummy);
+}
+
+void
+rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
+{
+  PROBE4(rte_update_entry, ah->proto->name, &net->n.prefix, net->n.pxlen, new);
+
+  rte_update_lock();
+  if (rte_import(ah, net, &new, src))
+    rte_import_recalculate(ah, net, new, src);
+  rte_update_unlock();
+
+  PROBE1(rte_update_return, ah->proto->name);
+}
+
+/**
+ * rte_batch_start - start a batch of route updates
+ * @b: batch structure (allocated by the caller)
+ * @ah: announce hook used to send the routes
+ *
+ * Routing protocols processing many updates at once (e.g. BGP UPDATE
+ * messages with many prefixes sharing the same attributes, or full kernel
+ * table scans) may use a batch instead of calling rte_update2() for each
+ * route. Routes in a batch are validated immediately by rte_batch_update()
+ * like by rte_update2(), but the import filter is run for all routes of the
+ * batch at once by f_run_batch(), and the routing table is recalculated and
+ * the changes announced, only when the batch is flushed. That happens when it
+ * is full or when rte_batch_end() is called. Several updates of the same
+ * network from the same source in one batch are coalesced, so only the last
+ * one is propagated.
+ *
+ * The temporary linpool @rte_update_pool is kept during the batch, so callers
+ * should prepare shared cached attributes (using rta_lookup()) once and only
+ * rta_clone() them for each route. Note that the routing table is not updated
+ * before the batch is flushed, so a protocol cannot see its own batched routes
+ * in the table.
+ */
+void
+rte_batch_start(struct rte_batch *b, struct announce_hook *ah)
+{
+  rte_update_lock();
+  b->ah = ah;
+  b->count = 0;
+}
+
+/* Run the import filter for all pending routes of the batch at once */
+static void
+rte_batch_filter(struct rte_batch *b)
+{
+  struct rte_batch_item *it, *end = b->items + b->count;
+  rte *rtes[RTE_BATCH_SIZE];
+  ea_list *tmpa[RTE_BATCH_SIZE];
+  int res[RTE_BATCH_SIZE];
+  uint i, n = 0;
+
+  for (it = b->items; it < end; it++)
+    if (it->filter)
+      {
+	rtes[n] = it->new;
+	tmpa[n] = it->tmpa;
+	n++;
+      }
+
+  if (!n)
+    return;
+
+  f_run_batch(b->ah->in_filter, rtes, tmpa, res, n, rte_update_pool, 0);
+
+  for (it = b->items, i = 0; it < end; it++)
+    if (it->filter)
+      {
+	rte *new = rtes[i];
+
+	if (rte_import_verdict(b->ah, new, it->src, res[i], tmpa[i], it->tmpa))
+	  rte_import_finish(new);
+	else
+	  {
+	    rte_free(new);
+	    new = NULL;
+	  }
+
+	it->new = new;
+	it->filter = 0;
+	i++;
+      }
+}
+
+static void
+rte_batch_flush(struct rte_batch *b)
+{
+  struct rte_batch_item *it, *it2, *end = b->items + b->count;
+
+  rte_batch_filter(b);
+
+  for (it = b->items; it < end; it++)
+    {
+      /* Skip updates superseded by later ones for the same network and source */
+      for (it2 = it + 1; it2 < end; it2++)
+	if ((it2->net == it->net) && (it2->src == it->src))
+	  break;
+
+      if (it2 < end)
+	{
+	  if (it->new)
+	    {
+	      b->ah->stats->imp_updates_ignored++;
+	      rte_free_quick(it->new);
+	    }
+	  continue;
+	}
+
+      rte_import_recalculate(b->ah, it->net, it->new, it->src);
+    }
+
+  b->count = 0;
+
+  /* Release temporary memory */
+  rte_update_unlock();
+  rte_update_lock();
+}
+
+/**
+ * rte_batch_update - add a route update to a batch
+ * @b: batch started with rte_batch_start()
+ * @net: network node
+ * @new: a &rte representing the new route or %NULL for route removal
+ * @src: protocol originating the update
+ *
+ * This function has the same semantics as rte_update2(), but the
+ * recalculation of the routing table is deferred, see rte_batch_start().
+ */
+void
+rte_batch_update(struct rte_batch *b, net *net, rte *new, struct rte_src *src)
+{
+  struct filter *filter = b->ah->in_filter;
+  ea_list *tmpa = NULL;
+  int pending = 0;
+
+  /* Routes are validated now, but filtered by f_run_batch() at flush */
+  if (new && filter && (filter != FILTER_REJECT))
+    {
+      if (rte_import_validate(b->ah, new))
+	{
+	  tmpa = make_tmp_attrs(new, rte_update_pool);
+	  pending = 1;
+	}
+      else
+	{
+	  rte_free(new);
+	  new = NULL;
+	}
+    }
+  else if (!rte_import(b->ah, net, &new, src))
+    return;
+
+  struct rte_batch_item *it = &b->items[b->count++];
+  it->net = net;
+  it->new = new;
+  it->src = src;
+  it->tmpa = tmpa;
+  it->filter = pending;
+
+  if (b->count == RTE_BATCH_SIZE)
+    rte_batch_flush(b);
+}
+
+/**
+ * rte_batch_end - finish a batch of route updates
+ * @b: batch to be finished
+ *
+ * All pending updates of the batch are propagated to the routing table.
+ */
+void
+rte_batch_end(struct rte_batch *b)
+{
+  if (b->count)
+    rte_batch_flush(b);
+
   rte_update_unlock();
-  return;
-
- drop:
-  rte_free(new);
-  new = NULL;
-  goto recalc;
 }
 
 /* Independent call to rte_announce(), used from next hop
@@ -1320,24 +2395,17 @@ rt_examine(rtable *t, ip_addr prefix, int pxlen, struct proto *p, struct filter
  * routes to the routing table (by rte_update()). After that, all protocol
  * routes (more precisely routes with @ah as @sender) not sent during the
  * refresh cycle but still in the table from the past are pruned. This is
- * implemented by marking all related routes as stale by REF_STALE flag in
- * rt_refresh_begin(), then marking all related stale routes with REF_DISCARD
- * flag in rt_refresh_end() and then removing such routes in the prune loop.
+ * implemented by a per-hook cycle counter. Routes are stamped with the
+ * current cycle of their sender when they are updated (or confirmed by an
+ * identical update), so rt_refresh_begin() just starts a new cycle. Routes
+ * with a stamp older than the last finished cycle are then removed in the
+ * prune loop.
  */
 void
-rt_refresh_begin(rtable *t, struct announce_hook *ah)
+rt_refresh_begin(rtable *t UNUSED, struct announce_hook *ah)
 {
-  net *n;
-  rte *e;
-
-  FIB_WALK(&t->fib, fn)
-    {
-      n = (net *) fn;
-      for (e = n->routes; e; e = e->next)
-	if (e->sender == ah)
-	  e->flags |= REF_STALE;
-    }
-  FIB_WALK_END;
+  ah->refresh_gen++;
+  ah->refresh_routes = 0;
 }
 
 /**
@@ -1345,30 +2413,106 @@ rt_refresh_begin(rtable *t, struct announce_hook *ah)
  * @t: related routing table
  * @ah: related announce hook 
  *
- * This function starts a refresh cycle for given routing table and announce
- * hook. See rt_refresh_begin() for description of refresh cycles.
+ * This function finishes a refresh cycle for given routing table and announce
+ * hook. See rt_refresh_begin() for description of refresh cycles. The prune
+ * loop is scheduled only when some routes were not refreshed, several hooks
+ * ending their cycles at once share one prune pass.
  */
 void
 rt_refresh_end(rtable *t, struct announce_hook *ah)
 {
-  int prune = 0;
-  net *n;
+  ah->refresh_stale = ah->refresh_gen;
+
+  if (ah->stats->imp_routes + ah->stats->filt_routes > ah->refresh_routes)
+    rt_schedule_prune(t);
+}
+
+/**
+ * rt_modify_stale - modify stale routes of an announce hook
+ * @t: related routing table
+ * @ah: related announce hook
+ *
+ * Valid routes of @ah not refreshed in the current refresh cycle (see
+ * rt_refresh_begin()) are passed to the rte_modify() hook of the protocol,
+ * which may replace them by modified routes or remove them. This function
+ * just flags the routes, the modification is done in the prune loop, so it
+ * is time-sliced and does not run any filters. Modified routes keep their
+ * refresh stamp, therefore they are pruned as usual when the refresh cycle
+ * ends.
+ */
+struct rt_modify_stale {
+  struct announce_hook *ah;
+  byte prune[FIB_WALK_JOBS];
+};
+
+static void
+rt_modify_stale_net(struct fib_node *fn, void *data, uint job)
+{
+  struct rt_modify_stale *ms = data;
   rte *e;
 
-  FIB_WALK(&t->fib, fn)
-    {
-      n = (net *) fn;
-      for (e = n->routes; e; e = e->next)
-	if ((e->sender == ah) && (e->flags & REF_STALE))
-	  {
-	    e->flags |= REF_DISCARD;
-	    prune = 1;
-	  }
-    }
-  FIB_WALK_END;
+  for (e = ((net *) fn)->routes; e; e = e->next)
+    if ((e->sender == ms->ah) && (e->refresh_gen != ms->ah->refresh_gen) && rte_is_valid(e))
+      {
+	e->flags |= REF_MODIFY;
+	ms->prune[job] = 1;
+      }
+}
 
-  if (prune)
-    rt_schedule_prune(t);
+void
+rt_modify_stale(rtable *t, struct announce_hook *ah)
+{
+  struct rt_modify_stale ms = { .ah = ah };
+  uint i;
+
+  /* Only flags of routes are changed, each net by just one job */
+  fib_walk_parallel(&t->fib, rt_workers, rt_modify_stale_net, &ms);
+
+  for (i = 0; i < FIB_WALK_JOBS; i++)
+    if (ms.prune[i])
+      {
+	rt_schedule_prune(t);
+	return;
+      }
+}
+
+
+/**
+ * rt_memory_usage - account memory used by a routing table
+ * @t: routing table
+ * @u: structure to be filled
+ *
+ * This function fills @u with the amount of memory used by various parts of
+ * routing table @t. Route attributes are shared between tables, they are
+ * accounted per source protocol instead (see rt_source_usage()).
+ */
+void
+rt_memory_usage(rtable *t, struct rt_memory_usage *u)
+{
+  struct announce_hook *a;
+
+  bzero(u, sizeof(*u));
+  u->nets = t->fib.entries;
+  u->fib = fib_memsize(&t->fib);
+
+  WALK_LIST(a, t->hooks)
+    u->routes += a->stats->imp_routes + a->stats->filt_routes;
+
+  /* Routes share one slab, count them as slab objects with their page pointer */
+  u->rtes = (size_t) u->routes * (sizeof(rte) + sizeof(void *));
+
+  if (t->src_index_slab)
+    u->indices += rmemsize(t->src_index_slab) + (sizeof(void *) << t->src_index.order);
+  if (t->he_dep_slab)
+    u->indices += rmemsize(t->he_dep_slab) + (sizeof(void *) << t->he_deps.order);
+
+  if (t->journal_slab)
+    u->journal = rmemsize(t->journal_slab);
+
+  if (t->hostcache)
+    u->hostcache = rmemsize(t->hostcache->slab) + rmemsize(t->hostcache->lp) +
+      fib_memsize(&t->hostcache->addrs) +
+      (sizeof(struct hostentry *) << t->hostcache->hash_order) + sizeof(struct hostcache);
 }
 
 
@@ -1433,11 +2577,44 @@ rt_dump_all(void)
     rt_dump(t);
 }
 
+static void
+rt_schedule(rtable *tab)
+{
+  /* Tables without configuration (e.g. inherited kernel routes) need no maintenance */
+  if (tab->maint_queued || !tab->config)
+    return;
+
+  if (!rt_maint_first)
+    ev_schedule_work(rt_maint_event);
+
+  tab->maint_queued = 1;
+  tab->maint_next = NULL;
+  *rt_maint_last = tab;
+  rt_maint_last = &tab->maint_next;
+}
+
+static void
+rt_unschedule(rtable *tab)
+{
+  rtable **tp;
+
+  if (!tab->maint_queued)
+    return;
+
+  for (tp = &rt_maint_first; *tp != tab; tp = &(*tp)->maint_next)
+    ;
+
+  if (!(*tp = tab->maint_next))
+    rt_maint_last = tp;
+
+  tab->maint_queued = 0;
+}
+
 static inline void
 rt_schedule_prune(rtable *tab)
 {
   rt_mark_for_prune(tab);
-  ev_schedule(tab->rt_event);
+  rt_schedule(tab);
 }
 
 static inline void
@@ -1447,7 +2624,7 @@ rt_schedule_gc(rtable *tab)
     return;
 
   tab->gc_scheduled = 1;
-  ev_schedule(tab->rt_event);
+  rt_schedule(tab);
 }
 
 static inline void
@@ -1457,93 +2634,155 @@ rt_schedule_hcu(rtable *tab)
     return;
 
   tab->hcu_scheduled = 1;
-  ev_schedule(tab->rt_event);
+  rt_schedule(tab);
 }
 
-static inline void
-rt_schedule_nhu(rtable *tab)
+static void
+rt_schedule_nhu(struct hostentry *he)
+{
+  rtable *tab = he->tab;
+
+  if (he->nhu_queued)
+    {
+      /* Restart the walk if the hostentry is just being processed */
+      if (tab->nhu_first == he)
+	tab->nhu_pos = NULL;
+      return;
+    }
+
+  if (!tab->nhu_first)
+    rt_schedule(tab);
+
+  he->nhu_queued = 1;
+  he->nhu_next = NULL;
+  *tab->nhu_last = he;
+  tab->nhu_last = &he->nhu_next;
+}
+
+static void
+rt_unschedule_nhu(struct hostentry *he)
 {
-  if (tab->nhu_state == 0)
-    ev_schedule(tab->rt_event);
+  rtable *tab = he->tab;
+  struct hostentry **hp;
 
-  /* state change 0->1, 2->3 */
-  tab->nhu_state |= 1;
+  if (!he->nhu_queued)
+    return;
+
+  for (hp = &tab->nhu_first; *hp != he; hp = &(*hp)->nhu_next)
+    ;
+
+  if (!(*hp = he->nhu_next))
+    tab->nhu_last = hp;
+
+  if (hp == &tab->nhu_first)
+    tab->nhu_pos = NULL;
+
+  he->nhu_queued = 0;
 }
 
+static int
+rt_net_orphaned(struct fib_node *f, void *data UNUSED)
+{
+  net *n = (net *) f;
+  return !n->routes && !(n->n.flags & NF_JOURNAL);
+}
 
 static void
 rt_prune_nets(rtable *tab)
 {
-  struct fib_iterator fit;
-  int ncnt = 0, ndel = 0;
+  struct fib_node **nodes;
+  uint i, ndel;
 
 #ifdef DEBUGGING
   fib_check(&tab->fib);
 #endif
 
-  FIB_ITERATE_INIT(&fit, &tab->fib);
-again:
-  FIB_ITERATE_START(&tab->fib, &fit, f)
-    {
-      net *n = (net *) f;
-      ncnt++;
-      if (!n->routes)		/* Orphaned FIB entry */
-	{
-	  FIB_ITERATE_PUT(&fit, f);
-	  fib_delete(&tab->fib, f);
-	  ndel++;
-	  goto again;
-	}
-    }
-  FIB_ITERATE_END(f);
-  DBG("Pruned %d of %d networks\n", ndel, ncnt);
+  /* Orphaned FIB entries are looked up in parallel, but deleted here */
+  ndel = fib_collect_parallel(&tab->fib, rt_workers, rt_net_orphaned, NULL, &nodes);
+
+  for (i = 0; i < ndel; i++)
+    fib_delete(&tab->fib, nodes[i]);
+
+  xfree(nodes);
+  DBG("Pruned %u networks\n", ndel);
 
   tab->gc_counter = 0;
   tab->gc_time = now;
   tab->gc_scheduled = 0;
 }
 
-static void
-rt_event(void *ptr)
+/* Returns 1 when stale network entries were pruned */
+static int
+rt_maintain(rtable *tab)
 {
-  rtable *tab = ptr;
-
   if (tab->hcu_scheduled)
     rt_update_hostcache(tab);
 
-  if (tab->nhu_state)
+  if (tab->nhu_first)
     rt_next_hop_update(tab);
 
+  if (tab->journal_first)
+    {
+      int limit = RT_JOURNAL_STEP;
+      if (!rt_journal_drain(tab, &limit))
+	rt_schedule(tab);
+    }
+
   if (tab->prune_state)
     if (!rt_prune_table(tab))
       {
 	/* Table prune unfinished */
-	ev_schedule(tab->rt_event);
-	return;
+	rt_schedule(tab);
+	return 0;
       }
 
   if (tab->gc_scheduled)
     {
       rt_prune_nets(tab);
-      rt_prune_sources(); // FIXME this should be moved to independent event
+      return 1;
+    }
+
+  return 0;
+}
+
+static void
+rt_maint_run(void *data UNUSED)
+{
+  int limit = RT_MAINT_TABLES, gc = 0;
+  rtable *tab;
+
+  /* Tables rescheduled by rt_maintain() are appended, so others are not starved */
+  while ((tab = rt_maint_first) && (limit-- > 0))
+    {
+      if (!(rt_maint_first = tab->maint_next))
+	rt_maint_last = &rt_maint_first;
+      tab->maint_queued = 0;
+
+      gc |= rt_maintain(tab);
     }
+
+  /* Sources are shared by all tables, prune them once after the batch */
+  if (gc)
+    rt_prune_sources();
+
+  if (rt_maint_first)
+    ev_schedule_work(rt_maint_event);
 }
 
 void
 rt_setup(pool *p, rtable *t, char *name, struct rtable_config *cf)
 {
   bzero(t, sizeof(*t));
-  fib_init(&t->fib, p, sizeof(net), 0, rte_init);
+  fib_init(&t->fib, p, sizeof(net), RT_FIB_ORDER, rte_init);
+  if (cf && cf->trie)
+    fib_enable_trie(&t->fib);
   t->name = name;
   t->config = cf;
   init_list(&t->hooks);
-  if (cf)
-    {
-      t->rt_event = ev_new(p);
-      t->rt_event->hook = rt_event;
-      t->rt_event->data = t;
-      t->gc_time = now;
-    }
+  t->journal_last = &t->journal_first;
+  t->nhu_last = &t->nhu_first;
+  t->coalesce = cf && cf->coalesce;
+  t->gc_time = now;
 }
 
 /**
@@ -1560,13 +2799,120 @@ rt_init(void)
   rte_update_pool = lp_new(rt_table_pool, 4080);
   rte_slab = sl_new(rt_table_pool, sizeof(rte));
   init_list(&routing_tables);
+
+  rt_maint_event = ev_new(rt_table_pool);
+  rt_maint_event->hook = rt_maint_run;
 }
 
 
+static inline int
+rte_is_pruned(rte *e)
+{
+  return e->sender->proto->flushing || (e->flags & REF_DISCARD) ||
+    (e->refresh_gen < e->sender->refresh_stale);
+}
+
+/*
+ * Alternative (non-best) routes can be dropped without going through
+ * rte_recalculate() if all hooks of the table are interested just in
+ * optimal route changes, as there is nothing to announce then. Routes
+ * of protocols with their own rte_recalculate hook (e.g. BGP with
+ * deterministic MED) still have to be discarded the regular way, so
+ * the hook may update the state of the remaining routes.
+ */
 static int
-rt_prune_step(rtable *tab, int *limit)
+rt_prune_fast(rtable *tab)
+{
+  struct announce_hook *a;
+
+  WALK_LIST(a, tab->hooks)
+    if (a->proto->accept_ra_types != RA_OPTIMAL)
+      return 0;
+
+  return 1;
+}
+
+/* Unlink and free a pruned alternative route, @k points to its predecessor link */
+static void
+rte_drop(rtable *tab, rte **k)
+{
+  rte *old = *k;
+  net *net = old->net;
+  struct announce_hook *ah = old->sender;
+  struct proto *p = ah->proto;
+  int old_ok = rte_is_ok(old);
+
+  ASSERT(k != &net->routes);
+  *k = old->next;
+
+  if (old->refresh_gen == ah->refresh_gen)
+    ah->refresh_routes--;
+
+  if (old_ok)
+    ah->stats->imp_withdraws_accepted++;
+  else
+    ah->stats->imp_withdraws_ignored++;
+
+  if (rte_is_filtered(old))
+    ah->stats->filt_routes--;
+  else
+    ah->stats->imp_routes--;
+
+  rt_update_deps(tab, net, NULL, old);
+  if (net->n.flags & NF_INDEXED)
+    rt_index_update(tab, net, old->attrs->src, NULL);
+
+  if (old_ok && (p->debug & D_ROUTES))
+    rte_trace(p, old, '>', "removed");
+
+  if (old_ok && p->rte_remove)
+    p->rte_remove(net, old);
+
+  rte_free_quick(old);
+}
+
+static void
+rte_modify(rte *old)
+{
+  struct announce_hook *ah = old->sender;
+  u32 gen = old->refresh_gen;
+  rte *new;
+
+  old->flags &= ~REF_MODIFY;
+
+  /* Refreshed in the meantime */
+  if (gen == ah->refresh_gen)
+    return;
+
+  rte_update_lock();
+  new = ah->proto->rte_modify(old, rte_update_pool);
+  if (new != old)
+    {
+      if (new)
+	{
+	  if (!rta_is_cached(new->attrs))
+	    new->attrs = rta_lookup(new->attrs);
+	  new->net = old->net;
+	  new->flags = old->flags;
+	}
+
+      rte_recalculate(ah, old->net, new, old->attrs->src);
+
+      /* The modified route is still stale */
+      if (new)
+	{
+	  new->refresh_gen = gen;
+	  ah->refresh_routes--;
+	}
+    }
+  rte_update_unlock();
+}
+
+static int
+rt_do_prune_step(rtable *tab, int *limit)
 {
   struct fib_iterator *fit = &tab->prune_fit;
+  int fast;
 
   DBG("Pruning route table %s\n", tab->name);
 #ifdef DEBUGGING
@@ -1582,15 +2928,55 @@ rt_prune_step(rtable *tab, int *limit)
       tab->prune_state = RPS_RUNNING;
     }
 
+  fast = rt_prune_fast(tab);
+
 again:
   FIB_ITERATE_START(&tab->fib, fit, fn)
     {
       net *n = (net *) fn;
       rte *e;
 
+      rte **k;
+
+      /*
+       * Alternative routes go first, so the best route is recalculated
+       * and announced just once, after all pruned routes are gone.
+       */
     rescan:
-      for (e=n->routes; e; e=e->next)
-	if (e->sender->proto->flushing || (e->flags & REF_DISCARD))
+      for (k = n->routes ? &n->routes->next : NULL; k && (e = *k); k = &e->next)
+	if (rte_is_pruned(e))
+	  {
+	    if (*limit <= 0)
+	      {
+		FIB_ITERATE_PUT(fit, fn);
+		return 0;
+	      }
+
+	    if (fast && !e->attrs->src->proto->rte_recalculate)
+	      rte_drop(tab, k);
+	    else
+	      rte_discard(tab, e);
+	    (*limit)--;
+
+	    goto rescan;
+	  }
+
+      if ((e = n->routes) && rte_is_pruned(e))
+	{
+	  if (*limit <= 0)
+	    {
+	      FIB_ITERATE_PUT(fit, fn);
+	      return 0;
+	    }
+
+	  rte_discard(tab, e);
+	  (*limit)--;
+
+	  goto rescan;
+	}
+
+      for (e = n->routes; e; e = e->next)
+	if (e->flags & REF_MODIFY)
 	  {
 	    if (*limit <= 0)
 	      {
@@ -1598,12 +2984,13 @@ again:
 		return 0;
 	      }
 
-	    rte_discard(tab, e);
+	    rte_modify(e);
 	    (*limit)--;
 
 	    goto rescan;
 	  }
-      if (!n->routes)		/* Orphaned FIB entry */
+
+      if (!n->routes && !(n->n.flags & NF_JOURNAL))	/* Orphaned FIB entry */
 	{
 	  FIB_ITERATE_PUT(fit, fn);
 	  fib_delete(&tab->fib, fn);
@@ -1612,6 +2999,10 @@ again:
     }
   FIB_ITERATE_END(fn);
 
+  /* Pending exports may still refer to routes of flushing protocols */
+  if (tab->journal_first && !rt_journal_drain(tab, limit))
+    return 0;
+
 #ifdef DEBUGGING
   fib_check(&tab->fib);
 #endif
@@ -1620,6 +3011,19 @@ again:
   return 1;
 }
 
+static int
+rt_prune_step(rtable *tab, int *limit)
+{
+  int done;
+
+  rte_free_deferred = 1;
+  done = rt_do_prune_step(tab, limit);
+  rte_free_deferred = 0;
+  rte_free_flush();
+
+  return done;
+}
+
 /**
  * rt_prune_table - prune a routing table
  *
@@ -1627,7 +3031,7 @@ again:
  * flushing protocols, discarded routes and also stale network entries, in a
  * similar fashion like rt_prune_loop(). Returns 1 when all such routes are
  * pruned. Contrary to rt_prune_loop(), this function is not a part of the
- * protocol flushing loop, but it is called from rt_event() for just one routing
+ * protocol flushing loop, but it is called from rt_maintain() for just one routing
  * table.
  *
  * Note that rt_prune_table() and rt_prune_loop() share (for each table) the
@@ -1734,6 +3138,9 @@ rt_next_hop_update_net(rtable *tab, net *n)
 	new = rt_next_hop_update_rte(tab, e);
 	*k = new;
 
+	if (n->n.flags & NF_INDEXED)
+	  rt_index_update(tab, n, e->attrs->src, new);
+
 	rte_announce_i(tab, RA_ANY, n, new, e, NULL, NULL);
 	rte_trace_in(D_ROUTES, new->sender->proto, new, "updated");
 
@@ -1754,6 +3161,9 @@ rt_next_hop_update_net(rtable *tab, net *n)
   if (!count)
     return 0;
 
+  /* Replaced routes may be kept by export caches */
+  rt_export_cache_invalidate(tab, n);
+
   /* Find the new best route */
   new_best = NULL;
   for (k = &n->routes; e = *k; k = &e->next)
@@ -1787,38 +3197,42 @@ rt_next_hop_update_net(rtable *tab, net *n)
   return count;
 }
 
+/*
+ * Work done in one rt_next_hop_update() call is bounded both by the number of
+ * updated routes and by the number of visited networks, as a single IGP change
+ * may affect a hostentry with many dependent networks.
+ */
+#define NHU_UPDATE_STEP	32
+#define NHU_SCAN_STEP	4096
+
 static void
 rt_next_hop_update(rtable *tab)
 {
-  struct fib_iterator *fit = &tab->nhu_fit;
-  int max_feed = 32;
-
-  if (tab->nhu_state == 0)
-    return;
-
-  if (tab->nhu_state == 1)
-    {
-      FIB_ITERATE_INIT(fit, &tab->fib);
-      tab->nhu_state = 2;
-    }
+  int max_feed = NHU_UPDATE_STEP;
+  int max_scan = NHU_SCAN_STEP;
+  struct hostentry *he;
+  node *n;
 
-  FIB_ITERATE_START(&tab->fib, fit, fn)
+  while (he = tab->nhu_first)
     {
-      if (max_feed <= 0)
+      /* Restarted walks have the position reset */
+      while (NODE_VALID(n = tab->nhu_pos ?: HEAD(he->deps)))
 	{
-	  FIB_ITERATE_PUT(fit, fn);
-	  ev_schedule(tab->rt_event);
-	  return;
-	}
-      max_feed -= rt_next_hop_update_net(tab, (net *) fn);
-    }
-  FIB_ITERATE_END(fn);
+	  if ((max_feed <= 0) || (max_scan <= 0))
+	    {
+	      tab->nhu_pos = n;
+	      rt_schedule(tab);
+	      return;
+	    }
 
-  /* state change 2->0, 3->1 */
-  tab->nhu_state &= 1;
+	  /* The position is moved when the next entry is removed */
+	  tab->nhu_pos = n->next;
+	  max_feed -= rt_next_hop_update_net(tab, SKIP_BACK(struct hostentry_dep, n, n)->net);
+	  max_scan--;
+	}
 
-  if (tab->nhu_state > 0)
-    ev_schedule(tab->rt_event);
+      rt_unschedule_nhu(he);
+    }
 }
 
 
@@ -1867,17 +3281,49 @@ rt_unlock_table(rtable *r)
   if (!--r->use_count && r->deleted)
     {
       struct config *conf = r->deleted;
+      struct hostentry *he;
       DBG("Deleting routing table %s\n", r->name);
       if (r->hostcache)
 	rt_free_hostcache(r);
+      if (r->journal_first)
+	{
+	  int limit = r->journal_count;	/* No hooks remain */
+	  rt_journal_drain(r, &limit);
+	}
       rem_node(&r->n);
+      if (r->src_index_slab)
+	{
+	  mb_free(r->src_index.data);
+	  rfree(r->src_index_slab);
+	}
+      if (r->journal_slab)
+	rfree(r->journal_slab);
+      if (r->he_dep_slab)
+	{
+	  mb_free(r->he_deps.data);
+	  rfree(r->he_dep_slab);
+	}
+      for (he = r->nhu_first; he; he = he->nhu_next)
+	he->nhu_queued = 0;
+      rt_unschedule(r);
       fib_free(&r->fib);
-      rfree(r->rt_event);
       mb_free(r);
       config_del_obstacle(conf);
     }
 }
 
+static void
+rt_set_threads(uint threads)
+{
+  uint old = rt_workers ? wp_threads(rt_workers) + 1 : 1;
+
+  if (threads == old)
+    return;
+
+  rfree(rt_workers);
+  rt_workers = (threads > 1) ? wp_new(rt_table_pool, threads - 1) : NULL;
+}
+
 /**
  * rt_commit - commit new routing table configuration
  * @new: new configuration
@@ -1913,6 +3359,10 @@ rt_commit(struct config *new, struct config *old)
 		  ot->config = r;
 		  if (o->sorted != r->sorted)
 		    log(L_WARN "Reconfiguration of rtable sorted flag not implemented");
+		  if (o->trie != r->trie)
+		    log(L_WARN "Reconfiguration of rtable trie flag not implemented");
+		  if (o->coalesce != r->coalesce)
+		    log(L_WARN "Reconfiguration of rtable coalesce flag not implemented");
 		}
 	      else
 		{
@@ -1935,6 +3385,8 @@ rt_commit(struct config *new, struct config *old)
 	add_tail(&routing_tables, &t->n);
 	r->table = t;
       }
+
+  rt_set_threads(new->shutdown ? 1 : new->table_threads);
   DBG("\tdone\n");
 }
 
@@ -1951,6 +3403,141 @@ do_feed_baby(struct proto *p, int type, struct announce_hook *h, net *n, rte *e)
   rte_update_unlock();
 }
 
+static uint
+do_feed_best_n(struct proto *p, struct announce_hook *h, net *n)
+{
+  rte *best[p->ra_best_paths];
+  uint i, cnt;
+
+  rte_update_lock();
+  cnt = rt_select_best_n(n, NULL, NULL, best, p->ra_best_paths);
+  for (i = 0; i < cnt; i++)
+    rt_notify_basic(h, n, best[i], p->refeeding ? best[i] : NULL, p->refeeding);
+  rte_update_unlock();
+
+  return cnt;
+}
+
+/*
+ * Feed routes of net @n through announce hook @h, consuming tokens from @tbf.
+ * Returns the number of fed routes, or -1 when the protocol fell down.
+ */
+static int
+rt_feed_net(struct proto *p, struct announce_hook *h, net *n, struct tbf *tbf)
+{
+  rte *e = n->routes;
+  int cnt = 0;
+
+  /* XXXX perhaps we should change feed for RA_ACCEPTED to not use 'new' */
+
+  if ((p->accept_ra_types == RA_OPTIMAL) ||
+      (p->accept_ra_types == RA_ACCEPTED) ||
+      (p->accept_ra_types == RA_MERGED))
+    if (rte_is_valid(e))
+      {
+	if (p->export_state != ES_FEEDING)
+	  return -1;  /* In the meantime, the protocol fell down. */
+
+	do_feed_baby(p, p->accept_ra_types, h, n, e);
+	cnt++;
+
+	if (tbf)
+	  tbf->count--;
+      }
+
+  if ((p->accept_ra_types == RA_ANY) && p->ra_best_paths)
+    {
+      if (p->export_state != ES_FEEDING)
+	return -1;  /* In the meantime, the protocol fell down. */
+
+      uint c = do_feed_best_n(p, h, n);
+      cnt += c;
+
+      if (tbf)
+	tbf->count -= MIN(tbf->count, c);
+    }
+  else if (p->accept_ra_types == RA_ANY)
+    for(e = n->routes; e; e = e->next)
+      {
+	if (p->export_state != ES_FEEDING)
+	  return -1;  /* In the meantime, the protocol fell down. */
+
+	if (!rte_is_valid(e))
+	  continue;
+
+	do_feed_baby(p, RA_ANY, h, n, e);
+	cnt++;
+
+	if (tbf && tbf->count)
+	  tbf->count--;
+      }
+
+  return cnt;
+}
+
+static int
+rt_feed_list_net(struct fib_node *fn, void *P)
+{
+  struct proto *p = P;
+
+  if (prefix_set_match(p->feed_set, fn->prefix, fn->pxlen))
+    {
+      struct feed_net *fx = &BUFFER_PUSH(p->feed_nets);
+      fx->prefix = fn->prefix;
+      fx->pxlen = fn->pxlen;
+    }
+
+  return 0;
+}
+
+static void
+rt_feed_list_range(ip_addr px, int plen, void *P)
+{
+  struct proto *p = P;
+  struct fib *fib = &p->feed_ahook->table->fib;
+  struct fib_node *fn = fib_find(fib, &px, plen);
+
+  if (fn)
+    rt_feed_list_net(fn, p);
+
+  fib_walk_below(fib, px, plen, rt_feed_list_net, p);
+}
+
+/*
+ * Partial feeding of a table indexed by a trie lists matching networks in
+ * advance, so only networks covered by the prefix set are visited. Networks are
+ * listed by prefix, as they may be removed from the table during feeding.
+ */
+static void
+rt_feed_list(struct proto *p)
+{
+  BUFFER_INIT(p->feed_nets, p->pool, 64);
+  p->feed_pos = 0;
+  trie_walk_ranges(p->feed_set->trie, rt_feed_list_range, p);
+}
+
+static void
+rt_feed_unlist(struct proto *p)
+{
+  mb_free(p->feed_nets.data);
+  p->feed_nets.data = NULL;
+}
+
+static void
+rt_feed_drop_set(struct proto *p)
+{
+  if (p->feed_nets.data)
+    rt_feed_unlist(p);
+
+  if (p->feed_set)
+    prefix_set_unlock(p->feed_set);
+  p->feed_set = NULL;
+}
+
+/* Skipping a network not matching the set costs a fraction of feeding a route */
+#define RT_FEED_STEP		256
+#define RT_FEED_SKIP_COST	16
+
 /**
  * rt_feed_baby - advertise routes to a new protocol
  * @p: protocol to be fed
@@ -1958,19 +3545,33 @@ do_feed_baby(struct proto *p, int type, struct announce_hook *h, net *n, rte *e)
  * This function performs one pass of advertisement of routes to a newly
  * initialized protocol. It's called by the protocol code as long as it
  * has something to do. (We avoid transferring all the routes in single
- * pass in order not to monopolize CPU time.)
+ * pass in order not to monopolize CPU time.) If the export rate of the
+ * protocol is limited, each fed route consumes a token from the bucket
+ * of its announce hook.
+ *
+ * When &feed_set of the protocol is set, only routes for networks matching
+ * the set are fed (see proto_request_partial_feeding()). In tables indexed by
+ * a trie, the matching networks are found without walking the whole table.
+ *
+ * Returns 1 when the feeding is done, 0 when it should continue as soon
+ * as possible and -1 when it should continue after new tokens arrive.
  */
 int
 rt_feed_baby(struct proto *p)
 {
   struct announce_hook *h;
   struct fib_iterator *fit;
-  int max_feed = 256;
+  struct tbf *tbf;
+  int max_feed = RT_FEED_STEP * RT_FEED_SKIP_COST;
+  int cnt;
 
   if (!p->feed_ahook)			/* Need to initialize first */
     {
       if (!p->ahooks)
-	return 1;
+	{
+	  rt_feed_drop_set(p);
+	  return 1;
+	}
       DBG("Announcing routes to new protocol %s\n", p->name);
       p->feed_ahook = p->ahooks;
       fit = p->feed_iterator = mb_alloc(p->pool, sizeof(struct fib_iterator));
@@ -1980,55 +3581,73 @@ rt_feed_baby(struct proto *p)
 
 again:
   h = p->feed_ahook;
+  tbf = h->feed_tbf.rate ? &h->feed_tbf : NULL;
+  if (tbf)
+    tbf_update(tbf);
+
+  if (p->feed_nets.data)
+    {
+      while (p->feed_pos < p->feed_nets.used)
+	{
+	  if (max_feed <= 0)
+	    return 0;
+
+	  if (tbf && !tbf->count)
+	    return -1;
+
+	  struct feed_net *fx = &p->feed_nets.data[p->feed_pos++];
+	  net *n = net_find(h->table, fx->prefix, fx->pxlen);
+
+	  if (n && ((cnt = rt_feed_net(p, h, n, tbf)) < 0))
+	    return 1;
+
+	  max_feed -= n ? cnt * RT_FEED_SKIP_COST : 1;
+	}
+
+      rt_feed_unlist(p);
+      goto hook_done;
+    }
+
   FIB_ITERATE_START(&h->table->fib, fit, fn)
     {
       net *n = (net *) fn;
-      rte *e = n->routes;
       if (max_feed <= 0)
 	{
 	  FIB_ITERATE_PUT(fit, fn);
 	  return 0;
 	}
 
-      /* XXXX perhaps we should change feed for RA_ACCEPTED to not use 'new' */
-
-      if ((p->accept_ra_types == RA_OPTIMAL) ||
-	  (p->accept_ra_types == RA_ACCEPTED) ||
-	  (p->accept_ra_types == RA_MERGED))
-	if (rte_is_valid(e))
-	  {
-	    if (p->export_state != ES_FEEDING)
-	      return 1;  /* In the meantime, the protocol fell down. */
-
-	    do_feed_baby(p, p->accept_ra_types, h, n, e);
-	    max_feed--;
-	  }
-
-      if (p->accept_ra_types == RA_ANY)
-	for(e = n->routes; e; e = e->next)
-	  {
-	    if (p->export_state != ES_FEEDING)
-	      return 1;  /* In the meantime, the protocol fell down. */
-
-	    if (!rte_is_valid(e))
-	      continue;
+      if (tbf && !tbf->count)
+	{
+	  FIB_ITERATE_PUT(fit, fn);
+	  return -1;
+	}
 
-	    do_feed_baby(p, RA_ANY, h, n, e);
-	    max_feed--;
-	  }
+      if (p->feed_set && !prefix_set_match(p->feed_set, fn->prefix, fn->pxlen))
+	max_feed--;
+      else if ((cnt = rt_feed_net(p, h, n, tbf)) < 0)
+	return 1;
+      else
+	max_feed -= cnt * RT_FEED_SKIP_COST;
     }
   FIB_ITERATE_END(fn);
+
+hook_done:
   p->feed_ahook = h->next;
   if (!p->feed_ahook)
     {
       mb_free(p->feed_iterator);
       p->feed_iterator = NULL;
+      rt_feed_drop_set(p);
       return 1;
     }
 
 next_hook:
   h = p->feed_ahook;
-  FIB_ITERATE_INIT(fit, &h->table->fib);
+  if (p->feed_set && h->table->fib.trie_slab)
+    rt_feed_list(p);
+  else
+    FIB_ITERATE_INIT(fit, &h->table->fib);
   goto again;
 }
 
@@ -2046,9 +3665,12 @@ rt_feed_baby_abort(struct proto *p)
   if (p->feed_ahook)
     {
       /* Unlink the iterator and exit */
-      fit_get(&p->feed_ahook->table->fib, p->feed_iterator);
+      if (!p->feed_nets.data)
+	fit_get(&p->feed_ahook->table->fib, p->feed_iterator);
       p->feed_ahook = NULL;
     }
+
+  rt_feed_drop_set(p);
 }
 
 
@@ -2091,6 +3713,55 @@ hc_remove(struct hostcache *hc, struct hostentry *he)
 #define HC_LO_STEP 2
 #define HC_LO_ORDER 10
 
+#define HC_PENDING_MIN	16		/* Changed prefixes always updated incrementally */
+#define HC_PENDING_RATIO 8		/* Full update above 1/8 of hostentries changed prefixes */
+
+#define HE_NO_RANGE	0xff		/* Hostentry has no range in the trie */
+
+/*
+ * Hostentries are also indexed by their addresses in a FIB with trie, so
+ * hostentries covered by a changed prefix are found by fib_walk_below(). A node
+ * keeps all hostentries with its address, one for each dependent table.
+ */
+struct hc_addr {
+  struct fib_node n;
+  struct hostentry *hostentries;	/* Chained by addr_next */
+};
+
+struct hc_update {
+  ip_addr prefix;
+  int pxlen;
+};
+
+static void
+hc_addr_init(struct fib_node *n)
+{
+  ((struct hc_addr *) n)->hostentries = NULL;
+}
+
+static void
+hc_addr_insert(struct hostcache *hc, struct hostentry *he)
+{
+  struct hc_addr *a = fib_get(&hc->addrs, &he->addr, MAX_PREFIX_LENGTH);
+
+  he->addr_next = a->hostentries;
+  a->hostentries = he;
+}
+
+static void
+hc_addr_remove(struct hostcache *hc, struct hostentry *he)
+{
+  struct hc_addr *a = fib_find(&hc->addrs, &he->addr, MAX_PREFIX_LENGTH);
+  struct hostentry **hp;
+
+  for (hp = &a->hostentries; *hp != he; hp = &(*hp)->addr_next)
+    ;
+  *hp = he->addr_next;
+
+  if (!a->hostentries)
+    fib_delete(&hc->addrs, a);
+}
+
 static void
 hc_alloc_table(struct hostcache *hc, unsigned order)
 {
@@ -2132,9 +3803,13 @@ hc_new_hostentry(struct hostcache *hc, ip_addr a, ip_addr ll, rtable *dep, unsig
   he->hash_key = k;
   he->uc = 0;
   he->src = NULL;
+  he->nhu_queued = 0;
+  he->pxlen = HE_NO_RANGE;
+  init_list(&he->deps);
 
   add_tail(&hc->hostentries, &he->ln);
   hc_insert(hc, he);
+  hc_addr_insert(hc, he);
 
   hc->hash_items++;
   if (hc->hash_items > hc->hash_max)
@@ -2147,9 +3822,11 @@ static void
 hc_delete_hostentry(struct hostcache *hc, struct hostentry *he)
 {
   rta_free(he->src);
+  rt_unschedule_nhu(he);
 
   rem_node(&he->ln);
   hc_remove(hc, he);
+  hc_addr_remove(hc, he);
   sl_free(hc->slab, he);
 
   hc->hash_items--;
@@ -2166,6 +3843,8 @@ rt_init_hostcache(rtable *tab)
   hc->hash_items = 0;
   hc_alloc_table(hc, HC_DEF_ORDER);
   hc->slab = sl_new(rt_table_pool, sizeof(struct hostentry));
+  fib_init(&hc->addrs, rt_table_pool, sizeof(struct hc_addr), RT_FIB_ORDER, hc_addr_init);
+  fib_enable_trie(&hc->addrs);
 
   hc->lp = lp_new(rt_table_pool, 1008);
   hc->trie = f_new_trie(hc->lp, sizeof(struct f_trie_node));
@@ -2183,6 +3862,7 @@ rt_free_hostcache(rtable *tab)
     {
       struct hostentry *he = SKIP_BACK(struct hostentry, ln, n);
       rta_free(he->src);
+      rt_unschedule_nhu(he);
 
       if (he->uc)
 	log(L_ERR "Hostcache is not empty in table %s", tab->name);
@@ -2190,20 +3870,49 @@ rt_free_hostcache(rtable *tab)
 
   rfree(hc->slab);
   rfree(hc->lp);
+  fib_free(&hc->addrs);
+  mb_free(hc->pending);
   mb_free(hc->hash_table);
   mb_free(hc);
 }
 
+/*
+ * The trie contains for each hostentry a range of prefixes which may change
+ * its resolution, i.e. prefixes covering its address not shorter than the
+ * prefix it is resolved by. Matching changed prefixes are queued, so just the
+ * hostentries covered by them are updated. When there are too many of them,
+ * all hostentries are updated. The trie is extended when a hostentry changes
+ * its range, ranges which are no longer used are removed when the trie is
+ * rebuilt, after enough of them is collected.
+ */
 static void
 rt_notify_hostcache(rtable *tab, net *net)
 {
   struct hostcache *hc = tab->hostcache;
 
-  if (tab->hcu_scheduled)
+  if (hc->update_full)
     return;
 
-  if (trie_match_prefix(hc->trie, net->n.prefix, net->n.pxlen))
-    rt_schedule_hcu(tab);
+  if (!trie_match_prefix(hc->trie, net->n.prefix, net->n.pxlen))
+    return;
+
+  if (hc->pending_count >= hc->hash_items / HC_PENDING_RATIO + HC_PENDING_MIN)
+    {
+      hc->update_full = 1;
+      rt_schedule_hcu(tab);
+      return;
+    }
+
+  if (hc->pending_count == hc->pending_size)
+    {
+      hc->pending_size = hc->pending_size ? 2 * hc->pending_size : HC_PENDING_MIN;
+      hc->pending = hc->pending ?
+	mb_realloc(hc->pending, hc->pending_size * sizeof(struct hc_update)) :
+	mb_alloc(rt_table_pool, hc->pending_size * sizeof(struct hc_update));
+    }
+
+  hc->pending[hc->pending_count++] = (struct hc_update) { net->n.prefix, net->n.pxlen };
+  rt_schedule_hcu(tab);
 }
 
 static int
@@ -2300,15 +4009,23 @@ rt_update_hostentry(rtable *tab, struct hostentry *he)
     }
 
  done:
-  /* Add a prefix range to the trie */
-  trie_add_prefix(tab->hostcache->trie, he->addr, MAX_PREFIX_LENGTH, pxlen, MAX_PREFIX_LENGTH);
+  /* Add a prefix range to the trie, the old one is left there */
+  if (he->pxlen != pxlen)
+    {
+      if (he->pxlen != HE_NO_RANGE)
+	tab->hostcache->stale++;
+
+      trie_add_prefix(tab->hostcache->trie, he->addr, MAX_PREFIX_LENGTH, pxlen, MAX_PREFIX_LENGTH);
+      he->pxlen = pxlen;
+    }
 
   rta_free(old_src);
   return old_src != he->src;
 }
 
+/* Rebuild the trie from ranges of hostentries, unused ones are deleted */
 static void
-rt_update_hostcache(rtable *tab)
+rt_rebuild_hostcache(rtable *tab, int update)
 {
   struct hostcache *hc = tab->hostcache;
   struct hostentry *he;
@@ -2317,6 +4034,7 @@ rt_update_hostcache(rtable *tab)
   /* Reset the trie */
   lp_flush(hc->lp);
   hc->trie = f_new_trie(hc->lp, sizeof(struct f_trie_node));
+  hc->stale = 0;
 
   WALK_LIST_DELSAFE(n, x, hc->hostentries)
     {
@@ -2327,10 +4045,80 @@ rt_update_hostcache(rtable *tab)
 	  continue;
 	}
 
+      if (!update)
+	{
+	  trie_add_prefix(hc->trie, he->addr, MAX_PREFIX_LENGTH, he->pxlen, MAX_PREFIX_LENGTH);
+	  continue;
+	}
+
+      he->pxlen = HE_NO_RANGE;
       if (rt_update_hostentry(tab, he))
-	rt_schedule_nhu(he->tab);
+	rt_schedule_nhu(he);
+    }
+}
+
+struct hc_walk {
+  rtable *tab;
+  int pxlen;				/* Length of the changed prefix */
+};
+
+static int
+rt_update_hostcache_addr(struct fib_node *fn, void *data)
+{
+  struct hc_walk *w = data;
+  struct hostentry *he;
+
+  for (he = ((struct hc_addr *) fn)->hostentries; he; he = he->addr_next)
+    {
+      /* Hostentries resolved by a longer prefix are not affected */
+      if (he->pxlen > w->pxlen)
+	continue;
+
+      /* Deleted during the next rebuild of the trie */
+      if (!he->uc)
+	{
+	  w->tab->hostcache->stale++;
+	  continue;
+	}
+
+      if (rt_update_hostentry(w->tab, he))
+	rt_schedule_nhu(he);
+    }
+
+  return 0;
+}
+
+static void
+rt_update_hostcache(rtable *tab)
+{
+  struct hostcache *hc = tab->hostcache;
+  uint i;
+
+  if (hc->update_full)
+    rt_rebuild_hostcache(tab, 1);
+  else
+    {
+      for (i = 0; i < hc->pending_count; i++)
+	{
+	  struct hc_update *u = &hc->pending[i];
+	  struct hc_walk w = { tab, u->pxlen };
+
+	  if (u->pxlen == MAX_PREFIX_LENGTH)
+	    {
+	      struct fib_node *fn = fib_find(&hc->addrs, &u->prefix, u->pxlen);
+	      if (fn)
+		rt_update_hostcache_addr(fn, &w);
+	    }
+	  else
+	    fib_walk_below(&hc->addrs, u->prefix, u->pxlen, rt_update_hostcache_addr, &w);
+	}
+
+      if (hc->stale > hc->hash_items / 4)
+	rt_rebuild_hostcache(tab, 0);
     }
 
+  hc->pending_count = 0;
+  hc->update_full = 0;
   tab->hcu_scheduled = 0;
 }
 
@@ -2381,6 +4169,148 @@ rt_format_via(rte *e, byte *via)
     }
 }
 
+/*
+ * JSON output puts one route on a single line, so it can be parsed line by line
+ * without knowledge of the human-readable format. A line is built in a buffer,
+ * the helpers return NULL when it overflows.
+ */
+
+static byte *
+rt_json_printf(byte *pos, byte *end, char *fmt, ...)
+{
+  va_list args;
+  int n;
+
+  if (!pos)
+    return NULL;
+
+  va_start(args, fmt);
+  n = bvsnprintf(pos, end - pos, fmt, args);
+  va_end(args);
+
+  return (n < 0) ? NULL : pos + n;
+}
+
+static byte *
+rt_json_str(byte *pos, byte *end, const char *s)
+{
+  if (!pos || (pos >= end))
+    return NULL;
+
+  *pos++ = '"';
+  for (; *s; s++)
+    {
+      if (end - pos < 8)
+	return NULL;
+
+      if ((*s == '"') || (*s == '\\'))
+	{ *pos++ = '\\'; *pos++ = *s; }
+      else if (*s == '\t')
+	{ *pos++ = '\\'; *pos++ = 't'; }
+      else if ((byte) *s < 0x20)
+	pos += bsprintf(pos, "\\u%04x", (byte) *s);
+      else
+	*pos++ = *s;
+    }
+
+  if (end - pos < 2)
+    return NULL;
+
+  *pos++ = '"';
+  *pos = 0;
+  return pos;
+}
+
+/* Attribute from ea_format() as JSON member, the name is separated by ': ' */
+static byte *
+rt_json_attr(byte *pos, byte *end, eattr *ea, int first)
+{
+  byte buf[CLI_MSG_SIZE];
+  byte *val;
+
+  ea_format(ea, buf, sizeof(buf));
+  if (val = strstr(buf, ": "))
+    {
+      *val = 0;
+      val += 2;
+    }
+  else
+    val = "";
+
+  pos = rt_json_printf(pos, end, first ? "" : ",");
+  pos = rt_json_str(pos, end, buf);
+  pos = rt_json_printf(pos, end, ":");
+  return rt_json_str(pos, end, val);
+}
+
+static void
+rt_show_rte_json(struct cli *c, rte *e, struct rt_show_data *d, ea_list *tmpa, byte *info)
+{
+  static char *dest_names[] = { "router", "device", "blackhole", "unreachable", "prohibit", "multipath" };
+  byte buf[CLI_LONG_LINE_SIZE - 16];
+  byte *pos = buf, *end = buf + sizeof(buf);
+  rta *a = e->attrs;
+  net *n = e->net;
+  struct mpnh *nh;
+  int i;
+
+  while (*info == ' ')
+    info++;
+
+  pos = rt_json_printf(pos, end, "{\"net\":\"%N\",\"proto\":", n->n.prefix, n->n.pxlen);
+  pos = rt_json_str(pos, end, a->src->proto->name);
+  pos = rt_json_printf(pos, end, ",\"primary\":%s", (n->routes == e) ? "true" : "false");
+  if ((n->routes == e) && (n->n.flags & KRF_SYNC_ERROR))
+    pos = rt_json_printf(pos, end, ",\"sync_error\":true");
+  pos = rt_json_printf(pos, end, ",\"dest\":\"%s\"",
+		       (a->dest < ARRAY_SIZE(dest_names)) ? dest_names[a->dest] : "unknown");
+  if (a->dest == RTD_ROUTER)
+    pos = rt_json_printf(pos, end, ",\"gw\":\"%I\"", a->gw);
+  if (a->iface)
+    {
+      pos = rt_json_printf(pos, end, ",\"iface\":");
+      pos = rt_json_str(pos, end, a->iface->name);
+    }
+  if (ipa_nonzero(a->from) && !ipa_equal(a->from, a->gw))
+    pos = rt_json_printf(pos, end, ",\"from\":\"%I\"", a->from);
+  pos = rt_json_printf(pos, end, ",\"pref\":%d,\"age\":%d,\"info\":", e->pref, (int) (now - e->lastmod));
+  pos = rt_json_str(pos, end, info);
+
+  if (a->nexthops)
+    {
+      pos = rt_json_printf(pos, end, ",\"nexthops\":[");
+      for (nh = a->nexthops; nh; nh = nh->next)
+	{
+	  pos = rt_json_printf(pos, end, "%s{\"gw\":\"%I\",\"iface\":", (nh == a->nexthops) ? "" : ",", nh->gw);
+	  pos = rt_json_str(pos, end, nh->iface->name);
+	  pos = rt_json_printf(pos, end, ",\"weight\":%d}", nh->weight + 1);
+	}
+      pos = rt_json_printf(pos, end, "]");
+    }
+
+  if (d->verbose)
+    {
+      ea_list *eal = tmpa ? tmpa : a->eattrs;
+      int first = 1;
+
+      pos = rt_json_printf(pos, end, ",\"attrs\":{");
+      for (; eal; eal = eal->next)
+	for (i = 0; i < eal->count; i++, first = 0)
+	  pos = rt_json_attr(pos, end, &eal->attrs[i], first);
+      pos = rt_json_printf(pos, end, "}");
+    }
+
+  pos = rt_json_printf(pos, end, "}");
+
+  if (!pos)
+    {
+      cli_printf(c, -8000, "<line overflow>");
+      return;
+    }
+
+  cli_write_line(c, -1025, buf, pos - buf);
+}
+
 static void
 rt_show_rte(struct cli *c, byte *ia, rte *e, struct rt_show_data *d, ea_list *tmpa)
 {
@@ -2413,6 +4343,11 @@ rt_show_rte(struct cli *c, byte *ia, rte *e, struct rt_show_data *d, ea_list *tm
     get_route_info(e, info, tmpa);
   else
     bsprintf(info, " (%d)", e->pref);
+  if (d->json)
+    {
+      rt_show_rte_json(c, e, d, tmpa, info);
+      return;
+    }
   cli_printf(c, -1007, "%-18s %s [%s %s%s]%s%s", ia, via, a->src->proto->name,
 	     tm, from, primary ? (sync_error ? " !" : " *") : "", info);
   for (nh = a->nexthops; nh; nh = nh->next)
@@ -2421,26 +4356,27 @@ rt_show_rte(struct cli *c, byte *ia, rte *e, struct rt_show_data *d, ea_list *tm
     rta_show(c, a, tmpa);
 }
 
-static void
+static int
 rt_show_net(struct cli *c, net *n, struct rt_show_data *d)
 {
   rte *e, *ee;
-  byte ia[STD_ADDRESS_P_LENGTH+8];
+  byte ia[STD_PREFIX_P_LENGTH+1];
   struct ea_list *tmpa;
   struct announce_hook *a = NULL;
   int first = 1;
   int pass = 0;
+  int work = 0;
 
-  bsprintf(ia, "%I/%d", n->n.prefix, n->n.pxlen);
+  ipa_ntop_px(n->n.prefix, n->n.pxlen, ia);
 
   if (d->export_mode)
     {
       if (! d->export_protocol->rt_notify)
-	return;
+	return 0;
 
       a = proto_find_announce_hook(d->export_protocol, d->table);
       if (!a)
-	return;
+	return 0;
     }
 
   for (e = n->routes; e; e = e->next)
@@ -2455,6 +4391,7 @@ rt_show_net(struct cli *c, net *n, struct rt_show_data *d)
       if (pass)
 	continue;
 
+      work++;
       ee = e;
       rte_update_lock();		/* We use the update buffer for filtering */
       tmpa = make_tmp_attrs(e, rte_update_pool);
@@ -2520,16 +4457,27 @@ rt_show_net(struct cli *c, net *n, struct rt_show_data *d)
       if (d->primary_only)
 	break;
     }
+
+  return work;
 }
 
+/*
+ * Work done in one rt_show_cont() call is bounded by the number of processed
+ * routes, so networks with many routes do not stall the main loop. Networks
+ * skipped by the prefix range check are much cheaper, so they are charged
+ * just a fraction of the cost.
+ */
+#define RT_SHOW_STEP	256
+#define RT_SHOW_SKIP_COST	16
+
 static void
 rt_show_cont(struct cli *c)
 {
   struct rt_show_data *d = c->rover;
 #ifdef DEBUGGING
-  unsigned max = 4;
+  int max = 4 * RT_SHOW_SKIP_COST;
 #else
-  unsigned max = 64;
+  int max = RT_SHOW_STEP * RT_SHOW_SKIP_COST;
 #endif
   struct fib *fib = &d->table->fib;
   struct fib_iterator *it = &d->fit;
@@ -2547,12 +4495,28 @@ rt_show_cont(struct cli *c)
 	  cli_printf(c, 8005, "Protocol is down");
 	  goto done;
 	}
-      if (!max--)
+      if (max <= 0)
 	{
 	  FIB_ITERATE_PUT(it, f);
 	  return;
 	}
-      rt_show_net(c, n, d);
+      if (d->show_in && !net_in_net(f->prefix, f->pxlen, d->prefix, d->pxlen))
+	max--;
+      else
+	{
+	  int shown = d->show_counter;
+
+	  /* Charge both the network and the routes processed for it */
+	  max -= RT_SHOW_SKIP_COST * (1 + rt_show_net(c, n, d));
+
+	  if (d->limit && (d->show_counter > shown) && (++d->net_shown >= d->limit))
+	    {
+	      if (d->stats)
+		cli_printf(c, -14, "%d of %d routes for %d networks", d->show_counter, d->rt_counter, d->net_counter);
+	      cli_printf(c, 26, "Cursor %u", f->uid);
+	      goto done;
+	    }
+	}
     }
   FIB_ITERATE_END(f);
   if (d->stats)
@@ -2586,9 +4550,12 @@ rt_show(struct rt_show_data *d)
   if (d->filtered && (d->export_mode || d->primary_only))
     cli_msg(0, "");
 
-  if (d->pxlen == 256)
+  if ((d->pxlen == 256) || d->show_in)
     {
-      FIB_ITERATE_INIT(&d->fit, &d->table->fib);
+      if (d->use_cursor)
+	FIB_ITERATE_INIT_AFTER(&d->fit, &d->table->fib, d->cursor);
+      else
+	FIB_ITERATE_INIT(&d->fit, &d->table->fib);
       this_cli->cont = rt_show_cont;
       this_cli->cleanup = rt_show_cleanup;
       this_cli->rover = d;
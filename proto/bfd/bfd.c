@@ -26,9 +26,14 @@
  * BFD sessions are represented by structure &bfd_session that contains a state
  * related to the session and two timers (TX timer for periodic packets and hold
  * timer for session timeout). These sessions are allocated from @session_slab
- * and are accessible by two hash tables, @session_hash_id (by session ID) and
- * @session_hash_ip (by IP addresses of neighbors). Slab and both hashes are in
- * the main protocol structure &bfd_proto. The protocol logic related to BFD
+ * in the main protocol structure &bfd_proto and distributed among shards
+ * (structure &bfd_shard), each with its own BFD thread, interfaces, sockets and
+ * timers. The shard of a session is given by its session ID modulo the number
+ * of shards. A shard contains two hash tables of its sessions, @session_hash_id
+ * (by session ID) and @session_hash_ip (by IP addresses of neighbors). State
+ * changes of sessions from all shards are collected in @notify_list and passed
+ * to the main thread by bfd_notify_hook(). Periodic control packets are queued
+ * in BFD interfaces and sent in batches by bfd_tx_flush(). The protocol logic related to BFD
  * sessions is implemented in internal functions bfd_session_*(), which are
  * expected to be called from the context of BFD thread, and external functions
  * bfd_add_session(), bfd_remove_session() and bfd_reconfigure_session(), which
@@ -37,12 +42,12 @@
  *
  * Each BFD session has an associated BFD interface, represented by structure
  * &bfd_iface. A BFD interface contains a socket used for TX (the one for RX is
- * shared in &bfd_proto), an interface configuration and reference counter.
+ * shared in &bfd_shard), an interface configuration and reference counter.
  * Compared to interface structures of other protocols, these structures are not
  * created and removed based on interface notification events, but according to
  * the needs of BFD sessions. When a new session is created, it requests a
  * proper BFD interface by function bfd_get_iface(), which either finds an
- * existing one in &iface_list (from &bfd_proto) or allocates a new one. When a
+ * existing one in &iface_list (from &bfd_shard) or allocates a new one. When a
  * session is removed, an associated iface is discharged by bfd_free_iface().
  *
  * BFD requests are the external API for the other protocols. When a protocol
@@ -83,7 +88,7 @@
  * BFD thread to the main thread. This is done in an asynchronous way, sesions
  * with pending notifications are linked (in the BFD thread) to @notify_list in
  * &bfd_proto, and then bfd_notify_hook() in the main thread is activated using
- * bfd_notify_kick() and a pipe. The hook then processes scheduled sessions and
+ * bfd_notify_kick() and ev_send_main(). The hook then processes scheduled sessions and
  * calls hooks from associated BFD requests. This @notify_list (and state fields
  * in structure &bfd_session) is protected by a spinlock in &bfd_proto and
  * functions bfd_lock_sessions() / bfd_unlock_sessions().
@@ -108,11 +113,18 @@
 #define HASH_ID_NEXT(n)		n->next_id
 #define HASH_ID_EQ(a,b)		a == b
 #define HASH_ID_FN(k)		k
+#define HASH_ID_REHASH		bfd_id_rehash
+#define HASH_ID_PARAMS		/8, *2, 2, 2, 8, 20
 
 #define HASH_IP_KEY(n)		n->addr
 #define HASH_IP_NEXT(n)		n->next_ip
 #define HASH_IP_EQ(a,b)		ipa_equal(a,b)
 #define HASH_IP_FN(k)		ipa_hash32(k)
+#define HASH_IP_REHASH		bfd_ip_rehash
+#define HASH_IP_PARAMS		/8, *2, 2, 2, 8, 20
+
+HASH_DEFINE_REHASH_FN(HASH_ID, struct bfd_session)
+HASH_DEFINE_REHASH_FN(HASH_IP, struct bfd_session)
 
 static list bfd_proto_list;
 static list bfd_wait_list;
@@ -120,7 +132,8 @@ static list bfd_wait_list;
 const char *bfd_state_names[] = { "AdminDown", "Down", "Init", "Up" };
 
 static void bfd_session_set_min_tx(struct bfd_session *s, u32 val);
-static struct bfd_iface *bfd_get_iface(struct bfd_proto *p, ip_addr local, struct iface *iface);
+static void bfd_session_control_echo(struct bfd_session *s);
+static struct bfd_iface *bfd_get_iface(struct bfd_shard *sh, ip_addr local, struct iface *iface);
 static void bfd_free_iface(struct bfd_iface *ifa);
 static inline void bfd_notify_kick(struct bfd_proto *p);
 
@@ -145,6 +158,7 @@ bfd_session_update_state(struct bfd_session *s, uint state, uint diag)
   bfd_lock_sessions(p);
   s->loc_state = state;
   s->loc_diag = diag;
+  s->rx_lag_max = s->tx_lag_max = 0;
 
   notify = !NODE_VALID(&s->n);
   if (notify)
@@ -157,6 +171,8 @@ bfd_session_update_state(struct bfd_session *s, uint state, uint diag)
   if (old_state == BFD_STATE_UP)
     bfd_session_set_min_tx(s, s->ifa->cf->idle_tx_int);
 
+  bfd_session_control_echo(s);
+
   if (notify)
     bfd_notify_kick(p);
 }
@@ -180,19 +196,50 @@ bfd_session_update_tx_interval(struct bfd_session *s)
 }
 
 static void
-bfd_session_update_detection_time(struct bfd_session *s, int kick)
+bfd_session_update_detection_time(struct bfd_session *s)
 {
   btime timeout = (btime) MAX(s->req_min_rx_int, s->rem_min_tx_int) * s->rem_detect_mult;
 
-  if (kick)
-    s->last_rx = current_time();
-
   if (!s->last_rx)
     return;
 
   tm2_set(s->hold_timer, s->last_rx + timeout);
 }
 
+/*
+ * The echo function (RFC 5880 6.4) is active for single-hop sessions in the Up
+ * state, when it is enabled by the interface configuration and the neighbor
+ * announces nonzero Required Min Echo RX Interval. Echo packets are never sent
+ * faster than that, so they are not jittered.
+ */
+static void
+bfd_session_control_echo(struct bfd_session *s)
+{
+  struct bfd_iface *ifa = s->ifa;
+  u32 echo_int = 0;
+
+  if (ifa->esk && ifa->cf->echo_int && s->rem_min_echo_rx_int &&
+      ipa_nonzero(s->echo_addr) && (s->loc_state == BFD_STATE_UP))
+    echo_int = MAX(ifa->cf->echo_int, s->rem_min_echo_rx_int);
+
+  if (echo_int == s->echo_int)
+    return;
+
+  if (!echo_int)
+  {
+    tm2_stop(s->echo_tx_timer);
+    tm2_stop(s->echo_hold_timer);
+    s->echo_int = 0;
+    return;
+  }
+
+  /* Detection time starts when the echo function is activated or changed */
+  s->echo_int = echo_int;
+  s->echo_tx_timer->recurrent = echo_int;
+  tm2_start(s->echo_tx_timer, 0);
+  tm2_start(s->echo_hold_timer, (btime) echo_int * s->detect_mult);
+}
+
 static void
 bfd_session_control_tx_timer(struct bfd_session *s, int reset)
 {
@@ -260,7 +307,7 @@ bfd_session_terminate_poll(struct bfd_session *s)
 }
 
 void
-bfd_session_process_ctl(struct bfd_session *s, u8 flags, u32 old_tx_int, u32 old_rx_int)
+bfd_session_process_ctl(struct bfd_session *s, u8 flags, u32 old_tx_int, u32 old_rx_int, btime rx_time)
 {
   if (s->poll_active && (flags & BFD_FLAG_FINAL))
     bfd_session_terminate_poll(s);
@@ -268,7 +315,9 @@ bfd_session_process_ctl(struct bfd_session *s, u8 flags, u32 old_tx_int, u32 old
   if ((s->des_min_tx_int != old_tx_int) || (s->rem_min_rx_int != old_rx_int))
     bfd_session_update_tx_interval(s);
 
-  bfd_session_update_detection_time(s, 1);
+  /* Detection time is measured from the arrival of the packet, see sk_rcv_time() */
+  s->last_rx = rx_time;
+  bfd_session_update_detection_time(s);
 
   /* Update session state */
   int next_state = 0;
@@ -298,11 +347,25 @@ bfd_session_process_ctl(struct bfd_session *s, u8 flags, u32 old_tx_int, u32 old
     bfd_session_update_state(s, next_state, diag);
 
   bfd_session_control_tx_timer(s, 0);
+  bfd_session_control_echo(s);
 
   if (flags & BFD_FLAG_POLL)
     bfd_send_ctl(s->ifa->bfd, s, 1);
 }
 
+void
+bfd_session_process_echo(struct bfd_session *s, btime tx_time, btime rx_time)
+{
+  btime timeout = (btime) s->echo_int * s->detect_mult;
+
+  /* Ignore packets returned too late, they may be just replayed */
+  if ((tx_time > rx_time) || (rx_time - tx_time > timeout))
+    return;
+
+  s->echo_rtt = rx_time - tx_time;
+  tm2_set(s->echo_hold_timer, rx_time + timeout);
+}
+
 static void
 bfd_session_timeout(struct bfd_session *s)
 {
@@ -325,6 +388,17 @@ bfd_session_timeout(struct bfd_session *s)
   bfd_session_control_tx_timer(s, 1);
 }
 
+static void
+bfd_session_echo_timeout(struct bfd_session *s)
+{
+  struct bfd_proto *p = s->ifa->bfd;
+
+  TRACE(D_EVENTS, "Session to %I echo failed", s->addr);
+
+  /* The echo function is stopped by the state change */
+  bfd_session_update_state(s, BFD_STATE_DOWN, BFD_DIAG_ECHO_FAILED);
+}
+
 static void
 bfd_session_set_min_tx(struct bfd_session *s, u32 val)
 {
@@ -359,22 +433,22 @@ bfd_session_set_min_rx(struct bfd_session *s, u32 val)
   if ((s->loc_state != BFD_STATE_UP) || (val > s->req_min_rx_int))
   {
     s->req_min_rx_int = val;
-    bfd_session_update_detection_time(s, 0);
+    bfd_session_update_detection_time(s);
   }
 
   bfd_session_request_poll(s, BFD_POLL_RX);
 }
 
 struct bfd_session *
-bfd_find_session_by_id(struct bfd_proto *p, u32 id)
+bfd_find_session_by_id(struct bfd_shard *sh, u32 id)
 {
-  return HASH_FIND(p->session_hash_id, HASH_ID, id);
+  return HASH_FIND(sh->session_hash_id, HASH_ID, id);
 }
 
 struct bfd_session *
-bfd_find_session_by_addr(struct bfd_proto *p, ip_addr addr)
+bfd_find_session_by_addr(struct bfd_shard *sh, ip_addr addr)
 {
-  return HASH_FIND(p->session_hash_ip, HASH_IP, addr);
+  return HASH_FIND(sh->session_hash_ip, HASH_IP, addr);
 }
 
 static void
@@ -383,6 +457,7 @@ bfd_tx_timer_hook(timer2 *t)
   struct bfd_session *s = t->data;
 
   s->last_tx = current_time();
+  s->tx_lag_max = MAX(s->tx_lag_max, t->lag);
   bfd_send_ctl(s->ifa->bfd, s, 0);
 }
 
@@ -392,33 +467,85 @@ bfd_hold_timer_hook(timer2 *t)
   bfd_session_timeout(t->data);
 }
 
+static void
+bfd_echo_tx_timer_hook(timer2 *t)
+{
+  struct bfd_session *s = t->data;
+
+  s->tx_lag_max = MAX(s->tx_lag_max, t->lag);
+  bfd_send_echo(s->ifa->bfd, s);
+}
+
+static void
+bfd_echo_hold_timer_hook(timer2 *t)
+{
+  bfd_session_echo_timeout(t->data);
+}
+
+/* Echo packets are forwarded back by the neighbor, so link-local addresses are not usable */
+static ip_addr
+bfd_echo_addr(ip_addr local, struct iface *iface)
+{
+  if (!iface)
+    return IPA_NONE;
+
+  if (ipa_nonzero(local) && !ipa_is_link_local(local))
+    return local;
+
+  if (iface->addr && !ipa_is_link_local(iface->addr->ip))
+    return iface->addr->ip;
+
+  return IPA_NONE;
+}
+
+/* Session IDs of a shard are its index modulo the number of shards */
 static u32
-bfd_get_free_id(struct bfd_proto *p)
+bfd_get_free_id(struct bfd_shard *sh)
 {
-  u32 id;
-  for (id = random_u32(); 1; id++)
-    if (id && !bfd_find_session_by_id(p, id))
+  u32 n = sh->bfd->shard_count;
+  u32 max = (0xffffffff - sh->index) / n;
+  u32 k, id;
+
+  for (k = random_u32() % ((u64) max + 1); 1; k = (k < max) ? k + 1 : 0)
+    if ((id = k * n + sh->index) && !bfd_find_session_by_id(sh, id))
       break;
 
   return id;
 }
 
+static struct bfd_shard *
+bfd_choose_shard(struct bfd_proto *p)
+{
+  struct bfd_shard *sh = &p->shards[0];
+  uint i;
+
+  for (i = 1; i < p->shard_count; i++)
+    if (p->shards[i].sessions < sh->sessions)
+      sh = &p->shards[i];
+
+  return sh;
+}
+
 static struct bfd_session *
 bfd_add_session(struct bfd_proto *p, ip_addr addr, ip_addr local, struct iface *iface)
 {
-  birdloop_enter(p->loop);
+  struct bfd_shard *sh = bfd_choose_shard(p);
 
-  struct bfd_iface *ifa = bfd_get_iface(p, local, iface);
+  birdloop_enter(sh->loop);
+
+  struct bfd_iface *ifa = bfd_get_iface(sh, local, iface);
 
   struct bfd_session *s = sl_alloc(p->session_slab);
   bzero(s, sizeof(struct bfd_session));
 
   s->addr = addr;
   s->ifa = ifa;
-  s->loc_id = bfd_get_free_id(p);
+  s->loc_id = bfd_get_free_id(sh);
+  s->echo_addr = bfd_echo_addr(local, iface);
 
-  HASH_INSERT(p->session_hash_id, HASH_ID, s);
-  HASH_INSERT(p->session_hash_ip, HASH_IP, s);
+  HASH_INSERT2(sh->session_hash_id, HASH_ID, p->p.pool, s);
+  HASH_INSERT2(sh->session_hash_ip, HASH_IP, p->p.pool, s);
+  sh->sessions++;
 
 
   /* Initialization of state variables - see RFC 5880 6.8.1 */
@@ -430,8 +557,10 @@ bfd_add_session(struct bfd_proto *p, ip_addr addr, ip_addr local, struct iface *
   s->detect_mult = ifa->cf->multiplier;
   s->passive = ifa->cf->passive;
 
-  s->tx_timer = tm2_new_init(p->tpool, bfd_tx_timer_hook, s, 0, 0);
-  s->hold_timer = tm2_new_init(p->tpool, bfd_hold_timer_hook, s, 0, 0);
+  s->tx_timer = tm2_new_init(sh->tpool, bfd_tx_timer_hook, s, 0, 0);
+  s->hold_timer = tm2_new_init(sh->tpool, bfd_hold_timer_hook, s, 0, 0);
+  s->echo_tx_timer = tm2_new_init(sh->tpool, bfd_echo_tx_timer_hook, s, 0, 0);
+  s->echo_hold_timer = tm2_new_init(sh->tpool, bfd_echo_hold_timer_hook, s, 0, 0);
   bfd_session_update_tx_interval(s);
   bfd_session_control_tx_timer(s, 1);
 
@@ -440,7 +569,7 @@ bfd_add_session(struct bfd_proto *p, ip_addr addr, ip_addr local, struct iface *
 
   TRACE(D_EVENTS, "Session to %I added", s->addr);
 
-  birdloop_leave(p->loop);
+  birdloop_leave(sh->loop);
 
   return s;
 }
@@ -475,36 +604,44 @@ bfd_close_session(struct bfd_proto *p, struct bfd_session *s)
 static void
 bfd_remove_session(struct bfd_proto *p, struct bfd_session *s)
 {
+  struct bfd_shard *sh = s->ifa->shard;
   ip_addr ip = s->addr;
 
   /* Caller should ensure that request list is empty */
 
-  birdloop_enter(p->loop);
+  birdloop_enter(sh->loop);
 
   /* Remove session from notify list if scheduled for notification */
-  /* No need for bfd_lock_sessions(), we are already protected by birdloop_enter() */
+  /* The list is shared with other shards, so birdloop_enter() is not enough */
+  bfd_lock_sessions(p);
   if (NODE_VALID(&s->n))
     rem_node(&s->n);
+  bfd_unlock_sessions(p);
 
   bfd_free_iface(s->ifa);
 
   rfree(s->tx_timer);
   rfree(s->hold_timer);
+  rfree(s->echo_tx_timer);
+  rfree(s->echo_hold_timer);
 
-  HASH_REMOVE(p->session_hash_id, HASH_ID, s);
-  HASH_REMOVE(p->session_hash_ip, HASH_IP, s);
+  HASH_REMOVE2(sh->session_hash_id, HASH_ID, p->p.pool, s);
+  HASH_REMOVE2(sh->session_hash_ip, HASH_IP, p->p.pool, s);
+  sh->sessions--;
 
   sl_free(p->session_slab, s);
 
   TRACE(D_EVENTS, "Session to %I removed", ip);
 
-  birdloop_leave(p->loop);
+  birdloop_leave(sh->loop);
 }
 
 static void
 bfd_reconfigure_session(struct bfd_proto *p, struct bfd_session *s)
 {
-  birdloop_enter(p->loop);
+  struct bfd_shard *sh = s->ifa->shard;
+
+  birdloop_enter(sh->loop);
 
   struct bfd_iface_config *cf = s->ifa->cf;
 
@@ -515,8 +652,9 @@ bfd_reconfigure_session(struct bfd_proto *p, struct bfd_session *s)
   s->passive = cf->passive;
 
   bfd_session_control_tx_timer(s, 0);
+  bfd_session_control_echo(s);
 
-  birdloop_leave(p->loop);
+  birdloop_leave(sh->loop);
 
   TRACE(D_EVENTS, "Session to %I reconfigured", s->addr);
 }
@@ -544,27 +682,32 @@ bfd_find_iface_config(struct bfd_config *cf, struct iface *iface)
 }
 
 static struct bfd_iface *
-bfd_get_iface(struct bfd_proto *p, ip_addr local, struct iface *iface)
+bfd_get_iface(struct bfd_shard *sh, ip_addr local, struct iface *iface)
 {
+  struct bfd_proto *p = sh->bfd;
   struct bfd_iface *ifa;
 
-  WALK_LIST(ifa, p->iface_list)
+  WALK_LIST(ifa, sh->iface_list)
     if (ipa_equal(ifa->local, local) && (ifa->iface == iface))
       return ifa->uc++, ifa;
 
   struct bfd_config *cf = (struct bfd_config *) (p->p.cf);
   struct bfd_iface_config *ic = bfd_find_iface_config(cf, iface);
 
-  ifa = mb_allocz(p->tpool, sizeof(struct bfd_iface));
+  ifa = mb_allocz(sh->tpool, sizeof(struct bfd_iface));
   ifa->local = local;
   ifa->iface = iface;
   ifa->cf = ic;
   ifa->bfd = p;
+  ifa->shard = sh;
 
-  ifa->sk = bfd_open_tx_sk(p, local, iface);
+  ifa->sk = bfd_open_tx_sk(sh, local, iface);
+  ifa->esk = (iface && ic->echo_int) ? bfd_open_echo_sk(sh, iface) : NULL;
+  ifa->tx_buf = mb_alloc(sh->tpool, BFD_TX_BATCH * BFD_BASE_LEN);
+  ifa->tx_addr = mb_alloc(sh->tpool, BFD_TX_BATCH * sizeof(ip_addr));
   ifa->uc = 1;
 
-  add_tail(&p->iface_list, &ifa->n);
+  add_tail(&sh->iface_list, &ifa->n);
 
   return ifa;
 }
@@ -581,20 +724,32 @@ bfd_free_iface(struct bfd_iface *ifa)
     rfree(ifa->sk);
   }
 
+  if (ifa->esk)
+  {
+    sk_stop(ifa->esk);
+    rfree(ifa->esk);
+  }
+
   rem_node(&ifa->n);
+  mb_free(ifa->tx_buf);
+  mb_free(ifa->tx_addr);
   mb_free(ifa);
 }
 
 static void
-bfd_reconfigure_iface(struct bfd_proto *p, struct bfd_iface *ifa, struct bfd_config *nc)
+bfd_reconfigure_iface(struct bfd_iface *ifa, struct bfd_config *nc)
 {
   struct bfd_iface_config *nic = bfd_find_iface_config(nc, ifa->iface);
   ifa->changed = !!memcmp(nic, ifa->cf, sizeof(struct bfd_iface_config));
 
   /* This should be probably changed to not access ifa->cf from the BFD thread */
-  birdloop_enter(p->loop);
+  birdloop_enter(ifa->shard->loop);
   ifa->cf = nic;
-  birdloop_leave(p->loop);
+
+  /* The echo socket is kept when echo is disabled, it is just not used */
+  if (ifa->iface && nic->echo_int && !ifa->esk)
+    ifa->esk = bfd_open_echo_sk(ifa->shard, ifa->iface);
+  birdloop_leave(ifa->shard->loop);
 }
 
 
@@ -619,10 +774,23 @@ bfd_request_notify(struct bfd_request *req, u8 state, u8 diag)
     req->hook(req);
 }
 
+/* Hash tables are changed only by the main thread, so it may search them freely */
+static struct bfd_session *
+bfd_find_session(struct bfd_proto *p, ip_addr addr)
+{
+  struct bfd_session *s = NULL;
+  uint i;
+
+  for (i = 0; !s && (i < p->shard_count); i++)
+    s = bfd_find_session_by_addr(&p->shards[i], addr);
+
+  return s;
+}
+
 static int
 bfd_add_request(struct bfd_proto *p, struct bfd_request *req)
 {
-  struct bfd_session *s = bfd_find_session_by_addr(p, req->addr);
+  struct bfd_session *s = bfd_find_session(p, req->addr);
   u8 state, diag;
 
   if (!s)
@@ -670,14 +838,18 @@ static void
 bfd_drop_requests(struct bfd_proto *p)
 {
   node *n;
+  uint i;
 
-  HASH_WALK(p->session_hash_id, next_id, s)
+  for (i = 0; i < p->shard_count; i++)
   {
-    /* We assume that p is not in bfd_proto_list */
-    WALK_LIST_FIRST(n, s->request_list)
-      bfd_submit_request(SKIP_BACK(struct bfd_request, n, n));
+    HASH_WALK(p->shards[i].session_hash_id, next_id, s)
+    {
+      /* We assume that p is not in bfd_proto_list */
+      WALK_LIST_FIRST(n, s->request_list)
+	bfd_submit_request(SKIP_BACK(struct bfd_request, n, n));
+    }
+    HASH_WALK_END;
   }
-  HASH_WALK_END;
 }
 
 static struct resclass bfd_request_class;
@@ -843,26 +1015,18 @@ bfd_reconfigure_neighbors(struct bfd_proto *p, struct bfd_config *new)
 
 
 /*
- *	BFD notify socket
+ *	BFD notify event
  */
 
-/* This core notify code should be replaced after main loop transition to birdloop */
-
-int pipe(int pipefd[2]);
-void pipe_drain(int fd);
-void pipe_kick(int fd);
-
-static int
-bfd_notify_hook(sock *sk, int len)
+static void
+bfd_notify_hook(void *data)
 {
-  struct bfd_proto *p = sk->data;
+  struct bfd_proto *p = data;
   struct bfd_session *s;
   list tmp_list;
   u8 state, diag;
   node *n, *nn;
 
-  pipe_drain(sk->fd);
-
   bfd_lock_sessions(p);
   init_list(&tmp_list);
   add_tail_list(&tmp_list, &p->notify_list);
@@ -889,52 +1053,20 @@ bfd_notify_hook(sock *sk, int len)
     if (EMPTY_LIST(s->request_list))
       bfd_remove_session(p, s);
   }
-
-  return 0;
 }
 
 static inline void
 bfd_notify_kick(struct bfd_proto *p)
 {
-  pipe_kick(p->notify_ws->fd);
-}
-
-static void
-bfd_noterr_hook(sock *sk, int err)
-{
-  struct bfd_proto *p = sk->data;
-  log(L_ERR "%s: Notify socket error: %m", p->p.name, err);
+  ev_send_main(p->notify_event);
 }
 
 static void
 bfd_notify_init(struct bfd_proto *p)
 {
-  int pfds[2];
-  sock *sk;
-
-  int rv = pipe(pfds);
-  if (rv < 0)
-    die("pipe: %m");
-
-  sk = sk_new(p->p.pool);
-  sk->type = SK_MAGIC;
-  sk->rx_hook = bfd_notify_hook;
-  sk->err_hook = bfd_noterr_hook;
-  sk->fd = pfds[0];
-  sk->data = p;
-  if (sk_open(sk) < 0)
-    die("bfd: sk_open failed");
-  p->notify_rs = sk;
-
-  /* The write sock is not added to any event loop */
-  sk = sk_new(p->p.pool);
-  sk->type = SK_MAGIC;
-  sk->fd = pfds[1];
-  sk->data = p;
-  sk->flags = SKF_THREAD;
-  if (sk_open(sk) < 0)
-    die("bfd: sk_open failed");
-  p->notify_ws = sk;
+  p->notify_event = ev_new(p->p.pool);
+  p->notify_event->hook = bfd_notify_hook;
+  p->notify_event->data = p;
 }
 
 
@@ -959,31 +1091,48 @@ bfd_init(struct proto_config *c)
   return p;
 }
 
+static void
+bfd_init_shard(struct bfd_proto *p, struct bfd_shard *sh, uint index)
+{
+  sh->bfd = p;
+  sh->index = index;
+  sh->loop = birdloop_new(THREAD_BFD);
+  sh->tpool = rp_new(NULL, "BFD thread root");
+
+  HASH_INIT(sh->session_hash_id, p->p.pool, 8);
+  HASH_INIT(sh->session_hash_ip, p->p.pool, 8);
+
+  init_list(&sh->iface_list);
+
+  birdloop_enter(sh->loop);
+  sh->tx_event = ev_new(sh->tpool);
+  sh->tx_event->hook = bfd_tx_flush;
+  sh->tx_event->data = sh;
+  birdloop_leave(sh->loop);
+}
+
 static int
 bfd_start(struct proto *P)
 {
   struct bfd_proto *p = (struct bfd_proto *) P;
   struct bfd_config *cf = (struct bfd_config *) (P->cf);
+  uint i;
 
-  p->loop = birdloop_new();
-  p->tpool = rp_new(NULL, "BFD thread root");
   pthread_spin_init(&p->lock, PTHREAD_PROCESS_PRIVATE);
 
   p->session_slab = sl_new(P->pool, sizeof(struct bfd_session));
-  HASH_INIT(p->session_hash_id, P->pool, 8);
-  HASH_INIT(p->session_hash_ip, P->pool, 8);
 
-  init_list(&p->iface_list);
+  p->shard_count = cf->threads;
+  p->shards = mb_allocz(P->pool, p->shard_count * sizeof(struct bfd_shard));
+  for (i = 0; i < p->shard_count; i++)
+    bfd_init_shard(p, &p->shards[i], i);
 
   init_list(&p->notify_list);
   bfd_notify_init(p);
 
   add_tail(&bfd_proto_list, &p->bfd_node);
 
-  birdloop_enter(p->loop);
-  p->rx_1 = bfd_open_rx_sk(p, 0);
-  p->rx_m = bfd_open_rx_sk(p, 1);
-  birdloop_leave(p->loop);
+  bfd_open_rx(p);
 
   bfd_take_requests(p);
 
@@ -991,7 +1140,8 @@ bfd_start(struct proto *P)
   WALK_LIST(n, cf->neigh_list)
     bfd_start_neighbor(p, n);
 
-  birdloop_start(p->loop);
+  for (i = 0; i < p->shard_count; i++)
+    birdloop_start(p->shards[i].loop);
 
   return PS_UP;
 }
@@ -1003,9 +1153,15 @@ bfd_shutdown(struct proto *P)
   struct bfd_proto *p = (struct bfd_proto *) P;
   struct bfd_config *cf = (struct bfd_config *) (P->cf);
 
+  uint i;
+
   rem_node(&p->bfd_node);
 
-  birdloop_stop(p->loop);
+  for (i = 0; i < p->shard_count; i++)
+    birdloop_stop(p->shards[i].loop);
+
+  /* Notifications are sent only by the stopped threads, see bfd_notify_kick() */
+  ev_postpone_main(p->notify_event);
 
   struct bfd_neighbor *n;
   WALK_LIST(n, cf->neigh_list)
@@ -1013,12 +1169,17 @@ bfd_shutdown(struct proto *P)
 
   bfd_drop_requests(p);
 
-  /* FIXME: This is hack */
-  birdloop_enter(p->loop);
-  rfree(p->tpool);
-  birdloop_leave(p->loop);
+  for (i = 0; i < p->shard_count; i++)
+  {
+    struct bfd_shard *sh = &p->shards[i];
+
+    /* FIXME: This is hack */
+    birdloop_enter(sh->loop);
+    rfree(sh->tpool);
+    birdloop_leave(sh->loop);
 
-  birdloop_free(p->loop);
+    birdloop_free(sh->loop);
+  }
 
   return PS_DOWN;
 }
@@ -1030,22 +1191,33 @@ bfd_reconfigure(struct proto *P, struct proto_config *c)
   // struct bfd_config *old = (struct bfd_config *) (P->cf);
   struct bfd_config *new = (struct bfd_config *) c;
   struct bfd_iface *ifa;
+  uint i;
 
-  birdloop_mask_wakeups(p->loop);
+  if (new->threads != p->shard_count)
+    return 0;
 
-  WALK_LIST(ifa, p->iface_list)
-    bfd_reconfigure_iface(p, ifa, new);
+  for (i = 0; i < p->shard_count; i++)
+    birdloop_mask_wakeups(p->shards[i].loop);
 
-  HASH_WALK(p->session_hash_id, next_id, s)
+  for (i = 0; i < p->shard_count; i++)
   {
-    if (s->ifa->changed)
-      bfd_reconfigure_session(p, s);
+    struct bfd_shard *sh = &p->shards[i];
+
+    WALK_LIST(ifa, sh->iface_list)
+      bfd_reconfigure_iface(ifa, new);
+
+    HASH_WALK(sh->session_hash_id, next_id, s)
+    {
+      if (s->ifa->changed)
+	bfd_reconfigure_session(p, s);
+    }
+    HASH_WALK_END;
   }
-  HASH_WALK_END;
 
   bfd_reconfigure_neighbors(p, new);
 
-  birdloop_unmask_wakeups(p->loop);
+  for (i = 0; i < p->shard_count; i++)
+    birdloop_unmask_wakeups(p->shards[i].loop);
 
   return 1;
 }
@@ -1075,9 +1247,11 @@ bfd_show_sessions(struct proto *P)
 {
   byte tbuf[TM_DATETIME_BUFFER_SIZE];
   struct bfd_proto *p = (struct bfd_proto *) P;
+  byte ebuf[16];
   uint state, diag UNUSED;
-  u32 tx_int, timeout;
+  u32 tx_int, timeout, rx_lag, tx_lag, echo_rtt;
   const char *ifname;
+  uint i;
 
   if (p->p.proto_state != PS_UP)
   {
@@ -1087,27 +1261,42 @@ bfd_show_sessions(struct proto *P)
   }
 
   cli_msg(-1020, "%s:", p->p.name);
-  cli_msg(-1020, "%-25s %-10s %-10s %-10s  %8s %8s",
-	  "IP address", "Interface", "State", "Since", "Interval", "Timeout");
+  cli_msg(-1020, "%-25s %-10s %-10s %-10s  %8s %8s  %8s %8s %8s",
+	  "IP address", "Interface", "State", "Since", "Interval", "Timeout",
+	  "RX lag", "TX lag", "Echo");
 
 
-  HASH_WALK(p->session_hash_id, next_id, s)
+  for (i = 0; i < p->shard_count; i++)
   {
-    /* FIXME: this is thread-unsafe, but perhaps harmless */
-    state = s->loc_state;
-    diag = s->loc_diag;
-    ifname = (s->ifa && s->ifa->iface) ? s->ifa->iface->name : "---";
-    tx_int = s->last_tx ? (MAX(s->des_min_tx_int, s->rem_min_rx_int) TO_MS) : 0;
-    timeout = (MAX(s->req_min_rx_int, s->rem_min_tx_int) TO_MS) * s->rem_detect_mult;
-
-    state = (state < 4) ? state : 0;
-    tm_format_datetime(tbuf, &config->tf_proto, s->last_state_change);
-
-    cli_msg(-1020, "%-25I %-10s %-10s %-10s  %3u.%03u  %3u.%03u",
-	    s->addr, ifname, bfd_state_names[state], tbuf,
-	    tx_int / 1000, tx_int % 1000, timeout / 1000, timeout % 1000);
+    HASH_WALK(p->shards[i].session_hash_id, next_id, s)
+    {
+      /* FIXME: this is thread-unsafe, but perhaps harmless */
+      state = s->loc_state;
+      diag = s->loc_diag;
+      ifname = (s->ifa && s->ifa->iface) ? s->ifa->iface->name : "---";
+      tx_int = s->last_tx ? (MAX(s->des_min_tx_int, s->rem_min_rx_int) TO_MS) : 0;
+      timeout = (MAX(s->req_min_rx_int, s->rem_min_tx_int) TO_MS) * s->rem_detect_mult;
+
+      /* Lags and echo round-trip time are in milliseconds */
+      rx_lag = MIN(s->rx_lag_max, 999999999);
+      tx_lag = MIN(s->tx_lag_max, 999999999);
+      echo_rtt = MIN(s->echo_rtt, 999999999);
+
+      if (s->echo_int)
+	bsprintf(ebuf, "%3u.%03u", echo_rtt / 1000, echo_rtt % 1000);
+      else
+	strcpy(ebuf, "---");
+
+      state = (state < 4) ? state : 0;
+      tm_format_datetime(tbuf, &config->tf_proto, s->last_state_change);
+
+      cli_msg(-1020, "%-25I %-10s %-10s %-10s  %3u.%03u  %3u.%03u  %3u.%03u  %3u.%03u %8s",
+	      s->addr, ifname, bfd_state_names[state], tbuf,
+	      tx_int / 1000, tx_int % 1000, timeout / 1000, timeout % 1000,
+	      rx_lag / 1000, rx_lag % 1000, tx_lag / 1000, tx_lag % 1000, ebuf);
+    }
+    HASH_WALK_END;
   }
-  HASH_WALK_END;
 
   cli_msg(0, "");
 }
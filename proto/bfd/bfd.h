@@ -33,6 +33,8 @@
 #define BFD_DEFAULT_IDLE_TX_INT	(1 S_)
 #define BFD_DEFAULT_MULTIPLIER	5
 
+#define BFD_MAX_THREADS		64
+
 
 struct bfd_iface_config;
 
@@ -42,6 +44,7 @@ struct bfd_config
   list patt_list;		/* List of iface configs (struct bfd_iface_config) */
   list neigh_list;		/* List of configured neighbors (struct bfd_neighbor) */
   struct bfd_iface_config *multihop; /* Multihop pseudoiface config */
+  uint threads;			/* Number of BFD threads (shards of sessions) */
 };
 
 struct bfd_iface_config
@@ -50,6 +53,8 @@ struct bfd_iface_config
   u32 min_rx_int;
   u32 min_tx_int;
   u32 idle_tx_int;
+  u32 echo_int;			/* Min echo TX interval, 0 if echo function is disabled */
+  u32 min_echo_rx_int;		/* Announced Required Min Echo RX Interval */
   u8 multiplier;
   u8 passive;
 };
@@ -68,27 +73,39 @@ struct bfd_neighbor
   u8 active;
 };
 
-struct bfd_proto
+struct bfd_shard
 {
-  struct proto p;
+  struct bfd_proto *bfd;
   struct birdloop *loop;
   pool *tpool;
-  pthread_spinlock_t lock;
-  node bfd_node;
+  uint index;			/* Position in bfd.shards, also session IDs modulo bfd.shard_count */
+  uint sessions;		/* Number of sessions, used for balancing */
 
-  slab *session_slab;
   HASH(struct bfd_session) session_hash_id;
   HASH(struct bfd_session) session_hash_ip;
 
-  sock *notify_rs;
-  sock *notify_ws;
-  list notify_list;
+  event *tx_event;		/* Sends queued periodic packets, see bfd_tx_flush() */
 
   sock *rx_1;
   sock *rx_m;
+  sock *rx_e;			/* Echo packets returned by neighbors */
   list iface_list;
 };
 
+struct bfd_proto
+{
+  struct proto p;
+  pthread_spinlock_t lock;
+  node bfd_node;
+
+  slab *session_slab;
+  struct bfd_shard *shards;	/* Array of shard_count shards, each with its own thread */
+  uint shard_count;
+
+  event *notify_event;
+  list notify_list;		/* Sessions with changed state from all shards */
+};
+
 struct bfd_iface
 {
   node n;
@@ -96,10 +113,16 @@ struct bfd_iface
   struct iface *iface;
   struct bfd_iface_config *cf;
   struct bfd_proto *bfd;
+  struct bfd_shard *shard;
 
   sock *sk;
+  sock *esk;			/* Raw socket for echo packets, NULL if echo is disabled */
   u32 uc;
   u8 changed;
+
+  byte *tx_buf;			/* Periodic packets queued for batched TX */
+  ip_addr *tx_addr;		/* Their destinations */
+  uint tx_count;
 };
 
 struct bfd_session
@@ -107,8 +130,8 @@ struct bfd_session
   node n;
   ip_addr addr;				/* Address of session */
   struct bfd_iface *ifa;		/* Iface associated with session */
-  struct bfd_session *next_id;		/* Next in bfd.session_hash_id */
-  struct bfd_session *next_ip;		/* Next in bfd.session_hash_ip */
+  struct bfd_session *next_id;		/* Next in bfd_shard.session_hash_id */
+  struct bfd_session *next_ip;		/* Next in bfd_shard.session_hash_ip */
 
   u8 opened_unused;
   u8 passive;
@@ -131,13 +154,24 @@ struct bfd_session
   u8 rem_demand_mode;
   u8 detect_mult;			/* Announced detect_mult, local option */
   u8 rem_detect_mult;			/* Last received detect_mult */
+  u32 rem_min_echo_rx_int;		/* Last received req_min_echo_rx_int */
 
   btime last_tx;			/* Time of last sent periodic control packet */
-  btime last_rx;			/* Time of last received valid control packet */
+  btime last_rx;			/* Arrival time of last received valid control packet */
 
   timer2 *tx_timer;			/* Periodic control packet timer */
   timer2 *hold_timer;			/* Timer for session down detection time */
 
+  ip_addr echo_addr;			/* Source and destination of echo packets, IPA_NONE if none */
+  u32 echo_int;				/* Echo TX interval, 0 if echo function is not active */
+  u32 echo_seq;				/* Sequence number of last sent echo packet */
+  btime echo_rtt;			/* Round trip time of last returned echo packet */
+  timer2 *echo_tx_timer;		/* Periodic echo packet timer */
+  timer2 *echo_hold_timer;		/* Timer for echo detection time */
+
+  u32 rx_lag_max;			/* Max delay of received packet processing since last state change */
+  u32 tx_lag_max;			/* Max delay of TX timers since last state change */
+
   list request_list;			/* List of client requests (struct bfd_request) */
   bird_clock_t last_state_change;	/* Time of last state change */
   u8 notify_running;			/* 1 if notify hooks are running */
@@ -176,16 +210,27 @@ extern const char *bfd_state_names[];
 static inline void bfd_lock_sessions(struct bfd_proto *p) { pthread_spin_lock(&p->lock); }
 static inline void bfd_unlock_sessions(struct bfd_proto *p) { pthread_spin_unlock(&p->lock); }
 
+static inline struct bfd_shard *bfd_shard_by_id(struct bfd_proto *p, u32 id)
+{ return &p->shards[id % p->shard_count]; }
+
 /* bfd.c */
-struct bfd_session * bfd_find_session_by_id(struct bfd_proto *p, u32 id);
-struct bfd_session * bfd_find_session_by_addr(struct bfd_proto *p, ip_addr addr);
-void bfd_session_process_ctl(struct bfd_session *s, u8 flags, u32 old_tx_int, u32 old_rx_int);
+struct bfd_session * bfd_find_session_by_id(struct bfd_shard *sh, u32 id);
+struct bfd_session * bfd_find_session_by_addr(struct bfd_shard *sh, ip_addr addr);
+void bfd_session_process_ctl(struct bfd_session *s, u8 flags, u32 old_tx_int, u32 old_rx_int, btime rx_time);
+void bfd_session_process_echo(struct bfd_session *s, btime tx_time, btime rx_time);
 void bfd_show_sessions(struct proto *P);
 
 /* packets.c */
+#define BFD_BASE_LEN		24	/* Length of control packet without authentication */
+#define BFD_TX_BATCH		64	/* Max periodic packets queued for an interface */
+
 void bfd_send_ctl(struct bfd_proto *p, struct bfd_session *s, int final);
-sock * bfd_open_rx_sk(struct bfd_proto *p, int multihop);
-sock * bfd_open_tx_sk(struct bfd_proto *p, ip_addr local, struct iface *ifa);
+void bfd_send_echo(struct bfd_proto *p, struct bfd_session *s);
+void bfd_tx_flush(void *data);
+sock * bfd_open_rx_sk(struct bfd_shard *sh, int multihop);
+void bfd_open_rx(struct bfd_proto *p);
+sock * bfd_open_tx_sk(struct bfd_shard *sh, ip_addr local, struct iface *ifa);
+sock * bfd_open_echo_sk(struct bfd_shard *sh, struct iface *ifa);
 
 
 #endif /* _BIRD_BFD_H_ */
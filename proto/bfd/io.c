@@ -16,6 +16,7 @@
 
 #include "nest/bird.h"
 #include "proto/bfd/io.h"
+#include "lib/unix.h"
 
 #include "lib/buffer.h"
 #include "lib/heap.h"
@@ -30,6 +31,7 @@ struct birdloop
   pool *pool;
   pthread_t thread;
   pthread_mutex_t mutex;
+  uint thread_class;			/* THREAD_*, for CPU affinity */
 
   btime last_time;
   btime real_time;
@@ -41,6 +43,9 @@ struct birdloop
   int wakeup_fds[2];
 
   BUFFER(timer2 *) timers;
+  list *wheel;				/* Timing wheel, see tm2_set() */
+  btime wheel_pos;			/* Tick of the first slot of the wheel */
+  btime next_expires;			/* First timer expiration when polling, 0 if none */
   list event_list;
   list sock_list;
   uint sock_num;
@@ -49,6 +54,8 @@ struct birdloop
   BUFFER(struct pollfd) poll_fd;
   u8 poll_changed;
   u8 close_scheduled;
+
+  struct birdloop *outer;		/* Context of the thread that entered the loop */
 };
 
 
@@ -168,62 +175,41 @@ current_time(void)
   return birdloop_current()->last_time;
 }
 
-
-/*
- *	Wakeup code for birdloop
+/**
+ * sk_rcv_time - arrival time of a received datagram
+ * @s: socket in rx_hook
+ *
+ * Returns the time of the current loop clock (see current_time()) when the
+ * last datagram was received by the kernel, based on its RX timestamp from
+ * %SKF_TSTAMP_RX. The difference to current_time() is the delay caused by loop
+ * scheduling. When the timestamp is not available or not usable (e.g. after a
+ * step of the real time clock), current_time() is returned.
  */
-
-static void
-pipe_new(int *pfds)
+btime
+sk_rcv_time(sock *s)
 {
-  int rv = pipe(pfds);
-  if (rv < 0)
-    die("pipe: %m");
+  struct birdloop *loop = birdloop_current();
+  struct timespec rt, mt;
 
-  if (fcntl(pfds[0], F_SETFL, O_NONBLOCK) < 0)
-    die("fcntl(O_NONBLOCK): %m");
+  if (!s->rcv_tstamp || !loop->use_monotonic_clock ||
+      (clock_gettime(CLOCK_REALTIME, &rt) < 0) ||
+      (clock_gettime(CLOCK_MONOTONIC, &mt) < 0))
+    return loop->last_time;
 
-  if (fcntl(pfds[1], F_SETFL, O_NONBLOCK) < 0)
-    die("fcntl(O_NONBLOCK): %m");
-}
+  btime age = ((s64) rt.tv_sec S) + (rt.tv_nsec / 1000) - s->rcv_tstamp;
+  btime mono = ((s64) mt.tv_sec S) + (mt.tv_nsec / 1000);
 
-void
-pipe_drain(int fd)
-{
-  char buf[64];
-  int rv;
-  
- try:
-  rv = read(fd, buf, 64);
-  if (rv < 0)
-  {
-    if (errno == EINTR)
-      goto try;
-    if (errno == EAGAIN)
-      return;
-    die("wakeup read: %m");
-  }
-  if (rv == 64)
-    goto try;
+  if ((age < 0) || (age > (60 S)))
+    return loop->last_time;
+
+  /* Datagrams received after the update of the loop clock are just current */
+  return MIN(mono - age, loop->last_time);
 }
 
-void
-pipe_kick(int fd)
-{
-  u64 v = 1;
-  int rv;
 
- try:
-  rv = write(fd, &v, sizeof(u64));
-  if (rv < 0)
-  {
-    if (errno == EINTR)
-      goto try;
-    if (errno == EAGAIN)
-      return;
-    die("wakeup write: %m");
-  }
-}
+/*
+ *	Wakeup code for birdloop
+ */
 
 static inline void
 wakeup_init(struct birdloop *loop)
@@ -293,18 +279,32 @@ ev2_schedule(event *e)
 
 /*
  *	Timers
+ *
+ *	Timers expiring within TIMER_WHEEL_SLOTS ticks are kept in a timing
+ *	wheel, others in a heap. BFD sessions reset their TX and hold timers with
+ *	every packet and most of these fit to the wheel, where they are inserted
+ *	and removed in constant time. The wheel covers ticks from @wheel_pos, so
+ *	all timers in a slot belong to one tick, except those expiring in the
+ *	past, which are in the first slot.
  */
 
 #define TIMER_LESS(a,b)		((a)->expires < (b)->expires)
 #define TIMER_SWAP(heap,a,b,t)	(t = heap[a], heap[a] = heap[b], heap[b] = t, \
 				   heap[a]->index = (a), heap[b]->index = (b))
 
+#define TIMER_TICK		(1 MS_)
+#define TIMER_WHEEL_SLOTS	1024
+#define TIMER_IN_WHEEL		0	/* Index of timers in the wheel, heap starts at 1 */
+
 static inline uint timers_count(struct birdloop *loop)
 { return loop->timers.used - 1; }
 
 static inline timer2 *timers_first(struct birdloop *loop)
 { return (loop->timers.used > 1) ? loop->timers.data[1] : NULL; }
 
+static inline list *timers_slot(struct birdloop *loop, btime tick)
+{ return &loop->wheel[tick % TIMER_WHEEL_SLOTS]; }
+
 
 static void
 tm2_free(resource *r)
@@ -353,8 +353,25 @@ tm2_set(timer2 *t, btime when)
 {
   struct birdloop *loop = birdloop_current();
   uint tc = timers_count(loop);
+  btime tick = when / TIMER_TICK;
 
-  if (!t->expires)
+  if (t->expires && (t->index == TIMER_IN_WHEEL))
+  {
+    rem_node(&t->wn);
+    t->index = -1;
+    t->expires = 0;
+  }
+
+  if (tick < loop->wheel_pos + TIMER_WHEEL_SLOTS)
+  {
+    if (t->expires)
+      tm2_stop(t);
+
+    t->index = TIMER_IN_WHEEL;
+    t->expires = when;
+    add_tail(timers_slot(loop, MAX(tick, loop->wheel_pos)), &t->wn);
+  }
+  else if (!t->expires)
   {
     t->index = ++tc;
     t->expires = when;
@@ -372,7 +389,7 @@ tm2_set(timer2 *t, btime when)
     HEAP_DECREASE(loop->timers.data, tc, timer2 *, TIMER_LESS, TIMER_SWAP, t->index);
   }
 
-  if (loop->poll_active && (t->index == 1))
+  if (loop->poll_active && (!loop->next_expires || (when < loop->next_expires)))
     wakeup_kick(loop);
 }
 
@@ -388,6 +405,14 @@ tm2_stop(timer2 *t)
   if (!t->expires)
     return;
 
+  if (t->index == TIMER_IN_WHEEL)
+  {
+    rem_node(&t->wn);
+    t->index = -1;
+    t->expires = 0;
+    return;
+  }
+
   struct birdloop *loop = birdloop_current();
   uint tc = timers_count(loop);
 
@@ -401,8 +426,115 @@ tm2_stop(timer2 *t)
 static void
 timers_init(struct birdloop *loop)
 {
+  uint i;
+
   BUFFER_INIT(loop->timers, loop->pool, 4);
   BUFFER_PUSH(loop->timers) = NULL;
+
+  loop->wheel = mb_alloc(loop->pool, TIMER_WHEEL_SLOTS * sizeof(list));
+  for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+    init_list(&loop->wheel[i]);
+
+  loop->wheel_pos = loop->last_time / TIMER_TICK;
+}
+
+/* Time of the first timer expiration, or 0 if there is no active timer */
+static btime
+timers_next(struct birdloop *loop)
+{
+  timer2 *t = timers_first(loop);
+  btime next = t ? t->expires : 0;
+  uint i;
+
+  /* The first non-empty slot contains the first timer of the wheel */
+  for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+  {
+    btime tick = loop->wheel_pos + i;
+    list *slot = timers_slot(loop, tick);
+    node *n;
+
+    if (next && (tick * TIMER_TICK >= next))
+      break;
+
+    if (EMPTY_LIST(*slot))
+      continue;
+
+    WALK_LIST(n, *slot)
+    {
+      t = SKIP_BACK(timer2, wn, n);
+      if (!next || (t->expires < next))
+	next = t->expires;
+    }
+    break;
+  }
+
+  return next;
+}
+
+static void
+timers_fire_one(struct birdloop *loop, timer2 *t)
+{
+  t->lag = loop->last_time - t->expires;
+
+  if (t->recurrent)
+  {
+    btime when = t->expires + t->recurrent;
+
+    if (when <= loop->last_time)
+      when = loop->last_time + t->recurrent;
+
+    if (t->randomize)
+      when += random() % (t->randomize + 1);
+
+    tm2_set(t, when);
+  }
+  else
+    tm2_stop(t);
+
+  t->hook(t);
+}
+
+static void
+timers_fire_wheel(struct birdloop *loop, btime base_time)
+{
+  btime tick = loop->wheel_pos;
+  btime last = base_time / TIMER_TICK;
+  list todo;
+
+  if (last < tick)
+    return;
+
+  /* Timers set by hooks already use the new position */
+  last = MIN(last, tick + TIMER_WHEEL_SLOTS - 1);
+  loop->wheel_pos = base_time / TIMER_TICK;
+
+  for (; tick <= last; tick++)
+  {
+    list *slot = timers_slot(loop, tick);
+
+    if (EMPTY_LIST(*slot))
+      continue;
+
+    /* Hooks may stop or set any timers, so just the head of the list is used */
+    init_list(&todo);
+    add_tail_list(&todo, slot);
+    init_list(slot);
+
+    while (!EMPTY_LIST(todo))
+    {
+      timer2 *t = SKIP_BACK(timer2, wn, HEAD(todo));
+
+      if (t->expires > base_time)
+      {
+	/* Not yet, or set by a hook for the next round of the slot */
+	rem_node(&t->wn);
+	add_tail(timers_slot(loop, MAX(t->expires / TIMER_TICK, loop->wheel_pos)), &t->wn);
+	continue;
+      }
+
+      timers_fire_one(loop, t);
+    }
+  }
 }
 
 static void
@@ -414,27 +546,14 @@ timers_fire(struct birdloop *loop)
   times_update(loop);
   base_time = loop->last_time;
 
+  timers_fire_wheel(loop, base_time);
+
   while (t = timers_first(loop))
   {
     if (t->expires > base_time)
       return;
 
-    if (t->recurrent)
-    {
-      btime when = t->expires + t->recurrent;
-      
-      if (when <= loop->last_time)
-	when = loop->last_time + t->recurrent;
-
-      if (t->randomize)
-	when += random() % (t->randomize + 1);
-
-      tm2_set(t, when);
-    }
-    else
-      tm2_stop(t);
-
-    t->hook(t);
+    timers_fire_one(loop, t);
   }
 }
 
@@ -622,7 +741,7 @@ sockets_fire(struct birdloop *loop)
 static void * birdloop_main(void *arg);
 
 struct birdloop *
-birdloop_new(void)
+birdloop_new(uint thread_class)
 {
   /* FIXME: this init should be elsewhere and thread-safe */
   static int init = 0;
@@ -632,6 +751,7 @@ birdloop_new(void)
   pool *p = rp_new(NULL, "Birdloop root");
   struct birdloop *loop = mb_allocz(p, sizeof(struct birdloop));
   loop->pool = p;
+  loop->thread_class = thread_class;
   pthread_mutex_init(&loop->mutex, NULL);
 
   times_init(loop);
@@ -672,19 +792,31 @@ birdloop_free(struct birdloop *loop)
 }
 
 
+/*
+ * Birdloop may be entered also from an event hook of another birdloop. In that
+ * case, the context of the outer loop is restored by birdloop_leave() and the
+ * time of the entered loop is updated, as its thread may be sleeping in poll().
+ * To avoid deadlocks, the caller must ensure that loops are always entered in a
+ * consistent order.
+ */
 void
 birdloop_enter(struct birdloop *loop)
 {
-  /* TODO: these functions could save and restore old context */
+  struct birdloop *outer = birdloop_current();
+
   pthread_mutex_lock(&loop->mutex);
+  loop->outer = outer;
   birdloop_set_current(loop);
+
+  if (outer)
+    times_update(loop);
 }
 
 void
 birdloop_leave(struct birdloop *loop)
 {
-  /* TODO: these functions could save and restore old context */
-  birdloop_set_current(NULL);
+  birdloop_set_current(loop->outer);
+  loop->outer = NULL;
   pthread_mutex_unlock(&loop->mutex);
 }
 
@@ -710,10 +842,10 @@ static void *
 birdloop_main(void *arg)
 {
   struct birdloop *loop = arg;
-  timer2 *t;
   int rv, timeout;
 
   birdloop_set_current(loop);
+  thread_start(loop->thread_class);
 
   pthread_mutex_lock(&loop->mutex);
   while (1)
@@ -722,10 +854,11 @@ birdloop_main(void *arg)
     timers_fire(loop);
 
     times_update(loop);
+    loop->next_expires = timers_next(loop);
     if (events_waiting(loop))
       timeout = 0;
-    else if (t = timers_first(loop))
-      timeout = (tm2_remains(t) TO_MS) + 1;
+    else if (loop->next_expires)
+      timeout = (MAX(loop->next_expires - loop->last_time, 0) TO_MS) + 1;
     else
       timeout = -1;
 
@@ -762,6 +895,7 @@ birdloop_main(void *arg)
   loop->stop_called = 0;
   pthread_mutex_unlock(&loop->mutex);
 
+  thread_stop();
   return NULL;
 }
 
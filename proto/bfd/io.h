@@ -12,6 +12,7 @@
 #include "lib/resource.h"
 #include "lib/event.h"
 #include "lib/socket.h"
+#include "lib/worker.h"
 // #include "lib/timer.h"
 
 
@@ -25,11 +26,14 @@ typedef struct timer2
   uint randomize;			/* Amount of randomization */
   uint recurrent;			/* Timer recurrence */
 
-  int index;
+  int index;				/* Position in heap, 0 if in wheel */
+  node wn;				/* Node in wheel slot */
+  btime lag;				/* Delay of the last hook call after expiration */
 } timer2;
 
 
 btime current_time(void);
+btime sk_rcv_time(sock *s);
 
 void ev2_schedule(event *e);
 
@@ -85,7 +89,7 @@ void sk_stop(sock *s);
 
 
 
-struct birdloop *birdloop_new(void);
+struct birdloop *birdloop_new(uint thread_class);
 void birdloop_start(struct birdloop *loop);
 void birdloop_stop(struct birdloop *loop);
 void birdloop_free(struct birdloop *loop);
@@ -5,6 +5,8 @@
  */
 
 #include "bfd.h"
+#include "lib/checksum.h"
+#include "lib/unaligned.h"
 
 
 struct bfd_ctl_packet
@@ -20,9 +22,32 @@ struct bfd_ctl_packet
   u32 req_min_echo_rx_int;
 };
 
-#define BFD_BASE_LEN	sizeof(struct bfd_ctl_packet)
+/*
+ * Echo packets are sent to ourselves through the neighbor, so their format is
+ * a local matter. The session ID is at the same offset as 'your discriminator'
+ * of control packets, so both are steered to shards in the same way.
+ */
+struct bfd_echo_packet
+{
+  u32 magic;			/* BFD_ECHO_MAGIC */
+  u32 seq;			/* sequence number */
+  u32 id;			/* local session ID */
+  u32 time_hi;			/* send time (current_time()) */
+  u32 time_lo;
+};
+
+#define BFD_ECHO_MAGIC	0x42464445
+#define BFD_ECHO_LEN	sizeof(struct bfd_echo_packet)
+
 #define BFD_MAX_LEN	64
 
+/* IP and UDP headers of sent echo packets */
+#ifndef IPV6
+#define BFD_ECHO_HDR_LEN	28
+#else
+#define BFD_ECHO_HDR_LEN	48
+#endif
+
 static inline u8 bfd_pack_vdiag(u8 version, u8 diag)
 { return (version << 5) | diag; }
 
@@ -59,17 +84,64 @@ bfd_format_flags(u8 flags, char *buf)
   return buf;
 }
 
+static void
+bfd_tx_flush_iface(struct bfd_iface *ifa)
+{
+  sk_send_batch(ifa->sk, ifa->tx_buf, BFD_BASE_LEN, ifa->tx_addr, ifa->tx_count, 0);
+  ifa->tx_count = 0;
+}
+
+/**
+ * bfd_tx_flush - send queued periodic packets
+ * @data: BFD shard
+ *
+ * Periodic control packets from TX timers are not sent immediately, but queued
+ * in their BFD interface. This event (scheduled by bfd_send_ctl()) runs after
+ * all timers in the current round of the BFD loop and sends the packets for
+ * each interface by one sk_send_batch() call.
+ */
+void
+bfd_tx_flush(void *data)
+{
+  struct bfd_shard *sh = data;
+  struct bfd_iface *ifa;
+
+  WALK_LIST(ifa, sh->iface_list)
+    if (ifa->tx_count)
+      bfd_tx_flush_iface(ifa);
+}
+
 void
 bfd_send_ctl(struct bfd_proto *p, struct bfd_session *s, int final)
 {
-  sock *sk = s->ifa->sk;
+  struct bfd_iface *ifa = s->ifa;
+  sock *sk = ifa->sk;
   struct bfd_ctl_packet *pkt;
   char fb[8];
 
   if (!sk)
     return;
 
-  pkt = (struct bfd_ctl_packet *) sk->tbuf;
+  if (final)
+  {
+    /* Replies to a poll are sent immediately */
+    pkt = (struct bfd_ctl_packet *) sk->tbuf;
+
+    if (sk->tbuf != sk->tpos)
+      log(L_WARN "%s: Old packet overwritten in TX buffer", p->p.name);
+  }
+  else
+  {
+    if (ifa->tx_count == BFD_TX_BATCH)
+      bfd_tx_flush_iface(ifa);
+
+    if (!ifa->tx_count)
+      ev2_schedule(ifa->shard->tx_event);
+
+    pkt = (struct bfd_ctl_packet *) (ifa->tx_buf + ifa->tx_count * BFD_BASE_LEN);
+    ifa->tx_addr[ifa->tx_count++] = s->addr;
+  }
+
   pkt->vdiag = bfd_pack_vdiag(1, s->loc_diag);
   pkt->flags = bfd_pack_flags(s->loc_state, 0);
   pkt->detect_mult = s->detect_mult;
@@ -78,28 +150,60 @@ bfd_send_ctl(struct bfd_proto *p, struct bfd_session *s, int final)
   pkt->rcv_id = htonl(s->rem_id);
   pkt->des_min_tx_int = htonl(s->des_min_tx_new);
   pkt->req_min_rx_int = htonl(s->req_min_rx_new);
-  pkt->req_min_echo_rx_int = 0;
+  pkt->req_min_echo_rx_int = htonl(ifa->iface ? ifa->cf->min_echo_rx_int : 0);
 
   if (final)
     pkt->flags |= BFD_FLAG_FINAL;
   else if (s->poll_active)
     pkt->flags |= BFD_FLAG_POLL;
 
-  if (sk->tbuf != sk->tpos)
-    log(L_WARN "%s: Old packet overwritten in TX buffer", p->p.name);
-
   TRACE(D_PACKETS, "Sending CTL to %I [%s%s]", s->addr,
 	bfd_state_names[s->loc_state], bfd_format_flags(pkt->flags, fb));
 
-  sk_send_to(sk, pkt->length, s->addr, sk->dport);
+  if (final)
+    sk_send_to(sk, pkt->length, s->addr, sk->dport);
 }
 
 #define DROP(DSC,VAL) do { err_dsc = DSC; err_val = VAL; goto drop; } while(0)
 
+/*
+ * Without session ID, the session is found by address in any shard. The loop of
+ * the owning shard is entered and left entered for the caller. That is done only
+ * by the first shard, see bfd_open_rx().
+ */
+static struct bfd_session *
+bfd_find_session_any(struct bfd_shard *sh, ip_addr addr, struct bfd_shard **owner)
+{
+  struct bfd_proto *p = sh->bfd;
+  struct bfd_session *s;
+  uint i;
+
+  *owner = sh;
+  if (s = bfd_find_session_by_addr(sh, addr))
+    return s;
+
+  for (i = 0; i < p->shard_count; i++)
+  {
+    struct bfd_shard *ss = &p->shards[i];
+
+    if (ss == sh)
+      continue;
+
+    birdloop_enter(ss->loop);
+    if (s = bfd_find_session_by_addr(ss, addr))
+      return *owner = ss, s;
+    birdloop_leave(ss->loop);
+  }
+
+  return NULL;
+}
+
 static int
 bfd_rx_hook(sock *sk, int len)
 {
-  struct bfd_proto *p =  sk->data;
+  struct bfd_shard *sh = sk->data;
+  struct bfd_shard *ss = sh;
+  struct bfd_proto *p = sh->bfd;
   struct bfd_ctl_packet *pkt = (struct bfd_ctl_packet *) sk->rbuf;
   const char *err_dsc = NULL;
   uint err_val = 0;
@@ -133,7 +237,15 @@ bfd_rx_hook(sock *sk, int len)
 
   if (id)
   {
-    s = bfd_find_session_by_id(p, id);
+    /* Packets for other shards come only to the first one, see bfd_open_rx() */
+    ss = bfd_shard_by_id(p, id);
+    if ((ss != sh) && sh->index)
+      DROP("misdirected session id", id);
+
+    if (ss != sh)
+      birdloop_enter(ss->loop);
+
+    s = bfd_find_session_by_id(ss, id);
 
     if (!s)
       DROP("unknown session id", id);
@@ -144,7 +256,7 @@ bfd_rx_hook(sock *sk, int len)
     if (ps > BFD_STATE_DOWN)
       DROP("invalid init state", ps);
 
-    s = bfd_find_session_by_addr(p, sk->faddr);
+    s = bfd_find_session_any(sh, sk->faddr, &ss);
 
     /* FIXME: better session matching and message */
     if (!s)
@@ -166,41 +278,118 @@ bfd_rx_hook(sock *sk, int len)
   s->rem_min_tx_int = ntohl(pkt->des_min_tx_int);
   s->rem_min_rx_int = ntohl(pkt->req_min_rx_int);
   s->rem_detect_mult = pkt->detect_mult;
+  s->rem_min_echo_rx_int = ntohl(pkt->req_min_echo_rx_int);
 
   TRACE(D_PACKETS, "CTL received from %I [%s%s]", sk->faddr,
 	bfd_state_names[s->rem_state], bfd_format_flags(pkt->flags, fb));
 
-  bfd_session_process_ctl(s, pkt->flags, old_tx_int, old_rx_int);
+  btime rx_time = sk_rcv_time(sk);
+  s->rx_lag_max = MAX(s->rx_lag_max, current_time() - rx_time);
+
+  bfd_session_process_ctl(s, pkt->flags, old_tx_int, old_rx_int, rx_time);
+
+  if (ss != sh)
+    birdloop_leave(ss->loop);
+
   return 1;
 
  drop:
+  if (ss != sh)
+    birdloop_leave(ss->loop);
+
   log(L_REMOTE "%s: Bad packet from %I - %s (%u)", p->p.name, sk->faddr, err_dsc, err_val);
   return 1;
 }
 
+/*
+ * Echo packets are looped back by the neighbor, so they come with our echo
+ * address as both source and destination and with TTL decremented by one.
+ */
+static int
+bfd_rx_echo_hook(sock *sk, int len)
+{
+  struct bfd_shard *sh = sk->data;
+  struct bfd_shard *ss = sh;
+  struct bfd_proto *p = sh->bfd;
+  struct bfd_echo_packet *pkt = (struct bfd_echo_packet *) sk->rbuf;
+  struct bfd_session *s;
+  const char *err_dsc = NULL;
+  uint err_val = 0;
+
+  if (len < (int) BFD_ECHO_LEN)
+    DROP("too short", len);
+
+  if (ntohl(pkt->magic) != BFD_ECHO_MAGIC)
+    DROP("invalid magic", 0);
+
+  if (sk->rcv_ttl < 254)
+    DROP("wrong TTL", sk->rcv_ttl);
+
+  u32 id = ntohl(pkt->id);
+  ss = bfd_shard_by_id(p, id);
+  if ((ss != sh) && sh->index)
+    DROP("misdirected session id", id);
+
+  if (ss != sh)
+    birdloop_enter(ss->loop);
+
+  s = bfd_find_session_by_id(ss, id);
+
+  /* Late echo packets of stopped echo function are ignored */
+  if (!s || !s->echo_int || !ipa_equal(sk->faddr, s->echo_addr))
+    goto done;
+
+  btime tx_time = ((btime) ntohl(pkt->time_hi) << 32) | ntohl(pkt->time_lo);
+  btime rx_time = sk_rcv_time(sk);
+
+  TRACE(D_PACKETS, "Echo %u returned from %I", ntohl(pkt->seq), s->addr);
+
+  s->rx_lag_max = MAX(s->rx_lag_max, current_time() - rx_time);
+  bfd_session_process_echo(s, tx_time, rx_time);
+
+ done:
+  if (ss != sh)
+    birdloop_leave(ss->loop);
+
+  return 1;
+
+ drop:
+  if (ss != sh)
+    birdloop_leave(ss->loop);
+
+  log(L_REMOTE "%s: Bad echo packet from %I - %s (%u)", p->p.name, sk->faddr, err_dsc, err_val);
+  return 1;
+}
+
 static void
 bfd_err_hook(sock *sk, int err)
 {
-  struct bfd_proto *p = sk->data;
-  log(L_ERR "%s: Socket error: %m", p->p.name, err);
+  struct bfd_shard *sh = sk->data;
+  log(L_ERR "%s: Socket error: %m", sh->bfd->p.name, err);
 }
 
 sock *
-bfd_open_rx_sk(struct bfd_proto *p, int multihop)
+bfd_open_rx_sk(struct bfd_shard *sh, int multihop)
 {
-  sock *sk = sk_new(p->tpool);
+  struct bfd_proto *p = sh->bfd;
+  sock *sk = sk_new(sh->tpool);
   sk->type = SK_UDP;
   sk->sport = !multihop ? BFD_CONTROL_PORT : BFD_MULTI_CTL_PORT;
-  sk->data = p;
+  sk->data = sh;
 
   sk->rbsize = BFD_MAX_LEN;
   sk->rx_hook = bfd_rx_hook;
+  sk->rx_batch = 8;
   sk->err_hook = bfd_err_hook;
 
   /* TODO: configurable ToS and priority */
   sk->tos = IP_PREC_INTERNET_CONTROL;
   sk->priority = sk_priority_control;
-  sk->flags = SKF_THREAD | SKF_LADDR_RX | (!multihop ? SKF_TTL_RX : 0);
+  sk->flags = SKF_THREAD | SKF_LADDR_RX | SKF_TSTAMP_RX | (!multihop ? SKF_TTL_RX : 0);
+
+  /* Shards share ports, packets are steered to them by bfd_open_rx() */
+  if (p->shard_count > 1)
+    sk->flags |= SKF_REUSEPORT;
 
 #ifdef IPV6
   sk->flags |= SKF_V6ONLY;
@@ -218,15 +407,121 @@ bfd_open_rx_sk(struct bfd_proto *p, int multihop)
   return NULL;
 }
 
+static sock *
+bfd_open_rx_echo_sk(struct bfd_shard *sh)
+{
+  struct bfd_proto *p = sh->bfd;
+  sock *sk = sk_new(sh->tpool);
+  sk->type = SK_UDP;
+  sk->sport = BFD_ECHO_PORT;
+  sk->data = sh;
+
+  sk->rbsize = BFD_MAX_LEN;
+  sk->rx_hook = bfd_rx_echo_hook;
+  sk->rx_batch = 8;
+  sk->err_hook = bfd_err_hook;
+  sk->flags = SKF_THREAD | SKF_TTL_RX | SKF_TSTAMP_RX;
+
+  if (p->shard_count > 1)
+    sk->flags |= SKF_REUSEPORT;
+
+#ifdef IPV6
+  sk->flags |= SKF_V6ONLY;
+#endif
+
+  if (sk_open(sk) < 0)
+    goto err;
+
+  sk_start(sk);
+  return sk;
+
+ err:
+  sk_log_error(sk, p->p.name);
+  rfree(sk);
+  return NULL;
+}
+
+static void
+bfd_close_rx_sk(sock **skp)
+{
+  if (!*skp)
+    return;
+
+  sk_stop(*skp);
+  rfree(*skp);
+  *skp = NULL;
+}
+
+/**
+ * bfd_open_rx - open RX sockets of all shards
+ * @p: BFD protocol
+ *
+ * With more shards, their RX sockets share BFD ports and the kernel is asked by
+ * sk_set_reuseport_steering() to pass each packet to the shard given by its
+ * 'your discriminator', which is the session ID modulo the number of shards
+ * (see bfd_get_free_id()). Packets without it are received by the first shard,
+ * which finds the session by address in all shards. When the steering is not
+ * available, only the first shard has RX sockets and it processes packets for
+ * other shards in their context. In both cases, only the first shard enters
+ * loops of other shards, so there is no deadlock.
+ */
+void
+bfd_open_rx(struct bfd_proto *p)
+{
+  uint off = OFFSETOF(struct bfd_ctl_packet, rcv_id);
+  uint n = p->shard_count;
+  uint i;
+
+  for (i = 0; i < n; i++)
+  {
+    struct bfd_shard *sh = &p->shards[i];
+
+    birdloop_enter(sh->loop);
+    sh->rx_1 = bfd_open_rx_sk(sh, 0);
+    sh->rx_m = bfd_open_rx_sk(sh, 1);
+    sh->rx_e = bfd_open_rx_echo_sk(sh);
+    birdloop_leave(sh->loop);
+
+    if ((n == 1) || (sh->rx_1 && sh->rx_m && sh->rx_e))
+      continue;
+
+    /* Indexes of sockets in the group would not match shards */
+    goto fallback;
+  }
+
+  if ((n == 1) ||
+      ((sk_set_reuseport_steering(p->shards[0].rx_1, off, n) >= 0) &&
+       (sk_set_reuseport_steering(p->shards[0].rx_m, off, n) >= 0) &&
+       (sk_set_reuseport_steering(p->shards[0].rx_e, off, n) >= 0)))
+    return;
+
+  sk_log_error(p->shards[0].rx_1, p->p.name);
+
+ fallback:
+  log(L_WARN "%s: Cannot steer packets to threads, receiving them by one thread", p->p.name);
+
+  for (i = 1; i < n; i++)
+  {
+    struct bfd_shard *sh = &p->shards[i];
+
+    birdloop_enter(sh->loop);
+    bfd_close_rx_sk(&sh->rx_1);
+    bfd_close_rx_sk(&sh->rx_m);
+    bfd_close_rx_sk(&sh->rx_e);
+    birdloop_leave(sh->loop);
+  }
+}
+
 sock *
-bfd_open_tx_sk(struct bfd_proto *p, ip_addr local, struct iface *ifa)
+bfd_open_tx_sk(struct bfd_shard *sh, ip_addr local, struct iface *ifa)
 {
-  sock *sk = sk_new(p->tpool);
+  struct bfd_proto *p = sh->bfd;
+  sock *sk = sk_new(sh->tpool);
   sk->type = SK_UDP;
   sk->saddr = local;
   sk->dport = ifa ? BFD_CONTROL_PORT : BFD_MULTI_CTL_PORT;
   sk->iface = ifa;
-  sk->data = p;
+  sk->data = sh;
 
   sk->tbsize = BFD_MAX_LEN;
   sk->err_hook = bfd_err_hook;
@@ -252,3 +547,106 @@ bfd_open_tx_sk(struct bfd_proto *p, ip_addr local, struct iface *ifa)
   rfree(sk);
   return NULL;
 }
+
+/**
+ * bfd_send_echo - send an echo packet
+ * @p: BFD protocol
+ * @s: BFD session
+ *
+ * Echo packets are sent with our echo address as both source and destination
+ * to the link-layer address of the neighbor, which forwards them back to us.
+ * Therefore they are sent through a raw socket with a prepared IP header.
+ */
+void
+bfd_send_echo(struct bfd_proto *p, struct bfd_session *s)
+{
+  sock *sk = s->ifa->esk;
+  ip_addr addr = s->echo_addr;
+  uint len = BFD_ECHO_HDR_LEN + BFD_ECHO_LEN;
+  uint ulen = 8 + BFD_ECHO_LEN;
+  byte *hdr = sk->tbuf;
+  byte *udp = hdr + BFD_ECHO_HDR_LEN - 8;
+  struct bfd_echo_packet *pkt = (void *) (udp + 8);
+  btime now = current_time();
+
+  if (sk->tbuf != sk->tpos)
+    log(L_WARN "%s: Old packet overwritten in TX buffer", p->p.name);
+
+  pkt->magic = htonl(BFD_ECHO_MAGIC);
+  pkt->seq = htonl(++s->echo_seq);
+  pkt->id = htonl(s->loc_id);
+  pkt->time_hi = htonl((u64) now >> 32);
+  pkt->time_lo = htonl((u32) now);
+
+  ipa_hton(addr);
+  put_u16(udp + 0, 49152 + (s->loc_id & 0x3fff));
+  put_u16(udp + 2, BFD_ECHO_PORT);
+  put_u16(udp + 4, ulen);
+  put_u16(udp + 6, 0);
+
+#ifndef IPV6
+  /* The kernel fills in ID and checksum, no UDP checksum is used */
+  memset(hdr, 0, 20);
+  hdr[0] = 0x45;
+  hdr[1] = IP_PREC_INTERNET_CONTROL;
+  put_u16(hdr + 2, len);
+  hdr[8] = 255;
+  hdr[9] = IPPROTO_UDP;
+  memcpy(hdr + 12, &addr, sizeof(ip_addr));
+  memcpy(hdr + 16, &addr, sizeof(ip_addr));
+#else
+  byte ph[40];
+  u16 sum;
+
+  put_u32(hdr, (6 << 28) | (IP_PREC_INTERNET_CONTROL << 20));
+  put_u16(hdr + 4, ulen);
+  hdr[6] = IPPROTO_UDP;
+  hdr[7] = 255;
+  memcpy(hdr + 8, &addr, sizeof(ip_addr));
+  memcpy(hdr + 24, &addr, sizeof(ip_addr));
+
+  /* UDP checksum is mandatory in IPv6 */
+  memcpy(ph, hdr + 8, 32);
+  put_u32(ph + 32, ulen);
+  put_u32(ph + 36, IPPROTO_UDP);
+  sum = ipsum_calculate(ph, sizeof(ph), udp, ulen, NULL);
+  memcpy(udp + 6, &sum, 2);
+  if (!sum)
+    put_u16(udp + 6, 0xffff);
+#endif
+
+  TRACE(D_PACKETS, "Sending echo %u to %I", s->echo_seq, s->addr);
+  sk_send_to(sk, len, s->addr, 0);
+}
+
+sock *
+bfd_open_echo_sk(struct bfd_shard *sh, struct iface *ifa)
+{
+  struct bfd_proto *p = sh->bfd;
+  sock *sk = sk_new(sh->tpool);
+  sk->type = SK_IP;
+  sk->dport = IPPROTO_RAW;	/* Implies prepared IP header */
+  sk->iface = ifa;
+  sk->data = sh;
+
+  sk->tbsize = BFD_ECHO_HDR_LEN + BFD_ECHO_LEN;
+  sk->err_hook = bfd_err_hook;
+
+  sk->priority = sk_priority_control;
+  sk->flags = SKF_THREAD;
+
+#ifdef IPV6
+  sk->flags |= SKF_V6ONLY;
+#endif
+
+  if (sk_open(sk) < 0)
+    goto err;
+
+  sk_start(sk);
+  return sk;
+
+ err:
+  sk_log_error(sk, p->p.name);
+  rfree(sk);
+  return NULL;
+}
@@ -0,0 +1,295 @@
+/*
+ *	BIRD -- BGP Adj-RIB-In
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Adj-RIB-In
+ *
+ * When the &import_table option is enabled, every route received from the
+ * neighbor is also stored in a per-session Adj-RIB-In before it passes the
+ * import filter. The table is a FIB of prefixes, each holding a list of
+ * routes (one per ADD-PATH path ID) which just reference the cached &rta
+ * shared with the routing table, so the overhead is mostly the FIB itself.
+ *
+ * When import filters change or the protocol is reloaded, bgp_adj_reload()
+ * walks the Adj-RIB-In in bounded steps from a low-priority event and
+ * feeds the stored routes through the import filter again, so no ROUTE-REFRESH
+ * round-trip to the neighbor is needed. The table lives for the duration of
+ * one established session.
+ *
+ * When a ROA table used by the import filter changes, bgp_adj_reload_partial()
+ * re-imports just routes for networks in the set of affected prefixes. Nets
+ * outside of the set are skipped by the same walk, which is much cheaper than
+ * running the filter, so the step is limited by a weighted cost.
+ */
+
+#undef LOCAL_DEBUG
+
+#include "nest/bird.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "lib/resource.h"
+#include "lib/event.h"
+#include "filter/filter.h"
+
+#include "bgp.h"
+
+#define BGP_ADJ_RELOAD_STEP	1024	/* Routes re-imported by one event run */
+#define BGP_ADJ_SKIP_COST	16	/* Skipped nets per one re-imported route */
+
+static void bgp_adj_reload_step(void *P);
+
+static void
+bgp_adj_init_net(struct fib_node *N)
+{
+  struct bgp_adj_net *n = (struct bgp_adj_net *) N;
+  n->routes = NULL;
+}
+
+/**
+ * bgp_adj_init - create an empty Adj-RIB-In
+ * @p: BGP instance
+ *
+ * The function is called when the session gets established and the
+ * &import_table option is enabled.
+ */
+void
+bgp_adj_init(struct bgp_proto *p)
+{
+  bgp_adj_free(p);
+
+  p->adj_pool = rp_new(p->p.pool, "Adj-RIB-In");
+  fib_init(&p->adj_fib, p->adj_pool, sizeof(struct bgp_adj_net), 0, bgp_adj_init_net);
+  p->adj_slab = sl_new(p->adj_pool, sizeof(struct bgp_adj_route));
+  p->adj_event = ev_new(p->adj_pool);
+  p->adj_event->hook = bgp_adj_reload_step;
+  p->adj_event->data = p;
+  p->adj_routes = 0;
+  p->adj_reloading = 0;
+  p->adj_reload_set = NULL;
+}
+
+static inline void
+bgp_adj_drop_set(struct bgp_proto *p)
+{
+  if (p->adj_reload_set)
+    prefix_set_unlock(p->adj_reload_set);
+
+  p->adj_reload_set = NULL;
+}
+
+/**
+ * bgp_adj_free - drop the Adj-RIB-In
+ * @p: BGP instance
+ *
+ * The function releases all stored routes and the table itself. It is
+ * called when the session leaves the established state.
+ */
+void
+bgp_adj_free(struct bgp_proto *p)
+{
+  if (!p->adj_pool)
+    return;
+
+  FIB_WALK(&p->adj_fib, fn)
+    {
+      struct bgp_adj_net *n = (struct bgp_adj_net *) fn;
+      struct bgp_adj_route *r;
+
+      for (r = n->routes; r; r = r->next)
+	rta_free(r->attrs);
+    }
+  FIB_WALK_END;
+
+  /* The reload iterator, event and FIB are all in the pool */
+  bgp_adj_drop_set(p);
+  rfree(p->adj_pool);
+  p->adj_pool = NULL;
+  p->adj_routes = 0;
+  p->adj_reloading = 0;
+}
+
+/**
+ * bgp_adj_update - store a received route
+ * @p: BGP instance
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ * @a: cached route attributes, the route source is taken from them
+ * @flags: route flags
+ *
+ * The route replaces a previously stored route with the same source.
+ */
+void
+bgp_adj_update(struct bgp_proto *p, ip_addr prefix, int pxlen, rta *a, u8 flags)
+{
+  struct bgp_adj_net *n = fib_get(&p->adj_fib, &prefix, pxlen);
+  struct bgp_adj_route *r;
+
+  for (r = n->routes; r; r = r->next)
+    if (r->attrs->src == a->src)
+      break;
+
+  if (!r)
+    {
+      r = sl_alloc(p->adj_slab);
+      r->next = n->routes;
+      r->attrs = NULL;
+      n->routes = r;
+      p->adj_routes++;
+    }
+
+  a = rta_clone(a);
+  rta_free(r->attrs);
+  r->attrs = a;
+  r->flags = flags;
+}
+
+/**
+ * bgp_adj_withdraw - remove a route from Adj-RIB-In
+ * @p: BGP instance
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ * @src: route source, may be NULL
+ */
+void
+bgp_adj_withdraw(struct bgp_proto *p, ip_addr prefix, int pxlen, struct rte_src *src)
+{
+  struct bgp_adj_net *n = fib_find(&p->adj_fib, &prefix, pxlen);
+  struct bgp_adj_route *r, **rr;
+
+  if (!n || !src)
+    return;
+
+  for (rr = &n->routes; r = *rr; rr = &r->next)
+    if (r->attrs->src == src)
+      {
+	*rr = r->next;
+	rta_free(r->attrs);
+	sl_free(p->adj_slab, r);
+	p->adj_routes--;
+	break;
+      }
+
+  if (!n->routes)
+    fib_delete(&p->adj_fib, n);
+}
+
+/**
+ * bgp_adj_reload - re-import routes from Adj-RIB-In
+ * @p: BGP instance
+ *
+ * The function schedules a walk over the Adj-RIB-In which passes all stored
+ * routes through the import filter again. A reload already in progress is
+ * restarted from the beginning.
+ *
+ * Result: 1 if the reload was scheduled, 0 if Adj-RIB-In is not available.
+ */
+int
+bgp_adj_reload(struct bgp_proto *p)
+{
+  if (!p->adj_pool)
+    return 0;
+
+  if (p->adj_reloading)
+    fit_get(&p->adj_fib, &p->adj_fit);
+
+  bgp_adj_drop_set(p);
+  FIB_ITERATE_INIT(&p->adj_fit, &p->adj_fib);
+  p->adj_reloading = 1;
+  ev_schedule_work(p->adj_event);
+  return 1;
+}
+
+/**
+ * bgp_adj_reload_partial - re-import routes for some networks from Adj-RIB-In
+ * @p: BGP instance
+ * @set: set of networks
+ *
+ * The function is like bgp_adj_reload(), but only routes for networks
+ * matching the prefix set @set are passed through the import filter. The set
+ * is locked until the reload is finished. As sets cannot be merged, a reload
+ * already in progress is restarted as a reload of the whole Adj-RIB-In.
+ *
+ * Result: 1 if the reload was scheduled, 0 if Adj-RIB-In is not available.
+ */
+int
+bgp_adj_reload_partial(struct bgp_proto *p, struct prefix_set *set)
+{
+  if (!p->adj_pool)
+    return 0;
+
+  if (p->adj_reloading)
+    return bgp_adj_reload(p);
+
+  prefix_set_lock(set);
+  p->adj_reload_set = set;
+  FIB_ITERATE_INIT(&p->adj_fit, &p->adj_fib);
+  p->adj_reloading = 1;
+  ev_schedule_work(p->adj_event);
+  return 1;
+}
+
+static void
+bgp_adj_reload_step(void *P)
+{
+  struct bgp_proto *p = P;
+  struct prefix_set *set = p->adj_reload_set;
+  struct rte_batch batch;
+  int max = BGP_ADJ_RELOAD_STEP * BGP_ADJ_SKIP_COST;
+
+  if (!p->adj_reloading)
+    return;
+
+  rte_batch_start(&batch, p->p.main_ahook);
+
+  FIB_ITERATE_START(&p->adj_fib, &p->adj_fit, fn)
+    {
+      struct bgp_adj_net *an = (struct bgp_adj_net *) fn;
+      struct bgp_adj_route *r;
+
+      if (max <= 0)
+	{
+	  FIB_ITERATE_PUT(&p->adj_fit, fn);
+	  rte_batch_end(&batch);
+	  ev_schedule_work(p->adj_event);
+	  return;
+	}
+
+      /* No continue here, FIB_ITERATE_END() moves to the next node */
+      if (set && !prefix_set_match(set, an->n.prefix, an->n.pxlen))
+	{
+	  max--;
+	  goto skip;
+	}
+
+      net *n = net_get(p->p.table, an->n.prefix, an->n.pxlen);
+      for (r = an->routes; r; r = r->next)
+	{
+	  /* Suppressed routes are re-imported when reused */
+	  if (p->damp_pool && bgp_damp_suppressed(p, an->n.prefix, an->n.pxlen, r->attrs->src->private_id))
+	    continue;
+
+	  rte *e = rte_get_temp(rta_clone(r->attrs));
+	  e->flags = r->flags;
+	  e->net = n;
+	  e->pflags = 0;
+	  e->u.bgp.suppressed = 0;
+	  rte_batch_update(&batch, n, e, r->attrs->src);
+	  max -= BGP_ADJ_SKIP_COST;
+	}
+    skip:;
+    }
+  FIB_ITERATE_END(fn);
+
+  rte_batch_end(&batch);
+  p->adj_reloading = 0;
+
+  if (set)
+    BGP_TRACE(D_EVENTS, "Affected routes reloaded from Adj-RIB-In");
+  else
+    BGP_TRACE(D_EVENTS, "Routes reloaded from Adj-RIB-In");
+
+  bgp_adj_drop_set(p);
+}
@@ -481,6 +481,22 @@ bgp_get_attr_len(eattr *a)
  */
 uint
 bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains)
+{
+  return bgp_encode_attrs_as4(p->as4_session, w, attrs, remains);
+}
+
+/**
+ * bgp_encode_attrs_as4 - encode BGP attributes without a session
+ * @as4: encode AS numbers as 4B
+ * @w: buffer
+ * @attrs: a list of extended attributes
+ * @remains: remaining space in the buffer
+ *
+ * This is bgp_encode_attrs() for users outside of an established session,
+ * like the MRT table dump, which only have to choose the AS number size.
+ */
+uint
+bgp_encode_attrs_as4(int as4, byte *w, ea_list *attrs, int remains)
 {
   uint i, code, type, flags;
   byte *start = w;
@@ -502,7 +518,7 @@ bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains)
        * we have to convert our 4B AS_PATH to 2B AS_PATH and send our AS_PATH
        * as optional AS4_PATH attribute.
        */
-      if ((code == BA_AS_PATH) && (! p->as4_session))
+      if ((code == BA_AS_PATH) && !as4)
 	{
 	  len = a->u.ptr->length;
 
@@ -544,7 +560,7 @@ bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains)
 	}
 
       /* The same issue with AGGREGATOR attribute */
-      if ((code == BA_AGGREGATOR) && (! p->as4_session))
+      if ((code == BA_AGGREGATOR) && !as4)
 	{
 	  int new_used;
 
@@ -643,11 +659,22 @@ bgp_compare_u32(const u32 *x, const u32 *y)
   return (*x < *y) ? -1 : (*x > *y) ? 1 : 0;
 }
 
-static inline void
+/* Sort and deduplicate @cnt values, @dest may be @src. Returns the new count. */
+static inline unsigned
 bgp_normalize_int_set(u32 *dest, u32 *src, unsigned cnt)
 {
-  memcpy(dest, src, sizeof(u32) * cnt);
+  unsigned i, j;
+
+  if (dest != src)
+    memcpy(dest, src, sizeof(u32) * cnt);
+
   qsort(dest, cnt, sizeof(u32), (int(*)(const void *, const void *)) bgp_compare_u32);
+
+  for (i = j = 0; i < cnt; i++)
+    if (!j || (dest[j-1] != dest[i]))
+      dest[j++] = dest[i];
+
+  return j;
 }
 
 static int
@@ -681,52 +708,30 @@ bgp_normalize_ec_set(struct adata *ad, u32 *src, int internal)
 
       ad->length = (t - dst) * 4;
     }
-  else
+  else if (dst != src)
     memcpy(dst, src, ad->length);
 
-  qsort(dst, ad->length / 8, 8, (int(*)(const void *, const void *)) bgp_compare_ec);
-}
+  int len = int_set_get_size(ad);
+  int i, j;
 
-static void
-bgp_rehash_buckets(struct bgp_proto *p)
-{
-  struct bgp_bucket **old = p->bucket_hash;
-  struct bgp_bucket **new;
-  unsigned oldn = p->hash_size;
-  unsigned i, e, mask;
-  struct bgp_bucket *b;
+  qsort(dst, len / 2, 8, (int(*)(const void *, const void *)) bgp_compare_ec);
 
-  p->hash_size = p->hash_limit;
-  DBG("BGP: Rehashing bucket table from %d to %d\n", oldn, p->hash_size);
-  p->hash_limit *= 4;
-  if (p->hash_limit >= 65536)
-    p->hash_limit = ~0;
-  new = p->bucket_hash = mb_allocz(p->p.pool, p->hash_size * sizeof(struct bgp_bucket *));
-  mask = p->hash_size - 1;
-  for (i=0; i<oldn; i++)
-    while (b = old[i])
+  for (i = j = 0; i < len; i += 2)
+    if (!j || (ec_get(dst, j-2) != ec_get(dst, i)))
       {
-	old[i] = b->hash_next;
-	e = b->hash & mask;
-	b->hash_next = new[e];
-	if (b->hash_next)
-	  b->hash_next->hash_prev = b;
-	b->hash_prev = NULL;
-	new[e] = b;
+	dst[j++] = dst[i];
+	dst[j++] = dst[i+1];
       }
-  mb_free(old);
+
+  ad->length = j * 4;
 }
 
-static struct bgp_bucket *
-bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
+/* Size of a flat copy of an attribute list made by bgp_copy_attrs() */
+static unsigned
+bgp_attrs_size(ea_list *new)
 {
-  struct bgp_bucket *b;
-  unsigned ea_size = sizeof(ea_list) + new->count * sizeof(eattr);
-  unsigned ea_size_aligned = BIRD_ALIGN(ea_size, CPU_STRUCT_ALIGN);
-  unsigned size = sizeof(struct bgp_bucket) + ea_size_aligned;
+  unsigned size = BIRD_ALIGN(sizeof(ea_list) + new->count * sizeof(eattr), CPU_STRUCT_ALIGN);
   unsigned i;
-  byte *dest;
-  unsigned index = hash & (p->hash_size - 1);
 
   /* Gather total size of non-inline attributes */
   for (i=0; i<new->count; i++)
@@ -736,23 +741,23 @@ bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
 	size += BIRD_ALIGN(sizeof(struct adata) + a->u.ptr->length, CPU_STRUCT_ALIGN);
     }
 
-  /* Create the bucket and hash it */
-  b = mb_alloc(p->p.pool, size);
-  b->hash_next = p->bucket_hash[index];
-  if (b->hash_next)
-    b->hash_next->hash_prev = b;
-  p->bucket_hash[index] = b;
-  b->hash_prev = NULL;
-  b->hash = hash;
-  add_tail(&p->bucket_queue, &b->send_node);
-  init_list(&b->prefixes);
-  memcpy(b->eattrs, new, ea_size);
-  dest = ((byte *)b->eattrs) + ea_size_aligned;
+  return size;
+}
+
+/* Copy an attribute list together with its non-inline values to @dst */
+static void
+bgp_copy_attrs(ea_list *dst, ea_list *new)
+{
+  unsigned ea_size = sizeof(ea_list) + new->count * sizeof(eattr);
+  byte *dest = ((byte *) dst) + BIRD_ALIGN(ea_size, CPU_STRUCT_ALIGN);
+  unsigned i;
+
+  memcpy(dst, new, ea_size);
 
   /* Copy values of non-inline attributes */
   for (i=0; i<new->count; i++)
     {
-      eattr *a = &b->eattrs->attrs[i];
+      eattr *a = &dst->attrs[i];
       if (!(a->type & EAF_EMBEDDED))
 	{
 	  struct adata *oa = a->u.ptr;
@@ -762,11 +767,24 @@ bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
 	  dest += BIRD_ALIGN(sizeof(struct adata) + na->length, CPU_STRUCT_ALIGN);
 	}
     }
+}
 
-  /* If needed, rehash */
-  p->hash_count++;
-  if (p->hash_count > p->hash_limit)
-    bgp_rehash_buckets(p);
+static struct bgp_bucket *
+bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
+{
+  struct bgp_bucket *b;
+  unsigned size = sizeof(struct bgp_bucket) + bgp_attrs_size(new);
+
+  /* Create the bucket and hash it */
+  b = mb_alloc(p->p.pool, size);
+  b->hash = hash;
+  b->enc = NULL;
+  b->sent = 0;
+  b->urgent = 0;
+  add_tail(&p->bucket_queue, &b->send_node);
+  init_list(&b->prefixes);
+  bgp_copy_attrs(b->eattrs, new);
+  oa_hash_insert(&p->bucket_hash.t, hash, b);
 
   return b;
 }
@@ -816,21 +834,22 @@ bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
       switch (d->type & EAF_TYPE_MASK)
 	{
 	case EAF_TYPE_INT_SET:
-	  {
-	    struct adata *z = alloca(sizeof(struct adata) + d->u.ptr->length);
-	    z->length = d->u.ptr->length;
-	    bgp_normalize_int_set((u32 *) z->data, (u32 *) d->u.ptr->data, z->length / 4);
-	    d->u.ptr = z;
-	    break;
-	  }
+	  if (!int_set_normalized(d->u.ptr))
+	    {
+	      struct adata *z = alloca(sizeof(struct adata) + d->u.ptr->length);
+	      z->length = 4 * bgp_normalize_int_set((u32 *) z->data, (u32 *) d->u.ptr->data, d->u.ptr->length / 4);
+	      d->u.ptr = z;
+	    }
+	  break;
 	case EAF_TYPE_EC_SET:
-	  {
-	    struct adata *z = alloca(sizeof(struct adata) + d->u.ptr->length);
-	    z->length = d->u.ptr->length;
-	    bgp_normalize_ec_set(z, (u32 *) d->u.ptr->data, p->is_internal);
-	    d->u.ptr = z;
-	    break;
-	  }
+	  if (!p->is_internal || !ec_set_normalized(d->u.ptr))
+	    {
+	      struct adata *z = alloca(sizeof(struct adata) + d->u.ptr->length);
+	      z->length = d->u.ptr->length;
+	      bgp_normalize_ec_set(z, (u32 *) d->u.ptr->data, p->is_internal);
+	      d->u.ptr = z;
+	    }
+	  break;
 	default: ;
 	}
       d++;
@@ -839,8 +858,8 @@ bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
 
   /* Hash */
   hash = ea_hash(new);
-  for(b=p->bucket_hash[hash & (p->hash_size - 1)]; b; b=b->hash_next)
-    if (b->hash == hash && ea_same(b->eattrs, new))
+  OA_HASH_WALK_HASH(p->bucket_hash, hash, b)
+    if (ea_same(b->eattrs, new))
       {
 	DBG("Found bucket.\n");
 	return b;
@@ -870,16 +889,123 @@ bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
 void
 bgp_free_bucket(struct bgp_proto *p, struct bgp_bucket *buck)
 {
-  if (buck->hash_next)
-    buck->hash_next->hash_prev = buck->hash_prev;
-  if (buck->hash_prev)
-    buck->hash_prev->hash_next = buck->hash_next;
-  else
-    p->bucket_hash[buck->hash & (p->hash_size-1)] = buck->hash_next;
+  oa_hash_remove(&p->bucket_hash.t, buck->hash, buck);
+  if (buck->enc)
+    bgp_release_enc_attrs(buck->enc);
   mb_free(buck);
 }
 
 
+/*
+ *	Cache of encoded attribute blocks
+ *
+ *	Buckets with the same attributes are usually present in many BGP
+ *	instances, especially when they are members of the same export group.
+ *	The wire form of the attributes depends only on the attributes and on
+ *	whether the session uses 4B AS numbers, so it is encoded once, kept in
+ *	a global hash table and shared by all buckets with the same key. Each
+ *	bucket holds a reference to its entry, which is freed when the last
+ *	bucket goes away.
+ */
+
+struct bgp_enc_attrs {
+  struct bgp_enc_attrs *next;		/* Next in hash chain */
+  ea_list *attrs;			/* Private copy of the attributes */
+  u32 hash;				/* Hash over the attributes, same as bucket hash */
+  u16 len;				/* Length of encoded block */
+  u8 as4;				/* Encoded for 4B AS session */
+  uint uc;				/* Number of buckets using this entry */
+  byte data[0];				/* Encoded attributes */
+};
+
+#define BEA_KEY(n)		n->attrs, n->hash, n->as4
+#define BEA_NEXT(n)		n->next
+#define BEA_EQ(a1,h1,s1,a2,h2,s2) h1 == h2 && s1 == s2 && ea_same(a1, a2)
+#define BEA_FN(a,h,s)		(h ^ s)
+
+#define BEA_REHASH		bgp_enc_rehash
+#define BEA_PARAMS		/8, *2, 2, 2, 8, 20
+
+static HASH(struct bgp_enc_attrs) bgp_enc_hash;
+static pool *bgp_enc_pool;
+
+HASH_DEFINE_REHASH_FN(BEA, struct bgp_enc_attrs)
+
+/**
+ * bgp_bucket_attrs - get encoded attributes of a bucket
+ * @p: BGP instance
+ * @buck: bucket
+ * @data: returned pointer to the encoded block
+ *
+ * This function returns the attributes of @buck in their BGP representation
+ * for the session of @p. The encoded block is taken from the cache if
+ * available, otherwise it is generated by bgp_encode_attrs() and cached.
+ * The block stays valid until the bucket is freed.
+ *
+ * Result: Length of the attribute block or -1 if it is too long.
+ */
+int
+bgp_bucket_attrs(struct bgp_proto *p, struct bgp_bucket *buck, byte **data)
+{
+  static byte buf[BGP_MAX_ATTRS_LENGTH];
+  struct bgp_enc_attrs *e = buck->enc;
+  u8 as4 = !!p->as4_session;
+  int len;
+
+  if (e && (e->as4 == as4))
+    goto found;
+
+  if (e)
+    bgp_release_enc_attrs(e);
+  buck->enc = NULL;
+
+  if (!bgp_enc_pool)
+    {
+      bgp_enc_pool = rp_new(&root_pool, "BGP attribute cache");
+      HASH_INIT(bgp_enc_hash, bgp_enc_pool, 10);
+    }
+
+  e = HASH_FIND(bgp_enc_hash, BEA, buck->eattrs, buck->hash, as4);
+  if (e)
+    {
+      e->uc++;
+      goto cached;
+    }
+
+  len = bgp_encode_attrs(p, buf, buck->eattrs, BGP_MAX_ATTRS_LENGTH);
+  if (len < 0)
+    return -1;
+
+  uint size = BIRD_ALIGN(sizeof(struct bgp_enc_attrs) + len, CPU_STRUCT_ALIGN);
+  e = mb_alloc(bgp_enc_pool, size + bgp_attrs_size(buck->eattrs));
+  e->attrs = (ea_list *) (((byte *) e) + size);
+  bgp_copy_attrs(e->attrs, buck->eattrs);
+  e->hash = buck->hash;
+  e->len = len;
+  e->as4 = as4;
+  e->uc = 1;
+  memcpy(e->data, buf, len);
+  HASH_INSERT2(bgp_enc_hash, BEA, bgp_enc_pool, e);
+
+ cached:
+  buck->enc = e;
+
+ found:
+  *data = e->data;
+  return e->len;
+}
+
+void
+bgp_release_enc_attrs(struct bgp_enc_attrs *e)
+{
+  if (--e->uc)
+    return;
+
+  HASH_REMOVE2(bgp_enc_hash, BEA, bgp_enc_pool, e);
+  mb_free(e);
+}
+
+
 /* Prefix hash table */
 
 #define PXH_KEY(n1)		n1->n.prefix, n1->n.pxlen, n1->path_id
@@ -952,6 +1078,7 @@ bgp_rt_notify(struct proto *P, rtable *tbl UNUSED, net *n, rte *new, rte *old UN
       if (!(buck = p->withdraw_bucket))
 	{
 	  buck = p->withdraw_bucket = mb_alloc(P->pool, sizeof(struct bgp_bucket));
+	  buck->enc = NULL;
 	  init_list(&buck->prefixes);
 	}
     }
@@ -963,6 +1090,16 @@ bgp_rt_notify(struct proto *P, rtable *tbl UNUSED, net *n, rte *new, rte *old UN
       rem_node(&px->bucket_node);
     }
   add_tail(&buck->prefixes, &px->bucket_node);
+
+  /* Changes outside of a feed go ahead of bulk updates */
+  if (new && !buck->urgent && (P->export_state != ES_FEEDING))
+    {
+      rem_node(&buck->send_node);
+      add_tail(&p->bucket_urgent, &buck->send_node);
+      buck->sent = 0;
+      buck->urgent = 1;
+    }
+
   bgp_schedule_packet(p->conn, PKT_UPDATE);
 }
 
@@ -1054,7 +1191,7 @@ static inline void
 bgp_cluster_list_prepend(rte *e, ea_list **attrs, struct linpool *pool, u32 cid)
 {
   eattr *a = ea_find(e->attrs->eattrs, EA_CODE(EAP_BGP, BA_CLUSTER_LIST));
-  bgp_attach_attr(attrs, pool, BA_CLUSTER_LIST, (uintptr_t) int_set_add(pool, a ? a->u.ptr : NULL, cid));
+  bgp_attach_attr(attrs, pool, BA_CLUSTER_LIST, (uintptr_t) int_set_prepend(pool, a ? a->u.ptr : NULL, cid));
 }
 
 static int
@@ -1128,25 +1265,36 @@ bgp_update_attrs(struct bgp_proto *p, rte *e, ea_list **attrs, struct linpool *p
   return 0;				/* Leave decision to the filters */
 }
 
+static int
+bgp_rte_stale(rte *e)
+{
+  eattr *a;
+
+  if (rta_is_cached(e->attrs))
+    return e->attrs->keys.stale;
+
+  a = ea_find(e->attrs->eattrs, EA_CODE(EAP_BGP, BA_COMMUNITY));
+  return a && int_set_contains(a->u.ptr, BGP_COMM_LLGR_STALE);
+}
+
 static int
 bgp_community_filter(struct bgp_proto *p, rte *e)
 {
+  static const u32 comms[] = { BGP_COMM_NO_ADVERTISE, BGP_COMM_NO_EXPORT, BGP_COMM_NO_EXPORT_SUBCONFED };
   eattr *a;
-  struct adata *d;
+  u32 m;
 
   /* Check if we aren't forbidden to export the route by communities */
   a = ea_find(e->attrs->eattrs, EA_CODE(EAP_BGP, BA_COMMUNITY));
   if (a)
     {
-      d = a->u.ptr;
-      if (int_set_contains(d, BGP_COMM_NO_ADVERTISE))
+      m = int_set_match(a->u.ptr, comms, 3);
+      if (m & 1)
 	{
 	  DBG("\tNO_ADVERTISE\n");
 	  return 1;
 	}
-      if (!p->is_internal &&
-	  (int_set_contains(d, BGP_COMM_NO_EXPORT) ||
-	   int_set_contains(d, BGP_COMM_NO_EXPORT_SUBCONFED)))
+      if (!p->is_internal && (m & 6))
 	{
 	  DBG("\tNO_EXPORT\n");
 	  return 1;
@@ -1166,6 +1314,10 @@ bgp_import_control(struct proto *P, rte **new, ea_list **attrs, struct linpool *
 
   if (p == new_bgp)			/* Poison reverse updates */
     return -1;
+  if (p->orf && !bgp_orf_permitted(p, e->net->n.prefix, e->net->n.pxlen)) /* Not asked for by prefix ORF */
+    return -1;
+  if (!new_bgp && (e->attrs->source == RTS_BGP))	/* Stale routes restored from a snapshot */
+    return -1;
   if (new_bgp)
     {
       /* We should check here for cluster list loop, because the receiving BGP instance
@@ -1176,6 +1328,10 @@ bgp_import_control(struct proto *P, rte **new, ea_list **attrs, struct linpool *
       if (p->cf->interpret_communities && bgp_community_filter(p, e))
 	return -1;
 
+      /* Long-lived stale routes are sent only to LLGR-aware neighbors [RFC 9494 4.5] */
+      if ((!p->conn || !p->conn->peer_llgr_aware) && bgp_rte_stale(e))
+	return -1;
+
       /* Add default filter by role and attribute */
       int prefix_role = ROLE_UNDE;
       if (p->cf->role == ROLE_COMP) prefix_role = rm_run(p->cf->role_map, e->net);
@@ -1204,23 +1360,135 @@ bgp_import_control(struct proto *P, rte **new, ea_list **attrs, struct linpool *
     return bgp_create_attrs(p, e, attrs, pool);
 }
 
-static inline u32
-bgp_get_neighbor(rte *r)
+static inline int
+rta_resolvable(rta *a)
 {
-  eattr *e = ea_find(r->attrs->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
-  u32 as;
-
-  if (e && as_path_get_first(e->u.ptr, &as))
-    return as;
-  else
-    return ((struct bgp_proto *) r->attrs->src->proto)->remote_as;
+  int rd = a->dest;
+  return (rd == RTD_ROUTER) || (rd == RTD_DEVICE) || (rd == RTD_MULTIPATH);
 }
 
 static inline int
 rte_resolvable(rte *rt)
 {
-  int rd = rt->attrs->dest;
-  return (rd == RTD_ROUTER) || (rd == RTD_DEVICE) || (rd == RTD_MULTIPATH);
+  return rta_resolvable(rt->attrs);
+}
+
+/*
+ * The rank packs the decision steps from LLGR stale check to ORIGIN, so they
+ * are usually decided by one comparison in bgp_rte_better(). The lowest bit
+ * records whether AS_PATH length is included, the rank is not usable when it
+ * differs for compared routes.
+ */
+#define BGP_RANK_NOT_STALE	(1ULL << 63)
+#define BGP_RANK_RESOLVABLE	(1ULL << 62)
+#define BGP_RANK_PREF(x)	((u64) (x) << 30)
+#define BGP_RANK_LENGTH(x)	((u64) (AS_PATH_MAXLEN - (x)) << 14)
+#define BGP_RANK_ORIGIN(x)	((u64) (3 - MIN(x, 3)) << 12)
+#define BGP_RANK_CPL		1ULL
+
+static void
+bgp_fill_keys(rta *a, struct rta_keys *k)
+{
+  struct bgp_proto *p = (struct bgp_proto *) a->src->proto;
+  eattr *e;
+  u32 as;
+
+  e = ea_find(a->eattrs, EA_CODE(EAP_BGP, BA_LOCAL_PREF));
+  k->pref = e ? e->u.data : p->cf->default_local_pref;
+
+  e = ea_find(a->eattrs, EA_CODE(EAP_BGP, BA_MULTI_EXIT_DISC));
+  k->metric = e ? e->u.data : p->cf->default_med;
+
+  e = ea_find(a->eattrs, EA_CODE(EAP_BGP, BA_ORIGIN));
+  k->origin = e ? e->u.data : ORIGIN_INCOMPLETE;
+
+  e = ea_find(a->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
+  k->length = e ? MIN(as_path_getlen(e->u.ptr), AS_PATH_MAXLEN) : AS_PATH_MAXLEN;
+  k->neighbor = (e && as_path_get_first(e->u.ptr, &as)) ? as : p->remote_as;
+
+  e = ea_find(a->eattrs, EA_CODE(EAP_BGP, BA_COMMUNITY));
+  k->stale = e && int_set_contains(e->u.ptr, BGP_COMM_LLGR_STALE);
+
+  e = ea_find(a->eattrs, EA_CODE(EAP_BGP, BA_ORIGINATOR_ID));
+  k->originator = e ? e->u.data : 0;
+
+  e = ea_find(a->eattrs, EA_CODE(EAP_BGP, BA_CLUSTER_LIST));
+  k->hops = e ? MIN(int_set_get_size(e->u.ptr), 0xffff) : 0;
+
+  k->rank = (k->stale ? 0 : BGP_RANK_NOT_STALE) |
+    (rta_resolvable(a) ? BGP_RANK_RESOLVABLE : 0) |
+    BGP_RANK_PREF(k->pref) | BGP_RANK_ORIGIN(k->origin);
+
+  if (p->cf->compare_path_lengths)
+    k->rank |= BGP_RANK_LENGTH(k->length) | BGP_RANK_CPL;
+}
+
+/**
+ * bgp_rta_prepare - fill decision keys of a cached rta
+ * @a: rta entering the attribute cache
+ *
+ * The keys are used by bgp_rte_better() and friends instead of looking up
+ * the attributes each time two routes are compared. Missing attributes are
+ * replaced by defaults of the originating BGP instance.
+ */
+void
+bgp_rta_prepare(rta *a)
+{
+  bgp_fill_keys(a, &a->keys);
+}
+
+/**
+ * bgp_rte_modify_stale - convert a stale route to long-lived stale
+ * @r: stale route in the routing table
+ * @pool: linpool for temporary data
+ *
+ * This is the rte_modify() hook called from rt_modify_stale() when a neighbor
+ * enters the long-lived stale phase. Routes with NO_LLGR community are removed,
+ * other routes get LLGR_STALE community [RFC 9494 4.3]. As the community is a
+ * part of cached attributes, routes sharing attributes share the conversion.
+ */
+rte *
+bgp_rte_modify_stale(rte *r, struct linpool *pool)
+{
+  static const u32 comms[] = { BGP_COMM_NO_LLGR, BGP_COMM_LLGR_STALE };
+  eattr *a = ea_find(r->attrs->eattrs, EA_CODE(EAP_BGP, BA_COMMUNITY));
+  struct adata *d = a ? a->u.ptr : NULL;
+  u32 m = int_set_match(d, comms, 2);
+
+  if (m & 1)
+    return NULL;
+
+  if (m & 2)
+    return r;
+
+  /* The original route keeps its rta until it is replaced */
+  rte *e = rte_do_cow(r);
+  rta_free(e->attrs);
+  e->attrs = rta_do_cow(r->attrs, pool);
+  bgp_attach_attr(&e->attrs->eattrs, pool, BA_COMMUNITY,
+		  (uintptr_t) int_set_add(pool, d, BGP_COMM_LLGR_STALE));
+
+  return e;
+}
+
+static inline struct rta_keys *
+bgp_rte_keys(rte *r, struct rta_keys *tmp)
+{
+  rta *a = r->attrs;
+
+  if (a->aflags & RTAF_CACHED)
+    return &a->keys;
+
+  /* Temporary rta's do not have the keys computed */
+  bgp_fill_keys(a, tmp);
+  return tmp;
+}
+
+static inline u32
+bgp_get_neighbor(rte *r)
+{
+  struct rta_keys tmp;
+  return bgp_rte_keys(r, &tmp)->neighbor;
 }
 
 int
@@ -1228,7 +1496,9 @@ bgp_rte_better(rte *new, rte *old)
 {
   struct bgp_proto *new_bgp = (struct bgp_proto *) new->attrs->src->proto;
   struct bgp_proto *old_bgp = (struct bgp_proto *) old->attrs->src->proto;
-  eattr *x, *y;
+  struct rta_keys ntmp, otmp;
+  struct rta_keys *nk = bgp_rte_keys(new, &ntmp);
+  struct rta_keys *ok = bgp_rte_keys(old, &otmp);
   u32 n, o;
 
   /* Skip suppressed routes (see bgp_rte_recalculate()) */
@@ -1239,6 +1509,23 @@ bgp_rte_better(rte *new, rte *old)
   if (n < o)
     return 1;
 
+  /* Steps up to ORIGIN are in the rank, see bgp_fill_keys() */
+  if (!((nk->rank ^ ok->rank) & BGP_RANK_CPL))
+    {
+      if (nk->rank != ok->rank)
+	return nk->rank > ok->rank;
+
+      goto med;
+    }
+
+  /* Long-lived stale routes are the least preferred [RFC 9494 4.3] */
+  n = nk->stale;
+  o = ok->stale;
+  if (n > o)
+    return 0;
+  if (n < o)
+    return 1;
+
   /* RFC 4271 9.1.2.1. Route resolvability test */
   n = rte_resolvable(new);
   o = rte_resolvable(old);
@@ -1248,10 +1535,8 @@ bgp_rte_better(rte *new, rte *old)
     return 0;
 
   /* Start with local preferences */
-  x = ea_find(new->attrs->eattrs, EA_CODE(EAP_BGP, BA_LOCAL_PREF));
-  y = ea_find(old->attrs->eattrs, EA_CODE(EAP_BGP, BA_LOCAL_PREF));
-  n = x ? x->u.data : new_bgp->cf->default_local_pref;
-  o = y ? y->u.data : old_bgp->cf->default_local_pref;
+  n = nk->pref;
+  o = ok->pref;
   if (n > o)
     return 1;
   if (n < o)
@@ -1260,10 +1545,8 @@ bgp_rte_better(rte *new, rte *old)
   /* RFC 4271 9.1.2.2. a)  Use AS path lengths */
   if (new_bgp->cf->compare_path_lengths || old_bgp->cf->compare_path_lengths)
     {
-      x = ea_find(new->attrs->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
-      y = ea_find(old->attrs->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
-      n = x ? as_path_getlen(x->u.ptr) : AS_PATH_MAXLEN;
-      o = y ? as_path_getlen(y->u.ptr) : AS_PATH_MAXLEN;
+      n = nk->length;
+      o = ok->length;
       if (n < o)
 	return 1;
       if (n > o)
@@ -1271,15 +1554,14 @@ bgp_rte_better(rte *new, rte *old)
     }
 
   /* RFC 4271 9.1.2.2. b) Use origins */
-  x = ea_find(new->attrs->eattrs, EA_CODE(EAP_BGP, BA_ORIGIN));
-  y = ea_find(old->attrs->eattrs, EA_CODE(EAP_BGP, BA_ORIGIN));
-  n = x ? x->u.data : ORIGIN_INCOMPLETE;
-  o = y ? y->u.data : ORIGIN_INCOMPLETE;
+  n = nk->origin;
+  o = ok->origin;
   if (n < o)
     return 1;
   if (n > o)
     return 0;
 
+ med:
   /* RFC 4271 9.1.2.2. c) Compare MED's */
   /* Proper RFC 4271 path selection cannot be interpreted as finding
    * the best path in some ordering. It is implemented partially in
@@ -1292,12 +1574,10 @@ bgp_rte_better(rte *new, rte *old)
    * probably not a big issue.
    */
   if (new_bgp->cf->med_metric || old_bgp->cf->med_metric ||
-      (bgp_get_neighbor(new) == bgp_get_neighbor(old)))
+      (nk->neighbor == ok->neighbor))
     {
-      x = ea_find(new->attrs->eattrs, EA_CODE(EAP_BGP, BA_MULTI_EXIT_DISC));
-      y = ea_find(old->attrs->eattrs, EA_CODE(EAP_BGP, BA_MULTI_EXIT_DISC));
-      n = x ? x->u.data : new_bgp->cf->default_med;
-      o = y ? y->u.data : old_bgp->cf->default_med;
+      n = nk->metric;
+      o = ok->metric;
       if (n < o)
 	return 1;
       if (n > o)
@@ -1320,10 +1600,8 @@ bgp_rte_better(rte *new, rte *old)
 
   /* RFC 4271 9.1.2.2. f) Compare BGP identifiers */
   /* RFC 4456 9. a) Use ORIGINATOR_ID instead of local neighor ID */
-  x = ea_find(new->attrs->eattrs, EA_CODE(EAP_BGP, BA_ORIGINATOR_ID));
-  y = ea_find(old->attrs->eattrs, EA_CODE(EAP_BGP, BA_ORIGINATOR_ID));
-  n = x ? x->u.data : new_bgp->remote_id;
-  o = y ? y->u.data : old_bgp->remote_id;
+  n = nk->originator ? : new_bgp->remote_id;
+  o = ok->originator ? : old_bgp->remote_id;
 
   /* RFC 5004 - prefer older routes */
   /* (if both are external and from different peer) */
@@ -1338,10 +1616,8 @@ bgp_rte_better(rte *new, rte *old)
     return 0;
 
   /* RFC 4456 9. b) Compare cluster list lengths */
-  x = ea_find(new->attrs->eattrs, EA_CODE(EAP_BGP, BA_CLUSTER_LIST));
-  y = ea_find(old->attrs->eattrs, EA_CODE(EAP_BGP, BA_CLUSTER_LIST));
-  n = x ? int_set_get_size(x->u.ptr) : 0;
-  o = y ? int_set_get_size(y->u.ptr) : 0;
+  n = nk->hops;
+  o = ok->hops;
   if (n < o)
     return 1;
   if (n > o)
@@ -1357,32 +1633,42 @@ bgp_rte_mergable(rte *pri, rte *sec)
 {
   struct bgp_proto *pri_bgp = (struct bgp_proto *) pri->attrs->src->proto;
   struct bgp_proto *sec_bgp = (struct bgp_proto *) sec->attrs->src->proto;
-  eattr *x, *y;
+  struct rta_keys ptmp, stmp;
+  struct rta_keys *pk = bgp_rte_keys(pri, &ptmp);
+  struct rta_keys *sk = bgp_rte_keys(sec, &stmp);
   u32 p, s;
 
   /* Skip suppressed routes (see bgp_rte_recalculate()) */
   if (pri->u.bgp.suppressed != sec->u.bgp.suppressed)
     return 0;
 
+  /* Steps up to ORIGIN are in the rank, see bgp_fill_keys() */
+  if (!((pk->rank ^ sk->rank) & BGP_RANK_CPL))
+    {
+      if ((pk->rank != sk->rank) || !(sk->rank & BGP_RANK_RESOLVABLE))
+	return 0;
+
+      goto med;
+    }
+
+  if (pk->stale != sk->stale)
+    return 0;
+
   /* RFC 4271 9.1.2.1. Route resolvability test */
   if (!rte_resolvable(sec))
     return 0;
 
   /* Start with local preferences */
-  x = ea_find(pri->attrs->eattrs, EA_CODE(EAP_BGP, BA_LOCAL_PREF));
-  y = ea_find(sec->attrs->eattrs, EA_CODE(EAP_BGP, BA_LOCAL_PREF));
-  p = x ? x->u.data : pri_bgp->cf->default_local_pref;
-  s = y ? y->u.data : sec_bgp->cf->default_local_pref;
+  p = pk->pref;
+  s = sk->pref;
   if (p != s)
     return 0;
 
   /* RFC 4271 9.1.2.2. a)  Use AS path lengths */
   if (pri_bgp->cf->compare_path_lengths || sec_bgp->cf->compare_path_lengths)
     {
-      x = ea_find(pri->attrs->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
-      y = ea_find(sec->attrs->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
-      p = x ? as_path_getlen(x->u.ptr) : AS_PATH_MAXLEN;
-      s = y ? as_path_getlen(y->u.ptr) : AS_PATH_MAXLEN;
+      p = pk->length;
+      s = sk->length;
 
       if (p != s)
 	return 0;
@@ -1392,21 +1678,18 @@ bgp_rte_mergable(rte *pri, rte *sec)
     }
 
   /* RFC 4271 9.1.2.2. b) Use origins */
-  x = ea_find(pri->attrs->eattrs, EA_CODE(EAP_BGP, BA_ORIGIN));
-  y = ea_find(sec->attrs->eattrs, EA_CODE(EAP_BGP, BA_ORIGIN));
-  p = x ? x->u.data : ORIGIN_INCOMPLETE;
-  s = y ? y->u.data : ORIGIN_INCOMPLETE;
+  p = pk->origin;
+  s = sk->origin;
   if (p != s)
     return 0;
 
+ med:
   /* RFC 4271 9.1.2.2. c) Compare MED's */
   if (pri_bgp->cf->med_metric || sec_bgp->cf->med_metric ||
-      (bgp_get_neighbor(pri) == bgp_get_neighbor(sec)))
+      (pk->neighbor == sk->neighbor))
     {
-      x = ea_find(pri->attrs->eattrs, EA_CODE(EAP_BGP, BA_MULTI_EXIT_DISC));
-      y = ea_find(sec->attrs->eattrs, EA_CODE(EAP_BGP, BA_MULTI_EXIT_DISC));
-      p = x ? x->u.data : pri_bgp->cf->default_med;
-      s = y ? y->u.data : sec_bgp->cf->default_med;
+      p = pk->metric;
+      s = sk->metric;
       if (p != s)
 	return 0;
     }
@@ -1840,6 +2123,12 @@ bgp_decode_attrs(struct bgp_conn *conn, byte *attr, uint len, struct linpool *po
 	    u32 *z = (u32 *) ad->data;
 	    for(i=0; i<ad->length/4; i++)
 	      z[i] = ntohl(z[i]);
+
+	    /* Communities are kept normalized, see nest/a-set.c */
+	    if ((code == BA_COMMUNITY) && !int_set_normalized(ad))
+	      ad->length = 4 * bgp_normalize_int_set(z, z, ad->length / 4);
+	    if ((code == BA_EXT_COMMUNITY) && !ec_set_normalized(ad))
+	      bgp_normalize_ec_set(ad, z, 1);
 	    break;
 	  }
 	}
@@ -1934,14 +2223,38 @@ bgp_get_attr(eattr *a, byte *buf, int buflen)
 void
 bgp_init_bucket_table(struct bgp_proto *p)
 {
-  p->hash_size = 256;
-  p->hash_limit = p->hash_size * 4;
-  p->bucket_hash = mb_allocz(p->p.pool, p->hash_size * sizeof(struct bgp_bucket *));
+  OA_HASH_INIT(p->bucket_hash, p->p.pool, 8);
   init_list(&p->bucket_queue);
+  init_list(&p->bucket_urgent);
   p->withdraw_bucket = NULL;
   // fib_init(&p->prefix_fib, p->p.pool, sizeof(struct bgp_prefix), 0, bgp_init_prefix);
 }
 
+/**
+ * bgp_free_bucket_table - release cached encodings of all buckets
+ * @p: BGP instance
+ *
+ * Buckets themselves are left to be freed with the protocol pool, but
+ * their references to the shared encoding cache have to be dropped.
+ */
+void
+bgp_free_bucket_table(struct bgp_proto *p)
+{
+  struct bgp_bucket *b;
+
+  if (!p->bucket_hash.t.data)
+    return;
+
+  OA_HASH_WALK(p->bucket_hash, b)
+    if (b->enc)
+      {
+	bgp_release_enc_attrs(b->enc);
+	b->enc = NULL;
+      }
+
+  OA_HASH_FREE(p->bucket_hash);
+}
+
 void
 bgp_get_route_info(rte *e, byte *buf, ea_list *attrs)
 {
@@ -61,6 +61,22 @@
  * point of view and therefore maintaining received routes. Routing table
  * refresh cycle (rt_refresh_begin(), rt_refresh_end()) is used for removing
  * stale routes after reestablishment of BGP session during graceful restart.
+ *
+ * Long-lived graceful restart (RFC 9494) extends the receiving role. When the
+ * restart timer expires, stale routes are not flushed but kept for the
+ * long-lived stale time. They are converted in bulk by rt_modify_stale(),
+ * which calls bgp_rte_modify_stale() for each of them from the time-sliced
+ * prune loop, without running filters. The LLGR_STALE community is attached
+ * to the routes, so they are considered worst by bgp_rte_better() and
+ * announced as stale to other neighbors.
+ *
+ * Established sessions may be handed off to a new BIRD process (see
+ * sysdep/unix/handoff.c). The old process passes the listening socket and
+ * sockets of sessions with their negotiated parameters and unprocessed data
+ * by bgp_handoff(), the new one continues them by bgp_adopt() without
+ * any exchange of OPEN messages. Received routes are not passed, they are
+ * requested again by route refresh, therefore only sessions with neighbors
+ * supporting it are handed off.
  */
 
 #undef LOCAL_DEBUG
@@ -75,6 +91,8 @@
 #include "lib/socket.h"
 #include "lib/resource.h"
 #include "lib/string.h"
+#include "lib/unix.h"
+#include "filter/filter.h"
 
 #include "bgp.h"
 
@@ -82,12 +100,27 @@
 struct linpool *bgp_linpool;		/* Global temporary pool */
 static sock *bgp_listen_sk;		/* Global listening socket */
 static int bgp_counter;			/* Number of protocol instances using the listening socket */
+static list bgp_export_groups;		/* List of active export groups (struct bgp_export_group) */
+
+#define BPH_KEY(n)		n->cf->remote_ip
+#define BPH_NEXT(n)		n->next_peer
+#define BPH_EQ(a1,a2)		ipa_equal(a1, a2)
+#define BPH_FN(a)		ipa_hash32(a)
+
+#define BPH_REHASH		bgp_peer_rehash
+#define BPH_PARAMS		/8, *2, 2, 2, 6, 20
+
+HASH_DEFINE_REHASH_FN(BPH, struct bgp_proto)
+
+static HASH(struct bgp_proto) bgp_peer_hash;	/* Running instances by neighbor address */
 
 static void bgp_close(struct bgp_proto *p, int apply_md5);
 static void bgp_connect(struct bgp_proto *p);
 static void bgp_active(struct bgp_proto *p);
 static sock *bgp_setup_listen_sk(ip_addr addr, unsigned port, u32 flags);
 static void bgp_update_bfd(struct bgp_proto *p, int use_bfd);
+static void bgp_long_lived_stale_begin(struct bgp_proto *p);
+static int bgp_adopt(struct bgp_proto *p);
 
 
 /**
@@ -144,6 +177,9 @@ bgp_startup(struct bgp_proto *p)
   BGP_TRACE(D_EVENTS, "Started");
   p->start_state = p->cf->capabilities ? BSS_CONNECT : BSS_CONNECT_NOCAP;
 
+  if (p->handoff && bgp_adopt(p))
+    return;
+
   if (!p->cf->passive)
     bgp_active(p);
 }
@@ -239,6 +275,8 @@ bgp_close_conn(struct bgp_conn *conn)
 
   DBG("BGP: Closing connection\n");
   conn->packets_to_send = 0;
+  bgp_rx_thread_stop(conn);
+  bgp_ka_thread_stop(conn);
   rfree(conn->connect_retry_timer);
   conn->connect_retry_timer = NULL;
   rfree(conn->keepalive_timer);
@@ -249,6 +287,12 @@ bgp_close_conn(struct bgp_conn *conn)
   conn->sk = NULL;
   rfree(conn->tx_ev);
   conn->tx_ev = NULL;
+#ifdef CONFIG_BMP
+  mb_free(conn->open_rx);
+  conn->open_rx = NULL;
+  mb_free(conn->open_tx);
+  conn->open_tx = NULL;
+#endif
 }
 
 
@@ -362,6 +406,90 @@ bgp_conn_enter_openconfirm_state(struct bgp_conn *conn)
   bgp_conn_set_state(conn, BS_OPENCONFIRM);
 }
 
+static inline int
+bgp_peer_llgr_aware(struct bgp_proto *p)
+{
+  return p->conn && p->conn->peer_llgr_aware;
+}
+
+/*
+ * Peers with the same export filter and the same parameters affecting
+ * bgp_import_control() are gathered to export groups, so the export filter is
+ * evaluated once per group for each route change (see nest/protocol.h).
+ * Negotiated capabilities are compared too, groups are joined again whenever
+ * the session is established.
+ */
+static int
+bgp_export_same(struct bgp_proto *p, struct bgp_proto *q, struct filter *f)
+{
+  struct bgp_config *a = p->cf, *b = q->cf;
+
+  return (p->p.table == q->p.table) &&
+    (p->p.accept_ra_types == q->p.accept_ra_types) &&
+    (p->local_as == q->local_as) &&
+    (p->local_id == q->local_id) &&
+    (p->is_internal == q->is_internal) &&
+    (p->rr_client == q->rr_client) &&
+    (p->rs_client == q->rs_client) &&
+    (p->rr_cluster_id == q->rr_cluster_id) &&
+    (bgp_peer_llgr_aware(p) == bgp_peer_llgr_aware(q)) &&
+    ipa_equal(p->source_addr, q->source_addr) &&
+    ((p->neigh ? p->neigh->iface : NULL) == (q->neigh ? q->neigh->iface : NULL)) &&
+    (a->next_hop_self == b->next_hop_self) &&
+    (a->next_hop_keep == b->next_hop_keep) &&
+    (a->interpret_communities == b->interpret_communities) &&
+    (a->default_local_pref == b->default_local_pref) &&
+    (a->role == b->role) &&
+    filter_same(f, q->p.main_ahook->out_filter);
+}
+
+static void
+bgp_join_export_group(struct bgp_proto *p, struct filter *f)
+{
+  struct bgp_export_group *g;
+
+  /* Complex roles depend on per-instance role map, prefix ORF on the neighbor */
+  if (!p->p.main_ahook || (p->cf->role == ROLE_COMP) || (p->conn && bgp_orf_rx_ready(p->conn)))
+    return;
+
+  WALK_LIST(g, bgp_export_groups)
+    if (bgp_export_same(p, SKIP_BACK(struct bgp_proto, export_node, HEAD(g->members)), f))
+      goto found;
+
+  g = mb_allocz(&root_pool, sizeof(struct bgp_export_group));
+  init_list(&g->members);
+  add_tail(&bgp_export_groups, &g->n);
+
+ found:
+  add_tail(&g->members, &p->export_node);
+  g->count++;
+  p->export_group = g;
+  p->p.main_ahook->group = &g->g;
+
+  if (g->count > 1)
+    BGP_TRACE(D_EVENTS, "Joined export group of %u peers", g->count);
+}
+
+static void
+bgp_leave_export_group(struct bgp_proto *p)
+{
+  struct bgp_export_group *g = p->export_group;
+
+  if (!g)
+    return;
+
+  rem_node(&p->export_node);
+  p->export_group = NULL;
+  if (p->p.main_ahook)
+    p->p.main_ahook->group = NULL;
+
+  if (!--g->count)
+    {
+      rem_node(&g->n);
+      mb_free(g);
+    }
+}
+
 void
 bgp_conn_enter_established_state(struct bgp_conn *conn)
 {
@@ -381,36 +509,60 @@ bgp_conn_enter_established_state(struct bgp_conn *conn)
   p->load_state = BFS_NONE;
   bgp_init_bucket_table(p);
   bgp_init_prefix_table(p, 8);
+  bgp_stats_init(p);
+  bmp_peer_up(p);
+
+  if (p->cf->import_table)
+    bgp_adj_init(p);
+
+  if (p->cf->damp)
+    bgp_damp_init(p);
 
   int peer_gr_ready = conn->peer_gr_aware && !(conn->peer_gr_flags & BGP_GRF_RESTART);
 
-  if (p->p.gr_recovery && !peer_gr_ready)
+  /* Adopted session keeps the lock until the refresh from the neighbor ends */
+  if (p->p.gr_recovery && !peer_gr_ready && !p->handoff)
     proto_graceful_restart_unlock(&p->p);
 
-  if (p->p.gr_recovery && (p->cf->gr_mode == BGP_GR_ABLE) && peer_gr_ready)
+  if (p->p.gr_recovery && (((p->cf->gr_mode == BGP_GR_ABLE) && peer_gr_ready) || p->handoff))
     p->p.gr_wait = 1;
 
   if (p->gr_active)
     tm_stop(p->gr_timer);
 
-  if (p->gr_active && (!conn->peer_gr_able || !(conn->peer_gr_aflags & BGP_GRF_FORWARDING)))
+  if (p->gr_active &&
+      !(!p->llgr_active && conn->peer_gr_able && (conn->peer_gr_aflags & BGP_GRF_FORWARDING)) &&
+      !(p->llgr_active && p->llgr_ready && (conn->peer_llgr_aflags & BGP_LLGRF_FORWARDING)))
     bgp_graceful_restart_done(p);
 
   /* GR capability implies that neighbor will send End-of-RIB */
-  if (conn->peer_gr_aware)
+  if (conn->peer_gr_aware && !p->handoff)
     p->load_state = BFS_LOADING;
 
   /* proto_notify_state() will likely call bgp_feed_begin(), setting p->feed_state */
 
   bgp_conn_set_state(conn, BS_ESTABLISHED);
+  bgp_ka_thread_start(conn);
+
+  /* ORF goes first, so the neighbor may hold its routes until it arrives */
+  bgp_orf_start(conn);
   proto_notify_state(&p->p, PS_UP);
+
+  /* The main announce hook is available since PS_UP */
+  bgp_join_export_group(p, p->cf->c.out_filter);
 }
 
 static void
 bgp_conn_leave_established_state(struct bgp_proto *p)
 {
   BGP_TRACE(D_EVENTS, "BGP session closed");
+  bmp_peer_down(p);
   p->conn = NULL;
+  bgp_leave_export_group(p);
+  bgp_free_bucket_table(p);
+  bgp_adj_free(p);
+  bgp_damp_free(p);
+  bgp_orf_free(p);
 
   if (p->p.proto_state == PS_UP)
     bgp_stop(p, 0);
@@ -425,6 +577,8 @@ bgp_conn_enter_close_state(struct bgp_conn *conn)
   bgp_conn_set_state(conn, BS_CLOSE);
   tm_stop(conn->keepalive_timer);
   conn->sk->rx_hook = NULL;
+  bgp_rx_thread_stop(conn);
+  bgp_ka_thread_stop(conn);
 
   /* Timeout for CLOSE state, if we cannot send notification soon then we just hangup */
   bgp_start_timer(conn->hold_timer, 10);
@@ -467,12 +621,27 @@ bgp_handle_graceful_restart(struct bgp_proto *p)
 	    p->gr_active ? " - already pending" : "");
   proto_notify_state(&p->p, PS_START);
 
+  if (p->llgr_active)
+    {
+      /* Routes of the interrupted session become long-lived stale, too */
+      rt_refresh_begin(p->p.main_ahook->table, p->p.main_ahook);
+      rt_modify_stale(p->p.main_ahook->table, p->p.main_ahook);
+      tm_start(p->gr_timer, p->llgr_time);
+      return;
+    }
+
   if (p->gr_active)
     rt_refresh_end(p->p.main_ahook->table, p->p.main_ahook);
 
   p->gr_active = 1;
-  bgp_start_timer(p->gr_timer, p->conn->peer_gr_time);
   rt_refresh_begin(p->p.main_ahook->table, p->p.main_ahook);
+
+  /* Neighbor without graceful restart time goes directly to long-lived stale phase */
+  uint gr_time = p->conn->peer_gr_able ? p->conn->peer_gr_time : 0;
+  if (!gr_time && p->llgr_ready)
+    bgp_long_lived_stale_begin(p);
+  else
+    bgp_start_timer(p->gr_timer, gr_time);
 }
 
 /**
@@ -490,17 +659,38 @@ bgp_graceful_restart_done(struct bgp_proto *p)
 {
   BGP_TRACE(D_EVENTS, "Neighbor graceful restart done");
   p->gr_active = 0;
+  p->llgr_active = 0;
   tm_stop(p->gr_timer);
   rt_refresh_end(p->p.main_ahook->table, p->p.main_ahook);
 }
 
+/**
+ * bgp_long_lived_stale_begin - start long-lived stale phase
+ * @p: BGP instance
+ *
+ * This function is called when the restart time of the neighbor expires and
+ * both sides support long-lived graceful restart. Stale routes are kept for
+ * the long-lived stale time, they are just marked by the LLGR_STALE community
+ * and demoted (see rt_modify_stale()).
+ */
+static void
+bgp_long_lived_stale_begin(struct bgp_proto *p)
+{
+  BGP_TRACE(D_EVENTS, "Neighbor long-lived graceful restart, keeping stale routes for %u s", p->llgr_time);
+  p->llgr_active = 1;
+  tm_start(p->gr_timer, p->llgr_time);
+  rt_modify_stale(p->p.main_ahook->table, p->p.main_ahook);
+}
+
 /**
  * bgp_graceful_restart_timeout - timeout of graceful restart 'restart timer'
  * @t: timer
  *
  * This function is a timeout hook for @gr_timer, implementing BGP restart time
  * limit for reestablisment of the BGP session after the graceful restart. When
- * fired, we just proceed with the usual protocol restart.
+ * fired, we proceed with the long-lived stale phase if it is negotiated, or
+ * with the usual protocol restart. The timer has the same role for the
+ * long-lived stale time.
  */
 
 static void
@@ -508,7 +698,13 @@ bgp_graceful_restart_timeout(timer *t)
 {
   struct bgp_proto *p = t->data;
 
-  BGP_TRACE(D_EVENTS, "Neighbor graceful restart timeout");
+  if (p->llgr_ready && !p->llgr_active)
+    {
+      bgp_long_lived_stale_begin(p);
+      return;
+    }
+
+  BGP_TRACE(D_EVENTS, "Neighbor %sgraceful restart timeout", p->llgr_active ? "long-lived " : "");
   bgp_stop(p, 0);
 }
 
@@ -550,6 +746,9 @@ bgp_refresh_end(struct bgp_proto *p)
 
   p->load_state = BFS_NONE;
   rt_refresh_end(p->p.main_ahook->table, p->p.main_ahook);
+
+  if (p->handoff)
+    proto_graceful_restart_unlock(&p->p);
 }
 
 
@@ -569,7 +768,13 @@ bgp_send_open(struct bgp_conn *conn)
   conn->peer_gr_time = 0;
   conn->peer_gr_flags = 0;
   conn->peer_gr_aflags = 0;
+  conn->peer_llgr_aware = 0;
+  conn->peer_llgr_able = 0;
+  conn->peer_llgr_time = 0;
+  conn->peer_llgr_aflags = 0;
   conn->peer_ext_messages_support = 0;
+  conn->peer_orf = 0;
+  conn->orf_tx = 0;
   conn->neighbor_role = ROLE_UNKN; /* role not get */
 
   DBG("BGP: Sending open\n");
@@ -677,6 +882,11 @@ bgp_setup_conn(struct bgp_proto *p, struct bgp_conn *conn)
   conn->sk = NULL;
   conn->bgp = p;
   conn->packets_to_send = 0;
+  conn->rx_thread = NULL;
+  conn->ka_thread = NULL;
+#ifdef CONFIG_BMP
+  conn->open_rx = conn->open_tx = NULL;
+#endif
 
   t = conn->connect_retry_timer = tm_new(p->p.pool);
   t->hook = bgp_connect_timeout;
@@ -698,6 +908,7 @@ bgp_setup_sk(struct bgp_conn *conn, sock *s)
   s->data = conn;
   s->err_hook = bgp_sock_err;
   conn->sk = s;
+  conn->rx_offset = 0;
 }
 
 static void
@@ -730,13 +941,15 @@ bgp_connect(struct bgp_proto *p)	/* Enter Connect state and start establishing c
   DBG("BGP: Connecting\n");
   s = sk_new(p->p.pool);
   s->type = SK_TCP_ACTIVE;
+  s->io_class = SK_CLASS_BULK;
   s->saddr = p->source_addr;
   s->daddr = p->cf->remote_ip;
   s->dport = p->cf->remote_port;
   s->iface = p->neigh ? p->neigh->iface : NULL;
   s->ttl = p->cf->ttl_security ? 255 : hops;
-  s->rbsize = p->cf->enable_extended_messages ? BGP_RX_BUFFER_EXT_SIZE : BGP_RX_BUFFER_SIZE;
-  s->tbsize = p->cf->enable_extended_messages ? BGP_TX_BUFFER_EXT_SIZE : BGP_TX_BUFFER_SIZE;
+  s->rbsize = bgp_rx_buffer_size(p->cf);
+  s->tbsize = bgp_tx_buffer_size(p->cf);
+  s->flags = SKF_RX_RING;
   s->tos = IP_PREC_INTERNET_CONTROL;
   s->password = p->cf->password;
   s->tx_hook = bgp_connected;
@@ -768,12 +981,34 @@ bgp_connect(struct bgp_proto *p)	/* Enter Connect state and start establishing c
  * bgp_find_proto - find existing proto for incoming connection
  * @sk: TCP socket
  *
+ * Running instances are kept in a hash table by neighbor address, so the
+ * lookup does not depend on the number of instances. When there are more
+ * instances for the neighbor, the one with matching local address is preferred,
+ * then one without configured local address. Instances which are not running
+ * are found by a walk through the configuration, just to reject the connection
+ * quietly.
  */
 static struct bgp_proto *
 bgp_find_proto(sock *sk)
 {
+  struct bgp_proto *p, *any = NULL;
   struct proto_config *pc;
 
+  if (bgp_peer_hash.data)
+    for (p = bgp_peer_hash.data[HASH_FN(bgp_peer_hash, BPH, sk->daddr)]; p; p = p->next_peer)
+      if (ipa_equal(p->cf->remote_ip, sk->daddr) &&
+	  (!ipa_is_link_local(sk->daddr) || (p->cf->iface == sk->iface)))
+	{
+	  if (ipa_equal(p->cf->source_addr, sk->saddr))
+	    return p;
+
+	  if (!any || (ipa_zero(p->cf->source_addr) && !ipa_zero(any->cf->source_addr)))
+	    any = p;
+	}
+
+  if (any)
+    return any;
+
   WALK_LIST(pc, config->protos)
     if ((pc->protocol == &proto_bgp) && pc->proto)
       {
@@ -845,13 +1080,17 @@ bgp_incoming_connection(sock *sk, int dummy UNUSED)
     if (sk_set_min_ttl(sk, 256 - hops) < 0)
       goto err;
 
-  if (p->cf->enable_extended_messages)
+  /* Buffers are inherited from the listening socket */
+  if ((sk->rbsize != bgp_rx_buffer_size(p->cf)) || (sk->tbsize != bgp_tx_buffer_size(p->cf)))
     {
-      sk->rbsize = BGP_RX_BUFFER_EXT_SIZE;
-      sk->tbsize = BGP_TX_BUFFER_EXT_SIZE;
+      sk->rbsize = bgp_rx_buffer_size(p->cf);
+      sk->tbsize = bgp_tx_buffer_size(p->cf);
       sk_reallocate(sk);
     }
 
+  /* Allocated from the pool of the listening socket, but work for us */
+  sk->acct = rp_account(p->p.pool);
+
   bgp_setup_conn(p, &p->incoming_conn);
   bgp_setup_sk(&p->incoming_conn, sk);
   bgp_send_open(&p->incoming_conn);
@@ -874,20 +1113,65 @@ bgp_listen_sock_err(sock *sk UNUSED, int err)
 }
 
 static sock *
-bgp_setup_listen_sk(ip_addr addr, unsigned port, u32 flags)
+bgp_new_listen_sk(ip_addr addr, unsigned port, u32 flags)
 {
   sock *s = sk_new(&root_pool);
-  DBG("BGP: Creating listening socket\n");
   s->type = SK_TCP_PASSIVE;
+  s->io_class = SK_CLASS_BULK;
   s->ttl = 255;
   s->saddr = addr;
   s->sport = port ? port : BGP_PORT;
-  s->flags = flags ? 0 : SKF_V6ONLY;
+  s->flags = (flags ? 0 : SKF_V6ONLY) | SKF_RX_RING;
   s->tos = IP_PREC_INTERNET_CONTROL;
   s->rbsize = BGP_RX_BUFFER_SIZE;
   s->tbsize = BGP_TX_BUFFER_SIZE;
   s->rx_hook = bgp_incoming_connection;
   s->err_hook = bgp_listen_sock_err;
+  return s;
+}
+
+/* Take over the listening socket of the old process, if it is bound as configured */
+static sock *
+bgp_adopt_listen_sk(ip_addr addr, unsigned port, u32 flags)
+{
+  struct handoff_rec *r = handoff_find(HO_BGP_LISTEN, "");
+  sock *s;
+  int fd;
+
+  if (!r)
+    return NULL;
+
+  fd = r->fd;
+  r->fd = -1;
+  handoff_release(r);
+
+  s = bgp_new_listen_sk(addr, port, flags);
+  if (sk_adopt(s, fd) < 0)
+    {
+      sk_log_error(s, "BGP");
+      rfree(s);
+      return NULL;
+    }
+
+  if (!ipa_equal(s->saddr, addr) || (s->sport != (port ? port : BGP_PORT)))
+    {
+      rfree(s);
+      return NULL;
+    }
+
+  return s;
+}
+
+static sock *
+bgp_setup_listen_sk(ip_addr addr, unsigned port, u32 flags)
+{
+  sock *s = bgp_adopt_listen_sk(addr, port, flags);
+
+  if (s)
+    return s;
+
+  DBG("BGP: Creating listening socket\n");
+  s = bgp_new_listen_sk(addr, port, flags);
 
   if (sk_open(s) < 0)
     goto err;
@@ -1010,6 +1294,11 @@ static int
 bgp_reload_routes(struct proto *P)
 {
   struct bgp_proto *p = (struct bgp_proto *) P;
+
+  /* Prefer local Adj-RIB-In over asking the neighbor */
+  if (bgp_adj_reload(p))
+    return 1;
+
   if (!p->conn || !p->conn->peer_refresh_support)
     return 0;
 
@@ -1017,6 +1306,15 @@ bgp_reload_routes(struct proto *P)
   return 1;
 }
 
+static int
+bgp_reload_prefixes(struct proto *P, struct prefix_set *set)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  /* Without Adj-RIB-In, reload_routes() asks the neighbor for everything */
+  return bgp_adj_reload_partial(p, set);
+}
+
 static void
 bgp_feed_begin(struct proto *P, int initial)
 {
@@ -1026,11 +1324,20 @@ bgp_feed_begin(struct proto *P, int initial)
   if (!p->conn)
     return;
 
+  /* The neighbor has routes from the old process, replace them like by refresh */
+  if (initial && p->handoff && p->cf->enable_refresh &&
+      p->conn->peer_enhanced_refresh_support)
+    {
+      p->feed_state = BFS_REFRESHING;
+      bgp_schedule_packet(p->conn, PKT_BEGIN_REFRESH);
+      return;
+    }
+
   if (initial && p->cf->gr_mode)
     p->feed_state = BFS_LOADING;
 
-  /* It is refeed and both sides support enhanced route refresh */
-  if (!initial && p->cf->enable_refresh &&
+  /* It is full refeed and both sides support enhanced route refresh */
+  if (!initial && !P->feed_set && p->cf->enable_refresh &&
       p->conn->peer_enhanced_refresh_support)
     {
       /* BoRR must not be sent before End-of-RIB */
@@ -1068,6 +1375,271 @@ bgp_feed_end(struct proto *P)
 }
 
 
+/*
+ *	Handoff to a new process
+ */
+
+struct bgp_handoff {
+  ip_addr remote_ip;			/* Checked against the new configuration */
+  u32 local_as, remote_as;
+  u32 remote_id;
+  u32 hold_time, keepalive_time;
+  u32 advertised_as, neighbor_role;
+  u32 peer_llgr_time, llgr_time;
+  u16 peer_gr_time;
+  u8 as4_session, add_path_rx, add_path_tx, ext_messages, gr_ready, llgr_ready;
+  u8 peer_refresh_support, peer_as4_support, peer_add_path, peer_enhanced_refresh_support;
+  u8 peer_gr_aware, peer_gr_able, peer_gr_flags, peer_gr_aflags;
+  u8 peer_llgr_aware, peer_llgr_able, peer_llgr_aflags, peer_ext_messages_support;
+  u8 peer_orf;
+  u32 rx_len, tx_len;			/* Lengths of data following the structure */
+  u32 orf_count;			/* Number of received prefix ORF entries */
+  byte data[0];				/* Unprocessed RX data, unsent TX data, ORF entries */
+};
+
+static void
+bgp_handoff_session(struct bgp_proto *p)
+{
+  struct bgp_conn *conn = p->conn;
+  struct bgp_handoff *h;
+  uint rx_len, tx_len, orf_len;
+  sock *sk;
+
+  if (!conn->peer_refresh_support)
+    {
+      log(L_WARN "%s: Neighbor does not support route refresh, session not handed off", p->p.name);
+      return;
+    }
+
+  /* Messages queued by the receive thread are processed here */
+  if (!bgp_rx_thread_join(conn))
+    return;
+
+  /* Nothing may be written to the socket except by the new process */
+  bgp_ka_thread_stop(conn);
+
+  sk = conn->sk;
+  if (sk->fd < 0)
+    return;
+
+  rx_len = sk->rpos - (sk->rbuf + conn->rx_offset);
+  tx_len = sk->tpos - sk->ttx;
+  orf_len = p->orf ? p->orf->count * sizeof(struct bgp_orf_entry) : 0;
+  h = mb_alloc(p->p.pool, sizeof(struct bgp_handoff) + rx_len + tx_len + orf_len);
+  bzero(h, sizeof(struct bgp_handoff));
+
+  h->remote_ip = p->cf->remote_ip;
+  h->local_as = p->local_as;
+  h->remote_as = p->remote_as;
+  h->remote_id = p->remote_id;
+  h->hold_time = conn->hold_time;
+  h->keepalive_time = conn->keepalive_time;
+  h->advertised_as = conn->advertised_as;
+  h->neighbor_role = conn->neighbor_role;
+  h->peer_llgr_time = conn->peer_llgr_time;
+  h->llgr_time = p->llgr_time;
+  h->peer_gr_time = conn->peer_gr_time;
+  h->as4_session = p->as4_session;
+  h->add_path_rx = p->add_path_rx;
+  h->add_path_tx = p->add_path_tx;
+  h->ext_messages = p->ext_messages;
+  h->gr_ready = p->gr_ready;
+  h->llgr_ready = p->llgr_ready;
+  h->peer_refresh_support = conn->peer_refresh_support;
+  h->peer_as4_support = conn->peer_as4_support;
+  h->peer_add_path = conn->peer_add_path;
+  h->peer_enhanced_refresh_support = conn->peer_enhanced_refresh_support;
+  h->peer_gr_aware = conn->peer_gr_aware;
+  h->peer_gr_able = conn->peer_gr_able;
+  h->peer_gr_flags = conn->peer_gr_flags;
+  h->peer_gr_aflags = conn->peer_gr_aflags;
+  h->peer_llgr_aware = conn->peer_llgr_aware;
+  h->peer_llgr_able = conn->peer_llgr_able;
+  h->peer_llgr_aflags = conn->peer_llgr_aflags;
+  h->peer_orf = conn->peer_orf;
+  h->peer_ext_messages_support = conn->peer_ext_messages_support;
+
+  /* Both streams continue in the new process at the same position */
+  h->rx_len = rx_len;
+  h->tx_len = tx_len;
+  memcpy(h->data, sk->rbuf + conn->rx_offset, rx_len);
+  memcpy(h->data + rx_len, sk->ttx, tx_len);
+
+  /* The neighbor will not resend its ORF, the new process must apply it */
+  h->orf_count = p->orf ? p->orf->count : 0;
+  if (orf_len)
+    memcpy(h->data + rx_len + tx_len, p->orf->e, orf_len);
+
+  if (!handoff_put(HO_BGP_SESSION, p->p.name, sk->fd, h, sizeof(struct bgp_handoff) + rx_len + tx_len + orf_len))
+    BGP_TRACE(D_EVENTS, "Session handed off");
+
+  mb_free(h);
+}
+
+/**
+ * bgp_handoff - pass BGP sessions to a new process
+ *
+ * The handoff() hook of BGP. It passes the listening socket and established
+ * sessions with neighbors supporting route refresh, other sessions are reset
+ * when the old process exits.
+ */
+static void
+bgp_handoff(void)
+{
+  struct proto_config *pc;
+
+  if (bgp_listen_sk && (bgp_listen_sk->fd >= 0))
+    handoff_put(HO_BGP_LISTEN, "", bgp_listen_sk->fd, NULL, 0);
+
+  WALK_LIST(pc, config->protos)
+    if ((pc->protocol == &proto_bgp) && pc->proto)
+      {
+	struct bgp_proto *p = (struct bgp_proto *) pc->proto;
+
+	if ((p->p.proto_state == PS_UP) && p->conn && (p->conn->state == BS_ESTABLISHED))
+	  bgp_handoff_session(p);
+      }
+}
+
+/**
+ * bgp_adopt - take over a session handed off by the old process
+ * @p: BGP instance
+ *
+ * The session continues in established state with the parameters negotiated
+ * by the old process. Data not sent by it are sent first, data received but
+ * not processed are processed as received, prefix ORF received by the old
+ * process is applied to the initial feed. Routes of the neighbor are asked
+ * for by route refresh. The initial feed is demarcated as enhanced route
+ * refresh if possible, so the neighbor removes routes which were announced
+ * by the old process but are not announced again. Returns 1 when a session
+ * was adopted, 0 when a new one should be established.
+ */
+static int
+bgp_adopt(struct bgp_proto *p)
+{
+  struct handoff_rec *r = handoff_find(HO_BGP_SESSION, p->p.name);
+  struct bgp_conn *conn = &p->outgoing_conn;
+  struct bgp_handoff *h;
+  sock *s;
+  int fd;
+
+  if (!r)
+    goto fail;
+
+  h = (void *) r->data;
+  if ((r->len < sizeof(struct bgp_handoff)) ||
+      (h->orf_count > BGP_ORF_MAX_ENTRIES) ||
+      (r->len != sizeof(struct bgp_handoff) + h->rx_len + h->tx_len +
+		 h->orf_count * sizeof(struct bgp_orf_entry)) ||
+      !ipa_equal(h->remote_ip, p->cf->remote_ip) ||
+      (h->local_as != p->local_as) || (h->remote_as != p->remote_as) ||
+      (h->rx_len > bgp_rx_buffer_size(p->cf)) || (h->tx_len > bgp_tx_buffer_size(p->cf)))
+    {
+      log(L_WARN "%s: Handed off session does not match configuration", p->p.name);
+      goto fail;
+    }
+
+  s = sk_new(p->p.pool);
+  s->type = SK_TCP;
+  s->io_class = SK_CLASS_BULK;
+  s->rbsize = bgp_rx_buffer_size(p->cf);
+  s->tbsize = bgp_tx_buffer_size(p->cf);
+  s->flags = SKF_RX_RING;
+  s->tos = IP_PREC_INTERNET_CONTROL;
+
+  fd = r->fd;
+  r->fd = -1;
+  if (sk_adopt(s, fd) < 0)
+    {
+      sk_log_error(s, p->p.name);
+      rfree(s);
+      goto fail;
+    }
+
+  bgp_setup_conn(p, conn);
+  bgp_setup_sk(conn, s);
+  s->rx_hook = bgp_rx;
+  s->tx_hook = bgp_tx;
+
+  conn->start_state = p->start_state;
+  conn->hold_time = h->hold_time;
+  conn->keepalive_time = h->keepalive_time;
+  conn->advertised_as = h->advertised_as;
+  conn->neighbor_role = h->neighbor_role;
+  conn->peer_llgr_time = h->peer_llgr_time;
+  conn->peer_gr_time = h->peer_gr_time;
+  conn->peer_refresh_support = h->peer_refresh_support;
+  conn->peer_as4_support = h->peer_as4_support;
+  conn->peer_add_path = h->peer_add_path;
+  conn->peer_enhanced_refresh_support = h->peer_enhanced_refresh_support;
+  conn->peer_gr_aware = h->peer_gr_aware;
+  conn->peer_gr_able = h->peer_gr_able;
+  conn->peer_gr_flags = h->peer_gr_flags;
+  conn->peer_gr_aflags = h->peer_gr_aflags;
+  conn->peer_llgr_aware = h->peer_llgr_aware;
+  conn->peer_llgr_able = h->peer_llgr_able;
+  conn->peer_llgr_aflags = h->peer_llgr_aflags;
+  conn->peer_orf = h->peer_orf;
+  conn->peer_ext_messages_support = h->peer_ext_messages_support;
+
+  p->remote_id = h->remote_id;
+  p->as4_session = h->as4_session;
+  p->add_path_rx = h->add_path_rx;
+  p->add_path_tx = h->add_path_tx;
+  p->ext_messages = h->ext_messages;
+  p->llgr_time = h->llgr_time;
+  p->llgr_ready = h->llgr_ready;
+  p->gr_ready = h->gr_ready;
+
+  if (p->add_path_tx)
+    p->p.accept_ra_types = RA_ANY;
+  p->p.ra_best_paths = p->add_path_tx ? p->cf->add_path_best : 0;
+
+  /* Applied by the initial feed, so it must be in place before it starts */
+  if (bgp_orf_rx_ready(conn))
+    bgp_orf_restore(p, h->data + h->rx_len + h->tx_len, h->orf_count);
+
+  BGP_TRACE(D_EVENTS, "Session taken over from the old process");
+  bgp_conn_enter_established_state(conn);
+
+  if (h->tx_len)
+    {
+      memcpy(s->tbuf, h->data + h->rx_len, h->tx_len);
+      if (sk_send(s, h->tx_len) < 0)
+	goto done;
+    }
+
+  bgp_restart_hold_timer(conn);
+  bgp_schedule_packet(conn, PKT_KEEPALIVE);
+  bgp_schedule_packet(conn, PKT_ROUTE_REFRESH);
+
+  /* Without enhanced route refresh, the end of the refresh is not known */
+  if (!conn->peer_enhanced_refresh_support)
+    proto_graceful_restart_unlock(&p->p);
+
+  if (h->rx_len)
+    {
+      memcpy(s->rbuf, h->data, h->rx_len);
+      s->rpos = s->rbuf + h->rx_len;
+      bgp_rx(s, h->rx_len);
+    }
+
+done:
+  handoff_release(r);
+  return 1;
+
+fail:
+  if (r)
+    handoff_release(r);
+
+  p->handoff = 0;
+  if (!p->cf->gr_mode)
+    proto_graceful_restart_unlock(&p->p);
+
+  return 0;
+}
+
+
 static void
 bgp_start_locked(struct object_lock *lock)
 {
@@ -1124,6 +1696,8 @@ bgp_start(struct proto *P)
   p->bfd_req = NULL;
   p->gr_ready = 0;
   p->gr_active = 0;
+  p->llgr_ready = 0;
+  p->llgr_active = 0;
 
   rt_lock_table(p->igp_table);
 
@@ -1146,7 +1720,14 @@ bgp_start(struct proto *P)
   p->remote_id = 0;
   p->source_addr = p->cf->source_addr;
 
-  if (p->p.gr_recovery && p->cf->gr_mode)
+  if (!bgp_peer_hash.data)
+    HASH_INIT(bgp_peer_hash, &root_pool, 6);
+  HASH_INSERT2(bgp_peer_hash, BPH, &root_pool, p);
+
+  /* Session handed off by the old process is adopted by bgp_startup() */
+  p->handoff = !!handoff_find(HO_BGP_SESSION, p->p.name);
+
+  if (p->p.gr_recovery && (p->cf->gr_mode || p->handoff))
     proto_graceful_restart_lock(P);
 
   /*
@@ -1229,6 +1810,7 @@ bgp_cleanup(struct proto *P)
 {
   struct bgp_proto *p = (struct bgp_proto *) P;
   rt_unlock_table(p->igp_table);
+  HASH_REMOVE2(bgp_peer_hash, BPH, &root_pool, p);
 }
 
 static rtable *
@@ -1249,10 +1831,13 @@ bgp_init(struct proto_config *C)
   P->import_control = bgp_import_control;
   P->neigh_notify = bgp_neigh_notify;
   P->reload_routes = bgp_reload_routes;
+  P->reload_prefixes = bgp_reload_prefixes;
   P->feed_begin = bgp_feed_begin;
   P->feed_end = bgp_feed_end;
   P->rte_better = bgp_rte_better;
   P->rte_mergable = bgp_rte_mergable;
+  P->rta_prepare = bgp_rta_prepare;
+  P->rte_modify = bgp_rte_modify_stale;
   P->rte_recalculate = c->deterministic_med ? bgp_rte_recalculate : NULL;
 
   p->cf = c;
@@ -1263,6 +1848,9 @@ bgp_init(struct proto_config *C)
   p->rr_client = c->rr_client;
   p->igp_table = get_igp_table(c);
 
+  if (!bgp_export_groups.head)
+    init_list(&bgp_export_groups);
+
   return P;
 }
 
@@ -1340,6 +1928,39 @@ bgp_check_config(struct bgp_config *c)
   if (c->secondary && !c->c.table->sorted)
     cf_error("BGP with secondary option requires sorted table");
 
+  if (c->rx_buffer_size && (c->rx_buffer_size <
+      (c->enable_extended_messages ? BGP_MAX_EXT_MSG_LENGTH : BGP_MAX_MESSAGE_LENGTH)))
+    cf_error("Receive buffer must hold a message of maximal length");
+
+  if (c->damp && (c->damp_reuse >= c->damp_suppress))
+    cf_error("Dampening reuse limit must be lower than suppress limit");
+
+  if (c->damp && (c->damp_max_suppress < c->damp_half_life))
+    cf_error("Dampening max suppress time must not be shorter than half life");
+
+  if (c->damp)
+    c->damp_ceiling = bgp_damp_ceiling(c);
+
+  if (c->llgr_mode < 0)
+    c->llgr_mode = c->gr_mode ? BGP_LLGR_AWARE : 0;
+
+  if (c->llgr_mode && !c->gr_mode)
+    cf_error("Long-lived graceful restart requires graceful restart");
+
+  if (c->llgr_time > 0xffffff)
+    cf_error("Long-lived stale time must be less than 2^24");
+
+  if ((c->orf_prefixes || c->orf_receive) && !c->enable_refresh)
+    cf_error("Outbound route filtering requires route refresh");
+
+#ifndef CONFIG_BFD
+  if (c->rx_thread)
+    cf_error("Receive thread requires BFD support to be compiled in");
+
+  if (c->ka_thread)
+    cf_error("Keepalive thread requires BFD support to be compiled in");
+#endif
+
   if (c->role == ROLE_UNDE)
     cf_error("Role must be set for each BGP protocol");
 
@@ -1370,15 +1991,27 @@ bgp_reconfigure(struct proto *P, struct proto_config *C)
 		     OFFSETOF(struct bgp_config, password) - sizeof(struct proto_config))
     && ((!old->password && !new->password)
 	|| (old->password && new->password && !strcmp(old->password, new->password)))
-    && (get_igp_table(old) == get_igp_table(new));
+    && (get_igp_table(old) == get_igp_table(new))
+    && (!old->orf_prefixes == !new->orf_prefixes);
 
   if (same && (p->start_state > BSS_PREPARE))
     bgp_update_bfd(p, new->bfd);
 
+  /* Export filter change may split the export group */
+  if (same && p->export_group && !filter_same(new->c.out_filter, old->c.out_filter))
+    {
+      bgp_leave_export_group(p);
+      bgp_join_export_group(p, new->c.out_filter);
+    }
+
   /* We should update our copy of configuration ptr as old configuration will be freed */
   if (same)
     p->cf = new;
 
+  /* Changed ORF list is resent, sending of the old one must not continue */
+  if (same && p->conn && (p->conn->orf_tx || !bgp_orf_same(old->orf_prefixes, new->orf_prefixes)))
+    bgp_orf_start(p->conn);
+
   return same;
 }
 
@@ -1517,7 +2150,9 @@ bgp_show_proto_info(struct proto *P)
   cli_msg(-1006, "    Neighbor address: %I%J", p->cf->remote_ip, p->cf->iface);
   cli_msg(-1006, "    Neighbor AS:      %u", p->remote_as);
 
-  if (p->gr_active)
+  if (p->llgr_active)
+    cli_msg(-1006, "    Neighbor long-lived graceful restart active");
+  else if (p->gr_active)
     cli_msg(-1006, "    Neighbor graceful restart active");
 
   if (P->proto_state == PS_START)
@@ -1535,7 +2170,8 @@ bgp_show_proto_info(struct proto *P)
 		oc->connect_retry_timer->expires - now, p->cf->connect_delay_time);
 
       if (p->gr_active && p->gr_timer->expires)
-	cli_msg(-1006, "    Restart timer:    %d/-", p->gr_timer->expires - now);
+	cli_msg(-1006, "    %s   %d/-", p->llgr_active ? "Stale timer: " : "Restart timer:",
+		p->gr_timer->expires - now);
     }
   else if (P->proto_state == PS_UP)
     {
@@ -1550,11 +2186,14 @@ bgp_show_proto_info(struct proto *P)
 	case ROLE_UNDE: ne_role_name = "undefine"; break;
 	case ROLE_UNKN: ne_role_name = "unknown "; break;
       }
-      cli_msg(-1006, "    Neighbor caps:   %s%s%s%s%s%s%s%s%s",
+      cli_msg(-1006, "    Neighbor caps:   %s%s%s%s%s%s%s%s%s%s%s%s",
           " role=", ne_role_name,
 	      c->peer_refresh_support ? " refresh" : "",
 	      c->peer_enhanced_refresh_support ? " enhanced-refresh" : "",
+	      (c->peer_orf & BGP_ORF_SEND) ? " orf-send" : "",
+	      (c->peer_orf & BGP_ORF_RECEIVE) ? " orf-receive" : "",
 	      c->peer_gr_able ? " restart-able" : (c->peer_gr_aware ? " restart-aware" : ""),
+	      c->peer_llgr_able ? " llgr-able" : (c->peer_llgr_aware ? " llgr-aware" : ""),
 	      c->peer_as4_support ? " AS4" : "",
 	      (c->peer_add_path & ADD_PATH_RX) ? " add-path-rx" : "",
 	      (c->peer_add_path & ADD_PATH_TX) ? " add-path-tx" : "",
@@ -1579,13 +2218,30 @@ bgp_show_proto_info(struct proto *P)
 	      p->add_path_tx ? " add-path-tx" : "",
 	      p->ext_messages ? " ext-messages" : "");
       cli_msg(-1006, "    Source address:   %I", p->source_addr);
+      if (p->export_group && (p->export_group->count > 1))
+	cli_msg(-1006, "    Export group:     %u peers, %u/%u shared",
+		p->export_group->count, p->export_group->g.hits,
+		p->export_group->g.hits + p->export_group->g.misses);
+      if (bgp_orf_rx_ready(c) || bgp_orf_tx_ready(c))
+	cli_msg(-1006, "    Prefix ORF:       %u received%s",
+		p->orf ? p->orf->count : 0, bgp_orf_tx_ready(c) ? ", sent" : "");
+      if (p->adj_pool)
+	cli_msg(-1006, "    Adj-RIB-In:       %u routes, %u kB%s",
+		p->adj_routes, (uint) (rmemsize(p->adj_pool) >> 10),
+		p->adj_reloading ? ", reloading" : "");
+      if (p->damp_pool)
+	cli_msg(-1006, "    Dampening:        %u tracked, %u suppressed",
+		p->damp_count, p->damp_suppressed);
+      bgp_show_stats_info(p);
       if (P->cf->in_limit)
 	cli_msg(-1006, "    Route limit:      %d/%d",
 		p->p.stats.imp_routes + p->p.stats.filt_routes, P->cf->in_limit->limit);
-      cli_msg(-1006, "    Hold timer:       %d/%d",
-	      tm_remains(c->hold_timer), c->hold_time);
-      cli_msg(-1006, "    Keepalive timer:  %d/%d",
-	      tm_remains(c->keepalive_timer), c->keepalive_time);
+      int hold = tm_remains(c->hold_timer), keepalive = tm_remains(c->keepalive_timer);
+      bgp_ka_thread_remains(c, &hold, &keepalive);
+      cli_msg(-1006, "    Hold timer:       %d/%d%s",
+	      hold, c->hold_time, c->ka_thread ? " (thread)" : "");
+      cli_msg(-1006, "    Keepalive timer:  %d/%d%s",
+	      keepalive, c->keepalive_time, c->ka_thread ? " (thread)" : "");
     }
 
   if ((p->last_error_class != BE_NONE) &&
@@ -1612,5 +2268,6 @@ struct protocol proto_bgp = {
   .get_status = 	bgp_get_status,
   .get_attr = 		bgp_get_attr,
   .get_route_info = 	bgp_get_route_info,
-  .show_proto_info = 	bgp_show_proto_info
+  .show_proto_info = 	bgp_show_proto_info,
+  .handoff =		bgp_handoff
 };
@@ -12,7 +12,9 @@
 #include <stdint.h>
 #include "nest/route.h"
 #include "nest/bfd.h"
+#include "nest/bmp.h"
 #include "lib/hash.h"
+#include "lib/wheel.h"
 
 struct linpool;
 struct eattr;
@@ -49,9 +51,12 @@ struct bgp_config {
   int interpret_communities;		/* Hardwired handling of well-known communities */
   int secondary;			/* Accept also non-best routes (i.e. RA_ACCEPTED) */
   int add_path;				/* Use ADD-PATH extension [draft] */
+  int add_path_best;			/* Advertise only that number of best paths by ADD-PATH, 0 for all */
   int allow_local_as;			/* Allow that number of local ASNs in incoming AS_PATHs */
   int gr_mode;				/* Graceful restart mode (BGP_GR_*) */
   unsigned gr_time;			/* Graceful restart timeout */
+  int llgr_mode;			/* Long-lived graceful restart mode (BGP_LLGR_*) */
+  uint llgr_time;			/* Long-lived stale time */
   unsigned connect_delay_time;		/* Minimum delay between connect attempts */
   unsigned connect_retry_time;		/* Timeout for connect attempts */
   unsigned hold_time, initial_hold_time;
@@ -60,9 +65,21 @@ struct bgp_config {
   unsigned error_delay_time_min;	/* Time to wait after an error is detected */
   unsigned error_delay_time_max;
   unsigned disable_after_error;		/* Disable the protocol when error is detected */
+  uint rx_buffer_size;			/* Size of socket receive buffer, 0 for default */
+  int rx_thread;			/* Read the session in a separate thread */
+  int ka_thread;			/* Send keepalives and check hold timer in a separate thread */
+  int import_table;			/* Keep received routes in Adj-RIB-In, see adjin.c */
+  uint bucket_quantum;			/* Messages sent from a bucket before the next one gets its turn */
+  int damp;				/* Route flap dampening [RFC2439], see damp.c */
+  uint damp_half_life;			/* Penalty half-life */
+  uint damp_reuse;			/* Penalty limit for reuse of suppressed routes */
+  uint damp_suppress;			/* Penalty limit for suppression */
+  uint damp_max_suppress;		/* Maximum time a route is suppressed */
+  u32 damp_ceiling;			/* Maximum penalty, computed from above */
   int role;            			/* Your role in (i|e)BGP connection */
   int strict_mode;     			/* Are there conditions on role are set? */
   struct role_map *role_map;
+  int orf_receive;			/* Accept prefix ORF from the neighbor [RFC5292], see orf.c */
   /* Don't move any of above items below "password", because it will change
   reconfiguration logic due bgp_reconfigure() */
 
@@ -70,6 +87,7 @@ struct bgp_config {
   struct rtable_config *igp_table;	/* Table used for recursive next hop lookups */
   int check_link;			/* Use iface link state for liveness detection */
   int bfd;				/* Use BFD for liveness detection */
+  struct bgp_orf_prefix *orf_prefixes;	/* Prefix ORF sent to the neighbor, NULL for none */
 };
 
 #define BGP_ROLE_CAP 38
@@ -96,12 +114,25 @@ struct bgp_config {
 #define BGP_GR_ABLE 1
 #define BGP_GR_AWARE 2
 
+#define BGP_LLGR_ABLE 1
+#define BGP_LLGR_AWARE 2
+
 /* For peer_gr_flags */
 #define BGP_GRF_RESTART 0x80
 
 /* For peer_gr_aflags */
 #define BGP_GRF_FORWARDING 0x80
 
+/* For peer_llgr_aflags */
+#define BGP_LLGRF_FORWARDING 0x80
+
+/* ORF type and for peer_orf [RFC5291] */
+#define BGP_ORF_PREFIX 64
+#define BGP_ORF_RECEIVE 1
+#define BGP_ORF_SEND 2
+
+#define BGP_ORF_MAX_ENTRIES 65536		/* Limit of received prefix ORF entries */
+
 
 struct bgp_conn {
   struct bgp_proto *bgp;
@@ -125,14 +156,46 @@ struct bgp_conn {
   u16 peer_gr_time;
   u8 peer_gr_flags;
   u8 peer_gr_aflags;
+  u8 peer_llgr_aware;			/* Peer supports long-lived graceful restart [RFC9494] */
+  u8 peer_llgr_able;
+  u8 peer_llgr_aflags;
+  uint peer_llgr_time;
   u8 peer_ext_messages_support;		/* Peer supports extended message length [draft] */
+  u8 peer_orf;				/* Peer supports prefix ORF [RFC5291], see BGP_ORF_* */
+  u8 orf_tx;				/* Sending of prefix ORF is in progress, see bgp_orf_put() */
+  u32 orf_tx_seq;			/* Sequence number of the last sent ORF entry */
+  struct bgp_orf_prefix *orf_tx_next;	/* Next ORF entry to be sent */
+  uint rx_offset;			/* Start of unprocessed data in sk->rbuf */
+  struct bgp_rx_thread *rx_thread;	/* Receive thread, see bgp_rx_thread_start() */
+  struct bgp_ka_thread *ka_thread;	/* Keepalive thread, see bgp_ka_thread_start() */
   unsigned hold_time, keepalive_time;	/* Times calculated from my and neighbor's requirements */
   u32 neighbor_role;
+#ifdef CONFIG_BMP
+  byte *open_rx, *open_tx;		/* Copies of OPEN messages for BMP Peer Up, see bmp_peer_up() */
+#endif
+};
+
+#define BGP_HIST_DECODE		0	/* Decoding of UPDATE attributes */
+#define BGP_HIST_IMPORT		1	/* Import of routes from an UPDATE to the table */
+#define BGP_HIST_EXPORT		2	/* Building of UPDATE from the bucket queue */
+#define BGP_HIST_MAX		3
+
+#define BGP_HIST_BUCKETS	20	/* Bucket i counts durations in [2^i, 2^(i+1)) us */
+
+struct bgp_stats {
+  bird_clock_t since;			/* Start of the accounted period */
+  u32 rx_messages, tx_messages;		/* Messages of all types */
+  u32 rx_updates, tx_updates;		/* UPDATE messages */
+  u64 rx_bytes, tx_bytes;
+  btime total[BGP_HIST_MAX];		/* Sum of measured durations */
+  btime max[BGP_HIST_MAX];		/* Longest measured duration */
+  u32 hist[BGP_HIST_MAX][BGP_HIST_BUCKETS]; /* Log-bucketed durations, see bgp_stats_time() */
 };
 
 struct bgp_proto {
   struct proto p;
   struct bgp_config *cf;		/* Shortcut to BGP configuration */
+  struct bgp_proto *next_peer;		/* Next in hash chain of running instances, see bgp_find_proto() */
   u32 local_as, remote_as;
   int start_state;			/* Substates that partitions BS_START */
   u8 is_internal;			/* Internal BGP connection (local_as == remote_as) */
@@ -147,6 +210,10 @@ struct bgp_proto {
   int rs_client;			/* Whether neighbor is RS client of me */
   u8 gr_ready;				/* Neighbor could do graceful restart */
   u8 gr_active;				/* Neighbor is doing graceful restart */
+  u8 llgr_ready;			/* Neighbor could do long-lived graceful restart */
+  u8 llgr_active;			/* Stale routes of the neighbor are kept long-lived */
+  uint llgr_time;			/* Long-lived stale time of this session */
+  u8 handoff;				/* Session is taken over from the old process, see bgp_adopt() */
   u8 feed_state;			/* Feed state (TX) for EoR, RR packets, see BFS_* */
   u8 load_state;			/* Load state (RX) for EoR, RR packets, see BFS_* */
   struct bgp_conn *conn;		/* Connection we have established */
@@ -160,17 +227,36 @@ struct bgp_proto {
   struct event *event;			/* Event for respawning and shutting process */
   struct timer *startup_timer;		/* Timer used to delay protocol startup due to previous errors (startup_delay) */
   struct timer *gr_timer;		/* Timer waiting for reestablishment after graceful restart */
-  struct bgp_bucket **bucket_hash;	/* Hash table of attribute buckets */
-  uint hash_size, hash_count, hash_limit;
+  OA_HASH(struct bgp_bucket) bucket_hash; /* Hash table of attribute buckets */
   HASH(struct bgp_prefix) prefix_hash;	/* Prefixes to be sent */
   slab *prefix_slab;			/* Slab holding prefix nodes */
   list bucket_queue;			/* Queue of buckets to send */
+  list bucket_urgent;			/* Queue of buckets with incremental changes, sent first */
   struct bgp_bucket *withdraw_bucket;	/* Withdrawn routes */
+  struct bgp_export_group *export_group; /* Export group we are member of, if any */
+  node export_node;			/* Node in export group member list */
   unsigned startup_delay;		/* Time to delay protocol startup by due to errors */
   bird_clock_t last_proto_error;	/* Time of last error that leads to protocol stop */
   u8 last_error_class; 			/* Error class of last error */
   u32 last_error_code;			/* Error code of last error. BGP protocol errors
 					   are encoded as (bgp_err_code << 16 | bgp_err_subcode) */
+  pool *adj_pool;			/* Pool for Adj-RIB-In, NULL if not used */
+  struct fib adj_fib;			/* Adj-RIB-In (struct bgp_adj_net) */
+  slab *adj_slab;			/* Slab holding struct bgp_adj_route */
+  struct fib_iterator adj_fit;		/* Position of reload from Adj-RIB-In */
+  struct event *adj_event;		/* Event running the reload */
+  struct prefix_set *adj_reload_set;	/* Networks to be reloaded, NULL for all */
+  uint adj_routes;			/* Number of routes in Adj-RIB-In */
+  u8 adj_reloading;			/* Reload from Adj-RIB-In is in progress */
+  pool *damp_pool;			/* Pool for dampening state, NULL if not used */
+  HASH(struct bgp_damp) damp_hash;	/* Penalized routes by prefix and path ID */
+  slab *damp_slab;			/* Slab holding struct bgp_damp */
+  struct wheel *damp_wheel;		/* Reuse and expiration of penalized routes */
+  uint damp_count;			/* Number of penalized routes */
+  uint damp_suppressed;			/* Number of suppressed routes */
+  uint rx_pending;			/* New routes in the current RX batch, see bgp_rx_limit_drop() */
+  struct bgp_orf *orf;			/* Prefix ORF received from the neighbor, NULL if none */
+  struct bgp_stats stats;		/* Message counters and timing of this session */
 #ifdef IPV6
   byte *mp_reach_start, *mp_unreach_start; /* Multiprotocol BGP attribute notes */
   unsigned mp_reach_len, mp_unreach_len;
@@ -178,6 +264,56 @@ struct bgp_proto {
 #endif
 };
 
+struct bgp_export_group {
+  struct export_group g;		/* Core part, see nest/protocol.h */
+  node n;				/* Node in bgp_export_groups */
+  list members;				/* Member instances (struct bgp_proto, export_node) */
+  uint count;				/* Number of members */
+};
+
+struct bgp_adj_net {
+  struct fib_node n;
+  struct bgp_adj_route *routes;		/* Received routes, one per path ID */
+};
+
+struct bgp_adj_route {
+  struct bgp_adj_route *next;
+  struct rta *attrs;			/* Cached attributes, attrs->src identifies the path */
+  u8 flags;				/* Route flags, see REF_* */
+};
+
+struct bgp_damp {
+  struct bgp_damp *next;		/* Next in hash chain */
+  struct wheel_node wn;			/* Node in dampening wheel */
+  ip_addr prefix;
+  u32 path_id;
+  u32 penalty;				/* Penalty at time of last update */
+  bird_clock_t updated;			/* Time of last penalty update */
+  struct rta *attrs;			/* Last received attributes, NULL if withdrawn */
+  u8 pxlen;
+  u8 suppressed;
+};
+
+struct bgp_orf_prefix {
+  struct bgp_orf_prefix *next;
+  ip_addr prefix;
+  u8 pxlen, lo, hi;			/* Prefix and range of matching lengths */
+};
+
+struct bgp_orf_entry {
+  ip_addr prefix;
+  u32 seq;				/* Sequence number, order of evaluation */
+  u8 pxlen, lo, hi;
+  u8 deny;
+};
+
+struct bgp_orf {
+  struct bgp_orf_entry *e;		/* Received entries sorted by sequence numbers */
+  uint count, size;
+  linpool *lp;				/* Linpool for trie */
+  struct f_trie *trie;			/* Compiled list of permit entries, NULL if there are deny entries */
+};
+
 struct bgp_prefix {
   struct {
     ip_addr prefix;
@@ -190,25 +326,34 @@ struct bgp_prefix {
 
 struct bgp_bucket {
   node send_node;			/* Node in send queue */
-  struct bgp_bucket *hash_next, *hash_prev;	/* Node in bucket hash table */
   unsigned hash;			/* Hash over extended attributes */
+  struct bgp_enc_attrs *enc;		/* Cached encoded attributes, see bgp_bucket_attrs() */
   list prefixes;			/* Prefixes in this buckets */
+  uint sent;				/* Messages sent in current turn */
+  u8 urgent;				/* Bucket is in bucket_urgent queue */
   ea_list eattrs[0];			/* Per-bucket extended attributes */
 };
 
 #define BGP_PORT		179
+#define BGP_MAX_ATTRS_LENGTH	2048	/* Limit for encoded attributes of one bucket */
 #define BGP_VERSION		4
 #define BGP_HEADER_LENGTH	19
 #define BGP_MAX_MESSAGE_LENGTH	4096
 #define BGP_MAX_EXT_MSG_LENGTH	65535
-#define BGP_RX_BUFFER_SIZE	4096
-#define BGP_TX_BUFFER_SIZE	4096
-#define BGP_RX_BUFFER_EXT_SIZE	65535
-#define BGP_TX_BUFFER_EXT_SIZE	65535
+#define BGP_RX_BUFFER_SIZE	65536	/* Packets are received in batches, see bgp_rx() */
+#define BGP_TX_BUFFER_SIZE	65536	/* Packets are sent in batches, see bgp_fire_tx() */
+#define BGP_RX_BUFFER_EXT_SIZE	262144
+#define BGP_TX_BUFFER_EXT_SIZE	262144
 
 static inline int bgp_max_packet_length(struct bgp_proto *p)
 { return p->ext_messages ? BGP_MAX_EXT_MSG_LENGTH : BGP_MAX_MESSAGE_LENGTH; }
 
+static inline uint bgp_rx_buffer_size(struct bgp_config *cf)
+{ return cf->rx_buffer_size ?: (cf->enable_extended_messages ? BGP_RX_BUFFER_EXT_SIZE : BGP_RX_BUFFER_SIZE); }
+
+static inline uint bgp_tx_buffer_size(struct bgp_config *cf)
+{ return cf->enable_extended_messages ? BGP_TX_BUFFER_EXT_SIZE : BGP_TX_BUFFER_SIZE; }
+
 extern struct linpool *bgp_linpool;
 
 
@@ -265,19 +410,70 @@ struct rta *bgp_decode_attrs(struct bgp_conn *conn, byte *a, uint len, struct li
 int bgp_get_attr(struct eattr *e, byte *buf, int buflen);
 int bgp_rte_better(struct rte *, struct rte *);
 int bgp_rte_mergable(rte *pri, rte *sec);
+void bgp_rta_prepare(struct rta *a);
+struct rte *bgp_rte_modify_stale(struct rte *r, struct linpool *pool);
 int bgp_rte_recalculate(rtable *table, net *net, rte *new, rte *old, rte *old_best);
 void bgp_rt_notify(struct proto *P, rtable *tbl UNUSED, net *n, rte *new, rte *old UNUSED, ea_list *attrs);
 int bgp_import_control(struct proto *, struct rte **, struct ea_list **, struct linpool *);
 void bgp_init_bucket_table(struct bgp_proto *);
 void bgp_free_bucket(struct bgp_proto *p, struct bgp_bucket *buck);
+void bgp_free_bucket_table(struct bgp_proto *p);
+int bgp_bucket_attrs(struct bgp_proto *p, struct bgp_bucket *buck, byte **data);
+void bgp_release_enc_attrs(struct bgp_enc_attrs *e);
 void bgp_init_prefix_table(struct bgp_proto *p, u32 order);
 void bgp_free_prefix(struct bgp_proto *p, struct bgp_prefix *bp);
 uint bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains);
+uint bgp_encode_attrs_as4(int as4, byte *w, ea_list *attrs, int remains);
 void bgp_get_route_info(struct rte *, byte *buf, struct ea_list *attrs);
 
 inline static void bgp_attach_attr_ip(struct ea_list **to, struct linpool *pool, unsigned attr, ip_addr a)
 { *(ip_addr *) bgp_attach_attr_wa(to, pool, attr, sizeof(ip_addr)) = a; }
 
+/* adjin.c */
+
+void bgp_adj_init(struct bgp_proto *p);
+void bgp_adj_free(struct bgp_proto *p);
+void bgp_adj_update(struct bgp_proto *p, ip_addr prefix, int pxlen, struct rta *a, u8 flags);
+void bgp_adj_withdraw(struct bgp_proto *p, ip_addr prefix, int pxlen, struct rte_src *src);
+int bgp_adj_reload(struct bgp_proto *p);
+int bgp_adj_reload_partial(struct bgp_proto *p, struct prefix_set *set);
+
+/* damp.c */
+
+void bgp_damp_init(struct bgp_proto *p);
+void bgp_damp_free(struct bgp_proto *p);
+u32 bgp_damp_ceiling(struct bgp_config *cf);
+int bgp_damp_update(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id, struct rta *a);
+void bgp_damp_withdraw(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id, int present);
+int bgp_damp_suppressed(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id);
+
+/* orf.c */
+
+void bgp_orf_free(struct bgp_proto *p);
+int bgp_orf_permitted(struct bgp_proto *p, ip_addr prefix, int pxlen);
+void bgp_orf_start(struct bgp_conn *conn);
+byte *bgp_orf_put(struct bgp_conn *conn, byte *buf, uint remains);
+int bgp_orf_rx(struct bgp_conn *conn, byte *pos, uint len);
+int bgp_orf_same(struct bgp_orf_prefix *a, struct bgp_orf_prefix *b);
+void bgp_orf_restore(struct bgp_proto *p, const byte *data, uint count);
+
+static inline int bgp_orf_tx_ready(struct bgp_conn *conn)
+{ return conn->bgp->cf->orf_prefixes && (conn->peer_orf & BGP_ORF_RECEIVE); }
+
+static inline int bgp_orf_rx_ready(struct bgp_conn *conn)
+{ return conn->bgp->cf->orf_receive && (conn->peer_orf & BGP_ORF_SEND); }
+
+/* stats.c */
+
+void bgp_stats_init(struct bgp_proto *p);
+void bgp_stats_time(struct bgp_proto *p, uint h, btime dt);
+void bgp_show_stats_info(struct bgp_proto *p);
+void bgp_show_stats(struct proto *P);
+
+/* mrt.c */
+
+void mrt_dump_table(struct symbol *sym, char *file);
+
 /* packets.c */
 
 void mrt_dump_bgp_state_change(struct bgp_conn *conn, unsigned old, unsigned new);
@@ -285,6 +481,12 @@ void bgp_schedule_packet(struct bgp_conn *conn, int type);
 void bgp_kick_tx(void *vconn);
 void bgp_tx(struct birdsock *sk);
 int bgp_rx(struct birdsock *sk, int size);
+void bgp_rx_thread_stop(struct bgp_conn *conn);
+int bgp_rx_thread_join(struct bgp_conn *conn);
+void bgp_ka_thread_start(struct bgp_conn *conn);
+void bgp_ka_thread_stop(struct bgp_conn *conn);
+void bgp_ka_thread_remains(struct bgp_conn *conn, int *hold, int *keepalive);
+void bgp_restart_hold_timer(struct bgp_conn *conn);
 const char * bgp_error_dsc(unsigned code, unsigned subcode);
 void bgp_log_error(struct bgp_proto *p, u8 class, char *msg, unsigned code, unsigned subcode, byte *data, unsigned len);
 
@@ -410,6 +612,8 @@ void bgp_log_error(struct bgp_proto *p, u8 class, char *msg, unsigned code, unsi
 #define BGP_COMM_NO_EXPORT		0xffffff01	/* Don't export outside local AS / confed. */
 #define BGP_COMM_NO_ADVERTISE		0xffffff02	/* Don't export at all */
 #define BGP_COMM_NO_EXPORT_SUBCONFED	0xffffff03	/* NO_EXPORT even in local confederation */
+#define BGP_COMM_LLGR_STALE		0xffff0006	/* Route is kept by long-lived graceful restart */
+#define BGP_COMM_NO_LLGR		0xffff0007	/* Do not keep the route as long-lived stale */
 
 /* Origins */
 
@@ -0,0 +1,317 @@
+/*
+ *	BIRD -- BGP Route Flap Dampening
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Route flap dampening
+ *
+ * When the &dampening option is enabled, received routes are subject to
+ * route flap dampening as described in RFC 2439. Each withdrawal of a route
+ * and each change of its attributes increases the penalty (figure of merit)
+ * of the route, which exponentially decays with configured half-life. When
+ * the penalty exceeds the suppress limit, the route is withdrawn from the
+ * routing table and further announcements are held back until the penalty
+ * falls below the reuse limit.
+ *
+ * State is kept only for routes that have flapped at least once, in a hash
+ * table keyed by prefix and ADD-PATH path ID. Entries are allocated from a
+ * slab and store just the penalty with the time of its last update, computing
+ * the decay lazily. Reuse of suppressed routes and removal of entries whose
+ * penalty dropped below half of the reuse limit are driven by a timer wheel
+ * (see lib/wheel.c), so there is no &timer per entry.
+ *
+ * The decay does not use floating point, the fraction of a half-life is
+ * applied from a table of 64 precomputed steps.
+ */
+
+#undef LOCAL_DEBUG
+
+#include "nest/bird.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "lib/resource.h"
+#include "lib/hash.h"
+#include "lib/wheel.h"
+
+#include "bgp.h"
+
+#define BGP_DAMP_WITHDRAW_PENALTY	1000
+#define BGP_DAMP_CHANGE_PENALTY		500
+
+#define BDH_KEY(n)		n->prefix, n->pxlen, n->path_id
+#define BDH_NEXT(n)		n->next
+#define BDH_EQ(p1,l1,i1,p2,l2,i2) ipa_equal(p1, p2) && l1 == l2 && i1 == i2
+#define BDH_FN(p,l,i)		ipa_hash32(p) ^ u32_hash((l << 16) ^ i)
+
+#define BDH_REHASH		bgp_damp_rehash
+#define BDH_PARAMS		/8, *2, 2, 2, 8, 24
+
+HASH_DEFINE_REHASH_FN(BDH, struct bgp_damp)
+
+static u32 bgp_damp_frac[64];		/* 2^(-i/64) in 16.16 fixed point */
+
+static void
+bgp_damp_init_frac(void)
+{
+  u64 x = 1 << 16;
+  uint i;
+
+  if (bgp_damp_frac[0])
+    return;
+
+  /* 2^(-1/64) = 0.98922...; repeated multiplication is precise enough */
+  for (i = 0; i < 64; i++, x = (x * 64830) >> 16)
+    bgp_damp_frac[i] = x;
+}
+
+static u32
+bgp_damp_decay(u32 penalty, bird_clock_t dt, uint half_life)
+{
+  if (dt <= 0)
+    return penalty;
+
+  if (dt / half_life >= 32)
+    return 0;
+
+  penalty >>= dt / half_life;
+  return ((u64) penalty * bgp_damp_frac[(dt % half_life) * 64 / half_life]) >> 16;
+}
+
+/* Time in which @penalty decays to @target */
+static bird_clock_t
+bgp_damp_time(u32 penalty, u32 target, uint half_life)
+{
+  bird_clock_t t = 0;
+  uint i;
+
+  for (; penalty > 2 * target; penalty /= 2)
+    t += half_life;
+
+  for (i = 0; (i < 64) && ((((u64) penalty * bgp_damp_frac[i]) >> 16) > target); i++)
+    ;
+
+  return t + (i * half_life + 63) / 64;
+}
+
+/**
+ * bgp_damp_ceiling - compute maximum penalty
+ * @cf: BGP configuration
+ *
+ * Penalty is limited, so that a suppressed route is reused after at most
+ * &max suppress time without further flaps.
+ */
+u32
+bgp_damp_ceiling(struct bgp_config *cf)
+{
+  u64 c = cf->damp_reuse;
+  uint t;
+
+  bgp_damp_init_frac();
+
+  for (t = cf->damp_max_suppress; (t >= cf->damp_half_life) && (c < 0x7fffffff); t -= cf->damp_half_life)
+    c *= 2;
+
+  /* The remaining part of a half-life */
+  if (t && (c < 0x7fffffff))
+    c = (c << 16) / bgp_damp_frac[t * 64 / cf->damp_half_life];
+
+  return MIN(c, 0x7fffffff);
+}
+
+static inline u32
+bgp_damp_penalty(struct bgp_proto *p, struct bgp_damp *d)
+{
+  d->penalty = bgp_damp_decay(d->penalty, now - d->updated, p->cf->damp_half_life);
+  d->updated = now;
+  return d->penalty;
+}
+
+static void
+bgp_damp_schedule(struct bgp_proto *p, struct bgp_damp *d)
+{
+  u32 target = d->suppressed ? p->cf->damp_reuse : p->cf->damp_reuse / 2;
+  wheel_add(p->damp_wheel, &d->wn, now + bgp_damp_time(d->penalty, target, p->cf->damp_half_life));
+}
+
+static void
+bgp_damp_penalize(struct bgp_proto *p, struct bgp_damp *d, u32 penalty)
+{
+  d->penalty = MIN(bgp_damp_penalty(p, d) + penalty, p->cf->damp_ceiling);
+
+  if (!d->suppressed && (d->penalty > p->cf->damp_suppress))
+    {
+      BGP_TRACE(D_ROUTES, "Suppressing %I/%d, penalty %u", d->prefix, d->pxlen, d->penalty);
+      d->suppressed = 1;
+      p->damp_suppressed++;
+    }
+
+  bgp_damp_schedule(p, d);
+}
+
+static void
+bgp_damp_delete(struct bgp_proto *p, struct bgp_damp *d)
+{
+  wheel_remove(p->damp_wheel, &d->wn);
+  HASH_REMOVE2(p->damp_hash, BDH, p->damp_pool, d);
+  rta_free(d->attrs);
+  sl_free(p->damp_slab, d);
+  p->damp_count--;
+}
+
+static void
+bgp_damp_expire(struct wheel *w, struct wheel_node *wn)
+{
+  struct bgp_proto *p = w->data;
+  struct bgp_damp *d = SKIP_BACK(struct bgp_damp, wn, wn);
+  u32 penalty = bgp_damp_penalty(p, d);
+
+  if (d->suppressed && (penalty <= p->cf->damp_reuse))
+    {
+      BGP_TRACE(D_ROUTES, "Reusing %I/%d", d->prefix, d->pxlen);
+      d->suppressed = 0;
+      p->damp_suppressed--;
+
+      if (d->attrs)
+	{
+	  net *n = net_get(p->p.table, d->prefix, d->pxlen);
+	  rte *e = rte_get_temp(rta_clone(d->attrs));
+	  e->net = n;
+	  e->pflags = 0;
+	  e->u.bgp.suppressed = 0;
+	  rte_update2(p->p.main_ahook, n, e, d->attrs->src);
+	}
+    }
+
+  if (!d->suppressed && (penalty <= p->cf->damp_reuse / 2))
+    bgp_damp_delete(p, d);
+  else
+    bgp_damp_schedule(p, d);
+}
+
+/**
+ * bgp_damp_init - start route flap dampening
+ * @p: BGP instance
+ *
+ * The dampening state lives for the duration of the established session.
+ */
+void
+bgp_damp_init(struct bgp_proto *p)
+{
+  bgp_damp_free(p);
+  bgp_damp_init_frac();
+
+  p->damp_pool = rp_new(p->p.pool, "Dampening");
+  p->damp_slab = sl_new(p->damp_pool, sizeof(struct bgp_damp));
+  HASH_INIT(p->damp_hash, p->damp_pool, 10);
+  p->damp_wheel = mb_alloc(p->damp_pool, sizeof(struct wheel));
+  wheel_init(p->damp_wheel, p->damp_pool, bgp_damp_expire, p);
+  p->damp_count = 0;
+  p->damp_suppressed = 0;
+}
+
+/**
+ * bgp_damp_free - drop dampening state
+ * @p: BGP instance
+ */
+void
+bgp_damp_free(struct bgp_proto *p)
+{
+  if (!p->damp_pool)
+    return;
+
+  HASH_WALK(p->damp_hash, next, d)
+    rta_free(d->attrs);
+  HASH_WALK_END;
+
+  rfree(p->damp_pool);
+  p->damp_pool = NULL;
+  p->damp_count = 0;
+  p->damp_suppressed = 0;
+}
+
+/**
+ * bgp_damp_update - account a received route
+ * @p: BGP instance
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ * @path_id: ADD-PATH path ID
+ * @a: cached route attributes
+ *
+ * Result: 1 if the route is suppressed and must not be imported.
+ */
+int
+bgp_damp_update(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id, rta *a)
+{
+  struct bgp_damp *d = HASH_FIND(p->damp_hash, BDH, prefix, pxlen, path_id);
+
+  if (!d)
+    return 0;
+
+  if (d->attrs != a)
+    {
+      /* Change of attributes of an announced route is a flap, too */
+      if (d->attrs)
+	bgp_damp_penalize(p, d, BGP_DAMP_CHANGE_PENALTY);
+
+      a = rta_clone(a);
+      rta_free(d->attrs);
+      d->attrs = a;
+    }
+
+  return d->suppressed;
+}
+
+/**
+ * bgp_damp_withdraw - account a withdrawn route
+ * @p: BGP instance
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ * @path_id: ADD-PATH path ID
+ * @present: the route is present in the routing table
+ */
+void
+bgp_damp_withdraw(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id, int present)
+{
+  struct bgp_damp *d = HASH_FIND(p->damp_hash, BDH, prefix, pxlen, path_id);
+
+  if (!d)
+    {
+      /* Start tracking at the first flap */
+      if (!present)
+	return;
+
+      d = sl_alloc(p->damp_slab);
+      d->prefix = prefix;
+      d->pxlen = pxlen;
+      d->path_id = path_id;
+      d->penalty = 0;
+      d->updated = now;
+      d->attrs = NULL;
+      d->suppressed = 0;
+      d->wn.expires = 0;
+      HASH_INSERT2(p->damp_hash, BDH, p->damp_pool, d);
+      p->damp_count++;
+    }
+  else if (!d->attrs)
+    return;
+
+  rta_free(d->attrs);
+  d->attrs = NULL;
+  bgp_damp_penalize(p, d, BGP_DAMP_WITHDRAW_PENALTY);
+}
+
+/**
+ * bgp_damp_suppressed - check whether a route is suppressed
+ * @p: BGP instance
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ * @path_id: ADD-PATH path ID
+ */
+int
+bgp_damp_suppressed(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id)
+{
+  struct bgp_damp *d = HASH_FIND(p->damp_hash, BDH, prefix, pxlen, path_id);
+  return d && d->suppressed;
+}
@@ -0,0 +1,328 @@
+/*
+ *	BIRD -- MRT Table Dumps
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: MRT table dumps
+ *
+ * The &dump table command writes a routing table to a file in the MRT
+ * TABLE_DUMP_V2 format [RFC 6396], which is understood by common offline
+ * analysis tools. The file starts with a PEER_INDEX_TABLE record describing
+ * the BGP protocols the routes come from, followed by one RIB_IPV4_UNICAST
+ * or RIB_IPV6_UNICAST record per network.
+ *
+ * The dump runs from a low-priority event and handles a bounded number of
+ * networks in each run, so it does not delay route processing even for large
+ * tables. The table is walked by a FIB iterator, therefore networks changed
+ * during the dump are written in the state they have when the iterator
+ * reaches them. The data go through a large stdio buffer to a temporary file,
+ * which replaces the target file when the dump is complete.
+ *
+ * Peers are identified by the protocol of the route source. Routes of other
+ * than BGP protocols are assigned to the first peer entry, which describes
+ * the local router.
+ */
+
+#undef LOCAL_DEBUG
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "nest/bird.h"
+#include "nest/cli.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "nest/mrtdump.h"
+#include "conf/conf.h"
+#include "lib/resource.h"
+#include "lib/event.h"
+#include "lib/hash.h"
+#include "lib/string.h"
+#include "lib/unaligned.h"
+#include "lib/nlri.h"
+
+#include "bgp.h"
+
+#define MRT_DUMP_STEP		1024	/* Networks written by one event run */
+#define MRT_DUMP_BUFFER		(1 << 20) /* Size of stdio buffer */
+#define MRT_ENTRY_MAX		(8 + BGP_MAX_ATTRS_LENGTH + 40)	/* Max size of one RIB entry */
+
+struct mrt_peer {
+  struct mrt_peer *next;		/* Next in hash chain */
+  struct proto *proto;			/* Protocol of route sources */
+  u16 index;				/* Index in PEER_INDEX_TABLE */
+};
+
+struct mrt_table_dump {
+  pool *pool;				/* Pool holding everything below */
+  rtable *table;			/* Dumped table, locked */
+  char *file, *tmp;			/* Target file and temporary file */
+  FILE *f;
+  char *buf;				/* Stdio buffer */
+  linpool *lp;				/* Temporary data of one step */
+  event *event;				/* Event running dump steps */
+  struct fib_iterator fit;		/* Position in the table */
+  HASH(struct mrt_peer) peer_hash;	/* Peers by protocol */
+  uint peers;				/* Number of peer entries */
+  u32 seq;				/* Sequence number of RIB records */
+};
+
+#define MPH_KEY(n)		n->proto
+#define MPH_NEXT(n)		n->next
+#define MPH_EQ(p1,p2)		p1 == p2
+#define MPH_FN(p)		ptr_hash(p)
+
+#define MPH_REHASH		mrt_peer_rehash
+#define MPH_PARAMS		/8, *2, 2, 2, 4, 16
+
+static inline u32 ptr_hash(void *ptr)
+{ uintptr_t p = (uintptr_t) ptr; return p ^ (p << 8) ^ (p >> 16); }
+
+HASH_DEFINE_REHASH_FN(MPH, struct mrt_peer)
+
+static inline byte *
+mrt_put_hdr(byte *buf, u16 type, u16 subtype, u32 len)
+{
+  put_u32(buf+0, now_real);
+  put_u16(buf+4, type);
+  put_u16(buf+6, subtype);
+  put_u32(buf+8, len);
+  return buf + MRTDUMP_HDR_LENGTH;
+}
+
+static byte *
+mrt_put_peer(byte *bp, u32 id, ip_addr addr, u32 as)
+{
+#ifdef IPV6
+  *bp++ = 0x03;				/* IPv6 address, AS4 */
+#else
+  *bp++ = 0x02;				/* AS4 */
+#endif
+  put_u32(bp, id);
+  bp = put_ipa(bp + 4, addr);
+  put_u32(bp, as);
+  return bp + 4;
+}
+
+static void
+mrt_dump_peers(struct mrt_table_dump *d)
+{
+  struct proto *P;
+  uint n = 1, len;
+
+  WALK_LIST(P, active_proto_list)
+    if (P->proto == &proto_bgp)
+      n++;
+
+  len = strlen(d->table->name);
+  byte *buf = lp_alloc(d->lp, MRTDUMP_HDR_LENGTH + 8 + len + n * (9 + sizeof(ip_addr)));
+  byte *bp = buf + MRTDUMP_HDR_LENGTH;
+
+  put_u32(bp, config->router_id);
+  put_u16(bp+4, len);
+  memcpy(bp+6, d->table->name, len);
+  bp += 6 + len;
+  put_u16(bp, n);
+  bp += 2;
+
+  /* The first entry is the local router */
+  bp = mrt_put_peer(bp, config->router_id, IPA_NONE, 0);
+  d->peers = 1;
+
+  WALK_LIST(P, active_proto_list)
+    if (P->proto == &proto_bgp)
+      {
+	struct bgp_proto *p = (struct bgp_proto *) P;
+	struct mrt_peer *mp = mb_alloc(d->pool, sizeof(struct mrt_peer));
+	mp->proto = P;
+	mp->index = d->peers++;
+	HASH_INSERT2(d->peer_hash, MPH, d->pool, mp);
+
+	bp = mrt_put_peer(bp, p->remote_id, p->cf->remote_ip, p->remote_as);
+      }
+
+  mrt_put_hdr(buf, TABLE_DUMP_V2, TDV2_PEER_INDEX_TABLE, bp - buf - MRTDUMP_HDR_LENGTH);
+  fwrite(buf, bp - buf, 1, d->f);
+}
+
+static inline uint
+mrt_peer_index(struct mrt_table_dump *d, struct proto *P)
+{
+  struct mrt_peer *mp = HASH_FIND(d->peer_hash, MPH, P);
+  return mp ? mp->index : 0;
+}
+
+static byte *
+mrt_put_attrs(struct mrt_table_dump *d, byte *bp, rte *e)
+{
+  ea_list *o = e->attrs->eattrs;
+  uint i, n = 0;
+
+  /* Only BGP attributes are written */
+  ea_list *l = lp_alloc(d->lp, sizeof(ea_list) + (o ? o->count : 0) * sizeof(eattr));
+  l->next = NULL;
+  l->flags = EALF_SORTED;
+  for (i = 0; o && (i < o->count); i++)
+    if (EA_PROTO(o->attrs[i].id) == EAP_BGP)
+      l->attrs[n++] = o->attrs[i];
+  l->count = n;
+
+  int len = bgp_encode_attrs_as4(1, bp + 2, l, BGP_MAX_ATTRS_LENGTH);
+  if (len < 0)
+    len = 0;
+
+#ifdef IPV6
+  /* RIB entries use abbreviated MP_REACH_NLRI with just the next hop */
+  eattr *nh = ea_find(l, EA_CODE(EAP_BGP, BA_NEXT_HOP));
+  ip_addr *nhs = nh ? (ip_addr *) nh->u.ptr->data : &e->attrs->gw;
+  uint cnt = (nh && (nh->u.ptr->length == NEXT_HOP_LENGTH) && ipa_nonzero(nhs[1])) ? 2 : 1;
+  byte *x = bp + 2 + len;
+
+  x[0] = BAF_OPTIONAL;
+  x[1] = BA_MP_REACH_NLRI;
+  x[2] = 1 + cnt * 16;
+  x[3] = cnt * 16;
+  for (i = 0, x += 4; i < cnt; i++)
+    x = put_ipa(x, nhs[i]);
+  len = x - (bp + 2);
+#endif
+
+  put_u16(bp, len);
+  return bp + 2 + len;
+}
+
+static void
+mrt_dump_net(struct mrt_table_dump *d, net *n)
+{
+  uint cnt = 0;
+  rte *e;
+
+  for (e = n->routes; e; e = e->next)
+    if (rte_is_valid(e))
+      cnt++;
+
+  if (!cnt)
+    return;
+
+  byte *buf = lp_alloc(d->lp, MRTDUMP_HDR_LENGTH + 8 + sizeof(ip_addr) + cnt * MRT_ENTRY_MAX);
+  byte *bp = buf + MRTDUMP_HDR_LENGTH;
+
+  put_u32(bp, d->seq++);
+  bp += 4 + nlri_put_prefix(bp+4, n->n.prefix, n->n.pxlen);
+  put_u16(bp, MIN(cnt, 0xffff));
+  bp += 2;
+
+  for (e = n->routes, cnt = 0; e && (cnt < 0xffff); e = e->next)
+    if (rte_is_valid(e))
+      {
+	put_u16(bp, mrt_peer_index(d, e->attrs->src->proto));
+	put_u32(bp+2, now_real - (now - e->lastmod));
+	bp = mrt_put_attrs(d, bp + 6, e);
+	cnt++;
+      }
+
+#ifdef IPV6
+  uint subtype = TDV2_RIB_IPV6_UNICAST;
+#else
+  uint subtype = TDV2_RIB_IPV4_UNICAST;
+#endif
+
+  mrt_put_hdr(buf, TABLE_DUMP_V2, subtype, bp - buf - MRTDUMP_HDR_LENGTH);
+  fwrite(buf, bp - buf, 1, d->f);
+}
+
+static void
+mrt_dump_done(struct mrt_table_dump *d)
+{
+  int err = ferror(d->f);
+
+  if (fclose(d->f) || err)
+    log(L_ERR "Dump of table %s to %s failed: %m", d->table->name, d->file);
+  else if (rename(d->tmp, d->file) < 0)
+    log(L_ERR "Cannot rename %s to %s: %m", d->tmp, d->file);
+  else
+    log(L_INFO "Table %s dumped to %s, %u networks", d->table->name, d->file, d->seq);
+
+  rt_unlock_table(d->table);
+  rfree(d->pool);
+}
+
+static void
+mrt_dump_step(void *data)
+{
+  struct mrt_table_dump *d = data;
+  int max = MRT_DUMP_STEP;
+
+  FIB_ITERATE_START(&d->table->fib, &d->fit, fn)
+    {
+      if (max-- <= 0)
+	{
+	  FIB_ITERATE_PUT(&d->fit, fn);
+	  lp_flush(d->lp);
+	  ev_schedule_work(d->event);
+	  return;
+	}
+
+      mrt_dump_net(d, (net *) fn);
+    }
+  FIB_ITERATE_END(fn);
+
+  mrt_dump_done(d);
+}
+
+/**
+ * mrt_dump_table - start a TABLE_DUMP_V2 dump
+ * @sym: table symbol
+ * @file: name of the target file
+ *
+ * This function implements the &dump table CLI command. The dump itself
+ * continues asynchronously and its result is logged.
+ */
+void
+mrt_dump_table(struct symbol *sym, char *file)
+{
+  rtable *t = ((struct rtable_config *) sym->def)->table;
+  pool *pp;
+
+  if (!t)
+    {
+      cli_msg(8009, "Table %s is not active", sym->name);
+      return;
+    }
+
+  pp = rp_new(&root_pool, "MRT table dump");
+  struct mrt_table_dump *d = mb_allocz(pp, sizeof(struct mrt_table_dump));
+  d->pool = pp;
+  d->table = t;
+  d->file = mb_alloc(pp, strlen(file) + 1);
+  strcpy(d->file, file);
+  d->tmp = mb_alloc(pp, strlen(file) + 5);
+  bsprintf(d->tmp, "%s.tmp", file);
+
+  if (!(d->f = fopen(d->tmp, "w")))
+    {
+      cli_msg(8009, "Cannot create %s: %m", d->tmp);
+      rfree(pp);
+      return;
+    }
+
+  d->buf = mb_alloc(pp, MRT_DUMP_BUFFER);
+  setvbuf(d->f, d->buf, _IOFBF, MRT_DUMP_BUFFER);
+  d->lp = lp_new(pp, 16384);
+  HASH_INIT(d->peer_hash, pp, 4);
+  d->event = ev_new(pp);
+  d->event->hook = mrt_dump_step;
+  d->event->data = d;
+
+  rt_lock_table(t);
+  mrt_dump_peers(d);
+  lp_flush(d->lp);
+
+  FIB_ITERATE_INIT(&d->fit, &t->fib);
+  ev_schedule_work(d->event);
+
+  cli_msg(25, "Dumping table %s to %s", t->name, file);
+}
@@ -0,0 +1,442 @@
+/*
+ *	BIRD -- BGP Outbound Route Filtering
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Outbound route filtering
+ *
+ * Address prefix ORF (RFC 5291, RFC 5292) allows a BGP speaker to push a list
+ * of prefixes it is interested in to the neighbor, which applies the list to
+ * routes it advertises back. Unwanted routes are then neither sent nor decoded
+ * just to be dropped by the import filter.
+ *
+ * With &orf prefix option, BIRD announces the ability to send ORFs and, when
+ * the neighbor is able to receive them, sends the configured list in
+ * ROUTE-REFRESH messages right after the session is established. The list
+ * starts with a REMOVE-ALL entry, so it may be simply resent after
+ * reconfiguration. Long lists are split to several messages, all but the last
+ * one with the DEFER flag.
+ *
+ * With &orf receive option, BIRD accepts ORFs from the neighbor. The entries
+ * are kept in an array sorted by their sequence numbers, the first matching
+ * entry decides and routes not matching any entry are not sent. The list is
+ * applied in bgp_import_control() before any attribute processing or export
+ * filter. Lists of permit entries only (the usual case) are compiled to a
+ * &f_trie, so the check is one trie lookup regardless of the list size.
+ * Sessions with received ORFs do not share export groups, as their exports
+ * differ.
+ */
+
+#undef LOCAL_DEBUG
+
+#include "nest/bird.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "lib/resource.h"
+#include "lib/unaligned.h"
+#include "lib/nlri.h"
+#include "filter/filter.h"
+
+#include "bgp.h"
+
+#define BGP_ORF_IMMEDIATE	1	/* When-to-refresh values */
+#define BGP_ORF_DEFER		2
+
+#define BGP_ORF_ADD		0	/* Entry actions */
+#define BGP_ORF_REMOVE		1
+#define BGP_ORF_REMOVE_ALL	2
+#define BGP_ORF_DENY		0x20	/* Match bit of entry */
+
+#define BGP_ORF_ENTRY_MAX	(7 + NLRI_MAX_LENGTH)	/* Encoded prefix ORF entry */
+
+
+static inline int
+bgp_orf_entry_same(struct bgp_orf_entry *a, struct bgp_orf_entry *b)
+{
+  return (a->seq == b->seq) && ipa_equal(a->prefix, b->prefix) && (a->pxlen == b->pxlen) &&
+    (a->lo == b->lo) && (a->hi == b->hi) && (a->deny == b->deny);
+}
+
+/* Position of the first entry with sequence number higher than @seq */
+static uint
+bgp_orf_find(struct bgp_orf *o, u32 seq)
+{
+  uint l = 0, h = o->count;
+
+  while (l < h)
+    {
+      uint m = (l + h) / 2;
+      if (o->e[m].seq <= seq)
+	l = m + 1;
+      else
+	h = m;
+    }
+
+  return l;
+}
+
+static int
+bgp_orf_add(struct bgp_proto *p, struct bgp_orf_entry *n)
+{
+  struct bgp_orf *o = p->orf;
+  uint i, pos;
+
+  if (!o)
+    o = p->orf = mb_allocz(p->p.pool, sizeof(struct bgp_orf));
+
+  pos = bgp_orf_find(o, n->seq);
+  for (i = pos; (i > 0) && (o->e[i-1].seq == n->seq); i--)
+    if (bgp_orf_entry_same(&o->e[i-1], n))
+      return 0;
+
+  if (o->count >= BGP_ORF_MAX_ENTRIES)
+    return -1;
+
+  if (o->count == o->size)
+    {
+      o->size = o->size ? 2 * o->size : 16;
+      o->e = o->e ? mb_realloc(o->e, o->size * sizeof(struct bgp_orf_entry)) :
+	mb_alloc(p->p.pool, o->size * sizeof(struct bgp_orf_entry));
+    }
+
+  memmove(o->e + pos + 1, o->e + pos, (o->count - pos) * sizeof(struct bgp_orf_entry));
+  o->e[pos] = *n;
+  o->count++;
+  return 0;
+}
+
+static void
+bgp_orf_remove(struct bgp_proto *p, struct bgp_orf_entry *n)
+{
+  struct bgp_orf *o = p->orf;
+  uint i;
+
+  if (!o)
+    return;
+
+  for (i = bgp_orf_find(o, n->seq); (i > 0) && (o->e[i-1].seq == n->seq); i--)
+    if (bgp_orf_entry_same(&o->e[i-1], n))
+      {
+	memmove(o->e + i - 1, o->e + i, (o->count - i) * sizeof(struct bgp_orf_entry));
+	o->count--;
+	return;
+      }
+}
+
+static void
+bgp_orf_compile(struct bgp_proto *p)
+{
+  struct bgp_orf *o = p->orf;
+  uint i;
+
+  if (o->lp)
+    rfree(o->lp);
+
+  o->lp = NULL;
+  o->trie = NULL;
+
+  for (i = 0; i < o->count; i++)
+    if (o->e[i].deny)
+      return;
+
+  if (!o->count)
+    return;
+
+  o->lp = lp_new(p->p.pool, 4080);
+  o->trie = f_new_trie(o->lp, sizeof(struct f_trie_node));
+
+  for (i = 0; i < o->count; i++)
+    trie_add_prefix(o->trie, o->e[i].prefix, o->e[i].pxlen, o->e[i].lo, o->e[i].hi);
+
+  trie_compile(o->trie);
+}
+
+/**
+ * bgp_orf_free - free prefix ORF received from the neighbor
+ * @p: BGP instance
+ *
+ * Called when the session is closed, as ORFs are bound to it.
+ */
+void
+bgp_orf_free(struct bgp_proto *p)
+{
+  struct bgp_orf *o = p->orf;
+
+  if (!o)
+    return;
+
+  if (o->lp)
+    rfree(o->lp);
+
+  mb_free(o->e);
+  mb_free(o);
+  p->orf = NULL;
+}
+
+/**
+ * bgp_orf_permitted - check a route against received prefix ORF
+ * @p: BGP instance
+ * @prefix: network prefix of the route
+ * @pxlen: prefix length
+ *
+ * Returns 1 if the neighbor asked for the route, or if it sent no ORF entries.
+ */
+int
+bgp_orf_permitted(struct bgp_proto *p, ip_addr prefix, int pxlen)
+{
+  struct bgp_orf *o = p->orf;
+  uint i;
+
+  if (!o || !o->count)
+    return 1;
+
+  if (o->trie)
+    return trie_match_prefix(o->trie, prefix, pxlen);
+
+  for (i = 0; i < o->count; i++)
+    {
+      struct bgp_orf_entry *e = &o->e[i];
+
+      if ((pxlen >= e->lo) && (pxlen <= e->hi) && ipa_in_net(prefix, e->prefix, e->pxlen))
+	return !e->deny;
+    }
+
+  return 0;
+}
+
+/*
+ * Minlen and Maxlen of prefix ORF entries [RFC 5292 3] are both zero for an
+ * exact match. Otherwise, zero Minlen stands for the prefix length and zero
+ * Maxlen for the maximal length.
+ */
+static inline void
+bgp_orf_encode_lens(byte *buf, uint pxlen, uint lo, uint hi)
+{
+  buf[0] = (lo > pxlen) ? lo : 0;
+  buf[1] = ((lo == pxlen) && (hi == pxlen)) ? 0 : hi;
+}
+
+static inline void
+bgp_orf_decode_lens(byte *buf, uint pxlen, uint *lo, uint *hi)
+{
+  uint minlen = buf[0], maxlen = buf[1];
+
+  *lo = MAX(minlen, pxlen);
+  *hi = maxlen ? MIN(maxlen, BITS_PER_IP_ADDRESS) : (minlen ? BITS_PER_IP_ADDRESS : pxlen);
+}
+
+/**
+ * bgp_orf_start - start sending configured prefix ORF
+ * @conn: BGP connection
+ *
+ * Schedules ROUTE-REFRESH messages with the configured ORF list, if both sides
+ * negotiated it. Any sending already in progress is restarted.
+ */
+void
+bgp_orf_start(struct bgp_conn *conn)
+{
+  if (!bgp_orf_tx_ready(conn))
+    return;
+
+  conn->orf_tx = 1;
+  conn->orf_tx_seq = 0;
+  conn->orf_tx_next = conn->bgp->cf->orf_prefixes;
+  bgp_schedule_packet(conn, PKT_ROUTE_REFRESH);
+}
+
+/**
+ * bgp_orf_put - encode prefix ORF to ROUTE-REFRESH message
+ * @conn: BGP connection
+ * @buf: position after AFI/SAFI of the message
+ * @remains: available space
+ *
+ * Encodes as many entries of the configured list as fit into @remains bytes.
+ * The first message starts with REMOVE-ALL entry. When entries remain to be
+ * sent, the message is marked with DEFER flag and @conn->orf_tx stays set, so
+ * the caller schedules another message. Returns the end of the message.
+ */
+byte *
+bgp_orf_put(struct bgp_conn *conn, byte *buf, uint remains)
+{
+  struct bgp_proto *p = conn->bgp;
+  struct bgp_orf_prefix *px;
+  byte *pos = buf + 4;
+  uint n = 0;
+
+  remains -= 4;
+  if (!conn->orf_tx_seq)
+    {
+      *pos++ = BGP_ORF_REMOVE_ALL << 6;
+      remains--;
+    }
+
+  for (px = conn->orf_tx_next; px && (remains >= BGP_ORF_ENTRY_MAX); px = px->next, n++)
+    {
+      byte *start = pos;
+
+      *pos++ = BGP_ORF_ADD << 6;	/* Permit */
+      put_u32(pos, ++conn->orf_tx_seq);
+      bgp_orf_encode_lens(pos + 4, px->pxlen, px->lo, px->hi);
+      pos += 6;
+      pos += nlri_put_prefix(pos, px->prefix, px->pxlen);
+      remains -= pos - start;
+    }
+
+  conn->orf_tx_next = px;
+  conn->orf_tx = !!px;
+
+  buf[0] = px ? BGP_ORF_DEFER : BGP_ORF_IMMEDIATE;
+  buf[1] = BGP_ORF_PREFIX;
+  put_u16(buf + 2, pos - (buf + 4));
+
+  BGP_TRACE(D_PACKETS, "Sending %u prefix ORF entries%s", n, px ? ", deferred" : "");
+  return pos;
+}
+
+static int
+bgp_orf_rx_entries(struct bgp_proto *p, byte *pos, uint len)
+{
+  struct bgp_orf_entry e;
+  ip_addr prefix;
+  int pxlen, q;
+  uint lo, hi;
+
+  while (len)
+    {
+      uint action = pos[0] >> 6;
+
+      if (action == BGP_ORF_REMOVE_ALL)
+	{
+	  if (p->orf)
+	    p->orf->count = 0;
+	  pos++;
+	  len--;
+	  continue;
+	}
+
+      if ((action != BGP_ORF_ADD) && (action != BGP_ORF_REMOVE))
+	return -1;
+
+      if (len < 8)
+	return -1;
+
+      q = nlri_get_prefix(pos + 7, len - 7, &prefix, &pxlen);
+      if (q < 0)
+	return -1;
+
+      bgp_orf_decode_lens(pos + 5, pxlen, &lo, &hi);
+
+      e.prefix = prefix;
+      e.seq = get_u32(pos + 1);
+      e.pxlen = pxlen;
+      e.lo = lo;
+      e.hi = hi;
+      e.deny = !!(pos[0] & BGP_ORF_DENY);
+
+      /* Entries with empty length range match nothing */
+      if (lo <= hi)
+	{
+	  if (action == BGP_ORF_ADD)
+	  {
+	    if (bgp_orf_add(p, &e) < 0)
+	      return -2;
+	  }
+	  else
+	    bgp_orf_remove(p, &e);
+	}
+
+      pos += 7 + q;
+      len -= 7 + q;
+    }
+
+  return 0;
+}
+
+/**
+ * bgp_orf_rx - process ORF part of received ROUTE-REFRESH message
+ * @conn: BGP connection
+ * @pos: position after AFI/SAFI of the message
+ * @len: remaining length
+ *
+ * Updates the received prefix ORF list. ORFs of other types are ignored.
+ * Returns 1 if the neighbor asked for immediate refresh, 0 if the refresh
+ * is deferred, -1 if the message is malformed, or -2 if the list would
+ * exceed %BGP_ORF_MAX_ENTRIES entries.
+ */
+int
+bgp_orf_rx(struct bgp_conn *conn, byte *pos, uint len)
+{
+  struct bgp_proto *p = conn->bgp;
+  uint when = BGP_ORF_IMMEDIATE;
+  int changed = 0, rv;
+
+  while (len)
+    {
+      if (len < 4)
+	return -1;
+
+      uint type = pos[1], olen = get_u16(pos + 2);
+      when = pos[0];
+      pos += 4;
+      len -= 4;
+
+      if (olen > len)
+	return -1;
+
+      if (type == BGP_ORF_PREFIX)
+	{
+	  if ((rv = bgp_orf_rx_entries(p, pos, olen)) < 0)
+	    return rv;
+	  changed = 1;
+	}
+
+      pos += olen;
+      len -= olen;
+    }
+
+  if (changed && p->orf)
+    {
+      bgp_orf_compile(p);
+      BGP_TRACE(D_PACKETS, "Got prefix ORF, %u entries", p->orf->count);
+    }
+
+  return when != BGP_ORF_DEFER;
+}
+
+int
+bgp_orf_same(struct bgp_orf_prefix *a, struct bgp_orf_prefix *b)
+{
+  for (; a && b; a = a->next, b = b->next)
+    if (!ipa_equal(a->prefix, b->prefix) || (a->pxlen != b->pxlen) || (a->lo != b->lo) || (a->hi != b->hi))
+      return 0;
+
+  return !a && !b;
+}
+
+/**
+ * bgp_orf_restore - restore prefix ORF of a handed off session
+ * @p: BGP instance
+ * @data: entries sorted by sequence numbers, possibly unaligned
+ * @count: number of entries
+ *
+ * The neighbor does not resend its ORF to a session which was not reset,
+ * so the list received by the old process is taken over (see bgp_adopt()).
+ */
+void
+bgp_orf_restore(struct bgp_proto *p, const byte *data, uint count)
+{
+  struct bgp_orf *o;
+
+  bgp_orf_free(p);
+  if (!count)
+    return;
+
+  o = p->orf = mb_allocz(p->p.pool, sizeof(struct bgp_orf));
+  o->e = mb_alloc(p->p.pool, count * sizeof(struct bgp_orf_entry));
+  o->size = o->count = count;
+  memcpy(o->e, data, count * sizeof(struct bgp_orf_entry));
+
+  bgp_orf_compile(p);
+}
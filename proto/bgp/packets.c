@@ -16,6 +16,8 @@
 #include "nest/mrtdump.h"
 #include "conf/conf.h"
 #include "lib/unaligned.h"
+#include "lib/nlri.h"
+#include "lib/probe.h"
 #include "lib/socket.h"
 
 #include "nest/cli.h"
@@ -23,6 +25,17 @@
 #include "bgp.h"
 #include "../../filter/filter.h"
 
+#ifdef CONFIG_BFD
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "proto/bfd/io.h"
+#endif
+
 
 #define BGP_RR_REQUEST		0
 #define BGP_RR_BEGIN		1
@@ -164,6 +177,21 @@ bgp_put_cap_rr(struct bgp_proto *p UNUSED, byte *buf)
   return buf;
 }
 
+static byte *
+bgp_put_cap_orf(struct bgp_proto *p, byte *buf)
+{
+  *buf++ = 3;		/* Capability 3: Support for outbound route filtering */
+  *buf++ = 7;		/* Capability data length */
+  *buf++ = 0;		/* Appropriate AF */
+  *buf++ = BGP_AF;
+  *buf++ = 0;		/* Reserved */
+  *buf++ = 1;		/* SAFI 1 */
+  *buf++ = 1;		/* Number of ORF types */
+  *buf++ = BGP_ORF_PREFIX;
+  *buf++ = (p->cf->orf_prefixes ? BGP_ORF_SEND : 0) | (p->cf->orf_receive ? BGP_ORF_RECEIVE : 0);
+  return buf;
+}
+
 static byte *
 bgp_put_cap_gr1(struct bgp_proto *p, byte *buf)
 {
@@ -192,6 +220,30 @@ bgp_put_cap_gr2(struct bgp_proto *p, byte *buf)
   return buf + 2;
 }
 
+static byte *
+bgp_put_cap_llgr1(struct bgp_proto *p, byte *buf)
+{
+  *buf++ = 71;		/* Capability 71: Support for long-lived graceful restart */
+  *buf++ = 7;		/* Capability data length */
+
+  *buf++ = 0;		/* Appropriate AF */
+  *buf++ = BGP_AF;
+  *buf++ = 1;		/* and SAFI 1 */
+
+  put_u32(buf, p->cf->llgr_time);	/* Flags and 3 B of stale time */
+  buf[0] = p->p.gr_recovery ? BGP_LLGRF_FORWARDING : 0;
+
+  return buf + 4;
+}
+
+static byte *
+bgp_put_cap_llgr2(struct bgp_proto *p UNUSED, byte *buf)
+{
+  *buf++ = 71;		/* Capability 71: Support for long-lived graceful restart */
+  *buf++ = 0;		/* Capability data length */
+  return buf;
+}
+
 static byte *
 bgp_put_cap_as4(struct bgp_proto *p, byte *buf)
 {
@@ -278,11 +330,19 @@ bgp_create_open(struct bgp_conn *conn, byte *buf)
   if (p->cf->enable_refresh)
     cap = bgp_put_cap_rr(p, cap);
 
+  if (p->cf->orf_prefixes || p->cf->orf_receive)
+    cap = bgp_put_cap_orf(p, cap);
+
   if (p->cf->gr_mode == BGP_GR_ABLE)
     cap = bgp_put_cap_gr1(p, cap);
   else if (p->cf->gr_mode == BGP_GR_AWARE)
     cap = bgp_put_cap_gr2(p, cap);
 
+  if (p->cf->llgr_mode == BGP_LLGR_ABLE)
+    cap = bgp_put_cap_llgr1(p, cap);
+  else if (p->cf->llgr_mode == BGP_LLGR_AWARE)
+    cap = bgp_put_cap_llgr2(p, cap);
+
   if (p->cf->enable_as4)
     cap = bgp_put_cap_as4(p, cap);
 
@@ -317,10 +377,9 @@ static uint
 bgp_encode_prefixes(struct bgp_proto *p, byte *w, struct bgp_bucket *buck, uint remains)
 {
   byte *start = w;
-  ip_addr a;
   int bytes;
 
-  while (!EMPTY_LIST(buck->prefixes) && (remains >= (5+sizeof(ip_addr))))
+  while (!EMPTY_LIST(buck->prefixes) && (remains >= (4+NLRI_MAX_LENGTH)))
     {
       struct bgp_prefix *px = SKIP_BACK(struct bgp_prefix, bucket_node, HEAD(buck->prefixes));
       DBG("\tDequeued route %I/%d\n", px->n.prefix, px->n.pxlen);
@@ -332,13 +391,9 @@ bgp_encode_prefixes(struct bgp_proto *p, byte *w, struct bgp_bucket *buck, uint
 	  remains -= 4;
 	}
 
-      *w++ = px->n.pxlen;
-      bytes = (px->n.pxlen + 7) / 8;
-      a = px->n.prefix;
-      ipa_hton(a);
-      memcpy(w, &a, bytes);
+      bytes = nlri_put_prefix(w, px->n.prefix, px->n.pxlen);
       w += bytes;
-      remains -= bytes + 1;
+      remains -= bytes;
       rem_node(&px->bucket_node);
       bgp_free_prefix(p, px);
       // fib_delete(&p->prefix_fib, px);
@@ -359,6 +414,37 @@ bgp_flush_prefixes(struct bgp_proto *p, struct bgp_bucket *buck)
     }
 }
 
+/*
+ * Buckets with incremental changes are sent before buckets filled by
+ * a feed, so that convergence-critical updates are not queued behind bulk
+ * re-advertisements. Within each queue, a bucket yields its turn after
+ * &bucket_quantum messages, so that large buckets do not starve small ones.
+ */
+static struct bgp_bucket *
+bgp_next_bucket(struct bgp_proto *p)
+{
+  if (!EMPTY_LIST(p->bucket_urgent))
+    return HEAD(p->bucket_urgent);
+
+  if (!EMPTY_LIST(p->bucket_queue))
+    return HEAD(p->bucket_queue);
+
+  return NULL;
+}
+
+static void
+bgp_bucket_sent(struct bgp_proto *p, struct bgp_bucket *buck)
+{
+  uint quantum = p->cf->bucket_quantum;
+
+  if (!quantum || EMPTY_LIST(buck->prefixes) || (++buck->sent < quantum))
+    return;
+
+  buck->sent = 0;
+  rem_node(&buck->send_node);
+  add_tail(buck->urgent ? &p->bucket_urgent : &p->bucket_queue, &buck->send_node);
+}
+
 #ifndef IPV6		/* IPv4 version */
 
 static byte *
@@ -371,6 +457,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
   int wd_size = 0;
   int r_size = 0;
   int a_size = 0;
+  byte *a_data;
 
   w = buf+2;
   if ((buck = p->withdraw_bucket) && !EMPTY_LIST(buck->prefixes))
@@ -384,7 +471,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 
   if (remains >= 3072)
     {
-      while ((buck = (struct bgp_bucket *) HEAD(p->bucket_queue))->send_node.next)
+      while (buck = bgp_next_bucket(p))
 	{
 	  if (EMPTY_LIST(buck->prefixes))
 	    {
@@ -395,7 +482,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	    }
 
 	  DBG("Processing bucket %p\n", buck);
-	  a_size = bgp_encode_attrs(p, w+2, buck->eattrs, 2048);
+	  a_size = bgp_bucket_attrs(p, buck, &a_data);
 
 	  if (a_size < 0)
 	    {
@@ -407,9 +494,11 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	    }
 
 	  put_u16(w, a_size);
+	  memcpy(w+2, a_data, a_size);
 	  w += a_size + 2;
 	  r_size = bgp_encode_prefixes(p, w, buck, remains - a_size);
 	  w += r_size;
+	  bgp_bucket_sent(p, buck);
 	  break;
 	}
     }
@@ -453,7 +542,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
   struct bgp_bucket *buck;
   int size, second, rem_stored;
   int remains = bgp_max_packet_length(p) - BGP_HEADER_LENGTH - 4;
-  byte *w, *w_stored, *tmp, *tstart;
+  byte *w, *w_stored, *tmp, *tstart, *a_data;
   ip_addr *ipp, ip, ip_ll;
   ea_list *ea;
   eattr *nh;
@@ -477,7 +566,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 
   if (remains >= 3072)
     {
-      while ((buck = (struct bgp_bucket *) HEAD(p->bucket_queue))->send_node.next)
+      while (buck = bgp_next_bucket(p))
 	{
 	  if (EMPTY_LIST(buck->prefixes))
 	    {
@@ -491,7 +580,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	  rem_stored = remains;
 	  w_stored = w;
 
-	  size = bgp_encode_attrs(p, w, buck->eattrs, 2048);
+	  size = bgp_bucket_attrs(p, buck, &a_data);
 	  if (size < 0)
 	    {
 	      log(L_ERR "%s: Attribute list too long, skipping corresponding routes", p->p.name);
@@ -500,6 +589,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	      bgp_free_bucket(p, buck);
 	      continue;
 	    }
+	  memcpy(w, a_data, size);
 	  w += size;
 	  remains -= size;
 
@@ -590,6 +680,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	  size = bgp_encode_attrs(p, w, ea, remains);
 	  ASSERT(size >= 0);
 	  w += size;
+	  bgp_bucket_sent(p, buck);
 	  break;
 	}
     }
@@ -639,6 +730,11 @@ bgp_create_route_refresh(struct bgp_conn *conn, byte *buf)
   *buf++ = BGP_AF;
   *buf++ = BGP_RR_REQUEST;
   *buf++ = 1;		/* SAFI */
+
+  /* Prefix ORF, RFC 5291 */
+  if (conn->orf_tx)
+    buf = bgp_orf_put(conn, buf, bgp_max_packet_length(p) - BGP_HEADER_LENGTH - 4);
+
   return buf;
 }
 
@@ -679,38 +775,28 @@ bgp_create_header(byte *buf, uint len, uint type)
   buf[18] = type;
 }
 
-/**
- * bgp_fire_tx - transmit packets
- * @conn: connection
+/*
+ * bgp_create_packet - assemble the highest priority queued packet
  *
- * Whenever the transmit buffers of the underlying TCP connection
- * are free and we have any packets queued for sending, the socket functions
- * call bgp_fire_tx() which takes care of selecting the highest priority packet
- * queued (Notification > Keepalive > Open > Update), assembling its header
- * and body and sending it to the connection.
+ * Builds the packet at @buf (including its header) and returns its end, or
+ * NULL if there is nothing to send. Returns @buf when the connection was
+ * closed instead.
  */
-static int
-bgp_fire_tx(struct bgp_conn *conn)
+static byte *
+bgp_create_packet(struct bgp_conn *conn, byte *buf)
 {
   struct bgp_proto *p = conn->bgp;
   uint s = conn->packets_to_send;
-  sock *sk = conn->sk;
-  byte *buf, *pkt, *end;
+  byte *pkt, *end;
   int type;
 
-  if (!sk)
-    {
-      conn->packets_to_send = 0;
-      return 0;
-    }
-  buf = sk->tbuf;
   pkt = buf + BGP_HEADER_LENGTH;
 
   if (s & (1 << PKT_SCHEDULE_CLOSE))
     {
       /* We can finally close connection and enter idle state */
       bgp_conn_enter_idle_state(conn);
-      return 0;
+      return buf;
     }
   if (s & (1 << PKT_NOTIFICATION))
     {
@@ -724,7 +810,8 @@ bgp_fire_tx(struct bgp_conn *conn)
       type = PKT_KEEPALIVE;
       end = pkt;			/* Keepalives carry no data */
       BGP_TRACE(D_PACKETS, "Sending KEEPALIVE");
-      bgp_start_timer(conn->keepalive_timer, conn->keepalive_time);
+      if (!conn->ka_thread)
+	bgp_start_timer(conn->keepalive_timer, conn->keepalive_time);
     }
   else if (s & (1 << PKT_OPEN))
     {
@@ -737,6 +824,10 @@ bgp_fire_tx(struct bgp_conn *conn)
       s &= ~(1 << PKT_ROUTE_REFRESH);
       type = PKT_ROUTE_REFRESH;
       end = bgp_create_route_refresh(conn, pkt);
+
+      /* Long ORF list continues in the next message */
+      if (conn->orf_tx)
+	s |= 1 << PKT_ROUTE_REFRESH;
     }
   else if (s & (1 << PKT_BEGIN_REFRESH))
     {
@@ -746,9 +837,14 @@ bgp_fire_tx(struct bgp_conn *conn)
     }
   else if (s & (1 << PKT_UPDATE))
     {
+      btime t0 = precise_time();
+
       type = PKT_UPDATE;
       end = bgp_create_update(conn, pkt);
 
+      if (end)
+	bgp_stats_time(p, BGP_HIST_EXPORT, precise_time() - t0);
+
       if (!end)
         {
 	  /* No update to send, perhaps we need to send End-of-RIB or EoRR */
@@ -768,17 +864,106 @@ bgp_fire_tx(struct bgp_conn *conn)
 	  }
 
 	  else /* Really nothing to send */
-	    return 0;
+	    return NULL;
 
 	  p->feed_state = BFS_NONE;
 	}
     }
   else
-    return 0;
+    return NULL;
 
   conn->packets_to_send = s;
   bgp_create_header(buf, end - buf, type);
-  return sk_send(sk, end - buf);
+
+  p->stats.tx_messages++;
+  p->stats.tx_bytes += end - buf;
+  if (type == PKT_UPDATE)
+    p->stats.tx_updates++;
+
+#ifdef CONFIG_BMP
+  if (type == PKT_OPEN)
+    {
+      mb_free(conn->open_tx);
+      conn->open_tx = mb_alloc(p->p.pool, end - buf);
+      memcpy(conn->open_tx, buf, end - buf);
+    }
+#endif
+
+  return end;
+}
+
+static inline int bgp_ka_tx_lock(struct bgp_conn *conn);
+static inline void bgp_ka_tx_unlock(struct bgp_conn *conn, int rv);
+static inline void bgp_ka_tx_done(struct bgp_conn *conn);
+
+/**
+ * bgp_fire_tx - transmit packets
+ * @conn: connection
+ *
+ * Whenever the transmit buffers of the underlying TCP connection
+ * are free and we have any packets queued for sending, the socket functions
+ * call bgp_fire_tx() which takes care of selecting the highest priority packet
+ * queued (Notification > Keepalive > Open > Update), assembling its header
+ * and body and sending it to the connection.
+ *
+ * As many packets as fit are packed to the transmit buffer one after another
+ * and passed to the kernel by a single write, so a table feed does not cost a
+ * syscall and a main loop iteration per message.
+ */
+static int
+bgp_fire_tx(struct bgp_conn *conn)
+{
+  struct bgp_proto *p = conn->bgp;
+  sock *sk = conn->sk;
+  byte *buf, *pos, *end;
+  uint max = bgp_max_packet_length(p);
+  int rv;
+
+  if (!sk)
+    {
+      conn->packets_to_send = 0;
+      return 0;
+    }
+  buf = pos = sk->tbuf;
+  bgp_ka_tx_done(conn);
+  PROBE1(bgp_fire_tx_entry, p->p.name);
+
+  while (conn->packets_to_send && (pos + max <= buf + sk->tbsize))
+    {
+      /* Send already packed ones before closing the connection */
+      if ((conn->packets_to_send & (1 << PKT_SCHEDULE_CLOSE)) && (pos != buf))
+	break;
+
+      end = bgp_create_packet(conn, pos);
+      if (!end)
+	break;
+
+      /* The connection was closed */
+      if (end == pos)
+	{
+	  pos = buf;
+	  break;
+	}
+
+      pos = end;
+
+      /* Nothing can follow a notification */
+      if (conn->packets_to_send & (1 << PKT_SCHEDULE_CLOSE))
+	break;
+    }
+
+  PROBE2(bgp_fire_tx_return, p->p.name, pos - buf);
+
+  if (pos == buf)
+    return 0;
+
+  /* Keepalive thread may write the socket between messages */
+  if (!bgp_ka_tx_lock(conn))
+    return sk_send(sk, pos - buf);
+
+  rv = sk_send(sk, pos - buf);
+  bgp_ka_tx_unlock(conn, rv);
+  return rv;
 }
 
 /**
@@ -840,6 +1025,23 @@ bgp_parse_capabilities(struct bgp_conn *conn, byte *opt, int len)
 	  conn->peer_refresh_support = 1;
 	  break;
 
+	case 3: /* Outbound route filtering capability, RFC 5291 */
+	  for (i = 0; i < cl; i += 5 + 2 * opt[2+i+4])
+	    {
+	      int j, n;
+
+	      if ((i + 5 > cl) || (i + 5 + 2 * opt[2+i+4] > cl))
+		goto err;
+
+	      if (opt[2+i+0] != 0 || opt[2+i+1] != BGP_AF || opt[2+i+3] != 1) /* Match AFI/SAFI */
+		continue;
+
+	      for (j = 0, n = opt[2+i+4]; j < n; j++)
+		if (opt[2+i+5+2*j] == BGP_ORF_PREFIX)
+		  conn->peer_orf = opt[2+i+5+2*j+1] & (BGP_ORF_SEND | BGP_ORF_RECEIVE);
+	    }
+	  break;
+
 	case 64: /* Graceful restart capability, RFC 4724 */
 	  if (cl % 4 != 2)
 	    goto err;
@@ -856,6 +1058,22 @@ bgp_parse_capabilities(struct bgp_conn *conn, byte *opt, int len)
 	      }
 	  break;
 
+	case 71: /* Long-lived graceful restart capability, RFC 9494 */
+	  if (cl % 7)
+	    goto err;
+	  conn->peer_llgr_aware = 1;
+	  conn->peer_llgr_able = 0;
+	  conn->peer_llgr_time = 0;
+	  conn->peer_llgr_aflags = 0;
+	  for (i = 0; i < cl; i += 7)
+	    if (opt[2+i+0] == 0 && opt[2+i+1] == BGP_AF && opt[2+i+2] == 1) /* Match AFI/SAFI */
+	      {
+		conn->peer_llgr_able = 1;
+		conn->peer_llgr_aflags = opt[2+i+3];
+		conn->peer_llgr_time = get_u32(opt + 2+i+3) & 0xffffff;
+	      }
+	  break;
+
 	case 65: /* AS4 capability, RFC 4893 */
 	  if (cl != 4)
 	    goto err;
@@ -962,6 +1180,12 @@ bgp_rx_open(struct bgp_conn *conn, byte *pkt, int len)
   if (conn->state != BS_OPENSENT)
     { bgp_error(conn, 5, fsm_err_subcode[conn->state], NULL, 0); return; }
 
+#ifdef CONFIG_BMP
+  mb_free(conn->open_rx);
+  conn->open_rx = mb_alloc(p->p.pool, len);
+  memcpy(conn->open_rx, pkt, len);
+#endif
+
   /* Check message contents */
   if (len < 29 || len != 29 + pkt[28])
     { bgp_error(conn, 1, 2, pkt+16, 2); return; }
@@ -1067,11 +1291,14 @@ bgp_rx_open(struct bgp_conn *conn, byte *pkt, int len)
   p->as4_session = p->cf->enable_as4 && conn->peer_as4_support;
   p->add_path_rx = (p->cf->add_path & ADD_PATH_RX) && (conn->peer_add_path & ADD_PATH_TX);
   p->add_path_tx = (p->cf->add_path & ADD_PATH_TX) && (conn->peer_add_path & ADD_PATH_RX);
-  p->gr_ready = p->cf->gr_mode && conn->peer_gr_able;
+  p->llgr_time = MIN(p->cf->llgr_time, conn->peer_llgr_time);
+  p->llgr_ready = p->cf->llgr_mode && conn->peer_llgr_able && p->llgr_time;
+  p->gr_ready = p->cf->gr_mode && (conn->peer_gr_able || p->llgr_ready);
   p->ext_messages = p->cf->enable_extended_messages && conn->peer_ext_messages_support;
 
   if (p->add_path_tx)
     p->p.accept_ra_types = RA_ANY;
+  p->p.ra_best_paths = p->add_path_tx ? p->cf->add_path_best : 0;
 
   DBG("BGP: Hold timer set to %d, keepalive to %d, AS to %d, ID to %x, AS4 session to %d\n", conn->hold_time, conn->keepalive_time, p->remote_as, p->remote_id, p->as4_session);
 
@@ -1105,23 +1332,60 @@ bgp_rx_end_mark(struct bgp_proto *p)
     pp += 4;					\
     ll -= 4;					\
   }						\
-  int b = *pp++;				\
-  int q;					\
-  ll--;						\
-  if (b > BITS_PER_IP_ADDRESS) { err=10; goto done; } \
-  q = (b+7) / 8;				\
-  if (ll < q) { err=1; goto done; }		\
-  memcpy(&prefix, pp, q);			\
+  int q = nlri_get_prefix(pp, ll, &prefix, &pxlen); \
+  if (q == NLRI_BAD_LENGTH) { err=10; goto done; } \
+  if (q < 0) { err=1; goto done; }		\
   pp += q;					\
   ll -= q;					\
-  ipa_ntoh(prefix);				\
-  prefix = ipa_and(prefix, ipa_mkmask(b));	\
-  pxlen = b;					\
 } while (0)
 
 
+/*
+ * Receive and import limits are checked by the routing table, when the route
+ * attributes are already interned (and the route possibly stored in Adj-RIB-In
+ * and dampening state). Once a limit blocks new routes, they are dropped here
+ * instead, before anything is allocated for them. The receive limit is also
+ * enforced here when filtered routes are kept, as it counts all received routes
+ * then. The table is updated in batches, so new routes pending in the batch are
+ * counted, too.
+ */
+static int
+bgp_rx_limit_drop(struct bgp_proto *p, struct rte_batch *b, ip_addr prefix, int pxlen, struct rte_src *src)
+{
+  struct announce_hook *ah = p->p.main_ahook;
+  struct proto_limit *rl = ah->rx_limit;
+  struct proto_limit *il = ah->in_limit;
+  net *n;
+
+  /* Updates of known routes do not change the count */
+  if ((n = net_find(p->p.table, prefix, pxlen)) && rte_find(n, src))
+    return 0;
+
+  if (!b->count)
+    p->rx_pending = 0;
+
+  if (rl && ah->in_keep_filtered && (rl->state != PLS_BLOCKED))
+    {
+      u32 all_routes = ah->stats->imp_routes + ah->stats->filt_routes + p->rx_pending;
+
+      if (all_routes >= rl->limit)
+	proto_notify_limit(ah, rl, PLD_RX, all_routes);
+    }
+
+  if ((rl && (rl->state == PLS_BLOCKED)) ||
+      (il && (il->state == PLS_BLOCKED) && !ah->in_keep_filtered))
+    {
+      ah->stats->imp_updates_received++;
+      ah->stats->imp_updates_ignored++;
+      return 1;
+    }
+
+  p->rx_pending++;
+  return 0;
+}
+
 static inline void
-bgp_rte_update(struct bgp_proto *p, ip_addr prefix, int pxlen,
+bgp_rte_update(struct bgp_proto *p, struct rte_batch *b, ip_addr prefix, int pxlen,
 	       u32 path_id, u32 *last_id, struct rte_src **src,
 	       rta *a0, rta **a)
 {
@@ -1137,6 +1401,10 @@ bgp_rte_update(struct bgp_proto *p, ip_addr prefix, int pxlen,
 	}
     }
 
+  if ((p->p.main_ahook->rx_limit || p->p.main_ahook->in_limit) &&
+      bgp_rx_limit_drop(p, b, prefix, pxlen, *src))
+    return;
+
   net *n = net_get(p->p.table, prefix, pxlen);
 
   int is_leak = 0; /* Small workaround */
@@ -1172,16 +1440,28 @@ bgp_rte_update(struct bgp_proto *p, ip_addr prefix, int pxlen,
       a0->eattrs = ea;
     }
 
+  u8 flags = is_leak ? REF_LEAKED : 0;
+
+  if (p->adj_pool)
+    bgp_adj_update(p, prefix, pxlen, *a, flags);
+
+  /* Suppressed routes are kept out of the table until reused */
+  if (p->damp_pool && bgp_damp_update(p, prefix, pxlen, path_id, *a))
+    {
+      rte_batch_update(b, n, NULL, *src);
+      return;
+    }
+
   rte *e = rte_get_temp(rta_clone(*a));
-  e->flags = is_leak ? REF_LEAKED : 0;
+  e->flags = flags;
   e->net = n;
   e->pflags = 0;
   e->u.bgp.suppressed = 0;
-  rte_update2(p->p.main_ahook, n, e, *src);
+  rte_batch_update(b, n, e, *src);
 }
 
 static inline void
-bgp_rte_withdraw(struct bgp_proto *p, ip_addr prefix, int pxlen,
+bgp_rte_withdraw(struct bgp_proto *p, struct rte_batch *b, ip_addr prefix, int pxlen,
 		 u32 path_id, u32 *last_id, struct rte_src **src)
 {
   if (path_id != *last_id)
@@ -1190,8 +1470,15 @@ bgp_rte_withdraw(struct bgp_proto *p, ip_addr prefix, int pxlen,
       *last_id = path_id;
     }
 
+  if (p->adj_pool)
+    bgp_adj_withdraw(p, prefix, pxlen, *src);
+
   net *n = net_find(p->p.table, prefix, pxlen);
-  rte_update2( p->p.main_ahook, n, NULL, *src);
+
+  if (p->damp_pool)
+    bgp_damp_withdraw(p, prefix, pxlen, path_id, n && *src && rte_find(n, *src));
+
+  rte_batch_update(b, n, NULL, *src);
 }
 
 static inline int
@@ -1253,11 +1540,13 @@ bgp_do_rx_update(struct bgp_conn *conn,
 {
   struct bgp_proto *p = conn->bgp;
   struct rte_src *src = p->p.main_source;
+  struct rte_batch batch;
   rta *a0, *a = NULL;
   ip_addr prefix;
   int pxlen, err = 0;
   u32 path_id = 0;
   u32 last_id = 0;
+  btime t0 = precise_time(), t1, td = 0;
 
   /* Check for End-of-RIB marker */
   if (!withdrawn_len && !attr_len && !nlri_len)
@@ -1266,26 +1555,37 @@ bgp_do_rx_update(struct bgp_conn *conn,
       return;
     }
 
+  /* All routes from one UPDATE are propagated to the table together */
+  rte_batch_start(&batch, p->p.main_ahook);
+
   /* Withdraw routes */
   while (withdrawn_len)
     {
       DECODE_PREFIX(withdrawn, withdrawn_len);
       DBG("Withdraw %I/%d\n", prefix, pxlen);
 
-      bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src);
+      bgp_rte_withdraw(p, &batch, prefix, pxlen, path_id, &last_id, &src);
     }
 
   if (!attr_len && !nlri_len)		/* shortcut */
-    return;
+    goto done;
+
+  /* Session is going down due to a route limit, do not bother with new routes */
+  if (p->p.down_sched)
+    goto done;
 
+  t1 = precise_time();
   a0 = bgp_decode_attrs(conn, attrs, attr_len, bgp_linpool, nlri_len);
 
   if (conn->state != BS_ESTABLISHED)	/* fatal error during decoding */
-    return;
+    goto done;
 
   if (a0 && nlri_len && !bgp_set_next_hop(p, a0))
     a0 = NULL;
 
+  td = precise_time() - t1;
+  bgp_stats_time(p, BGP_HIST_DECODE, td);
+
   last_id = 0;
   src = p->p.main_source;
 
@@ -1295,12 +1595,17 @@ bgp_do_rx_update(struct bgp_conn *conn,
       DBG("Add %I/%d\n", prefix, pxlen);
 
       if (a0)
-	bgp_rte_update(p, prefix, pxlen, path_id, &last_id, &src, a0, &a);
+	bgp_rte_update(p, &batch, prefix, pxlen, path_id, &last_id, &src, a0, &a);
       else /* Forced withdraw as a result of soft error */
-	bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src);
+	bgp_rte_withdraw(p, &batch, prefix, pxlen, path_id, &last_id, &src);
     }
 
  done:
+  rte_batch_end(&batch);
+
+  /* Everything except attribute decoding is accounted as import */
+  bgp_stats_time(p, BGP_HIST_IMPORT, precise_time() - t0 - td);
+
   if (a)
     rta_free(a);
 
@@ -1357,11 +1662,13 @@ bgp_do_rx_update(struct bgp_conn *conn,
   byte *start, *x;
   int len, len0;
   unsigned af, sub;
+  struct rte_batch batch;
   rta *a0, *a = NULL;
   ip_addr prefix;
   int pxlen, err = 0;
   u32 path_id = 0;
   u32 last_id = 0;
+  btime t0 = precise_time(), t1;
 
   p->mp_reach_len = 0;
   p->mp_unreach_len = 0;
@@ -1370,6 +1677,9 @@ bgp_do_rx_update(struct bgp_conn *conn,
   if (conn->state != BS_ESTABLISHED)	/* fatal error during decoding */
     return;
 
+  t1 = precise_time();
+  bgp_stats_time(p, BGP_HIST_DECODE, t1 - t0);
+
   /* Check for End-of-RIB marker */
   if ((attr_len < 8) && !withdrawn_len && !nlri_len && !p->mp_reach_len &&
       (p->mp_unreach_len == 3) && (get_u16(p->mp_unreach_start) == BGP_AF_IPV6))
@@ -1378,16 +1688,23 @@ bgp_do_rx_update(struct bgp_conn *conn,
       return;
     }
 
+  /* All routes from one UPDATE are propagated to the table together */
+  rte_batch_start(&batch, p->p.main_ahook);
+
   DO_NLRI(mp_unreach)
     {
       while (len)
 	{
 	  DECODE_PREFIX(x, len);
 	  DBG("Withdraw %I/%d\n", prefix, pxlen);
-	  bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src);
+	  bgp_rte_withdraw(p, &batch, prefix, pxlen, path_id, &last_id, &src);
 	}
     }
 
+  /* Session is going down due to a route limit, do not bother with new routes */
+  if (p->p.down_sched)
+    goto done;
+
   DO_NLRI(mp_reach)
     {
       /* Create fake NEXT_HOP attribute */
@@ -1413,13 +1730,18 @@ bgp_do_rx_update(struct bgp_conn *conn,
 	  DBG("Add %I/%d\n", prefix, pxlen);
 
 	  if (a0)
-	    bgp_rte_update(p, prefix, pxlen, path_id, &last_id, &src, a0, &a);
+	    bgp_rte_update(p, &batch, prefix, pxlen, path_id, &last_id, &src, a0, &a);
 	  else /* Forced withdraw as a result of soft error */
-	    bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src);
+	    bgp_rte_withdraw(p, &batch, prefix, pxlen, path_id, &last_id, &src);
 	}
     }
 
  done:
+  rte_batch_end(&batch);
+
+  /* Next hops and NLRI are decoded along with the import */
+  bgp_stats_time(p, BGP_HIST_IMPORT, precise_time() - t1);
+
   if (a)
     rta_free(a);
 
@@ -1439,6 +1761,7 @@ bgp_rx_update(struct bgp_conn *conn, byte *pkt, int len)
   int withdrawn_len, attr_len, nlri_len;
 
   BGP_TRACE_RL(&rl_rcv_update, D_PACKETS, "Got UPDATE");
+  p->stats.rx_updates++;
 
   /* Workaround for some BGP implementations that skip initial KEEPALIVE */
   if (conn->state == BS_OPENCONFIRM)
@@ -1446,7 +1769,7 @@ bgp_rx_update(struct bgp_conn *conn, byte *pkt, int len)
 
   if (conn->state != BS_ESTABLISHED)
     { bgp_error(conn, 5, fsm_err_subcode[conn->state], NULL, 0); return; }
-  bgp_start_timer(conn->hold_timer, conn->hold_time);
+  bgp_restart_hold_timer(conn);
 
   /* Find parts of the packet and check sizes */
   if (len < 23)
@@ -1468,8 +1791,10 @@ bgp_rx_update(struct bgp_conn *conn, byte *pkt, int len)
     goto malformed;
   DBG("Sizes: withdrawn=%d, attrs=%d, NLRI=%d\n", withdrawn_len, attr_len, nlri_len);
 
-  lp_flush(bgp_linpool);
+  /* Pre-policy route monitoring */
+  bmp_rx_update(p, pkt, len);
 
+  /* Temporary data are flushed once per received batch in bgp_rx() */
   bgp_do_rx_update(conn, withdrawn, withdrawn_len, nlri, nlri_len, attrs, attr_len);
   return;
 
@@ -1635,7 +1960,7 @@ bgp_rx_keepalive(struct bgp_conn *conn)
   struct bgp_proto *p = conn->bgp;
 
   BGP_TRACE(D_PACKETS, "Got KEEPALIVE");
-  bgp_start_timer(conn->hold_timer, conn->hold_time);
+  bgp_restart_hold_timer(conn);
   switch (conn->state)
     {
     case BS_OPENCONFIRM:
@@ -1662,9 +1987,6 @@ bgp_rx_route_refresh(struct bgp_conn *conn, byte *pkt, int len)
   if (len < (BGP_HEADER_LENGTH + 4))
     { bgp_error(conn, 1, 2, pkt+16, 2); return; }
 
-  if (len > (BGP_HEADER_LENGTH + 4))
-    { bgp_error(conn, 7, 1, pkt, MIN(len, 2048)); return; }
-
   /* FIXME - we ignore AFI/SAFI values, as we support
      just one value and even an error code for an invalid
      request is not defined */
@@ -1672,10 +1994,34 @@ bgp_rx_route_refresh(struct bgp_conn *conn, byte *pkt, int len)
   /* RFC 7313 redefined reserved field as RR message subtype */
   uint subtype = conn->peer_enhanced_refresh_support ? pkt[21] : BGP_RR_REQUEST;
 
+  /* Just route refresh requests may carry ORFs [RFC 5291 4] */
+  if ((len > (BGP_HEADER_LENGTH + 4)) && ((subtype != BGP_RR_REQUEST) || !bgp_orf_rx_ready(conn)))
+    { bgp_error(conn, 7, 1, pkt, MIN(len, 2048)); return; }
+
   switch (subtype)
   {
   case BGP_RR_REQUEST:
     BGP_TRACE(D_PACKETS, "Got ROUTE-REFRESH");
+
+    if (len > (BGP_HEADER_LENGTH + 4))
+      {
+	int rv = bgp_orf_rx(conn, pkt + BGP_HEADER_LENGTH + 4, len - BGP_HEADER_LENGTH - 4);
+
+	if (rv == -2)
+	  {
+	    log(L_WARN "%s: Prefix ORF limit (%u) exceeded", p->p.name, BGP_ORF_MAX_ENTRIES);
+	    bgp_error(conn, 6, 1, NULL, 0);
+	    return;
+	  }
+
+	if (rv < 0)
+	  { bgp_error(conn, 7, 1, pkt, MIN(len, 2048)); return; }
+
+	/* Refresh is deferred until the rest of ORF arrives */
+	if (!rv)
+	  break;
+      }
+
     proto_request_feeding(&p->p);
     break;
 
@@ -1713,13 +2059,20 @@ bgp_rx_packet(struct bgp_conn *conn, byte *pkt, unsigned len)
 
   DBG("BGP: Got packet %02x (%d bytes)\n", type, len);
 
+  conn->bgp->stats.rx_messages++;
+  conn->bgp->stats.rx_bytes += len;
+
   if (conn->bgp->p.mrtdump & MD_MESSAGES)
     mrt_dump_bgp_packet(conn, pkt, len);
 
   switch (type)
     {
     case PKT_OPEN:		return bgp_rx_open(conn, pkt, len);
-    case PKT_UPDATE:		return bgp_rx_update(conn, pkt, len);
+    case PKT_UPDATE:
+      PROBE2(bgp_rx_update_entry, conn->bgp->p.name, len);
+      bgp_rx_update(conn, pkt, len);
+      PROBE1(bgp_rx_update_return, conn->bgp->p.name);
+      return;
     case PKT_NOTIFICATION:      return bgp_rx_notification(conn, pkt, len);
     case PKT_KEEPALIVE:		return bgp_rx_keepalive(conn);
     case PKT_ROUTE_REFRESH:	return bgp_rx_route_refresh(conn, pkt, len);
@@ -1727,30 +2080,17 @@ bgp_rx_packet(struct bgp_conn *conn, byte *pkt, unsigned len)
     }
 }
 
-/**
- * bgp_rx - handle received data
- * @sk: socket
- * @size: amount of data received
- *
- * bgp_rx() is called by the socket layer whenever new data arrive from
- * the underlying TCP connection. It assembles the data fragments to packets,
- * checks their headers and framing and passes complete packets to
- * bgp_rx_packet().
- */
-int
-bgp_rx(sock *sk, int size)
+/* Process complete packets in the buffer, returns the start of unprocessed data or NULL */
+static byte *
+bgp_rx_packets(struct bgp_conn *conn, sock *sk, byte *pkt_start, byte *end)
 {
-  struct bgp_conn *conn = sk->data;
   struct bgp_proto *p = conn->bgp;
-  byte *pkt_start = sk->rbuf;
-  byte *end = pkt_start + size;
   unsigned i, len;
 
-  DBG("BGP: RX hook: Got %d bytes\n", size);
   while (end >= pkt_start + BGP_HEADER_LENGTH)
     {
       if ((conn->state == BS_CLOSE) || (conn->sk != sk))
-	return 0;
+	return NULL;
       for(i=0; i<16; i++)
 	if (pkt_start[i] != 0xff)
 	  {
@@ -1768,10 +2108,862 @@ bgp_rx(sock *sk, int size)
       bgp_rx_packet(conn, pkt_start, len);
       pkt_start += len;
     }
-  if (pkt_start != sk->rbuf)
+
+  return pkt_start;
+}
+
+#ifdef CONFIG_BFD
+static void bgp_rx_thread_start(struct bgp_conn *conn);
+#endif
+
+/**
+ * bgp_rx - handle received data
+ * @sk: socket
+ * @size: amount of data received
+ *
+ * bgp_rx() is called by the socket layer whenever new data arrive from
+ * the underlying TCP connection. It assembles the data fragments to packets,
+ * checks their headers and framing and passes complete packets to
+ * bgp_rx_packet().
+ *
+ * All complete packets in the buffer are processed in one pass, directly in
+ * the receive buffer. An incomplete packet at the end stays in place and the
+ * next read appends to it, the data are moved to the start of the buffer only
+ * when there is no more space for a packet of maximal length after them.
+ */
+int
+bgp_rx(sock *sk, int size)
+{
+  struct bgp_conn *conn = sk->data;
+  struct bgp_proto *p = conn->bgp;
+  byte *pkt_start = sk->rbuf + conn->rx_offset;
+  byte *end = sk->rbuf + size;
+
+  DBG("BGP: RX hook: Got %d bytes\n", size);
+  pkt_start = bgp_rx_packets(conn, sk, pkt_start, end);
+  if (!pkt_start)
+    goto done;
+
+  if (sk->flags & SKF_RX_RING)
+    {
+      /* A partial packet stays in place, the ring wraps around */
+      sk_rx_consume(sk, pkt_start - sk->rbuf);
+      conn->rx_offset = 0;
+    }
+  else if (pkt_start == end)
+    {
+      conn->rx_offset = 0;
+      sk->rpos = sk->rbuf;
+    }
+  else if (sk->rbuf + sk->rbsize - pkt_start < bgp_max_packet_length(p))
     {
       memmove(sk->rbuf, pkt_start, end - pkt_start);
+      conn->rx_offset = 0;
       sk->rpos = sk->rbuf + (end - pkt_start);
     }
+  else
+    conn->rx_offset = pkt_start - sk->rbuf;
+
+#ifdef CONFIG_BFD
+  /* Established sessions may be read by a separate thread */
+  if (p->cf->rx_thread && (conn->state == BS_ESTABLISHED) && !conn->rx_thread)
+    bgp_rx_thread_start(conn);
+#endif
+
+done:
+  lp_flush(bgp_linpool);
   return 0;
 }
+
+
+#ifdef CONFIG_BFD
+
+/*
+ *	Receive threads
+ *
+ * When the receive thread option is enabled, an established session is read
+ * by a separate thread running its own &birdloop (see proto/bfd/io.c). The
+ * thread reads from a duplicate of the session socket descriptor, splits the
+ * data to complete messages and passes them in chunks to the main thread,
+ * which is woken up by a pipe. The original socket stays in the main loop
+ * and is used just for transmission. Decoding of attributes and route import
+ * remain in the main thread, as the attribute cache, routing tables and
+ * resource allocators are not thread-safe.
+ */
+
+#define BGP_RX_QUEUE_MAX	(4 << 20)	/* Queued bytes before the thread stops reading */
+
+struct bgp_rx_chunk {
+  struct bgp_rx_chunk *next;
+  uint len;
+  byte data[0];				/* Sequence of complete messages */
+};
+
+struct bgp_rx_thread {
+  struct bgp_conn *conn;
+  struct bgp_ka_thread *ka;		/* Keepalive thread of the connection, or NULL */
+  struct birdloop *loop;
+  sock *sk;				/* Reading socket, used only by the thread */
+  sock *notify_rs, *notify_ws;		/* Pipe waking up the main thread */
+  byte *buf;				/* Read buffer, used only by the thread */
+  uint size, used;
+
+  pthread_mutex_t lock;			/* Protects fields below */
+  pthread_cond_t cond;			/* Signalled when the queue is drained or on stop */
+  struct bgp_rx_chunk *first, **last;	/* Queue of received chunks */
+  uint queued;				/* Number of bytes in the queue */
+  int err;				/* Error code, valid when failed */
+  byte failed;				/* Reading failed or the peer closed the session */
+  byte stop;				/* Thread is being stopped */
+};
+
+void pipe_drain(int fd);
+void pipe_kick(int fd);
+
+static void bgp_ka_thread_rx(struct bgp_ka_thread *t, btime now_);
+
+/* Runs in the receive thread */
+static int
+bgp_rx_thread_read(sock *sk, int size UNUSED)
+{
+  struct bgp_rx_thread *t = sk->data;
+  struct bgp_rx_chunk *c;
+  byte *pos, *end;
+  int n, kick, err = 0;
+
+  pthread_mutex_lock(&t->lock);
+  while (!t->stop && (t->failed || (t->queued >= BGP_RX_QUEUE_MAX)))
+    pthread_cond_wait(&t->cond, &t->lock);
+  n = t->stop;
+  pthread_mutex_unlock(&t->lock);
+
+  if (n)
+    return 0;
+
+  n = read(sk->fd, t->buf + t->used, t->size - t->used);
+  if (n < 0)
+    {
+      if ((errno == EINTR) || (errno == EAGAIN))
+	return 0;
+
+      err = errno;
+      goto fail;
+    }
+
+  if (!n)
+    goto fail;
+
+  t->used += n;
+
+  /* Find the end of complete messages, framing errors are left to bgp_rx_packets() */
+  pos = t->buf;
+  end = t->buf + t->used;
+  while (end - pos >= BGP_HEADER_LENGTH)
+    {
+      uint len = get_u16(pos + 16);
+
+      if (len < BGP_HEADER_LENGTH)
+	{
+	  pos = end;
+	  break;
+	}
+
+      if (end - pos < len)
+	break;
+
+      pos += len;
+    }
+
+  if (pos == t->buf)
+    return 1;
+
+  /* Received messages restart the hold timer, even if they wait in the queue */
+  if (t->ka)
+    bgp_ka_thread_rx(t->ka, current_time());
+
+  c = xmalloc(sizeof(struct bgp_rx_chunk) + (pos - t->buf));
+  c->next = NULL;
+  c->len = pos - t->buf;
+  memcpy(c->data, t->buf, c->len);
+  memmove(t->buf, pos, end - pos);
+  t->used = end - pos;
+
+  pthread_mutex_lock(&t->lock);
+  kick = !t->first;
+  *t->last = c;
+  t->last = &c->next;
+  t->queued += c->len;
+  pthread_mutex_unlock(&t->lock);
+
+  if (kick)
+    pipe_kick(t->notify_ws->fd);
+
+  return 1;
+
+fail:
+  pthread_mutex_lock(&t->lock);
+  t->failed = 1;
+  t->err = err;
+  pthread_mutex_unlock(&t->lock);
+
+  pipe_kick(t->notify_ws->fd);
+  return 0;
+}
+
+static int
+bgp_rx_thread_notify(sock *sk, int size UNUSED)
+{
+  struct bgp_rx_thread *t = sk->data;
+  struct bgp_conn *conn = t->conn;
+  struct bgp_rx_chunk *c, *next;
+  int failed, err;
+
+  pipe_drain(sk->fd);
+
+  pthread_mutex_lock(&t->lock);
+  c = t->first;
+  t->first = NULL;
+  t->last = &t->first;
+  t->queued = 0;
+  failed = t->failed;
+  err = t->err;
+  pthread_cond_signal(&t->cond);
+  pthread_mutex_unlock(&t->lock);
+
+  /* Processed packets may close the connection and stop the thread */
+  for (; c; c = next)
+    {
+      next = c->next;
+      if ((conn->rx_thread == t) &&
+	  !bgp_rx_packets(conn, conn->sk, c->data, c->data + c->len))
+	bgp_rx_thread_stop(conn);
+      xfree(c);
+    }
+
+  lp_flush(bgp_linpool);
+
+  if (failed && (conn->rx_thread == t))
+    conn->sk->err_hook(conn->sk, err);
+
+  return 0;
+}
+
+static void
+bgp_rx_thread_err(sock *sk, int err)
+{
+  struct bgp_rx_thread *t = sk->data;
+  log(L_ERR "%s: Receive thread notify socket error: %M", t->conn->bgp->p.name, err);
+}
+
+static sock *
+bgp_rx_thread_sk(struct bgp_rx_thread *t, int fd, int (*hook)(sock *, int), u32 flags)
+{
+  sock *sk = sk_new(t->conn->bgp->p.pool);
+  sk->type = SK_MAGIC;
+  sk->rx_hook = hook;
+  sk->err_hook = bgp_rx_thread_err;
+  sk->fd = fd;
+  sk->data = t;
+  sk->flags = flags;
+
+  if (sk_open(sk) < 0)
+    {
+      sk->fd = -1;			/* Already closed by sk_open() */
+      rfree(sk);
+      return NULL;
+    }
+
+  return sk;
+}
+
+/**
+ * bgp_rx_thread_start - move reading of a connection to a separate thread
+ * @conn: established connection
+ *
+ * The function starts a receive thread for @conn and passes it the data
+ * already read but not yet processed. The protocol falls back to reading
+ * in the main loop if the thread cannot be started.
+ */
+static void
+bgp_rx_thread_start(struct bgp_conn *conn)
+{
+  struct bgp_proto *p = conn->bgp;
+  struct bgp_rx_thread *t;
+  sock *sk = conn->sk;
+  uint pending = sk->rpos - (sk->rbuf + conn->rx_offset);
+  int pfds[2], fd;
+
+  /* Inputs of traced sockets are recorded and replayed by the main loop */
+  if (sk->trace_id)
+    return;
+
+  fd = dup(sk->fd);
+  if (fd < 0)
+    goto err1;
+
+  if (pipe(pfds) < 0)
+    goto err2;
+
+  t = mb_allocz(p->p.pool, sizeof(struct bgp_rx_thread));
+  t->conn = conn;
+  t->ka = conn->ka_thread;
+  t->notify_rs = bgp_rx_thread_sk(t, pfds[0], bgp_rx_thread_notify, 0);
+  t->notify_ws = bgp_rx_thread_sk(t, pfds[1], NULL, SKF_THREAD);
+  t->sk = bgp_rx_thread_sk(t, fd, bgp_rx_thread_read, SKF_THREAD);
+
+  if (!t->notify_rs || !t->notify_ws || !t->sk)
+    {
+      /* The descriptors are closed by sk_open() or rfree() */
+      rfree(t->notify_rs);
+      rfree(t->notify_ws);
+      rfree(t->sk);
+      mb_free(t);
+      goto err0;
+    }
+
+  t->size = MAX(sk->rbsize, BGP_MAX_EXT_MSG_LENGTH);
+  t->buf = xmalloc(t->size);
+  t->used = pending;
+  memcpy(t->buf, sk->rbuf + conn->rx_offset, pending);
+  t->last = &t->first;
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->cond, NULL);
+
+  t->loop = birdloop_new(THREAD_BGP);
+  birdloop_enter(t->loop);
+  sk_start(t->sk);
+  birdloop_leave(t->loop);
+  birdloop_start(t->loop);
+
+  sk->rx_hook = NULL;
+  sk->rpos = sk->rbuf;
+  conn->rx_offset = 0;
+  conn->rx_thread = t;
+
+  BGP_TRACE(D_EVENTS, "Receive thread started");
+  return;
+
+err2:
+  close(fd);
+err1:
+  log(L_ERR "%s: Cannot start receive thread: %m", p->p.name);
+  return;
+err0:
+  log(L_ERR "%s: Cannot start receive thread", p->p.name);
+}
+
+/* Stop the thread, the queue is not touched by it since then */
+static void
+bgp_rx_thread_halt(struct bgp_rx_thread *t)
+{
+  pthread_mutex_lock(&t->lock);
+  t->stop = 1;
+  pthread_cond_signal(&t->cond);
+  pthread_mutex_unlock(&t->lock);
+
+  birdloop_stop(t->loop);
+  birdloop_free(t->loop);
+}
+
+static void
+bgp_rx_thread_free(struct bgp_rx_thread *t)
+{
+  struct bgp_rx_chunk *c, *next;
+
+  rfree(t->sk);
+  rfree(t->notify_rs);
+  rfree(t->notify_ws);
+
+  for (c = t->first; c; c = next)
+    {
+      next = c->next;
+      xfree(c);
+    }
+
+  xfree(t->buf);
+  pthread_mutex_destroy(&t->lock);
+  pthread_cond_destroy(&t->cond);
+  mb_free(t);
+}
+
+/**
+ * bgp_rx_thread_stop - stop the receive thread of a connection
+ * @conn: connection
+ *
+ * Stops the receive thread of @conn (if there is one) and drops data
+ * received but not yet processed.
+ */
+void
+bgp_rx_thread_stop(struct bgp_conn *conn)
+{
+  struct bgp_rx_thread *t = conn->rx_thread;
+
+  if (!t)
+    return;
+
+  conn->rx_thread = NULL;
+  bgp_rx_thread_halt(t);
+  bgp_rx_thread_free(t);
+}
+
+/**
+ * bgp_rx_thread_join - move reading of a connection back to the main loop
+ * @conn: established connection
+ *
+ * Stops the receive thread of @conn (if there is one), processes messages
+ * queued by it and moves a partially received message to the socket buffer,
+ * where bgp_rx() continues with it. Used before handoff of the session, as
+ * the thread is started again by the next bgp_rx() otherwise. Returns 0 when
+ * the connection was closed by some of the messages, 1 otherwise.
+ */
+int
+bgp_rx_thread_join(struct bgp_conn *conn)
+{
+  struct bgp_rx_thread *t = conn->rx_thread;
+  struct bgp_rx_chunk *c;
+  sock *sk = conn->sk;
+  int ok = 1;
+
+  if (!t)
+    return 1;
+
+  conn->rx_thread = NULL;
+  bgp_rx_thread_halt(t);
+
+  for (c = t->first; c && ok; c = c->next)
+    ok = !!bgp_rx_packets(conn, sk, c->data, c->data + c->len);
+
+  lp_flush(bgp_linpool);
+  ok = ok && (conn->state == BS_ESTABLISHED);
+
+  /* A partial message is shorter than the maximal one, so it fits */
+  if (ok && !t->failed && (t->used <= sk->rbsize))
+    {
+      memcpy(sk->rbuf, t->buf, t->used);
+      sk->rpos = sk->rbuf + t->used;
+      sk->rx_hook = bgp_rx;
+      conn->rx_offset = 0;
+    }
+  else if (ok)
+    {
+      conn->sk->err_hook(conn->sk, t->err);
+      ok = 0;
+    }
+
+  bgp_rx_thread_free(t);
+  return ok;
+}
+
+
+
+/*
+ *	Keepalive threads
+ *
+ * When the keepalive thread option is enabled, keepalives and the hold timer
+ * of an established session are handled by a separate thread running its own
+ * &birdloop, so a busy main loop does not delay them. The thread writes
+ * KEEPALIVE messages directly to a duplicate of the session socket descriptor.
+ * The main thread writes the socket under the lock of the thread and marks
+ * when a message is sent partially, as nothing may be written by the thread
+ * until the rest is sent by the main loop. Any message sent by the main thread
+ * postpones the keepalive. Receiving of messages (by the main thread or by the
+ * receive thread) is recorded for the hold timer, which also does not expire
+ * while there are unread data in the socket. Expiration of the hold timer is
+ * passed to the main thread by ev_send_main().
+ */
+
+#define BGP_KA_RETRY		(1 S)		/* Retry when the socket is busy */
+#define BGP_KA_TX_TIMEOUT	(1 S)		/* Wait for the rest of a keepalive */
+
+struct bgp_ka_thread {
+  struct bgp_conn *conn;
+  struct birdloop *loop;
+  pool *tpool;				/* Pool for the thread resources */
+  timer2 *keepalive_timer, *hold_timer;
+  event *event;				/* Sent to the main loop when failed */
+  int fd;				/* Duplicate of the session socket */
+  btime keepalive_time, hold_time;
+
+  pthread_mutex_t lock;			/* Protects fields below and writes to the socket */
+  btime last_rx, last_tx;		/* Last message received and sent */
+  uint sent;				/* Number of keepalives sent by the thread */
+  int err;				/* Error code of writing, valid when failed */
+  byte tx_busy;				/* Main thread has a partially sent message */
+  byte failed;				/* Hold timer expired or writing failed */
+};
+
+/* Write the whole KEEPALIVE, returns 1 if sent, 0 if not started, or -errno */
+static int
+bgp_ka_thread_write(struct bgp_ka_thread *t)
+{
+  byte buf[BGP_HEADER_LENGTH];
+  btime deadline = 0;
+  uint pos = 0;
+  int n;
+
+  bgp_create_header(buf, BGP_HEADER_LENGTH, PKT_KEEPALIVE);
+
+  while (pos < BGP_HEADER_LENGTH)
+    {
+      n = send(t->fd, buf + pos, BGP_HEADER_LENGTH - pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n > 0)
+	{
+	  pos += n;
+	  continue;
+	}
+
+      if ((n < 0) && (errno == EINTR))
+	continue;
+
+      if ((n < 0) && (errno != EAGAIN))
+	return -errno;
+
+      if (!pos)
+	return 0;
+
+      /* Partially written message must be completed before anything else */
+      if (!deadline)
+	deadline = precise_time() + BGP_KA_TX_TIMEOUT;
+
+      struct pollfd pfd = { .fd = t->fd, .events = POLLOUT };
+      btime now_ = precise_time();
+      if ((now_ >= deadline) ||
+	  ((poll(&pfd, 1, (deadline - now_) TO_MS + 1) < 0) && (errno != EINTR)))
+	return -ETIMEDOUT;
+    }
+
+  return 1;
+}
+
+static void
+bgp_ka_thread_fail(struct bgp_ka_thread *t, int err)
+{
+  t->failed = 1;
+  t->err = err;
+  ev_send_main(t->event);
+}
+
+/* Runs in the keepalive thread */
+static void
+bgp_ka_thread_keepalive(timer2 *tm)
+{
+  struct bgp_ka_thread *t = tm->data;
+  btime now_ = current_time();
+  btime next = 0;
+  int rv, failed;
+
+  pthread_mutex_lock(&t->lock);
+  if (t->failed)
+    goto done;
+
+  next = t->last_tx + t->keepalive_time;
+  if (now_ < next)
+    goto done;
+
+  if (t->tx_busy)
+    {
+      next = now_ + MIN(t->keepalive_time, BGP_KA_RETRY);
+      goto done;
+    }
+
+  rv = bgp_ka_thread_write(t);
+  if (rv < 0)
+    {
+      bgp_ka_thread_fail(t, -rv);
+      goto done;
+    }
+
+  if (rv)
+    {
+      t->last_tx = now_;
+      t->sent++;
+    }
+
+  next = rv ? (now_ + t->keepalive_time) : (now_ + MIN(t->keepalive_time, BGP_KA_RETRY));
+
+done:
+  /* The flag must not be read unlocked */
+  failed = t->failed;
+  pthread_mutex_unlock(&t->lock);
+
+  if (!failed)
+    tm2_set(tm, next);
+}
+
+/* Runs in the keepalive thread */
+static void
+bgp_ka_thread_hold(timer2 *tm)
+{
+  struct bgp_ka_thread *t = tm->data;
+  btime expires;
+  int unread = 0, failed;
+
+  pthread_mutex_lock(&t->lock);
+  expires = t->last_rx + t->hold_time;
+
+  if (!t->failed && (current_time() >= expires))
+    {
+      /* Messages waiting in the socket are not processed yet, but received */
+      if ((ioctl(t->fd, FIONREAD, &unread) < 0) || (unread <= 0))
+	bgp_ka_thread_fail(t, 0);
+      else
+	expires = current_time() + BGP_KA_RETRY;
+    }
+  failed = t->failed;
+  pthread_mutex_unlock(&t->lock);
+
+  if (!failed)
+    tm2_set(tm, expires);
+}
+
+/* Called from the main thread and from the receive thread */
+static void
+bgp_ka_thread_rx(struct bgp_ka_thread *t, btime now_)
+{
+  pthread_mutex_lock(&t->lock);
+  t->last_rx = MAX(t->last_rx, now_);
+  pthread_mutex_unlock(&t->lock);
+}
+
+static void
+bgp_ka_thread_event(void *data)
+{
+  struct bgp_ka_thread *t = data;
+  struct bgp_conn *conn = t->conn;
+  struct bgp_proto *p = conn->bgp;
+  int failed, err;
+
+  pthread_mutex_lock(&t->lock);
+  failed = t->failed;
+  err = t->err;
+  pthread_mutex_unlock(&t->lock);
+
+  if (!failed || (conn->ka_thread != t))
+    return;
+
+  /* The thread structure is freed by the following calls */
+  if (err)
+    conn->sk->err_hook(conn->sk, err);
+  else
+  {
+    BGP_TRACE(D_EVENTS, "Hold timer expired in keepalive thread");
+    bgp_error(conn, 4, 0, NULL, 0);
+  }
+}
+
+/**
+ * bgp_ka_thread_start - move keepalives of a connection to a separate thread
+ * @conn: established connection
+ *
+ * The function starts a keepalive thread for @conn if it is enabled, which
+ * replaces the keepalive and hold timers of the main loop. The protocol falls
+ * back to the timers if the thread cannot be started.
+ */
+void
+bgp_ka_thread_start(struct bgp_conn *conn)
+{
+  struct bgp_proto *p = conn->bgp;
+  struct bgp_ka_thread *t;
+  btime now_ = precise_time();
+  int fd;
+
+  /* Timing of traced sockets is replayed by the main loop */
+  if (!p->cf->ka_thread || !conn->hold_time || conn->ka_thread || conn->sk->trace_id)
+    return;
+
+  fd = dup(conn->sk->fd);
+  if (fd < 0)
+    {
+      log(L_ERR "%s: Cannot start keepalive thread: %m", p->p.name);
+      return;
+    }
+
+  t = mb_allocz(p->p.pool, sizeof(struct bgp_ka_thread));
+  t->conn = conn;
+  t->fd = fd;
+  t->keepalive_time = conn->keepalive_time S;
+  t->hold_time = conn->hold_time S;
+  t->last_rx = t->last_tx = now_;
+  t->event = ev_new(p->p.pool);
+  t->event->hook = bgp_ka_thread_event;
+  t->event->data = t;
+  pthread_mutex_init(&t->lock, NULL);
+
+  t->loop = birdloop_new(THREAD_BGP);
+  t->tpool = rp_new(NULL, "BGP keepalive thread");
+  birdloop_enter(t->loop);
+  t->keepalive_timer = tm2_new_init(t->tpool, bgp_ka_thread_keepalive, t, 0, 0);
+  t->hold_timer = tm2_new_init(t->tpool, bgp_ka_thread_hold, t, 0, 0);
+  tm2_set(t->keepalive_timer, now_ + t->keepalive_time);
+  tm2_set(t->hold_timer, now_ + t->hold_time);
+  birdloop_leave(t->loop);
+  birdloop_start(t->loop);
+
+  tm_stop(conn->keepalive_timer);
+  tm_stop(conn->hold_timer);
+  conn->ka_thread = t;
+
+  BGP_TRACE(D_EVENTS, "Keepalive thread started");
+}
+
+/**
+ * bgp_ka_thread_stop - stop the keepalive thread of a connection
+ * @conn: connection
+ *
+ * Stops the keepalive thread of @conn (if there is one). The receive thread
+ * must be stopped before, as it refers to the keepalive thread. Timers of the
+ * main loop take over if the connection stays established.
+ */
+void
+bgp_ka_thread_stop(struct bgp_conn *conn)
+{
+  struct bgp_ka_thread *t = conn->ka_thread;
+  struct bgp_proto *p = conn->bgp;
+
+  if (!t)
+    return;
+
+  ASSERT(!conn->rx_thread);
+  conn->ka_thread = NULL;
+  birdloop_stop(t->loop);
+
+  /* Failures are sent only by the stopped thread */
+  ev_postpone_main(t->event);
+  rfree(t->event);
+
+  birdloop_enter(t->loop);
+  rfree(t->tpool);
+  birdloop_leave(t->loop);
+  birdloop_free(t->loop);
+
+  p->stats.tx_messages += t->sent;
+  p->stats.tx_bytes += t->sent * BGP_HEADER_LENGTH;
+
+  if (conn->state == BS_ESTABLISHED)
+    {
+      btime now_ = precise_time();
+      bgp_start_timer(conn->hold_timer, MAX(t->last_rx + t->hold_time - now_, 1 S) / (1 S));
+      bgp_start_timer(conn->keepalive_timer, MAX(t->last_tx + t->keepalive_time - now_, 1 S) / (1 S));
+    }
+
+  close(t->fd);
+  pthread_mutex_destroy(&t->lock);
+  mb_free(t);
+}
+
+/* Lock writing to the socket, returns 1 if locked */
+static inline int
+bgp_ka_tx_lock(struct bgp_conn *conn)
+{
+  if (!conn->ka_thread)
+    return 0;
+
+  pthread_mutex_lock(&conn->ka_thread->lock);
+  return 1;
+}
+
+/* Unlock writing to the socket, @rv is the result of sk_send() */
+static inline void
+bgp_ka_tx_unlock(struct bgp_conn *conn, int rv)
+{
+  struct bgp_ka_thread *t = conn->ka_thread;
+
+  t->tx_busy = (rv == 0);
+  t->last_tx = precise_time();
+  pthread_mutex_unlock(&t->lock);
+}
+
+/* The rest of a partially sent message was written by the main loop */
+static inline void
+bgp_ka_tx_done(struct bgp_conn *conn)
+{
+  struct bgp_ka_thread *t = conn->ka_thread;
+
+  if (t && t->tx_busy)
+    {
+      pthread_mutex_lock(&t->lock);
+      t->tx_busy = 0;
+      t->last_tx = precise_time();
+      pthread_mutex_unlock(&t->lock);
+    }
+}
+
+/**
+ * bgp_ka_thread_remains - remaining times of keepalive thread timers
+ * @conn: connection
+ * @hold: place for the remaining hold time
+ * @keepalive: place for the remaining keepalive time
+ *
+ * If @conn has a keepalive thread, the function replaces the values with the
+ * remaining times (in seconds) of the timers of the thread.
+ */
+void
+bgp_ka_thread_remains(struct bgp_conn *conn, int *hold, int *keepalive)
+{
+  struct bgp_ka_thread *t = conn->ka_thread;
+  btime now_ = precise_time();
+
+  if (!t)
+    return;
+
+  pthread_mutex_lock(&t->lock);
+  *hold = MAX(t->last_rx + t->hold_time - now_, 0) / (1 S);
+  *keepalive = MAX(t->last_tx + t->keepalive_time - now_, 0) / (1 S);
+  pthread_mutex_unlock(&t->lock);
+}
+
+/**
+ * bgp_restart_hold_timer - a message was received
+ * @conn: connection
+ *
+ * Restarts the hold timer of @conn, either in the main loop, or in the
+ * keepalive thread if there is one.
+ */
+void
+bgp_restart_hold_timer(struct bgp_conn *conn)
+{
+  if (conn->ka_thread)
+    bgp_ka_thread_rx(conn->ka_thread, precise_time());
+  else
+    bgp_start_timer(conn->hold_timer, conn->hold_time);
+}
+
+#else
+
+void
+bgp_rx_thread_stop(struct bgp_conn *conn UNUSED)
+{
+}
+
+int
+bgp_rx_thread_join(struct bgp_conn *conn UNUSED)
+{
+  return 1;
+}
+
+void
+bgp_ka_thread_start(struct bgp_conn *conn UNUSED)
+{
+}
+
+void
+bgp_ka_thread_stop(struct bgp_conn *conn UNUSED)
+{
+}
+
+static inline int bgp_ka_tx_lock(struct bgp_conn *conn UNUSED) { return 0; }
+static inline void bgp_ka_tx_unlock(struct bgp_conn *conn UNUSED, int rv UNUSED) { }
+static inline void bgp_ka_tx_done(struct bgp_conn *conn UNUSED) { }
+
+void
+bgp_ka_thread_remains(struct bgp_conn *conn UNUSED, int *hold UNUSED, int *keepalive UNUSED)
+{
+}
+
+void
+bgp_restart_hold_timer(struct bgp_conn *conn)
+{
+  bgp_start_timer(conn->hold_timer, conn->hold_time);
+}
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ *	BIRD -- BGP Session Statistics
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Session statistics
+ *
+ * Each BGP instance counts sent and received messages and bytes and measures
+ * the time spent on decoding of received UPDATE messages, on import of their
+ * routes to the routing table and on building of UPDATE messages from the
+ * bucket queue. The durations are read by precise_time() and kept as their
+ * sum, maximum and a histogram with logarithmic buckets, which is just an
+ * increment of one counter per measurement. Everything runs in the main
+ * thread, so no locking is needed.
+ *
+ * The statistics cover one established session. They are shown by the
+ * &show protocols all command and dumped in the key=value format suitable
+ * for monitoring scripts by the &show bgp stats command.
+ */
+
+#undef LOCAL_DEBUG
+
+#include "nest/bird.h"
+#include "nest/protocol.h"
+#include "nest/cli.h"
+#include "lib/bitops.h"
+#include "lib/string.h"
+
+#include "bgp.h"
+
+static const char *bgp_hist_names[BGP_HIST_MAX] = { "decode", "import", "export" };
+static const char *bgp_hist_labels[BGP_HIST_MAX] = { "Decode time: ", "Import time: ", "Export time: " };
+
+/**
+ * bgp_stats_init - reset session statistics
+ * @p: BGP instance
+ */
+void
+bgp_stats_init(struct bgp_proto *p)
+{
+  memset(&p->stats, 0, sizeof(struct bgp_stats));
+  p->stats.since = now;
+}
+
+/**
+ * bgp_stats_time - account a measured duration
+ * @p: BGP instance
+ * @h: measured operation (%BGP_HIST_DECODE, %BGP_HIST_IMPORT or %BGP_HIST_EXPORT)
+ * @dt: duration in microseconds
+ */
+void
+bgp_stats_time(struct bgp_proto *p, uint h, btime dt)
+{
+  struct bgp_stats *s = &p->stats;
+  uint b;
+
+  if (dt < 0)
+    dt = 0;
+
+  b = (dt > 1) ? u32_log2(MIN(dt, 0xffffffff)) : 0;
+  s->hist[h][MIN(b, BGP_HIST_BUCKETS - 1)]++;
+  s->total[h] += dt;
+  s->max[h] = MAX(s->max[h], dt);
+}
+
+static inline uint
+bgp_stats_count(struct bgp_stats *s, uint h)
+{
+  uint i, n = 0;
+
+  for (i = 0; i < BGP_HIST_BUCKETS; i++)
+    n += s->hist[h][i];
+
+  return n;
+}
+
+/**
+ * bgp_show_stats_info - show statistics in protocol details
+ * @p: BGP instance
+ */
+void
+bgp_show_stats_info(struct bgp_proto *p)
+{
+  struct bgp_stats *s = &p->stats;
+  uint dt = MAX(now - s->since, 1);
+  uint h;
+
+  cli_msg(-1006, "    Messages:         %u received (%u updates), %u sent (%u updates)",
+	  s->rx_messages, s->rx_updates, s->tx_messages, s->tx_updates);
+  cli_msg(-1006, "    Update rate:      %u/s received, %u/s sent",
+	  s->rx_updates / dt, s->tx_updates / dt);
+  cli_msg(-1006, "    Traffic:          %u kB received, %u kB sent",
+	  (uint) (s->rx_bytes >> 10), (uint) (s->tx_bytes >> 10));
+
+  for (h = 0; h < BGP_HIST_MAX; h++)
+    {
+      uint n = bgp_stats_count(s, h);
+      cli_msg(-1006, "    %s     avg %u us, max %u us", bgp_hist_labels[h],
+	      n ? (uint) (s->total[h] / n) : 0, (uint) s->max[h]);
+    }
+}
+
+static void
+bgp_show_stats_lines(struct bgp_proto *p)
+{
+  struct bgp_stats *s = &p->stats;
+  byte buf[CLI_LINE_SIZE - 16];
+  byte *pos, *end = buf + sizeof(buf);
+  uint h, i;
+
+  cli_msg(-1022, "%s up=%d seconds=%u rx_messages=%u tx_messages=%u rx_updates=%u tx_updates=%u"
+	  " rx_bytes=%lu tx_bytes=%lu",
+	  p->p.name, p->p.proto_state == PS_UP, (uint) (now - s->since),
+	  s->rx_messages, s->tx_messages, s->rx_updates, s->tx_updates,
+	  (unsigned long) s->rx_bytes, (unsigned long) s->tx_bytes);
+
+  for (h = 0; h < BGP_HIST_MAX; h++)
+    {
+      /* Each line fits, counts have at most 10 digits */
+      pos = buf;
+      for (i = 0; i < BGP_HIST_BUCKETS; i++)
+	pos += bsnprintf(pos, end - pos, i ? ",%u" : "%u", s->hist[h][i]);
+
+      cli_msg(-1022, "%s %s_total_us=%lu %s_max_us=%u %s_hist=%s",
+	      p->p.name, bgp_hist_names[h], (unsigned long) s->total[h],
+	      bgp_hist_names[h], (uint) s->max[h], bgp_hist_names[h], buf);
+    }
+}
+
+/**
+ * bgp_show_stats - dump session statistics
+ * @P: BGP instance, or NULL for all BGP instances
+ *
+ * This function implements the &show bgp stats CLI command. Each instance
+ * is reported on four lines, the first one with counters and one for each
+ * measured operation, every line consists of the instance name followed by
+ * key=value pairs. Histograms are lists of %BGP_HIST_BUCKETS comma-separated
+ * counts, bucket i counting durations from 2^i to 2^(i+1) microseconds (the
+ * first one also shorter ones, the last one also longer ones).
+ */
+void
+bgp_show_stats(struct proto *P)
+{
+  struct proto *q;
+
+  if (P)
+    bgp_show_stats_lines((struct bgp_proto *) P);
+  else
+    WALK_LIST(q, active_proto_list)
+      if (q->proto == &proto_bgp)
+	bgp_show_stats_lines((struct bgp_proto *) q);
+
+  cli_msg(0, "");
+}
@@ -0,0 +1,822 @@
+/*
+ *	BIRD -- BGP Monitoring Protocol (BMP)
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: BGP Monitoring Protocol
+ *
+ * The BMP protocol implements the monitored router side of RFC 7854. It keeps
+ * a TCP connection to a monitoring station and streams Peer Up and Peer
+ * Down notifications of BGP sessions, Route Monitoring messages and periodic
+ * Stats Reports to it. The station never sends anything back.
+ *
+ * Pre-policy routes are passed to the station as received, BGP calls
+ * bmp_rx_update() for each valid UPDATE message before it is processed.
+ * Post-policy routes are obtained through a regular announce hook of the
+ * protocol, which accepts %RA_ANY announcements, so every change of a route
+ * from a BGP peer in the connected table is encoded as a new UPDATE message.
+ * When the station connects, Peer Up messages are sent for all established
+ * sessions and the protocol goes up, so the core feeds it with all routes.
+ *
+ * Messages are never sent directly. They are appended to chunks of a send
+ * queue, which are passed to the socket one by one from an event and the TX
+ * hook, so route processing never waits for the station. The queue is limited
+ * by the &queue_limit option. When a slow station lets the queue overflow,
+ * the connection is dropped and established again after the retry time,
+ * followed by a complete resynchronization.
+ */
+
+#undef LOCAL_DEBUG
+
+#include "nest/bird.h"
+#include "nest/cli.h"
+#include "nest/iface.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "conf/conf.h"
+#include "lib/event.h"
+#include "lib/nlri.h"
+#include "lib/resource.h"
+#include "lib/socket.h"
+#include "lib/string.h"
+#include "lib/unaligned.h"
+
+#include "proto/bgp/bgp.h"
+#include "bmp.h"
+
+/* Max size of a post-policy UPDATE message */
+#define BMP_UPDATE_MAX		(BGP_HEADER_LENGTH + 4 + BGP_MAX_ATTRS_LENGTH + 64)
+
+static list bmp_proto_list;
+uint bmp_stations;
+
+static void bmp_connect(struct bmp_proto *p);
+static void bmp_disconnect(struct bmp_proto *p);
+
+
+/*
+ *	Send queue
+ */
+
+/* Reserve space for a message of at most @max bytes, returns its body */
+static byte *
+bmp_begin(struct bmp_proto *p, uint type, uint max)
+{
+  struct bmp_chunk *c = TAIL(p->tx_queue);
+  byte *buf;
+
+  if (!p->connected || p->overflow)
+    return NULL;
+
+  max += BMP_HEADER_LENGTH;
+  if (p->tx_queued + max > p->cf->queue_limit)
+    {
+      /* The connection is dropped from the event, not from our caller */
+      p->overflow = 1;
+      ev_schedule(p->tx_ev);
+      return NULL;
+    }
+
+  if (!NODE_VALID(c) || c->sent || (c->len + max > c->size))
+    {
+      uint size = MAX(BMP_CHUNK_SIZE, max);
+      c = mb_alloc(p->p.pool, sizeof(struct bmp_chunk) + size);
+      c->len = 0;
+      c->size = size;
+      c->sent = 0;
+      add_tail(&p->tx_queue, &c->n);
+    }
+
+  buf = c->data + c->len;
+  buf[0] = BMP_VERSION;
+  buf[5] = type;
+  return buf + BMP_HEADER_LENGTH;
+}
+
+/* Finish the message reserved by bmp_begin(), @end points after its body */
+static void
+bmp_commit(struct bmp_proto *p, byte *end)
+{
+  struct bmp_chunk *c = TAIL(p->tx_queue);
+  byte *buf = c->data + c->len;
+  uint len = end - buf;
+
+  put_u32(buf + 1, len);
+  c->len += len;
+  p->tx_queued += len;
+  p->tx_msgs++;
+
+  if (!ev_active(p->tx_ev))
+    ev_schedule(p->tx_ev);
+}
+
+static void
+bmp_free_chunk(struct bmp_proto *p, struct bmp_chunk *c)
+{
+  p->tx_queued -= c->len;
+  rem_node(&c->n);
+  mb_free(c);
+}
+
+static void
+bmp_flush_queue(struct bmp_proto *p)
+{
+  struct bmp_chunk *c;
+  node *nxt;
+
+  WALK_LIST_DELSAFE(c, nxt, p->tx_queue)
+    bmp_free_chunk(p, c);
+}
+
+/* Pass queued chunks to the socket until it blocks */
+static void
+bmp_fire_tx(struct bmp_proto *p)
+{
+  struct bmp_chunk *c;
+  int rv;
+
+  while ((c = HEAD(p->tx_queue)), NODE_VALID(c) && !c->sent)
+    {
+      c->sent = 1;
+      sk_set_tbuf(p->sk, c->data);
+      rv = sk_send(p->sk, c->len);
+
+      /* Error hook was called and the connection is gone */
+      if (rv < 0)
+	return;
+
+      /* The rest is sent from the TX hook */
+      if (!rv)
+	return;
+
+      sk_set_tbuf(p->sk, NULL);
+      bmp_free_chunk(p, c);
+    }
+}
+
+static void
+bmp_tx_event(void *data)
+{
+  struct bmp_proto *p = data;
+
+  if (p->overflow)
+    {
+      log(L_WARN "%s: Send queue overflow, monitoring station is too slow", p->p.name);
+      p->drops++;
+      bmp_disconnect(p);
+      return;
+    }
+
+  if (p->connected)
+    bmp_fire_tx(p);
+}
+
+static void
+bmp_tx(sock *sk)
+{
+  struct bmp_proto *p = sk->data;
+  struct bmp_chunk *c = HEAD(p->tx_queue);
+
+  /* The chunk in progress is done */
+  if (NODE_VALID(c) && c->sent)
+    {
+      sk_set_tbuf(sk, NULL);
+      bmp_free_chunk(p, c);
+    }
+
+  bmp_fire_tx(p);
+}
+
+
+/*
+ *	Message encoding
+ */
+
+static inline byte *
+bmp_put_addr(byte *buf, ip_addr a)
+{
+#ifndef IPV6
+  memset(buf, 0, 12);
+  buf += 12;
+#endif
+  return put_ipa(buf, a);
+}
+
+static byte *
+bmp_put_peer_hdr(byte *buf, struct bgp_proto *peer, uint flags)
+{
+  buf[0] = 0;				/* Global instance peer */
+#ifdef IPV6
+  buf[1] = flags | BMP_PEER_V;
+#else
+  buf[1] = flags;
+#endif
+  memset(buf + 2, 0, 8);		/* Peer distinguisher */
+  bmp_put_addr(buf + 10, peer->cf->remote_ip);
+  put_u32(buf + 26, peer->remote_as);
+  put_u32(buf + 30, peer->remote_id);
+  put_u32(buf + 34, now_real);
+  put_u32(buf + 38, 0);
+  return buf + BMP_PEER_HEADER_LENGTH;
+}
+
+static inline byte *
+bmp_put_tlv(byte *buf, uint type, const char *str)
+{
+  uint len = strlen(str);
+  put_u16(buf, type);
+  put_u16(buf + 2, len);
+  memcpy(buf + 4, str, len);
+  return buf + 4 + len;
+}
+
+static inline int
+bmp_peer_established(struct bgp_proto *peer)
+{
+  return peer->conn && (peer->conn->state == BS_ESTABLISHED);
+}
+
+static void
+bmp_send_initiation(struct bmp_proto *p)
+{
+  byte name[16];
+  byte *pos = bmp_begin(p, BMP_INITIATION, 64);
+
+  if (!pos)
+    return;
+
+  bsprintf(name, "%R", config->router_id);
+  pos = bmp_put_tlv(pos, 1, "BIRD " BIRD_VERSION);	/* sysDescr */
+  pos = bmp_put_tlv(pos, 2, name);			/* sysName */
+  bmp_commit(p, pos);
+}
+
+static void
+bmp_send_termination(struct bmp_proto *p)
+{
+  byte *pos = bmp_begin(p, BMP_TERMINATION, 6);
+
+  if (!pos)
+    return;
+
+  put_u16(pos, 1);			/* Reason */
+  put_u16(pos + 2, 2);
+  put_u16(pos + 4, 0);			/* Session administratively closed */
+  bmp_commit(p, pos + 6);
+}
+
+static void
+bmp_send_peer_up(struct bmp_proto *p, struct bgp_proto *peer)
+{
+  struct bgp_conn *conn = peer->conn;
+  uint tx_len = conn->open_tx ? get_u16(conn->open_tx + 16) : 0;
+  uint rx_len = conn->open_rx ? get_u16(conn->open_rx + 16) : 0;
+  byte *pos = bmp_begin(p, BMP_PEER_UP, BMP_PEER_HEADER_LENGTH + 20 + tx_len + rx_len);
+
+  if (!pos)
+    return;
+
+  pos = bmp_put_peer_hdr(pos, peer, peer->as4_session ? 0 : BMP_PEER_A);
+  pos = bmp_put_addr(pos, conn->sk->saddr);
+  put_u16(pos, conn->sk->sport);
+  put_u16(pos + 2, conn->sk->dport);
+  pos += 4;
+
+  memcpy(pos, conn->open_tx, tx_len);
+  pos += tx_len;
+  memcpy(pos, conn->open_rx, rx_len);
+  pos += rx_len;
+  bmp_commit(p, pos);
+}
+
+static void
+bmp_send_peer_down(struct bmp_proto *p, struct bgp_proto *peer)
+{
+  byte *pos = bmp_begin(p, BMP_PEER_DOWN, BMP_PEER_HEADER_LENGTH + BGP_HEADER_LENGTH + 3);
+  uint code = peer->last_error_code;
+
+  if (!pos)
+    return;
+
+  pos = bmp_put_peer_hdr(pos, peer, peer->as4_session ? 0 : BMP_PEER_A);
+
+  switch (peer->last_error_class)
+    {
+    case BE_BGP_TX:
+    case BE_BGP_RX:
+      /* Local or remote notification, we have just its code */
+      *pos++ = (peer->last_error_class == BE_BGP_TX) ? 1 : 3;
+      memset(pos, 0xff, 16);
+      put_u16(pos + 16, BGP_HEADER_LENGTH + 2);
+      pos[18] = PKT_NOTIFICATION;
+      pos[19] = code >> 16;
+      pos[20] = code & 0xff;
+      pos += BGP_HEADER_LENGTH + 2;
+      break;
+
+    case BE_SOCKET:
+      *pos++ = 4;			/* Remote system closed, no data */
+      break;
+
+    default:
+      *pos++ = 2;			/* Local system closed, FSM event follows */
+      put_u16(pos, 0);
+      pos += 2;
+    }
+
+  bmp_commit(p, pos);
+}
+
+static void
+bmp_send_stats(struct bmp_proto *p, struct bgp_proto *peer)
+{
+  struct proto_stats *s = &peer->p.stats;
+  u32 adj_routes = s->imp_routes + s->filt_routes;
+  byte *pos = bmp_begin(p, BMP_STATS_REPORT, BMP_PEER_HEADER_LENGTH + 4 + 8 + 2 * 12);
+
+  if (!pos)
+    return;
+
+  pos = bmp_put_peer_hdr(pos, peer, peer->as4_session ? 0 : BMP_PEER_A);
+  put_u32(pos, 3);
+  pos += 4;
+
+  /* Prefixes rejected by inbound policy */
+  put_u16(pos, 0);
+  put_u16(pos + 2, 4);
+  put_u32(pos + 4, s->imp_updates_filtered);
+  pos += 8;
+
+  /* Routes in Adj-RIB-In */
+  put_u16(pos, 7);
+  put_u16(pos + 2, 8);
+  put_u32(pos + 4, 0);
+  put_u32(pos + 8, adj_routes);
+  pos += 12;
+
+  /* Routes in Loc-RIB */
+  put_u16(pos, 8);
+  put_u16(pos + 2, 8);
+  put_u32(pos + 4, 0);
+  put_u32(pos + 8, s->imp_routes);
+  pos += 12;
+
+  bmp_commit(p, pos);
+}
+
+/* Encode BGP attributes of @e preceded by their length */
+static byte *
+bmp_put_attrs(struct bmp_proto *p, byte *pos, rte *e)
+{
+  ea_list *o = e->attrs->eattrs;
+  uint i, n = 0;
+
+  ea_list *l = lp_alloc(p->lp, sizeof(ea_list) + (o ? o->count : 0) * sizeof(eattr));
+  l->next = NULL;
+  l->flags = EALF_SORTED;
+  for (i = 0; o && (i < o->count); i++)
+    if (EA_PROTO(o->attrs[i].id) == EAP_BGP)
+      l->attrs[n++] = o->attrs[i];
+  l->count = n;
+
+  int len = bgp_encode_attrs_as4(1, pos + 2, l, BGP_MAX_ATTRS_LENGTH);
+  if (len < 0)
+    len = 0;
+
+#ifdef IPV6
+  /* MP_REACH_NLRI with the next hop and the prefix */
+  eattr *nh = ea_find(l, EA_CODE(EAP_BGP, BA_NEXT_HOP));
+  ip_addr *nhs = nh ? (ip_addr *) nh->u.ptr->data : &e->attrs->gw;
+  uint cnt = (nh && (nh->u.ptr->length == NEXT_HOP_LENGTH) && ipa_nonzero(nhs[1])) ? 2 : 1;
+  byte *x = pos + 2 + len;
+  byte *start = x;
+
+  x[0] = BAF_OPTIONAL;
+  x[1] = BA_MP_REACH_NLRI;
+  put_u16(x + 3, BGP_AF_IPV6);
+  x[5] = 1;				/* SAFI unicast */
+  x[6] = cnt * 16;
+  for (i = 0, x += 7; i < cnt; i++)
+    x = put_ipa(x, nhs[i]);
+  *x++ = 0;				/* Reserved */
+  x += nlri_put_prefix(x, e->net->n.prefix, e->net->n.pxlen);
+  start[2] = x - start - 3;
+  len = x - (pos + 2);
+#endif
+
+  put_u16(pos, len);
+  return pos + 2 + len;
+}
+
+/* Encode UPDATE message announcing @new or withdrawing network @n */
+static byte *
+bmp_put_update(struct bmp_proto *p, byte *buf, net *n, rte *new)
+{
+  byte *pos = buf + BGP_HEADER_LENGTH;
+
+  memset(buf, 0xff, 16);
+  buf[18] = PKT_UPDATE;
+
+#ifndef IPV6
+  if (!new)
+    {
+      uint l = nlri_put_prefix(pos + 2, n->n.prefix, n->n.pxlen);
+      put_u16(pos, l);
+      pos += 2 + l;
+      put_u16(pos, 0);
+      pos += 2;
+    }
+  else
+    {
+      put_u16(pos, 0);
+      pos = bmp_put_attrs(p, pos + 2, new);
+      pos += nlri_put_prefix(pos, n->n.prefix, n->n.pxlen);
+    }
+#else
+  put_u16(pos, 0);
+  pos += 2;
+
+  if (!new)
+    {
+      /* Just MP_UNREACH_NLRI */
+      byte *x = pos + 2;
+      x[0] = BAF_OPTIONAL;
+      x[1] = BA_MP_UNREACH_NLRI;
+      put_u16(x + 3, BGP_AF_IPV6);
+      x[5] = 1;
+      x[2] = 3 + nlri_put_prefix(x + 6, n->n.prefix, n->n.pxlen);
+      put_u16(pos, x[2] + 3);
+      pos = x + x[2] + 3;
+    }
+  else
+    pos = bmp_put_attrs(p, pos, new);
+#endif
+
+  put_u16(buf + 16, pos - buf);
+  return pos;
+}
+
+
+/*
+ *	Hooks called from BGP
+ */
+
+/**
+ * bmp_peer_up - report an established BGP session
+ * @peer: BGP instance
+ */
+void
+bmp_peer_up(struct bgp_proto *peer)
+{
+  struct bmp_proto *p;
+
+  if (!bmp_stations)
+    return;
+
+  WALK_LIST(p, bmp_proto_list)
+    bmp_send_peer_up(p, peer);
+}
+
+/**
+ * bmp_peer_down - report a closed BGP session
+ * @peer: BGP instance
+ *
+ * The reason is taken from the last error of @peer.
+ */
+void
+bmp_peer_down(struct bgp_proto *peer)
+{
+  struct bmp_proto *p;
+
+  if (!bmp_stations)
+    return;
+
+  WALK_LIST(p, bmp_proto_list)
+    bmp_send_peer_down(p, peer);
+}
+
+/**
+ * bmp_route_monitor_rx - report a received UPDATE message
+ * @peer: BGP instance
+ * @pkt: message including BGP header
+ * @len: message length
+ *
+ * Called through bmp_rx_update(), only when some station is connected.
+ */
+void
+bmp_route_monitor_rx(struct bgp_proto *peer, byte *pkt, uint len)
+{
+  struct bmp_proto *p;
+  byte *pos;
+
+  WALK_LIST(p, bmp_proto_list)
+    if (p->cf->monitor_pre && (pos = bmp_begin(p, BMP_ROUTE_MONITOR, BMP_PEER_HEADER_LENGTH + len)))
+      {
+	pos = bmp_put_peer_hdr(pos, peer, peer->as4_session ? 0 : BMP_PEER_A);
+	memcpy(pos, pkt, len);
+	bmp_commit(p, pos + len);
+      }
+}
+
+
+/*
+ *	Post-policy routes
+ */
+
+static void
+bmp_rt_notify(struct proto *P, rtable *tbl UNUSED, net *n, rte *new, rte *old, ea_list *attrs UNUSED)
+{
+  struct bmp_proto *p = (struct bmp_proto *) P;
+  rte *e = new ?: old;
+  struct proto *src = e->attrs->src->proto;
+  struct bgp_proto *peer = (struct bgp_proto *) src;
+  byte *pos;
+
+  if (!p->cf->monitor_post || (src->proto != &proto_bgp) || !bmp_peer_established(peer))
+    return;
+
+  pos = bmp_begin(p, BMP_ROUTE_MONITOR, BMP_PEER_HEADER_LENGTH + BMP_UPDATE_MAX);
+  if (!pos)
+    return;
+
+  pos = bmp_put_peer_hdr(pos, peer, BMP_PEER_L);
+  pos = bmp_put_update(p, pos, n, new);
+  bmp_commit(p, pos);
+  lp_flush(p->lp);
+}
+
+
+/*
+ *	Connection
+ */
+
+static void
+bmp_stats_timeout(timer *t)
+{
+  struct bmp_proto *p = t->data;
+  struct proto *P;
+
+  WALK_LIST(P, active_proto_list)
+    if ((P->proto == &proto_bgp) && bmp_peer_established((struct bgp_proto *) P))
+      bmp_send_stats(p, (struct bgp_proto *) P);
+}
+
+static void
+bmp_connected(sock *sk)
+{
+  struct bmp_proto *p = sk->data;
+  struct proto *P;
+
+  TRACE(D_EVENTS, "Connected to %I", sk->daddr);
+  tm_stop(p->connect_timer);
+  sk->tx_hook = bmp_tx;
+  p->connected = 1;
+  p->tx_msgs = 0;
+  bmp_stations++;
+
+  bmp_send_initiation(p);
+
+  WALK_LIST(P, active_proto_list)
+    if ((P->proto == &proto_bgp) && bmp_peer_established((struct bgp_proto *) P))
+      bmp_send_peer_up(p, (struct bgp_proto *) P);
+
+  if (p->cf->stats_interval)
+    {
+      p->stats_timer->recurrent = p->cf->stats_interval;
+      tm_start(p->stats_timer, p->cf->stats_interval);
+    }
+
+  /* Post-policy routes follow from the feed */
+  proto_notify_state(&p->p, PS_UP);
+}
+
+static int
+bmp_rx(sock *sk UNUSED, int size UNUSED)
+{
+  /* The station is not supposed to send anything, just drop it */
+  return 1;
+}
+
+static void
+bmp_sock_err(sock *sk, int err)
+{
+  struct bmp_proto *p = sk->data;
+
+  if (err)
+    TRACE(D_EVENTS, "Connection lost (%M)", err);
+  else
+    TRACE(D_EVENTS, "Connection closed");
+
+  bmp_disconnect(p);
+}
+
+static void
+bmp_sock_err_down(sock *sk UNUSED, int err UNUSED)
+{
+  /* The protocol is going down, errors do not matter anymore */
+}
+
+static void
+bmp_connect_timeout(timer *t)
+{
+  struct bmp_proto *p = t->data;
+
+  if (p->sk)
+    {
+      TRACE(D_EVENTS, "Connection timeout");
+      rfree(p->sk);
+      p->sk = NULL;
+    }
+
+  bmp_connect(p);
+}
+
+static void
+bmp_connect(struct bmp_proto *p)
+{
+  sock *sk = sk_new(p->p.pool);
+
+  sk->type = SK_TCP_ACTIVE;
+  sk->daddr = p->cf->station_ip;
+  sk->dport = p->cf->station_port;
+  sk->rbsize = 1024;
+  sk->tbsize = 1024;			/* Chunks are sent from their own buffers */
+  sk->tos = IP_PREC_INTERNET_CONTROL;
+  sk->rx_hook = bmp_rx;
+  sk->tx_hook = bmp_connected;
+  sk->err_hook = bmp_sock_err;
+  sk->data = p;
+  p->sk = sk;
+
+  TRACE(D_EVENTS, "Connecting to %I port %u", sk->daddr, sk->dport);
+  tm_start(p->connect_timer, p->cf->connect_retry_time);
+
+  if (sk_open(sk) < 0)
+    {
+      sk_log_error(sk, p->p.name);
+      rfree(sk);
+      p->sk = NULL;
+    }
+}
+
+/* Close the connection and schedule a new one */
+static void
+bmp_disconnect(struct bmp_proto *p)
+{
+  rfree(p->sk);
+  p->sk = NULL;
+  bmp_flush_queue(p);
+  tm_stop(p->stats_timer);
+
+  if (p->connected)
+    bmp_stations--;
+
+  p->connected = 0;
+  p->overflow = 0;
+
+  if (p->p.proto_state == PS_UP)
+    proto_notify_state(&p->p, PS_START);
+
+  tm_start(p->connect_timer, p->cf->connect_retry_time);
+}
+
+
+/*
+ *	Protocol glue
+ */
+
+static struct proto *
+bmp_init(struct proto_config *C)
+{
+  struct proto *P = proto_new(C, sizeof(struct bmp_proto));
+
+  P->accept_ra_types = RA_ANY;
+  P->rt_notify = bmp_rt_notify;
+
+  return P;
+}
+
+static int
+bmp_start(struct proto *P)
+{
+  struct bmp_proto *p = (struct bmp_proto *) P;
+
+  p->cf = (struct bmp_config *) P->cf;
+  p->sk = NULL;
+  p->connected = p->overflow = 0;
+  p->tx_queued = p->tx_msgs = p->drops = 0;
+  init_list(&p->tx_queue);
+  p->lp = lp_new(P->pool, 4080);
+  p->connect_timer = tm_new_set(P->pool, bmp_connect_timeout, p, 0, 0);
+  p->stats_timer = tm_new_set(P->pool, bmp_stats_timeout, p, 0, 0);
+  p->tx_ev = ev_new(P->pool);
+  p->tx_ev->hook = bmp_tx_event;
+  p->tx_ev->data = p;
+
+  if (!bmp_proto_list.head)
+    init_list(&bmp_proto_list);
+  add_tail(&bmp_proto_list, &p->bmp_node);
+
+  bmp_connect(p);
+  return PS_START;
+}
+
+static int
+bmp_shutdown(struct proto *P)
+{
+  struct bmp_proto *p = (struct bmp_proto *) P;
+
+  /* Last try to pass the rest to the socket */
+  if (p->connected)
+    {
+      bmp_send_termination(p);
+      p->sk->err_hook = bmp_sock_err_down;
+      bmp_fire_tx(p);
+    }
+
+  if (p->connected)
+    bmp_stations--;
+
+  p->connected = 0;
+  rem_node(&p->bmp_node);
+  return PS_DOWN;
+}
+
+static int
+bmp_reconfigure(struct proto *P, struct proto_config *CF)
+{
+  struct bmp_proto *p = (struct bmp_proto *) P;
+  struct bmp_config *new = (struct bmp_config *) CF;
+  struct bmp_config *old = p->cf;
+
+  int same = !memcmp(((byte *) old) + sizeof(struct proto_config),
+		     ((byte *) new) + sizeof(struct proto_config),
+		     sizeof(struct bmp_config) - sizeof(struct proto_config));
+
+  if (same)
+    p->cf = new;
+
+  return same;
+}
+
+static void
+bmp_copy_config(struct proto_config *dest, struct proto_config *src)
+{
+  /* Just a shallow copy */
+  proto_copy_rest(dest, src, sizeof(struct bmp_config));
+}
+
+static void
+bmp_get_status(struct proto *P, byte *buf)
+{
+  struct bmp_proto *p = (struct bmp_proto *) P;
+
+  if (P->proto_state != PS_DOWN)
+    strcpy(buf, p->connected ? "Connected" : "Connecting");
+}
+
+static void
+bmp_show_proto_info(struct proto *P)
+{
+  struct bmp_proto *p = (struct bmp_proto *) P;
+
+  proto_show_basic_info(P);
+
+  cli_msg(-1006, "  Station:          %I port %u", p->cf->station_ip, p->cf->station_port);
+
+  if (P->proto_state == PS_DOWN)
+    return;
+
+  cli_msg(-1006, "  Send queue:       %u kB of %u kB", p->tx_queued >> 10, p->cf->queue_limit >> 10);
+  cli_msg(-1006, "  Messages:         %u", p->tx_msgs);
+  cli_msg(-1006, "  Overflows:        %u", p->drops);
+}
+
+/**
+ * bmp_check_config - check BMP configuration
+ * @c: BMP configuration
+ */
+void
+bmp_check_config(struct bmp_config *c)
+{
+  if (ipa_zero(c->station_ip))
+    cf_error("Station address must be configured");
+
+  if (c->queue_limit < 2 * BMP_CHUNK_SIZE)
+    cf_error("Queue limit must be at least %u", 2 * BMP_CHUNK_SIZE);
+}
+
+struct protocol proto_bmp = {
+  .name =		"BMP",
+  .template =		"bmp%d",
+  .config_size =	sizeof(struct bmp_config),
+  .init =		bmp_init,
+  .start =		bmp_start,
+  .shutdown =		bmp_shutdown,
+  .reconfigure =	bmp_reconfigure,
+  .copy_config =	bmp_copy_config,
+  .get_status =		bmp_get_status,
+  .show_proto_info =	bmp_show_proto_info
+};
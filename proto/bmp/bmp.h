@@ -0,0 +1,71 @@
+/*
+ *	BIRD -- BGP Monitoring Protocol (BMP)
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_BMP_H_
+#define _BIRD_BMP_H_
+
+#include "nest/bird.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "nest/bmp.h"
+#include "lib/socket.h"
+
+#define BMP_VERSION		3
+#define BMP_HEADER_LENGTH	6
+#define BMP_PEER_HEADER_LENGTH	42
+
+#define BMP_ROUTE_MONITOR	0
+#define BMP_STATS_REPORT	1
+#define BMP_PEER_DOWN		2
+#define BMP_PEER_UP		3
+#define BMP_INITIATION		4
+#define BMP_TERMINATION		5
+
+#define BMP_PEER_V		0x80	/* Peer address is IPv6 */
+#define BMP_PEER_L		0x40	/* Post-policy Adj-RIB-In */
+#define BMP_PEER_A		0x20	/* Legacy 2-byte AS_PATH format */
+
+#define BMP_DEFAULT_PORT	11019
+#define BMP_CHUNK_SIZE		65536	/* Default size of send queue chunks */
+
+struct bmp_config {
+  struct proto_config c;
+  ip_addr station_ip;			/* Address of the monitoring station */
+  uint station_port;
+  uint connect_retry_time;
+  uint stats_interval;			/* Period of Stats Reports, 0 for none */
+  uint queue_limit;			/* Max bytes in the send queue */
+  u8 monitor_pre;			/* Send pre-policy routes */
+  u8 monitor_post;			/* Send post-policy routes */
+};
+
+struct bmp_chunk {
+  node n;
+  uint len, size;			/* Used and allocated bytes of data */
+  u8 sent;				/* The chunk is passed to the socket */
+  byte data[0];
+};
+
+struct bmp_proto {
+  struct proto p;
+  struct bmp_config *cf;		/* Shortcut to BMP configuration */
+  node bmp_node;			/* Node in bmp_proto_list */
+  sock *sk;				/* Connection to the station, NULL if none */
+  u8 connected;				/* Station accepted the connection */
+  u8 overflow;				/* Send queue overflowed, reconnect pending */
+  timer *connect_timer;			/* Connection timeout and retry */
+  timer *stats_timer;			/* Periodic Stats Reports */
+  event *tx_ev;				/* Passes queued chunks to the socket */
+  linpool *lp;				/* Temporary data of message encoding */
+  list tx_queue;			/* Queued data (struct bmp_chunk) */
+  uint tx_queued;			/* Bytes in tx_queue */
+  u32 tx_msgs;				/* Messages queued in this session */
+  u32 drops;				/* Connections dropped due to queue overflow */
+};
+
+void bmp_check_config(struct bmp_config *c);
+
+#endif
@@ -0,0 +1,836 @@
+/*
+ *	BIRD -- Metrics Exporter
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Metrics Exporter
+ *
+ * The Metrics protocol serves the state of the daemon to Prometheus and other
+ * scrapers understanding the OpenMetrics text format. It exports states and
+ * route statistics of all protocols, sizes of routing tables, memory usage,
+ * durations of main loop cycles, and per-session statistics of BGP.
+ *
+ * Scrapes never run in the main loop. The main loop renders all metrics into
+ * a text snapshot periodically, each &interval seconds, just reading counters
+ * which are maintained anyway. The snapshot is then passed to a server thread,
+ * which listens for HTTP connections and answers each GET request with the
+ * latest snapshot. Snapshots are refcounted and they are swapped under the
+ * server lock, so a slow scraper may still receive the previous one while
+ * a new one is published. The server thread uses just its own poll loop and
+ * memory from malloc(), it touches no other state of the daemon.
+ *
+ * The HTTP server is minimal. It accepts a limited number of concurrent
+ * connections, it answers one request per connection with HTTP/1.0 and closes
+ * the connection afterwards. Slow clients are dropped after a timeout.
+ */
+
+#undef LOCAL_DEBUG
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "nest/bird.h"
+#include "nest/cli.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "conf/conf.h"
+#include "lib/resource.h"
+#include "lib/string.h"
+#include "lib/unix.h"
+#include "lib/worker.h"
+
+#ifdef CONFIG_BGP
+#include "proto/bgp/bgp.h"
+#endif
+
+#include "metrics.h"
+
+#define METRICS_CONTENT_TYPE	"text/plain; version=0.0.4; charset=utf-8"
+
+/* Arguments for printing btime in seconds with "%u.%06u" */
+#define METRICS_TIME(t)		(uint) ((t) / 1000000), (uint) ((t) % 1000000)
+
+
+/*
+ *	Server thread
+ */
+
+static void
+metrics_snapshot_unlock(struct metrics_server *srv, struct metrics_snapshot *s)
+{
+  pthread_mutex_lock(&srv->lock);
+  uint uc = --s->uc;
+  pthread_mutex_unlock(&srv->lock);
+
+  if (!uc)
+    xfree(s);
+}
+
+static struct metrics_snapshot *
+metrics_snapshot_lock(struct metrics_server *srv)
+{
+  pthread_mutex_lock(&srv->lock);
+  struct metrics_snapshot *s = srv->snap;
+  if (s)
+    s->uc++;
+  pthread_mutex_unlock(&srv->lock);
+
+  return s;
+}
+
+static void
+metrics_client_close(struct metrics_server *srv, struct metrics_client *c)
+{
+  if (c->snap)
+    metrics_snapshot_unlock(srv, c->snap);
+
+  close(c->fd);
+  c->fd = -1;
+  c->snap = NULL;
+}
+
+static void
+metrics_client_status(struct metrics_client *c, const char *status)
+{
+  c->hdr_len = bsnprintf(c->hdr, sizeof(c->hdr),
+			 "HTTP/1.0 %s\r\nContent-Type: text/plain\r\nContent-Length: %u\r\n"
+			 "Connection: close\r\n\r\n%s\n", status, (uint) strlen(status) + 1, status);
+}
+
+static void
+metrics_client_reply(struct metrics_server *srv, struct metrics_client *c)
+{
+  struct metrics_snapshot *s;
+  char *path;
+  int head = 0;
+
+  if (!strncmp(c->rx, "GET ", 4))
+    path = c->rx + 4;
+  else if (!strncmp(c->rx, "HEAD ", 5))
+    path = c->rx + 5, head = 1;
+  else
+    {
+      metrics_client_status(c, "405 Method Not Allowed");
+      return;
+    }
+
+  uint len = strcspn(path, " ?\r\n");
+  if (!((len == 1) && (path[0] == '/')) && !((len == 8) && !memcmp(path, "/metrics", 8)))
+    {
+      metrics_client_status(c, "404 Not Found");
+      return;
+    }
+
+  if (!(s = metrics_snapshot_lock(srv)))
+    {
+      metrics_client_status(c, "503 Service Unavailable");
+      return;
+    }
+
+  c->hdr_len = bsnprintf(c->hdr, sizeof(c->hdr),
+			 "HTTP/1.0 200 OK\r\nContent-Type: " METRICS_CONTENT_TYPE "\r\n"
+			 "Content-Length: %u\r\nConnection: close\r\n\r\n", s->len);
+
+  if (head)
+    metrics_snapshot_unlock(srv, s);
+  else
+    c->snap = s;
+
+  __atomic_add_fetch(&srv->requests, 1, __ATOMIC_RELAXED);
+}
+
+static void
+metrics_client_tx(struct metrics_server *srv, struct metrics_client *c)
+{
+  for (;;)
+    {
+      const char *buf;
+      uint len;
+
+      if (c->tx_pos < c->hdr_len)
+	{
+	  buf = c->hdr + c->tx_pos;
+	  len = c->hdr_len - c->tx_pos;
+	}
+      else if (c->snap && (c->tx_pos < c->hdr_len + c->snap->len))
+	{
+	  buf = c->snap->data + (c->tx_pos - c->hdr_len);
+	  len = c->hdr_len + c->snap->len - c->tx_pos;
+	}
+      else
+	break;
+
+      int rv = write(c->fd, buf, len);
+      if (rv < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+	    return;
+	  break;
+	}
+
+      c->tx_pos += rv;
+    }
+
+  /* Done or failed */
+  metrics_client_close(srv, c);
+}
+
+static void
+metrics_client_rx(struct metrics_server *srv, struct metrics_client *c)
+{
+  int rv = read(c->fd, c->rx + c->rx_len, METRICS_REQUEST_MAX - 1 - c->rx_len);
+  if (rv < 0)
+    {
+      if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK))
+	return;
+      metrics_client_close(srv, c);
+      return;
+    }
+
+  if (!rv)
+    {
+      metrics_client_close(srv, c);
+      return;
+    }
+
+  c->rx_len += rv;
+  c->rx[c->rx_len] = 0;
+
+  /* Wait for the end of the request header */
+  if (strstr(c->rx, "\r\n\r\n") || strstr(c->rx, "\n\n"))
+    metrics_client_reply(srv, c);
+  else if (c->rx_len >= METRICS_REQUEST_MAX - 1)
+    metrics_client_status(c, "400 Bad Request");
+  else
+    return;
+
+  metrics_client_tx(srv, c);
+}
+
+static void
+metrics_accept(struct metrics_server *srv)
+{
+  uint i;
+
+  for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+    {
+      struct metrics_client *c = &srv->clients[i];
+
+      if (c->fd >= 0)
+	continue;
+
+      int fd = accept(srv->listen_fd, NULL, NULL);
+      if (fd < 0)
+	return;
+
+      if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+	{
+	  close(fd);
+	  continue;
+	}
+
+      c->fd = fd;
+      c->rx_len = c->tx_pos = c->hdr_len = 0;
+      c->snap = NULL;
+      c->deadline = precise_time() + METRICS_CLIENT_TIMEOUT S;
+    }
+}
+
+static void *
+metrics_server_main(void *arg)
+{
+  struct metrics_server *srv = arg;
+  struct pollfd pfd[METRICS_MAX_CLIENTS + 2];
+  struct metrics_client *pcl[METRICS_MAX_CLIENTS + 2];
+  uint i, n, used;
+
+  thread_start(THREAD_METRICS);
+
+  while (!__atomic_load_n(&srv->stop, __ATOMIC_ACQUIRE))
+    {
+      btime now = precise_time();
+
+      /* Internal wakeup fd and listening socket go first */
+      pfd[0] = (struct pollfd) { .fd = srv->wakeup_fds[0], .events = POLLIN };
+      pfd[1] = (struct pollfd) { .fd = srv->listen_fd, .events = POLLIN };
+      n = 2;
+      used = 0;
+
+      for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+	{
+	  struct metrics_client *c = &srv->clients[i];
+
+	  if (c->fd < 0)
+	    continue;
+
+	  if (now > c->deadline)
+	    {
+	      metrics_client_close(srv, c);
+	      continue;
+	    }
+
+	  pfd[n] = (struct pollfd) { .fd = c->fd, .events = c->hdr_len ? POLLOUT : POLLIN };
+	  pcl[n] = c;
+	  n++;
+	  used++;
+	}
+
+      /* No new connections when all slots are used */
+      if (used == METRICS_MAX_CLIENTS)
+	pfd[1].events = 0;
+
+      int rv = poll(pfd, n, 1000);
+      if (rv < 0)
+	{
+	  if ((errno == EINTR) || (errno == EAGAIN))
+	    continue;
+	  die("poll: %m");
+	}
+
+      if (pfd[0].revents & POLLIN)
+	pipe_drain(srv->wakeup_fds[0]);
+
+      for (i = 2; i < n; i++)
+	if (pfd[i].revents)
+	  {
+	    if (pcl[i]->hdr_len)
+	      metrics_client_tx(srv, pcl[i]);
+	    else
+	      metrics_client_rx(srv, pcl[i]);
+	  }
+
+      if (pfd[1].revents & POLLIN)
+	metrics_accept(srv);
+    }
+
+  for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+    if (srv->clients[i].fd >= 0)
+      metrics_client_close(srv, &srv->clients[i]);
+
+  thread_stop();
+  return NULL;
+}
+
+static int
+metrics_open_listen(struct metrics_proto *p)
+{
+  struct metrics_config *cf = p->cf;
+  sockaddr sa;
+  int fd, y = 1;
+
+  fd = socket(BIRD_AF, SOCK_STREAM, 0);
+  if (fd < 0)
+    goto err0;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y)) < 0)
+    goto err;
+
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+    goto err;
+
+  sockaddr_fill(&sa, BIRD_AF, cf->listen_ip, NULL, cf->listen_port);
+  if (bind(fd, &sa.sa, (BIRD_AF == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6)) < 0)
+    goto err;
+
+  if (listen(fd, METRICS_MAX_CLIENTS) < 0)
+    goto err;
+
+  return fd;
+
+ err:
+  close(fd);
+ err0:
+  log(L_ERR "%s: Cannot listen on %I port %u: %m", p->p.name, cf->listen_ip, cf->listen_port);
+  return -1;
+}
+
+static struct metrics_server *
+metrics_server_start(struct metrics_proto *p, int fd)
+{
+  struct metrics_server *srv = xmalloc(sizeof(struct metrics_server));
+  uint i;
+
+  memset(srv, 0, sizeof(struct metrics_server));
+  pthread_mutex_init(&srv->lock, NULL);
+  srv->listen_fd = fd;
+  pipe_new(srv->wakeup_fds);
+
+  for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+    srv->clients[i].fd = -1;
+
+  int rv = pthread_create(&srv->thread, NULL, metrics_server_main, srv);
+  if (rv)
+    {
+      log(L_ERR "%s: Cannot start server thread: %M", p->p.name, rv);
+      close(srv->wakeup_fds[0]);
+      close(srv->wakeup_fds[1]);
+      pthread_mutex_destroy(&srv->lock);
+      xfree(srv);
+      return NULL;
+    }
+
+  return srv;
+}
+
+static void
+metrics_server_stop(struct metrics_server *srv)
+{
+  __atomic_store_n(&srv->stop, 1, __ATOMIC_RELEASE);
+  pipe_kick(srv->wakeup_fds[1]);
+
+  int rv = pthread_join(srv->thread, NULL);
+  if (rv)
+    die("pthread_join(): %M", rv);
+
+  if (srv->snap)
+    metrics_snapshot_unlock(srv, srv->snap);
+
+  close(srv->listen_fd);
+  close(srv->wakeup_fds[0]);
+  close(srv->wakeup_fds[1]);
+  pthread_mutex_destroy(&srv->lock);
+  xfree(srv);
+}
+
+static void
+metrics_server_publish(struct metrics_server *srv, struct metrics_snapshot *s)
+{
+  s->uc = 1;
+
+  pthread_mutex_lock(&srv->lock);
+  struct metrics_snapshot *old = srv->snap;
+  srv->snap = s;
+  pthread_mutex_unlock(&srv->lock);
+
+  if (old)
+    metrics_snapshot_unlock(srv, old);
+}
+
+
+/*
+ *	Rendering
+ */
+
+static void
+metrics_print(struct metrics_proto *p, const char *fmt, ...)
+{
+  va_list args;
+  int n;
+
+  for (;;)
+    {
+      struct metrics_snapshot *s = p->render;
+
+      va_start(args, fmt);
+      n = bvsnprintf(s->data + s->len, p->render_size - s->len, fmt, args);
+      va_end(args);
+
+      if (n >= 0)
+	break;
+
+      p->render_size *= 2;
+      p->render = xrealloc(s, sizeof(struct metrics_snapshot) + p->render_size);
+    }
+
+  p->render->len += n;
+}
+
+static void
+metrics_family(struct metrics_proto *p, const char *name, const char *type, const char *help)
+{
+  metrics_print(p, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+#define PS_FIELD(x) OFFSETOF(struct proto_stats, x)
+
+struct metrics_stat {
+  const char *family;			/* Name of metric family, NULL for a row of the previous one */
+  const char *help;
+  const char *label;			/* Label name and value of the sample */
+  size_t offset;			/* Position in struct proto_stats */
+};
+
+static const struct metrics_stat metrics_proto_stats[] = {
+  { "bird_protocol_routes", "Routes of the protocol in the table", "kind=\"imported\"", PS_FIELD(imp_routes) },
+  { NULL, NULL, "kind=\"filtered\"", PS_FIELD(filt_routes) },
+  { NULL, NULL, "kind=\"exported\"", PS_FIELD(exp_routes) },
+  { NULL, NULL, "kind=\"preferred\"", PS_FIELD(pref_routes) },
+  { "bird_protocol_import_updates_total", "Route updates imported from the protocol", "result=\"received\"", PS_FIELD(imp_updates_received) },
+  { NULL, NULL, "result=\"invalid\"", PS_FIELD(imp_updates_invalid) },
+  { NULL, NULL, "result=\"filtered\"", PS_FIELD(imp_updates_filtered) },
+  { NULL, NULL, "result=\"ignored\"", PS_FIELD(imp_updates_ignored) },
+  { NULL, NULL, "result=\"accepted\"", PS_FIELD(imp_updates_accepted) },
+  { "bird_protocol_import_withdraws_total", "Route withdraws imported from the protocol", "result=\"received\"", PS_FIELD(imp_withdraws_received) },
+  { NULL, NULL, "result=\"invalid\"", PS_FIELD(imp_withdraws_invalid) },
+  { NULL, NULL, "result=\"ignored\"", PS_FIELD(imp_withdraws_ignored) },
+  { NULL, NULL, "result=\"accepted\"", PS_FIELD(imp_withdraws_accepted) },
+  { "bird_protocol_export_updates_total", "Route updates exported to the protocol", "result=\"received\"", PS_FIELD(exp_updates_received) },
+  { NULL, NULL, "result=\"rejected\"", PS_FIELD(exp_updates_rejected) },
+  { NULL, NULL, "result=\"filtered\"", PS_FIELD(exp_updates_filtered) },
+  { NULL, NULL, "result=\"accepted\"", PS_FIELD(exp_updates_accepted) },
+  { "bird_protocol_export_withdraws_total", "Route withdraws exported to the protocol", "result=\"received\"", PS_FIELD(exp_withdraws_received) },
+  { NULL, NULL, "result=\"accepted\"", PS_FIELD(exp_withdraws_accepted) },
+};
+
+/* Walk running instances of configured protocols */
+#define WALK_PROTOS(pc, P) \
+  WALK_LIST(pc, config->protos) \
+    if (P = pc->proto)
+
+static void
+metrics_render_protos(struct metrics_proto *p)
+{
+  struct proto_config *pc;
+  struct proto *P;
+  uint i;
+
+  metrics_family(p, "bird_protocol_up", "gauge", "Whether the protocol is up");
+  WALK_PROTOS(pc, P)
+    metrics_print(p, "bird_protocol_up{proto=\"%s\",type=\"%s\"} %u\n",
+		  P->name, P->proto->name, P->proto_state == PS_UP);
+
+  metrics_family(p, "bird_protocol_state", "gauge", "State of the protocol as in show protocols");
+  WALK_PROTOS(pc, P)
+    metrics_print(p, "bird_protocol_state{proto=\"%s\",type=\"%s\",state=\"%s\"} 1\n",
+		  P->name, P->proto->name, proto_state_name(P));
+
+  for (i = 0; i < ARRAY_SIZE(metrics_proto_stats); i++)
+    {
+      const struct metrics_stat *st = &metrics_proto_stats[i];
+      const char *family;
+      uint j;
+
+      /* Find the family of the row */
+      for (j = i; !metrics_proto_stats[j].family; j--)
+	;
+      family = metrics_proto_stats[j].family;
+
+      if (st->family)
+	metrics_family(p, family, strstr(family, "_total") ? "counter" : "gauge", st->help);
+
+      WALK_PROTOS(pc, P)
+	metrics_print(p, "%s{proto=\"%s\",type=\"%s\",%s} %u\n", family, P->name, P->proto->name,
+		      st->label, *(u32 *) (((byte *) &P->stats) + st->offset));
+    }
+}
+
+static void
+metrics_render_tables(struct metrics_proto *p)
+{
+  struct rtable_config *tc;
+
+  metrics_family(p, "bird_table_networks", "gauge", "Networks in the routing table");
+  WALK_LIST(tc, config->tables)
+    if (tc->table)
+      metrics_print(p, "bird_table_networks{table=\"%s\"} %u\n", tc->name, tc->table->fib.entries);
+}
+
+extern pool *rt_table_pool;
+extern pool *rta_pool;
+extern pool *roa_pool;
+extern pool *proto_pool;
+
+static void
+metrics_render_memory(struct metrics_proto *p)
+{
+  struct page_stats ps;
+
+  page_alloc_stats(&ps);
+
+  metrics_family(p, "bird_memory_bytes", "gauge", "Memory used by parts of the daemon");
+  metrics_print(p, "bird_memory_bytes{pool=\"tables\"} %lu\n", (unsigned long) rmemsize(rt_table_pool));
+  metrics_print(p, "bird_memory_bytes{pool=\"attributes\"} %lu\n", (unsigned long) rmemsize(rta_pool));
+  metrics_print(p, "bird_memory_bytes{pool=\"roa\"} %lu\n", (unsigned long) rmemsize(roa_pool));
+  metrics_print(p, "bird_memory_bytes{pool=\"protocols\"} %lu\n", (unsigned long) rmemsize(proto_pool));
+  metrics_print(p, "bird_memory_bytes{pool=\"total\"} %lu\n", (unsigned long) rmemsize(&root_pool));
+  metrics_print(p, "bird_memory_bytes{pool=\"slab_pages\"} %lu\n", (unsigned long) ps.used * PAGE_ALLOC_SIZE);
+  metrics_print(p, "bird_memory_bytes{pool=\"linpool_cache\"} %lu\n", (unsigned long) lp_cache_memsize());
+}
+
+static void
+metrics_render_loop(struct metrics_proto *p)
+{
+  struct io_loop_stats ls;
+  u64 sum = 0;
+  uint i;
+
+  io_loop_stats(&ls);
+
+  metrics_family(p, "bird_loop_cycle_seconds", "histogram", "Durations of main loop cycles");
+  for (i = 0; i < IO_HIST_SIZE - 1; i++)
+    {
+      sum += ls.hist[i];
+      metrics_print(p, "bird_loop_cycle_seconds_bucket{le=\"%u.%06u\"} %lu\n",
+		    METRICS_TIME((btime) 2 << i), (unsigned long) sum);
+    }
+  metrics_print(p, "bird_loop_cycle_seconds_bucket{le=\"+Inf\"} %lu\n", (unsigned long) ls.cycles);
+  metrics_print(p, "bird_loop_cycle_seconds_sum %u.%06u\n", METRICS_TIME(ls.total));
+  metrics_print(p, "bird_loop_cycle_seconds_count %lu\n", (unsigned long) ls.cycles);
+
+  metrics_family(p, "bird_loop_cycle_max_seconds", "gauge", "The longest main loop cycle");
+  metrics_print(p, "bird_loop_cycle_max_seconds %u.%06u\n", METRICS_TIME(ls.max));
+}
+
+#ifdef CONFIG_BGP
+
+static const char *metrics_bgp_stages[BGP_HIST_MAX] = { "decode", "import", "export" };
+
+#define WALK_BGP(pc, P, bp) \
+  WALK_PROTOS(pc, P) \
+    if ((P->proto == &proto_bgp) && (bp = (struct bgp_proto *) P))
+
+static inline int
+metrics_bgp_state(struct bgp_proto *bp)
+{
+  return (bp->p.proto_state == PS_DOWN) ? BS_IDLE :
+    MAX(bp->incoming_conn.state, bp->outgoing_conn.state);
+}
+
+static void
+metrics_render_bgp(struct metrics_proto *p)
+{
+  struct proto_config *pc;
+  struct proto *P;
+  struct bgp_proto *bp;
+  uint i, j;
+
+  metrics_family(p, "bird_bgp_session_info", "gauge", "Parameters of the BGP session");
+  WALK_BGP(pc, P, bp)
+    metrics_print(p, "bird_bgp_session_info{proto=\"%s\",neighbor=\"%I\",local_as=\"%u\",remote_as=\"%u\"} 1\n",
+		  P->name, bp->cf->remote_ip, bp->cf->local_as, bp->cf->remote_as);
+
+  metrics_family(p, "bird_bgp_state", "gauge", "BGP state, 0 is Idle, 5 is Established");
+  WALK_BGP(pc, P, bp)
+    metrics_print(p, "bird_bgp_state{proto=\"%s\"} %u\n", P->name, metrics_bgp_state(bp));
+
+  metrics_family(p, "bird_bgp_messages_total", "counter", "BGP messages of all types");
+  WALK_BGP(pc, P, bp)
+    {
+      metrics_print(p, "bird_bgp_messages_total{proto=\"%s\",dir=\"rx\"} %u\n", P->name, bp->stats.rx_messages);
+      metrics_print(p, "bird_bgp_messages_total{proto=\"%s\",dir=\"tx\"} %u\n", P->name, bp->stats.tx_messages);
+    }
+
+  metrics_family(p, "bird_bgp_updates_total", "counter", "BGP UPDATE messages");
+  WALK_BGP(pc, P, bp)
+    {
+      metrics_print(p, "bird_bgp_updates_total{proto=\"%s\",dir=\"rx\"} %u\n", P->name, bp->stats.rx_updates);
+      metrics_print(p, "bird_bgp_updates_total{proto=\"%s\",dir=\"tx\"} %u\n", P->name, bp->stats.tx_updates);
+    }
+
+  metrics_family(p, "bird_bgp_bytes_total", "counter", "Bytes of BGP messages");
+  WALK_BGP(pc, P, bp)
+    {
+      metrics_print(p, "bird_bgp_bytes_total{proto=\"%s\",dir=\"rx\"} %lu\n", P->name, (unsigned long) bp->stats.rx_bytes);
+      metrics_print(p, "bird_bgp_bytes_total{proto=\"%s\",dir=\"tx\"} %lu\n", P->name, (unsigned long) bp->stats.tx_bytes);
+    }
+
+  metrics_family(p, "bird_bgp_processing_seconds", "summary", "Time spent in stages of UPDATE processing");
+  WALK_BGP(pc, P, bp)
+    for (i = 0; i < BGP_HIST_MAX; i++)
+      {
+	u64 cnt = 0;
+	for (j = 0; j < BGP_HIST_BUCKETS; j++)
+	  cnt += bp->stats.hist[i][j];
+
+	metrics_print(p, "bird_bgp_processing_seconds_sum{proto=\"%s\",stage=\"%s\"} %u.%06u\n",
+		      P->name, metrics_bgp_stages[i], METRICS_TIME(bp->stats.total[i]));
+	metrics_print(p, "bird_bgp_processing_seconds_count{proto=\"%s\",stage=\"%s\"} %lu\n",
+		      P->name, metrics_bgp_stages[i], (unsigned long) cnt);
+      }
+}
+
+#endif
+
+static void
+metrics_render(struct metrics_proto *p)
+{
+  btime t0 = precise_time();
+
+  /* Start with the size of the last snapshot, so usually no reallocation is needed */
+  p->render_size = MAX(p->last_size + p->last_size / 4, 16384);
+  p->render = xmalloc(sizeof(struct metrics_snapshot) + p->render_size);
+  p->render->len = 0;
+
+  metrics_family(p, "bird_info", "gauge", "Version of the daemon");
+  metrics_print(p, "bird_info{version=\"%s\"} 1\n", BIRD_VERSION);
+
+  metrics_family(p, "bird_uptime_seconds", "gauge", "Time since the daemon started");
+  metrics_print(p, "bird_uptime_seconds %u\n", (uint) (now - boot_time));
+
+  metrics_render_protos(p);
+  metrics_render_tables(p);
+  metrics_render_memory(p);
+  metrics_render_loop(p);
+#ifdef CONFIG_BGP
+  metrics_render_bgp(p);
+#endif
+
+  metrics_family(p, "bird_metrics_render_seconds", "gauge", "Time it took to render the previous snapshot");
+  metrics_print(p, "bird_metrics_render_seconds %u.%06u\n", METRICS_TIME(p->last_duration));
+  metrics_print(p, "# EOF\n");
+
+  p->last_size = p->render->len;
+  p->last_duration = precise_time() - t0;
+  p->snapshots++;
+
+  metrics_server_publish(p->srv, p->render);
+  p->render = NULL;
+}
+
+
+/*
+ *	Protocol glue
+ */
+
+static void
+metrics_listen(struct metrics_proto *p)
+{
+  int fd = metrics_open_listen(p);
+  if (fd < 0)
+    goto retry;
+
+  if (!(p->srv = metrics_server_start(p, fd)))
+    {
+      close(fd);
+      goto retry;
+    }
+
+  DBG("%s: Listening on %I port %u\n", p->p.name, p->cf->listen_ip, p->cf->listen_port);
+  metrics_render(p);
+
+  p->render_timer->recurrent = p->cf->interval;
+  tm_start(p->render_timer, p->cf->interval);
+  return;
+
+ retry:
+  p->render_timer->recurrent = 0;
+  tm_start(p->render_timer, METRICS_RETRY_TIME);
+}
+
+static void
+metrics_timeout(timer *t)
+{
+  struct metrics_proto *p = t->data;
+
+  if (p->srv)
+    {
+      metrics_render(p);
+      return;
+    }
+
+  metrics_listen(p);
+  if (p->srv)
+    proto_notify_state(&p->p, PS_UP);
+}
+
+static struct proto *
+metrics_init(struct proto_config *C)
+{
+  return proto_new(C, sizeof(struct metrics_proto));
+}
+
+static int
+metrics_start(struct proto *P)
+{
+  struct metrics_proto *p = (struct metrics_proto *) P;
+
+  p->cf = (struct metrics_config *) P->cf;
+  p->srv = NULL;
+  p->render = NULL;
+  p->render_size = p->last_size = 0;
+  p->last_duration = 0;
+  p->snapshots = 0;
+  p->render_timer = tm_new_set(P->pool, metrics_timeout, p, 0, 0);
+
+  metrics_listen(p);
+  return p->srv ? PS_UP : PS_START;
+}
+
+static int
+metrics_shutdown(struct proto *P)
+{
+  struct metrics_proto *p = (struct metrics_proto *) P;
+
+  if (p->srv)
+    metrics_server_stop(p->srv);
+
+  p->srv = NULL;
+  return PS_DOWN;
+}
+
+static int
+metrics_reconfigure(struct proto *P, struct proto_config *CF)
+{
+  struct metrics_proto *p = (struct metrics_proto *) P;
+  struct metrics_config *new = (struct metrics_config *) CF;
+  struct metrics_config *old = p->cf;
+
+  if (!ipa_equal(new->listen_ip, old->listen_ip) || (new->listen_port != old->listen_port))
+    return 0;
+
+  p->cf = new;
+
+  if (p->srv && (new->interval != old->interval))
+    {
+      p->render_timer->recurrent = new->interval;
+      tm_start(p->render_timer, new->interval);
+    }
+
+  return 1;
+}
+
+static void
+metrics_copy_config(struct proto_config *dest, struct proto_config *src)
+{
+  /* Just a shallow copy */
+  proto_copy_rest(dest, src, sizeof(struct metrics_config));
+}
+
+static void
+metrics_get_status(struct proto *P, byte *buf)
+{
+  struct metrics_proto *p = (struct metrics_proto *) P;
+
+  if (P->proto_state != PS_DOWN)
+    strcpy(buf, p->srv ? "Listening" : "Waiting");
+}
+
+static void
+metrics_show_proto_info(struct proto *P)
+{
+  struct metrics_proto *p = (struct metrics_proto *) P;
+
+  cli_msg(-1006, "  Listen:           %I port %u", p->cf->listen_ip, p->cf->listen_port);
+
+  if (!p->srv)
+    return;
+
+  cli_msg(-1006, "  Snapshots:        %u every %u s", p->snapshots, p->cf->interval);
+  cli_msg(-1006, "  Snapshot size:    %u B", p->last_size);
+  cli_msg(-1006, "  Render time:      %u us", (uint) p->last_duration);
+  cli_msg(-1006, "  Requests:         %u", __atomic_load_n(&p->srv->requests, __ATOMIC_RELAXED));
+}
+
+
+struct protocol proto_metrics = {
+  .name =		"Metrics",
+  .template =		"metrics%d",
+  .config_size =	sizeof(struct metrics_config),
+  .init =		metrics_init,
+  .start =		metrics_start,
+  .shutdown =		metrics_shutdown,
+  .reconfigure =	metrics_reconfigure,
+  .copy_config =	metrics_copy_config,
+  .get_status =		metrics_get_status,
+  .show_proto_info =	metrics_show_proto_info
+};
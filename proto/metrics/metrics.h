@@ -0,0 +1,72 @@
+/*
+ *	BIRD -- Metrics Exporter
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_METRICS_H_
+#define _BIRD_METRICS_H_
+
+#include <pthread.h>
+
+#include "nest/bird.h"
+#include "nest/protocol.h"
+#include "lib/timer.h"
+
+#define METRICS_DEFAULT_PORT	9324
+#define METRICS_DEFAULT_INTERVAL 5
+#define METRICS_RETRY_TIME	10	/* Retry of failed listen */
+
+#define METRICS_MAX_CLIENTS	16	/* Connections served at once */
+#define METRICS_REQUEST_MAX	2048	/* Max length of request header */
+#define METRICS_CLIENT_TIMEOUT	10	/* Seconds for the whole exchange */
+
+struct metrics_config {
+  struct proto_config c;
+  ip_addr listen_ip;			/* Address of the HTTP listener */
+  uint listen_port;
+  uint interval;			/* Period of snapshot rendering */
+};
+
+/* Rendered text of all metrics, shared with the server thread */
+struct metrics_snapshot {
+  uint uc;				/* Use count, protected by the server lock */
+  uint len;
+  char data[0];
+};
+
+struct metrics_client {
+  int fd;				/* -1 for unused slot */
+  uint rx_len;
+  uint tx_pos;				/* Sent bytes of header and body */
+  uint hdr_len;
+  btime deadline;			/* The client is dropped after that */
+  struct metrics_snapshot *snap;	/* Served snapshot, NULL if none */
+  char rx[METRICS_REQUEST_MAX];
+  char hdr[256];
+};
+
+struct metrics_server {
+  pthread_t thread;
+  pthread_mutex_t lock;			/* Protects @snap and snapshot use counts */
+  int listen_fd;
+  int wakeup_fds[2];
+  int stop;				/* Set by main thread to stop the server */
+  struct metrics_snapshot *snap;	/* The latest snapshot, NULL before the first one */
+  u32 requests;				/* Served requests, written by the server thread */
+  struct metrics_client clients[METRICS_MAX_CLIENTS];
+};
+
+struct metrics_proto {
+  struct proto p;
+  struct metrics_config *cf;		/* Shortcut to metrics configuration */
+  struct metrics_server *srv;		/* Running server, NULL if none */
+  timer *render_timer;			/* Periodic rendering, also retry of listen */
+  struct metrics_snapshot *render;	/* Snapshot being rendered */
+  uint render_size;			/* Allocated size of its data */
+  uint last_size;			/* Length of the last snapshot */
+  btime last_duration;			/* Time it took to render it */
+  u32 snapshots;			/* Snapshots rendered by this instance */
+};
+
+#endif
@@ -46,6 +46,81 @@ ospf_dbdes_hdrlen(struct ospf_proto *p)
 }
 
 
+/*
+ * Database summary of LSA headers is shared by all neighbors that start the
+ * database exchange while the LSA database is not changed. It is built by
+ * ospf_dbdes_get_summary() when a neighbor enters Exchange state and dropped
+ * from p->dbsum by ospf_dbdes_flush_summary() on any change of the database,
+ * neighbors keep using their copy until they send all headers from it. LSAs
+ * installed later are flooded to neighbors in Exchange state (RFC 2328 10.3).
+ * Filtering by flooding scope and aging is done when DBDES packets are built.
+ */
+
+struct ospf_dbdes_summary
+{
+  uint uc;			/* Use count, includes p->dbsum reference */
+  uint count;			/* Number of entries */
+  bird_clock_t created;		/* Time of build, for aging of headers */
+  struct ospf_dbdes_entry {
+    struct ospf_lsa_header hdr;	/* LSA header in network byte order */
+    u32 type;
+    u32 domain;
+  } e[];
+};
+
+static struct ospf_dbdes_summary *
+ospf_dbdes_build_summary(struct ospf_proto *p)
+{
+  struct ospf_dbdes_summary *s;
+  struct top_hash_entry *en;
+  uint count = 0;
+
+  WALK_SLIST(en, p->lsal)
+    if (en->lsa.age < LSA_MAXAGE)
+      count++;
+
+  s = mb_alloc(p->p.pool, sizeof(struct ospf_dbdes_summary) + count * sizeof(struct ospf_dbdes_entry));
+  s->uc = 1;
+  s->count = 0;
+  s->created = now;
+
+  WALK_SLIST(en, p->lsal)
+    if (en->lsa.age < LSA_MAXAGE)
+    {
+      struct ospf_dbdes_entry *e = &s->e[s->count++];
+      lsa_hton_hdr(&(en->lsa), &e->hdr);
+      e->type = en->lsa_type;
+      e->domain = en->domain;
+    }
+
+  return s;
+}
+
+struct ospf_dbdes_summary *
+ospf_dbdes_get_summary(struct ospf_proto *p)
+{
+  if (!p->dbsum)
+    p->dbsum = ospf_dbdes_build_summary(p);
+
+  p->dbsum->uc++;
+  return p->dbsum;
+}
+
+void
+ospf_dbdes_put_summary(struct ospf_dbdes_summary *s)
+{
+  if (s && !--s->uc)
+    mb_free(s);
+}
+
+void
+ospf_dbdes_flush_summary(struct ospf_proto *p)
+{
+  ospf_dbdes_put_summary(p->dbsum);
+  p->dbsum = NULL;
+}
+
+
 static void
 ospf_dbdes_body(struct ospf_proto *p, struct ospf_packet *pkt,
 		struct ospf_lsa_header **body, uint *count)
@@ -140,33 +215,34 @@ ospf_prepare_dbdes(struct ospf_proto *p, struct ospf_neighbor *n)
   /* Prepare DBDES body */
   if (!(n->myimms & DBDES_I) && (n->myimms & DBDES_M))
   {
+    struct ospf_dbdes_summary *s = n->dbsum;
     struct ospf_lsa_header *lsas;
-    struct top_hash_entry *en;
-    uint i = 0, lsa_max;
+    uint i = 0, lsa_max, age;
 
     ospf_dbdes_body(p, pkt, &lsas, &lsa_max);
-    en = (void *) s_get(&(n->dbsi));
 
     while (i < lsa_max)
     {
-      if (!SNODE_VALID(en))
+      if (!s || (n->dbsum_pos >= s->count))
       {
 	n->myimms &= ~DBDES_M;	/* Unset More bit */
+	ospf_dbdes_put_summary(s);
+	n->dbsum = NULL;
 	break;
       }
 
-      if ((en->lsa.age < LSA_MAXAGE) &&
-	  lsa_flooding_allowed(en->lsa_type, en->domain, ifa))
+      struct ospf_dbdes_entry *e = &s->e[n->dbsum_pos++];
+      age = ntohs(e->hdr.age) + (now - s->created);
+
+      if ((age < LSA_MAXAGE) &&
+	  lsa_flooding_allowed(e->type, e->domain, ifa))
       {
-	lsa_hton_hdr(&(en->lsa), lsas + i);
+	lsas[i] = e->hdr;
+	lsas[i].age = htons(age);
 	i++;
       }
-
-      en = SNODE_NEXT(en);
     }
 
-    s_put(&(n->dbsi), SNODE en);
-
     length += i * sizeof(struct ospf_lsa_header);
   }
 
@@ -45,25 +45,15 @@ struct ospf_hello3_packet
 };
 
 
-void
-ospf_send_hello(struct ospf_iface *ifa, int kind, struct ospf_neighbor *dirn)
+static void
+ospf_prepare_hello(struct ospf_iface *ifa, struct ospf_packet *pkt, int kind)
 {
   struct ospf_proto *p = ifa->oa->po;
-  struct ospf_packet *pkt;
-  struct ospf_neighbor *neigh, *n1;
-  struct nbma_node *nb;
+  struct ospf_neighbor *neigh;
   u32 *neighbors;
   uint length;
   int i, max;
 
-  if (ifa->state <= OSPF_IS_LOOP)
-    return;
-
-  if (ifa->stub)
-    return;
-
-
-  pkt = ospf_tx_buffer(ifa);
   ospf_pkt_fill_hdr(ifa, pkt, HELLO_P);
 
   if (ospf_is_v2(p))
@@ -76,7 +66,7 @@ ospf_send_hello(struct ospf_iface *ifa, int kind, struct ospf_neighbor *dirn)
     else
       ps->netmask = htonl(u32_mkmask(ifa->addr->pxlen));
 
-    ps->helloint = ntohs(ifa->helloint);
+    ps->helloint = htons(ospf_hello_int(ifa));
     ps->options = ifa->oa->options;
     ps->priority = ifa->priority;
     ps->deadint = htonl(ifa->deadint);
@@ -95,7 +85,7 @@ ospf_send_hello(struct ospf_iface *ifa, int kind, struct ospf_neighbor *dirn)
     ps->options3 = ifa->oa->options >> 16;
     ps->options2 = ifa->oa->options >> 8;
     ps->options = ifa->oa->options;
-    ps->helloint = ntohs(ifa->helloint);
+    ps->helloint = htons(ospf_hello_int(ifa));
     ps->deadint = htons(ifa->deadint);
     ps->dr = htonl(ifa->drid);
     ps->bdr = htonl(ifa->bdrid);
@@ -124,6 +114,22 @@ ospf_send_hello(struct ospf_iface *ifa, int kind, struct ospf_neighbor *dirn)
 
   length += i * sizeof(u32);
   pkt->length = htons(length);
+}
+
+void
+ospf_send_hello(struct ospf_iface *ifa, int kind, struct ospf_neighbor *dirn)
+{
+  struct ospf_proto *p = ifa->oa->po;
+  struct ospf_neighbor *n1;
+  struct nbma_node *nb;
+
+  if (ifa->state <= OSPF_IS_LOOP)
+    return;
+
+  if (ifa->stub)
+    return;
+
+  ospf_prepare_hello(ifa, ospf_tx_buffer(ifa), kind);
 
   OSPF_TRACE(D_PACKETS, "HELLO packet sent via %s", ifa->ifname);
 
@@ -249,7 +255,7 @@ ospf_receive_hello(struct ospf_packet *pkt, struct ospf_iface *ifa,
     neigh_count = (plen - sizeof(struct ospf_hello3_packet)) / sizeof(u32);
   }
 
-  if (rcv_helloint != ifa->helloint)
+  if (rcv_helloint != ospf_hello_int(ifa))
     DROP("hello interval mismatch", rcv_helloint);
 
   if (rcv_deadint != ifa->deadint)
@@ -390,3 +396,546 @@ drop:
   LOG_PKT("Bad HELLO packet from nbr %R on %s - %s (%u)",
 	  rcv_rid, ifa->ifname, err_dsc, err_val);
 }
+
+
+#ifdef CONFIG_BFD
+
+/*
+ *	Hello thread
+ */
+
+#include "proto/bfd/io.h"
+
+/*
+ * The hello thread offloads periodic transmission of hellos and inactivity
+ * checks of neighbors from the main loop, so adjacencies are kept when the main
+ * loop is busy (e.g. with a full BGP table) and sub-second hello intervals may
+ * be used. It is a birdloop (see proto/bfd/io.c) shared by all ifaces of the
+ * protocol with the hello thread option.
+ *
+ * The main thread still processes all received hellos and runs the neighbor
+ * and iface state machines. It also builds the hello packet, which is passed to
+ * the hello thread by ospf_hello_update() and repeated there by its own timer
+ * until replaced. That is done on the main hello timer (at most once a second),
+ * when the iface goes up or down and when the crypt sequence number changes.
+ *
+ * The hello thread also receives hellos by its own socket and restarts the
+ * inactivity timers of known neighbors. Expired neighbors are passed back to
+ * the main thread by a notification pipe, like in BFD. As the hello thread does
+ * not authenticate packets, the received hellos just keep existing neighbors
+ * alive, neighbors are always created by the main thread.
+ *
+ * All data of the hello thread are allocated from @hello_pool of the protocol
+ * and the main thread accesses them only between birdloop_enter() and
+ * birdloop_leave(). Timers of the hello thread are set by the main thread with
+ * precise_time(), which uses the same clock.
+ */
+
+struct ospf_hello_iface
+{
+  struct ospf_proto *p;
+  sock *sk;			/* Socket of the hello thread, TX buffer holds the packet */
+  timer2 *hello_timer;		/* Periodic hello TX */
+  list neigh_list;		/* Known neighbors (struct ospf_hello_neigh) */
+  btime hello_int;		/* Hello interval */
+  btime dead_int;		/* Inactivity interval of neighbors */
+  u32 areaid;
+  u8 instance_id;
+  u8 check_ttl;
+  uint plen;			/* Length of the packet, 0 for none */
+  ip_addr *dst;			/* Destinations of the packet */
+  uint dst_count, dst_size;
+  u32 tx_count;			/* Sent hellos */
+  u32 rx_count;			/* Received hellos of known neighbors */
+};
+
+struct ospf_hello_neigh
+{
+  node n;			/* Node in neigh_list */
+  node dn;			/* Node in hello_notify when dead */
+  struct ospf_hello_iface *hi;
+  struct ospf_neighbor *nbr;	/* Associated neighbor, only for the main thread */
+  timer2 *inactim;		/* Inactivity timer */
+  u32 rid;
+  ip_addr ip;
+  u8 dead;			/* Inactivity timer expired, reported to the main thread */
+};
+
+int pipe(int pipefd[2]);
+void pipe_drain(int fd);
+void pipe_kick(int fd);
+
+
+/* These are called in the hello thread */
+
+static void
+ospf_hello_tx_hook(timer2 *t)
+{
+  struct ospf_hello_iface *hi = t->data;
+  int done = 1;
+
+  tm2_start(t, hi->hello_int);
+
+  if (!hi->plen || !hi->dst_count)
+    return;
+
+  if (hi->dst_count == 1)
+    done = sk_send_to(hi->sk, hi->plen, hi->dst[0], 0);
+  else
+    done = sk_send_to_many(hi->sk, hi->plen, hi->dst, hi->dst_count, 0);
+
+  hi->tx_count++;
+
+  if (!done)
+    log(L_WARN "%s: Hello thread TX queue full on %s", hi->p->p.name, hi->sk->iface->name);
+}
+
+static int
+ospf_hello_rx_hook(sock *sk, int len)
+{
+  struct ospf_hello_iface *hi = sk->data;
+  struct ospf_hello_neigh *hn;
+
+  /* Like in ospf_rx_hook(), but we care just about hellos of known neighbors */
+  if (sk->lifindex != sk->iface->index)
+    return 1;
+
+  struct ospf_packet *pkt = (void *) sk_rx_buffer(sk, &len);
+
+  if (!pkt || (len < (int) sizeof(struct ospf_packet)))
+    return 1;
+
+  if (hi->check_ttl && (sk->rcv_ttl < 255))
+    return 1;
+
+  if ((pkt->version != ospf_get_version(hi->p)) || (pkt->type != HELLO_P))
+    return 1;
+
+  if ((ntohl(pkt->areaid) != hi->areaid) || (pkt->instance_id != hi->instance_id))
+    return 1;
+
+  if (ntohs(pkt->length) > len)
+    return 1;
+
+  u32 rid = ntohl(pkt->routerid);
+  WALK_LIST(hn, hi->neigh_list)
+    if ((hn->rid == rid) && ipa_equal(hn->ip, sk->faddr))
+    {
+      if (!hn->dead)
+	tm2_start(hn->inactim, hi->dead_int);
+
+      hi->rx_count++;
+      break;
+    }
+
+  return 1;
+}
+
+static void
+ospf_hello_err_hook(sock *sk, int err)
+{
+  struct ospf_hello_iface *hi = sk->data;
+  log(L_ERR "%s: Hello thread socket error on %s: %M", hi->p->p.name, sk->iface->name, err);
+}
+
+static void
+ospf_hello_inactim_hook(timer2 *t)
+{
+  struct ospf_hello_neigh *hn = t->data;
+  struct ospf_proto *p = hn->hi->p;
+
+  hn->dead = 1;
+  add_tail(&p->hello_notify, &hn->dn);
+  pipe_kick(p->hello_notify_ws->fd);
+}
+
+
+/* These are called in the main thread */
+
+static int
+ospf_hello_notify_hook(sock *sk, int len)
+{
+  struct ospf_proto *p = sk->data;
+  list tmp_list;
+
+  pipe_drain(sk->fd);
+
+  birdloop_enter(p->hello_loop);
+  init_list(&tmp_list);
+  add_tail_list(&tmp_list, &p->hello_notify);
+  init_list(&p->hello_notify);
+  birdloop_leave(p->hello_loop);
+
+  /* Each neighbor is removed from tmp_list by ospf_hello_neigh_remove() */
+  while (!EMPTY_LIST(tmp_list))
+  {
+    struct ospf_hello_neigh *hn = SKIP_BACK(struct ospf_hello_neigh, dn, HEAD(tmp_list));
+    struct ospf_neighbor *n = hn->nbr;
+
+    OSPF_TRACE(D_EVENTS, "Inactivity timer expired for nbr %R on %s (hello thread)",
+	       n->rid, n->ifa->ifname);
+    ospf_neigh_sm(n, INM_INACTTIM);
+  }
+
+  return 0;
+}
+
+static void
+ospf_hello_noterr_hook(sock *sk, int err)
+{
+  struct ospf_proto *p = sk->data;
+  log(L_ERR "%s: Hello thread notify socket error: %m", p->p.name, err);
+}
+
+static void
+ospf_hello_init(struct ospf_proto *p)
+{
+  int pfds[2];
+  sock *sk;
+
+  int rv = pipe(pfds);
+  if (rv < 0)
+    die("pipe: %m");
+
+  sk = sk_new(p->p.pool);
+  sk->type = SK_MAGIC;
+  sk->rx_hook = ospf_hello_notify_hook;
+  sk->err_hook = ospf_hello_noterr_hook;
+  sk->fd = pfds[0];
+  sk->data = p;
+  if (sk_open(sk) < 0)
+    die("ospf: sk_open failed");
+  p->hello_notify_rs = sk;
+
+  /* The write sock is not added to any event loop */
+  sk = sk_new(p->p.pool);
+  sk->type = SK_MAGIC;
+  sk->fd = pfds[1];
+  sk->data = p;
+  sk->flags = SKF_THREAD;
+  if (sk_open(sk) < 0)
+    die("ospf: sk_open failed");
+  p->hello_notify_ws = sk;
+
+  init_list(&p->hello_notify);
+  p->hello_pool = rp_new(NULL, "OSPF hello thread root");
+  p->hello_loop = birdloop_new(THREAD_OSPF);
+  birdloop_start(p->hello_loop);
+
+  OSPF_TRACE(D_EVENTS, "Hello thread started");
+}
+
+/**
+ * ospf_hello_start - move hellos of an iface to the hello thread
+ * @ifa: OSPF iface
+ *
+ * The function is called for ifaces with the hello thread option when their
+ * socket is opened. The hello thread is started with the first such iface. If
+ * the hello thread socket cannot be opened, hellos stay in the main thread.
+ */
+void
+ospf_hello_start(struct ospf_iface *ifa)
+{
+  struct ospf_proto *p = ifa->oa->po;
+  struct ospf_hello_iface *hi;
+
+  if (!p->hello_loop)
+    ospf_hello_init(p);
+
+  birdloop_enter(p->hello_loop);
+
+  hi = mb_allocz(p->hello_pool, sizeof(struct ospf_hello_iface));
+  hi->p = p;
+  init_list(&hi->neigh_list);
+  hi->areaid = ifa->oa->areaid;
+  hi->instance_id = ifa->instance_id;
+  hi->check_ttl = ifa->check_ttl;
+  hi->hello_timer = tm2_new_init(p->hello_pool, ospf_hello_tx_hook, hi, 0, 0);
+
+  hi->sk = ospf_sk_new(ifa, p->hello_pool, SKF_THREAD);
+  if (hi->sk)
+  {
+    hi->sk->rx_hook = ospf_hello_rx_hook;
+    hi->sk->err_hook = ospf_hello_err_hook;
+    hi->sk->data = hi;
+    sk_start(hi->sk);
+  }
+  else
+  {
+    rfree(hi->hello_timer);
+    mb_free(hi);
+    hi = NULL;
+  }
+
+  birdloop_leave(p->hello_loop);
+
+  if (!hi)
+  {
+    log(L_ERR "%s: Cannot open hello thread socket for %s", p->p.name, ifa->ifname);
+    return;
+  }
+
+  ifa->hello = hi;
+}
+
+/**
+ * ospf_hello_stop - return hellos of an iface to the main thread
+ * @ifa: OSPF iface
+ *
+ * The function is called before the iface is removed.
+ */
+void
+ospf_hello_stop(struct ospf_iface *ifa)
+{
+  struct ospf_proto *p = ifa->oa->po;
+  struct ospf_hello_iface *hi = ifa->hello;
+  struct ospf_neighbor *n;
+
+  WALK_LIST(n, ifa->neigh_list)
+    if (n->hello)
+      ospf_hello_neigh_remove(n);
+
+  birdloop_enter(p->hello_loop);
+
+  rfree(hi->hello_timer);
+  sk_stop(hi->sk);
+  rfree(hi->sk);
+  mb_free(hi->dst);
+  mb_free(hi);
+
+  birdloop_leave(p->hello_loop);
+
+  ifa->hello = NULL;
+}
+
+/* Destinations of periodic hellos, see ospf_send_hello() */
+static void
+ospf_hello_fill_dst(struct ospf_iface *ifa, struct ospf_hello_iface *hi)
+{
+  struct ospf_proto *p = ifa->oa->po;
+  struct ospf_neighbor *n;
+  struct nbma_node *nb;
+  uint max = 1;
+
+  WALK_LIST(n, ifa->neigh_list)
+    max++;
+
+  WALK_LIST(nb, ifa->nbma_list)
+    max++;
+
+  if (max > hi->dst_size)
+  {
+    hi->dst_size = MAX(max, 2 * hi->dst_size);
+    mb_free(hi->dst);
+    hi->dst = mb_alloc(p->hello_pool, hi->dst_size * sizeof(ip_addr));
+  }
+
+  ip_addr *dst = hi->dst;
+  uint i = 0;
+
+  switch (ifa->type)
+  {
+  case OSPF_IT_BCAST:
+  case OSPF_IT_PTP:
+    dst[i++] = ifa->all_routers;
+    break;
+
+  case OSPF_IT_NBMA:
+    {
+      int to_all = ifa->state > OSPF_IS_DROTHER;
+      int me_elig = ifa->priority > 0;
+
+      WALK_LIST(n, ifa->neigh_list)
+	if (to_all || (me_elig && (n->priority > 0)) ||
+	    (n->rid == ifa->drid) || (n->rid == ifa->bdrid))
+	  dst[i++] = n->ip;
+    }
+    break;
+
+  case OSPF_IT_PTMP:
+    WALK_LIST(n, ifa->neigh_list)
+      dst[i++] = n->ip;
+
+    WALK_LIST(nb, ifa->nbma_list)
+      if (!nb->found)
+	dst[i++] = nb->ip;
+
+    if (ipa_nonzero(ifa->addr->opposite) && !ifa->strictnbma && !i)
+      dst[i++] = ifa->addr->opposite;
+    break;
+
+  default:
+    bug("Bug in ospf_hello_fill_dst()");
+  }
+
+  hi->dst_count = i;
+}
+
+/**
+ * ospf_hello_update - update hellos sent by the hello thread
+ * @ifa: OSPF iface
+ *
+ * The function builds the current hello packet of the iface and passes it to
+ * the hello thread together with its destinations and timer values. When the
+ * iface is down, the hello thread stops sending hellos.
+ */
+void
+ospf_hello_update(struct ospf_iface *ifa)
+{
+  struct ospf_proto *p = ifa->oa->po;
+  struct ospf_hello_iface *hi = ifa->hello;
+
+  birdloop_enter(p->hello_loop);
+
+  btime hello_int = ifa->cf->hello_us ?: ((btime) ifa->helloint S);
+  int restart = (hello_int != hi->hello_int);
+
+  hi->hello_int = hello_int;
+  hi->dead_int = ifa->cf->dead_us ?: ((btime) ifa->deadint S);
+
+  if (ifa->state > OSPF_IS_LOOP)
+  {
+    if (hi->sk->tbsize < ifa->tx_length)
+      sk_set_tbsize(hi->sk, ifa->tx_length);
+
+    struct ospf_packet *pkt = (void *) hi->sk->tbuf;
+    ospf_prepare_hello(ifa, pkt, OHS_HELLO);
+    hi->plen = ospf_pkt_finalize_len(ifa, pkt);
+    ospf_hello_fill_dst(ifa, hi);
+
+    if (restart || !tm2_active(hi->hello_timer))
+      tm2_set(hi->hello_timer, precise_time() + hi->hello_int);
+  }
+  else
+  {
+    hi->plen = 0;
+    tm2_stop(hi->hello_timer);
+  }
+
+  birdloop_leave(p->hello_loop);
+}
+
+/**
+ * ospf_hello_shutdown - stop the hello thread
+ * @p: OSPF instance
+ *
+ * All data of the hello thread are freed and hellos of all ifaces return to the
+ * main thread.
+ */
+void
+ospf_hello_shutdown(struct ospf_proto *p)
+{
+  struct ospf_iface *ifa;
+  struct ospf_neighbor *n;
+
+  if (!p->hello_loop)
+    return;
+
+  birdloop_stop(p->hello_loop);
+
+  WALK_LIST(ifa, p->iface_list)
+  {
+    WALK_LIST(n, ifa->neigh_list)
+      n->hello = NULL;
+
+    ifa->hello = NULL;
+  }
+
+  birdloop_enter(p->hello_loop);
+  rfree(p->hello_pool);
+  birdloop_leave(p->hello_loop);
+
+  birdloop_free(p->hello_loop);
+  p->hello_loop = NULL;
+  p->hello_pool = NULL;
+}
+
+/**
+ * ospf_hello_neigh_alive - restart inactivity timer in the hello thread
+ * @n: OSPF neighbor
+ *
+ * The function is called when the main thread receives a hello from the
+ * neighbor. The neighbor is added to the hello thread when it is new, its
+ * Router ID and IP address are updated.
+ */
+void
+ospf_hello_neigh_alive(struct ospf_neighbor *n)
+{
+  struct ospf_iface *ifa = n->ifa;
+  struct ospf_proto *p = ifa->oa->po;
+  struct ospf_hello_iface *hi = ifa->hello;
+  struct ospf_hello_neigh *hn = n->hello;
+
+  birdloop_enter(p->hello_loop);
+
+  if (!hn)
+  {
+    hn = mb_allocz(p->hello_pool, sizeof(struct ospf_hello_neigh));
+    hn->hi = hi;
+    hn->nbr = n;
+    hn->inactim = tm2_new_init(p->hello_pool, ospf_hello_inactim_hook, hn, 0, 0);
+    add_tail(&hi->neigh_list, &hn->n);
+    n->hello = hn;
+  }
+
+  hn->rid = n->rid;
+  hn->ip = n->ip;
+
+  if (!hn->dead)
+    tm2_set(hn->inactim, precise_time() + hi->dead_int);
+
+  birdloop_leave(p->hello_loop);
+}
+
+void
+ospf_hello_neigh_remove(struct ospf_neighbor *n)
+{
+  struct ospf_proto *p = n->ifa->oa->po;
+  struct ospf_hello_neigh *hn = n->hello;
+
+  birdloop_enter(p->hello_loop);
+
+  rem_node(&hn->n);
+  if (hn->dead)
+    rem_node(&hn->dn);
+
+  rfree(hn->inactim);
+  mb_free(hn);
+
+  birdloop_leave(p->hello_loop);
+
+  n->hello = NULL;
+}
+
+/* Seconds to expiration of the inactivity timer, for show ospf neighbors */
+int
+ospf_hello_neigh_expires(struct ospf_neighbor *n)
+{
+  struct ospf_proto *p = n->ifa->oa->po;
+  btime exp = 0;
+
+  birdloop_enter(p->hello_loop);
+
+  if (tm2_active(n->hello->inactim))
+    exp = n->hello->inactim->expires - precise_time();
+
+  birdloop_leave(p->hello_loop);
+
+  return (exp > 0) ? (int) (exp TO_S) : 0;
+}
+
+void
+ospf_hello_info(struct ospf_iface *ifa)
+{
+  struct ospf_proto *p = ifa->oa->po;
+  u32 tx, rx;
+
+  birdloop_enter(p->hello_loop);
+  tx = ifa->hello->tx_count;
+  rx = ifa->hello->rx_count;
+  birdloop_leave(p->hello_loop);
+
+  cli_msg(-1015, "\tHello thread: %u sent, %u received", tx, rx);
+}
+
+#endif
@@ -32,7 +32,13 @@ poll_timer_hook(timer * timer)
 static void
 hello_timer_hook(timer * timer)
 {
-  ospf_send_hello(timer->data, OHS_HELLO, NULL);
+  struct ospf_iface *ifa = (struct ospf_iface *) timer->data;
+
+  /* With the hello thread, we just refresh the packet it sends */
+  if (ifa->hello)
+    ospf_hello_update(ifa);
+  else
+    ospf_send_hello(ifa, OHS_HELLO, NULL);
 }
 
 static void
@@ -58,6 +64,12 @@ ifa_bufsize(struct ospf_iface *ifa)
   return MAX(bsize, ifa->tx_length);
 }
 
+static inline btime
+ifa_ack_delay(struct ospf_iface *ifa)
+{
+  return ifa->cf->ack_delay ?: ((btime) ifa->rxmtint S) / 2;
+}
+
 static inline uint
 ifa_flood_queue_size(struct ospf_iface *ifa)
 {
@@ -70,8 +82,7 @@ ospf_iface_assure_bufsize(struct ospf_iface *ifa, uint plen)
   plen += SIZE_OF_IP_HEADER;
 
   /* This is relevant just for OSPFv2 */
-  if (ifa->autype == OSPF_AUTH_CRYPT)
-    plen += OSPF_AUTH_CRYPT_SIZE;
+  plen += ospf_auth_size(ifa);
 
   if (plen <= ifa->sk->tbsize)
     return 0;
@@ -99,12 +110,22 @@ find_nbma_node_(list *nnl, ip_addr ip)
 }
 
 
-static int
-ospf_sk_open(struct ospf_iface *ifa)
+/**
+ * ospf_sk_new - open and set up a socket for an OSPF iface
+ * @ifa: OSPF iface
+ * @pool: resource pool for the socket
+ * @flags: additional socket flags (e.g. %SKF_THREAD)
+ *
+ * The function returns the socket joined to the AllSPFRouters group on
+ * multicast networks, or NULL on error. Besides the iface socket, it is used
+ * for sockets of the hello thread.
+ */
+sock *
+ospf_sk_new(struct ospf_iface *ifa, pool *pool, uint flags)
 {
   struct ospf_proto *p = ifa->oa->po;
 
-  sock *sk = sk_new(ifa->pool);
+  sock *sk = sk_new(pool);
   sk->type = SK_IP;
   sk->dport = OSPF_PROTO;
   sk->saddr = ifa->addr->ip;
@@ -113,11 +134,12 @@ ospf_sk_open(struct ospf_iface *ifa)
   sk->tos = ifa->cf->tx_tos;
   sk->priority = ifa->cf->tx_priority;
   sk->rx_hook = ospf_rx_hook;
+  sk->rx_batch = 8;
   // sk->tx_hook = ospf_tx_hook;
   sk->err_hook = ospf_err_hook;
   sk->rbsize = sk->tbsize = ifa_bufsize(ifa);
   sk->data = (void *) ifa;
-  sk->flags = SKF_LADDR_RX | (ifa->check_ttl ? SKF_TTL_RX : 0);
+  sk->flags = flags | SKF_LADDR_RX | (ifa->check_ttl ? SKF_TTL_RX : 0);
   sk->ttl = ifa->cf->ttl_security ? 255 : 1;
 
   if (sk_open(sk) < 0)
@@ -151,14 +173,24 @@ ospf_sk_open(struct ospf_iface *ifa)
     }
   }
 
-  ifa->sk = sk;
-  ifa->sk_dr = 0;
-  return 1;
+  return sk;
 
  err:
   sk_log_error(sk, p->p.name);
   rfree(sk);
-  return 0;
+  return NULL;
+}
+
+static int
+ospf_sk_open(struct ospf_iface *ifa)
+{
+  sock *sk = ospf_sk_new(ifa, ifa->pool, 0);
+  if (!sk)
+    return 0;
+
+  ifa->sk = sk;
+  ifa->sk_dr = 0;
+  return 1;
 }
 
 static inline void
@@ -249,6 +281,9 @@ ospf_iface_down(struct ospf_iface *ifa)
   WALK_LIST_DELSAFE(n, nx, ifa->neigh_list)
     ospf_neigh_sm(n, INM_KILLNBR);
 
+  if (ifa->hello)
+    ospf_hello_update(ifa);
+
   if (ifa->hello_timer)
     tm_stop(ifa->hello_timer);
 
@@ -258,6 +293,8 @@ ospf_iface_down(struct ospf_iface *ifa)
   if (ifa->wait_timer)
     tm_stop(ifa->wait_timer);
 
+  ospf_reset_iface_lsack_queue(ifa);
+
   ospf_flush2_lsa(p, &ifa->link_lsa);
   ospf_flush2_lsa(p, &ifa->net_lsa);
   ospf_flush2_lsa(p, &ifa->pxn_lsa);
@@ -292,6 +329,10 @@ ospf_iface_remove(struct ospf_iface *ifa)
       ifa->flood_queue[i]->ret_count--;
 
   ospf_iface_sm(ifa, ISM_DOWN);
+
+  if (ifa->hello)
+    ospf_hello_stop(ifa);
+
   rem_node(NODE ifa);
   rfree(ifa->pool);
 }
@@ -394,6 +435,9 @@ ospf_iface_sm(struct ospf_iface *ifa, int event)
 	tm_start(ifa->poll_timer, ifa->pollint);
 
       ospf_send_hello(ifa, OHS_HELLO, NULL);
+
+      if (ifa->hello)
+	ospf_hello_update(ifa);
     }
     break;
 
@@ -487,10 +531,16 @@ ospf_iface_add(struct object_lock *lock)
       ifa->poll_timer = tm_new_set(ifa->pool, poll_timer_hook, ifa, 0, ifa->pollint);
 
     if ((ifa->type == OSPF_IT_BCAST) || (ifa->type == OSPF_IT_NBMA))
+    {
       ifa->wait_timer = tm_new_set(ifa->pool, wait_timer_hook, ifa, 0, 0);
+      ifa->ack_timer = ptm_new_set(ifa->pool, ospf_iface_ack_timer_hook, ifa);
+    }
 
     ifa->flood_queue_size = ifa_flood_queue_size(ifa);
     ifa->flood_queue = mb_allocz(ifa->pool, ifa->flood_queue_size * sizeof(void *));
+
+    if (ifa->cf->hello_thread)
+      ospf_hello_start(ifa);
   }
 
   /* Do iface UP, unless there is no link and we use link detection */
@@ -571,6 +621,7 @@ ospf_iface_new(struct ospf_area *oa, struct ifa *addr, struct ospf_iface_patt *i
   ifa->stub = ospf_iface_stubby(ip, addr);
   ifa->ioprob = OSPF_I_OK;
   ifa->tx_length = ifa_tx_length(ifa);
+  ifa->ack_delay = ifa_ack_delay(ifa);
   ifa->check_link = ip->check_link;
   ifa->ecmp_weight = ip->ecmp_weight;
   ifa->check_ttl = (ip->ttl_security == 1);
@@ -612,6 +663,7 @@ ospf_iface_new(struct ospf_area *oa, struct ifa *addr, struct ospf_iface_patt *i
 
   ifa->state = OSPF_IS_DOWN;
   init_list(&ifa->neigh_list);
+  init_list(&ifa->ackl);
   init_list(&ifa->nbma_list);
 
   struct nbma_node *nb;
@@ -689,6 +741,7 @@ ospf_iface_new_vlink(struct ospf_proto *p, struct ospf_iface_patt *ip)
 
   ifa->state = OSPF_IS_DOWN;
   init_list(&ifa->neigh_list);
+  init_list(&ifa->ackl);
   init_list(&ifa->nbma_list);
 
   add_tail(&p->iface_list, NODE ifa);
@@ -750,6 +803,12 @@ ospf_iface_reconfigure(struct ospf_iface *ifa, struct ospf_iface_patt *new)
       (new->ttl_security != old->ttl_security))
     return 0;
 
+  /* Change of the hello thread or sub-second hellos requires iface restart */
+  if ((new->hello_thread != old->hello_thread) ||
+      (new->hello_us != old->hello_us) ||
+      (new->dead_us != old->dead_us))
+    return 0;
+
   ifa->cf = new;
   ifa->marked = 0;
 
@@ -774,6 +833,16 @@ ospf_iface_reconfigure(struct ospf_iface *ifa, struct ospf_iface_patt *new)
     /* FIXME: Update neighbors' timers */
   }
 
+  /* ACK DELAY */
+  btime ack_delay = ifa_ack_delay(ifa);
+  if (ifa->ack_delay != ack_delay)
+  {
+    OSPF_TRACE(D_EVENTS, "Changing ack delay of %s from %u ms to %u ms",
+	       ifname, (uint) (ifa->ack_delay TO_MS), (uint) (ack_delay TO_MS));
+
+    ifa->ack_delay = ack_delay;
+  }
+
   /* POLL TIMER */
   if (ifa->pollint != new->pollint)
   {
@@ -1333,7 +1402,10 @@ ospf_iface_info(struct ospf_iface *ifa)
   cli_msg(-1015, "\tCost: %u", ifa->cost);
   if (ifa->oa->po->ecmp)
     cli_msg(-1015, "\tECMP weight: %d", ((int) ifa->ecmp_weight) + 1);
-  cli_msg(-1015, "\tHello timer: %u", ifa->helloint);
+  if (ifa->cf->hello_us)
+    cli_msg(-1015, "\tHello timer: %u ms", ifa->cf->hello_us TO_MS);
+  else
+    cli_msg(-1015, "\tHello timer: %u", ifa->helloint);
 
   if (ifa->type == OSPF_IT_NBMA)
   {
@@ -1342,6 +1414,11 @@ ospf_iface_info(struct ospf_iface *ifa)
   cli_msg(-1015, "\tWait timer: %u", ifa->waitint);
   cli_msg(-1015, "\tDead timer: %u", ifa->deadint);
   cli_msg(-1015, "\tRetransmit timer: %u", ifa->rxmtint);
+  if (ifa->ack_timer)
+    cli_msg(-1015, "\tAck delay: %u ms", (uint) (ifa->ack_delay TO_MS));
+  cli_msg(-1015, "\tAcks sent: %u in %u packets", ifa->ack_sent, ifa->ack_pkts);
+  if (ifa->hello)
+    ospf_hello_info(ifa);
   if ((ifa->type == OSPF_IT_BCAST) || (ifa->type == OSPF_IT_NBMA))
   {
     cli_msg(-1015, "\tDesignated router (ID): %R", ifa->drid);
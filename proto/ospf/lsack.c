@@ -54,34 +54,69 @@ ospf_dump_lsack(struct ospf_proto *p, struct ospf_packet *pkt)
 }
 
 
+/*
+ * Delayed acks on broadcast and NBMA networks are sent to all adjacent
+ * neighbors regardless of which neighbor the acked LSA came from (RFC 2328
+ * 13.5), therefore they are not kept per neighbor but aggregated in one queue
+ * of the iface. The queue is flushed after the ack delay from the first queued
+ * ack, in as few LSACK packets as the TX length allows.
+ */
+
 void
 ospf_enqueue_lsack(struct ospf_neighbor *n, struct ospf_lsa_header *h_n, int queue)
 {
+  struct ospf_iface *ifa = n->ifa;
+  int aggr = (queue == ACKL_DELAY) && ifa->ack_timer;
+
   /* Note that h_n is in network endianity */
-  struct lsa_node *no = mb_alloc(n->pool, sizeof(struct lsa_node));
+  struct lsa_node *no = mb_alloc(aggr ? ifa->pool : n->pool, sizeof(struct lsa_node));
   memcpy(&no->lsa, h_n, sizeof(struct ospf_lsa_header));
-  add_tail(&n->ackl[queue], NODE no);
   DBG("Adding %s ack for %R, ID: %R, RT: %R, Type: %u\n",
       (queue == ACKL_DIRECT) ? "direct" : "delayed",
       n->rid, ntohl(h_n->id), ntohl(h_n->rt), h_n->type);
+
+  if (!aggr)
+  {
+    add_tail(&n->ackl[queue], NODE no);
+    return;
+  }
+
+  add_tail(&ifa->ackl, NODE no);
+
+  if (!ptm_active(ifa->ack_timer))
+    ptm_start(ifa->ack_timer, ifa->ack_delay);
 }
 
-void
-ospf_reset_lsack_queue(struct ospf_neighbor *n)
+static void
+ospf_free_lsack_list(list *l)
 {
   struct lsa_node *no;
 
-  WALK_LIST_FIRST(no, n->ackl[ACKL_DELAY])
+  WALK_LIST_FIRST(no, *l)
   {
     rem_node(NODE no);
     mb_free(no);
   }
 }
 
+void
+ospf_reset_lsack_queue(struct ospf_neighbor *n)
+{
+  ospf_free_lsack_list(&n->ackl[ACKL_DELAY]);
+}
+
+void
+ospf_reset_iface_lsack_queue(struct ospf_iface *ifa)
+{
+  if (ifa->ack_timer)
+    ptm_stop(ifa->ack_timer);
+
+  ospf_free_lsack_list(&ifa->ackl);
+}
+
 static inline void
-ospf_send_lsack_(struct ospf_proto *p, struct ospf_neighbor *n, int queue)
+ospf_send_lsack_(struct ospf_proto *p, struct ospf_iface *ifa, list *queue)
 {
-  struct ospf_iface *ifa = n->ifa;
   struct ospf_lsa_header *lsas;
   struct ospf_packet *pkt;
   struct lsa_node *no;
@@ -93,9 +128,9 @@ ospf_send_lsack_(struct ospf_proto *p, struct ospf_neighbor *n, int queue)
   ospf_pkt_fill_hdr(ifa, pkt, LSACK_P);
   ospf_lsack_body(p, pkt, &lsas, &lsa_max);
 
-  for (i = 0; i < lsa_max && !EMPTY_LIST(n->ackl[queue]); i++)
+  for (i = 0; i < lsa_max && !EMPTY_LIST(*queue); i++)
   {
-    no = (struct lsa_node *) HEAD(n->ackl[queue]);
+    no = (struct lsa_node *) HEAD(*queue);
     memcpy(&lsas[i], &no->lsa, sizeof(struct ospf_lsa_header));
     DBG("Iter %u ID: %R, RT: %R, Type: %04x\n",
 	i, ntohl(lsas[i].id), ntohl(lsas[i].rt), lsas[i].type);
@@ -106,6 +141,9 @@ ospf_send_lsack_(struct ospf_proto *p, struct ospf_neighbor *n, int queue)
   length = ospf_pkt_hdrlen(p) + i * sizeof(struct ospf_lsa_header);
   pkt->length = htons(length);
 
+  ifa->ack_sent += i;
+  ifa->ack_pkts++;
+
   OSPF_PACKET(ospf_dump_lsack, pkt, "LSACK packet sent via %s", ifa->ifname);
 
   if (ifa->type == OSPF_IT_BCAST)
@@ -123,7 +161,17 @@ void
 ospf_send_lsack(struct ospf_proto *p, struct ospf_neighbor *n, int queue)
 {
   while (!EMPTY_LIST(n->ackl[queue]))
-    ospf_send_lsack_(p, n, queue);
+    ospf_send_lsack_(p, n->ifa, &n->ackl[queue]);
+}
+
+void
+ospf_iface_ack_timer_hook(ptimer *t)
+{
+  struct ospf_iface *ifa = t->data;
+  struct ospf_proto *p = ifa->oa->po;
+
+  while (!EMPTY_LIST(ifa->ackl))
+    ospf_send_lsack_(p, ifa, &ifa->ackl);
 }
 
 void
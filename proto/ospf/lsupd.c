@@ -122,19 +122,43 @@ ospf_lsa_lsrq_down(struct top_hash_entry *req, struct ospf_neighbor *n, struct o
   }
 }
 
+/*
+ * The retransmission list is kept in the order of the last transmission of
+ * its entries (stored in ret->inst_time), which is also the order of their
+ * retransmission deadlines, as rxmtint is the same for all of them. Entries
+ * are moved to the tail whenever they are (re)transmitted, therefore
+ * ospf_rxmt_lsupd() just takes the due entries from the head, and the
+ * acknowledgement is a hash lookup and a removal from the slist.
+ */
+static void
+ospf_lsrt_schedule(struct ospf_neighbor *n)
+{
+  struct top_hash_entry *ret = SHEAD(n->lsrtl);
+
+  if (EMPTY_SLIST(n->lsrtl))
+  {
+    tm_stop(n->lsrt_timer);
+    return;
+  }
+
+  bird_clock_t due = ret->inst_time + n->ifa->rxmtint;
+  tm_start(n->lsrt_timer, (due > now) ? (due - now) : 0);
+}
+
 static inline void
 ospf_lsa_lsrt_up(struct top_hash_entry *en, struct ospf_neighbor *n)
 {
   struct top_hash_entry *ret = ospf_hash_get_entry(n->lsrth, en);
 
-  if (!SNODE_VALID(ret))
-  {
+  if (SNODE_VALID(ret))
+    s_rem_node(SNODE ret);
+  else
     en->ret_count++;
-    s_add_tail(&n->lsrtl, SNODE ret);
-  }
 
   ret->lsa = en->lsa;
   ret->lsa_body = LSA_BODY_DUMMY;
+  ret->inst_time = now;
+  s_add_tail(&n->lsrtl, SNODE ret);
 
   if (!tm_active(n->lsrt_timer))
     tm_start(n->lsrt_timer, n->ifa->rxmtint);
@@ -167,16 +191,18 @@ ospf_lsa_lsrt_down(struct top_hash_entry *en, struct ospf_neighbor *n)
 void
 ospf_add_flushed_to_lsrt(struct ospf_proto *p, struct ospf_neighbor *n)
 {
-  struct top_hash_entry *en;
+  struct top_hash_entry *en, *ret;
 
   WALK_SLIST(en, p->lsal)
     if ((en->lsa.age == LSA_MAXAGE) && (en->lsa_body != NULL) &&
 	lsa_flooding_allowed(en->lsa_type, en->domain, n->ifa))
       ospf_lsa_lsrt_up(en, n);
 
-  /* If we found any flushed LSA, we send them ASAP */
-  if (tm_active(n->lsrt_timer))
-    tm_start(n->lsrt_timer, 0);
+  /* If we found any flushed LSA, we send them ASAP (the list was empty before) */
+  WALK_SLIST(ret, n->lsrtl)
+    ret->inst_time = now - n->ifa->rxmtint;
+
+  ospf_lsrt_schedule(n);
 }
 
 static int ospf_flood_lsupd(struct ospf_proto *p, struct top_hash_entry **lsa_list, uint lsa_count, uint lsa_min_count, struct ospf_iface *ifa);
@@ -431,16 +457,20 @@ ospf_rxmt_lsupd(struct ospf_proto *p, struct ospf_neighbor *n)
 {
   uint max = 2 * n->ifa->flood_queue_size;
   struct top_hash_entry *entries[max];
-  struct top_hash_entry *ret, *nxt, *en;
+  struct top_hash_entry *ret, *en;
   uint i = 0;
 
   /* ASSERT((n->state >= NEIGHBOR_EXCHANGE) && !EMPTY_SLIST(n->lsrtl)); */
 
-  WALK_SLIST_DELSAFE(ret, nxt, n->lsrtl)
+  /* Entries moved to the tail are not due, so we stop when we reach them */
+  while (!EMPTY_SLIST(n->lsrtl) && (i < max))
   {
-    if (i == max)
+    ret = SHEAD(n->lsrtl);
+    if (ret->inst_time + n->ifa->rxmtint > now)
       break;
 
+    s_rem_node(SNODE ret);
+
     en = ospf_hash_find_entry(p->gr, ret);
     if (!en)
     {
@@ -448,17 +478,21 @@ ospf_rxmt_lsupd(struct ospf_proto *p, struct ospf_neighbor *n)
       log(L_WARN "%s: LSA disappeared (Type: %04x, Id: %R, Rt: %R)",
 	  p->p.name, ret->lsa_type, ret->lsa.id, ret->lsa.rt);
 
-      s_rem_node(SNODE ret);
       ospf_hash_delete(n->lsrth, ret);
-
       continue;
     }
 
+    ret->inst_time = now;
+    s_add_tail(&n->lsrtl, SNODE ret);
+
     entries[i] = en;
     i++;
   }
 
-  ospf_send_lsupd(p, entries, i, n);
+  if (i)
+    ospf_send_lsupd(p, entries, i, n);
+
+  ospf_lsrt_schedule(n);
 }
 
 
@@ -473,6 +507,20 @@ ospf_addr_is_local(struct ospf_proto *p, struct ospf_area *oa, ip_addr ip)
   return 0;
 }
 
+/*
+ * MinLSArrival check of a new instance of LSA @en. Under LSA throttling,
+ * neighbors may originate LSAs faster than the fixed %MINLSARRIVAL, so we
+ * accept instances arriving after a half of the minimal lsa_hold interval.
+ */
+static inline int
+ospf_lsa_arrived_early(struct ospf_proto *p, struct top_hash_entry *en)
+{
+  if (!p->lsa_hold)
+    return (now - en->inst_time) < MINLSARRIVAL;
+
+  return (precise_time() - en->inst_ptime) < (p->lsa_hold / 2);
+}
+
 void
 ospf_receive_lsupd(struct ospf_packet *pkt, struct ospf_iface *ifa,
 		   struct ospf_neighbor *n)
@@ -572,7 +620,7 @@ ospf_receive_lsupd(struct ospf_packet *pkt, struct ospf_iface *ifa,
     {
       /* 13. (5a) - enforce minimum time between updates for received LSAs */
       /* We also use this to ratelimit reactions to received self-originated LSAs */
-      if (en && ((now - en->inst_time) < MINLSARRIVAL))
+      if (en && ospf_lsa_arrived_early(p, en))
       {
 	OSPF_TRACE(D_EVENTS, "Skipping LSA received in less that MinLSArrival");
 	continue;
@@ -89,7 +89,6 @@ ospf_neighbor_new(struct ospf_iface *ifa)
   n->state = NEIGHBOR_DOWN;
 
   init_lists(p, n);
-  s_init(&(n->dbsi), &(p->lsal));
 
   init_list(&n->ackl[ACKL_DIRECT]);
   init_list(&n->ackl[ACKL_DELAY]);
@@ -97,7 +96,7 @@ ospf_neighbor_new(struct ospf_iface *ifa)
   n->inactim = tm_new_set(pool, inactivity_timer_hook, n, 0, 0);
   n->dbdes_timer = tm_new_set(pool, dbdes_timer_hook, n, 0, ifa->rxmtint);
   n->lsrq_timer = tm_new_set(pool, lsrq_timer_hook, n, 0, ifa->rxmtint);
-  n->lsrt_timer = tm_new_set(pool, lsrt_timer_hook, n, 0, ifa->rxmtint);
+  n->lsrt_timer = tm_new_set(pool, lsrt_timer_hook, n, 0, 0);
   n->ackd_timer = tm_new_set(pool, ackd_timer_hook, n, 0, ifa->rxmtint / 2);
 
   return (n);
@@ -116,7 +115,10 @@ ospf_neigh_down(struct ospf_neighbor *n)
       nn->found = 0;
   }
 
-  s_get(&(n->dbsi));
+  if (n->hello)
+    ospf_hello_neigh_remove(n);
+
+  ospf_dbdes_put_summary(n->dbsum);
   release_lsrtl(p, n);
   rem_node(NODE n);
   rfree(n->pool);
@@ -185,7 +187,10 @@ ospf_neigh_chstate(struct ospf_neighbor *n, u8 state)
     n->myimms = DBDES_IMMS;
 
     tm_start(n->dbdes_timer, 0);
-    tm_start(n->ackd_timer, ifa->rxmtint / 2);
+
+    /* Delayed acks are aggregated in the iface queue when there is one */
+    if (!ifa->ack_timer)
+      tm_start(n->ackd_timer, ifa->rxmtint / 2);
   }
 
   if (state > NEIGHBOR_EXSTART)
@@ -229,8 +234,11 @@ ospf_neigh_sm(struct ospf_neighbor *n, int event)
     if (n->state < NEIGHBOR_INIT)
       ospf_neigh_chstate(n, NEIGHBOR_INIT);
 
-    /* Restart inactivity timer */
-    tm_start(n->inactim, n->ifa->deadint);
+    /* Restart inactivity timer, the hello thread has its own */
+    if (n->ifa->hello)
+      ospf_hello_neigh_alive(n);
+    else
+      tm_start(n->inactim, n->ifa->deadint);
     break;
 
   case INM_2WAYREC:
@@ -245,9 +253,10 @@ ospf_neigh_sm(struct ospf_neighbor *n, int event)
     {
       ospf_neigh_chstate(n, NEIGHBOR_EXCHANGE);
 
-      /* Reset DB summary list iterator */
-      s_get(&(n->dbsi));
-      s_init(&(n->dbsi), &p->lsal);
+      /* Take DB summary of the current LSA db */
+      ospf_dbdes_put_summary(n->dbsum);
+      n->dbsum = ospf_dbdes_get_summary(p);
+      n->dbsum_pos = 0;
 
       /* Add MaxAge LSA entries to retransmission list */
       ospf_add_flushed_to_lsrt(p, n);
@@ -652,7 +661,7 @@ ospf_sh_neigh_info(struct ospf_neighbor *n)
   char etime[6];
   int exp, sec, min;
 
-  exp = n->inactim->expires - now;
+  exp = n->hello ? ospf_hello_neigh_expires(n) : (int) (n->inactim->expires - now);
   sec = exp % 60;
   min = exp / 60;
   if (min > 59)
@@ -106,6 +106,10 @@ static int ospf_reload_routes(struct proto *P);
 static int ospf_rte_better(struct rte *new, struct rte *old);
 static int ospf_rte_same(struct rte *new, struct rte *old);
 static void ospf_disp(timer *timer);
+static void ospf_spf_timer_hook(ptimer *t);
+static void ospf_lsa_timer_hook(ptimer *t);
+static void ospf_set_throttling(struct ospf_proto *p, struct ospf_config *c);
+static void ospf_set_spf_threads(struct ospf_proto *p, uint threads);
 
 static void
 ospf_area_initfib(struct fib_node *fn)
@@ -155,6 +159,9 @@ ospf_area_add(struct ospf_proto *p, struct ospf_area_config *ac)
   oa->rt = NULL;
   oa->po = p;
   fib_init(&oa->rtr, p->p.pool, sizeof(ort), 0, ospf_rt_initort);
+  BUFFER_INIT(oa->cand, p->p.pool, 16);
+  oa->nhpool = lp_new(p->p.pool, 12*sizeof(struct mpnh));
+  oa->spf_pool = lp_new(p->p.pool, 4080);
   add_area_nets(oa, ac);
 
   if (oa->areaid == 0)
@@ -190,6 +197,9 @@ ospf_area_remove(struct ospf_area *oa)
   fib_free(&oa->rtr);
   fib_free(&oa->net_fib);
   fib_free(&oa->enet_fib);
+  mb_free(oa->cand.data);
+  rfree(oa->nhpool);
+  rfree(oa->spf_pool);
 
   if (oa->translator_timer)
     rfree(oa->translator_timer);
@@ -237,10 +247,18 @@ ospf_start(struct proto *P)
   p->tick = c->tick;
   p->disp_timer = tm_new_set(P->pool, ospf_disp, p, 0, p->tick);
   tm_start(p->disp_timer, 1);
+  p->spf_timer = ptm_new_set(P->pool, ospf_spf_timer_hook, p);
+  p->lsa_timer = ptm_new_set(P->pool, ospf_lsa_timer_hook, p);
+  ospf_set_throttling(p, c);
+  ospf_set_spf_threads(p, c->spf_threads);
   p->lsab_size = 256;
   p->lsab_used = 0;
   p->lsab = mb_alloc(P->pool, p->lsab_size);
   p->nhpool = lp_new(P->pool, 12*sizeof(struct mpnh));
+  p->ext_nhpool = lp_new(P->pool, 12*sizeof(struct mpnh));
+  BUFFER_INIT(p->rt_dirty, P->pool, 64);
+  BUFFER_INIT(p->ext_jobs, P->pool, 64);
+  HASH_INIT(p->ext_asbrs, P->pool, 6);
   init_list(&(p->iface_list));
   init_list(&(p->area_list));
   fib_init(&p->rtf, P->pool, sizeof(ort), 0, ospf_rt_initort);
@@ -381,14 +399,131 @@ ospf_build_attrs(ea_list * next, struct linpool *pool, u32 m1, u32 m2,
 }
 
 
+/*
+ * Without SPF throttling, the scheduled routing table calculation is done on
+ * the next tick of ospf_disp(). With SPF throttling, it is done by the precise
+ * spf_timer. The first calculation after a quiet period is delayed by
+ * spf_initial, following ones are at least spf_wait after the end of previous
+ * one. The interval spf_wait starts at spf_hold and doubles with each such
+ * calculation up to spf_max. When there is no calculation for spf_max,
+ * the backoff starts again.
+ */
+static void
+ospf_kick_spf(struct ospf_proto *p)
+{
+  btime t, delay;
+
+  if (!p->spf_hold || ptm_active(p->spf_timer))
+    return;
+
+  t = precise_time();
+  if (!p->spf_last || ((t - p->spf_last) >= p->spf_max))
+  {
+    p->spf_wait = p->spf_hold;
+    delay = p->spf_initial;
+  }
+  else
+  {
+    delay = MAX(p->spf_last + p->spf_wait - t, p->spf_initial);
+    p->spf_wait = MIN(2 * p->spf_wait, p->spf_max);
+  }
+
+  ptm_start(p->spf_timer, delay);
+}
+
+static void
+ospf_spf_timer_hook(ptimer *t)
+{
+  struct ospf_proto *p = t->data;
+
+  if (p->calcrt)
+    ospf_rt_spf(p);
+
+  p->spf_last = precise_time();
+}
+
+static void
+ospf_lsa_timer_hook(ptimer *t)
+{
+  struct ospf_proto *p = t->data;
+
+  /* Originate requested topology LSAs and postponed LSAs */
+  ospf_update_topology(p);
+  ospf_originate_postponed(p);
+}
+
+static void
+ospf_set_throttling(struct ospf_proto *p, struct ospf_config *c)
+{
+  p->spf_initial = c->spf_initial;
+  p->spf_hold = c->spf_hold;
+  p->spf_max = c->spf_max;
+  p->lsa_hold = c->lsa_hold;
+  p->lsa_max = c->lsa_max;
+
+  if (!p->spf_hold)
+    ptm_stop(p->spf_timer);
+  else if (p->calcrt)
+    ospf_kick_spf(p);
+
+  if (!p->lsa_hold)
+    ptm_stop(p->lsa_timer);
+}
+
+static void
+ospf_set_spf_threads(struct ospf_proto *p, uint threads)
+{
+  uint old = p->spf_workers ? wp_threads(p->spf_workers) + 1 : 1;
+
+  if (threads == old)
+    return;
+
+  rfree(p->spf_workers);
+  p->spf_workers = (threads > 1) ? wp_new(p->p.pool, threads - 1) : NULL;
+}
+
 void
 ospf_schedule_rtcalc(struct ospf_proto *p)
 {
+  p->calcrt_ext = 0;
+
   if (p->calcrt)
     return;
 
   OSPF_TRACE(D_EVENTS, "Scheduling routing table calculation");
   p->calcrt = 1;
+  ospf_kick_spf(p);
+}
+
+/**
+ * ospf_schedule_rtcalc_ext - schedule calculation of external routes
+ * @p: OSPF protocol instance
+ *
+ * Schedules the partial routing table calculation (RFC 2328 16.5), where just
+ * external routes are recomputed. If the full calculation is already scheduled,
+ * it is kept.
+ */
+void
+ospf_schedule_rtcalc_ext(struct ospf_proto *p)
+{
+  if (p->calcrt)
+    return;
+
+  OSPF_TRACE(D_EVENTS, "Scheduling routing table calculation for ext routes");
+  p->calcrt = 1;
+  p->calcrt_ext = 1;
+  ospf_kick_spf(p);
+}
+
+/* Schedule routing table calculation after a change of LSA @en */
+void
+ospf_schedule_rtcalc_lsa(struct ospf_proto *p, struct top_hash_entry *en)
+{
+  /* RFC 2328 16.5. - AS-external-LSAs affect just external routes */
+  if (en->lsa_type == LSA_T_EXT)
+    ospf_schedule_rtcalc_ext(p);
+  else
+    ospf_schedule_rtcalc(p);
 }
 
 static int
@@ -400,6 +535,8 @@ ospf_reload_routes(struct proto *P)
     OSPF_TRACE(D_EVENTS, "Scheduling routing table calculation with route reload");
 
   p->calcrt = 2;
+  p->calcrt_ext = 0;
+  ospf_kick_spf(p);
 
   return 1;
 }
@@ -421,8 +558,8 @@ ospf_disp(timer * timer)
   /* Process LSA DB */
   ospf_update_lsadb(p);
 
-  /* Calculate routing table */
-  if (p->calcrt)
+  /* Calculate routing table, unless it is throttled by spf_timer */
+  if (p->calcrt && !p->spf_hold)
     ospf_rt_spf(p);
 }
 
@@ -505,6 +642,8 @@ ospf_shutdown(struct proto *P)
   WALK_LIST(ifa, p->iface_list)
     ospf_iface_shutdown(ifa);
 
+  ospf_hello_shutdown(p);
+
   /* Cleanup locked rta entries */
   FIB_WALK(&p->rtf, nftmp)
   {
@@ -665,6 +804,8 @@ ospf_reconfigure(struct proto *P, struct proto_config *c)
   p->tick = new->tick;
   p->disp_timer->recurrent = p->tick;
   tm_start(p->disp_timer, 1);
+  ospf_set_throttling(p, new);
+  ospf_set_spf_threads(p, new->spf_threads);
 
   /* Mark all areas and ifaces */
   WALK_LIST(oa, p->area_list)
@@ -759,8 +900,17 @@ ospf_sh(struct proto *P)
   cli_msg(-1014, "RFC1583 compatibility: %s", (p->rfc1583 ? "enabled" : "disabled"));
   cli_msg(-1014, "Stub router: %s", (p->stub_router ? "Yes" : "No"));
   cli_msg(-1014, "RT scheduler tick: %d", p->tick);
+  if (p->spf_hold)
+    cli_msg(-1014, "SPF throttling: %u ms initial, %u ms hold, %u ms max, current %u ms",
+	    (uint) (p->spf_initial TO_MS), (uint) (p->spf_hold TO_MS),
+	    (uint) (p->spf_max TO_MS), (uint) (p->spf_wait TO_MS));
+  if (p->lsa_hold)
+    cli_msg(-1014, "LSA throttling: %u ms hold, %u ms max",
+	    (uint) (p->lsa_hold TO_MS), (uint) (p->lsa_max TO_MS));
+  if (p->spf_workers)
+    cli_msg(-1014, "SPF threads: %u", wp_threads(p->spf_workers) + 1);
   cli_msg(-1014, "Number of areas: %u", p->areano);
-  cli_msg(-1014, "Number of LSAs in DB:\t%u", p->gr->hash_entries);
+  cli_msg(-1014, "Number of LSAs in DB:\t%u", p->gr->hash.entries);
 
   WALK_LIST(oa, p->area_list)
   {
@@ -1102,9 +1252,6 @@ show_lsa_external(struct top_hash_entry *he, int ospf2)
   char str_via[STD_ADDRESS_P_LENGTH + 8] = "";
   char str_tag[16] = "";
 
-  if (he->lsa_type == LSA_T_EXT)
-    he->domain = 0; /* Unmark the LSA */
-
   lsa_parse_ext(he, ospf2, &rt);
 
   if (rt.fbit)
@@ -1151,123 +1298,190 @@ show_lsa_prefix(struct top_hash_entry *he, struct top_hash_entry *cnode)
     }
 }
 
-void
-ospf_sh_state(struct proto *P, int verbose, int reachable)
+/*
+ * Both 'show ospf state' and 'show ospf lsadb' may produce a lot of output for
+ * a large LSDB. The LSAs are sorted once to an array of lookup keys, which is
+ * owned by the CLI and processed in chunks of bounded size by the continuation
+ * routine. LSAs are looked up again when presented, therefore LSAs removed in
+ * the meantime are skipped and the LSDB may change freely between chunks.
+ */
+#define OSPF_SHOW_STEP	256
+
+struct ospf_lsa_key {
+  u32 domain;
+  u32 id;
+  u32 rt;
+  u16 type;
+};
+
+struct ospf_show_state {
+  struct ospf_proto *p;
+  struct config *running_on_config;
+  struct ospf_lsa_key *lsa;		/* Presented area-scoped LSAs */
+  struct ospf_lsa_key *ext;		/* AS-external LSAs */
+  u8 *ext_shown;			/* AS-external LSA was presented with its ASBR */
+  uint lsa_count, ext_count;
+  uint lsa_pos, ext_pos, other_pos;	/* Current positions in these arrays */
+  u32 last_area, last_rt;
+  u8 verbose, reachable, other_hdr;
+};
+
+struct ospf_show_lsadb {
+  struct ospf_proto *p;
+  struct config *running_on_config;
+  struct ospf_lsa_key *lsa;		/* Presented LSAs */
+  uint lsa_count, lsa_pos;
+  int last_dscope;
+  u32 last_domain;
+};
+
+static inline int
+ospf_show_max(void)
 {
-  struct ospf_proto *p = (struct ospf_proto *) P;
-  int ospf2 = ospf_is_v2(p);
-  uint i, ix, j1, jx;
-  u32 last_area = 0xFFFFFFFF;
+#ifdef DEBUGGING
+  return 4;
+#else
+  return OSPF_SHOW_STEP;
+#endif
+}
 
-  if (p->p.proto_state != PS_UP)
-  {
-    cli_msg(-1016, "%s: is not up", p->p.name);
-    cli_msg(0, "");
-    return;
-  }
+/* Sort LSAs in @hea and store their keys to @keys */
+static void
+ospf_sort_lsa_keys(struct ospf_lsa_key *keys, struct top_hash_entry **hea, uint num,
+		   int (*cmp)(const void *, const void *))
+{
+  uint i;
 
-  /* We store interesting area-scoped LSAs in array hea and
-     global-scoped (LSA_T_EXT) LSAs in array hex */
+  qsort(hea, num, sizeof(struct top_hash_entry *), cmp);
 
-  int num = p->gr->hash_entries;
-  struct top_hash_entry *hea[num];
-  struct top_hash_entry *hex[verbose ? num : 0];
-  struct top_hash_entry *he;
-  struct top_hash_entry *cnode = NULL;
+  for (i = 0; i < num; i++)
+    keys[i] = (struct ospf_lsa_key) {
+      .domain = hea[i]->domain,
+      .id = hea[i]->lsa.id,
+      .rt = hea[i]->lsa.rt,
+      .type = hea[i]->lsa_type
+    };
+}
 
-  j1 = jx = 0;
-  WALK_SLIST(he, p->lsal)
+static inline struct top_hash_entry *
+ospf_find_lsa_key(struct ospf_proto *p, struct ospf_lsa_key *k)
+{
+  return ospf_hash_find(p->gr, k->domain, k->id, k->rt, k->type);
+}
+
+static inline struct top_hash_entry *
+ospf_find_lsa_key_alive(struct ospf_proto *p, struct ospf_lsa_key *k)
+{
+  struct top_hash_entry *he = ospf_find_lsa_key(p, k);
+  return (he && (he->lsa.age < LSA_MAXAGE)) ? he : NULL;
+}
+
+/* Check whether a show command may continue, finish it otherwise */
+static int
+ospf_show_valid(struct cli *c, struct ospf_proto *p, struct config *cf, int code)
+{
+  if (cf != config)
   {
-    int accept;
+    cli_printf(c, 8004, "Stopped due to reconfiguration");
+    return 0;
+  }
 
-    if (he->lsa.age == LSA_MAXAGE)
-      continue;
+  if (p->p.proto_state != PS_UP)
+  {
+    cli_printf(c, code, "%s: is not up", p->p.name);
+    cli_printf(c, 0, "");
+    return 0;
+  }
 
-    switch (he->lsa_type)
-    {
-    case LSA_T_RT:
-    case LSA_T_NET:
-      accept = 1;
-      break;
+  return 1;
+}
 
-    case LSA_T_SUM_NET:
-    case LSA_T_SUM_RT:
-    case LSA_T_NSSA:
-    case LSA_T_PREFIX:
-      accept = verbose;
-      break;
+static void
+ospf_show_done(struct cli *c)
+{
+  mb_free(c->rover);
+  c->rover = NULL;
+  c->cont = NULL;
+}
 
-    case LSA_T_EXT:
-      if (verbose)
-      {
-	he->domain = 1; /* Abuse domain field to mark the LSA */
-	hex[jx++] = he;
-      }
-    default:
-      accept = 0;
-    }
+static inline void
+ospf_sh_state_ext(struct ospf_show_state *d, uint i)
+{
+  struct top_hash_entry *he = ospf_find_lsa_key_alive(d->p, &d->ext[i]);
 
-    if (accept)
-      hea[j1++] = he;
-  }
+  d->ext_shown[i] = 1;
 
-  ASSERT(j1 <= num && jx <= num);
+  if (he)
+    show_lsa_external(he, ospf_is_v2(d->p));
+}
+
+/*
+ * This code is a bit tricky, we have a primary LSAs (router and network) that
+ * are presented as a node, and secondary LSAs that are presented as a part of a
+ * primary node. cnode represents an currently opened node (whose header was
+ * presented). The LSAs are sorted to get secondary LSAs just after related
+ * primary LSA (if available). We present secondary LSAs only when related
+ * primary LSA is opened.
+ *
+ * AS-external LSAs are stored separately as they might be presented several
+ * times (for each area when related ASBR is opened). When the node is closed,
+ * related external routes are presented. We also have to take into account that
+ * in OSPFv3, there might be more router-LSAs and only the first should be
+ * considered as a primary. This is handled by not closing old router-LSA when
+ * next one is processed (which is not opened because there is already one
+ * opened).
+ *
+ * The output is split to chunks only between nodes, so cnode is never kept
+ * between calls.
+ */
+static void
+ospf_sh_state_cont(struct cli *c)
+{
+  struct ospf_show_state *d = c->rover;
+  struct ospf_proto *p = d->p;
+  int ospf2 = ospf_is_v2(p);
+  struct top_hash_entry *he, *cnode = NULL;
+  int max = ospf_show_max();
 
-  lsa_compare_ospf3 = !ospf2;
-  qsort(hea, j1, sizeof(struct top_hash_entry *), lsa_compare_for_state);
-  qsort(hex, jx, sizeof(struct top_hash_entry *), ext_compare_for_state);
+  if (!ospf_show_valid(c, p, d->running_on_config, -1016))
+    goto done;
 
-  /*
-   * This code is a bit tricky, we have a primary LSAs (router and
-   * network) that are presented as a node, and secondary LSAs that
-   * are presented as a part of a primary node. cnode represents an
-   * currently opened node (whose header was presented). The LSAs are
-   * sorted to get secondary LSAs just after related primary LSA (if
-   * available). We present secondary LSAs only when related primary
-   * LSA is opened.
-   *
-   * AS-external LSAs are stored separately as they might be presented
-   * several times (for each area when related ASBR is opened). When
-   * the node is closed, related external routes are presented. We
-   * also have to take into account that in OSPFv3, there might be
-   * more router-LSAs and only the first should be considered as a
-   * primary. This is handled by not closing old router-LSA when next
-   * one is processed (which is not opened because there is already
-   * one opened).
-   */
-
-  ix = 0;
-  for (i = 0; i < j1; i++)
+  for (; d->lsa_pos < d->lsa_count; d->lsa_pos++)
   {
-    he = hea[i];
+    struct ospf_lsa_key *k = &d->lsa[d->lsa_pos];
+    he = ospf_find_lsa_key_alive(p, k);
 
     /* If there is no opened node, we open the LSA (if appropriate) or skip to the next one */
     if (!cnode)
     {
-      if (((he->lsa_type == LSA_T_RT) || (he->lsa_type == LSA_T_NET))
-	  && ((he->color == INSPF) || !reachable))
+      if (max <= 0)
+	return;
+
+      if (he && ((he->lsa_type == LSA_T_RT) || (he->lsa_type == LSA_T_NET))
+	  && ((he->color == INSPF) || !d->reachable))
       {
 	cnode = he;
 
-	if (he->domain != last_area)
+	if (he->domain != d->last_area)
 	{
 	  cli_msg(-1016, "");
 	  cli_msg(-1016, "area %R", he->domain);
-	  last_area = he->domain;
-	  ix = 0;
+	  d->last_area = he->domain;
+	  d->ext_pos = 0;
 	}
       }
       else
 	continue;
     }
 
-    ASSERT(cnode && (he->domain == last_area) && (he->lsa.rt == cnode->lsa.rt));
+    ASSERT(cnode && (k->domain == d->last_area) && (k->rt == cnode->lsa.rt));
+    max--;
 
-    switch (he->lsa_type)
+    switch (he ? he->lsa_type : 0)
     {
     case LSA_T_RT:
       if (he->lsa.id == cnode->lsa.id)
-	show_lsa_router(p, he, verbose);
+	show_lsa_router(p, he, d->verbose);
       break;
 
     case LSA_T_NET:
@@ -1295,56 +1509,142 @@ ospf_sh_state(struct proto *P, int verbose, int reachable)
     }
 
     /* In these cases, we close the current node */
-    if ((i+1 == j1)
-	|| (hea[i+1]->domain != last_area)
-	|| (hea[i+1]->lsa.rt != cnode->lsa.rt)
-	|| (hea[i+1]->lsa_type == LSA_T_NET))
+    if ((d->lsa_pos+1 == d->lsa_count)
+	|| (k[1].domain != d->last_area)
+	|| (k[1].rt != cnode->lsa.rt)
+	|| (k[1].type == LSA_T_NET))
     {
-      while ((ix < jx) && (hex[ix]->lsa.rt < cnode->lsa.rt))
-	ix++;
+      while ((d->ext_pos < d->ext_count) && (d->ext[d->ext_pos].rt < cnode->lsa.rt))
+	d->ext_pos++;
 
-      while ((ix < jx) && (hex[ix]->lsa.rt == cnode->lsa.rt))
-	show_lsa_external(hex[ix++], ospf2);
+      while ((d->ext_pos < d->ext_count) && (d->ext[d->ext_pos].rt == cnode->lsa.rt))
+      {
+	ospf_sh_state_ext(d, d->ext_pos++);
+	max--;
+      }
 
       cnode = NULL;
     }
   }
 
-  int hdr = 0;
-  u32 last_rt = 0xFFFFFFFF;
-  for (ix = 0; ix < jx; ix++)
+  /* AS-external LSAs not presented with any ASBR are shown now */
+  for (; d->other_pos < d->ext_count; d->other_pos++)
   {
-    he = hex[ix];
+    if (d->ext_shown[d->other_pos])
+      continue;
 
-    /* If it is still marked, we show it now. */
-    if (he->domain)
-    {
-      he->domain = 0;
+    if (max <= 0)
+      return;
 
-      if ((he->color != INSPF) && reachable)
-	continue;
+    he = ospf_find_lsa_key_alive(p, &d->ext[d->other_pos]);
+    max--;
 
-      if (!hdr)
-      {
-	cli_msg(-1016, "");
-	cli_msg(-1016, "other ASBRs");
-	hdr = 1;
-      }
+    if (!he || ((he->color != INSPF) && d->reachable))
+      continue;
 
-      if (he->lsa.rt != last_rt)
-      {
-	cli_msg(-1016, "");
-	cli_msg(-1016, "\trouter %R", he->lsa.rt);
-	last_rt = he->lsa.rt;
-      }
+    if (!d->other_hdr)
+    {
+      cli_msg(-1016, "");
+      cli_msg(-1016, "other ASBRs");
+      d->other_hdr = 1;
+    }
 
-      show_lsa_external(he, ospf2);
+    if (he->lsa.rt != d->last_rt)
+    {
+      cli_msg(-1016, "");
+      cli_msg(-1016, "\trouter %R", he->lsa.rt);
+      d->last_rt = he->lsa.rt;
     }
+
+    show_lsa_external(he, ospf2);
   }
 
   cli_msg(0, "");
+
+done:
+  ospf_show_done(c);
 }
 
+void
+ospf_sh_state(struct proto *P, int verbose, int reachable)
+{
+  struct ospf_proto *p = (struct ospf_proto *) P;
+  uint j1, jx;
+
+  if (p->p.proto_state != PS_UP)
+  {
+    cli_msg(-1016, "%s: is not up", p->p.name);
+    cli_msg(0, "");
+    return;
+  }
+
+  /* We store interesting area-scoped LSAs in array hea and
+     global-scoped (LSA_T_EXT) LSAs in array hex */
+
+  uint num = p->gr->hash.entries;
+  struct top_hash_entry **hea = mb_alloc(this_cli->pool, 2 * num * sizeof(struct top_hash_entry *));
+  struct top_hash_entry **hex = hea + num;
+  struct top_hash_entry *he;
+
+  j1 = jx = 0;
+  WALK_SLIST(he, p->lsal)
+  {
+    int accept;
+
+    if (he->lsa.age == LSA_MAXAGE)
+      continue;
+
+    switch (he->lsa_type)
+    {
+    case LSA_T_RT:
+    case LSA_T_NET:
+      accept = 1;
+      break;
+
+    case LSA_T_SUM_NET:
+    case LSA_T_SUM_RT:
+    case LSA_T_NSSA:
+    case LSA_T_PREFIX:
+      accept = verbose;
+      break;
+
+    case LSA_T_EXT:
+      if (verbose)
+	hex[jx++] = he;
+    default:
+      accept = 0;
+    }
+
+    if (accept)
+      hea[j1++] = he;
+  }
+
+  ASSERT(j1 <= num && jx <= num);
+
+  struct ospf_show_state *d =
+    mb_allocz(this_cli->pool, sizeof(struct ospf_show_state) +
+	      (j1 + jx) * sizeof(struct ospf_lsa_key) + jx);
+
+  d->p = p;
+  d->running_on_config = p->p.cf->global;
+  d->lsa = (void *) (d + 1);
+  d->ext = d->lsa + j1;
+  d->ext_shown = (void *) (d->ext + jx);
+  d->lsa_count = j1;
+  d->ext_count = jx;
+  d->last_area = 0xFFFFFFFF;
+  d->last_rt = 0xFFFFFFFF;
+  d->verbose = verbose;
+  d->reachable = reachable;
+
+  lsa_compare_ospf3 = !ospf_is_v2(p);
+  ospf_sort_lsa_keys(d->lsa, hea, j1, lsa_compare_for_state);
+  ospf_sort_lsa_keys(d->ext, hex, jx, ext_compare_for_state);
+  mb_free(hea);
+
+  this_cli->cont = ospf_sh_state_cont;
+  this_cli->rover = d;
+}
 
 static int
 lsa_compare_for_lsadb(const void *p1, const void *p2)
@@ -1374,14 +1674,73 @@ lsa_compare_for_lsadb(const void *p1, const void *p2)
   return lsa1->sn - lsa2->sn;
 }
 
+static void
+ospf_sh_lsadb_cont(struct cli *c)
+{
+  struct ospf_show_lsadb *d = c->rover;
+  struct ospf_proto *p = d->p;
+  u16 type_mask = ospf_is_v2(p) ?  0x00ff : 0xffff;	/* see lsa_etype() */
+  int max = ospf_show_max();
+
+  if (!ospf_show_valid(c, p, d->running_on_config, -1017))
+    goto done;
+
+  for (; d->lsa_pos < d->lsa_count; d->lsa_pos++)
+  {
+    struct ospf_lsa_key *k = &d->lsa[d->lsa_pos];
+    struct top_hash_entry *he;
+    int dscope = LSA_SCOPE(k->type);
+
+    if (max-- <= 0)
+      return;
+
+    if (!(he = ospf_find_lsa_key(p, k)))
+      continue;
+
+    if ((dscope != d->last_dscope) || (k->domain != d->last_domain))
+    {
+      cli_msg(-1017, "");
+      switch (dscope)
+      {
+      case LSA_SCOPE_AS:
+	cli_msg(-1017, "Global");
+	break;
+
+      case LSA_SCOPE_AREA:
+	cli_msg(-1017, "Area %R", k->domain);
+	break;
+
+      case LSA_SCOPE_LINK:
+	{
+	  struct iface *ifa = if_find_by_index(k->domain);
+	  cli_msg(-1017, "Link %s", (ifa != NULL) ? ifa->name : "?");
+	}
+	break;
+      }
+      cli_msg(-1017, "");
+      cli_msg(-1017," Type   LS ID           Router          Sequence   Age  Checksum");
+
+      d->last_dscope = dscope;
+      d->last_domain = k->domain;
+    }
+
+    struct ospf_lsa_header *lsa = &(he->lsa);
+    cli_msg(-1017," %04x  %-15R %-15R  %08x %5u    %04x",
+	    lsa->type_raw & type_mask, lsa->id, lsa->rt, lsa->sn, lsa->age, lsa->checksum);
+  }
+
+  cli_msg(0, "");
+
+done:
+  ospf_show_done(c);
+}
+
 void
 ospf_sh_lsadb(struct lsadb_show_data *ld)
 {
   struct ospf_proto *p = (struct ospf_proto *) proto_get_named(ld->name, &proto_ospf);
-  uint num = p->gr->hash_entries;
-  uint i, j;
-  int last_dscope = -1;
-  u32 last_domain = 0;
+  uint num = p->gr->hash.entries;
+  uint j;
   u16 type_mask = ospf_is_v2(p) ?  0x00ff : 0xffff;	/* see lsa_etype() */
 
   if (p->p.proto_state != PS_UP)
@@ -1394,29 +1753,25 @@ ospf_sh_lsadb(struct lsadb_show_data *ld)
   if (ld->router == SH_ROUTER_SELF)
     ld->router = p->router_id;
 
-  struct top_hash_entry *hea[num];
+  struct top_hash_entry **hea = mb_alloc(this_cli->pool, num * sizeof(struct top_hash_entry *));
   struct top_hash_entry *he;
 
+  /* The filter is applied here, only the matching LSAs are kept for output */
   j = 0;
   WALK_SLIST(he, p->lsal)
-    if (he->lsa_body)
-      hea[j++] = he;
-
-  ASSERT(j <= num);
-
-  qsort(hea, j, sizeof(struct top_hash_entry *), lsa_compare_for_lsadb);
-
-  for (i = 0; i < j; i++)
   {
-    struct ospf_lsa_header *lsa = &(hea[i]->lsa);
+    struct ospf_lsa_header *lsa = &(he->lsa);
     u16 lsa_type = lsa->type_raw & type_mask;
-    u16 dscope = LSA_SCOPE(hea[i]->lsa_type);
+    u16 dscope = LSA_SCOPE(he->lsa_type);
+
+    if (!he->lsa_body)
+      continue;
 
     /* Hack: 1 is used for LSA_SCOPE_LINK, fixed by & 0xf000 */
     if (ld->scope && (dscope != (ld->scope & 0xf000)))
       continue;
 
-    if ((ld->scope == LSA_SCOPE_AREA) && (hea[i]->domain != ld->area))
+    if ((ld->scope == LSA_SCOPE_AREA) && (he->domain != ld->area))
       continue;
 
     /* For user convenience ignore high nibble */
@@ -1429,37 +1784,25 @@ ospf_sh_lsadb(struct lsadb_show_data *ld)
     if (ld->router && (lsa->rt != ld->router))
       continue;
 
-    if ((dscope != last_dscope) || (hea[i]->domain != last_domain))
-    {
-      cli_msg(-1017, "");
-      switch (dscope)
-      {
-      case LSA_SCOPE_AS:
-	cli_msg(-1017, "Global");
-	break;
+    hea[j++] = he;
+  }
 
-      case LSA_SCOPE_AREA:
-	cli_msg(-1017, "Area %R", hea[i]->domain);
-	break;
+  ASSERT(j <= num);
 
-      case LSA_SCOPE_LINK:
-	{
-	  struct iface *ifa = if_find_by_index(hea[i]->domain);
-	  cli_msg(-1017, "Link %s", (ifa != NULL) ? ifa->name : "?");
-	}
-	break;
-      }
-      cli_msg(-1017, "");
-      cli_msg(-1017," Type   LS ID           Router          Sequence   Age  Checksum");
+  struct ospf_show_lsadb *d =
+    mb_allocz(this_cli->pool, sizeof(struct ospf_show_lsadb) + j * sizeof(struct ospf_lsa_key));
 
-      last_dscope = dscope;
-      last_domain = hea[i]->domain;
-    }
+  d->p = p;
+  d->running_on_config = p->p.cf->global;
+  d->lsa = (void *) (d + 1);
+  d->lsa_count = j;
+  d->last_dscope = -1;
 
-    cli_msg(-1017," %04x  %-15R %-15R  %08x %5u    %04x",
-	    lsa_type, lsa->id, lsa->rt, lsa->sn, lsa->age, lsa->checksum);
-  }
-  cli_msg(0, "");
+  ospf_sort_lsa_keys(d->lsa, hea, j, lsa_compare_for_lsadb);
+  mb_free(hea);
+
+  this_cli->cont = ospf_sh_lsadb_cont;
+  this_cli->rover = d;
 }
 
 
@@ -20,11 +20,15 @@
 #include "lib/socket.h"
 #include "lib/timer.h"
 #include "lib/resource.h"
+#include "lib/buffer.h"
+#include "lib/hash.h"
+#include "lib/worker.h"
 #include "nest/protocol.h"
 #include "nest/iface.h"
 #include "nest/route.h"
 #include "nest/cli.h"
 #include "nest/locks.h"
+#include "nest/password.h"
 #include "nest/bfd.h"
 #include "conf/conf.h"
 #include "lib/string.h"
@@ -73,6 +77,9 @@
 #define OSPF_PROTO 89
 
 #define LSREFRESHTIME 1800	/* 30 minutes */
+#define LSREFRESH_JITTER 450	/* Maximal random shortening of LSRefreshTime */
+#define LSREFRESH_PACE 4	/* Refresh rate limit, in multiples of the average rate */
+#define LSREFRESH_PACE_MIN 32	/* Refreshes allowed in each tick regardless of the limit */
 #define MINLSINTERVAL 5
 #define MINLSARRIVAL 1
 #define LSINFINITY 0xffffff
@@ -92,6 +99,9 @@ struct ospf_config
 {
   struct proto_config c;
   uint tick;
+  u32 spf_initial, spf_hold, spf_max;	/* SPF throttling (in us), 0 for none */
+  u32 lsa_hold, lsa_max;	/* LSA throttling (in us), 0 for none */
+  uint spf_threads;		/* Number of areas computed in parallel */
   u8 ospf2;
   u8 rfc1583;
   u8 stub_router;
@@ -163,12 +173,15 @@ struct ospf_iface_patt
   u32 stub;
   u32 cost;
   u32 helloint;
+  u32 hello_us;			/* Sub-second hello interval (in us), 0 for none */
+  u32 dead_us;			/* Local dead interval with sub-second hellos (in us) */
   u32 rxmtint;
   u32 pollint;
   u32 waitint;
   u32 deadc;
   u32 deadint;
   u32 inftransdelay;
+  u32 ack_delay;		/* Delay of aggregated acks (in us), 0 for rxmtint / 2 */
   list nbma_list;
   u32 priority;
   u32 voa;
@@ -184,7 +197,9 @@ struct ospf_iface_patt
 #define OSPF_AUTH_NONE 0
 #define OSPF_AUTH_SIMPLE 1
 #define OSPF_AUTH_CRYPT 2
-#define OSPF_AUTH_CRYPT_SIZE 16
+#define OSPF_AUTH_CRYPT_SIZE 16	/* Keyed MD5 digest */
+#define OSPF_AUTH_CRYPT_MAX 32	/* HMAC-SHA-256 digest */
+#define OSPF_AUTH_APAD 0x878FE1F3	/* RFC 5709 */
   u8 strictnbma;
   u8 check_link;
   u8 ecmp_weight;
@@ -194,6 +209,7 @@ struct ospf_iface_patt
   u8 ttl_security;		/* bool + 2 for TX only */
   u8 bfd;
   u8 bsd_secondary;
+  u8 hello_thread;		/* Hello TX/RX in the hello thread, see hello.c */
   list *passwords;
 };
 
@@ -215,14 +231,24 @@ struct ospf_proto
   struct proto p;
   timer *disp_timer;		/* OSPF proto dispatcher */
   uint tick;
+  ptimer *spf_timer;		/* Throttled routing table calculation */
+  ptimer *lsa_timer;		/* Origination of LSAs under LSA throttling */
+  btime spf_initial, spf_hold, spf_max;	/* SPF throttling, see ospf_kick_spf() */
+  btime spf_wait;		/* Current minimal interval between calculations */
+  btime spf_last;		/* End of the last calculation */
+  btime lsa_hold, lsa_max;	/* LSA throttling, see ospf_lsa_interval_passed() */
   struct top_graph *gr;		/* LSA graph */
   slist lsal;			/* List of all LSA's */
+  uint lsa_self_count;		/* Number of valid self-originated LSAs, for refresh pacing */
   int calcrt;			/* Routing table calculation scheduled?
 				   0=no, 1=normal, 2=forced reload */
+  u8 calcrt_ext;		/* Only external routes have to be recalculated */
+  worker_pool *spf_workers;	/* Threads for parallel per-area SPF, or NULL */
   list iface_list;		/* List of OSPF interfaces (struct ospf_iface) */
   list area_list;		/* List of OSPF areas (struct ospf_area) */
   int areano;			/* Number of area I belong to */
   int padj;			/* Number of neighbors in Exchange or Loading state */
+  struct ospf_dbdes_summary *dbsum; /* Database summary of the current LSA db, or NULL */
   struct fib rtf;		/* Routing table */
   byte ospf2;			/* OSPF v2 or v3 */
   byte rfc1583;			/* RFC1583 compatibility */
@@ -235,7 +261,16 @@ struct ospf_proto
   void *lsab;			/* LSA buffer used when originating router LSAs */
   int lsab_size, lsab_used;
   linpool *nhpool;		/* Linpool used for next hops computed in SPF */
+  linpool *ext_nhpool;		/* Linpool used for next hops of external routes */
+  BUFFER(struct ort *) rt_dirty; /* Entries of rtf changed by partial calculation */
+  BUFFER(struct ospf_ext_job) ext_jobs; /* LSAs processed by ospf_ext_spf() */
+  HASH(struct ospf_ext_asbr) ext_asbrs; /* ASBRs of these LSAs, in ext_nhpool */
   sock *vlink_sk;		/* IP socket used for vlink TX */
+  struct birdloop *hello_loop;	/* Hello thread, NULL if not running */
+  pool *hello_pool;		/* Resources owned by the hello thread */
+  sock *hello_notify_rs;	/* Notifications from the hello thread, read end */
+  sock *hello_notify_ws;	/* Notifications from the hello thread, write end */
+  list hello_notify;		/* Dead neighbors reported by the hello thread */
   u32 router_id;
   u32 last_vlink_id;		/* Interface IDs for vlinks (starts at 0x80000000) */
   struct tbf log_pkt_tbf;	/* TBF for packet messages */
@@ -249,11 +284,19 @@ struct ospf_area
   struct ospf_area_config *ac;	/* Related area config */
   struct top_hash_entry *rt;	/* My own router LSA */
   struct top_hash_entry *pxr_lsa; /* Originated prefix LSA */
-  list cand;			/* List of candidates for RT calc. */
+  BUFFER(struct top_hash_entry *) cand; /* Heap of candidates for RT calc. */
+  u32 cand_seq;			/* Counter of candidate insertions */
+  linpool *nhpool;		/* Linpool used for next hops computed in area SPF */
+  linpool *spf_pool;		/* Linpool used for deferred results of area SPF */
+  struct spf_result *spf_res;	/* Deferred results, see ospf_rt_spfa_parallel() */
+  struct spf_result **spf_res_end;
+  uint spf_size;		/* Number of router and network LSAs in area */
+  u8 spf_deferred;		/* Results of area SPF are deferred */
   struct fib net_fib;		/* Networks to advertise or not */
   struct fib enet_fib;		/* External networks for NSSAs */
   u32 options;			/* Optional features */
   u8 update_rt_lsa;		/* Rt lsa origination scheduled? */
+  u64 rt_fp;			/* Fingerprint of inputs of rt lsa, see rt_lsa_fingerprint() */
   u8 trcap;			/* Transit capability? */
   u8 marked;			/* Used in OSPF reconfigure */
   u8 translate;			/* Translator state (TRANS_*), for NSSA ABR  */
@@ -314,6 +357,12 @@ struct ospf_iface
   timer *wait_timer;		/* WAIT timer */
   timer *hello_timer;		/* HELLOINT timer */
   timer *poll_timer;		/* Poll Interval - for NBMA */
+  struct ospf_hello_iface *hello; /* Hello thread state, NULL if not used */
+  ptimer *ack_timer;		/* Delayed ack timer - for BCAST and NBMA */
+  btime ack_delay;		/* Delay of acks in ackl */
+  list ackl;			/* Delayed acks aggregated from all neighbors */
+  u32 ack_sent;			/* Number of sent acks (LSA headers) */
+  u32 ack_pkts;			/* Number of sent LSACK packets */
 
   struct top_hash_entry *link_lsa;	/* Originated link LSA */
   struct top_hash_entry *net_lsa;	/* Originated network LSA */
@@ -321,6 +370,7 @@ struct ospf_iface
   struct top_hash_entry **flood_queue;	/* LSAs queued for LSUPD */
   u8 update_link_lsa;
   u8 update_net_lsa;
+  u64 net_fp;			/* Fingerprint of inputs of net_lsa */
   u16 flood_queue_used;		/* The current number of LSAs in flood_queue */
   u16 flood_queue_size;		/* The maximum number of LSAs in flood_queue */
   int fadj;			/* Number of fully adjacent neighbors */
@@ -366,10 +416,11 @@ struct ospf_neighbor
   u32 bdr;			/* Neighbor's idea of BDR */
   u32 iface_id;			/* ID of Neighbour's iface connected to common network */
 
-  /* Database summary list iterator, controls initial dbdes exchange.
-   * Advances in the LSA list as dbdes packets are sent.
+  /* Database summary, controls initial dbdes exchange.
+   * Position advances in the shared summary as dbdes packets are sent.
    */
-  siterator dbsi;		/* iterator of po->lsal */
+  struct ospf_dbdes_summary *dbsum;	/* Summary being sent, or NULL */
+  uint dbsum_pos;		/* Index of the first unsent entry */
 
   /* Link state request list, controls initial LSA exchange.
    * Entries added when received in dbdes packets, removed as sent in lsreq packets.
@@ -380,7 +431,8 @@ struct ospf_neighbor
 
   /* Link state retransmission list, controls LSA retransmission during flood.
    * Entries added as sent in lsupd packets, removed when received in lsack packets.
-   * These entries hold ret_count in appropriate LSA entries.
+   * These entries hold ret_count in appropriate LSA entries. The list is ordered
+   * by inst_time of entries, which is the time of their last transmission.
    */
   slist lsrtl;			/* slist of struct top_hash_entry from n->lsrth */
   struct top_graph *lsrth;
@@ -392,6 +444,7 @@ struct ospf_neighbor
 #define ACKL_DELAY 1
   timer *ackd_timer;		/* Delayed ack timer */
   struct bfd_request *bfd_req;	/* BFD request, if BFD is used */
+  struct ospf_hello_neigh *hello; /* Hello thread state, NULL if not used */
   void *ldd_buffer;		/* Last database description packet */
   u32 ldd_bsize;		/* Buffer size for ldd_buffer */
   u32 csn;                      /* Last received crypt seq number (for MD5) */
@@ -820,15 +873,21 @@ struct lsadb_show_data {
 
 /* ospf.c */
 void ospf_schedule_rtcalc(struct ospf_proto *p);
+void ospf_schedule_rtcalc_ext(struct ospf_proto *p);
+void ospf_schedule_rtcalc_lsa(struct ospf_proto *p, struct top_hash_entry *en);
+
+/* Under LSA throttling, requested LSAs are originated without waiting for the tick */
+static inline void ospf_kick_lsa_timer(struct ospf_proto *p)
+{ if (p->lsa_hold && !ptm_active(p->lsa_timer)) ptm_start(p->lsa_timer, 0); }
 
 static inline void ospf_notify_rt_lsa(struct ospf_area *oa)
-{ oa->update_rt_lsa = 1; }
+{ oa->update_rt_lsa = 1; ospf_kick_lsa_timer(oa->po); }
 
 static inline void ospf_notify_net_lsa(struct ospf_iface *ifa)
-{ ifa->update_net_lsa = 1; }
+{ ifa->update_net_lsa = 1; ospf_kick_lsa_timer(ifa->oa->po); }
 
 static inline void ospf_notify_link_lsa(struct ospf_iface *ifa)
-{ ifa->update_link_lsa = 1; }
+{ ifa->update_link_lsa = 1; ospf_kick_lsa_timer(ifa->oa->po); }
 
 
 #define ospf_is_v2(X) OSPF_IS_V2
@@ -880,6 +939,7 @@ int ospf_iface_assure_bufsize(struct ospf_iface *ifa, uint plen);
 int ospf_iface_reconfigure(struct ospf_iface *ifa, struct ospf_iface_patt *new);
 void ospf_reconfigure_ifaces(struct ospf_proto *p);
 void ospf_open_vlink_sk(struct ospf_proto *p);
+sock *ospf_sk_new(struct ospf_iface *ifa, pool *pool, uint flags);
 struct nbma_node *find_nbma_node_(list *nnl, ip_addr ip);
 
 static inline struct nbma_node * find_nbma_node(struct ospf_iface *ifa, ip_addr ip)
@@ -897,10 +957,15 @@ void ospf_sh_neigh_info(struct ospf_neighbor *n);
 /* packet.c */
 void ospf_pkt_fill_hdr(struct ospf_iface *ifa, void *buf, u8 h_type);
 uint ospf_pkt_maxsize(struct ospf_iface *ifa);
+
+/* Maximal length of the digest after OSPFv2 packets sent via @ifa */
+static inline uint ospf_auth_size(struct ospf_iface *ifa)
+{ return (ifa->autype == OSPF_AUTH_CRYPT) ? password_max_mac_length(ifa->passwords) : 0; }
 int ospf_rx_hook(sock * sk, int size);
 // void ospf_tx_hook(sock * sk);
 void ospf_err_hook(sock * sk, int err);
 void ospf_verr_hook(sock *sk, int err);
+int ospf_pkt_finalize_len(struct ospf_iface *ifa, struct ospf_packet *pkt);
 void ospf_send_to(struct ospf_iface *ifa, ip_addr ip);
 void ospf_send_to_agt(struct ospf_iface *ifa, u8 state);
 void ospf_send_to_bdr(struct ospf_iface *ifa);
@@ -936,7 +1001,34 @@ static inline void * ospf_tx_buffer(struct ospf_iface *ifa)
 void ospf_send_hello(struct ospf_iface *ifa, int kind, struct ospf_neighbor *dirn);
 void ospf_receive_hello(struct ospf_packet *pkt, struct ospf_iface *ifa, struct ospf_neighbor *n, ip_addr faddr);
 
+/* Advertised hello interval, sub-second hellos are announced as zero */
+static inline u16 ospf_hello_int(struct ospf_iface *ifa)
+{ return ifa->cf->hello_us ? 0 : ifa->helloint; }
+
+#ifdef CONFIG_BFD
+void ospf_hello_start(struct ospf_iface *ifa);
+void ospf_hello_stop(struct ospf_iface *ifa);
+void ospf_hello_update(struct ospf_iface *ifa);
+void ospf_hello_shutdown(struct ospf_proto *p);
+void ospf_hello_neigh_alive(struct ospf_neighbor *n);
+void ospf_hello_neigh_remove(struct ospf_neighbor *n);
+int ospf_hello_neigh_expires(struct ospf_neighbor *n);
+void ospf_hello_info(struct ospf_iface *ifa);
+#else
+static inline void ospf_hello_start(struct ospf_iface *ifa) { }
+static inline void ospf_hello_stop(struct ospf_iface *ifa) { }
+static inline void ospf_hello_update(struct ospf_iface *ifa) { }
+static inline void ospf_hello_shutdown(struct ospf_proto *p) { }
+static inline void ospf_hello_neigh_alive(struct ospf_neighbor *n) { }
+static inline void ospf_hello_neigh_remove(struct ospf_neighbor *n) { }
+static inline int ospf_hello_neigh_expires(struct ospf_neighbor *n) { return 0; }
+static inline void ospf_hello_info(struct ospf_iface *ifa) { }
+#endif
+
 /* dbdes.c */
+struct ospf_dbdes_summary *ospf_dbdes_get_summary(struct ospf_proto *p);
+void ospf_dbdes_put_summary(struct ospf_dbdes_summary *s);
+void ospf_dbdes_flush_summary(struct ospf_proto *p);
 void ospf_send_dbdes(struct ospf_proto *p, struct ospf_neighbor *n);
 void ospf_rxmt_dbdes(struct ospf_proto *p, struct ospf_neighbor *n);
 void ospf_receive_dbdes(struct ospf_packet *pkt, struct ospf_iface *ifa, struct ospf_neighbor *n);
@@ -959,7 +1051,9 @@ void ospf_receive_lsupd(struct ospf_packet *pkt, struct ospf_iface *ifa, struct
 /* lsack.c */
 void ospf_enqueue_lsack(struct ospf_neighbor *n, struct ospf_lsa_header *h_n, int queue);
 void ospf_reset_lsack_queue(struct ospf_neighbor *n);
+void ospf_reset_iface_lsack_queue(struct ospf_iface *ifa);
 void ospf_send_lsack(struct ospf_proto *p, struct ospf_neighbor *n, int queue);
+void ospf_iface_ack_timer_hook(ptimer *t);
 void ospf_receive_lsack(struct ospf_packet *pkt, struct ospf_iface *ifa, struct ospf_neighbor *n);
 
 
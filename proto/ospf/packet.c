@@ -11,6 +11,8 @@
 #include "ospf.h"
 #include "nest/password.h"
 #include "lib/md5.h"
+#include "lib/sha256.h"
+#include "lib/unaligned.h"
 
 void
 ospf_pkt_fill_hdr(struct ospf_iface *ifa, void *buf, u8 h_type)
@@ -36,14 +38,48 @@ ospf_pkt_maxsize(struct ospf_iface *ifa)
   uint headers = SIZE_OF_IP_HEADER;
 
   /* Relevant just for OSPFv2 */
-  if (ifa->autype == OSPF_AUTH_CRYPT)
-    headers += OSPF_AUTH_CRYPT_SIZE;
+  headers += ospf_auth_size(ifa);
 
   return ifa->tx_length - headers;
 }
 
-/* We assume OSPFv2 in ospf_pkt_finalize() */
+/*
+ * Compute the cryptographic digest of the packet, which is appended to it.
+ * Keyed MD5 (RFC 2328) hashes the packet followed by the password padded to
+ * 16 bytes, HMAC-SHA-256 (RFC 5709) authenticates the packet followed by Apad,
+ * a constant of the digest length, with the key prepared in the password.
+ */
 static void
+ospf_pkt_digest(struct ospf_packet *pkt, uint plen, struct password_item *pass, byte *digest)
+{
+  if (pass->alg == ALG_HMAC_SHA256)
+  {
+    struct sha256_context ctx;
+    byte apad[SHA256_SIZE];
+    uint i;
+
+    for (i = 0; i < SHA256_SIZE; i += 4)
+      put_u32(apad + i, OSPF_AUTH_APAD);
+
+    sha256_hmac_init(&ctx, pass->hmac_key);
+    sha256_update(&ctx, (byte *) pkt, plen);
+    sha256_update(&ctx, apad, SHA256_SIZE);
+    sha256_hmac_final(&ctx, pass->hmac_key, digest);
+    return;
+  }
+
+  char password[OSPF_AUTH_CRYPT_SIZE];
+  strncpy(password, pass->password, sizeof(password));
+
+  struct MD5Context ctxt;
+  MD5Init(&ctxt);
+  MD5Update(&ctxt, (char *) pkt, plen);
+  MD5Update(&ctxt, password, OSPF_AUTH_CRYPT_SIZE);
+  MD5Final(digest, &ctxt);
+}
+
+/* We assume OSPFv2 in ospf_pkt_finalize(), returns length of the digest */
+static uint
 ospf_pkt_finalize(struct ospf_iface *ifa, struct ospf_packet *pkt)
 {
   struct password_item *passwd = NULL;
@@ -64,7 +100,7 @@ ospf_pkt_finalize(struct ospf_iface *ifa, struct ospf_packet *pkt)
     if (!passwd)
     {
       log(L_ERR "No suitable password found for authentication");
-      return;
+      return 0;
     }
     strncpy(auth->password, passwd->password, sizeof(auth->password));
 
@@ -74,14 +110,14 @@ ospf_pkt_finalize(struct ospf_iface *ifa, struct ospf_packet *pkt)
       uint blen = plen - sizeof(struct ospf_packet) - sizeof(union ospf_auth);
       pkt->checksum = ipsum_calculate(pkt, sizeof(struct ospf_packet), body, blen, NULL);
     }
-    break;
+    return 0;
 
   case OSPF_AUTH_CRYPT:
     passwd = password_find(ifa->passwords, 0);
     if (!passwd)
     {
       log(L_ERR "No suitable password found for authentication");
-      return;
+      return 0;
     }
 
     /* Perhaps use random value to prevent replay attacks after
@@ -101,19 +137,11 @@ ospf_pkt_finalize(struct ospf_iface *ifa, struct ospf_packet *pkt)
 
     auth->md5.zero = 0;
     auth->md5.keyid = passwd->id;
-    auth->md5.len = OSPF_AUTH_CRYPT_SIZE;
+    auth->md5.len = password_mac_length(passwd);
     auth->md5.csn = htonl(ifa->csn);
 
-    void *tail = ((void *) pkt) + plen;
-    char password[OSPF_AUTH_CRYPT_SIZE];
-    strncpy(password, passwd->password, sizeof(password));
-
-    struct MD5Context ctxt;
-    MD5Init(&ctxt);
-    MD5Update(&ctxt, (char *) pkt, plen);
-    MD5Update(&ctxt, password, OSPF_AUTH_CRYPT_SIZE);
-    MD5Final(tail, &ctxt);
-    break;
+    ospf_pkt_digest(pkt, plen, passwd, ((byte *) pkt) + plen);
+    return auth->md5.len;
 
   default:
     bug("Unknown authentication type");
@@ -153,10 +181,15 @@ ospf_pkt_checkauth(struct ospf_neighbor *n, struct ospf_iface *ifa, struct ospf_
     return 1;
 
   case OSPF_AUTH_CRYPT:
-    if (auth->md5.len != OSPF_AUTH_CRYPT_SIZE)
-      DROP("invalid MD5 digest length", auth->md5.len);
+    pass = password_find_by_id(ifa->passwords, auth->md5.keyid);
+    if (!pass)
+      DROP("no suitable password found", auth->md5.keyid);
 
-    if (plen + OSPF_AUTH_CRYPT_SIZE > len)
+    uint dlen = password_mac_length(pass);
+    if (auth->md5.len != dlen)
+      DROP("invalid digest length", auth->md5.len);
+
+    if (plen + dlen > len)
       DROP("length mismatch", len);
 
     u32 rcv_csn = ntohl(auth->md5.csn);
@@ -170,24 +203,11 @@ ospf_pkt_checkauth(struct ospf_neighbor *n, struct ospf_iface *ifa, struct ospf_
       return 0;
     }
 
-    pass = password_find_by_id(ifa->passwords, auth->md5.keyid);
-    if (!pass)
-      DROP("no suitable password found", auth->md5.keyid);
-
-    void *tail = ((void *) pkt) + plen;
-    char passwd[OSPF_AUTH_CRYPT_SIZE];
-    char md5sum[OSPF_AUTH_CRYPT_SIZE];
+    byte digest[OSPF_AUTH_CRYPT_MAX];
+    ospf_pkt_digest(pkt, plen, pass, digest);
 
-    strncpy(passwd, pass->password, OSPF_AUTH_CRYPT_SIZE);
-
-    struct MD5Context ctxt;
-    MD5Init(&ctxt);
-    MD5Update(&ctxt, (char *) pkt, plen);
-    MD5Update(&ctxt, passwd, OSPF_AUTH_CRYPT_SIZE);
-    MD5Final(md5sum, &ctxt);
-
-    if (memcmp(md5sum, tail, OSPF_AUTH_CRYPT_SIZE))
-      DROP("wrong MD5 digest", pass->id);
+    if (memcmp(digest, ((byte *) pkt) + plen, dlen))
+      DROP("wrong digest", pass->id);
 
     if (n)
       n->csn = rcv_csn;
@@ -464,22 +484,55 @@ ospf_verr_hook(sock *sk, int err)
   log(L_ERR "%s: Vlink socket error: %M", p->p.name, err);
 }
 
-void
-ospf_send_to(struct ospf_iface *ifa, ip_addr dst)
+/* Finalize the packet @pkt to be sent via @ifa, returns its length */
+int
+ospf_pkt_finalize_len(struct ospf_iface *ifa, struct ospf_packet *pkt)
 {
-  sock *sk = ifa->sk;
-  struct ospf_packet *pkt = (struct ospf_packet *) sk->tbuf;
   int plen = ntohs(pkt->length);
 
   if (ospf_is_v2(ifa->oa->po))
-  {
-    if (ifa->autype == OSPF_AUTH_CRYPT)
-      plen += OSPF_AUTH_CRYPT_SIZE;
+    plen += ospf_pkt_finalize(ifa, pkt);
 
-    ospf_pkt_finalize(ifa, pkt);
-  }
+  return plen;
+}
+
+/* Finalize the packet in the TX buffer, returns its length */
+static int
+ospf_tx_finalize(struct ospf_iface *ifa)
+{
+  u32 csn = ifa->csn;
+  int plen = ospf_pkt_finalize_len(ifa, (struct ospf_packet *) ifa->sk->tbuf);
+
+  /* Hellos repeated by the hello thread must not fall behind the current CSN */
+  if (ifa->hello && (ifa->csn != csn))
+    ospf_hello_update(ifa);
+
+  return plen;
+}
+
+void
+ospf_send_to(struct ospf_iface *ifa, ip_addr dst)
+{
+  int plen = ospf_tx_finalize(ifa);
+
+  int done = sk_send_to(ifa->sk, plen, dst, 0);
+  if (!done)
+    log(L_WARN "OSPF: TX queue full on %s", ifa->ifname);
+}
+
+/*
+ * The packet is finalized just once and sent to all destinations together,
+ * that is one syscall for all neighbors where sendmmsg() is available.
+ */
+static void
+ospf_send_to_many(struct ospf_iface *ifa, ip_addr *dst, uint count)
+{
+  if (!count)
+    return;
+
+  int plen = ospf_tx_finalize(ifa);
 
-  int done = sk_send_to(sk, plen, dst, 0);
+  int done = sk_send_to_many(ifa->sk, plen, dst, count, 0);
   if (!done)
     log(L_WARN "OSPF: TX queue full on %s", ifa->ifname);
 }
@@ -488,17 +541,32 @@ void
 ospf_send_to_agt(struct ospf_iface *ifa, u8 state)
 {
   struct ospf_neighbor *n;
+  uint count = 0;
 
   WALK_LIST(n, ifa->neigh_list)
     if (n->state >= state)
-      ospf_send_to(ifa, n->ip);
+      count++;
+
+  ip_addr dst[count];
+  uint i = 0;
+
+  WALK_LIST(n, ifa->neigh_list)
+    if (n->state >= state)
+      dst[i++] = n->ip;
+
+  ospf_send_to_many(ifa, dst, count);
 }
 
 void
 ospf_send_to_bdr(struct ospf_iface *ifa)
 {
+  ip_addr dst[2];
+  uint count = 0;
+
   if (ipa_nonzero(ifa->drip))
-    ospf_send_to(ifa, ifa->drip);
+    dst[count++] = ifa->drip;
   if (ipa_nonzero(ifa->bdrip))
-    ospf_send_to(ifa, ifa->bdrip);
+    dst[count++] = ifa->bdrip;
+
+  ospf_send_to_many(ifa, dst, count);
 }
@@ -8,12 +8,16 @@
  *	Can be freely distributed and used under the terms of the GNU GPL.
  */
 
+#include <stdlib.h>
+
 #include "ospf.h"
+#include "lib/heap.h"
+#include "lib/probe.h"
 
-static void add_cand(list * l, struct top_hash_entry *en,
-		     struct top_hash_entry *par, u32 dist,
-		     struct ospf_area *oa, int i);
+static void add_cand(struct ospf_area *oa, struct top_hash_entry *en,
+		     struct top_hash_entry *par, u32 dist, int i);
 static void rt_sync(struct ospf_proto *p);
+static void rt_sync_dirty(struct ospf_proto *p);
 
 
 static inline void reset_ri(ort *ort)
@@ -28,6 +32,18 @@ ospf_rt_initort(struct fib_node *fn)
   reset_ri(ri);
   ri->old_rta = NULL;
   ri->fn.flags = 0;
+  ri->dirty = 0;
+}
+
+/* Remember entry changed by partial calculation for rt_sync_dirty() */
+static inline void
+ort_mark_dirty(struct ospf_proto *p, ort *nf)
+{
+  if (nf->dirty)
+    return;
+
+  nf->dirty = 1;
+  BUFFER_PUSH(p->rt_dirty) = nf;
 }
 
 static inline int
@@ -43,9 +59,9 @@ unresolved_vlink(ort *ort)
 }
 
 static inline struct mpnh *
-new_nexthop(struct ospf_proto *p, ip_addr gw, struct iface *iface, byte weight)
+lp_new_nexthop(linpool *lp, ip_addr gw, struct iface *iface, byte weight)
 {
-  struct mpnh *nh = lp_alloc(p->nhpool, sizeof(struct mpnh));
+  struct mpnh *nh = lp_alloc(lp, sizeof(struct mpnh));
   nh->gw = gw;
   nh->iface = iface;
   nh->next = NULL;
@@ -53,6 +69,11 @@ new_nexthop(struct ospf_proto *p, ip_addr gw, struct iface *iface, byte weight)
   return nh;
 }
 
+/* Next hops computed in area SPF, see ospf_rt_spfa_parallel() */
+static inline struct mpnh *
+new_nexthop(struct ospf_area *oa, ip_addr gw, struct iface *iface, byte weight)
+{ return lp_new_nexthop(oa->nhpool, gw, iface, weight); }
+
 /* Returns true if there are device nexthops in n */
 static inline int
 has_device_nexthops(const struct mpnh *n)
@@ -64,7 +85,7 @@ has_device_nexthops(const struct mpnh *n)
   return 0;
 }
 
-/* Replace device nexthops with nexthops to gw */
+/* Replace device nexthops with nexthops to gw, used for external routes */
 static struct mpnh *
 fix_device_nexthops(struct ospf_proto *p, const struct mpnh *n, ip_addr gw)
 {
@@ -74,7 +95,7 @@ fix_device_nexthops(struct ospf_proto *p, const struct mpnh *n, ip_addr gw)
   struct mpnh **nn2 = &root2;
 
   if (!p->ecmp)
-    return new_nexthop(p, gw, n->iface, n->weight);
+    return lp_new_nexthop(p->ext_nhpool, gw, n->iface, n->weight);
 
   /* This is a bit tricky. We cannot just copy the list and update n->gw,
      because the list should stay sorted, so we create two lists, one with new
@@ -82,7 +103,7 @@ fix_device_nexthops(struct ospf_proto *p, const struct mpnh *n, ip_addr gw)
 
   for (; n; n = n->next)
   {
-    struct mpnh *nn = new_nexthop(p, ipa_zero(n->gw) ? gw : n->gw, n->iface, n->weight);
+    struct mpnh *nn = lp_new_nexthop(p->ext_nhpool, ipa_zero(n->gw) ? gw : n->gw, n->iface, n->weight);
 
     if (ipa_zero(n->gw))
     {
@@ -96,7 +117,7 @@ fix_device_nexthops(struct ospf_proto *p, const struct mpnh *n, ip_addr gw)
     }
   }
 
-  return mpnh_merge(root1, root2, 1, 1, p->ecmp, p->nhpool);
+  return mpnh_merge(root1, root2, 1, 1, p->ecmp, p->ext_nhpool);
 }
 
 
@@ -309,7 +330,7 @@ ort_merge_ext(struct ospf_proto *p, ort *o, const orta *new)
   if (old->nhs != new->nhs)
   {
     old->nhs = mpnh_merge(old->nhs, new->nhs, old->nhs_reuse, new->nhs_reuse,
-			  p->ecmp, p->nhpool);
+			  p->ecmp, p->ext_nhpool);
     old->nhs_reuse = 1;
   }
 
@@ -376,6 +397,56 @@ ri_install_ext(struct ospf_proto *p, ip_addr prefix, int pxlen, const orta *new)
     ort_replace(old, new);
   else if (cmp == 0)
     ort_merge_ext(p, old, new);
+  else
+    return;
+
+  ort_mark_dirty(p, old);
+}
+
+/*
+ * Results of area SPF that would be installed to shared routing tables are
+ * deferred during parallel computation, see ospf_rt_spfa_parallel().
+ */
+struct spf_result
+{
+  struct spf_result *next;
+  ip_addr prefix;
+  int pxlen;			/* -1 for router entries */
+  u32 rid;
+  orta nf;
+};
+
+static void
+spf_defer(struct ospf_area *oa, ip_addr prefix, int pxlen, u32 rid, const orta *nf)
+{
+  struct spf_result *res = lp_alloc(oa->spf_pool, sizeof(struct spf_result));
+
+  res->next = NULL;
+  res->prefix = prefix;
+  res->pxlen = pxlen;
+  res->rid = rid;
+  res->nf = *nf;
+
+  *oa->spf_res_end = res;
+  oa->spf_res_end = &res->next;
+}
+
+static inline void
+spfa_install_net(struct ospf_area *oa, ip_addr prefix, int pxlen, const orta *nf)
+{
+  if (oa->spf_deferred)
+    spf_defer(oa, prefix, pxlen, 0, nf);
+  else
+    ri_install_net(oa->po, prefix, pxlen, nf);
+}
+
+static inline void
+spfa_install_rt(struct ospf_area *oa, u32 rid, const orta *nf)
+{
+  if (oa->spf_deferred)
+    spf_defer(oa, IPA_NONE, -1, rid, nf);
+  else
+    ri_install_rt(oa, rid, nf);
 }
 
 static inline struct ospf_iface *
@@ -438,10 +509,10 @@ add_network(struct ospf_area *oa, ip_addr px, int pxlen, int metric, struct top_
 
     struct ospf_iface *ifa;
     ifa = ospf_is_v2(p) ? rt_pos_to_ifa(oa, pos) : px_pos_to_ifa(oa, pos);
-    nf.nhs = ifa ? new_nexthop(p, IPA_NONE, ifa->iface, ifa->ecmp_weight) : NULL;
+    nf.nhs = ifa ? new_nexthop(oa, IPA_NONE, ifa->iface, ifa->ecmp_weight) : NULL;
   }
 
-  ri_install_net(p, px, pxlen, &nf);
+  spfa_install_net(oa, px, pxlen, &nf);
 }
 
 
@@ -477,7 +548,7 @@ spfa_process_rt(struct ospf_proto *p, struct ospf_area *oa, struct top_hash_entr
       .oa = oa,
       .nhs = act->nhs
     };
-    ri_install_rt(oa, act->lsa.rt, &nf);
+    spfa_install_rt(oa, act->lsa.rt, &nf);
   }
 
   /* Errata 2078 to RFC 5340 4.8.1 - skip links from non-routing nodes */
@@ -518,7 +589,7 @@ spfa_process_rt(struct ospf_proto *p, struct ospf_area *oa, struct top_hash_entr
       break;
     }
 
-    add_cand(&oa->cand, tmp, act, act->dist + rtl.metric, oa, i);
+    add_cand(oa, tmp, act, act->dist + rtl.metric, i);
   }
 }
 
@@ -541,7 +612,7 @@ spfa_process_net(struct ospf_proto *p, struct ospf_area *oa, struct top_hash_ent
   for (i = 0; i < cnt; i++)
   {
     tmp = ospf_hash_find_rt(p->gr, oa->areaid, ln->routers[i]);
-    add_cand(&oa->cand, tmp, act, act->dist, oa, -1);
+    add_cand(oa, tmp, act, act->dist, -1);
   }
 }
 
@@ -603,13 +674,28 @@ spfa_process_prefixes(struct ospf_proto *p, struct ospf_area *oa)
   }
 }
 
+/*
+ * Candidates are kept in a binary heap ordered by distance. Among candidates
+ * with the same distance, networks precede routers (see add_cand()), networks
+ * are taken in the order of insertion and routers in the reverse order. The
+ * rank encoding that order is assigned from oa->cand_seq during insertion.
+ */
+#define CAND_LESS(a,b) (((a)->dist < (b)->dist) ||			\
+  (((a)->dist == (b)->dist) && ((a)->cand_rank < (b)->cand_rank)))
+
+#define CAND_SWAP(heap,a,b,t) (t = heap[a], heap[a] = heap[b], heap[b] = t,	\
+  heap[a]->cand_pos = (a), heap[b]->cand_pos = (b))
+
+static inline uint cand_count(struct ospf_area *oa)
+{ return oa->cand.used - 1; }
+
 /* RFC 2328 16.1. calculating shortest paths for an area */
 static void
 ospf_rt_spfa(struct ospf_area *oa)
 {
   struct ospf_proto *p = oa->po;
   struct top_hash_entry *act;
-  node *n;
+  uint cnt;
 
   if (oa->rt == NULL)
     return;
@@ -619,22 +705,26 @@ ospf_rt_spfa(struct ospf_area *oa)
   OSPF_TRACE(D_EVENTS, "Starting routing table calculation for area %R", oa->areaid);
 
   /* 16.1. (1) */
-  init_list(&oa->cand);		/* Empty list of candidates */
+  BUFFER_FLUSH(oa->cand);	/* Empty heap of candidates */
+  BUFFER_PUSH(oa->cand) = NULL;	/* Heap is indexed from 1 */
+  oa->cand_seq = 0;
   oa->trcap = 0;
 
   DBG("LSA db prepared, adding me into candidate list.\n");
 
   oa->rt->dist = 0;
   oa->rt->color = CANDIDATE;
-  add_head(&oa->cand, &oa->rt->cn);
+  oa->rt->cand_rank = 0;
+  oa->rt->cand_pos = 1;
+  BUFFER_PUSH(oa->cand) = oa->rt;
   DBG("RT LSA: rt: %R, id: %R, type: %u\n",
       oa->rt->lsa.rt, oa->rt->lsa.id, oa->rt->lsa_type);
 
-  while (!EMPTY_LIST(oa->cand))
+  while ((cnt = cand_count(oa)) > 0)
   {
-    n = HEAD(oa->cand);
-    act = SKIP_BACK(struct top_hash_entry, cn, n);
-    rem_node(n);
+    act = oa->cand.data[1];
+    HEAP_DELMIN(oa->cand.data, cnt, struct top_hash_entry *, CAND_LESS, CAND_SWAP);
+    BUFFER_POP(oa->cand);
 
     DBG("Working on LSA: rt: %R, id: %R, type: %u\n",
 	act->lsa.rt, act->lsa.id, act->lsa_type);
@@ -659,6 +749,83 @@ ospf_rt_spfa(struct ospf_area *oa)
     spfa_process_prefixes(p, oa);
 }
 
+static void
+ospf_rt_spfa_job(void *data, uint i)
+{
+  struct ospf_area **areas = data;
+  ospf_rt_spfa(areas[i]);
+}
+
+static int
+spf_size_cmp(const void *A, const void *B)
+{
+  const struct ospf_area *a = *(const struct ospf_area **) A;
+  const struct ospf_area *b = *(const struct ospf_area **) B;
+
+  /* Larger areas first */
+  return (a->spf_size < b->spf_size) - (a->spf_size > b->spf_size);
+}
+
+/*
+ * Area SPF reads just the LSA database and writes to top_hash_entry nodes of
+ * LSAs of the area, the heap of candidates and nexthops in the area nhpool.
+ * Therefore, areas may be computed in parallel by p->spf_workers, when the
+ * heaps of candidates are allocated in advance and results that would be
+ * installed to shared routing tables are deferred. They are installed after
+ * the computation in the area order, so the result is the same as when areas
+ * are computed in sequence.
+ */
+static void
+ospf_rt_spfa_parallel(struct ospf_proto *p)
+{
+  struct ospf_area *oa, *areas[p->areano];
+  struct top_hash_entry *en;
+  struct spf_result *res;
+  uint n = 0;
+
+  WALK_LIST(oa, p->area_list)
+  {
+    oa->spf_size = 0;
+    areas[n++] = oa;
+  }
+
+  /* Each node is added to the heap of candidates at most once */
+  oa = NULL;
+  WALK_SLIST(en, p->lsal)
+    if ((en->lsa_type == LSA_T_RT) || (en->lsa_type == LSA_T_NET))
+    {
+      if (!oa || (oa->areaid != en->domain))
+	oa = ospf_find_area(p, en->domain);
+
+      if (oa)
+	oa->spf_size++;
+    }
+
+  WALK_LIST(oa, p->area_list)
+  {
+    BUFFER_SET(oa->cand, oa->spf_size + 1);
+    BUFFER_FLUSH(oa->cand);
+    oa->spf_res = NULL;
+    oa->spf_res_end = &oa->spf_res;
+    oa->spf_deferred = 1;
+  }
+
+  qsort(areas, n, sizeof(struct ospf_area *), spf_size_cmp);
+  wp_run(p->spf_workers, ospf_rt_spfa_job, areas, n);
+
+  WALK_LIST(oa, p->area_list)
+  {
+    for (res = oa->spf_res; res; res = res->next)
+      if (res->pxlen < 0)
+	ri_install_rt(oa, res->rid, &res->nf);
+      else
+	ri_install_net(p, res->prefix, res->pxlen, &res->nf);
+
+    oa->spf_deferred = 0;
+    lp_flush(oa->spf_pool);
+  }
+}
+
 static int
 link_back(struct ospf_area *oa, struct top_hash_entry *en, struct top_hash_entry *par)
 {
@@ -1399,20 +1566,189 @@ ospf_fib_route(struct fib *f, ip_addr a, int len)
   return NULL;
 }
 
-/* RFC 2328 16.4. calculating external routes */
+/*
+ * RFC 2328 16.4. calculating external routes
+ *
+ * The calculation is split to two passes. The first one collects AS-external
+ * and NSSA LSAs and groups them by the ASBR and the area of its entry, so the
+ * ASBR is looked up and checked just once per group. The second one computes
+ * routes for the LSAs in chunks of OSPF_EXT_CHUNK LSAs, in parallel by
+ * p->spf_workers when available. It just reads LSAs and routing tables, the
+ * routes are stored in the jobs and installed to p->rtf afterwards in the order
+ * of LSAs. Therefore forwarding addresses are always resolved by internal
+ * routes, regardless of the order of LSAs.
+ */
+#define OSPF_EXT_CHUNK	1024
+
+#define EAH_KEY(n)		n->oa, n->rid
+#define EAH_NEXT(n)		n->next
+#define EAH_EQ(o1,r1,o2,r2)	o1 == o2 && r1 == r2
+#define EAH_FN(o,r)		u32_hash(r ^ o->areaid)
+
+#define EAH_REHASH		ospf_ext_asbr_rehash
+#define EAH_PARAMS		/8, *2, 2, 2, 6, 20
+
+HASH_DEFINE_REHASH_FN(EAH, struct ospf_ext_asbr)
+
+static struct ospf_ext_asbr *
+ospf_ext_get_asbr(struct ospf_proto *p, struct ospf_area *oa, u32 rid)
+{
+  struct ospf_ext_asbr *a = HASH_FIND(p->ext_asbrs, EAH, oa, rid);
+  ip_addr rtid;
+  ort *nf;
+
+  if (a)
+    return a;
+
+  rtid = ipa_from_rid(rid);
+  nf = fib_find(&oa->rtr, &rtid, MAX_PREFIX_LENGTH);
+
+  a = lp_alloc(p->ext_nhpool, sizeof(struct ospf_ext_asbr));
+  a->oa = oa;
+  a->rid = rid;
+
+  /* No AS boundary router found, or it is not ASBR */
+  a->nf = (nf && nf->n.type && (nf->n.options & ORTA_ASBR)) ? nf : NULL;
+
+  HASH_INSERT2(p->ext_asbrs, EAH, p->p.pool, a);
+  return a;
+}
+
 static void
-ospf_ext_spf(struct ospf_proto *p)
+ospf_ext_spf_lsa(struct ospf_proto *p, struct ospf_ext_job *job)
 {
-  struct top_hash_entry *en;
+  struct top_hash_entry *en = job->en;
+  struct ospf_area *atmp = job->asbr->oa;
   struct ospf_lsa_ext_local rt;
-  ort *nf1, *nf2;
-  orta nfa = {};
-  ip_addr rtid;
+  orta *nfa = &job->nfa;
+  ort *nf1 = job->asbr->nf;
+  ort *nf2;
   u32 br_metric;
+
+  job->pxlen = -1;
+  lsa_parse_ext(en, ospf_is_v2(p), &rt);
+
+  if (rt.metric == LSINFINITY)
+    return;
+
+  if (rt.pxopts & OPT_PX_NU)
+    return;
+
+  if (rt.pxlen < 0 || rt.pxlen > MAX_PREFIX_LENGTH)
+  {
+    log(L_WARN "%s: Invalid prefix in LSA (Type: %04x, Id: %R, Rt: %R)",
+	p->p.name, en->lsa_type, en->lsa.id, en->lsa.rt);
+    return;
+  }
+
+  /* 16.4. (3) NSSA - special rule for default routes */
+  /* ABR should use default only if P-bit is set and summaries are active */
+  if ((en->lsa_type == LSA_T_NSSA) && ipa_zero(rt.ip) && (rt.pxlen == 0) &&
+      (p->areano > 1) && !(rt.propagate && atmp->ac->summary))
+    return;
+
+  memset(nfa, 0, sizeof(orta));
+
+  if (!rt.fbit)
+  {
+    nf2 = nf1;
+    nfa->nhs = nf1->n.nhs;
+    br_metric = nf1->n.metric1;
+  }
+  else
+  {
+    nf2 = ospf_fib_route(&p->rtf, rt.fwaddr, MAX_PREFIX_LENGTH);
+    if (!nf2)
+      return;
+
+    if (en->lsa_type == LSA_T_EXT)
+    {
+      /* For ext routes, we accept intra-area or inter-area routes */
+      if ((nf2->n.type != RTS_OSPF) && (nf2->n.type != RTS_OSPF_IA))
+	return;
+    }
+    else /* NSSA */
+    {
+      /* For NSSA routes, we accept just intra-area in the same area */
+      if ((nf2->n.type != RTS_OSPF) || (nf2->n.oa != atmp))
+	return;
+    }
+
+    /* Next-hop is a part of a configured stubnet */
+    if (!nf2->n.nhs)
+      return;
+
+    nfa->nhs = nf2->n.nhs;
+    br_metric = nf2->n.metric1;
+
+    /* Device nexthops are replaced with nexthops to forwarding address from
+       LSA later, as they are allocated from the shared ext_nhpool */
+    job->fix_nhs = has_device_nexthops(nfa->nhs);
+    job->fwaddr = rt.fwaddr;
+  }
+
+  if (rt.ebit)
+  {
+    nfa->type = RTS_OSPF_EXT2;
+    nfa->metric1 = br_metric;
+    nfa->metric2 = rt.metric;
+  }
+  else
+  {
+    nfa->type = RTS_OSPF_EXT1;
+    nfa->metric1 = br_metric + rt.metric;
+    nfa->metric2 = LSINFINITY;
+  }
+
+  /* Mark the LSA as reachable */
+  en->color = INSPF;
+
+  /* Whether the route is preferred in route selection according to 16.4.1 */
+  nfa->options = epath_preferred(&nf2->n) ? ORTA_PREF : 0;
+  if (en->lsa_type == LSA_T_NSSA)
+  {
+    nfa->options |= ORTA_NSSA;
+    if (rt.propagate)
+      nfa->options |= ORTA_PROP;
+  }
+
+  nfa->tag = rt.tag;
+  nfa->rid = en->lsa.rt;
+  nfa->oa = atmp; /* undefined in RFC 2328 */
+  nfa->en = en; /* store LSA for later (NSSA processing) */
+
+  job->prefix = rt.ip;
+  job->pxlen = rt.pxlen;
+}
+
+static void
+ospf_ext_spf_job(void *data, uint i)
+{
+  struct ospf_proto *p = data;
+  uint pos = i * OSPF_EXT_CHUNK;
+  uint end = MIN(pos + OSPF_EXT_CHUNK, p->ext_jobs.used);
+
+  for (; pos < end; pos++)
+    ospf_ext_spf_lsa(p, &p->ext_jobs.data[pos]);
+}
+
+static void
+ospf_ext_spf(struct ospf_proto *p)
+{
+  struct top_hash_entry *en;
+  struct ospf_ext_job *job;
+  struct ospf_ext_asbr *asbr;
   struct ospf_area *atmp;
+  uint i, chunks;
 
   OSPF_TRACE(D_EVENTS, "Starting routing table calculation for ext routes");
 
+  /* All external routes are recomputed, so their old next hops can go */
+  lp_flush(p->ext_nhpool);
+  memset(p->ext_asbrs.data, 0, HASH_SIZE(p->ext_asbrs) * sizeof(struct ospf_ext_asbr *));
+  p->ext_asbrs.count = 0;
+  BUFFER_FLUSH(p->ext_jobs);
+
   WALK_SLIST(en, p->lsal)
   {
     /* 16.4. (1) */
@@ -1429,22 +1765,6 @@ ospf_ext_spf(struct ospf_proto *p)
     DBG("%s: Working on LSA. ID: %R, RT: %R, Type: %u\n",
 	p->p.name, en->lsa.id, en->lsa.rt, en->lsa_type);
 
-    lsa_parse_ext(en, ospf_is_v2(p), &rt);
-
-    if (rt.metric == LSINFINITY)
-      continue;
-
-    if (rt.pxopts & OPT_PX_NU)
-      continue;
-
-    if (rt.pxlen < 0 || rt.pxlen > MAX_PREFIX_LENGTH)
-    {
-      log(L_WARN "%s: Invalid prefix in LSA (Type: %04x, Id: %R, Rt: %R)",
-	  p->p.name, en->lsa_type, en->lsa.id, en->lsa.rt);
-      continue;
-    }
-
-
     /* 16.4. (3) */
     /* If there are more areas, we already precomputed preferred ASBR
        entries in ospf_rt_abr1() and stored them in the backbone
@@ -1457,92 +1777,38 @@ ospf_ext_spf(struct ospf_proto *p)
     if (!atmp)
       continue;			/* Should not happen */
 
-    rtid = ipa_from_rid(en->lsa.rt);
-    nf1 = fib_find(&atmp->rtr, &rtid, MAX_PREFIX_LENGTH);
-
-    if (!nf1 || !nf1->n.type)
-      continue;			/* No AS boundary router found */
-
-    if (!(nf1->n.options & ORTA_ASBR))
-      continue;			/* It is not ASBR */
-
-    /* 16.4. (3) NSSA - special rule for default routes */
-    /* ABR should use default only if P-bit is set and summaries are active */
-    if ((en->lsa_type == LSA_T_NSSA) && ipa_zero(rt.ip) && (rt.pxlen == 0) &&
-	(p->areano > 1) && !(rt.propagate && atmp->ac->summary))
+    asbr = ospf_ext_get_asbr(p, atmp, en->lsa.rt);
+    if (!asbr->nf)
       continue;
 
-    if (!rt.fbit)
-    {
-      nf2 = nf1;
-      nfa.nhs = nf1->n.nhs;
-      br_metric = nf1->n.metric1;
-    }
-    else
-    {
-      nf2 = ospf_fib_route(&p->rtf, rt.fwaddr, MAX_PREFIX_LENGTH);
-      if (!nf2)
-	continue;
-
-      if (en->lsa_type == LSA_T_EXT)
-      {
-	/* For ext routes, we accept intra-area or inter-area routes */
-	if ((nf2->n.type != RTS_OSPF) && (nf2->n.type != RTS_OSPF_IA))
-	  continue;
-      }
-      else /* NSSA */
-      {
-	/* For NSSA routes, we accept just intra-area in the same area */
-	if ((nf2->n.type != RTS_OSPF) || (nf2->n.oa != atmp))
-	  continue;
-      }
-
-      /* Next-hop is a part of a configured stubnet */
-      if (!nf2->n.nhs)
-	continue;
+    job = BUFFER_INC(p->ext_jobs, 1);
+    job->en = en;
+    job->asbr = asbr;
+    job->fix_nhs = 0;
+  }
 
-      nfa.nhs = nf2->n.nhs;
-      br_metric = nf2->n.metric1;
+  chunks = (p->ext_jobs.used + OSPF_EXT_CHUNK - 1) / OSPF_EXT_CHUNK;
 
-      /* Replace device nexthops with nexthops to forwarding address from LSA */
-      if (has_device_nexthops(nfa.nhs))
-      {
-	nfa.nhs = fix_device_nexthops(p, nfa.nhs, rt.fwaddr);
-	nfa.nhs_reuse = 1;
-      }
-    }
+  if (p->spf_workers)
+    wp_run(p->spf_workers, ospf_ext_spf_job, p, chunks);
+  else
+    for (i = 0; i < chunks; i++)
+      ospf_ext_spf_job(p, i);
 
-    if (rt.ebit)
-    {
-      nfa.type = RTS_OSPF_EXT2;
-      nfa.metric1 = br_metric;
-      nfa.metric2 = rt.metric;
-    }
-    else
-    {
-      nfa.type = RTS_OSPF_EXT1;
-      nfa.metric1 = br_metric + rt.metric;
-      nfa.metric2 = LSINFINITY;
-    }
+  for (i = 0; i < p->ext_jobs.used; i++)
+  {
+    job = &p->ext_jobs.data[i];
 
-    /* Mark the LSA as reachable */
-    en->color = INSPF;
+    if (job->pxlen < 0)
+      continue;
 
-    /* Whether the route is preferred in route selection according to 16.4.1 */
-    nfa.options = epath_preferred(&nf2->n) ? ORTA_PREF : 0;
-    if (en->lsa_type == LSA_T_NSSA)
+    if (job->fix_nhs)
     {
-      nfa.options |= ORTA_NSSA;
-      if (rt.propagate)
-	nfa.options |= ORTA_PROP;
+      job->nfa.nhs = fix_device_nexthops(p, job->nfa.nhs, job->fwaddr);
+      job->nfa.nhs_reuse = 1;
     }
 
-    nfa.tag = rt.tag;
-    nfa.rid = en->lsa.rt;
-    nfa.oa = atmp; /* undefined in RFC 2328 */
-    nfa.en = en; /* store LSA for later (NSSA processing) */
-
-    ri_install_ext(p, rt.ip, rt.pxlen, &nfa);
+    ri_install_ext(p, job->prefix, job->pxlen, &job->nfa);
   }
 }
 
@@ -1608,6 +1874,50 @@ ospf_rt_reset(struct ospf_proto *p)
   }
 }
 
+/* Cleanup of external routes and data for partial calculation */
+static void
+ospf_rt_reset_ext(struct ospf_proto *p)
+{
+  struct top_hash_entry *en;
+  ort *ri;
+
+  FIB_WALK(&p->rtf, nftmp)
+  {
+    ri = (ort *) nftmp;
+    if ((ri->n.type == RTS_OSPF_EXT1) || (ri->n.type == RTS_OSPF_EXT2))
+    {
+      reset_ri(ri);
+      ort_mark_dirty(p, ri);
+    }
+  }
+  FIB_WALK_END;
+
+  WALK_SLIST(en, p->lsal)
+    if (en->lsa_type == LSA_T_EXT)
+      en->color = OUTSPF;
+}
+
+/*
+ * RFC 2328 16.5. - when just AS-external-LSAs changed, intra-area and
+ * inter-area routes stay the same and only external routes are recomputed.
+ * With NSSA areas, external routes are also involved in type-7 translation
+ * and area border router procedures, so we do the full calculation there.
+ */
+static int
+ospf_rt_ext_only(struct ospf_proto *p)
+{
+  struct ospf_area *oa;
+
+  if (!p->calcrt_ext || (p->calcrt == 2))
+    return 0;
+
+  WALK_LIST(oa, p->area_list)
+    if (oa_is_nssa(oa))
+      return 0;
+
+  return 1;
+}
+
 /**
  * ospf_rt_spf - calculate internal routes
  * @p: OSPF protocol instance
@@ -1615,6 +1925,15 @@ ospf_rt_reset(struct ospf_proto *p)
  * Calculation of internal paths in an area is described in 16.1 of RFC 2328.
  * It's based on Dijkstra's shortest path tree algorithms.
  * This function is invoked from ospf_disp().
+ *
+ * When only AS-external-LSAs changed since the last calculation (see
+ * ospf_schedule_rtcalc_ext()), only external routes are recomputed. Next hops
+ * of internal routes are therefore kept in @nhpool and area nhpools until the
+ * next full calculation, while next hops of external routes are in separate
+ * @ext_nhpool.
+ *
+ * With the &spf threads option, SPF for areas is computed in parallel, see
+ * ospf_rt_spfa_parallel().
  */
 void
 ospf_rt_spf(struct ospf_proto *p)
@@ -1624,14 +1943,31 @@ ospf_rt_spf(struct ospf_proto *p)
   if (p->areano == 0)
     return;
 
+  PROBE2(ospf_rt_spf_entry, p->p.name, p->calcrt_ext);
+
+  if (ospf_rt_ext_only(p))
+  {
+    ospf_rt_reset_ext(p);
+    ospf_ext_spf(p);
+    rt_sync_dirty(p);
+    goto done;
+  }
+
   OSPF_TRACE(D_EVENTS, "Starting routing table calculation");
 
   /* 16. (1) */
   ospf_rt_reset(p);
+  lp_flush(p->nhpool);
 
-  /* 16. (2) */
   WALK_LIST(oa, p->area_list)
-    ospf_rt_spfa(oa);
+    lp_flush(oa->nhpool);
+
+  /* 16. (2) */
+  if (p->spf_workers && (p->areano > 1))
+    ospf_rt_spfa_parallel(p);
+  else
+    WALK_LIST(oa, p->area_list)
+      ospf_rt_spfa(oa);
 
   /* 16. (3) */
   ospf_rt_sum(ospf_main_area(p));
@@ -1651,9 +1987,12 @@ ospf_rt_spf(struct ospf_proto *p)
     ospf_rt_abr2(p);
 
   rt_sync(p);
-  lp_flush(p->nhpool);
 
+ done:
   p->calcrt = 0;
+  p->calcrt_ext = 0;
+
+  PROBE1(ospf_rt_spf_return, p->p.name);
 }
 
 
@@ -1695,7 +2034,7 @@ calc_next_hop(struct ospf_area *oa, struct top_hash_entry *en,
     if (!ifa)
       return NULL;
 
-    return new_nexthop(p, IPA_NONE, ifa->iface, ifa->ecmp_weight);
+    return new_nexthop(oa, IPA_NONE, ifa->iface, ifa->ecmp_weight);
   }
 
   /* The second case - ptp or ptmp neighbor */
@@ -1706,13 +2045,13 @@ calc_next_hop(struct ospf_area *oa, struct top_hash_entry *en,
       return NULL;
 
     if (ifa->type == OSPF_IT_VLINK)
-      return new_nexthop(p, IPA_NONE, NULL, 0);
+      return new_nexthop(oa, IPA_NONE, NULL, 0);
 
     struct ospf_neighbor *m = find_neigh(ifa, rid);
     if (!m || (m->state != NEIGHBOR_FULL))
       return NULL;
 
-    return new_nexthop(p, m->ip, ifa->iface, ifa->ecmp_weight);
+    return new_nexthop(oa, m->ip, ifa->iface, ifa->ecmp_weight);
   }
 
   /* The third case - bcast or nbma neighbor */
@@ -1731,7 +2070,7 @@ calc_next_hop(struct ospf_area *oa, struct top_hash_entry *en,
       if (ipa_zero(en->lb))
 	goto bad;
 
-      return new_nexthop(p, en->lb, pn->iface, pn->weight);
+      return new_nexthop(oa, en->lb, pn->iface, pn->weight);
     }
     else /* OSPFv3 */
     {
@@ -1750,7 +2089,7 @@ calc_next_hop(struct ospf_area *oa, struct top_hash_entry *en,
       if (ip6_zero(llsa->lladdr))
 	return NULL;
 
-      return new_nexthop(p, ipa_from_ip6(llsa->lladdr), pn->iface, pn->weight);
+      return new_nexthop(oa, ipa_from_ip6(llsa->lladdr), pn->iface, pn->weight);
     }
   }
 
@@ -1761,15 +2100,14 @@ calc_next_hop(struct ospf_area *oa, struct top_hash_entry *en,
 }
 
 
-/* Add LSA into list of candidates in Dijkstra's algorithm */
+/* Add LSA into heap of candidates in Dijkstra's algorithm */
 static void
-add_cand(list * l, struct top_hash_entry *en, struct top_hash_entry *par,
-	 u32 dist, struct ospf_area *oa, int pos)
+add_cand(struct ospf_area *oa, struct top_hash_entry *en,
+	 struct top_hash_entry *par, u32 dist, int pos)
 {
   struct ospf_proto *p = oa->po;
-  node *prev, *n;
-  int added = 0;
-  struct top_hash_entry *act;
+  u32 old_dist, old_rank;
+  uint cnt;
 
   /* 16.1. (2b) */
   if (en == NULL)
@@ -1835,7 +2173,7 @@ add_cand(list * l, struct top_hash_entry *en, struct top_hash_entry *par,
 
     /* Merge old and new */
     int new_reuse = (par->nhs != nhs);
-    en->nhs = mpnh_merge(en->nhs, nhs, en->nhs_reuse, new_reuse, p->ecmp, p->nhpool);
+    en->nhs = mpnh_merge(en->nhs, nhs, en->nhs_reuse, new_reuse, p->ecmp, oa->nhpool);
     en->nhs_reuse = 1;
     return;
   }
@@ -1843,44 +2181,32 @@ add_cand(list * l, struct top_hash_entry *en, struct top_hash_entry *par,
   DBG("     Adding candidate: rt: %R, id: %R, type: %u\n",
       en->lsa.rt, en->lsa.id, en->lsa_type);
 
-  if (en->color == CANDIDATE)
-  {				/* We found a shorter path */
-    rem_node(&en->cn);
-  }
+  old_dist = en->dist;
+  old_rank = en->cand_rank;
+
   en->nhs = nhs;
   en->dist = dist;
-  en->color = CANDIDATE;
   en->nhs_reuse = (par->nhs != nhs);
 
-  prev = NULL;
+  /* 16.1. (3) - networks are chosen before routers with the same distance */
+  oa->cand_seq++;
+  en->cand_rank = (en->lsa_type == LSA_T_NET) ? oa->cand_seq : ~oa->cand_seq;
 
-  if (EMPTY_LIST(*l))
-  {
-    add_head(l, &en->cn);
-  }
-  else
-  {
-    WALK_LIST(n, *l)
-    {
-      act = SKIP_BACK(struct top_hash_entry, cn, n);
-      if ((act->dist > dist) ||
-	  ((act->dist == dist) && (act->lsa_type == LSA_T_RT)))
-      {
-	if (prev == NULL)
-	  add_head(l, &en->cn);
-	else
-	  insert_node(&en->cn, prev);
-	added = 1;
-	break;
-      }
-      prev = n;
-    }
+  cnt = cand_count(oa);
 
-    if (!added)
-    {
-      add_tail(l, &en->cn);
-    }
+  if (en->color == CANDIDATE)
+  {				/* We found a shorter path */
+    if ((dist < old_dist) || ((dist == old_dist) && (en->cand_rank < old_rank)))
+      HEAP_DECREASE(oa->cand.data, cnt, struct top_hash_entry *, CAND_LESS, CAND_SWAP, en->cand_pos);
+    else
+      HEAP_INCREASE(oa->cand.data, cnt, struct top_hash_entry *, CAND_LESS, CAND_SWAP, en->cand_pos);
+    return;
   }
+
+  en->color = CANDIDATE;
+  en->cand_pos = ++cnt;
+  BUFFER_PUSH(oa->cand) = en;
+  HEAP_INSERT(oa->cand.data, cnt, struct top_hash_entry *, CAND_LESS, CAND_SWAP);
 }
 
 static inline int
@@ -1895,103 +2221,121 @@ ort_changed(ort *nf, rta *nr)
     !mpnh_same(nr->nexthops, or->nexthops);
 }
 
+/*
+ * Propagate rt entry @nf to the routing table, if it changed since the last
+ * update. Returns 1 if the entry is no longer needed and may be removed.
+ */
+static int
+rt_sync_ort(struct ospf_proto *p, struct rte_batch *batch, ort *nf, int reload)
+{
+  /* Sanity check of next-hop addresses, failure should not happen */
+  if (nf->n.type)
+  {
+    struct mpnh *nh;
+    for (nh = nf->n.nhs; nh; nh = nh->next)
+      if (ipa_nonzero(nh->gw))
+      {
+	neighbor *ng = neigh_find2(&p->p, &nh->gw, nh->iface, 0);
+	if (!ng || (ng->scope == SCOPE_HOST))
+	  { reset_ri(nf); break; }
+      }
+  }
+
+  /* Remove configured stubnets */
+  if (!nf->n.nhs)
+    reset_ri(nf);
+
+  if (nf->n.type) /* Add the route */
+  {
+    rta a0 = {
+      .src = p->p.main_source,
+      .source = nf->n.type,
+      .scope = SCOPE_UNIVERSE,
+      .cast = RTC_UNICAST
+    };
+
+    if (nf->n.nhs->next)
+    {
+      a0.dest = RTD_MULTIPATH;
+      a0.nexthops = nf->n.nhs;
+    }
+    else if (ipa_nonzero(nf->n.nhs->gw))
+    {
+      a0.dest = RTD_ROUTER;
+      a0.iface = nf->n.nhs->iface;
+      a0.gw = nf->n.nhs->gw;
+    }
+    else
+    {
+      a0.dest = RTD_DEVICE;
+      a0.iface = nf->n.nhs->iface;
+    }
+
+    if (reload || ort_changed(nf, &a0))
+    {
+      net *ne = net_get(p->p.table, nf->fn.prefix, nf->fn.pxlen);
+      rta *a = rta_lookup(&a0);
+      rte *e = rte_get_temp(a);
+
+      rta_free(nf->old_rta);
+      nf->old_rta = rta_clone(a);
+      e->u.ospf.metric1 = nf->old_metric1 = nf->n.metric1;
+      e->u.ospf.metric2 = nf->old_metric2 = nf->n.metric2;
+      e->u.ospf.tag = nf->old_tag = nf->n.tag;
+      e->u.ospf.router_id = nf->old_rid = nf->n.rid;
+      e->pflags = 0;
+      e->net = ne;
+      e->pref = p->p.preference;
+
+      DBG("Mod rte type %d - %I/%d via %I on iface %s, met %d\n",
+	  a0.source, nf->fn.prefix, nf->fn.pxlen, a0.gw, a0.iface ? a0.iface->name : "(none)", nf->n.metric1);
+      rte_batch_update(batch, ne, e, p->p.main_source);
+    }
+  }
+  else if (nf->old_rta)
+  {
+    /* Remove the route */
+    rta_free(nf->old_rta);
+    nf->old_rta = NULL;
+
+    net *ne = net_get(p->p.table, nf->fn.prefix, nf->fn.pxlen);
+    rte_batch_update(batch, ne, NULL, p->p.main_source);
+  }
+
+  /* Remove unused rt entry, some special entries are persistent */
+  return !nf->n.type && !nf->external_rte && !nf->area_net;
+}
+
 static void
 rt_sync(struct ospf_proto *p)
 {
   struct top_hash_entry *en;
   struct fib_iterator fit;
   struct fib *fib = &p->rtf;
+  struct rte_batch batch;
   ort *nf;
   struct ospf_area *oa;
+  uint i;
 
   /* This is used for forced reload of routes */
   int reload = (p->calcrt == 2);
 
   OSPF_TRACE(D_EVENTS, "Starting routing table synchronisation");
 
+  /* All entries are examined, forget the changed ones */
+  for (i = 0; i < p->rt_dirty.used; i++)
+    p->rt_dirty.data[i]->dirty = 0;
+  BUFFER_FLUSH(p->rt_dirty);
+
   DBG("Now syncing my rt table with nest's\n");
+  rte_batch_start(&batch, p->p.main_ahook);
   FIB_ITERATE_INIT(&fit, fib);
 again1:
   FIB_ITERATE_START(fib, &fit, nftmp)
   {
     nf = (ort *) nftmp;
 
-    /* Sanity check of next-hop addresses, failure should not happen */
-    if (nf->n.type)
-    {
-      struct mpnh *nh;
-      for (nh = nf->n.nhs; nh; nh = nh->next)
-	if (ipa_nonzero(nh->gw))
-	{
-	  neighbor *ng = neigh_find2(&p->p, &nh->gw, nh->iface, 0);
-	  if (!ng || (ng->scope == SCOPE_HOST))
-	    { reset_ri(nf); break; }
-	}
-    }
-
-    /* Remove configured stubnets */
-    if (!nf->n.nhs)
-      reset_ri(nf);
-
-    if (nf->n.type) /* Add the route */
-    {
-      rta a0 = {
-	.src = p->p.main_source,
-	.source = nf->n.type,
-	.scope = SCOPE_UNIVERSE,
-	.cast = RTC_UNICAST
-      };
-
-      if (nf->n.nhs->next)
-      {
-	a0.dest = RTD_MULTIPATH;
-	a0.nexthops = nf->n.nhs;
-      }
-      else if (ipa_nonzero(nf->n.nhs->gw))
-      {
-	a0.dest = RTD_ROUTER;
-	a0.iface = nf->n.nhs->iface;
-	a0.gw = nf->n.nhs->gw;
-      }
-      else
-      {
-	a0.dest = RTD_DEVICE;
-	a0.iface = nf->n.nhs->iface;
-      }
-
-      if (reload || ort_changed(nf, &a0))
-      {
-	net *ne = net_get(p->p.table, nf->fn.prefix, nf->fn.pxlen);
-	rta *a = rta_lookup(&a0);
-	rte *e = rte_get_temp(a);
-
-	rta_free(nf->old_rta);
-	nf->old_rta = rta_clone(a);
-	e->u.ospf.metric1 = nf->old_metric1 = nf->n.metric1;
-	e->u.ospf.metric2 = nf->old_metric2 = nf->n.metric2;
-	e->u.ospf.tag = nf->old_tag = nf->n.tag;
-	e->u.ospf.router_id = nf->old_rid = nf->n.rid;
-	e->pflags = 0;
-	e->net = ne;
-	e->pref = p->p.preference;
-
-	DBG("Mod rte type %d - %I/%d via %I on iface %s, met %d\n",
-	    a0.source, nf->fn.prefix, nf->fn.pxlen, a0.gw, a0.iface ? a0.iface->name : "(none)", nf->n.metric1);
-	rte_update(&p->p, ne, e);
-      }
-    }
-    else if (nf->old_rta)
-    {
-      /* Remove the route */
-      rta_free(nf->old_rta);
-      nf->old_rta = NULL;
-
-      net *ne = net_get(p->p.table, nf->fn.prefix, nf->fn.pxlen);
-      rte_update(&p->p, ne, NULL);
-    }
-
-    /* Remove unused rt entry, some special entries are persistent */
-    if (!nf->n.type && !nf->external_rte && !nf->area_net)
+    if (rt_sync_ort(p, &batch, nf, reload))
     {
       FIB_ITERATE_PUT(&fit, nftmp);
       fib_delete(fib, nftmp);
@@ -1999,6 +2343,7 @@ again1:
     }
   }
   FIB_ITERATE_END(nftmp);
+  rte_batch_end(&batch);
 
 
   WALK_LIST(oa, p->area_list)
@@ -2025,3 +2370,33 @@ again2:
     if (en->mode == LSA_M_STALE)
       ospf_flush_lsa(p, en);
 }
+
+/*
+ * Like rt_sync(), but after the partial calculation, when only entries from
+ * p->rt_dirty could have changed. Other entries and the ASBR tables are kept
+ * as they are and no LSAs get stale, so the work is proportional to the
+ * number of changed routes.
+ */
+static void
+rt_sync_dirty(struct ospf_proto *p)
+{
+  struct rte_batch batch;
+  ort *nf;
+  uint i;
+
+  OSPF_TRACE(D_EVENTS, "Starting routing table synchronisation of %u entries",
+	     p->rt_dirty.used);
+
+  rte_batch_start(&batch, p->p.main_ahook);
+  for (i = 0; i < p->rt_dirty.used; i++)
+  {
+    nf = p->rt_dirty.data[i];
+    nf->dirty = 0;
+
+    if (rt_sync_ort(p, &batch, nf, 0))
+      fib_delete(&p->rtf, nf);
+  }
+  rte_batch_end(&batch);
+
+  BUFFER_FLUSH(p->rt_dirty);
+}
@@ -84,12 +84,34 @@ typedef struct ort
   rta *old_rta;
   u8 external_rte;
   u8 area_net;
+  u8 dirty;			/* Entry is in p->rt_dirty */
 }
 ort;
 
 static inline int rt_is_nssa(ort *nf)
 { return nf->n.options & ORTA_NSSA; }
 
+/* ASBR of a group of AS-external LSAs, see ospf_ext_spf() */
+struct ospf_ext_asbr
+{
+  struct ospf_ext_asbr *next;
+  struct ospf_area *oa;		/* Area of the ASBR entry */
+  u32 rid;
+  ort *nf;			/* ASBR entry, NULL if it is not reachable */
+};
+
+/* AS-external LSA processed by ospf_ext_spf() and its computed route */
+struct ospf_ext_job
+{
+  struct top_hash_entry *en;
+  struct ospf_ext_asbr *asbr;
+  ip_addr prefix;
+  int pxlen;			/* -1 if there is no route */
+  u8 fix_nhs;			/* Device next hops are replaced by ones to fwaddr */
+  ip_addr fwaddr;
+  orta nfa;
+};
+
 
 /*
  * Invariants for structs top_hash_entry (nodes of LSA db)
@@ -16,17 +16,29 @@
 
 
 #define HASH_DEF_ORDER 6
-#define HASH_HI_MARK *4
-#define HASH_HI_STEP 2
-#define HASH_HI_MAX 16
-#define HASH_LO_MARK /5
-#define HASH_LO_STEP 2
-#define HASH_LO_MIN 8
+#define HASH_HI_MARK /4*3	/* Max ratio of used (live and deleted) slots */
+#define HASH_LO_MARK /16	/* Min ratio of live entries */
+#define HASH_REHASH_LOAD 4	/* Slots per live entry after rehash */
+#define HASH_MIGRATE_STEP 8	/* Slots migrated per update during rehash */
+#define HASH_DELETED ((struct top_hash_entry *) 1)
 
 static inline void * lsab_flush(struct ospf_proto *p);
 static inline void lsab_reset(struct ospf_proto *p);
 
 
+/*
+ * Each instance of a self-originated LSA is refreshed after LSRefreshTime
+ * shortened by a random jitter. LSAs originated together therefore drift apart
+ * with each refresh, instead of being refreshed (and flooded) in one burst
+ * every %LSREFRESHTIME. See ospf_update_lsadb() for refresh pacing.
+ */
+static inline void
+ospf_lsa_set_refresh(struct top_hash_entry *en)
+{
+  en->refresh_age = LSREFRESHTIME - (random_u32() % LSREFRESH_JITTER);
+}
+
+
 /**
  * ospf_install_lsa - install new LSA into database
  * @p: OSPF protocol instance
@@ -51,6 +63,7 @@ ospf_install_lsa(struct ospf_proto *p, struct ospf_lsa_header *lsa, u32 type, u3
   int change = 0;
 
   en = ospf_hash_get(p->gr, domain, lsa->id, lsa->rt, type);
+  ospf_dbdes_flush_summary(p);
 
   if (!SNODE_VALID(en))
     s_add_tail(&p->lsal, SNODE en);
@@ -71,6 +84,7 @@ ospf_install_lsa(struct ospf_proto *p, struct ospf_lsa_header *lsa, u32 type, u3
   en->lsa = *lsa;
   en->init_age = en->lsa.age;
   en->inst_time = now;
+  en->inst_ptime = precise_time();
 
   /*
    * We do not set en->mode. It is either default LSA_M_BASIC, or in a special
@@ -83,7 +97,7 @@ ospf_install_lsa(struct ospf_proto *p, struct ospf_lsa_header *lsa, u32 type, u3
 	     en->lsa_type, en->lsa.id, en->lsa.rt, en->lsa.sn, en->lsa.age);
 
   if (change)
-    ospf_schedule_rtcalc(p);
+    ospf_schedule_rtcalc_lsa(p, en);
 
   return en;
 }
@@ -110,6 +124,8 @@ ospf_advance_lsa(struct ospf_proto *p, struct top_hash_entry *en, struct ospf_ls
 {
   /* RFC 2328 13.4 */
 
+  ospf_dbdes_flush_summary(p);
+
   if (en && (en->lsa.age < LSA_MAXAGE))
   {
     if (lsa->sn != LSA_MAXSEQNO)
@@ -129,6 +145,7 @@ ospf_advance_lsa(struct ospf_proto *p, struct top_hash_entry *en, struct ospf_ls
       en->lsa.age = 0;
       en->init_age = 0;
       en->inst_time = now;
+      ospf_lsa_set_refresh(en);
       lsa_generate_checksum(&en->lsa, en->lsa_body);
 
       OSPF_TRACE(D_EVENTS, "Advancing LSA: Type: %04x, Id: %R, Rt: %R, Seq: %08x",
@@ -192,13 +209,42 @@ ospf_advance_lsa(struct ospf_proto *p, struct top_hash_entry *en, struct ospf_ls
 }
 
 
+/*
+ * Check whether MinLSInterval since the last origination of LSA @en passed.
+ * Without LSA throttling, it is the fixed %MINLSINTERVAL. With LSA throttling,
+ * it starts at lsa_hold and doubles (up to lsa_max) with each origination
+ * done within lsa_max from the previous one, see ospf_do_originate_lsa().
+ * If the interval did not pass, lsa_timer is set to retry the origination.
+ */
+static int
+ospf_lsa_interval_passed(struct ospf_proto *p, struct top_hash_entry *en)
+{
+  btime next, t;
+
+  if (!p->lsa_hold)
+    return (en->inst_time + MINLSINTERVAL) <= now;
+
+  next = en->inst_ptime + en->lsa_interval;
+  t = precise_time();
+
+  if (t >= next)
+    return 1;
+
+  if (!ptm_active(p->lsa_timer) || (p->lsa_timer->expires > next))
+    ptm_start(p->lsa_timer, next - t);
+
+  return 0;
+}
+
 static int
 ospf_do_originate_lsa(struct ospf_proto *p, struct top_hash_entry *en, void *lsa_body, u16 lsa_blen, u16 lsa_opts)
 {
   /* Enforce MinLSInterval */
-  if ((en->init_age == 0) && en->inst_time && ((en->inst_time + MINLSINTERVAL) > now))
+  if ((en->init_age == 0) && en->inst_time && !ospf_lsa_interval_passed(p, en))
     return 0;
 
+  ospf_dbdes_flush_summary(p);
+
   /* Handle wrapping sequence number */
   if (en->lsa.sn == LSA_MAXSEQNO)
   {
@@ -238,15 +284,29 @@ ospf_do_originate_lsa(struct ospf_proto *p, struct top_hash_entry *en, void *lsa
   en->lsa.age = 0;
   en->init_age = 0;
   en->inst_time = now;
+  ospf_lsa_set_refresh(en);
   lsa_generate_checksum(&en->lsa, en->lsa_body);
 
+  if (p->lsa_hold)
+  {
+    btime t = precise_time();
+
+    /* Exponential backoff of MinLSInterval, reset after a stable period */
+    if (!en->lsa_interval || ((t - en->inst_ptime) >= p->lsa_max))
+      en->lsa_interval = p->lsa_hold;
+    else
+      en->lsa_interval = MIN(2 * en->lsa_interval, p->lsa_max);
+
+    en->inst_ptime = t;
+  }
+
   OSPF_TRACE(D_EVENTS, "Originating LSA: Type: %04x, Id: %R, Rt: %R, Seq: %08x",
 	     en->lsa_type, en->lsa.id, en->lsa.rt, en->lsa.sn);
 
   ospf_flood_lsa(p, en, NULL);
 
   if (en->mode == LSA_M_BASIC)
-    ospf_schedule_rtcalc(p);
+    ospf_schedule_rtcalc_lsa(p, en);
 
   return 1;
 }
@@ -382,6 +442,7 @@ ospf_refresh_lsa(struct ospf_proto *p, struct top_hash_entry *en)
   en->lsa.age = 0;
   en->init_age = 0;
   en->inst_time = now;
+  ospf_lsa_set_refresh(en);
   lsa_generate_checksum(&en->lsa, en->lsa_body);
   ospf_flood_lsa(p, en, NULL);
 }
@@ -419,10 +480,11 @@ ospf_flush_lsa(struct ospf_proto *p, struct top_hash_entry *en)
 	     en->lsa_type, en->lsa.id, en->lsa.rt, en->lsa.sn);
 
   en->lsa.age = LSA_MAXAGE;
+  ospf_dbdes_flush_summary(p);
   ospf_flood_lsa(p, en, NULL);
 
   if (en->mode == LSA_M_BASIC)
-    ospf_schedule_rtcalc(p);
+    ospf_schedule_rtcalc_lsa(p, en);
 
   en->mode = LSA_M_BASIC;
 }
@@ -458,6 +520,24 @@ ospf_remove_lsa(struct ospf_proto *p, struct top_hash_entry *en)
   ospf_hash_delete(p->gr, en);
 }
 
+/**
+ * ospf_originate_postponed - originate postponed LSAs
+ * @p: OSPF protocol instance
+ *
+ * Like the first part of ospf_update_lsadb(), but without aging. It is called
+ * when lsa_timer expires under LSA throttling, so postponed LSAs are
+ * originated as soon as their MinLSInterval passes.
+ */
+void
+ospf_originate_postponed(struct ospf_proto *p)
+{
+  struct top_hash_entry *en;
+
+  WALK_SLIST(en, p->lsal)
+    if (en->next_lsa_body)
+      ospf_originate_next_lsa(p, en);
+}
+
 /**
  * ospf_update_lsadb - update LSA database
  * @p: OSPF protocol instance
@@ -466,8 +546,11 @@ ospf_remove_lsa(struct ospf_proto *p, struct top_hash_entry *en)
  * or postponed processing related to LSA entries. It originates postponed LSAs
  * scheduled by ospf_originate_lsa(), It continues in flushing processes started
  * by ospf_flush_lsa(). It also periodically refreshs locally originated LSAs --
- * when the current instance is older %LSREFRESHTIME, a new instance is originated.
- * Finally, it also ages stored LSAs and flushes ones that reached %LSA_MAXAGE.
+ * when the current instance is older than its jittered refresh age, a new
+ * instance is originated. Refreshes are paced to at most %LSREFRESH_PACE times
+ * the average rate (given by the number of self-originated LSAs), the rest is
+ * postponed to next ticks, but never beyond %LSREFRESHTIME. Finally, it also
+ * ages stored LSAs and flushes ones that reached %LSA_MAXAGE.
  *
  * The RFC 2328 says that a router should periodically check checksums of all
  * stored LSAs to detect hardware problems. This is not implemented.
@@ -477,6 +560,9 @@ ospf_update_lsadb(struct ospf_proto *p)
 {
   struct top_hash_entry *en, *nxt;
   bird_clock_t real_age;
+  uint self_count = 0;
+  uint budget = MAX(LSREFRESH_PACE_MIN,
+		    (u64) p->lsa_self_count * p->tick * LSREFRESH_PACE / LSREFRESHTIME);
 
   WALK_SLIST_DELSAFE(en, nxt, p->lsal)
   {
@@ -497,10 +583,17 @@ ospf_update_lsadb(struct ospf_proto *p)
       continue;
     }
 
-    if ((en->lsa.rt == p->router_id) && (real_age >= LSREFRESHTIME))
+    if (en->lsa.rt == p->router_id)
     {
-      ospf_refresh_lsa(p, en);
-      continue;
+      self_count++;
+
+      if ((real_age >= LSREFRESHTIME) ||
+	  ((real_age >= (en->refresh_age ?: LSREFRESHTIME)) && budget))
+      {
+	budget -= !!budget;
+	ospf_refresh_lsa(p, en);
+	continue;
+      }
     }
 
     if (real_age >= LSA_MAXAGE)
@@ -511,6 +604,8 @@ ospf_update_lsadb(struct ospf_proto *p)
 
     en->lsa.age = real_age;
   }
+
+  p->lsa_self_count = self_count;
 }
 
 
@@ -684,6 +779,111 @@ get_rt_options(struct ospf_proto *p, struct ospf_area *oa, int bitv)
   return opts;
 }
 
+/*
+ * Router and network LSAs are requested for update on many changes of related
+ * interfaces and neighbors, but the result is often the same as the current
+ * LSA. Therefore we keep a fingerprint of the inputs of the last prepared body
+ * and skip the preparation when the fingerprint does not change. Side effects
+ * of the preparation (rt_pos_* of interfaces) stay valid in that case. The
+ * fingerprint covers whole states of interfaces and neighbors, not just the
+ * parts relevant to the LSA, so it is conservative.
+ */
+
+static inline u64
+lsa_fp_add(u64 fp, u64 val)
+{
+  fp = (fp ^ val) * 0x9e3779b97f4a7c15ULL;
+  return fp ^ (fp >> 29);
+}
+
+static inline u64
+lsa_fp_add_ip(u64 fp, ip_addr a)
+{
+  u32 buf[sizeof(ip_addr) / sizeof(u32)];
+  uint i;
+
+  memcpy(buf, &a, sizeof(ip_addr));
+  for (i = 0; i < ARRAY_SIZE(buf); i++)
+    fp = lsa_fp_add(fp, buf[i]);
+
+  return fp;
+}
+
+static inline u64
+lsa_fp_add_addr(u64 fp, struct ifa *a)
+{
+  if (!a)
+    return lsa_fp_add(fp, 0);
+
+  fp = lsa_fp_add_ip(fp, a->ip);
+  fp = lsa_fp_add_ip(fp, a->prefix);
+  return lsa_fp_add(fp, ((u64) a->flags << 8) | a->pxlen);
+}
+
+static u64
+rt_lsa_fingerprint(struct ospf_proto *p, struct ospf_area *oa)
+{
+  struct ospf_iface *ifa;
+  struct ospf_neighbor *n;
+  u64 fp = 0;
+
+  /* Stubnets and translator role are covered by the config pointer */
+  fp = lsa_fp_add(fp, (uintptr_t) oa->ac);
+  fp = lsa_fp_add(fp, ((u64) p->router_id << 32) | oa->options);
+  fp = lsa_fp_add(fp, ((u64) p->areano << 16) | (p->asbr << 8) | p->stub_router);
+
+  WALK_LIST(ifa, p->iface_list)
+  {
+    /* Vlinks of other areas are relevant for the V-bit */
+    if ((ifa->oa != oa) && (ifa->voa != oa))
+      continue;
+
+    fp = lsa_fp_add(fp, (uintptr_t) ifa);
+    fp = lsa_fp_add(fp, (uintptr_t) ifa->cf);
+    fp = lsa_fp_add(fp, ((u64) ifa->cost << 16) | (ifa->type << 8) | ifa->state);
+    fp = lsa_fp_add(fp, ((u64) ifa->drid << 32) | ifa->dr_iface_id);
+    fp = lsa_fp_add(fp, ifa->iface_id);
+    fp = lsa_fp_add_ip(fp, ifa->drip);
+    fp = lsa_fp_add_addr(fp, ifa->addr);
+
+    WALK_LIST(n, ifa->neigh_list)
+    {
+      fp = lsa_fp_add(fp, ((u64) n->rid << 32) | n->iface_id);
+      fp = lsa_fp_add(fp, n->state);
+    }
+  }
+
+  return fp;
+}
+
+static u64
+net_lsa_fingerprint(struct ospf_proto *p, struct ospf_iface *ifa)
+{
+  struct ospf_neighbor *n;
+  u64 fp = 0;
+
+  fp = lsa_fp_add(fp, ((u64) p->router_id << 32) | ifa->oa->options);
+  fp = lsa_fp_add(fp, ((u64) ifa->iface_id << 32) | ifa->fadj);
+  fp = lsa_fp_add_addr(fp, ifa->addr);
+
+  WALK_LIST(n, ifa->neigh_list)
+    if (n->state == NEIGHBOR_FULL)
+    {
+      fp = lsa_fp_add(fp, ((u64) n->rid << 32) | n->iface_id);
+
+      /* In OSPFv3, options from Link LSAs of neighbors are merged */
+      if (ospf_is_v3(p))
+      {
+	struct top_hash_entry *en =
+	  ospf_hash_find(p->gr, ifa->iface_id, n->iface_id, n->rid, LSA_T_LINK);
+
+	fp = lsa_fp_add(fp, en ? (((struct ospf_lsa_link *) en->lsa_body)->options | (1ULL << 32)) : 0);
+      }
+    }
+
+  return fp;
+}
+
 static inline void
 add_rt2_lsa_link(struct ospf_proto *p, u8 type, u32 id, u32 data, u16 metric)
 {
@@ -880,6 +1080,12 @@ ospf_originate_rt_lsa(struct ospf_proto *p, struct ospf_area *oa)
     .opts = oa->options
   };
 
+  u64 fp = rt_lsa_fingerprint(p, oa);
+
+  /* The body would be the same as the current one */
+  if (oa->rt && (oa->rt->lsa.age < LSA_MAXAGE) && (fp == oa->rt_fp))
+    return;
+
   OSPF_TRACE(D_EVENTS, "Updating router state for area %R", oa->areaid);
 
   if (ospf_is_v2(p))
@@ -888,6 +1094,7 @@ ospf_originate_rt_lsa(struct ospf_proto *p, struct ospf_area *oa)
     prepare_rt3_lsa_body(p, oa);
 
   oa->rt = ospf_originate_lsa(p, &lsa);
+  oa->rt_fp = fp;
 }
 
 
@@ -967,6 +1174,12 @@ ospf_originate_net_lsa(struct ospf_proto *p, struct ospf_iface *ifa)
     .ifa  = ifa
   };
 
+  u64 fp = net_lsa_fingerprint(p, ifa);
+
+  /* The body would be the same as the current one */
+  if (ifa->net_lsa && (ifa->net_lsa->lsa.age < LSA_MAXAGE) && (fp == ifa->net_fp))
+    return;
+
   OSPF_TRACE(D_EVENTS, "Updating network state for %s (Id: %R)", ifa->ifname, lsa.id);
 
   if (ospf_is_v2(p))
@@ -975,6 +1188,7 @@ ospf_originate_net_lsa(struct ospf_proto *p, struct ospf_iface *ifa)
     prepare_net3_lsa_body(p, ifa);
 
   ifa->net_lsa = ospf_originate_lsa(p, &lsa);
+  ifa->net_fp = fp;
 }
 
 
@@ -1613,8 +1827,8 @@ ospf_originate_prefix_net_lsa(struct ospf_proto *p, struct ospf_iface *ifa)
   ifa->pxn_lsa = ospf_originate_lsa(p, &lsa);
 }
 
-static inline int breaks_minlsinterval(struct top_hash_entry *en)
-{ return en && (en->lsa.age < LSA_MAXAGE) && ((en->inst_time + MINLSINTERVAL) > now); }
+static inline int breaks_minlsinterval(struct ospf_proto *p, struct top_hash_entry *en)
+{ return en && (en->lsa.age < LSA_MAXAGE) && !ospf_lsa_interval_passed(p, en); }
 
 void
 ospf_update_topology(struct ospf_proto *p)
@@ -1642,7 +1856,7 @@ ospf_update_topology(struct ospf_proto *p)
        * is not a problem because in that case rtcalc is blocked by MaxAge.
        */
 
-      if (breaks_minlsinterval(oa->rt) || breaks_minlsinterval(oa->pxr_lsa))
+      if (breaks_minlsinterval(p, oa->rt) || breaks_minlsinterval(p, oa->pxr_lsa))
 	continue;
 
       ospf_originate_rt_lsa(p, oa);
@@ -1685,57 +1899,210 @@ ospf_update_topology(struct ospf_proto *p)
 }
 
 
+/*
+ * The topology database is an open-addressing hash table with linear probing.
+ * Slots of deleted entries are marked by %HASH_DELETED tombstones, which are
+ * reused by later insertions and dropped when the table is rehashed. Rehashing
+ * is incremental, the old slot array is kept and migrated to the new one a few
+ * slots per update, while lookups probe both arrays until it is finished.
+ *
+ * Router LSAs and OSPFv2 network LSAs are also kept in a secondary index keyed
+ * by the part of the key that is known when looking for them (Router ID and
+ * LSA ID, respectively). Its slots point to lists of matching entries linked
+ * by idx_next and sorted by LSA ID, therefore ospf_hash_find_rt() and related
+ * functions used during SPF need just one probe.
+ */
+
 static void
-ospf_top_ht_alloc(struct top_graph *f)
+top_table_alloc(struct top_graph *f, struct top_table *t, uint order)
 {
-  f->hash_size = 1 << f->hash_order;
-  f->hash_mask = f->hash_size - 1;
-  if (f->hash_order > HASH_HI_MAX - HASH_HI_STEP)
-    f->hash_entries_max = ~0;
-  else
-    f->hash_entries_max = f->hash_size HASH_HI_MARK;
-  if (f->hash_order < HASH_LO_MIN + HASH_LO_STEP)
-    f->hash_entries_min = 0;
-  else
-    f->hash_entries_min = f->hash_size HASH_LO_MARK;
-  DBG("Allocating OSPF hash of order %d: %d hash_entries, %d low, %d high\n",
-      f->hash_order, f->hash_size, f->hash_entries_min, f->hash_entries_max);
-  f->hash_table =
-    mb_alloc(f->pool, f->hash_size * sizeof(struct top_hash_entry *));
-  bzero(f->hash_table, f->hash_size * sizeof(struct top_hash_entry *));
+  DBG("Allocating OSPF hash of order %u: %u slots, %u entries\n",
+      order, 1 << order, t->entries);
+
+  t->order = order;
+  t->mask = (1 << order) - 1;
+  t->used = 0;
+  t->slots = mb_allocz(f->pool, (t->mask + 1) * sizeof(struct top_hash_entry *));
 }
 
-static inline void
-ospf_top_ht_free(struct top_hash_entry **h)
+static void
+top_table_free(struct top_table *t)
 {
-  mb_free(h);
+  mb_free(t->slots);
+  if (t->old_slots)
+    mb_free(t->old_slots);
 }
 
 static inline u32
 ospf_top_hash_u32(u32 a)
 {
-  /* Shamelessly stolen from IP address hashing in ipv4.h */
+  /* Finalizer of MurmurHash3, linear probing needs well-mixed low bits */
+  a ^= a >> 16;
+  a *= 0x85ebca6b;
+  a ^= a >> 13;
+  a *= 0xc2b2ae35;
   a ^= a >> 16;
-  a ^= a << 10;
   return a;
 }
 
-static uint
-ospf_top_hash(struct top_graph *f, u32 domain, u32 lsaid, u32 rtrid, u32 type)
+static inline u32
+ospf_top_hash(u32 domain, u32 lsaid, u32 rtrid, u32 type)
 {
-  /* In OSPFv2, we don't know Router ID when looking for network LSAs.
-     In OSPFv3, we don't know LSA ID when looking for router LSAs.
-     In both cases, there is (usually) just one (or small number)
-     appropriate LSA, so we just clear unknown part of key. */
+  u32 h = ospf_top_hash_u32(domain + type * 0x9e3779b9);
+  h = ospf_top_hash_u32(h ^ rtrid);
+  return ospf_top_hash_u32(h ^ lsaid);
+}
 
-  return (((f->ospf2 && (type == LSA_T_NET)) ? 0 : ospf_top_hash_u32(rtrid)) +
-	  ((!f->ospf2 && (type == LSA_T_RT)) ? 0 : ospf_top_hash_u32(lsaid)) +
-	  type + domain) & f->hash_mask;
+static inline u32
+ospf_top_index_hash(u32 domain, u32 key, u32 type)
+{
+  u32 h = ospf_top_hash_u32(domain + type * 0x9e3779b9);
+  return ospf_top_hash_u32(h ^ key);
+}
 
-  /*
-  return (ospf_top_hash_u32(lsaid) + ospf_top_hash_u32(rtrid) +
-	  type + areaid) & f->hash_mask;
-  */
+/* In OSPFv2, we don't know Router ID when looking for network LSAs.
+   In OSPFv3, we don't know LSA ID when looking for router LSAs.
+   Such LSAs are indexed by the known part of the key. */
+static inline int
+top_indexed(struct top_graph *f, struct top_hash_entry *e)
+{
+  return (e->lsa_type == LSA_T_RT) || (f->ospf2 && (e->lsa_type == LSA_T_NET));
+}
+
+static inline u32
+top_index_key(struct top_hash_entry *e)
+{
+  return (e->lsa_type == LSA_T_RT) ? e->lsa.rt : e->lsa.id;
+}
+
+static inline u32
+top_entry_hash(struct top_graph *f, struct top_table *t, struct top_hash_entry *e)
+{
+  return (t == &f->index) ?
+    ospf_top_index_hash(e->domain, top_index_key(e), e->lsa_type) :
+    ospf_top_hash(e->domain, e->lsa.id, e->lsa.rt, e->lsa_type);
+}
+
+struct top_probe
+{
+  struct top_table *t;
+  u32 hash;
+  uint pos;
+  int old;
+};
+
+static inline void
+top_probe_init(struct top_probe *pr, struct top_table *t, u32 hash)
+{
+  pr->t = t;
+  pr->hash = hash;
+  pr->pos = hash & t->mask;
+  pr->old = 0;
+}
+
+/* Returns the next occupied slot in the probe sequence, NULL at the end */
+static struct top_hash_entry **
+top_probe_next(struct top_probe *pr)
+{
+  struct top_table *t = pr->t;
+
+  while (1)
+  {
+    struct top_hash_entry **s = (pr->old ? t->old_slots : t->slots) + pr->pos;
+    pr->pos = (pr->pos + 1) & (pr->old ? t->old_mask : t->mask);
+
+    if (*s == HASH_DELETED)
+      continue;
+
+    if (*s)
+      return s;
+
+    if (pr->old || !t->old_slots)
+      return NULL;
+
+    /* Continue with the table being migrated */
+    pr->old = 1;
+    pr->pos = pr->hash & t->old_mask;
+  }
+}
+
+/* Puts the entry to a free slot of the current table */
+static void
+top_table_put(struct top_graph *f, struct top_table *t, struct top_hash_entry *e)
+{
+  uint pos = top_entry_hash(f, t, e) & t->mask;
+
+  while (t->slots[pos] && (t->slots[pos] != HASH_DELETED))
+    pos = (pos + 1) & t->mask;
+
+  if (!t->slots[pos])
+    t->used++;
+
+  t->slots[pos] = e;
+}
+
+static void
+top_table_migrate(struct top_graph *f, struct top_table *t, uint max)
+{
+  for (; t->old_slots && max; max--)
+  {
+    struct top_hash_entry **s = t->old_slots + t->old_pos;
+
+    /* Migrated slots become tombstones, as the table is still probed */
+    if (*s && (*s != HASH_DELETED))
+    {
+      top_table_put(f, t, *s);
+      *s = HASH_DELETED;
+    }
+
+    if (t->old_pos++ == t->old_mask)
+    {
+      mb_free(t->old_slots);
+      t->old_slots = NULL;
+    }
+  }
+}
+
+static void
+top_table_rehash(struct top_graph *f, struct top_table *t)
+{
+  uint order = HASH_DEF_ORDER;
+
+  /* Finish the previous rehash first */
+  top_table_migrate(f, t, ~0);
+
+  while ((1U << order) < HASH_REHASH_LOAD * t->entries)
+    order++;
+
+  DBG("Re-hashing topology hash from order %u to %u\n", t->order, order);
+  t->old_slots = t->slots;
+  t->old_mask = t->mask;
+  t->old_pos = 0;
+  top_table_alloc(f, t, order);
+}
+
+static void
+top_table_add(struct top_graph *f, struct top_table *t, struct top_hash_entry *e)
+{
+  top_table_put(f, t, e);
+  t->entries++;
+
+  if (t->used > t->mask HASH_HI_MARK)
+    top_table_rehash(f, t);
+  else
+    top_table_migrate(f, t, HASH_MIGRATE_STEP);
+}
+
+static void
+top_table_remove(struct top_graph *f, struct top_table *t, struct top_hash_entry **s)
+{
+  *s = HASH_DELETED;
+  t->entries--;
+
+  if ((t->order > HASH_DEF_ORDER) && (t->entries < t->mask HASH_LO_MARK))
+    top_table_rehash(f, t);
+  else
+    top_table_migrate(f, t, HASH_MIGRATE_STEP);
 }
 
 /**
@@ -1755,11 +2122,9 @@ ospf_top_new(struct ospf_proto *p, pool *pool)
   f = mb_allocz(pool, sizeof(struct top_graph));
   f->pool = pool;
   f->hash_slab = sl_new(f->pool, sizeof(struct top_hash_entry));
-  f->hash_order = HASH_DEF_ORDER;
-  ospf_top_ht_alloc(f);
-  f->hash_entries = 0;
-  f->hash_entries_min = 0;
   f->ospf2 = ospf_is_v2(p);
+  top_table_alloc(f, &f->hash, HASH_DEF_ORDER);
+  top_table_alloc(f, &f->index, HASH_DEF_ORDER);
   return f;
 }
 
@@ -1767,50 +2132,31 @@ void
 ospf_top_free(struct top_graph *f)
 {
   rfree(f->hash_slab);
-  ospf_top_ht_free(f->hash_table);
+  top_table_free(&f->hash);
+  top_table_free(&f->index);
   mb_free(f);
 }
 
-static void
-ospf_top_rehash(struct top_graph *f, int step)
+static struct top_hash_entry **
+ospf_hash_find_slot(struct top_graph *f, u32 domain, u32 lsa, u32 rtr, u32 type)
 {
-  struct top_hash_entry **n, **oldt, **newt, *e, *x;
-  uint oldn, oldh;
+  struct top_hash_entry **s;
+  struct top_probe pr;
 
-  oldn = f->hash_size;
-  oldt = f->hash_table;
-  DBG("re-hashing topology hash from order %d to %d\n", f->hash_order,
-      f->hash_order + step);
-  f->hash_order += step;
-  ospf_top_ht_alloc(f);
-  newt = f->hash_table;
+  top_probe_init(&pr, &f->hash, ospf_top_hash(domain, lsa, rtr, type));
+  while (s = top_probe_next(&pr))
+    if ((*s)->lsa.id == lsa && (*s)->lsa.rt == rtr &&
+	(*s)->lsa_type == type && (*s)->domain == domain)
+      return s;
 
-  for (oldh = 0; oldh < oldn; oldh++)
-  {
-    e = oldt[oldh];
-    while (e)
-    {
-      x = e->next;
-      n = newt + ospf_top_hash(f, e->domain, e->lsa.id, e->lsa.rt, e->lsa_type);
-      e->next = *n;
-      *n = e;
-      e = x;
-    }
-  }
-  ospf_top_ht_free(oldt);
+  return NULL;
 }
 
 static struct top_hash_entry *
 ospf_hash_find_(struct top_graph *f, u32 domain, u32 lsa, u32 rtr, u32 type)
 {
-  struct top_hash_entry *e;
-  e = f->hash_table[ospf_top_hash(f, domain, lsa, rtr, type)];
-
-  while (e && (e->lsa.id != lsa || e->lsa.rt != rtr ||
-	       e->lsa_type != type || e->domain != domain))
-    e = e->next;
-
-  return e;
+  struct top_hash_entry **s = ospf_hash_find_slot(f, domain, lsa, rtr, type);
+  return s ? *s : NULL;
 }
 
 struct top_hash_entry *
@@ -1822,29 +2168,78 @@ ospf_hash_find(struct top_graph *f, u32 domain, u32 lsa, u32 rtr, u32 type)
   return (e && e->lsa_body) ? e : NULL;
 }
 
+/* Returns the index slot with the list of entries for given key */
+static struct top_hash_entry **
+ospf_index_find_slot(struct top_graph *f, u32 domain, u32 key, u32 type)
+{
+  struct top_hash_entry **s;
+  struct top_probe pr;
+
+  top_probe_init(&pr, &f->index, ospf_top_index_hash(domain, key, type));
+  while (s = top_probe_next(&pr))
+    if ((*s)->lsa_type == type && (*s)->domain == domain && top_index_key(*s) == key)
+      return s;
+
+  return NULL;
+}
+
+static inline struct top_hash_entry *
+ospf_index_find(struct top_graph *f, u32 domain, u32 key, u32 type)
+{
+  struct top_hash_entry **s = ospf_index_find_slot(f, domain, key, type);
+  return s ? *s : NULL;
+}
+
+static void
+ospf_index_add(struct top_graph *f, struct top_hash_entry *e)
+{
+  struct top_hash_entry **s = ospf_index_find_slot(f, e->domain, top_index_key(e), e->lsa_type);
+
+  if (!s)
+  {
+    e->idx_next = NULL;
+    top_table_add(f, &f->index, e);
+    return;
+  }
+
+  /* The slot itself is updated when the entry becomes the first one */
+  while (*s && ((*s)->lsa.id < e->lsa.id))
+    s = &((*s)->idx_next);
+
+  e->idx_next = *s;
+  *s = e;
+}
+
+static void
+ospf_index_delete(struct top_graph *f, struct top_hash_entry *e)
+{
+  struct top_hash_entry **slot = ospf_index_find_slot(f, e->domain, top_index_key(e), e->lsa_type);
+  struct top_hash_entry **s = slot;
+
+  while (s && *s && (*s != e))
+    s = &((*s)->idx_next);
+
+  if (!s || !*s)
+    bug("ospf_index_delete() called for invalid node");
+
+  *s = e->idx_next;
+
+  if (!*slot)
+    top_table_remove(f, &f->index, slot);
+}
+
 /* In OSPFv2, lsa.id is the same as lsa.rt for router LSA. In OSPFv3, we don't know
    lsa.id when looking for router LSAs. We return matching LSA with smallest lsa.id. */
 struct top_hash_entry *
 ospf_hash_find_rt(struct top_graph *f, u32 domain, u32 rtr)
 {
-  struct top_hash_entry *rv = NULL;
-  struct top_hash_entry *e;
-  /* We can put rtr for lsa.id to hash fn, it is ignored in OSPFv3 */
-  e = f->hash_table[ospf_top_hash(f, domain, rtr, rtr, LSA_T_RT)];
+  struct top_hash_entry *e = ospf_index_find(f, domain, rtr, LSA_T_RT);
 
-  while (e)
-  {
-    if (e->lsa.rt == rtr && e->lsa_type == LSA_T_RT && e->domain == domain && e->lsa_body)
-    {
-      if (f->ospf2 && (e->lsa.id == rtr))
-	return e;
-      if (!f->ospf2 && (!rv || e->lsa.id < rv->lsa.id))
-	rv = e;
-    }
-    e = e->next;
-  }
+  /* The list is sorted by lsa.id */
+  while (e && (!e->lsa_body || (f->ospf2 && (e->lsa.id != rtr))))
+    e = e->idx_next;
 
-  return rv;
+  return e;
 }
 
 /*
@@ -1852,26 +2247,23 @@ ospf_hash_find_rt(struct top_graph *f, u32 domain, u32 rtr)
  * for lsa_walk_rt_init(), lsa_walk_rt(), therefore they skip MaxAge entries.
  */
 static inline struct top_hash_entry *
-find_matching_rt3(struct top_hash_entry *e, u32 domain, u32 rtr)
+find_matching_rt3(struct top_hash_entry *e)
 {
-  while (e && (e->lsa.rt != rtr || e->lsa_type != LSA_T_RT ||
-	       e->domain != domain || e->lsa.age == LSA_MAXAGE))
-    e = e->next;
+  while (e && (e->lsa.age == LSA_MAXAGE))
+    e = e->idx_next;
   return e;
 }
 
 struct top_hash_entry *
 ospf_hash_find_rt3_first(struct top_graph *f, u32 domain, u32 rtr)
 {
-  struct top_hash_entry *e;
-  e = f->hash_table[ospf_top_hash(f, domain, 0, rtr, LSA_T_RT)];
-  return find_matching_rt3(e, domain, rtr);
+  return find_matching_rt3(ospf_index_find(f, domain, rtr, LSA_T_RT));
 }
 
 struct top_hash_entry *
 ospf_hash_find_rt3_next(struct top_hash_entry *e)
 {
-  return find_matching_rt3(e->next, e->domain, e->lsa.rt);
+  return find_matching_rt3(e->idx_next);
 }
 
 /* In OSPFv2, we don't know Router ID when looking for network LSAs.
@@ -1879,12 +2271,10 @@ ospf_hash_find_rt3_next(struct top_hash_entry *e)
 struct top_hash_entry *
 ospf_hash_find_net2(struct top_graph *f, u32 domain, u32 id)
 {
-  struct top_hash_entry *e;
-  e = f->hash_table[ospf_top_hash(f, domain, id, 0, LSA_T_NET)];
+  struct top_hash_entry *e = ospf_index_find(f, domain, id, LSA_T_NET);
 
-  while (e && (e->lsa.id != id || e->lsa_type != LSA_T_NET ||
-	       e->domain != domain || e->lsa_body == NULL))
-    e = e->next;
+  while (e && (e->lsa_body == NULL))
+    e = e->idx_next;
 
   return e;
 }
@@ -1893,15 +2283,7 @@ ospf_hash_find_net2(struct top_graph *f, u32 domain, u32 id)
 struct top_hash_entry *
 ospf_hash_get(struct top_graph *f, u32 domain, u32 lsa, u32 rtr, u32 type)
 {
-  struct top_hash_entry **ee;
-  struct top_hash_entry *e;
-
-  ee = f->hash_table + ospf_top_hash(f, domain, lsa, rtr, type);
-  e = *ee;
-
-  while (e && (e->lsa.id != lsa || e->lsa.rt != rtr ||
-	       e->lsa_type != type || e->domain != domain))
-    e = e->next;
+  struct top_hash_entry *e = ospf_hash_find_(f, domain, lsa, rtr, type);
 
   if (e)
     return e;
@@ -1917,32 +2299,28 @@ ospf_hash_get(struct top_graph *f, u32 domain, u32 lsa, u32 rtr, u32 type)
   e->lsa.sn = LSA_ZEROSEQNO;
   e->lsa_type = type;
   e->domain = domain;
-  e->next = *ee;
-  *ee = e;
-  if (f->hash_entries++ > f->hash_entries_max)
-    ospf_top_rehash(f, HASH_HI_STEP);
+
+  top_table_add(f, &f->hash, e);
+  if (top_indexed(f, e))
+    ospf_index_add(f, e);
+
   return e;
 }
 
 void
 ospf_hash_delete(struct top_graph *f, struct top_hash_entry *e)
 {
-  struct top_hash_entry **ee = f->hash_table +
-    ospf_top_hash(f, e->domain, e->lsa.id, e->lsa.rt, e->lsa_type);
+  struct top_hash_entry **s =
+    ospf_hash_find_slot(f, e->domain, e->lsa.id, e->lsa.rt, e->lsa_type);
 
-  while (*ee)
-  {
-    if (*ee == e)
-    {
-      *ee = e->next;
-      sl_free(f->hash_slab, e);
-      if (f->hash_entries-- < f->hash_entries_min)
-	ospf_top_rehash(f, -HASH_LO_STEP);
-      return;
-    }
-    ee = &((*ee)->next);
-  }
-  bug("ospf_hash_delete() called for invalid node");
+  if (!s || (*s != e))
+    bug("ospf_hash_delete() called for invalid node");
+
+  if (top_indexed(f, e))
+    ospf_index_delete(f, e);
+
+  top_table_remove(f, &f->hash, s);
+  sl_free(f->hash_slab, e);
 }
 
 /*
@@ -1989,12 +2367,12 @@ void
 ospf_top_dump(struct top_graph *f, struct proto *p)
 {
   uint i;
-  OSPF_TRACE(D_EVENTS, "Hash entries: %d", f->hash_entries);
+  OSPF_TRACE(D_EVENTS, "Hash entries: %d", f->hash.entries);
 
-  for (i = 0; i < f->hash_size; i++)
+  for (i = 0; i <= f->hash.mask; i++)
   {
-    struct top_hash_entry *e;
-    for (e = f->hash_table[i]; e != NULL; e = e->next)
+    struct top_hash_entry *e = f->hash.slots[i];
+    if (e && (e != HASH_DELETED))
       ospf_dump_lsa(e, p);
   }
 }
@@ -14,9 +14,10 @@
 struct top_hash_entry
 {				/* Index for fast mapping (type,rtrid,LSid)->vertex */
   snode n;
-  node cn;			/* For adding into list of candidates
+  uint cand_pos;		/* Position in the heap of candidates
 				   in intra-area routing table calculation */
-  struct top_hash_entry *next;	/* Next in hash chain */
+  u32 cand_rank;		/* Order of candidates with the same distance */
+  struct top_hash_entry *idx_next; /* Next in the list of the secondary index */
   struct ospf_lsa_header lsa;
   u16 lsa_type;			/* lsa.type processed and converted to common values (LSA_T_*) */
   u16 init_age;			/* Initial value for lsa.age during inst_time */
@@ -26,7 +27,10 @@ struct top_hash_entry
   void *next_lsa_body;		/* For postponed LSA origination */
   u16 next_lsa_blen;		/* For postponed LSA origination */
   u16 next_lsa_opts;		/* For postponed LSA origination */
+  u16 refresh_age;		/* Age when self-originated LSA is refreshed, 0 for LSREFRESHTIME */
   bird_clock_t inst_time;	/* Time of installation into DB */
+  btime inst_ptime;		/* Precise inst_time, for LSA throttling */
+  btime lsa_interval;		/* Current MinLSInterval under LSA throttling */
   struct ort *nf;		/* Reference fibnode for sum and ext LSAs, NULL for otherwise */
   struct mpnh *nhs;		/* Computed nexthops - valid only in ospf_rt_spf() */
   ip_addr lb;			/* In OSPFv2, link back address. In OSPFv3, any global address in the area useful for vlinks */
@@ -147,17 +151,23 @@ struct top_hash_entry
  */
 
 
+struct top_table
+{				/* Open-addressing hash table, see topology.c */
+  struct top_hash_entry **slots;
+  struct top_hash_entry **old_slots; /* Table being migrated during rehash, or NULL */
+  uint order, mask;
+  uint entries;			/* Number of live entries in both tables */
+  uint used;			/* Number of live and deleted slots in the current table */
+  uint old_mask, old_pos;	/* Size and migration position of the old table */
+};
+
 struct top_graph
 {
   pool *pool;			/* Pool we allocate from */
   slab *hash_slab;		/* Slab for hash entries */
-  struct top_hash_entry **hash_table;	/* Hashing (modelled a`la fib) */
+  struct top_table hash;	/* All entries */
+  struct top_table index;	/* Router LSAs and OSPFv2 network LSAs by known part of the key */
   uint ospf2;			/* Whether it is for OSPFv2 or OSPFv3 */
-  uint hash_size;
-  uint hash_order;
-  uint hash_mask;
-  uint hash_entries;
-  uint hash_entries_min, hash_entries_max;
 };
 
 struct ospf_new_lsa
@@ -190,6 +200,7 @@ void ospf_originate_ext_lsa(struct ospf_proto *p, struct ospf_area *oa, ort *nf,
 
 void ospf_rt_notify(struct proto *P, rtable *tbl, net *n, rte *new, rte *old, ea_list *attrs);
 void ospf_update_topology(struct ospf_proto *p);
+void ospf_originate_postponed(struct ospf_proto *p);
 
 struct top_hash_entry *ospf_hash_find(struct top_graph *, u32 domain, u32 lsa, u32 rtr, u32 type);
 struct top_hash_entry *ospf_hash_get(struct top_graph *, u32 domain, u32 lsa, u32 rtr, u32 type);
@@ -14,8 +14,15 @@
  * about a change in one of the tables, it converts it to a rte_update()
  * in the other one.
  *
- * To avoid pipe loops, Pipe keeps a `being updated' flag in each routing
- * table.
+ * The converted updates are not propagated immediately from rt_notify(), but
+ * queued in the pipe, separately for each direction, and passed to the target
+ * table by an event in limited steps and in batches (see rte_batch_start()).
+ * Therefore, a change is propagated through chained tables iteratively and
+ * each pipe gets its fair share of the time, without a deep stack of nested
+ * announcements. To avoid pipe loops, each queued update carries the list of
+ * tables it has already visited, which is attached to the target table while
+ * the update is announced there (&rtable->pipe_path), and an update is never
+ * sent to a table from that list.
  *
  * A pipe has two announce hooks, the first connected to the main
  * table, the second connected to the peer table. When a new route is
@@ -28,6 +35,11 @@
  * set to accept, while user configured 'import' and 'export' filters
  * are used as export filters in ahooks 2 and 1. Route limits are
  * handled similarly, but on the import side of ahooks.
+ *
+ * Cached attributes of propagated routes are shared by both tables whenever
+ * possible, i.e. in transparent mode when the route has no temporary
+ * attributes and no recursive next hop (which is specific to its table).
+ * Otherwise a copy of the attributes is looked up in the attribute cache.
  */
 
 #undef LOCAL_DEBUG
@@ -43,44 +55,174 @@
 
 #include "pipe.h"
 
+static inline int
+pipe_path_same(struct pipe_path *a, struct pipe_path *b)
+{
+  return (a->hops == b->hops) &&
+    !memcmp(a->tables, b->tables, a->hops * sizeof(rtable *));
+}
+
+static void
+pipe_free_update(struct pipe_proto *p, struct pipe_update *u)
+{
+  rt_unlock_source(u->src);
+  sl_free(p->update_slab, u);
+}
+
+static void
+pipe_flush_queues(struct pipe_proto *p)
+{
+  struct pipe_update *u;
+  int i;
+
+  for (i = 0; i < 2; i++)
+    WALK_LIST_FIRST(u, p->queue[i])
+      {
+	rem_node(&u->n);
+	if (u->new)
+	  rte_free(u->new);
+	pipe_free_update(p, u);
+      }
+}
+
+/* Finish a batch of updates from @done, which share the path of the first one */
+static void
+pipe_process_done(struct pipe_proto *p, struct rte_batch *b, list *done)
+{
+  rtable *dst_table = b->ah->table;
+  struct pipe_update *u;
+
+  rte_batch_end(b);
+  dst_table->pipe_path = NULL;
+
+  WALK_LIST_FIRST(u, *done)
+    {
+      rem_node(&u->n);
+      pipe_free_update(p, u);
+    }
+}
+
+/* Pass at most @limit queued updates to the table of @ah, returns 1 when more are pending */
+static int
+pipe_process_queue(struct pipe_proto *p, list *queue, struct announce_hook *ah, int limit)
+{
+  rtable *dst_table = ah->table;
+  struct pipe_update *u, *first = NULL;
+  struct rte_batch b;
+  list done;
+
+  init_list(&done);
+
+  while (!EMPTY_LIST(*queue) && (limit-- > 0))
+    {
+      u = HEAD(*queue);
+
+      /* Updates with different paths must be announced separately */
+      if (first && !pipe_path_same(&first->path, &u->path))
+	{
+	  pipe_process_done(p, &b, &done);
+	  first = NULL;
+	}
+
+      if (!first)
+	{
+	  first = u;
+	  dst_table->pipe_path = &first->path;
+	  rte_batch_start(&b, ah);
+	}
+
+      rem_node(&u->n);
+      add_tail(&done, &u->n);
+
+      net *n = net_get(dst_table, u->prefix, u->pxlen);
+      if (u->new)
+	u->new->net = n;
+
+      rte_batch_update(&b, n, u->new, u->src);
+    }
+
+  if (first)
+    pipe_process_done(p, &b, &done);
+
+  return !EMPTY_LIST(*queue);
+}
+
+static void
+pipe_queue_event(void *P)
+{
+  struct pipe_proto *p = P;
+  int more = 0;
+
+  if (p->p.export_state == ES_DOWN)
+    {
+      pipe_flush_queues(p);
+      return;
+    }
+
+  more |= pipe_process_queue(p, &p->queue[0], p->p.main_ahook, PIPE_QUEUE_STEP);
+  more |= pipe_process_queue(p, &p->queue[1], p->peer_ahook, PIPE_QUEUE_STEP);
+
+  if (more)
+    ev_schedule(p->queue_event);
+}
+
 static void
 pipe_rt_notify(struct proto *P, rtable *src_table, net *n, rte *new, rte *old, ea_list *attrs)
 {
   struct pipe_proto *p = (struct pipe_proto *) P;
-  struct announce_hook *ah = (src_table == P->table) ? p->peer_ahook : P->main_ahook;
+  int dir = (src_table == P->table);
+  struct announce_hook *ah = dir ? p->peer_ahook : P->main_ahook;
   rtable *dst_table = ah->table;
-  struct rte_src *src;
+  struct pipe_update *u;
+  uint i;
 
-  net *nn;
   rte *e;
   rta a;
 
   if (!new && !old)
     return;
 
-  if (dst_table->pipe_busy)
+  /* The update is either from a pipe queue of the source table, or an original one */
+  struct pipe_path *path = src_table->pipe_path;
+  uint hops = path ? path->hops : 0;
+
+  for (i = 0; i < hops; i++)
+    if (path->tables[i] == dst_table)
+      break;
+
+  if ((i < hops) || (hops == PIPE_MAX_HOPS))
     {
       log(L_ERR "Pipe loop detected when sending %I/%d to table %s",
 	  n->n.prefix, n->n.pxlen, dst_table->name);
       return;
     }
 
-  nn = net_get(dst_table, n->n.prefix, n->n.pxlen);
   if (new)
     {
-      memcpy(&a, new->attrs, sizeof(rta));
-
-      if (p->mode == PIPE_OPAQUE)
+      if ((p->mode == PIPE_TRANSPARENT) && rta_is_cached(new->attrs) &&
+	  !new->attrs->hostentry && (attrs == new->attrs->eattrs))
+	{
+	  /* No change of attributes, just share them */
+	  e = rte_get_temp(rta_clone(new->attrs));
+	}
+      else
 	{
-	  a.src = P->main_source;
-	  a.source = RTS_PIPE;
+	  memcpy(&a, new->attrs, sizeof(rta));
+
+	  if (p->mode == PIPE_OPAQUE)
+	    {
+	      a.src = P->main_source;
+	      a.source = RTS_PIPE;
+	    }
+
+	  a.aflags = 0;
+	  a.eattrs = attrs;
+	  a.hostentry = NULL;
+
+	  /* The update is queued, so local attributes cannot be used */
+	  e = rte_get_temp(rta_lookup(&a));
 	}
 
-      a.aflags = 0;
-      a.eattrs = attrs;
-      a.hostentry = NULL;
-      e = rte_get_temp(&a);
-      e->net = nn;
       e->pflags = 0;
 
       if (p->mode == PIPE_TRANSPARENT)
@@ -90,18 +232,24 @@ pipe_rt_notify(struct proto *P, rtable *src_table, net *n, rte *new, rte *old, e
 	  e->pref = new->pref;
 	  e->pflags = new->pflags;
 	}
-
-      src = a.src;
     }
   else
-    {
-      e = NULL;
-      src = old->attrs->src;
-    }
-
-  src_table->pipe_busy = 1;
-  rte_update2(ah, nn, e, src);
-  src_table->pipe_busy = 0;
+    e = NULL;
+
+  u = sl_alloc(p->update_slab);
+  u->prefix = n->n.prefix;
+  u->pxlen = n->n.pxlen;
+  u->new = e;
+  u->src = e ? e->attrs->src : old->attrs->src;
+  rt_lock_source(u->src);
+
+  u->path.hops = hops + 1;
+  if (path)
+    memcpy(u->path.tables, path->tables, hops * sizeof(rtable *));
+  u->path.tables[hops] = src_table;
+
+  add_tail(&p->queue[dir], &u->n);
+  ev_schedule(p->queue_event);
 }
 
 static int
@@ -173,6 +321,13 @@ pipe_start(struct proto *P)
   p->peer_ahook->in_limit = cf->c.out_limit;
   proto_reset_limit(p->peer_ahook->in_limit);
 
+  init_list(&p->queue[0]);
+  init_list(&p->queue[1]);
+  p->update_slab = sl_new(P->pool, sizeof(struct pipe_update));
+  p->queue_event = ev_new(P->pool);
+  p->queue_event->hook = pipe_queue_event;
+  p->queue_event->data = p;
+
   if (p->mode == PIPE_OPAQUE)
     {
       P->main_source = rt_get_source(P, 0);
@@ -190,6 +345,9 @@ pipe_cleanup(struct proto *P)
   bzero(&P->stats, sizeof(struct proto_stats));
   bzero(&p->peer_stats, sizeof(struct proto_stats));
 
+  pipe_flush_queues(p);
+  ev_postpone(p->queue_event);
+
   P->main_ahook = NULL;
   p->peer_ahook = NULL;
 
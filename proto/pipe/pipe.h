@@ -12,6 +12,9 @@
 #define PIPE_OPAQUE 0
 #define PIPE_TRANSPARENT 1
 
+#define PIPE_MAX_HOPS	16		/* Max number of tables passed by one update */
+#define PIPE_QUEUE_STEP	512		/* Max number of updates processed in one event */
+
 struct pipe_config {
   struct proto_config c;
   struct rtable_config *peer;		/* Table we're connected to */
@@ -24,6 +27,23 @@ struct pipe_proto {
   struct announce_hook *peer_ahook;	/* Announce hook for direction peer->primary */
   struct proto_stats peer_stats;	/* Statistics for the direction peer->primary */
   int mode;				/* PIPE_OPAQUE or PIPE_TRANSPARENT */
+  list queue[2];			/* Updates for the primary and peer table (struct pipe_update) */
+  slab *update_slab;			/* Slab for struct pipe_update */
+  event *queue_event;			/* Processes queued updates */
+};
+
+struct pipe_path {
+  uint hops;
+  struct rtable *tables[PIPE_MAX_HOPS];	/* Tables visited by the update, the origin first */
+};
+
+struct pipe_update {
+  node n;				/* Node in pipe_proto->queue */
+  ip_addr prefix;
+  int pxlen;
+  rte *new;				/* Route to be imported, NULL for withdraw */
+  struct rte_src *src;			/* Source of the route, locked */
+  struct pipe_path path;		/* Tables visited before the destination one */
 };
 
 
@@ -30,6 +30,14 @@
  * by RA_EV_* codes), and radv_timer(), which triggers sending RAs and
  * computes the next timeout.
  *
+ * The prepared RA is rebuilt only after a change of options or prefixes
+ * (%RA_EV_CHANGE), so sending it is cheap. Responses to router
+ * solicitations are coalesced as described in RFC 4861 6.2.6: the response
+ * is delayed randomly by up to %MAX_RA_DELAY_TIME and at most one is pending,
+ * RSs received meanwhile, or when an RA is scheduled to be sent sooner anyway,
+ * are just ignored. Responses are also limited by a token bucket (&rs_tbf),
+ * so a flood of RSs cannot cause more than a few extra RAs.
+ *
  * The RAdv protocol could receive routes (through
  * radv_import_control() and radv_rt_notify()), but only the
  * configured trigger route is tracked (in &active var).  When a radv
@@ -44,14 +52,10 @@
  */
 
 static void
-radv_timer(timer *tm)
+radv_send_scheduled(struct radv_iface *ifa)
 {
-  struct radv_iface *ifa = tm->data;
-  struct proto_radv *ra = ifa->ra;
-
-  RADV_TRACE(D_EVENTS, "Timer fired on %s", ifa->iface->name);
-
   radv_send_ra(ifa, 0);
+  ptm_stop(ifa->rs_timer);
 
   /* Update timer */
   ifa->last = now;
@@ -67,6 +71,52 @@ radv_timer(timer *tm)
   tm_start(ifa->timer, after);
 }
 
+static void
+radv_timer(timer *tm)
+{
+  struct radv_iface *ifa = tm->data;
+  struct proto_radv *ra = ifa->ra;
+
+  RADV_TRACE(D_EVENTS, "Timer fired on %s", ifa->iface->name);
+
+  radv_send_scheduled(ifa);
+}
+
+static void
+radv_rs_timer(ptimer *tm)
+{
+  struct radv_iface *ifa = tm->data;
+  struct proto_radv *ra = ifa->ra;
+
+  RADV_TRACE(D_EVENTS, "Responding to RS on %s", ifa->iface->name);
+
+  radv_send_scheduled(ifa);
+}
+
+/* Schedule a response to RS, see RFC 4861 6.2.6 */
+static void
+radv_schedule_response(struct radv_iface *ifa)
+{
+  /* Response is already pending */
+  if (ptm_active(ifa->rs_timer))
+    return;
+
+  /* Multicast RAs must be separated by min_delay */
+  unsigned delta = now - ifa->last;
+  btime after = (delta < ifa->cf->min_delay) ?
+    ((btime) (ifa->cf->min_delay - delta) S) :
+    ((btime) (random() % (MAX_RA_DELAY_TIME + 1)) MS);
+
+  /* Periodic RA is sent earlier anyway */
+  if (tm_active(ifa->timer) && ((btime) tm_remains(ifa->timer) S <= after))
+    return;
+
+  if (tbf_limit(&ifa->rs_tbf))
+    return;
+
+  ptm_start(ifa->rs_timer, after);
+}
+
 static char* ev_name[] = { NULL, "Init", "Change", "RS" };
 
 void
@@ -77,6 +127,12 @@ radv_iface_notify(struct radv_iface *ifa, int event)
   if (!ifa->sk)
     return;
 
+  if (event == RA_EV_RS)
+  {
+    radv_schedule_response(ifa);
+    return;
+  }
+
   RADV_TRACE(D_EVENTS, "Event %s on %s", ev_name[event], ifa->iface->name);
 
   switch (event)
@@ -86,9 +142,6 @@ radv_iface_notify(struct radv_iface *ifa, int event)
   case RA_EV_INIT:
     ifa->initial = MAX_INITIAL_RTR_ADVERTISEMENTS;
     break;
-
-  case RA_EV_RS:
-    break;
   }
 
   /* Update timer */
@@ -178,6 +231,9 @@ radv_iface_new(struct proto_radv *ra, struct iface *iface, struct radv_iface_con
   tm->recurrent = 0;
   ifa->timer = tm;
 
+  ifa->rs_timer = ptm_new_set(pool, radv_rs_timer, ifa);
+  ifa->rs_tbf = (struct tbf) RADV_RS_LIMITS;
+
   struct object_lock *lock = olock_new(pool);
   lock->addr = IPA_NONE;
   lock->type = OBJLOCK_IP;
@@ -200,6 +256,7 @@ radv_iface_remove(struct radv_iface *ifa)
 
   rfree(ifa->sk);
   rfree(ifa->timer);
+  rfree(ifa->rs_timer);
   rfree(ifa->lock);
 
   mb_free(ifa);
@@ -31,6 +31,10 @@
 
 #define MAX_INITIAL_RTR_ADVERTISEMENTS 3
 #define MAX_INITIAL_RTR_ADVERT_INTERVAL 16
+#define MAX_RA_DELAY_TIME 500		/* In ms, for responses to RS */
+
+/* Limits of responses to RS, when exceeded RSs wait for a periodic RA */
+#define RADV_RS_LIMITS { .rate = 1, .burst = 3 }
 
 #define DEFAULT_MAX_RA_INT 600
 #define DEFAULT_MIN_DELAY 3
@@ -130,8 +134,10 @@ struct radv_iface
   struct ifa *addr;		/* Link-local address of iface */
 
   timer *timer;
+  ptimer *rs_timer;		/* Delayed response to RS */
   struct object_lock *lock;
   sock *sk;
+  struct tbf rs_tbf;		/* Rate limit of responses to RS */
 
   bird_clock_t last;		/* Time of last sending of RA */
   u16 plen;			/* Length of prepared RA in tbuf, or 0 if not valid */
@@ -28,11 +28,14 @@
  * packet reception; instead, it lets the core know about data from the packet
  * and waits for the core to call rip_rt_notify().
  *
- * Within rip_tx(), the list is
- * walked and a packet is generated using rip_tx_prepare(). This gets
+ * Blocks of an update are generated using rip_tx_prepare() by
+ * rip_prepare_update(). Full updates are cached in &rip_interface until the
+ * table changes, triggered updates are taken from a journal of recently
+ * changed entries, so the table is not walked on each tick. Within
+ * rip_tx(), prepared blocks are sent in packets. This gets
  * tricky because we may need to send more than one packet to one
  * destination. Struct &rip_connection is used to hold context information such as how
- * many of &rip_entry's we have already sent and it's also used to protect
+ * many blocks we have already sent and it's also used to protect
  * against two concurrent sends to one destination. Each &rip_interface has
  * at most one &rip_connection.
  *
@@ -124,6 +127,76 @@ rip_tx_prepare(struct proto *p, struct rip_block *b, struct rip_entry *e, struct
   return pos+1;
 }
 
+/*
+ * rip_reserve_blocks - make room for @n blocks in an update buffer
+ */
+static struct rip_block *
+rip_reserve_blocks(struct proto *p, struct rip_block **blocks, int *size, int n)
+{
+  if (n <= *size)
+    return *blocks;
+
+  *size = MAX(n, 2 * *size);
+  if (*blocks)
+    *blocks = mb_realloc(*blocks, *size * sizeof(struct rip_block));
+  else
+    *blocks = mb_alloc(p->pool, *size * sizeof(struct rip_block));
+  return *blocks;
+}
+
+/*
+ * rip_prepare_update - prepare blocks of an update for one interface
+ * @rif: interface the update is sent to
+ * @triggered: whether just recently changed entries are sent
+ * @count: returns number of blocks
+ *
+ * Blocks depend on the interface (split horizon, next hops), but not on
+ * the destination. A full update is prepared once per generation of the
+ * routing table and shared by all connections of the interface, i.e. both
+ * periodic updates and responses to requests. A triggered update takes
+ * entries from the journal of recent changes, so neither of them needs to
+ * walk the table unless it is changed.
+ */
+static struct rip_block *
+rip_prepare_update(struct proto *p, struct rip_interface *rif, int triggered, int *count)
+{
+  struct rip_block *b;
+  node *n;
+  int i = 0;
+
+  if (triggered)
+  {
+    /* Journal contains just entries changed in last 2 seconds, see rip_timer() */
+    WALK_LIST(n, P->journal)
+      i++;
+
+    b = rip_reserve_blocks(p, &rif->trig_blocks, &rif->trig_size, i);
+    i = 0;
+    WALK_LIST(n, P->journal)
+      i = rip_tx_prepare(p, b + i, SKIP_BACK(struct rip_entry, journal, n), rif, i);
+
+    *count = i;
+    return b;
+  }
+
+  if (rif->full_blocks && (rif->full_gen == P->gen))
+  {
+    *count = rif->full_count;
+    return rif->full_blocks;
+  }
+
+  b = rip_reserve_blocks(p, &rif->full_blocks, &rif->full_size, P->rtable.entries);
+  FIB_WALK(&P->rtable, z)
+    i = rip_tx_prepare(p, b + i, (struct rip_entry *) z, rif, i);
+  FIB_WALK_END;
+
+  rif->full_count = i;
+  rif->full_gen = P->gen;
+
+  *count = i;
+  return b;
+}
+
 /*
  * rip_tx - send one rip packet to the network
  */
@@ -134,8 +207,8 @@ rip_tx( sock *s )
   struct rip_connection *c = rif->busy;
   struct proto *p = c->proto;
   struct rip_packet *packet = (void *) s->tbuf;
-  int i, packetlen;
-  int maxi, nullupdate = 1;
+  int i, n, packetlen;
+  int maxi;
 
   DBG( "Sending to %I\n", s->daddr );
   do {
@@ -159,27 +232,19 @@ rip_tx( sock *s )
 #else
     maxi = 5; /* We need to have at least reserve of one at end of packet */
 #endif
-    
-    FIB_ITERATE_START(&P->rtable, &c->iter, z) {
-      struct rip_entry *e = (struct rip_entry *) z;
-
-      if (!rif->triggered || (!(e->updated < now-2))) {		/* FIXME: Should be probably 1 or some different algorithm */
-	nullupdate = 0;
-	i = rip_tx_prepare( p, packet->block + i, e, rif, i );
-	if (i >= maxi) {
-	  FIB_ITERATE_PUT(&c->iter, z);
-	  goto break_loop;
-	}
-      }
-    } FIB_ITERATE_END(z);
-    c->done = 1;
 
-  break_loop:
+    n = MIN(maxi - i, c->count - c->pos);
+    memcpy(packet->block + i, c->blocks + c->pos, n * sizeof(struct rip_block));
+    c->pos += n;
+    i += n;
+
+    if (c->pos >= c->count)
+      c->done = 1;
 
     packetlen = rip_outgoing_authentication(p, (void *) &packet->block[0], packet, i);
 
     DBG( ", sending %d blocks, ", i );
-    if (nullupdate) {
+    if (!n) {
       DBG( "not sending NULL update\n" );
       c->done = 1;
       goto done;
@@ -207,12 +272,13 @@ done:
 }
 
 /* 
- * rip_sendto - send whole routing table to selected destination
+ * rip_sendto - send whole routing table (or its recent changes when
+ * @triggered) to selected destination
  * @rif: interface to use. Notice that we lock interface so that at
  * most one send to one interface is done.
  */
 static void
-rip_sendto( struct proto *p, ip_addr daddr, int dport, struct rip_interface *rif )
+rip_sendto( struct proto *p, ip_addr daddr, int dport, struct rip_interface *rif, int triggered )
 {
   struct iface *iface = rif->iface;
   struct rip_connection *c;
@@ -236,7 +302,8 @@ rip_sendto( struct proto *p, ip_addr daddr, int dport, struct rip_interface *rif
     bug("not enough send magic");
 
   c->done = 0;
-  FIB_ITERATE_INIT( &c->iter, &P->rtable );
+  c->pos = 0;
+  c->blocks = rip_prepare_update(p, rif, triggered, &c->count);
   add_head( &P->connections, NODE c );
   if (ipa_nonzero(daddr))
     TRACE(D_PACKETS, "Sending my routing table to %I:%d on %s", daddr, dport, rif->iface->name );
@@ -414,7 +481,7 @@ rip_process_packet( struct proto *p, struct rip_packet *packet, int num, ip_addr
 
 	  if ((P_CF->honor == HO_NEIGHBOR) && (!neigh_find2( p, &whotoldme, iface, 0 )))
 	    BAD( "They asked me to send routing table, but he is not my neighbor" );
-    	  rip_sendto( p, whotoldme, port, HEAD(P->interfaces) ); /* no broadcast */
+    	  rip_sendto( p, whotoldme, port, HEAD(P->interfaces), 0 ); /* no broadcast */
           break;
   case RIPCMD_RESPONSE: DBG( "*** Rtable from %I\n", whotoldme ); 
           if (port != P_CF->port) {
@@ -520,46 +587,105 @@ rip_dump_entry( struct rip_entry *e )
   debug( "\n" );
 }
 
-/**
- * rip_timer
- * @t: timer
+/*
+ * rip_gc_queue - put route to the garbage bucket of its next deadline
  *
- * Broadcast routing tables periodically (using rip_tx) and kill
- * routes that are too old. RIP keeps a list of its own entries present
- * in the core table by a linked list (functions rip_rte_insert() and
- * rip_rte_delete() are responsible for that), it walks this list in the timer
- * and in case an entry is too old, it is discarded.
+ * Routes are timed out when they are older than timeout_time and discarded
+ * when they are older than garbage_time. The age is given by rte->lastmod,
+ * which is also updated by the core when the same route is received again,
+ * so the time is just checked again when the bucket is processed.
  */
+static void
+rip_gc_queue(struct proto *p, rte *rte)
+{
+  bird_clock_t timeout = rte->lastmod + P_CF->timeout_time + 1;
+  bird_clock_t garbage = rte->lastmod + P_CF->garbage_time + 1;
+  bird_clock_t next = (timeout > now) ? MIN(timeout, garbage) : garbage;
 
+  /* Bucket of the next tick is processed no earlier than in the next tick */
+  next = MAX(next, P->gc_time + 1);
+
+  add_tail( &P->gc_buckets[next % P->gc_size], &rte->u.rip.garbage );
+}
+
+/* Process routes from one garbage bucket */
 static void
-rip_timer(timer *t)
+rip_gc_bucket(struct proto *p, list *bucket)
 {
-  struct proto *p = t->data;
-  struct fib_node *e, *et;
+  list todo;
+  node *n, *nx;
 
-  CHK_MAGIC;
-  DBG( "RIP: tick tock\n" );
-  
-  WALK_LIST_DELSAFE( e, et, P->garbage ) {
-    rte *rte;
-    rte = SKIP_BACK( struct rte, u.rip.garbage, e );
+  if (EMPTY_LIST(*bucket))
+    return;
+
+  /* Routes may be queued to the same bucket again */
+  init_list(&todo);
+  add_tail_list(&todo, bucket);
+  init_list(bucket);
+
+  WALK_LIST_DELSAFE( n, nx, todo ) {
+    rte *rte = SKIP_BACK( struct rte, u.rip.garbage, n );
 
     CHK_MAGIC;
 
-    DBG( "Garbage: (%p)", rte ); rte_dump( rte );
+    if (now - rte->lastmod > P_CF->garbage_time) {
+      TRACE(D_EVENTS, "entry is much too old: %I", rte->net->n.prefix );
+      rte_discard(p->table, rte);	/* Calls rip_rte_remove() */
+      continue;
+    }
 
     if (now - rte->lastmod > P_CF->timeout_time) {
       TRACE(D_EVENTS, "entry is too old: %I", rte->net->n.prefix );
       if (rte->u.rip.entry) {
 	rte->u.rip.entry->metric = P_CF->infinity;
 	rte->u.rip.metric = P_CF->infinity;
+	P->gen++;
       }
     }
 
-    if (now - rte->lastmod > P_CF->garbage_time) {
-      TRACE(D_EVENTS, "entry is much too old: %I", rte->net->n.prefix );
-      rte_discard(p->table, rte);
-    }
+    rem_node(n);
+    rip_gc_queue(p, rte);
+  }
+}
+
+/**
+ * rip_timer
+ * @t: timer
+ *
+ * Broadcast routing tables periodically (using rip_tx) and kill
+ * routes that are too old. RIP keeps its own entries present
+ * in the core table in buckets by time of their next timeout (functions
+ * rip_rte_insert() and rip_rte_remove() are responsible for that), the timer
+ * processes buckets of elapsed seconds and in case an entry is too old, it
+ * is discarded. Therefore, just routes that time out are touched.
+ */
+
+static void
+rip_timer(timer *t)
+{
+  struct proto *p = t->data;
+
+  CHK_MAGIC;
+  DBG( "RIP: tick tock\n" );
+
+  /* After a long delay, each bucket is processed just once */
+  if (now - P->gc_time > (bird_clock_t) P->gc_size)
+    P->gc_time = now - P->gc_size;
+
+  while (P->gc_time < now) {
+    P->gc_time++;
+    rip_gc_bucket(p, &P->gc_buckets[P->gc_time % P->gc_size]);
+  }
+
+  /* Entries older than 2 seconds are not sent in triggered updates */
+  while (!EMPTY_LIST(P->journal)) {
+    struct rip_entry *en = SKIP_BACK(struct rip_entry, journal, HEAD(P->journal));
+
+    if (en->updated >= now-2)	/* FIXME: Should be probably 1 or some different algorithm */
+      break;
+
+    rem_node(&en->journal);
+    en->journal.next = NULL;
   }
 
   DBG( "RIP: Broadcasting routing tables\n" );
@@ -578,7 +704,7 @@ rip_timer(timer *t)
       if (!(iface->flags & IF_UP)) continue;
       rif->triggered = P->rnd_count;
 
-      rip_sendto( p, IPA_NONE, 0, rif );
+      rip_sendto( p, IPA_NONE, 0, rif, rif->triggered );
     }
     P->tx_count++;
     P->rnd_count--;
@@ -594,6 +720,7 @@ static int
 rip_start(struct proto *p)
 {
   struct rip_interface *rif;
+  uint i;
   DBG( "RIP: starting instance...\n" );
 
   ASSERT(sizeof(struct rip_packet_heading) == 4);
@@ -605,8 +732,14 @@ rip_start(struct proto *p)
 #endif
   fib_init( &P->rtable, p->pool, sizeof( struct rip_entry ), 0, NULL );
   init_list( &P->connections );
-  init_list( &P->garbage );
+  P->gc_size = MAX(P_CF->timeout_time, P_CF->garbage_time) + 2;
+  P->gc_buckets = mb_alloc( p->pool, P->gc_size * sizeof(list) );
+  for (i = 0; i < P->gc_size; i++)
+    init_list( &P->gc_buckets[i] );
+  P->gc_time = now;
   init_list( &P->interfaces );
+  init_list( &P->journal );
+  P->gen = 1;
   P->timer = tm_new( p->pool );
   P->timer->data = p;
   P->timer->recurrent = 1;
@@ -659,6 +792,8 @@ kill_iface(struct rip_interface *i)
 {
   DBG( "RIP: Interface %s disappeared\n", i->iface->name);
   rfree(i->sock);
+  mb_free(i->full_blocks);
+  mb_free(i->trig_blocks);
   mb_free(i);
 }
 
@@ -698,6 +833,7 @@ new_iface(struct proto *p, struct iface *new, unsigned long flags, struct iface_
   rif->sock->type = SK_UDP;
   rif->sock->sport = P_CF->port;
   rif->sock->rx_hook = rip_rx;
+  rif->sock->rx_batch = 8;
   rif->sock->data = rif;
   rif->sock->rbsize = 10240;
   rif->sock->iface = new;		/* Automagically works for dummy interface */
@@ -883,9 +1019,13 @@ rip_rt_notify(struct proto *p, struct rtable *table UNUSED, struct network *net,
   struct rip_entry *e;
 
   e = fib_find( &P->rtable, &net->n.prefix, net->n.pxlen );
-  if (e)
+  if (e) {
+    if (e->journal.next)
+      rem_node(&e->journal);
     fib_delete( &P->rtable, e );
+  }
 
+  P->gen++;
   if (new) {
     e = fib_get( &P->rtable, &net->n.prefix, net->n.pxlen );
 
@@ -907,6 +1047,9 @@ rip_rt_notify(struct proto *p, struct rtable *table UNUSED, struct network *net,
       e->metric = 5;
     e->updated = e->changed = now;
     e->flags = 0;
+
+    /* Changed entries are sent in triggered updates, see rip_prepare_update() */
+    add_tail( &P->journal, &e->journal );
   }
 }
 
@@ -951,7 +1094,7 @@ rip_rte_insert(net *net UNUSED, rte *rte)
   struct proto *p = rte->attrs->src->proto;
   CHK_MAGIC;
   DBG( "rip_rte_insert: %p\n", rte );
-  add_head( &P->garbage, &rte->u.rip.garbage );
+  rip_gc_queue( p, rte );
 }
 
 /*
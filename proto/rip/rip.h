@@ -33,7 +33,8 @@ struct rip_connection {
   ip_addr addr;
   sock *send;
   struct rip_interface *rif;
-  struct fib_iterator iter;
+  struct rip_block *blocks;	/* Prepared update, see rip_prepare_update() */
+  int count, pos;		/* Number of blocks and blocks already sent */
 
   ip_addr daddr;
   int dport;
@@ -99,6 +100,7 @@ struct rip_entry {
 
   bird_clock_t updated, changed;
   int flags;
+  node journal;			/* Node in rip_proto->journal */
 };
 
 struct rip_packet {
@@ -118,6 +120,12 @@ struct rip_interface {
   int triggered;
   struct object_lock *lock;
   int multicast;
+
+  struct rip_block *full_blocks;	/* Cached full update for this interface */
+  int full_count, full_size;
+  u32 full_gen;				/* Table generation of the cached update */
+  struct rip_block *trig_blocks;	/* Last triggered update */
+  int trig_size;
 };
 
 struct rip_patt {
@@ -160,8 +168,12 @@ struct rip_proto {
   timer *timer;
   list connections;
   struct fib rtable;
-  list garbage;
+  list *gc_buckets;	/* Our routes (rte->u.rip.garbage) by second of next timeout, see rip_gc_queue() */
+  uint gc_size;		/* Number of buckets, covers the longest timeout */
+  bird_clock_t gc_time;	/* Last processed second */
   list interfaces;	/* Interfaces we really know about */
+  list journal;		/* Recently changed entries (struct rip_entry), oldest first */
+  u32 gen;		/* Generation of rtable, changed on any change of entries */
 #ifdef LOCAL_DEBUG
   int magic;
 #endif
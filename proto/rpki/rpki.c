@@ -0,0 +1,781 @@
+/*
+ *	BIRD -- The Resource Public Key Infrastructure (RPKI) to Router Protocol
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: RPKI to Router Protocol
+ *
+ * The RPKI protocol implements the router side of RFC 8210 (and RFC 6810,
+ * version 0, as a fallback). It keeps a TCP connection to a cache server and
+ * applies validated ROA payloads received from it directly to a ROA table,
+ * as entries of its own ROA source (see roa_add_item()).
+ *
+ * After the connection is established, a Reset Query downloads the complete
+ * data set. Later, a Serial Query is sent when the cache announces a new
+ * serial number by a Serial Notify or when the refresh timer fires, and just
+ * the differences since the last known serial number are received. A Cache
+ * Reset response falls back to a Reset Query. Entries received during a reset
+ * replace the previous ones by marking and sweeping (roa_mark_stale() and
+ * roa_flush_stale()), so unchanged entries stay in the table and nothing is
+ * invalid in the meantime.
+ *
+ * At the end of each response, the protocol calls roa_notify(), which
+ * re-evaluates import filters depending on the table just for networks
+ * covered by changed entries. Data are kept while the connection is down and
+ * they are removed when they are not refreshed for the expire time.
+ *
+ * Only prefixes of the address family of the build are used, the others are
+ * ignored. Router Key PDUs are ignored, as there is no BGPsec support.
+ */
+
+#undef LOCAL_DEBUG
+
+#include "nest/bird.h"
+#include "nest/cli.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "conf/conf.h"
+#include "lib/resource.h"
+#include "lib/socket.h"
+#include "lib/string.h"
+#include "lib/unaligned.h"
+
+#include "rpki.h"
+
+#define RPKI_SOURCES		256
+
+static u32 rpki_sources[RPKI_SOURCES / 32];	/* Allocated ROA sources */
+
+static void rpki_connect(struct rpki_proto *p);
+static void rpki_disconnect(struct rpki_proto *p);
+
+static const char *rpki_pdu_names[] = {
+  [RPKI_SERIAL_NOTIFY] = "Serial Notify",
+  [RPKI_SERIAL_QUERY] = "Serial Query",
+  [RPKI_RESET_QUERY] = "Reset Query",
+  [RPKI_CACHE_RESPONSE] = "Cache Response",
+  [RPKI_IPV4_PREFIX] = "IPv4 Prefix",
+  [RPKI_IPV6_PREFIX] = "IPv6 Prefix",
+  [RPKI_END_OF_DATA] = "End of Data",
+  [RPKI_CACHE_RESET] = "Cache Reset",
+  [RPKI_ROUTER_KEY] = "Router Key",
+  [RPKI_ERROR_REPORT] = "Error Report",
+};
+
+static const char *rpki_err_names[] = {
+  [RPKI_ERR_CORRUPT_DATA] = "Corrupt data",
+  [RPKI_ERR_INTERNAL] = "Internal error",
+  [RPKI_ERR_NO_DATA] = "No data available",
+  [RPKI_ERR_INVALID_REQUEST] = "Invalid request",
+  [RPKI_ERR_UNSUPPORTED_VERSION] = "Unsupported protocol version",
+  [RPKI_ERR_UNSUPPORTED_PDU] = "Unsupported PDU type",
+  [RPKI_ERR_UNKNOWN_WITHDRAW] = "Withdrawal of unknown record",
+  [RPKI_ERR_DUPLICATE_ANNOUNCE] = "Duplicate announcement received",
+  [RPKI_ERR_UNEXPECTED_VERSION] = "Unexpected protocol version",
+};
+
+static inline const char *
+rpki_pdu_name(uint type)
+{
+  return ((type < ARRAY_SIZE(rpki_pdu_names)) && rpki_pdu_names[type]) ? rpki_pdu_names[type] : "Unknown PDU";
+}
+
+static inline const char *
+rpki_err_name(uint code)
+{
+  return (code < ARRAY_SIZE(rpki_err_names)) ? rpki_err_names[code] : "Unknown error";
+}
+
+/* Each instance has its own ROA source, so that they do not mix their entries */
+static uint
+rpki_alloc_src(void)
+{
+  uint i;
+
+  for (i = ROA_SRC_DYNAMIC + 1; i < RPKI_SOURCES; i++)
+    if (!(rpki_sources[i / 32] & (1 << (i % 32))))
+      {
+	rpki_sources[i / 32] |= 1 << (i % 32);
+	return i;
+      }
+
+  return 0;
+}
+
+static void
+rpki_free_src(uint src)
+{
+  rpki_sources[src / 32] &= ~(1 << (src % 32));
+}
+
+
+/*
+ *	Sending
+ */
+
+static byte *
+rpki_put_header(struct rpki_proto *p, byte *buf, uint type, uint session, uint len)
+{
+  buf[0] = p->version;
+  buf[1] = type;
+  put_u16(buf + 2, session);
+  put_u32(buf + 4, len);
+  return buf + RPKI_HEADER_LENGTH;
+}
+
+static void
+rpki_send_query(struct rpki_proto *p)
+{
+  byte *buf = p->sk->tbuf;
+  uint len;
+
+  if (p->synced)
+    {
+      TRACE(D_PACKETS, "Sending Serial Query, serial %u", p->serial);
+      put_u32(rpki_put_header(p, buf, RPKI_SERIAL_QUERY, p->session_id, 12), p->serial);
+      len = 12;
+    }
+  else
+    {
+      TRACE(D_PACKETS, "Sending Reset Query");
+      rpki_put_header(p, buf, RPKI_RESET_QUERY, 0, RPKI_HEADER_LENGTH);
+      len = RPKI_HEADER_LENGTH;
+    }
+
+  p->state = RPKI_S_QUERY;
+  p->resetting = !p->synced;
+
+  /* The response timeout, End of Data restarts it for periodic refresh */
+  tm_start(p->refresh_timer, p->retry_time);
+
+  sk_send(p->sk, len);
+}
+
+static void
+rpki_send_error(struct rpki_proto *p, uint code, byte *pdu, uint pdu_len, const char *text)
+{
+  uint text_len = strlen(text);
+  uint max = p->sk->tbsize - RPKI_HEADER_LENGTH - 8;
+  byte *buf = p->sk->tbuf;
+  byte *pos;
+
+  text_len = MIN(text_len, max / 2);
+  pdu_len = MIN(pdu_len, max - text_len);
+
+  pos = rpki_put_header(p, buf, RPKI_ERROR_REPORT, code, RPKI_HEADER_LENGTH + 8 + pdu_len + text_len);
+  put_u32(pos, pdu_len);
+  memcpy(pos + 4, pdu, pdu_len);
+  pos += 4 + pdu_len;
+  put_u32(pos, text_len);
+  memcpy(pos + 4, text, text_len);
+  pos += 4 + text_len;
+
+  TRACE(D_PACKETS, "Sending Error Report (%s)", rpki_err_name(code));
+  sk_send(p->sk, pos - buf);
+}
+
+/* Report an error to the cache and drop the connection */
+static void
+rpki_error(struct rpki_proto *p, uint code, byte *pdu, uint pdu_len, const char *msg)
+{
+  log(L_ERR "%s: %s", p->p.name, msg);
+  rpki_send_error(p, code, pdu, pdu_len, msg);
+  rpki_disconnect(p);
+}
+
+
+/*
+ *	Receiving
+ */
+
+static uint
+rpki_pdu_length(struct rpki_proto *p, uint type)
+{
+  switch (type)
+    {
+    case RPKI_SERIAL_NOTIFY:	return 12;
+    case RPKI_CACHE_RESPONSE:	return 8;
+    case RPKI_IPV4_PREFIX:	return 20;
+    case RPKI_IPV6_PREFIX:	return 32;
+    case RPKI_END_OF_DATA:	return p->version ? 24 : 12;
+    case RPKI_CACHE_RESET:	return 8;
+    default:			return 0;
+    }
+}
+
+static void
+rpki_rx_prefix(struct rpki_proto *p, byte *pkt, uint type)
+{
+  uint flags = pkt[8];
+  uint pxlen = pkt[9];
+  uint maxlen = pkt[10];
+  uint max = (type == RPKI_IPV4_PREFIX) ? 32 : 128;
+  byte *pos = pkt + 12;
+  u32 asn;
+
+  if ((pxlen > maxlen) || (maxlen > max))
+    {
+      rpki_error(p, RPKI_ERR_CORRUPT_DATA, pkt, get_u32(pkt + 4), "Invalid prefix length");
+      return;
+    }
+
+#ifdef IPV6
+  if (type == RPKI_IPV4_PREFIX)
+    return;
+#else
+  if (type == RPKI_IPV6_PREFIX)
+    return;
+#endif
+
+  ip_addr px = ipa_and(get_ipa(pos), ipa_mkmask(pxlen));
+  asn = get_u32(pos + ((type == RPKI_IPV4_PREFIX) ? 4 : 16));
+
+  if (flags & RPKI_FLAG_ANNOUNCE)
+    {
+      DBG("RPKI: Announce %I/%d max %d as %u\n", px, pxlen, maxlen, asn);
+      if (roa_add_item(p->table, px, pxlen, maxlen, asn, p->src))
+	p->records++;
+    }
+  else
+    {
+      DBG("RPKI: Withdraw %I/%d max %d as %u\n", px, pxlen, maxlen, asn);
+      if (roa_delete_item(p->table, px, pxlen, maxlen, asn, p->src))
+	p->records--;
+      else
+	TRACE(D_ROUTES, "Withdrawal of unknown record %I/%d max %d as %u", px, pxlen, maxlen, asn);
+    }
+}
+
+static void
+rpki_rx_end_of_data(struct rpki_proto *p, byte *pkt)
+{
+  struct rpki_config *cf = p->cf;
+
+  p->serial = get_u32(pkt + 8);
+
+  if (p->version)
+    {
+      uint refresh = get_u32(pkt + 12);
+      uint retry = get_u32(pkt + 16);
+      uint expire = get_u32(pkt + 20);
+
+      /* Ranges of RFC 8210 6., invalid values are ignored */
+      if (!(cf->timers_set & RPKI_CF_REFRESH) && (refresh >= 1) && (refresh <= 86400))
+	p->refresh_time = refresh;
+
+      if (!(cf->timers_set & RPKI_CF_RETRY) && (retry >= 1) && (retry <= 7200))
+	p->retry_time = retry;
+
+      if (!(cf->timers_set & RPKI_CF_EXPIRE) && (expire >= 600) && (expire <= 172800))
+	p->expire_time = expire;
+    }
+
+  if (p->resetting)
+    p->records -= roa_flush_stale(p->table, p->src);
+
+  p->synced = 1;
+  p->resetting = 0;
+  p->state = RPKI_S_IDLE;
+  p->last_update = now;
+  p->updates++;
+
+  TRACE(D_EVENTS, "Synchronized to serial %u, %u records", p->serial, p->records);
+
+  tm_start(p->refresh_timer, p->refresh_time);
+  tm_start(p->expire_timer, p->expire_time);
+  roa_notify(p->table);
+
+  if (p->p.proto_state != PS_UP)
+    proto_notify_state(&p->p, PS_UP);
+}
+
+static void
+rpki_rx_error_report(struct rpki_proto *p, byte *pkt, uint len)
+{
+  uint code = get_u16(pkt + 2);
+  uint pdu_len = get_u32(pkt + 8);
+  char text[256] = "";
+
+  if ((len >= 16) && (pdu_len <= len - 16))
+    {
+      uint text_len = get_u32(pkt + 12 + pdu_len);
+      if (text_len <= len - 16 - pdu_len)
+	bsnprintf(text, sizeof(text), ": %.*s", (int) MIN(text_len, 200), pkt + 16 + pdu_len);
+    }
+
+  if ((code == RPKI_ERR_UNSUPPORTED_VERSION) && !p->version_fixed && (pkt[0] < p->version))
+    {
+      /* Try again with the version of the cache */
+      log(L_INFO "%s: Cache does not support version %u, falling back to %u", p->p.name, p->version, pkt[0]);
+      p->version = pkt[0];
+      rpki_disconnect(p);
+      tm_start(p->retry_timer, 0);
+      return;
+    }
+
+  if (code == RPKI_ERR_NO_DATA)
+    {
+      /* Not fatal, the query is repeated after the retry time */
+      log(L_WARN "%s: Cache has no data available%s", p->p.name, text);
+      p->state = RPKI_S_IDLE;
+      tm_start(p->refresh_timer, p->retry_time);
+      return;
+    }
+
+  log(L_ERR "%s: Error Report from cache: %s%s", p->p.name, rpki_err_name(code), text);
+  rpki_disconnect(p);
+}
+
+/* Process one complete PDU, returns 0 when the connection was dropped */
+static int
+rpki_rx_pdu(struct rpki_proto *p, byte *pkt, uint len)
+{
+  uint version = pkt[0];
+  uint type = pkt[1];
+  uint session = get_u16(pkt + 2);
+  sock *sk = p->sk;
+
+  DBG("RPKI: Got %s, length %u\n", rpki_pdu_name(type), len);
+  if (type != RPKI_IPV4_PREFIX && type != RPKI_IPV6_PREFIX)
+    TRACE(D_PACKETS, "Got %s", rpki_pdu_name(type));
+
+  if (type == RPKI_ERROR_REPORT)
+    {
+      rpki_rx_error_report(p, pkt, len);
+      return p->sk == sk;
+    }
+
+  if (version != p->version)
+    {
+      /* A cache supporting only a lower version may just answer by it */
+      if (p->version_fixed || (version > p->version))
+	{
+	  rpki_error(p, RPKI_ERR_UNEXPECTED_VERSION, pkt, len, "Unexpected protocol version");
+	  return 0;
+	}
+
+      log(L_INFO "%s: Cache uses version %u", p->p.name, version);
+      p->version = version;
+    }
+
+  p->version_fixed = 1;
+
+  if (type == RPKI_ROUTER_KEY && version > 0)
+    {
+      if (p->state != RPKI_S_DATA)
+	goto unexpected;
+
+      return 1;
+    }
+
+  uint plen = rpki_pdu_length(p, type);
+
+  if (!plen)
+    {
+      rpki_error(p, RPKI_ERR_UNSUPPORTED_PDU, pkt, len, "Unsupported PDU type");
+      return 0;
+    }
+
+  if (len != plen)
+    {
+      rpki_error(p, RPKI_ERR_CORRUPT_DATA, pkt, len, "Invalid PDU length");
+      return 0;
+    }
+
+  switch (type)
+    {
+    case RPKI_SERIAL_NOTIFY:
+      /* Queries in progress will get the new data anyway */
+      if ((p->state == RPKI_S_IDLE) && (!p->synced || (session == p->session_id)) &&
+	  (!p->synced || (get_u32(pkt + 8) != p->serial)))
+	rpki_send_query(p);
+      break;
+
+    case RPKI_CACHE_RESPONSE:
+      if (p->state != RPKI_S_QUERY)
+	goto unexpected;
+
+      if (p->resetting)
+	{
+	  p->session_id = session;
+	  roa_mark_stale(p->table, p->src);
+	}
+      else if (session != p->session_id)
+	goto bad_session;
+
+      p->state = RPKI_S_DATA;
+      break;
+
+    case RPKI_IPV4_PREFIX:
+    case RPKI_IPV6_PREFIX:
+      if (p->state != RPKI_S_DATA)
+	goto unexpected;
+
+      rpki_rx_prefix(p, pkt, type);
+      break;
+
+    case RPKI_END_OF_DATA:
+      if (p->state != RPKI_S_DATA)
+	goto unexpected;
+
+      if (session != p->session_id)
+	goto bad_session;
+
+      rpki_rx_end_of_data(p, pkt);
+      break;
+
+    case RPKI_CACHE_RESET:
+      if (p->state != RPKI_S_QUERY)
+	goto unexpected;
+
+      /* The cache cannot provide the difference, download everything */
+      p->synced = 0;
+      rpki_send_query(p);
+      break;
+    }
+
+  return p->sk == sk;
+
+unexpected:
+  rpki_error(p, RPKI_ERR_CORRUPT_DATA, pkt, len, "Unexpected PDU");
+  return 0;
+
+bad_session:
+  /* The cache was restarted, a new reset is needed after reconnection */
+  p->synced = 0;
+  rpki_error(p, RPKI_ERR_CORRUPT_DATA, pkt, len, "Session ID mismatch");
+  return 0;
+}
+
+static int
+rpki_rx(sock *sk, int size)
+{
+  struct rpki_proto *p = sk->data;
+  byte *pkt = sk->rbuf;
+  byte *end = sk->rbuf + size;
+
+  while (end - pkt >= RPKI_HEADER_LENGTH)
+    {
+      uint len = get_u32(pkt + 4);
+
+      if ((len < RPKI_HEADER_LENGTH) || (len > RPKI_MAX_PDU_LENGTH))
+	{
+	  rpki_error(p, RPKI_ERR_CORRUPT_DATA, pkt, RPKI_HEADER_LENGTH, "Invalid PDU length");
+	  return 0;
+	}
+
+      if (end - pkt < len)
+	break;
+
+      if (!rpki_rx_pdu(p, pkt, len))
+	return 0;
+
+      pkt += len;
+    }
+
+  /* Keep the partial PDU */
+  memmove(sk->rbuf, pkt, end - pkt);
+  sk->rpos = sk->rbuf + (end - pkt);
+  return 0;
+}
+
+
+/*
+ *	Connection
+ */
+
+static void
+rpki_connected(sock *sk)
+{
+  struct rpki_proto *p = sk->data;
+
+  TRACE(D_EVENTS, "Connected to %I", sk->daddr);
+  tm_stop(p->retry_timer);
+  sk->tx_hook = NULL;
+  p->state = RPKI_S_IDLE;
+  p->version_fixed = 0;
+
+  rpki_send_query(p);
+}
+
+static void
+rpki_sock_err(sock *sk, int err)
+{
+  struct rpki_proto *p = sk->data;
+
+  if (err)
+    TRACE(D_EVENTS, "Connection lost (%M)", err);
+  else
+    TRACE(D_EVENTS, "Connection closed");
+
+  rpki_disconnect(p);
+}
+
+static void
+rpki_retry_timeout(timer *t)
+{
+  struct rpki_proto *p = t->data;
+
+  if (p->sk)
+    {
+      TRACE(D_EVENTS, "Connection timeout");
+      rfree(p->sk);
+      p->sk = NULL;
+    }
+
+  rpki_connect(p);
+}
+
+static void
+rpki_refresh_timeout(timer *t)
+{
+  struct rpki_proto *p = t->data;
+
+  if (!p->sk)
+    return;
+
+  if (p->state != RPKI_S_IDLE)
+    {
+      log(L_WARN "%s: No response from cache", p->p.name);
+      rpki_disconnect(p);
+      return;
+    }
+
+  rpki_send_query(p);
+}
+
+static void
+rpki_flush(struct rpki_proto *p)
+{
+  roa_flush(p->table, p->src);
+  roa_notify(p->table);
+  p->records = 0;
+  p->synced = 0;
+}
+
+static void
+rpki_expire_timeout(timer *t)
+{
+  struct rpki_proto *p = t->data;
+
+  log(L_WARN "%s: Data from cache expired", p->p.name);
+  rpki_flush(p);
+}
+
+static void
+rpki_connect(struct rpki_proto *p)
+{
+  sock *sk = sk_new(p->p.pool);
+
+  sk->type = SK_TCP_ACTIVE;
+  sk->daddr = p->cf->remote_ip;
+  sk->dport = p->cf->remote_port;
+  sk->rbsize = 4 * RPKI_MAX_PDU_LENGTH;
+  sk->tbsize = 1024;
+  sk->tos = IP_PREC_INTERNET_CONTROL;
+  sk->rx_hook = rpki_rx;
+  sk->tx_hook = rpki_connected;
+  sk->err_hook = rpki_sock_err;
+  sk->data = p;
+  p->sk = sk;
+  p->state = RPKI_S_CONNECTING;
+
+  TRACE(D_EVENTS, "Connecting to %I port %u", sk->daddr, sk->dport);
+  tm_start(p->retry_timer, p->retry_time);
+
+  if (sk_open(sk) < 0)
+    {
+      sk_log_error(sk, p->p.name);
+      rfree(sk);
+      p->sk = NULL;
+    }
+}
+
+/* Close the connection and schedule a new one, data are kept until expired */
+static void
+rpki_disconnect(struct rpki_proto *p)
+{
+  rfree(p->sk);
+  p->sk = NULL;
+  p->state = RPKI_S_CONNECTING;
+  tm_stop(p->refresh_timer);
+
+  /* Changes from an incomplete response are valid data as well */
+  roa_notify(p->table);
+
+  tm_start(p->retry_timer, p->retry_time);
+}
+
+
+/*
+ *	Protocol glue
+ */
+
+static struct proto *
+rpki_init(struct proto_config *C)
+{
+  struct proto *P = proto_new(C, sizeof(struct rpki_proto));
+
+  return P;
+}
+
+static int
+rpki_start(struct proto *P)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+  struct rpki_config *cf = (struct rpki_config *) P->cf;
+
+  p->cf = cf;
+  p->table = cf->roa_table->table;
+  p->sk = NULL;
+  p->state = RPKI_S_CONNECTING;
+  p->version = RPKI_VERSION_MAX;
+  p->version_fixed = 0;
+  p->synced = p->resetting = 0;
+  p->session_id = 0;
+  p->serial = 0;
+  p->retry_time = cf->retry_time;
+  p->refresh_time = cf->refresh_time;
+  p->expire_time = cf->expire_time;
+  p->last_update = 0;
+  p->records = p->updates = 0;
+  p->retry_timer = tm_new_set(P->pool, rpki_retry_timeout, p, 0, 0);
+  p->refresh_timer = tm_new_set(P->pool, rpki_refresh_timeout, p, 0, 0);
+  p->expire_timer = tm_new_set(P->pool, rpki_expire_timeout, p, 0, 0);
+
+  p->src = rpki_alloc_src();
+  if (!p->src)
+    {
+      log(L_ERR "%s: No ROA source available", P->name);
+      return PS_START;
+    }
+
+  rpki_connect(p);
+  return PS_START;
+}
+
+static int
+rpki_shutdown(struct proto *P)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+
+  if (p->src)
+    {
+      /* The table may be already gone with the old config */
+      if (p->cf->roa_table->table == p->table)
+	rpki_flush(p);
+
+      rpki_free_src(p->src);
+      p->src = 0;
+    }
+
+  return PS_DOWN;
+}
+
+static int
+rpki_reconfigure(struct proto *P, struct proto_config *CF)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+  struct rpki_config *new = (struct rpki_config *) CF;
+  struct rpki_config *old = p->cf;
+
+  /* ROA table configs differ between configs, the table is identified by name */
+  if (strcmp(old->roa_table->name, new->roa_table->name) ||
+      !ipa_equal(old->remote_ip, new->remote_ip) ||
+      (old->remote_port != new->remote_port) ||
+      (old->retry_time != new->retry_time) ||
+      (old->refresh_time != new->refresh_time) ||
+      (old->expire_time != new->expire_time) ||
+      (old->timers_set != new->timers_set))
+    return 0;
+
+  p->cf = new;
+  return 1;
+}
+
+static void
+rpki_copy_config(struct proto_config *dest, struct proto_config *src)
+{
+  /* Just a shallow copy */
+  proto_copy_rest(dest, src, sizeof(struct rpki_config));
+}
+
+static void
+rpki_get_status(struct proto *P, byte *buf)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+
+  if (P->proto_state == PS_DOWN)
+    return;
+
+  if (!p->sk || (p->state == RPKI_S_CONNECTING))
+    strcpy(buf, "Connecting");
+  else if (p->state == RPKI_S_IDLE)
+    strcpy(buf, p->synced ? "Established" : "Connected");
+  else
+    strcpy(buf, "Synchronizing");
+}
+
+static void
+rpki_show_proto_info(struct proto *P)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+
+  proto_show_basic_info(P);
+
+  cli_msg(-1006, "  Cache server:     %I port %u", p->cf->remote_ip, p->cf->remote_port);
+  cli_msg(-1006, "  ROA table:        %s", p->cf->roa_table->name);
+
+  if (P->proto_state == PS_DOWN)
+    return;
+
+  cli_msg(-1006, "  Protocol version: %u", p->version);
+  if (p->synced)
+    {
+      cli_msg(-1006, "  Session ID:       %u", p->session_id);
+      cli_msg(-1006, "  Serial number:    %u", p->serial);
+      cli_msg(-1006, "  Last update:      %d s ago", (int) (now - p->last_update));
+    }
+  cli_msg(-1006, "  ROA entries:      %u", p->records);
+  cli_msg(-1006, "  Updates:          %u", p->updates);
+  cli_msg(-1006, "  Refresh time:     %u s", p->refresh_time);
+  cli_msg(-1006, "  Retry time:       %u s", p->retry_time);
+  cli_msg(-1006, "  Expire time:      %u s", p->expire_time);
+}
+
+/**
+ * rpki_check_config - check RPKI configuration
+ * @c: RPKI configuration
+ */
+void
+rpki_check_config(struct rpki_config *c)
+{
+  if (!c->roa_table)
+    {
+      if (EMPTY_LIST(new_config->roa_tables))
+	cf_error("No ROA table defined");
+
+      c->roa_table = HEAD(new_config->roa_tables);
+    }
+
+  if (ipa_zero(c->remote_ip))
+    cf_error("Cache server address must be configured");
+
+  if (c->expire_time <= c->refresh_time)
+    cf_error("Expire time must be longer than refresh time");
+}
+
+struct protocol proto_rpki = {
+  .name =		"RPKI",
+  .template =		"rpki%d",
+  .config_size =	sizeof(struct rpki_config),
+  .init =		rpki_init,
+  .start =		rpki_start,
+  .shutdown =		rpki_shutdown,
+  .reconfigure =	rpki_reconfigure,
+  .copy_config =	rpki_copy_config,
+  .get_status =		rpki_get_status,
+  .show_proto_info =	rpki_show_proto_info
+};
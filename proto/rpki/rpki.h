@@ -0,0 +1,92 @@
+/*
+ *	BIRD -- The Resource Public Key Infrastructure (RPKI) to Router Protocol
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_RPKI_H_
+#define _BIRD_RPKI_H_
+
+#include "nest/bird.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "lib/socket.h"
+
+#define RPKI_VERSION_MAX	1	/* RFC 8210, version 0 is RFC 6810 */
+#define RPKI_HEADER_LENGTH	8
+#define RPKI_MAX_PDU_LENGTH	4096	/* Longer PDUs are only Error Reports with long texts */
+
+#define RPKI_SERIAL_NOTIFY	0
+#define RPKI_SERIAL_QUERY	1
+#define RPKI_RESET_QUERY	2
+#define RPKI_CACHE_RESPONSE	3
+#define RPKI_IPV4_PREFIX	4
+#define RPKI_IPV6_PREFIX	6
+#define RPKI_END_OF_DATA	7
+#define RPKI_CACHE_RESET	8
+#define RPKI_ROUTER_KEY		9
+#define RPKI_ERROR_REPORT	10
+
+#define RPKI_ERR_CORRUPT_DATA		0
+#define RPKI_ERR_INTERNAL		1
+#define RPKI_ERR_NO_DATA		2
+#define RPKI_ERR_INVALID_REQUEST	3
+#define RPKI_ERR_UNSUPPORTED_VERSION	4
+#define RPKI_ERR_UNSUPPORTED_PDU	5
+#define RPKI_ERR_UNKNOWN_WITHDRAW	6
+#define RPKI_ERR_DUPLICATE_ANNOUNCE	7
+#define RPKI_ERR_UNEXPECTED_VERSION	8
+
+#define RPKI_FLAG_ANNOUNCE	0x01
+
+#define RPKI_DEFAULT_PORT	323
+#define RPKI_DEFAULT_RETRY	600
+#define RPKI_DEFAULT_REFRESH	3600
+#define RPKI_DEFAULT_EXPIRE	7200
+
+/* Intervals set explicitly in the config, they override End of Data */
+#define RPKI_CF_RETRY		0x01
+#define RPKI_CF_REFRESH		0x02
+#define RPKI_CF_EXPIRE		0x04
+
+struct rpki_config {
+  struct proto_config c;
+  struct roa_table_config *roa_table;	/* ROA table to be updated */
+  ip_addr remote_ip;			/* Address of the cache server */
+  uint remote_port;
+  uint retry_time;
+  uint refresh_time;
+  uint expire_time;
+  u8 timers_set;			/* RPKI_CF_* flags */
+};
+
+#define RPKI_S_CONNECTING	0	/* Waiting for the connection */
+#define RPKI_S_IDLE		1	/* Connected, no query in progress */
+#define RPKI_S_QUERY		2	/* Query sent, waiting for Cache Response */
+#define RPKI_S_DATA		3	/* Receiving data, waiting for End of Data */
+
+struct rpki_proto {
+  struct proto p;
+  struct rpki_config *cf;		/* Shortcut to RPKI configuration */
+  struct roa_table *table;		/* Updated ROA table */
+  sock *sk;				/* Connection to the cache, NULL if none */
+  timer *retry_timer;			/* Connection timeout and retry */
+  timer *refresh_timer;			/* Periodic Serial Query */
+  timer *expire_timer;			/* Removal of data not refreshed for too long */
+  u8 state;				/* RPKI_S_* */
+  u8 version;				/* Protocol version in use */
+  u8 version_fixed;			/* Version is negotiated for this session */
+  u8 src;				/* ROA source of this instance */
+  u8 synced;				/* Session ID and serial number are valid */
+  u8 resetting;				/* Receiving a response to Reset Query */
+  u16 session_id;
+  u32 serial;
+  uint retry_time, refresh_time, expire_time;	/* Current intervals */
+  bird_clock_t last_update;		/* Time of last End of Data */
+  uint records;				/* ROA entries from the cache */
+  u32 updates;				/* Processed End of Data PDUs */
+};
+
+void rpki_check_config(struct rpki_config *c);
+
+#endif
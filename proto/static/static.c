@@ -31,7 +31,10 @@
  * The only other thing worth mentioning is that when asked for reconfiguration,
  * Static not only compares the two configurations, but it also calculates
  * difference between the lists of static routes and it just inserts the
- * newly added routes and removes the obsolete ones.
+ * newly added routes and removes the obsolete ones. New routes are indexed by
+ * a hash table for that, so the difference is found in linear time. During
+ * start and reconfiguration, routes are propagated to the table in batches
+ * (see rte_batch_start()).
  */
 
 #undef LOCAL_DEBUG
@@ -45,10 +48,35 @@
 #include "filter/filter.h"
 #include "lib/string.h"
 #include "lib/alloca.h"
+#include "lib/hash.h"
 
 #include "static.h"
 
 static linpool *static_lp;
+static struct rte_batch *static_batch;	/* Active batch of route updates, if any */
+
+static inline void
+static_rte_update(struct proto *p, net *n, rte *e)
+{
+  if (static_batch)
+    rte_batch_update(static_batch, n, e, p->main_source);
+  else
+    rte_update(p, n, e);
+}
+
+static inline void
+static_batch_start(struct proto *p, struct rte_batch *batch)
+{
+  rte_batch_start(batch, p->main_ahook);
+  static_batch = batch;
+}
+
+static inline void
+static_batch_end(struct rte_batch *batch)
+{
+  static_batch = NULL;
+  rte_batch_end(batch);
+}
 
 static inline rtable *
 p_igp_table(struct proto *p)
@@ -110,7 +138,7 @@ static_install(struct proto *p, struct static_route *r, struct iface *ifa)
   if (r->dest == RTDX_RECURSIVE)
     rta_set_recursive_next_hop(p->table, &a, p_igp_table(p), &r->via, &r->via);
 
-  /* We skip rta_lookup() here */
+  /* We skip rta_lookup() here, unless the route is batched */
 
   n = net_get(p->table, r->net, r->masklen);
   e = rte_get_temp(&a);
@@ -120,7 +148,11 @@ static_install(struct proto *p, struct static_route *r, struct iface *ifa)
   if (r->cmds)
     f_eval_rte(r->cmds, &e, static_lp);
 
-  rte_update(p, n, e);
+  /* Batched routes outlive both local and temporary attributes */
+  if (static_batch)
+    e->attrs = rta_lookup(e->attrs);
+
+  static_rte_update(p, n, e);
   r->installed = 1;
 
   if (r->cmds)
@@ -137,7 +169,7 @@ static_remove(struct proto *p, struct static_route *r)
 
   DBG("Removing static route %I/%d via %I\n", r->net, r->masklen, r->via);
   n = net_find(p->table, r->net, r->masklen);
-  rte_update(p, n, NULL);
+  static_rte_update(p, n, NULL);
   r->installed = 0;
 }
 
@@ -277,6 +309,7 @@ static_start(struct proto *p)
 {
   struct static_config *cf = (void *) p->cf;
   struct static_route *r;
+  struct rte_batch batch;
 
   DBG("Static: take off!\n");
 
@@ -289,8 +322,11 @@ static_start(struct proto *p)
   /* We have to go UP before routes could be installed */
   proto_notify_state(p, PS_UP);
 
+  static_batch_start(p, &batch);
   WALK_LIST(r, cf->other_routes)
     static_add(p, cf, r);
+  static_batch_end(&batch);
+
   return PS_UP;
 }
 
@@ -462,12 +498,6 @@ static_init(struct proto_config *c)
   return p;
 }
 
-static inline int
-static_same_net(struct static_route *x, struct static_route *y)
-{
-  return ipa_equal(x->net, y->net) && (x->masklen == y->masklen);
-}
-
 static inline int
 static_same_dest(struct static_route *x, struct static_route *y)
 {
@@ -505,14 +535,23 @@ static_same_rte(struct static_route *x, struct static_route *y)
 }
 
 
+#define SRT_KEY(n)		n->net, n->masklen
+#define SRT_NEXT(n)		n->hash_next
+#define SRT_EQ(a1,l1,a2,l2)	ipa_equal(a1, a2) && l1 == l2
+#define SRT_FN(a,l)		(ipa_hash32(a) ^ l)
+#define SRT_ORDER		8
+
+#define SRT_REHASH		static_route_rehash
+#define SRT_PARAMS		/8, *2, 2, 2, 8, 24
+
+HASH_DEFINE_REHASH_FN(SRT, struct static_route)
+
 static void
-static_match(struct proto *p, struct static_route *r, struct static_config *n)
+static_match(struct proto *p, struct static_route *r, struct static_route *t)
 {
-  struct static_route *t;
-
   /*
-   * For given old route *r we find whether a route to the same
-   * network is also in the new route list. In that case, we keep the
+   * For given old route *r we found whether a route to the same
+   * network is also in the new route list (@t). In that case, we keep the
    * route and possibly update the route later if destination changed.
    * Otherwise, we remove the route.
    */
@@ -520,18 +559,12 @@ static_match(struct proto *p, struct static_route *r, struct static_config *n)
   if (r->neigh)
     r->neigh->data = NULL;
 
-  WALK_LIST(t, n->iface_routes)
-    if (static_same_net(r, t))
-      goto found;
-
-  WALK_LIST(t, n->other_routes)
-    if (static_same_net(r, t))
-      goto found;
-
-  static_remove(p, r);
-  return;
+  if (!t)
+  {
+    static_remove(p, r);
+    return;
+  }
 
- found:
   /* If destination is different, force reinstall */
   if ((r->installed > 0) && !static_same_rte(r, t))
     t->installed = -1;
@@ -551,15 +584,30 @@ static_reconfigure(struct proto *p, struct proto_config *new)
   struct static_config *o = (void *) p->cf;
   struct static_config *n = (void *) new;
   struct static_route *r;
+  struct rte_batch batch;
+  HASH(struct static_route) routes;
 
   if (cf_igp_table(o) != cf_igp_table(n))
     return 0;
 
+  /* Index new routes, the first one for a network is used */
+  HASH_INIT(routes, p->pool, SRT_ORDER);
+  WALK_LIST(r, n->iface_routes)
+    if (!HASH_FIND(routes, SRT, r->net, r->masklen))
+      HASH_INSERT2(routes, SRT, p->pool, r);
+  WALK_LIST(r, n->other_routes)
+    if (!HASH_FIND(routes, SRT, r->net, r->masklen))
+      HASH_INSERT2(routes, SRT, p->pool, r);
+
+  static_batch_start(p, &batch);
+
   /* Delete all obsolete routes and reset neighbor entries */
   WALK_LIST(r, o->iface_routes)
-    static_match(p, r, n);
+    static_match(p, r, HASH_FIND(routes, SRT, r->net, r->masklen));
   WALK_LIST(r, o->other_routes)
-    static_match(p, r, n);
+    static_match(p, r, HASH_FIND(routes, SRT, r->net, r->masklen));
+
+  mb_free(routes.data);
 
   /* Now add all new routes, those not changed will be ignored by static_install() */
   WALK_LIST(r, n->iface_routes)
@@ -571,6 +619,8 @@ static_reconfigure(struct proto *p, struct proto_config *new)
   WALK_LIST(r, n->other_routes)
     static_add(p, n, r);
 
+  static_batch_end(&batch);
+
   WALK_LIST(r, o->other_routes)
     static_rte_cleanup(p, r);
 
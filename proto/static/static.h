@@ -26,6 +26,7 @@ void static_init_config(struct static_config *);
 struct static_route {
   node n;
   struct static_route *chain;		/* Next for the same neighbor */
+  struct static_route *hash_next;	/* Next in hash of new routes during reconfiguration */
   ip_addr net;				/* Network we route */
   int masklen;				/* Mask length */
   int dest;				/* Destination type (RTD_*) */
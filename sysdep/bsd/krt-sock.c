@@ -71,6 +71,16 @@
 #define KRT_MAX_TABLES 1
 #endif
 
+/*
+ * Our own route changes are not looped back to kernel sockets, errors are
+ * reported by write(2) anyway. Messages about changes done by other processes
+ * are read in bulks, a large receive buffer keeps them from being dropped when
+ * the routes are changed by BIRD with another socket or by another daemon.
+ */
+#define KRT_SOCK_RCVBUF (4 << 20)
+
+static pid_t krt_pid;
+
 
 
 /* Dynamic max number of tables */
@@ -417,7 +427,8 @@ krt_read_route(struct ks_msg *msg, struct krt_proto *p, int scan)
     src = KRT_SRC_REDIRECT;
   else if (flags & self_mask)
     {
-      if (!scan)
+      /* In incremental mode, changes of our routes by others are fixed immediately */
+      if (!scan && (!KRT_CF->incremental || (msg->rtm.rtm_pid == krt_pid)))
 	SKIP("echo\n");
       src = KRT_SRC_BIRD;
     }
@@ -721,6 +732,8 @@ krt_read_addr(struct ks_msg *msg, int scan)
     if_end_partial_update(iface);
 }
 
+static void krt_sock_lost(struct proto *p);
+
 static void
 krt_read_msg(struct proto *p, struct ks_msg *msg, int scan)
 {
@@ -745,6 +758,12 @@ krt_read_msg(struct proto *p, struct ks_msg *msg, int scan)
     case RTM_DELADDR:
       krt_read_addr(msg, scan);
       break;
+#ifdef RTM_DESYNC
+    case RTM_DESYNC:
+      /* OpenBSD reports dropped messages in-band */
+      krt_sock_lost(p);
+      break;
+#endif
     default:
       break;
   }
@@ -898,18 +917,58 @@ kif_do_scan(struct kif_proto *p)
 
 /* Kernel sockets */
 
+static struct tbf rl_krt_sock_err = TBF_DEFAULT_LOG_LIMITS;
+
+/* Notifications were lost, incremental protocols need a scan */
+static void
+krt_sock_lost(struct proto *P)
+{
+  struct krt_proto *p = (struct krt_proto *) P;
+
+  log_rl(&rl_krt_sock_err, L_WARN "KRT: Kernel socket notifications lost");
+  kif_request_scan();
+
+#ifdef KRT_SHARED_SOCKET
+  /* P is NULL for the shared socket */
+  int i;
+
+  for (i = 0; i < KRT_MAX_TABLES; i++)
+    if ((p = krt_table_map[i]) && KRT_CF->incremental)
+      krt_request_scan(p);
+#else
+  if (KRT_CF->incremental)
+    krt_request_scan(p);
+#endif
+}
+
 static int
 krt_sock_hook(sock *sk, int size UNUSED)
 {
   struct ks_msg msg;
   int l = read(sk->fd, (char *)&msg, sizeof(msg));
 
-  if (l <= 0)
-    log(L_ERR "krt-sock: read failed");
-  else
-    krt_read_msg((struct proto *) sk->data, &msg, 0);
+  if (l < 0)
+  {
+    if (errno == ENOBUFS)
+    {
+      /* The kernel dropped some messages, more data are likely to be ready */
+      krt_sock_lost((struct proto *) sk->data);
+      return 1;
+    }
 
-  return 0;
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+      log(L_ERR "KRT: Kernel socket read failed: %m");
+    return 0;
+  }
+
+  if (l == 0)
+  {
+    log(L_ERR "KRT: Kernel socket read failed");
+    return 0;
+  }
+
+  krt_read_msg((struct proto *) sk->data, &msg, 0);
+  return 1;
 }
 
 static sock *
@@ -930,6 +989,27 @@ krt_sock_open(pool *pool, void *data, int table_id)
   }
 #endif
 
+  int zero = 0, rcvbuf = KRT_SOCK_RCVBUF;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_USELOOPBACK, &zero, sizeof(zero)) < 0)
+    log(L_WARN "KRT: Cannot disable loopback on kernel socket: %m");
+
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+    log(L_WARN "KRT: Cannot set receive buffer size on kernel socket: %m");
+
+#ifdef ROUTE_MSGFILTER
+  /* Skip message types we do not handle already in the kernel */
+  uint filter = ROUTE_FILTER(RTM_ADD) | ROUTE_FILTER(RTM_DELETE) | ROUTE_FILTER(RTM_CHANGE) |
+    ROUTE_FILTER(RTM_IFANNOUNCE) | ROUTE_FILTER(RTM_IFINFO) |
+    ROUTE_FILTER(RTM_NEWADDR) | ROUTE_FILTER(RTM_DELADDR) | ROUTE_FILTER(RTM_DESYNC);
+
+  if (setsockopt(fd, PF_ROUTE, ROUTE_MSGFILTER, &filter, sizeof(filter)) < 0)
+    log(L_WARN "KRT: Cannot set message filter on kernel socket: %m");
+#endif
+
+  if (!krt_pid)
+    krt_pid = getpid();
+
   sk = sk_new(pool);
   sk->type = SK_MAGIC;
   sk->rx_hook = krt_sock_hook;
@@ -133,6 +133,34 @@ sk_process_cmsg4_ttl(sock *s, struct cmsghdr *cm)
     s->rcv_ttl = * (byte *) CMSG_DATA(cm);
 }
 
+
+/*
+ *	BSD RX timestamps
+ */
+
+#define CMSG_SPACE_TSTAMP CMSG_SPACE(sizeof(struct timeval))
+
+static inline int
+sk_request_cmsg_tstamp(sock *s)
+{
+  int y = 1;
+
+  if (setsockopt(s->fd, SOL_SOCKET, SO_TIMESTAMP, &y, sizeof(y)) < 0)
+    ERR("SO_TIMESTAMP");
+
+  return 0;
+}
+
+static inline void
+sk_process_cmsg_tstamp(sock *s, struct cmsghdr *cm)
+{
+  if (cm->cmsg_type == SCM_TIMESTAMP)
+  {
+    struct timeval *tv = (struct timeval *) CMSG_DATA(cm);
+    s->rcv_tstamp = ((s64) tv->tv_sec S) + tv->tv_usec;
+  }
+}
+
 static inline void
 sk_prepare_cmsgs4(sock *s, struct msghdr *msg, void *cbuf, size_t cbuflen)
 {
@@ -204,6 +232,9 @@ sk_set_md5_auth(sock *s, ip_addr a, struct iface *ifa, char *passwd)
 {
   int enable = 0;
 
+  if (s->flags & SKF_REPLAY)
+    return 0;
+
   if (passwd && *passwd)
   {
     int len = strlen(passwd);
@@ -265,3 +296,9 @@ sk_set_priority(sock *s, int prio UNUSED)
 {
   ERR_MSG("Socket priority not supported");
 }
+
+static inline int
+sk_set_reuseport_steering_sys(sock *s, uint offset UNUSED, uint n UNUSED)
+{
+  ERR_MSG("Reuseport steering not supported");
+}
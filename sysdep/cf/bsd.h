@@ -10,6 +10,7 @@
 #define CONFIG_SELF_CONSCIOUS
 #define CONFIG_MULTIPLE_TABLES
 #define CONFIG_SINGLE_ROUTE
+#define CONFIG_KRT_INCREMENTAL
 
 #define CONFIG_SKIP_MC_BIND
 #define CONFIG_NO_IFACE_BIND
@@ -12,6 +12,11 @@
 #define CONFIG_SELF_CONSCIOUS
 #define CONFIG_MULTIPLE_TABLES
 #define CONFIG_ALL_TABLES_AT_ONCE
+#define CONFIG_KRT_INCREMENTAL
+#define CONFIG_SENDMMSG
+#define CONFIG_RECVMMSG
+#define CONFIG_EPOLL
+#define CONFIG_RX_RING
 
 #define CONFIG_RESTRICTED_PRIVILEGES
 
@@ -10,6 +10,13 @@
 #define CONFIG_SELF_CONSCIOUS
 #define CONFIG_MULTIPLE_TABLES
 #define CONFIG_ALL_TABLES_AT_ONCE
+#define CONFIG_KRT_INCREMENTAL
+#define CONFIG_SENDMMSG
+#define CONFIG_RECVMMSG
+#define CONFIG_EPOLL
+#define CONFIG_RX_RING
+#define CONFIG_CPU_AFFINITY
+#define CONFIG_NUMA
 
 #define CONFIG_MC_PROPER_SRC
 #define CONFIG_UNIX_DONTROUTE
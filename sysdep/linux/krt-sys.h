@@ -89,6 +89,7 @@ static inline struct ifa * kif_get_primary_ip(struct iface *i) { return NULL; }
 
 struct krt_params {
   int table_id;				/* Kernel table ID we sync with */
+  int nexthop_objects;			/* Use kernel nexthop objects */
 };
 
 struct krt_state {
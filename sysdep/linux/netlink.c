@@ -9,9 +9,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <errno.h>
+#include <stdlib.h>
 
 #undef LOCAL_DEBUG
 
@@ -20,13 +22,21 @@
 #include "nest/protocol.h"
 #include "nest/iface.h"
 #include "lib/alloca.h"
+#include "lib/event.h"
+#include "lib/hash.h"
 #include "lib/timer.h"
 #include "lib/unix.h"
 #include "lib/krt.h"
+#include "lib/probe.h"
 #include "lib/socket.h"
 #include "lib/string.h"
+#include "lib/worker.h"
 #include "conf/conf.h"
 
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include <asm/types.h>
 #include <linux/if.h>
 #include <linux/netlink.h>
@@ -40,6 +50,14 @@
 #define IFF_LOWER_UP 0x10000
 #endif
 
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif
+
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
+
 /*
  *	Synchronous Netlink interface
  */
@@ -49,17 +67,26 @@ struct nl_sock
   int fd;
   u32 seq;
   byte *rx_buffer;			/* Receive buffer */
+  uint rx_size;
   struct nlmsghdr *last_hdr;		/* Recently received packet */
   uint last_size;
+  int strict;				/* Kernel checks and filters dump requests */
 };
 
 #define NL_RX_SIZE 8192
 
+/*
+ * The kernel sizes packets of a dump by the receive buffer, up to 32 kB, so
+ * with a larger buffer each read gets several hundreds of routes and no
+ * packet may be truncated.
+ */
+#define NL_RX_BULK 65536
+
 static struct nl_sock nl_scan = {.fd = -1};	/* Netlink socket for synchronous scan */
-static struct nl_sock nl_req  = {.fd = -1};	/* Netlink socket for requests */
+static struct nl_sock nl_bulk = {.fd = -1};	/* Netlink socket for route dumps */
 
 static void
-nl_open_sock(struct nl_sock *nl)
+nl_open_sock(struct nl_sock *nl, uint rx_size)
 {
   if (nl->fd < 0)
     {
@@ -67,7 +94,8 @@ nl_open_sock(struct nl_sock *nl)
       if (nl->fd < 0)
 	die("Unable to open rtnetlink socket: %m");
       nl->seq = now;
-      nl->rx_buffer = xmalloc(NL_RX_SIZE);
+      nl->rx_buffer = xmalloc(rx_size);
+      nl->rx_size = rx_size;
       nl->last_hdr = NULL;
       nl->last_size = 0;
     }
@@ -76,8 +104,16 @@ nl_open_sock(struct nl_sock *nl)
 static void
 nl_open(void)
 {
-  nl_open_sock(&nl_scan);
-  nl_open_sock(&nl_req);
+  nl_open_sock(&nl_scan, NL_RX_SIZE);
+
+  if (nl_bulk.fd < 0)
+    {
+      nl_open_sock(&nl_bulk, NL_RX_BULK);
+
+      /* Dumps may be filtered by the kernel since Linux 4.20 */
+      int one = 1;
+      nl_bulk.strict = !setsockopt(nl_bulk.fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &one, sizeof(one));
+    }
 }
 
 static void
@@ -89,13 +125,15 @@ nl_send(struct nl_sock *nl, struct nlmsghdr *nh)
   sa.nl_family = AF_NETLINK;
   nh->nlmsg_pid = 0;
   nh->nlmsg_seq = ++(nl->seq);
-  if (sendto(nl->fd, nh, nh->nlmsg_len, 0, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+  /* In replay, recorded replies are read instead */
+  if (!trace_replaying() &&
+      (sendto(nl->fd, nh, nh->nlmsg_len, 0, (struct sockaddr *)&sa, sizeof(sa)) < 0))
     die("rtnetlink sendto: %m");
   nl->last_hdr = NULL;
 }
 
 static void
-nl_request_dump(int af, int cmd)
+nl_request_dump(struct nl_sock *nl, int af, int cmd)
 {
   struct {
     struct nlmsghdr nh;
@@ -106,7 +144,7 @@ nl_request_dump(int af, int cmd)
     .nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
     .g.rtgen_family = af
   };
-  nl_send(&nl_scan, &req.nh);
+  nl_send(nl, &req.nh);
 }
 
 static struct nlmsghdr *
@@ -116,10 +154,12 @@ nl_get_reply(struct nl_sock *nl)
     {
       if (!nl->last_hdr)
 	{
-	  struct iovec iov = { nl->rx_buffer, NL_RX_SIZE };
-	  struct sockaddr_nl sa;
+	  struct iovec iov = { nl->rx_buffer, nl->rx_size };
+	  struct sockaddr_nl sa = { .nl_pid = 0 };
 	  struct msghdr m = { (struct sockaddr *) &sa, sizeof(sa), &iov, 1, NULL, 0, 0 };
-	  int x = recvmsg(nl->fd, &m, 0);
+	  int x = trace_replaying() ?
+	    trace_read(0, nl->rx_buffer, nl->rx_size) :
+	    recvmsg(nl->fd, &m, 0);
 	  if (x < 0)
 	    die("nl_get_reply: %m");
 	  if (sa.nl_pid)		/* It isn't from the kernel */
@@ -127,6 +167,7 @@ nl_get_reply(struct nl_sock *nl)
 	      DBG("Non-kernel packet\n");
 	      continue;
 	    }
+	  trace_kernel(0, nl->rx_buffer, x);
 	  nl->last_size = x;
 	  nl->last_hdr = (void *) nl->rx_buffer;
 	  if (m.msg_flags & MSG_TRUNC)
@@ -171,9 +212,9 @@ nl_error(struct nlmsghdr *h)
 }
 
 static struct nlmsghdr *
-nl_get_scan(void)
+nl_get_dump(struct nl_sock *nl)
 {
-  struct nlmsghdr *h = nl_get_reply(&nl_scan);
+  struct nlmsghdr *h = nl_get_reply(nl);
 
   if (h->nlmsg_type == NLMSG_DONE)
     return NULL;
@@ -185,22 +226,23 @@ nl_get_scan(void)
   return h;
 }
 
+/* Send request and wait for its ACK, returns error code */
 static int
 nl_exchange(struct nlmsghdr *pkt)
 {
   struct nlmsghdr *h;
 
-  nl_send(&nl_req, pkt);
-  for(;;)
-    {
-      h = nl_get_reply(&nl_req);
-      if (h->nlmsg_type == NLMSG_ERROR)
-	break;
-      log(L_WARN "nl_exchange: Unexpected reply received");
-    }
-  return nl_error(h) ? -1 : 0;
+  nl_send(&nl_scan, pkt);
+  while ((h = nl_get_reply(&nl_scan))->nlmsg_type != NLMSG_ERROR)
+    log(L_WARN "nl_exchange: Unexpected reply received");
+
+  if (h->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr)))
+    return ENOBUFS;
+
+  return -((struct nlmsgerr *) NLMSG_DATA(h))->error;
 }
 
+
 /*
  *	Netlink attributes
  */
@@ -430,6 +472,573 @@ nl_parse_metrics(struct rtattr *hdr, u32 *metrics, int max)
 }
 
 
+/*
+ *	Kernel nexthop objects
+ *
+ * With the nexthop objects option, unicast routes refer to shared kernel
+ * nexthop objects (by RTA_NH_ID) instead of carrying their own gateways. Each
+ * &nl_nh is found by its key, which is the next hop itself (a gateway and
+ * interface, or the list of nexthop members and their weights for a group),
+ * or the hostentry for next hops of recursive routes. Recursive routes share
+ * the object of their hostentry even when its resolution changes. Such change
+ * is applied by one replace of the object, so when the table passes updated
+ * routes later, their kernel routes stay unchanged and are not rewritten.
+ *
+ * To recognize such unchanged routes, &nl_nh_route keeps the object and a
+ * hash of the last request for each route using objects. These records also
+ * hold references to objects. Unused objects are removed from the kernel
+ * after the next sync, when no route in the kernel may refer to them.
+ * Objects possibly removed by the kernel (after the interface goes down or
+ * a route using them fails) are no longer offered to new routes.
+ */
+
+#define NL_RTA_NH_ID	30
+
+#define NL_NHA_ID	1
+#define NL_NHA_GROUP	2
+#define NL_NHA_OIF	5
+#define NL_NHA_GATEWAY	6
+#define NL_NHA_MAX	7
+
+#ifndef RTM_NEWNEXTHOP
+#define RTM_NEWNEXTHOP	104
+#define RTM_DELNEXTHOP	105
+#define RTM_GETNEXTHOP	106
+#endif
+
+struct nl_nhmsg {			/* Same as struct nhmsg */
+  u8 nh_family;
+  u8 nh_scope;
+  u8 nh_protocol;
+  u8 resvd;
+  u32 nh_flags;
+};
+
+struct nl_nh_grp {			/* Same as struct nexthop_grp */
+  u32 id;
+  u8 weight;
+  u8 resvd1;
+  u16 resvd2;
+};
+
+struct nl_nh_member {
+  struct nl_nh *nh;
+  u8 weight;				/* Weight - 1, as in struct mpnh */
+};
+
+struct nl_nh {
+  node n;				/* Node in nl_nh_list */
+  struct nl_nh *next;			/* Next in key hash chain */
+  struct nl_nh *id_next;		/* Next in ID hash chain */
+  struct hostentry *he;			/* Key of shared next hop of recursive routes */
+  u32 hash;				/* Hash of the key */
+  u32 id;				/* Kernel nexthop ID */
+  u32 uc;				/* Use count (routes and groups) */
+  u8 keyed;				/* In key hash, usable for new routes */
+  u8 count;				/* Number of group members, 0 for single next hop */
+  ip_addr gw;				/* Single next hop, IPA_NONE for device route */
+  struct iface *iface;
+  struct nl_nh_member *members;		/* Group members */
+};
+
+struct nl_nh_route {
+  struct nl_nh_route *next;
+  struct krt_proto *p;
+  net *n;
+  struct nl_nh *nh;			/* Object used by the route, NULL if none */
+  u64 hash;				/* Hash of the last route request */
+};
+
+#define NH_KEY(n)		n
+#define NH_NEXT(n)		n->next
+#define NH_EQ(a,b)		nl_nh_same_key(a, b)
+#define NH_FN(n)		n->hash
+
+#define NH_REHASH		nl_nh_rehash
+#define NH_PARAMS		/8, *2, 2, 2, 8, 20
+
+#define NHI_KEY(n)		n->id
+#define NHI_NEXT(n)		n->id_next
+#define NHI_EQ(a,b)		a == b
+#define NHI_FN(k)		u32_hash(k)
+
+#define NHI_REHASH		nl_nh_id_rehash
+#define NHI_PARAMS		/8, *2, 2, 2, 8, 20
+
+#define NHR_KEY(r)		r->p, r->n
+#define NHR_NEXT(r)		r->next
+#define NHR_EQ(p1,n1,p2,n2)	p1 == p2 && n1 == n2
+#define NHR_FN(p,n)		u32_hash((u32) ((uintptr_t) p ^ (uintptr_t) n))
+
+#define NHR_REHASH		nl_nh_route_rehash
+#define NHR_PARAMS		/8, *2, 2, 2, 10, 24
+
+static int nl_nh_state;			/* 1 if initialized, -1 if unsupported */
+static u32 nl_nh_last_id;
+static list nl_nh_list;
+static HASH(struct nl_nh) nl_nh_hash;
+static HASH(struct nl_nh) nl_nh_id_hash;
+static HASH(struct nl_nh_route) nl_nh_route_hash;
+static slab *nl_nh_route_slab;
+
+static inline int
+nl_nh_same_content(struct nl_nh *x, struct nl_nh *y)
+{
+  return ipa_equal(x->gw, y->gw) && (x->iface == y->iface) && (x->count == y->count) &&
+    !memcmp(x->members, y->members, x->count * sizeof(struct nl_nh_member));
+}
+
+static inline int
+nl_nh_same_key(struct nl_nh *x, struct nl_nh *y)
+{
+  return (x->he || y->he) ? (x->he == y->he) : nl_nh_same_content(x, y);
+}
+
+static u32
+nl_nh_key_hash(struct nl_nh *k)
+{
+  if (k->he)
+    return u32_hash((u32) (uintptr_t) k->he);
+
+  u32 h = ipa_hash32(k->gw) ^ u32_hash(k->iface ? k->iface->index : 0);
+  for (uint i = 0; i < k->count; i++)
+    h ^= u32_hash(k->members[i].nh->id * 257 + k->members[i].weight);
+
+  return h;
+}
+
+HASH_DEFINE_REHASH_FN(NH, struct nl_nh)
+HASH_DEFINE_REHASH_FN(NHI, struct nl_nh)
+HASH_DEFINE_REHASH_FN(NHR, struct nl_nh_route)
+
+static int
+nl_nh_send(struct nl_nh *nh, int op)
+{
+  uint size = NLMSG_LENGTH(sizeof(struct nl_nhmsg)) + 64 + nh->count * RTA_LENGTH(sizeof(struct nl_nh_grp));
+  struct nlmsghdr *h = alloca(size);
+  struct nl_nhmsg *m = NLMSG_DATA(h);
+
+  bzero(h, NLMSG_LENGTH(sizeof(struct nl_nhmsg)));
+  h->nlmsg_type = op;
+  h->nlmsg_len = NLMSG_LENGTH(sizeof(struct nl_nhmsg));
+  h->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  nl_add_attr_u32(h, size, NL_NHA_ID, nh->id);
+
+  /* Objects may be already removed by the kernel */
+  if (op == RTM_DELNEXTHOP)
+    return nl_exchange(h);
+
+  h->nlmsg_flags |= NLM_F_CREATE | (nh->uc ? NLM_F_REPLACE : NLM_F_EXCL);
+  m->nh_family = nh->count ? AF_UNSPEC : BIRD_AF;
+  m->nh_protocol = RTPROT_BIRD;
+
+  if (nh->count)
+    {
+      struct nl_nh_grp grp[nh->count];
+
+      bzero(grp, sizeof(grp));
+      for (uint i = 0; i < nh->count; i++)
+	{
+	  grp[i].id = nh->members[i].nh->id;
+	  grp[i].weight = nh->members[i].weight;
+	}
+
+      nl_add_attr(h, size, NL_NHA_GROUP, grp, sizeof(grp));
+    }
+  else
+    {
+      nl_add_attr_u32(h, size, NL_NHA_OIF, nh->iface->index);
+      if (ipa_nonzero(nh->gw))
+	nl_add_attr_ipa(h, size, NL_NHA_GATEWAY, nh->gw);
+    }
+
+  int err = nl_exchange(h);
+  if (err)
+    log_rl(&rl_netlink_err, L_WARN "Netlink: Cannot set nexthop %u: %s", nh->id, strerror(err));
+
+  return err;
+}
+
+static void
+nl_nh_set_members(struct nl_nh *nh, struct nl_nh_member *members, uint count)
+{
+  struct nl_nh_member *old = nh->members;
+  uint i;
+
+  for (i = 0; i < count; i++)
+    members[i].nh->uc++;
+
+  for (i = 0; i < nh->count; i++)
+    old[i].nh->uc--;
+
+  mb_free(old);
+  nh->members = count ? mb_alloc(krt_pool, count * sizeof(struct nl_nh_member)) : NULL;
+  memcpy(nh->members, members, count * sizeof(struct nl_nh_member));
+  nh->count = count;
+}
+
+static struct nl_nh *
+nl_nh_new(struct nl_nh *key)
+{
+  struct nl_nh *nh = mb_allocz(krt_pool, sizeof(struct nl_nh));
+
+  do
+    nl_nh_last_id = nl_nh_last_id + 1 ?: 1;
+  while (HASH_FIND(nl_nh_id_hash, NHI, nl_nh_last_id));
+
+  nh->id = nl_nh_last_id;
+  nh->he = key->he;
+  nh->hash = key->hash;
+  nh->gw = key->gw;
+  nh->iface = key->iface;
+  nl_nh_set_members(nh, key->members, key->count);
+
+  if (nl_nh_send(nh, RTM_NEWNEXTHOP))
+    {
+      nl_nh_set_members(nh, NULL, 0);
+      mb_free(nh);
+      return NULL;
+    }
+
+  nh->keyed = 1;
+  HASH_INSERT2(nl_nh_hash, NH, krt_pool, nh);
+  HASH_INSERT2(nl_nh_id_hash, NHI, krt_pool, nh);
+  add_tail(&nl_nh_list, &nh->n);
+  return nh;
+}
+
+static void
+nl_nh_invalidate(struct nl_nh *nh)
+{
+  if (!nh->keyed)
+    return;
+
+  HASH_REMOVE2(nl_nh_hash, NH, krt_pool, nh);
+  nh->keyed = 0;
+}
+
+/* Find or create object for @key, @key->hash is computed here */
+static struct nl_nh *
+nl_nh_get(struct nl_nh *key)
+{
+  struct nl_nh *nh;
+
+  key->hash = nl_nh_key_hash(key);
+  nh = HASH_FIND(nl_nh_hash, NH, key);
+
+  /* Resolution of hostentry changed, update shared object */
+  if (nh && !nl_nh_same_content(nh, key))
+    {
+      /* Kernel cannot replace single next hop by group or vice versa */
+      if (nh->uc && (!nh->count == !key->count))
+	{
+	  struct nl_nh old = *nh;
+
+	  nh->gw = key->gw;
+	  nh->iface = key->iface;
+	  nh->members = NULL;
+	  nh->count = 0;
+	  nl_nh_set_members(nh, key->members, key->count);
+
+	  if (!nl_nh_send(nh, RTM_NEWNEXTHOP))
+	    {
+	      for (uint i = 0; i < old.count; i++)
+		old.members[i].nh->uc--;
+	      mb_free(old.members);
+	      return nh;
+	    }
+
+	  /* Restore the previous content, routes still refer to it */
+	  nl_nh_set_members(nh, NULL, 0);
+	  nh->gw = old.gw;
+	  nh->iface = old.iface;
+	  nh->members = old.members;
+	  nh->count = old.count;
+	}
+
+      nl_nh_invalidate(nh);
+      nh = NULL;
+    }
+
+  return nh ?: nl_nh_new(key);
+}
+
+static struct nl_nh *
+nl_nh_get_single(ip_addr gw, struct iface *iface)
+{
+  struct nl_nh key = { .gw = gw, .iface = iface };
+  return nl_nh_get(&key);
+}
+
+/* Object for next hop of route attributes @a, or NULL if it should not use one */
+static struct nl_nh *
+nl_nh_find(rta *a)
+{
+  struct nl_nh key = { .gw = IPA_NONE };
+  struct hostentry *he = a->hostentry;
+  struct mpnh *nh;
+  uint i = 0;
+
+  switch (a->dest)
+    {
+    case RTD_ROUTER:
+      key.gw = a->gw;
+      /* fall through */
+    case RTD_DEVICE:
+      key.iface = a->iface;
+      break;
+
+    case RTD_MULTIPATH:
+      for (nh = a->nexthops; nh; nh = nh->next)
+	i++;
+
+      key.members = alloca(i * sizeof(struct nl_nh_member));
+      for (nh = a->nexthops; nh; nh = nh->next, key.count++)
+	{
+	  struct nl_nh_member *m = &key.members[key.count];
+
+	  bzero(m, sizeof(struct nl_nh_member));
+	  m->nh = nl_nh_get_single(nh->gw, nh->iface);
+	  m->weight = nh->weight;
+
+	  if (!m->nh)
+	    return NULL;
+	}
+      break;
+
+    default:
+      return NULL;
+    }
+
+  /* Share object of hostentry only with its unmodified resolution */
+  if (he && (a->dest == he->dest) && ipa_equal(a->gw, he->gw) && he->src &&
+      (a->iface == he->src->iface) && mpnh_same(a->nexthops, he->src->nexthops))
+    key.he = he;
+
+  return nl_nh_get(&key);
+}
+
+/*
+ * Record @nh and request @h of the route in @n, returns 1 if the kernel route
+ * is already the same and the request need not be sent.
+ */
+static int
+nl_nh_route_set(struct krt_proto *p, net *n, struct nl_nh *nh, struct nlmsghdr *h, int installed)
+{
+  struct nl_nh_route *r = HASH_FIND(nl_nh_route_hash, NHR, p, n);
+  u64 hash = 0xcbf29ce484222325ULL;
+  byte *b = (byte *) h;
+
+  for (uint i = 0; h && (i < h->nlmsg_len); i++)
+    hash = (hash ^ b[i]) * 0x100000001b3ULL;
+
+  if (r && installed && (r->nh == nh) && (r->hash == hash))
+    return 1;
+
+  if (!r && !nh)
+    return 0;
+
+  if (!r)
+    {
+      r = sl_alloc(nl_nh_route_slab);
+      r->p = p;
+      r->n = n;
+      r->nh = NULL;
+      HASH_INSERT2(nl_nh_route_hash, NHR, krt_pool, r);
+    }
+
+  if (nh)
+    nh->uc++;
+  if (r->nh)
+    r->nh->uc--;
+
+  r->nh = nh;
+  r->hash = hash;
+
+  if (!nh)
+    {
+      HASH_REMOVE2(nl_nh_route_hash, NHR, krt_pool, r);
+      sl_free(nl_nh_route_slab, r);
+    }
+
+  return 0;
+}
+
+static inline void
+nl_nh_route_clear(struct krt_proto *p, net *n)
+{
+  if (nl_nh_state > 0)
+    nl_nh_route_set(p, n, NULL, NULL, 0);
+}
+
+/* The kernel refused route in @n, the object may be gone */
+static void
+nl_nh_route_failed(struct krt_proto *p, net *n)
+{
+  struct nl_nh_route *r;
+
+  if ((nl_nh_state > 0) && (r = HASH_FIND(nl_nh_route_hash, NHR, p, n)))
+    nl_nh_invalidate(r->nh);
+}
+
+/* Interface @i went down, the kernel flushed objects using it */
+static void
+nl_nh_flush_iface(struct iface *i)
+{
+  struct nl_nh *nh;
+
+  if (nl_nh_state <= 0)
+    return;
+
+  WALK_LIST(nh, nl_nh_list)
+    if (nh->iface == i)
+      nl_nh_invalidate(nh);
+
+  /* Groups changed as well */
+  WALK_LIST(nh, nl_nh_list)
+    for (uint j = 0; j < nh->count; j++)
+      if (!nh->members[j].nh->keyed)
+	nl_nh_invalidate(nh);
+}
+
+/* Forget routes of @p, which are left in the kernel with their objects */
+static void
+nl_nh_route_flush(struct krt_proto *p)
+{
+  if (nl_nh_state <= 0)
+    return;
+
+  HASH_WALK_DELSAFE(nl_nh_route_hash, next, r)
+    if (r->p == p)
+    {
+      HASH_REMOVE(nl_nh_route_hash, NHR, r);
+      sl_free(nl_nh_route_slab, r);
+    }
+  HASH_WALK_DELSAFE_END;
+}
+
+/* Remove unused objects, no route in the kernel may use them */
+static void
+nl_nh_prune(void)
+{
+  struct nl_nh *nh, *next;
+  int groups;
+
+  if (nl_nh_state <= 0)
+    return;
+
+  /* Groups first, as they may hold the last references to their members */
+  for (groups = 1; groups >= 0; groups--)
+    WALK_LIST_DELSAFE(nh, next, nl_nh_list)
+      if (!nh->uc && (!nh->count == !groups))
+      {
+	nl_nh_send(nh, RTM_DELNEXTHOP);
+	nl_nh_set_members(nh, NULL, 0);
+	nl_nh_invalidate(nh);
+	HASH_REMOVE2(nl_nh_id_hash, NHI, krt_pool, nh);
+	rem_node(&nh->n);
+	mb_free(nh);
+      }
+}
+
+/* Fill next hop of route attributes @a by object @id, returns 0 if unknown */
+static int
+nl_nh_parse(rta *a, u32 id)
+{
+  static struct mpnh *nh_buffer;
+  static uint nh_buf_size;
+  struct nl_nh *nh;
+
+  if ((nl_nh_state <= 0) || !(nh = HASH_FIND(nl_nh_id_hash, NHI, id)))
+    return 0;
+
+  if (!nh->count)
+    {
+      a->dest = ipa_nonzero(nh->gw) ? RTD_ROUTER : RTD_DEVICE;
+      a->gw = nh->gw;
+      a->iface = nh->iface;
+      return 1;
+    }
+
+  if (nh_buf_size < nh->count)
+    {
+      nh_buf_size = nh->count;
+      nh_buffer = xrealloc(nh_buffer, nh_buf_size * sizeof(struct mpnh));
+    }
+
+  for (uint i = 0; i < nh->count; i++)
+    {
+      struct nl_nh *m = nh->members[i].nh;
+
+      nh_buffer[i] = (struct mpnh) {
+	.gw = m->gw,
+	.iface = m->iface,
+	.weight = nh->members[i].weight,
+	.next = (i + 1 < nh->count) ? &nh_buffer[i + 1] : NULL,
+      };
+    }
+
+  a->dest = RTD_MULTIPATH;
+  a->nexthops = nh_buffer;
+  return 1;
+}
+
+static void
+nl_nh_init(void)
+{
+  struct {
+    struct nlmsghdr h;
+    struct nl_nhmsg m;
+  } req = {
+    .h.nlmsg_type = RTM_GETNEXTHOP,
+    .h.nlmsg_len = sizeof(req),
+    .h.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+  };
+  struct nlmsghdr *h;
+
+  if (nl_nh_state)
+    return;
+
+  /* Kernel supports objects since 5.3, IDs of existing ones must be avoided */
+  nl_send(&nl_scan, &req.h);
+  while ((h = nl_get_reply(&nl_scan))->nlmsg_type != NLMSG_DONE)
+    {
+      if (h->nlmsg_type == NLMSG_ERROR)
+	{
+	  nl_error(h);
+	  log(L_WARN "Kernel nexthop objects not supported, routes use plain next hops");
+	  nl_nh_state = -1;
+	  return;
+	}
+
+      struct nl_nhmsg *m;
+      struct rtattr *a[NL_NHA_MAX];
+      u32 id;
+
+      if ((h->nlmsg_type != RTM_NEWNEXTHOP) || !(m = nl_checkin(h, sizeof(*m))) ||
+	  !nl_parse_attrs((struct rtattr *) (m + 1), a, sizeof(a)) ||
+	  !a[NL_NHA_ID] || (RTA_PAYLOAD(a[NL_NHA_ID]) != 4))
+	continue;
+
+      memcpy(&id, RTA_DATA(a[NL_NHA_ID]), sizeof(id));
+      nl_nh_last_id = MAX(nl_nh_last_id, id);
+    }
+
+  init_list(&nl_nh_list);
+  HASH_INIT(nl_nh_hash, krt_pool, 6);
+  HASH_INIT(nl_nh_id_hash, krt_pool, 6);
+  HASH_INIT(nl_nh_route_hash, krt_pool, 10);
+  nl_nh_route_slab = sl_new(krt_pool, sizeof(struct nl_nh_route));
+  nl_nh_state = 1;
+}
+
+static inline int
+nl_nh_enabled(struct krt_proto *p)
+{
+  return KRT_CF->sys.nexthop_objects && (nl_nh_state > 0);
+}
+
+
 /*
  *	Scanning of interfaces
  */
@@ -465,6 +1074,7 @@ nl_parse_link(struct nlmsghdr *h, int scan)
       if (!ifi)
 	return;
 
+      nl_nh_flush_iface(ifi);
       if_delete(ifi);
     }
   else
@@ -478,6 +1088,9 @@ nl_parse_link(struct nlmsghdr *h, int scan)
       f.mtu = mtu;
 
       fl = i->ifi_flags;
+      if (ifi && !((fl & IFF_UP) && (fl & IFF_LOWER_UP)))
+	nl_nh_flush_iface(ifi);
+
       if (fl & IFF_UP)
 	f.flags |= IF_ADMIN_UP;
       if (fl & IFF_LOWER_UP)
@@ -619,15 +1232,15 @@ kif_do_scan(struct kif_proto *p UNUSED)
 
   if_start_update();
 
-  nl_request_dump(AF_UNSPEC, RTM_GETLINK);
-  while (h = nl_get_scan())
+  nl_request_dump(&nl_scan, AF_UNSPEC, RTM_GETLINK);
+  while (h = nl_get_dump(&nl_scan))
     if (h->nlmsg_type == RTM_NEWLINK || h->nlmsg_type == RTM_DELLINK)
       nl_parse_link(h, 1);
     else
       log(L_DEBUG "nl_scan_ifaces: Unknown packet received (type=%d)", h->nlmsg_type);
 
-  nl_request_dump(BIRD_AF, RTM_GETADDR);
-  while (h = nl_get_scan())
+  nl_request_dump(&nl_scan, BIRD_AF, RTM_GETADDR);
+  while (h = nl_get_dump(&nl_scan))
     if (h->nlmsg_type == RTM_NEWADDR || h->nlmsg_type == RTM_DELADDR)
       nl_parse_addr(h, 1);
     else
@@ -637,10 +1250,558 @@ kif_do_scan(struct kif_proto *p UNUSED)
 }
 
 /*
- *	Routes
+ *	Pipelined route updates
+ *
+ * Route updates are not sent one by one waiting for each ACK. They are
+ * collected in a TX buffer, which is sent by one sendmsg() when it is full or
+ * after the current batch of route changes. Sent requests are kept in a FIFO
+ * of at most %NL_TX_WINDOW entries, as the kernel processes and answers them
+ * in order. When the window is full, the writer waits for ACKs, which also
+ * bounds the receive queue of the socket. Errors are reported back by
+ * %KRF_SYNC_ERROR flags of the affected nets.
+ *
+ * With threads, the writer runs in a separate kernel sync thread which owns
+ * the socket, see below. Otherwise, ACKs are received by the socket RX hook
+ * in the main loop and the buffer is sent from an event.
  */
 
-static struct krt_proto *nl_table_map[NL_NUM_TABLES];
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK 10
+#endif
+
+#define NL_TX_SIZE	65536		/* Max length of one batch of requests */
+#define NL_TX_WINDOW	128		/* Max number of requests waiting for ACK */
+
+struct nl_tx_req {
+  struct krt_proto *p;
+  ip_addr prefix;
+  u8 pxlen;
+  u8 report;				/* Report result to KRF_SYNC_ERROR */
+  u32 seq;
+  struct nl_upd *upd;			/* Queued update, result is stored there */
+};
+
+static int nl_tx_fd = -1;		/* Netlink socket for route updates */
+static byte *nl_tx_buffer;
+static byte *nl_tx_rx_buffer;
+static uint nl_tx_pos;			/* Length of buffered requests */
+static u32 nl_tx_seq;
+static struct nl_tx_req nl_tx_queue[NL_TX_WINDOW];
+static uint nl_tx_first, nl_tx_num;	/* Buffered and sent requests in nl_tx_queue */
+
+static void nl_tx_done(struct nl_tx_req *rq, int err);
+
+static void
+nl_tx_flush(void)
+{
+  struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+
+  if (!nl_tx_pos)
+    return;
+
+  /* Replayed updates are not sent, they all succeed */
+  if (trace_replaying())
+    {
+      for (; nl_tx_num; nl_tx_num--, nl_tx_first = (nl_tx_first + 1) % NL_TX_WINDOW)
+	nl_tx_done(&nl_tx_queue[nl_tx_first], 0);
+
+      nl_tx_pos = 0;
+      return;
+    }
+
+  if (sendto(nl_tx_fd, nl_tx_buffer, nl_tx_pos, 0, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+    die("rtnetlink sendto: %m");
+
+  nl_tx_pos = 0;
+}
+
+static void
+nl_tx_ack(struct nlmsghdr *h)
+{
+  if (h->nlmsg_type != NLMSG_ERROR)
+    {
+      log(L_WARN "Netlink: Unexpected reply received (type=%d)", h->nlmsg_type);
+      return;
+    }
+
+  while (nl_tx_num)
+    {
+      struct nl_tx_req *rq = &nl_tx_queue[nl_tx_first];
+
+      if ((int) (h->nlmsg_seq - rq->seq) < 0)
+	break;
+
+      nl_tx_first = (nl_tx_first + 1) % NL_TX_WINDOW;
+      nl_tx_num--;
+
+      if (h->nlmsg_seq == rq->seq)
+	{
+	  nl_tx_done(rq, nl_error(h));
+	  return;
+	}
+
+      /* Missing ACK, should not happen */
+      nl_tx_done(rq, ENOBUFS);
+    }
+
+  log(L_WARN "Netlink: Ignoring out of sequence reply (%x)", h->nlmsg_seq);
+}
+
+/* Lost ACKs - results of all sent requests are unknown */
+static void
+nl_tx_lost(void)
+{
+  log(L_WARN "Netlink: Lost replies to route updates");
+
+  for (; nl_tx_num; nl_tx_num--, nl_tx_first = (nl_tx_first + 1) % NL_TX_WINDOW)
+    nl_tx_done(&nl_tx_queue[nl_tx_first], ENOBUFS);
+}
+
+/* Receive available ACKs, returns 0 when no more are ready */
+static int
+nl_tx_receive(void)
+{
+  struct iovec iov = { nl_tx_rx_buffer, NL_RX_SIZE };
+  struct sockaddr_nl sa;
+  struct msghdr m = { (struct sockaddr *) &sa, sizeof(sa), &iov, 1, NULL, 0, 0 };
+  struct nlmsghdr *h;
+  int x;
+  uint len;
+
+  x = recvmsg(nl_tx_fd, &m, MSG_DONTWAIT);
+  if (x < 0)
+    {
+      if (errno == ENOBUFS)
+	{
+	  nl_tx_lost();
+	  return 1;
+	}
+      if ((errno != EINTR) && (errno != EAGAIN))
+	log(L_ERR "Netlink recvmsg: %m");
+      return 0;
+    }
+
+  if (sa.nl_pid)		/* It isn't from the kernel */
+    return 1;
+
+  h = (void *) nl_tx_rx_buffer;
+  len = x;
+  while (NLMSG_OK(h, len))
+    {
+      nl_tx_ack(h);
+      h = NLMSG_NEXT(h, len);
+    }
+  return 1;
+}
+
+/* Wait until at most @max requests are waiting for ACK */
+static void
+nl_tx_wait(uint max)
+{
+  struct pollfd pfd = { .fd = nl_tx_fd, .events = POLLIN };
+
+  nl_tx_flush();
+  while (nl_tx_num > max)
+    if (!nl_tx_receive() && (poll(&pfd, 1, -1) < 0) && (errno != EINTR))
+      die("Netlink poll: %m");
+}
+
+static void
+nl_tx_send(struct krt_proto *p, ip_addr prefix, uint pxlen, struct nlmsghdr *h, int report, struct nl_upd *upd)
+{
+  if (nl_tx_num == NL_TX_WINDOW)
+    nl_tx_wait(NL_TX_WINDOW / 2);
+
+  if (nl_tx_pos + NLMSG_ALIGN(h->nlmsg_len) > NL_TX_SIZE)
+    nl_tx_flush();
+
+  h->nlmsg_pid = 0;
+  h->nlmsg_seq = ++nl_tx_seq;
+  memcpy(nl_tx_buffer + nl_tx_pos, h, h->nlmsg_len);
+  nl_tx_pos += NLMSG_ALIGN(h->nlmsg_len);
+
+  struct nl_tx_req *rq = &nl_tx_queue[(nl_tx_first + nl_tx_num++) % NL_TX_WINDOW];
+  rq->p = p;
+  rq->prefix = prefix;
+  rq->pxlen = pxlen;
+  rq->report = report;
+  rq->seq = nl_tx_seq;
+  rq->upd = upd;
+}
+
+static void
+nl_tx_init(void)
+{
+  int one = 1, rcvbuf = NL_TX_WINDOW * 4096;
+
+  nl_tx_fd = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (nl_tx_fd < 0)
+    die("Unable to open rtnetlink socket: %m");
+
+  /* Short ACKs without copies of requests, errors are reported anyway */
+  setsockopt(nl_tx_fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+  setsockopt(nl_tx_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  nl_tx_buffer = xmalloc(NL_TX_SIZE);
+  nl_tx_rx_buffer = xmalloc(NL_RX_SIZE);
+  nl_tx_seq = now;
+}
+
+static void
+nl_set_sync_error(struct krt_proto *p, ip_addr prefix, uint pxlen, int err)
+{
+  net *n = net_find(p->p.table, prefix, pxlen);
+
+  if (!n)
+    return;
+
+  if (err)
+  {
+    n->n.flags |= KRF_SYNC_ERROR;
+    nl_nh_route_failed(p, n);
+  }
+  else
+    n->n.flags &= ~KRF_SYNC_ERROR;
+}
+
+
+#ifdef USE_PTHREADS
+
+/*
+ *	Kernel sync thread
+ *
+ * Kernel FIB updates are slow and they should not hold up the protocol
+ * loop. The main loop just keeps the latest desired state of each prefix in
+ * a coalescing queue of &nl_upd entries: whether the route in the kernel has
+ * to be deleted and the request for the new route, if any. The sync thread
+ * takes all queued entries, sends them by the pipelined writer and passes
+ * them back with results by an event sent to the main loop. An entry taken by
+ * the thread is never changed, a later change of the prefix queues a new
+ * entry. Therefore a prefix that changes many times before the thread gets
+ * to it costs just one kernel update. Entries are allocated and freed only by
+ * the main loop, which also keeps them in a hash table until they are taken.
+ */
+
+struct nl_upd {
+  struct nl_upd *next;			/* Next in hash chain */
+  struct nl_upd *qnext;			/* Next in queue or done list */
+  struct krt_proto *p;
+  ip_addr prefix;
+  u8 pxlen;
+  u8 del;				/* Delete the kernel route first */
+  u8 taken;				/* Taken by the sync thread (locked) */
+  u8 table_id;
+  int err;				/* Result of the new route request */
+  struct nlmsghdr *msg;			/* Request for the new route, NULL if none */
+};
+
+#define NU_KEY(n)		n->p, n->prefix, n->pxlen
+#define NU_NEXT(n)		n->next
+#define NU_EQ(p1,a1,l1,p2,a2,l2) p1 == p2 && ipa_equal(a1, a2) && l1 == l2
+#define NU_FN(p,a,l)		(ipa_hash32(a) ^ l)
+
+#define NU_REHASH		nl_upd_rehash
+#define NU_PARAMS		/8, *2, 2, 2, 8, 20
+
+HASH_DEFINE_REHASH_FN(NU, struct nl_upd)
+
+static HASH(struct nl_upd) nl_upd_hash;	/* Entries not yet taken, main loop only */
+
+static pthread_t nl_sync_thread;
+static pthread_mutex_t nl_sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nl_sync_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t nl_sync_idle = PTHREAD_COND_INITIALIZER;
+
+/* Protected by nl_sync_mutex */
+static struct nl_upd *nl_upd_first, **nl_upd_last = &nl_upd_first;
+static struct nl_upd *nl_done_first, **nl_done_last = &nl_done_first;
+static int nl_sync_busy;
+
+static event *nl_done_event;
+
+static void
+nl_tx_done(struct nl_tx_req *rq, int err)
+{
+  if (rq->report)
+    rq->upd->err = err;
+}
+
+static void
+nl_sync_send(struct nl_upd *u)
+{
+  struct {
+    struct nlmsghdr h;
+    struct rtmsg r;
+    char buf[64];
+  } r = {
+    .h.nlmsg_type = RTM_DELROUTE,
+    .h.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg)),
+    .h.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK,
+    .r.rtm_family = BIRD_AF,
+    .r.rtm_dst_len = u->pxlen,
+    .r.rtm_table = u->table_id,
+    .r.rtm_protocol = RTPROT_BIRD,
+    .r.rtm_scope = RT_SCOPE_UNIVERSE,
+  };
+
+  if (u->del)
+    {
+      nl_add_attr_ipa(&r.h, sizeof(r), RTA_DST, u->prefix);
+      nl_tx_send(u->p, u->prefix, u->pxlen, &r.h, 0, u);
+    }
+
+  if (u->msg)
+    nl_tx_send(u->p, u->prefix, u->pxlen, u->msg, 1, u);
+}
+
+static void *
+nl_sync_main(void *arg UNUSED)
+{
+  struct nl_upd *list, *u;
+
+  thread_start(THREAD_KERNEL);
+
+  pthread_mutex_lock(&nl_sync_mutex);
+  for (;;)
+    {
+      while (!nl_upd_first)
+	{
+	  nl_sync_busy = 0;
+	  pthread_cond_broadcast(&nl_sync_idle);
+	  pthread_cond_wait(&nl_sync_wakeup, &nl_sync_mutex);
+	}
+
+      list = nl_upd_first;
+      nl_upd_first = NULL;
+      nl_upd_last = &nl_upd_first;
+      nl_sync_busy = 1;
+
+      for (u = list; u; u = u->qnext)
+	u->taken = 1;
+      pthread_mutex_unlock(&nl_sync_mutex);
+
+      for (u = list; u; u = u->qnext)
+	nl_sync_send(u);
+      nl_tx_wait(0);
+
+      pthread_mutex_lock(&nl_sync_mutex);
+      *nl_done_last = list;
+      for (u = list; u->qnext; u = u->qnext)
+	;
+      nl_done_last = &u->qnext;
+      ev_send_main(nl_done_event);
+    }
+
+  return NULL;
+}
+
+/* Apply results of finished updates, called from main loop */
+static void
+nl_done_hook(void *data UNUSED)
+{
+  struct nl_upd *list, *u, *next;
+
+  pthread_mutex_lock(&nl_sync_mutex);
+  list = nl_done_first;
+  nl_done_first = NULL;
+  nl_done_last = &nl_done_first;
+  pthread_mutex_unlock(&nl_sync_mutex);
+
+  for (u = list; u; u = next)
+    {
+      next = u->qnext;
+
+      /* Entries are removed from the hash table when found taken */
+      if (HASH_FIND(nl_upd_hash, NU, NU_KEY(u)) == u)
+	HASH_REMOVE2(nl_upd_hash, NU, krt_pool, u);
+
+      if (u->msg)
+	nl_set_sync_error(u->p, u->prefix, u->pxlen, u->err);
+
+      xfree(u->msg);
+      xfree(u);
+    }
+}
+
+static void
+nl_queue_update(struct krt_proto *p, net *n, struct nlmsghdr *msg, int del)
+{
+  struct nl_upd *u = HASH_FIND(nl_upd_hash, NU, p, n->n.prefix, n->n.pxlen);
+  int fresh = 0;
+
+  pthread_mutex_lock(&nl_sync_mutex);
+
+  if (u && u->taken)
+    {
+      HASH_REMOVE2(nl_upd_hash, NU, krt_pool, u);
+      u = NULL;
+    }
+
+  if (!u)
+    {
+      u = xmalloc(sizeof(struct nl_upd));
+      memset(u, 0, sizeof(struct nl_upd));
+      u->p = p;
+      u->prefix = n->n.prefix;
+      u->pxlen = n->n.pxlen;
+      u->table_id = KRT_CF->sys.table_id;
+      fresh = 1;
+
+      *nl_upd_last = u;
+      nl_upd_last = &u->qnext;
+    }
+
+  /* A kernel route exists if it was there before the entry was queued */
+  if (fresh)
+    u->del = del;
+
+  xfree(u->msg);
+  u->msg = msg;
+
+  pthread_cond_signal(&nl_sync_wakeup);
+  pthread_mutex_unlock(&nl_sync_mutex);
+
+  if (fresh)
+    HASH_INSERT2(nl_upd_hash, NU, krt_pool, u);
+}
+
+static void
+nl_queue_request(struct krt_proto *p, net *n, struct nlmsghdr *h, int report UNUSED)
+{
+  struct nlmsghdr *msg = NULL;
+
+  /* Deletes are sent by the thread, as they may follow an older update */
+  if (h->nlmsg_type == RTM_NEWROUTE)
+    {
+      msg = xmalloc(h->nlmsg_len);
+      memcpy(msg, h, h->nlmsg_len);
+    }
+
+  nl_queue_update(p, n, msg, !msg);
+}
+
+/* Wait until all queued updates are in the kernel and apply their results */
+static void
+nl_sync(void)
+{
+  if (nl_tx_fd < 0)
+    return;
+
+  pthread_mutex_lock(&nl_sync_mutex);
+  while (nl_upd_first || nl_sync_busy)
+    pthread_cond_wait(&nl_sync_idle, &nl_sync_mutex);
+  pthread_mutex_unlock(&nl_sync_mutex);
+
+  ev_postpone_main(nl_done_event);
+  nl_done_hook(NULL);
+}
+
+/* No queued update waits for the kernel */
+static int
+nl_tx_idle(void)
+{
+  int idle;
+
+  if (nl_tx_fd < 0)
+    return 1;
+
+  pthread_mutex_lock(&nl_sync_mutex);
+  idle = !nl_upd_first && !nl_sync_busy;
+  pthread_mutex_unlock(&nl_sync_mutex);
+
+  return idle;
+}
+
+static void
+nl_open_tx(void)
+{
+  if (nl_tx_fd >= 0)
+    return;
+
+  nl_tx_init();
+  HASH_INIT(nl_upd_hash, krt_pool, 10);
+
+  nl_done_event = ev_new(krt_pool);
+  nl_done_event->hook = nl_done_hook;
+
+  int rv = pthread_create(&nl_sync_thread, NULL, nl_sync_main, NULL);
+  if (rv)
+    die("pthread_create(): %M", rv);
+}
+
+#else
+
+static event *nl_tx_event;		/* Sends buffered requests */
+
+static void
+nl_tx_done(struct nl_tx_req *rq, int err)
+{
+  if (rq->report)
+    nl_set_sync_error(rq->p, rq->prefix, rq->pxlen, err);
+}
+
+static int
+nl_tx_hook(sock *sk UNUSED, int size UNUSED)
+{
+  return nl_tx_receive();
+}
+
+static void
+nl_tx_event_hook(void *data UNUSED)
+{
+  nl_tx_flush();
+}
+
+static void
+nl_queue_request(struct krt_proto *p, net *n, struct nlmsghdr *h, int report)
+{
+  nl_tx_send(p, n->n.prefix, n->n.pxlen, h, report, NULL);
+
+  if (!ev_active(nl_tx_event))
+    ev_schedule(nl_tx_event);
+}
+
+/* Wait until all sent updates are acknowledged */
+static inline void
+nl_sync(void)
+{
+  if (nl_tx_fd >= 0)
+    nl_tx_wait(0);
+}
+
+/* No sent update waits for acknowledgement */
+static inline int
+nl_tx_idle(void)
+{
+  return !nl_tx_pos && !nl_tx_num;
+}
+
+static void
+nl_open_tx(void)
+{
+  if (nl_tx_fd >= 0)
+    return;
+
+  nl_tx_init();
+
+  nl_tx_event = ev_new(krt_pool);
+  nl_tx_event->hook = nl_tx_event_hook;
+
+  sock *sk = sk_new(krt_pool);
+  sk->type = SK_MAGIC;
+  sk->rx_hook = nl_tx_hook;
+  sk->fd = nl_tx_fd;
+  if (sk_open(sk) < 0)
+    bug("Netlink: sk_open failed");
+}
+
+#endif
+
+/*
+ *	Routes
+ */
+
+static struct krt_proto *nl_table_map[NL_NUM_TABLES];
 
 int
 krt_capable(rte *e)
@@ -676,25 +1837,53 @@ nh_bufsize(struct mpnh *nh)
   return rv;
 }
 
-static int
-nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int new)
+static void
+nl_delete_route(struct krt_proto *p, net *net)
+{
+  struct {
+    struct nlmsghdr h;
+    struct rtmsg r;
+    char buf[64];
+  } r = {
+    .h.nlmsg_type = RTM_DELROUTE,
+    .h.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg)),
+    .h.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK,
+    .r.rtm_family = BIRD_AF,
+    .r.rtm_dst_len = net->n.pxlen,
+    .r.rtm_table = KRT_CF->sys.table_id,
+    .r.rtm_protocol = RTPROT_BIRD,
+    .r.rtm_scope = RT_SCOPE_UNIVERSE,
+  };
+
+  DBG("nl_delete_route(%I/%d)\n", net->n.prefix, net->n.pxlen);
+
+  /* For route delete, we do not specify route attributes */
+  nl_add_attr_ipa(&r.h, sizeof(r), RTA_DST, net->n.prefix);
+  nl_queue_request(p, net, &r.h, 0);
+}
+
+/* Send route @e, replacing the installed one if @old is set */
+static void
+nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int old)
 {
   eattr *ea;
   net *net = e->net;
   rta *a = e->attrs;
+  struct nl_nh *nh = NULL;
   struct {
     struct nlmsghdr h;
     struct rtmsg r;
     char buf[128 + KRT_METRICS_MAX*8 + nh_bufsize(a->nexthops)];
   } r;
 
-  DBG("nl_send_route(%I/%d,new=%d)\n", net->n.prefix, net->n.pxlen, new);
+  DBG("nl_send_route(%I/%d,old=%d)\n", net->n.prefix, net->n.pxlen, old);
+  PROBE4(nl_send_route, p->p.name, &net->n.prefix, net->n.pxlen, old);
 
   bzero(&r.h, sizeof(r.h));
   bzero(&r.r, sizeof(r.r));
-  r.h.nlmsg_type = new ? RTM_NEWROUTE : RTM_DELROUTE;
+  r.h.nlmsg_type = RTM_NEWROUTE;
   r.h.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
-  r.h.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | (new ? NLM_F_CREATE|NLM_F_EXCL : 0);
+  r.h.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL;
 
   r.r.rtm_family = BIRD_AF;
   r.r.rtm_dst_len = net->n.pxlen;
@@ -704,11 +1893,6 @@ nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int new)
   r.r.rtm_scope = RT_SCOPE_UNIVERSE;
   nl_add_attr_ipa(&r.h, sizeof(r), RTA_DST, net->n.prefix);
 
-  /* For route delete, we do not specify route attributes */
-  if (!new)
-    return nl_exchange(&r.h);
-
-
   if (ea = ea_find(eattrs, EA_KRT_METRIC))
     nl_add_attr_u32(&r.h, sizeof(r), RTA_PRIORITY, ea->u.data);
 
@@ -736,7 +1920,12 @@ nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int new)
 
   /* a->iface != NULL checked in krt_capable() for router and device routes */
 
-  switch (a->dest)
+  if (nl_nh_enabled(p) && (nh = nl_nh_find(a)))
+    {
+      r.r.rtm_type = RTN_UNICAST;
+      nl_add_attr_u32(&r.h, sizeof(r), NL_RTA_NH_ID, nh->id);
+    }
+  else switch (a->dest)
     {
     case RTD_ROUTER:
       r.r.rtm_type = RTN_UNICAST;
@@ -764,33 +1953,178 @@ nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int new)
       bug("krt_capable inconsistent with nl_send_route");
     }
 
-  return nl_exchange(&r.h);
+  /* The route may already use the updated object */
+  if (nl_nh_enabled(p) &&
+      nl_nh_route_set(p, net, nh, &r.h, old && !(net->n.flags & KRF_SYNC_ERROR)))
+    return;
+
+  if (old)
+    nl_delete_route(p, net);
+
+  nl_queue_request(p, net, &r.h, 1);
 }
 
 void
 krt_replace_rte(struct krt_proto *p, net *n, rte *new, rte *old, struct ea_list *eattrs)
 {
-  int err = 0;
+  /* The sync error flag is updated when the kernel acknowledges the route */
+  if (new)
+    nl_send_route(p, new, eattrs, !!old);
+  else
+    {
+      if (old)
+	nl_delete_route(p, n);
 
-  /*
-   * NULL for eattr of the old route is a little hack, but we don't
-   * get proper eattrs for old in rt_notify() anyway. NULL means no
-   * extended route attributes and therefore matches if the kernel
-   * route has any of them.
-   */
+      nl_nh_route_clear(p, n);
+      n->n.flags &= ~KRF_SYNC_ERROR;
+    }
+}
 
-  if (old)
-    nl_send_route(p, old, NULL, 0);
 
-  if (new)
-    err = nl_send_route(p, new, eattrs, 1);
+/*
+ * In incremental mode, notifications about our routes are checked against
+ * KRF_INSTALLED flags. Most of them are just echoes of our updates, the rest
+ * may be caused by updates still in progress. Therefore a mismatched route is
+ * kept and checked again after a while, when all sent updates are done and
+ * following notifications are processed.
+ */
 
-  if (err < 0)
-    n->n.flags |= KRF_SYNC_ERROR;
+struct nl_chk {
+  struct nl_chk *next;			/* Next in hash chain */
+  struct krt_proto *p;
+  ip_addr prefix;
+  uint pxlen;
+  int new;				/* The route is in the kernel */
+  rte *e;				/* Last notified route, cached */
+};
+
+#define NC_KEY(n)		n->p, n->prefix, n->pxlen
+#define NC_NEXT(n)		n->next
+#define NC_EQ(p1,a1,l1,p2,a2,l2) p1 == p2 && ipa_equal(a1, a2) && l1 == l2
+#define NC_FN(p,a,l)		(ipa_hash32(a) ^ l)
+
+#define NC_REHASH		nl_chk_rehash
+#define NC_PARAMS		/8, *2, 2, 2, 6, 20
+
+HASH_DEFINE_REHASH_FN(NC, struct nl_chk)
+
+static HASH(struct nl_chk) nl_chk_hash;
+static slab *nl_chk_slab;
+static timer *nl_chk_timer;
+
+#define NL_CHECK_DELAY 1		/* Seconds */
+#define NL_CHECK_RCVBUF (4 << 20)	/* Receive buffer of the async socket */
+
+static sock *nl_async_sk;		/* BIRD socket for asynchronous notifications */
+static int nl_async_hook(sock *sk, int size);
+
+static void
+nl_chk_free(struct nl_chk *c)
+{
+  rte_free(c->e);
+  HASH_REMOVE(nl_chk_hash, NC, c);
+  sl_free(nl_chk_slab, c);
+}
+
+static void
+nl_check_hook(timer *t)
+{
+  if (!nl_tx_idle())
+    {
+      tm_start(t, NL_CHECK_DELAY);
+      return;
+    }
+
+  /* Notifications about sent updates may still wait in the socket */
+  if (nl_async_sk)
+    while (nl_async_hook(nl_async_sk, 0))
+      ;
+
+  HASH_WALK_DELSAFE(nl_chk_hash, next, c)
+    {
+      /* The table may have changed, so the net is found again */
+      rte *e = c->e;
+      e->net = net_get(c->p->p.table, c->prefix, c->pxlen);
+
+      krt_got_route_async(c->p, e, c->new);
+
+      HASH_REMOVE(nl_chk_hash, NC, c);
+      sl_free(nl_chk_slab, c);
+    }
+  HASH_WALK_DELSAFE_END;
+  HASH_MAY_RESIZE_DOWN(nl_chk_hash, NC, krt_pool);
+}
+
+static void
+nl_check_route(struct krt_proto *p, rte *e, int new)
+{
+  net *n = e->net;
+  struct nl_chk *c = HASH_FIND(nl_chk_hash, NC, p, n->n.prefix, n->n.pxlen);
+
+  if (!new == !(n->n.flags & KRF_INSTALLED))
+    {
+      /* The kernel agrees with us */
+      if (c)
+	{
+	  nl_chk_free(c);
+	  HASH_MAY_STEP_DOWN(nl_chk_hash, NC, krt_pool);
+	}
+
+      rte_free(e);
+      return;
+    }
+
+  if (!c)
+    {
+      c = sl_alloc(nl_chk_slab);
+      c->p = p;
+      c->prefix = n->n.prefix;
+      c->pxlen = n->n.pxlen;
+      HASH_INSERT2(nl_chk_hash, NC, krt_pool, c);
+    }
   else
-    n->n.flags &= ~KRF_SYNC_ERROR;
+    rte_free(c->e);
+
+  /* Get a cached copy of attributes */
+  e->attrs->source = RTS_DUMMY;
+  e->attrs = rta_lookup(e->attrs);
+  c->new = new;
+  c->e = e;
+
+  if (!tm_active(nl_chk_timer))
+    tm_start(nl_chk_timer, NL_CHECK_DELAY);
 }
 
+static void
+nl_check_init(void)
+{
+  if (nl_chk_timer)
+    return;
+
+  HASH_INIT(nl_chk_hash, krt_pool, 6);
+  nl_chk_slab = sl_new(krt_pool, sizeof(struct nl_chk));
+  nl_chk_timer = tm_new_set(krt_pool, nl_check_hook, NULL, 0, 0);
+
+  /* Lost notifications cause a scan, so echoes of update bursts must fit */
+  int size = NL_CHECK_RCVBUF;
+  if (nl_async_sk && (nl_async_sk->fd >= 0) &&
+      (setsockopt(nl_async_sk->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) &&
+      (setsockopt(nl_async_sk->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0))
+    log(L_WARN "Netlink: Cannot set receive buffer size: %m");
+}
+
+static void
+nl_check_flush(struct krt_proto *p)
+{
+  if (!nl_chk_timer)
+    return;
+
+  HASH_WALK_DELSAFE(nl_chk_hash, next, c)
+    if (c->p == p)
+      nl_chk_free(c);
+  HASH_WALK_DELSAFE_END;
+  HASH_MAY_RESIZE_DOWN(nl_chk_hash, NC, krt_pool);
+}
 
 #define SKIP(ARG...) do { DBG("KRT: Ignoring route - " ARG); return; } while(0)
 
@@ -799,7 +2133,7 @@ nl_parse_route(struct nlmsghdr *h, int scan)
 {
   struct krt_proto *p;
   struct rtmsg *i;
-  struct rtattr *a[RTA_CACHEINFO+1];
+  struct rtattr *a[NL_RTA_NH_ID+1];
   int new = h->nlmsg_type == RTM_NEWROUTE;
 
   ip_addr dst = IPA_NONE;
@@ -818,7 +2152,8 @@ nl_parse_route(struct nlmsghdr *h, int scan)
       (a[RTA_GATEWAY] && RTA_PAYLOAD(a[RTA_GATEWAY]) != sizeof(ip_addr)) ||
       (a[RTA_PRIORITY] && RTA_PAYLOAD(a[RTA_PRIORITY]) != 4) ||
       (a[RTA_PREFSRC] && RTA_PAYLOAD(a[RTA_PREFSRC]) != sizeof(ip_addr)) ||
-      (a[RTA_FLOW] && RTA_PAYLOAD(a[RTA_FLOW]) != 4))
+      (a[RTA_FLOW] && RTA_PAYLOAD(a[RTA_FLOW]) != 4) ||
+      (a[NL_RTA_NH_ID] && RTA_PAYLOAD(a[NL_RTA_NH_ID]) != 4))
     {
       log(L_ERR "KRT: Malformed message received");
       return;
@@ -872,7 +2207,7 @@ nl_parse_route(struct nlmsghdr *h, int scan)
       return;
 
     case RTPROT_BIRD:
-      if (!scan)
+      if (!scan && !KRT_CF->incremental)
 	SKIP("echo\n");
       src = KRT_SRC_BIRD;
       break;
@@ -895,6 +2230,23 @@ nl_parse_route(struct nlmsghdr *h, int scan)
     {
     case RTN_UNICAST:
 
+      /* Without nexthop_compat_mode, the kernel reports just the object */
+      if (a[NL_RTA_NH_ID] && !a[RTA_MULTIPATH] && !a[RTA_OIF])
+	{
+	  u32 id;
+	  memcpy(&id, RTA_DATA(a[NL_RTA_NH_ID]), sizeof(id));
+
+	  if (nl_nh_parse(&ra, id))
+	    break;
+
+	  if (src != KRT_SRC_BIRD)
+	    SKIP("unknown nexthop %u\n", id);
+
+	  /* Our stale route, make it differ from any exported one */
+	  ra.dest = RTD_NONE;
+	  break;
+	}
+
       if (a[RTA_MULTIPATH])
 	{
 	  ra.dest = RTD_MULTIPATH;
@@ -1037,30 +2389,103 @@ nl_parse_route(struct nlmsghdr *h, int scan)
 
   if (scan)
     krt_got_route(p, e);
+  else if (src == KRT_SRC_BIRD)
+    nl_check_route(p, e, new);
   else
     krt_got_route_async(p, e, new);
 }
 
+/*
+ * Routes are dumped by a separate socket, as synchronous requests may be done
+ * during stepped scan. When just one kernel table is synced and the kernel
+ * supports strict checking, other tables are skipped by the kernel.
+ */
+static void
+nl_request_route_dump(struct nl_sock *nl)
+{
+  struct {
+    struct nlmsghdr h;
+    struct rtmsg r;
+    char buf[16];
+  } req = {
+    .h.nlmsg_type = RTM_GETROUTE,
+    .h.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg)),
+    .h.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+    .r.rtm_family = BIRD_AF,
+  };
+  int i, table = -1;
+
+  for (i = 0; i < NL_NUM_TABLES; i++)
+    if (nl_table_map[i])
+      table = (table < 0) ? i : NL_NUM_TABLES;
+
+  if (nl->strict && (table >= 0) && (table < NL_NUM_TABLES))
+    {
+      req.r.rtm_table = table;
+      nl_add_attr_u32(&req.h, sizeof(req), RTA_TABLE, table);
+    }
+
+  nl_send(nl, &req.h);
+}
+
+void
+krt_sys_scan_start(void)
+{
+  /* The scan must see results of all sent updates */
+  nl_sync();
+  nl_nh_prune();
+
+  nl_request_route_dump(&nl_bulk);
+}
+
 void
 krt_do_scan(struct krt_proto *p UNUSED)	/* CONFIG_ALL_TABLES_AT_ONCE => p is NULL */
+{
+  krt_sys_scan_start();
+  while (krt_sys_scan_step(~0U))
+    ;
+}
+
+/* Process at most @max routes of the dump, returns 0 when finished */
+int
+krt_sys_scan_step(uint max)
 {
   struct nlmsghdr *h;
 
-  nl_request_dump(BIRD_AF, RTM_GETROUTE);
-  while (h = nl_get_scan())
-    if (h->nlmsg_type == RTM_NEWROUTE || h->nlmsg_type == RTM_DELROUTE)
-      nl_parse_route(h, 1);
-    else
-      log(L_DEBUG "nl_scan_fire: Unknown packet received (type=%d)", h->nlmsg_type);
+  for (; max; max--)
+    {
+      if (!(h = nl_get_dump(&nl_bulk)))
+	return 0;
+
+      if (h->nlmsg_type == RTM_NEWROUTE || h->nlmsg_type == RTM_DELROUTE)
+	nl_parse_route(h, 1);
+      else
+	log(L_DEBUG "nl_scan_fire: Unknown packet received (type=%d)", h->nlmsg_type);
+    }
+
+  return 1;
 }
 
 /*
  *	Asynchronous Netlink interface
  */
 
-static sock *nl_async_sk;		/* BIRD socket for asynchronous notifications */
 static byte *nl_async_rx_buffer;	/* Receive buffer */
 
+/* Notifications were lost, incremental protocols need a scan */
+static void
+nl_async_lost(void)
+{
+  int i;
+
+  for (i = 0; i < NL_NUM_TABLES; i++)
+    {
+      struct krt_proto *p = nl_table_map[i];
+      if (p && KRT_CF->incremental)
+	krt_request_scan(p);
+    }
+}
+
 static void
 nl_async_msg(struct nlmsghdr *h)
 {
@@ -1090,22 +2515,27 @@ static int
 nl_async_hook(sock *sk, int size UNUSED)
 {
   struct iovec iov = { nl_async_rx_buffer, NL_RX_SIZE };
-  struct sockaddr_nl sa;
+  struct sockaddr_nl sa = { .nl_pid = 0 };
   struct msghdr m = { (struct sockaddr *) &sa, sizeof(sa), &iov, 1, NULL, 0, 0 };
   struct nlmsghdr *h;
   int x;
   uint len;
 
-  x = recvmsg(sk->fd, &m, 0);
+  if (trace_replaying())
+    x = trace_read(sk->trace_id, nl_async_rx_buffer, NL_RX_SIZE);
+  else
+    x = recvmsg(sk->fd, &m, 0);
   if (x < 0)
     {
       if (errno == ENOBUFS)
 	{
 	  /*
 	   *  Netlink reports some packets have been thrown away.
-	   *  One day we might react to it by asking for route table
-	   *  scan in near future.
+	   *  Protocols relying on notifications need a route table scan.
 	   */
+	  trace_kernel_error(sk->trace_id, ENOBUFS);
+	  log_rl(&rl_netlink_err, L_WARN "Netlink: Async notifications lost");
+	  nl_async_lost();
 	  return 1;	/* More data are likely to be ready */
 	}
       else if (errno != EWOULDBLOCK)
@@ -1124,6 +2554,7 @@ nl_async_hook(sock *sk, int size UNUSED)
       log(L_WARN "Netlink got truncated asynchronous message");
       return 1;
     }
+  trace_kernel(sk->trace_id, nl_async_rx_buffer, x);
   while (NLMSG_OK(h, len))
     {
       nl_async_msg(h);
@@ -1146,6 +2577,13 @@ nl_open_async(void)
 
   DBG("KRT: Opening async netlink socket\n");
 
+  /* In replay, notifications come from the trace */
+  if (trace_replaying())
+    {
+      fd = -1;
+      goto open;
+    }
+
   fd = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
   if (fd < 0)
     {
@@ -1167,6 +2605,7 @@ nl_open_async(void)
       return;
     }
 
+open:
   nl_async_rx_buffer = xmalloc(NL_RX_SIZE);
 
   sk = nl_async_sk = sk_new(krt_pool);
@@ -1190,18 +2629,32 @@ krt_sys_start(struct krt_proto *p)
 
   nl_open();
   nl_open_async();
+  nl_open_tx();
+
+  if (KRT_CF->incremental)
+    nl_check_init();
+
+  if (KRT_CF->sys.nexthop_objects)
+    nl_nh_init();
 }
 
 void
-krt_sys_shutdown(struct krt_proto *p UNUSED)
+krt_sys_shutdown(struct krt_proto *p)
 {
+  /* Queued requests refer to the protocol */
+  nl_sync();
+  nl_nh_route_flush(p);
+  nl_nh_prune();
+  nl_check_flush(p);
+
   nl_table_map[KRT_CF->sys.table_id] = NULL;
 }
 
 int
 krt_sys_reconfigure(struct krt_proto *p UNUSED, struct krt_config *n, struct krt_config *o)
 {
-  return n->sys.table_id == o->sys.table_id;
+  return (n->sys.table_id == o->sys.table_id) &&
+    (n->sys.nexthop_objects == o->sys.nexthop_objects);
 }
 
 
@@ -1231,6 +2684,7 @@ void
 krt_sys_copy_config(struct krt_config *d, struct krt_config *s)
 {
   d->sys.table_id = s->sys.table_id;
+  d->sys.nexthop_objects = s->sys.nexthop_objects;
 }
 
 static const char *krt_metrics_names[KRT_METRICS_MAX] = {
@@ -149,6 +149,34 @@ sk_process_cmsg4_ttl(sock *s, struct cmsghdr *cm)
     s->rcv_ttl = * (int *) CMSG_DATA(cm);
 }
 
+
+/*
+ *	Linux RX timestamps
+ */
+
+#define CMSG_SPACE_TSTAMP CMSG_SPACE(sizeof(struct timespec))
+
+static inline int
+sk_request_cmsg_tstamp(sock *s)
+{
+  int y = 1;
+
+  if (setsockopt(s->fd, SOL_SOCKET, SO_TIMESTAMPNS, &y, sizeof(y)) < 0)
+    ERR("SO_TIMESTAMPNS");
+
+  return 0;
+}
+
+static inline void
+sk_process_cmsg_tstamp(sock *s, struct cmsghdr *cm)
+{
+  if (cm->cmsg_type == SCM_TIMESTAMPNS)
+  {
+    struct timespec *ts = (struct timespec *) CMSG_DATA(cm);
+    s->rcv_tstamp = ((s64) ts->tv_sec S) + (ts->tv_nsec / 1000);
+  }
+}
+
 static inline void
 sk_prepare_cmsgs4(sock *s, struct msghdr *msg, void *cbuf, size_t cbuflen)
 {
@@ -183,6 +211,9 @@ sk_set_md5_auth(sock *s, ip_addr a, struct iface *ifa, char *passwd)
 {
   struct tcp_md5sig md5;
 
+  if (s->flags & SKF_REPLAY)
+    return 0;
+
   memset(&md5, 0, sizeof(md5));
   sockaddr_fill((sockaddr *) &md5.tcpm_addr, s->af, a, ifa, 0);
 
@@ -269,3 +300,25 @@ sk_set_priority(sock *s, int prio)
   return 0;
 }
 
+#include <linux/filter.h>
+
+static inline int
+sk_set_reuseport_steering_sys(sock *s, uint offset, uint n)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+  /* Programs for UDP sockets see the packet from the start of the payload */
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offset),
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n),
+    BPF_STMT(BPF_RET | BPF_A, 0),
+  };
+  struct sock_fprog prog = { .len = ARRAY_SIZE(code), .filter = code };
+
+  if (setsockopt(s->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+    ERR("SO_ATTACH_REUSEPORT_CBPF");
+
+  return 0;
+#else
+  ERR_MSG("Reuseport steering not supported");
+#endif
+}
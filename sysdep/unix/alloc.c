@@ -0,0 +1,358 @@
+/*
+ *	BIRD Internet Routing Daemon -- Page Allocator
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Page allocator
+ *
+ * Pages for slabs are allocated from chunks of %PAGE_CHUNK_SIZE bytes, which
+ * are mapped by mmap() and aligned to their size, so the kernel may back them
+ * by huge pages (this is requested by MADV_HUGEPAGE where available). That
+ * saves TLB entries when walking large tables, whose nodes and routes are
+ * allocated from slabs.
+ *
+ * The first page of each chunk holds its header, the other pages are given
+ * out. Free pages are linked through their first word. Chunks with some free
+ * pages are kept in a list and pages are taken from its head, while chunks
+ * getting a free page are appended, so the chunks at the tail have a chance
+ * to become completely free. Such chunks are returned to the OS by
+ * MADV_DONTNEED (except for the header), but they stay mapped for later use.
+ * One completely free chunk is kept as a spare to avoid repeated faults.
+ *
+ * On NUMA machines, chunks are kept separately for each node and pages are
+ * given out from chunks of the node of the CPU the calling thread runs on.
+ * Pages are placed by the kernel when they are first touched, i.e. by the
+ * thread that allocated them, so threads bound to CPUs of one node (see
+ * thread_set_affinity()) get memory of that node for their slabs.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "nest/bird.h"
+#include "lib/resource.h"
+#include "lib/string.h"
+#include "lib/worker.h"
+
+#ifdef CONFIG_NUMA
+#include <sched.h>
+#endif
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+static pthread_mutex_t page_mutex = PTHREAD_MUTEX_INITIALIZER;
+static inline void page_lock(void) { pthread_mutex_lock(&page_mutex); }
+static inline void page_unlock(void) { pthread_mutex_unlock(&page_mutex); }
+#else
+static inline void page_lock(void) { }
+static inline void page_unlock(void) { }
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define PAGE_CHUNK_PAGES	(PAGE_CHUNK_SIZE / PAGE_ALLOC_SIZE)
+
+#ifdef CONFIG_NUMA
+#define PAGE_MAX_NODES		8
+#else
+#define PAGE_MAX_NODES		1
+#endif
+
+struct page_chunk {
+  node n;				/* In one of the lists of its node */
+  void *free;				/* List of free pages */
+  uint used;				/* Number of allocated pages */
+  uint fresh;				/* Number of never used pages at the end */
+  byte released;			/* Pages were returned to the OS */
+  byte node;				/* NUMA node the chunk belongs to */
+};
+
+struct page_node {
+  list partial;				/* Chunks with free pages, in use */
+  list full;				/* Chunks without free pages */
+  list released;			/* Completely free chunks returned to the OS */
+  struct page_chunk *spare;		/* Completely free chunk kept mapped */
+};
+
+static struct page_node page_nodes[PAGE_MAX_NODES];
+static int page_init_done;
+
+#ifdef CONFIG_NUMA
+
+static uint page_num_nodes;		/* Nodes found, 1 if not NUMA */
+static byte page_cpu_node[THREAD_MAX_CPUS];
+
+/* Map CPUs to nodes by cpulist files in sysfs */
+static void
+page_numa_init(void)
+{
+  u64 cpus[THREAD_MAX_CPUS / 64];
+  char name[64], buf[1024];
+  uint i, j;
+
+  page_num_nodes = 1;
+
+  for (i = 0; i < PAGE_MAX_NODES; i++)
+    {
+      bsprintf(name, "/sys/devices/system/node/node%u/cpulist", i);
+
+      FILE *f = fopen(name, "r");
+      if (!f)
+	break;
+
+      int ok = fgets(buf, sizeof(buf), f) && (thread_parse_cpus(buf, cpus) >= 0);
+      fclose(f);
+
+      if (!ok)
+	continue;
+
+      for (j = 0; j < THREAD_MAX_CPUS; j++)
+	if (cpus[j / 64] & (1ULL << (j % 64)))
+	  page_cpu_node[j] = i;
+
+      page_num_nodes = i + 1;
+    }
+}
+
+static inline uint
+page_current_node(void)
+{
+  if (page_num_nodes < 2)
+    return 0;
+
+  int cpu = sched_getcpu();
+  return ((cpu >= 0) && (cpu < THREAD_MAX_CPUS)) ? page_cpu_node[cpu] : 0;
+}
+
+#else
+
+static inline void page_numa_init(void) { }
+static inline uint page_current_node(void) { return 0; }
+
+#endif
+
+static inline struct page_chunk *
+page_chunk_of(void *p)
+{
+  return (struct page_chunk *) ((uintptr_t) p & ~((uintptr_t) PAGE_CHUNK_SIZE - 1));
+}
+
+static inline void
+page_chunk_reset(struct page_chunk *c)
+{
+  c->free = NULL;
+  c->used = 0;
+  c->fresh = PAGE_CHUNK_PAGES - 1;
+}
+
+static struct page_chunk *
+page_chunk_new(void)
+{
+  /* Map twice the size and trim it to get an aligned chunk */
+  size_t len = 2 * PAGE_CHUNK_SIZE;
+  byte *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (m == MAP_FAILED)
+    die("Unable to map %u bytes of memory: %m", (uint) len);
+
+  byte *b = (byte *) (((uintptr_t) m + PAGE_CHUNK_SIZE - 1) & ~((uintptr_t) PAGE_CHUNK_SIZE - 1));
+
+  if (b > m)
+    munmap(m, b - m);
+  if (b + PAGE_CHUNK_SIZE < m + len)
+    munmap(b + PAGE_CHUNK_SIZE, (m + len) - (b + PAGE_CHUNK_SIZE));
+
+#ifdef MADV_HUGEPAGE
+  madvise(b, PAGE_CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+
+  struct page_chunk *c = (void *) b;
+  page_chunk_reset(c);
+  c->released = 0;
+  return c;
+}
+
+static void
+page_chunk_release(struct page_chunk *c)
+{
+  madvise((byte *) c + PAGE_ALLOC_SIZE, PAGE_CHUNK_SIZE - PAGE_ALLOC_SIZE, MADV_DONTNEED);
+  page_chunk_reset(c);
+  c->released = 1;
+  add_tail(&page_nodes[c->node].released, &c->n);
+}
+
+/**
+ * alloc_page - allocate a memory page
+ *
+ * This function allocates a block of %PAGE_ALLOC_SIZE bytes, aligned to its
+ * size, for use by slabs. The page is taken from the NUMA node of the current
+ * CPU. It is safe to call it from other threads.
+ */
+void *
+alloc_page(void)
+{
+  struct page_node *pn;
+  struct page_chunk *c;
+  void *p;
+  uint i;
+
+  page_lock();
+
+  if (!page_init_done)
+    {
+      for (i = 0; i < PAGE_MAX_NODES; i++)
+	{
+	  init_list(&page_nodes[i].partial);
+	  init_list(&page_nodes[i].full);
+	  init_list(&page_nodes[i].released);
+	}
+      page_numa_init();
+      page_init_done = 1;
+    }
+
+  i = page_current_node();
+  pn = &page_nodes[i];
+
+  if (!EMPTY_LIST(pn->partial))
+    c = HEAD(pn->partial);
+  else
+    {
+      if (pn->spare)
+	{
+	  c = pn->spare;
+	  pn->spare = NULL;
+	}
+      else if (!EMPTY_LIST(pn->released))
+	{
+	  c = HEAD(pn->released);
+	  rem_node(&c->n);
+	  c->released = 0;
+	}
+      else
+	{
+	  c = page_chunk_new();
+	  c->node = i;
+	}
+
+      add_head(&pn->partial, &c->n);
+    }
+
+  if (c->free)
+    {
+      p = c->free;
+      c->free = * (void **) p;
+    }
+  else
+    {
+      p = (byte *) c + (PAGE_CHUNK_PAGES - c->fresh) * PAGE_ALLOC_SIZE;
+      c->fresh--;
+    }
+
+  c->used++;
+
+  if (!c->free && !c->fresh)
+    {
+      rem_node(&c->n);
+      add_tail(&pn->full, &c->n);
+    }
+
+  page_unlock();
+  return p;
+}
+
+/**
+ * free_page - free a memory page
+ * @p: page allocated by alloc_page()
+ */
+void
+free_page(void *p)
+{
+  struct page_chunk *c = page_chunk_of(p);
+
+  page_lock();
+
+  struct page_node *pn = &page_nodes[c->node];
+
+  int was_full = !c->free && !c->fresh;
+
+  * (void **) p = c->free;
+  c->free = p;
+  c->used--;
+
+  if (!c->used)
+    {
+      rem_node(&c->n);
+
+      if (!pn->spare)
+	{
+	  page_chunk_reset(c);
+	  pn->spare = c;
+	}
+      else
+	page_chunk_release(c);
+    }
+  else if (was_full)
+    {
+      rem_node(&c->n);
+      add_tail(&pn->partial, &c->n);
+    }
+
+  page_unlock();
+}
+
+/**
+ * page_alloc_stats - get statistics of the page allocator
+ * @s: structure to be filled
+ *
+ * Chunks are counted including the spare and released ones, free pages are
+ * counted only in chunks backed by memory, i.e. not released to the OS.
+ */
+void
+page_alloc_stats(struct page_stats *s)
+{
+  struct page_chunk *c;
+  uint i;
+
+  bzero(s, sizeof(struct page_stats));
+  page_lock();
+
+  if (!page_init_done)
+    goto done;
+
+  for (i = 0; i < PAGE_MAX_NODES; i++)
+    {
+      struct page_node *pn = &page_nodes[i];
+
+      WALK_LIST(c, pn->full)
+	{
+	  s->chunks++;
+	  s->used += c->used;
+	}
+
+      WALK_LIST(c, pn->partial)
+	{
+	  s->chunks++;
+	  s->used += c->used;
+	  s->free += PAGE_CHUNK_PAGES - 1 - c->used;
+	}
+
+      WALK_LIST(c, pn->released)
+	s->chunks++;
+
+      if (pn->spare)
+	{
+	  s->chunks++;
+	  s->spare += PAGE_CHUNK_PAGES - 1;
+	}
+    }
+
+ done:
+  page_unlock();
+}
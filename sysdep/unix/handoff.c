@@ -0,0 +1,589 @@
+/*
+ *	BIRD -- Handoff of Sessions to a New Process
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Handoff to a new process
+ *
+ * With the -H option, a new BIRD process takes over sockets and session state
+ * of the running one, so an upgrade does not reset BGP sessions. The new
+ * process reads its configuration, creates a UNIX socket of the given name
+ * and asks the old process by the control socket (command |handoff|) to
+ * connect there. The old process calls protos_handoff(), protocols pass their
+ * sockets and state by handoff_put() and the old process exits right after
+ * that, without shutdown of protocols, so routes in the kernel stay in place.
+ *
+ * Each message is a &ho_msg header, optionally carrying a file descriptor
+ * (passed by SCM_RIGHTS with the first byte of the header), followed by
+ * protocol specific data. The new process keeps received messages in a list
+ * until protocols claim them by handoff_find() and handoff_release() when
+ * they start. Messages not claimed in %HO_HOLD seconds are dropped, closing
+ * their descriptors. The data are in host byte order, both processes must
+ * be of the same IP version, but not necessarily of the same build.
+ *
+ * Session state and descriptors are trusted, so the handoff socket is
+ * accessible just by its owner and the new process accepts a connection only
+ * from the same user (or root). The old process checks that the handoff socket
+ * was created by the process which asked for handoff on the control socket,
+ * where peer credentials tell it.
+ *
+ * The new process also starts graceful restart recovery, so the kernel
+ * protocol (with its |graceful restart| option) keeps routes of the old
+ * process until routing tables are refilled.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "nest/bird.h"
+#include "nest/cli.h"
+#include "nest/protocol.h"
+#include "lib/resource.h"
+#include "lib/socket.h"
+#include "lib/timer.h"
+#include "lib/unix.h"
+
+#define HO_MAGIC	"BIRDHOF"
+#define HO_VERSION	1
+#define HO_TIMEOUT	30		/* Seconds to wait for the old process */
+#define HO_HOLD		60		/* Seconds to keep unclaimed messages */
+#define HO_MAX_DATA	(64 << 20)
+
+#define HO_END		0		/* Last message */
+
+struct ho_header {
+  char magic[8];
+  u32 version;
+  u32 ip_size;				/* sizeof(ip_addr) */
+};
+
+struct ho_msg {
+  u32 type;				/* HO_* */
+  u32 len;				/* Length of data following the message */
+  u32 has_fd;				/* A descriptor is passed with the message */
+  u32 reserved;
+  char name[HO_NAME_SIZE];
+};
+
+char *handoff_path;
+
+static list ho_received;		/* Received messages (struct handoff_rec) */
+static timer *ho_timer;			/* Unclaimed messages are dropped when it fires */
+static int ho_fd = -1;			/* Connection to the new process during handoff */
+static int ho_failed;
+
+
+#ifdef SO_PEERCRED
+
+/* Credentials of the peer, of the listening process for a connecting socket */
+static int
+ho_peer(int fd, uid_t *uid, pid_t *pid)
+{
+  struct ucred uc;
+  socklen_t len = sizeof(uc);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &uc, &len) < 0)
+    return -1;
+
+  *uid = uc.uid;
+  *pid = uc.pid;
+  return 0;
+}
+
+#else
+
+static int
+ho_peer(int fd, uid_t *uid, pid_t *pid)
+{
+  gid_t gid;
+
+  *pid = 0;			/* Unknown */
+  return getpeereid(fd, uid, &gid);
+}
+
+#endif
+
+static int
+ho_write(int fd, const void *buf, uint len)
+{
+  const byte *pos = buf;
+
+  while (len)
+  {
+    int n = write(fd, pos, len);
+
+    if ((n < 0) && (errno == EINTR))
+      continue;
+
+    if (n <= 0)
+      return -1;
+
+    pos += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int
+ho_read(int fd, void *buf, uint len)
+{
+  byte *pos = buf;
+
+  while (len)
+  {
+    int n = read(fd, pos, len);
+
+    if ((n < 0) && (errno == EINTR))
+      continue;
+
+    if (n <= 0)
+    {
+      if (!n)
+	errno = ECONNRESET;
+      return -1;
+    }
+
+    pos += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+
+/*
+ *	Old process
+ */
+
+/**
+ * handoff_put - pass a message to the new process
+ * @type: message type (HO_*)
+ * @name: name of the owner, usually a protocol instance
+ * @fd: descriptor passed with the message, -1 for none
+ * @data: protocol specific data
+ * @len: length of @data
+ *
+ * Called from handoff() hooks of protocols. The descriptor stays open in the
+ * old process. After the first error, all following messages are dropped and
+ * the handoff fails. Returns 0 on success, -1 on error.
+ */
+int
+handoff_put(uint type, const char *name, int fd, const void *data, uint len)
+{
+  union {
+    struct cmsghdr hdr;
+    byte buf[CMSG_SPACE(sizeof(int))];
+  } cb;
+  struct ho_msg m;
+  struct iovec iov = { .iov_base = &m, .iov_len = sizeof(m) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  int n;
+
+  if ((ho_fd < 0) || ho_failed)
+    return -1;
+
+  bzero(&m, sizeof(m));
+  m.type = type;
+  m.len = len;
+  m.has_fd = (fd >= 0);
+  strncpy(m.name, name, sizeof(m.name) - 1);
+
+  if (fd >= 0)
+  {
+    bzero(&cb, sizeof(cb));
+    msg.msg_control = cb.buf;
+    msg.msg_controllen = sizeof(cb.buf);
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+  }
+
+  /* The descriptor goes with the first byte, the rest may be written by parts */
+  while (((n = sendmsg(ho_fd, &msg, 0)) < 0) && (errno == EINTR))
+    ;
+
+  if ((n <= 0) ||
+      (ho_write(ho_fd, (byte *) &m + n, sizeof(m) - n) < 0) ||
+      (len && (ho_write(ho_fd, data, len) < 0)))
+  {
+    log(L_ERR "Handoff: Cannot send state of %s: %m", name[0] ? name : "daemon");
+    ho_failed = 1;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * cmd_handoff - hand off the daemon to a new process
+ * @path: UNIX socket of the new process
+ *
+ * Implements the |handoff| command, which is sent by the new process itself
+ * (see handoff_receive()). When the state is passed, the old process exits
+ * without shutdown. When the handoff fails, it continues running.
+ */
+void
+cmd_handoff(char *path)
+{
+  struct ho_header h = { .magic = HO_MAGIC, .version = HO_VERSION, .ip_size = sizeof(ip_addr) };
+  struct timeval tv = { .tv_sec = HO_TIMEOUT };
+  struct sockaddr_un sa;
+  sock *cs = this_cli->priv;
+  uid_t uid, cuid;
+  pid_t pid, cpid;
+  byte ack;
+
+  if (cli_access_restricted())
+    return;
+
+  if (strlen(path) >= sizeof(sa.sun_path))
+  {
+    cli_msg(8011, "Handoff socket path too long");
+    return;
+  }
+
+  bzero(&sa, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+
+  ho_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ((ho_fd < 0) ||
+      (setsockopt(ho_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) ||
+      (setsockopt(ho_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) ||
+      (connect(ho_fd, (struct sockaddr *) &sa, SUN_LEN(&sa)) < 0))
+  {
+    cli_msg(8011, "Cannot connect to %s: %m", path);
+    goto done;
+  }
+
+  /* The socket must belong to the process which asked for handoff */
+  if (!cs || (cs->fd < 0) || (ho_peer(ho_fd, &uid, &pid) < 0) || (ho_peer(cs->fd, &cuid, &cpid) < 0) ||
+      (uid != cuid) || (pid != cpid))
+  {
+    log(L_ERR "Handoff: Socket %s does not belong to the requesting process", path);
+    cli_msg(8011, "Handoff socket does not belong to the requesting process");
+    goto done;
+  }
+
+  log(L_INFO "Handing off to %s", path);
+
+  if (ho_write(ho_fd, &h, sizeof(h)) < 0)
+    ho_failed = 1;
+
+  protos_handoff();
+  handoff_put(HO_END, "", -1, NULL, 0);
+
+  /* The new process acknowledges when it has received everything */
+  if (!ho_failed && (ho_read(ho_fd, &ack, 1) < 0))
+  {
+    log(L_ERR "Handoff: No acknowledgement: %m");
+    ho_failed = 1;
+  }
+
+  if (ho_failed)
+  {
+    log(L_ERR "Handoff to %s failed", path);
+    cli_msg(8011, "Handoff to %s failed", path);
+    goto done;
+  }
+
+  /* The new process has taken over, protocols are not shut down */
+  log_msg(L_FATAL "Handoff completed");
+  exit(0);
+
+done:
+  if (ho_fd >= 0)
+    close(ho_fd);
+  ho_fd = -1;
+  ho_failed = 0;
+}
+
+
+/*
+ *	New process
+ */
+
+static struct handoff_rec *
+ho_recv(int fd)
+{
+  union {
+    struct cmsghdr hdr;
+    byte buf[CMSG_SPACE(sizeof(int))];
+  } cb;
+  struct ho_msg m;
+  struct iovec iov = { .iov_base = &m, .iov_len = sizeof(m) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = cb.buf, .msg_controllen = sizeof(cb.buf) };
+  struct cmsghdr *cm;
+  struct handoff_rec *r;
+  int n, pfd = -1;
+
+  while (((n = recvmsg(fd, &msg, 0)) < 0) && (errno == EINTR))
+    ;
+
+  if (n <= 0)
+    die("Handoff: Cannot receive state: %m");
+
+  for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+    if ((cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SCM_RIGHTS))
+      memcpy(&pfd, CMSG_DATA(cm), sizeof(int));
+
+  if (ho_read(fd, (byte *) &m + n, sizeof(m) - n) < 0)
+    die("Handoff: Cannot receive state: %m");
+
+  if ((msg.msg_flags & MSG_CTRUNC) || (m.has_fd != (pfd >= 0)) || (m.len > HO_MAX_DATA))
+    die("Handoff: Invalid message of type %u", m.type);
+
+  r = xmalloc(sizeof(struct handoff_rec) + m.len);
+  r->type = m.type;
+  r->fd = pfd;
+  memcpy(r->name, m.name, HO_NAME_SIZE);
+  r->name[HO_NAME_SIZE - 1] = 0;
+  r->len = m.len;
+
+  if (m.len && (ho_read(fd, r->data, m.len) < 0))
+    die("Handoff: Cannot receive state of %s: %m", r->name);
+
+  return r;
+}
+
+/* Ask the old process over its control socket to connect to @path */
+static int
+ho_request(char *path, char *ctl)
+{
+  struct sockaddr_un sa;
+  char cmd[sizeof(sa.sun_path) + 16];
+  int fd;
+
+  if (strlen(ctl) >= sizeof(sa.sun_path))
+    die("Control socket path too long");
+
+  bzero(&sa, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, ctl);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    die("Cannot create socket: %m");
+
+  if (connect(fd, (struct sockaddr *) &sa, SUN_LEN(&sa)) < 0)
+    die("Cannot connect to old BIRD at %s: %m", ctl);
+
+  /* The greeting is checked with the reply, see handoff_receive() */
+  int len = bsnprintf(cmd, sizeof(cmd), "handoff \"%s\"\n", path);
+  if ((len < 0) || (ho_write(fd, cmd, len) < 0))
+    die("Cannot send handoff request: %m");
+
+  return fd;
+}
+
+/* Any reply code but the greeting means that the old process refused */
+static void
+ho_check_reply(int fd)
+{
+  char buf[256], *line, *end;
+  int n = read(fd, buf, sizeof(buf) - 1);
+
+  if (n <= 0)
+    die("Old BIRD closed the control connection");
+
+  buf[n] = 0;
+  for (line = buf; *line; line = end + 1)
+  {
+    end = strchr(line, '\n');
+    if (!end)
+      break;
+    *end = 0;
+
+    if (!strncmp(line, "0001 ", 5))
+      continue;
+
+    if ((line[0] == '8') || (line[0] == '9'))
+      die("Old BIRD refused handoff: %s", line + 5);
+  }
+}
+
+static void
+handoff_expire(timer *t UNUSED)
+{
+  struct handoff_rec *r;
+  node *n;
+  uint count = 0;
+
+  WALK_LIST_DELSAFE(r, n, ho_received)
+  {
+    handoff_release(r);
+    count++;
+  }
+
+  if (count)
+    log(L_WARN "Handoff: %u unclaimed sessions dropped", count);
+}
+
+/**
+ * handoff_receive - take over from the old process
+ * @path: name of the UNIX socket to listen on
+ * @ctl: control socket of the old process
+ *
+ * Called from main() after the configuration is read, before protocols are
+ * started. It asks the old process to hand off, receives its messages and
+ * returns when the old process is done. Startup is aborted on any error, the
+ * old process then keeps running.
+ */
+void
+handoff_receive(char *path, char *ctl)
+{
+  struct ho_header h;
+  struct sockaddr_un sa;
+  struct timeval tv = { .tv_sec = HO_TIMEOUT };
+  struct handoff_rec *r;
+  int lfd, cfd, fd, err;
+  mode_t mask;
+  uid_t uid;
+  pid_t pid;
+  uint count = 0;
+
+  init_list(&ho_received);
+
+  if (strlen(path) >= sizeof(sa.sun_path))
+    die("Handoff socket path too long");
+
+  bzero(&sa, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+
+  lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (lfd < 0)
+    die("Cannot create socket: %m");
+
+  /* Nobody else may connect */
+  unlink(path);
+  mask = umask(077);
+  err = bind(lfd, (struct sockaddr *) &sa, SUN_LEN(&sa));
+  umask(mask);
+
+  if ((err < 0) || (listen(lfd, 1) < 0))
+    die("Cannot create handoff socket %s: %m", path);
+
+  cfd = ho_request(path, ctl);
+
+  for (;;)
+  {
+    struct pollfd pfd[2] = { { .fd = lfd, .events = POLLIN }, { .fd = cfd, .events = POLLIN } };
+    int n = poll(pfd, 2, HO_TIMEOUT * 1000);
+
+    if ((n < 0) && (errno == EINTR))
+      continue;
+
+    if (n <= 0)
+      die("Old BIRD did not connect to %s", path);
+
+    /* The old process exits soon after it connects */
+    if (pfd[0].revents)
+      break;
+
+    if (pfd[1].revents)
+      ho_check_reply(cfd);
+  }
+
+  fd = accept(lfd, NULL, NULL);
+  if (fd < 0)
+    die("Cannot accept handoff connection: %m");
+
+  close(lfd);
+  unlink(path);
+
+  /*
+   * The pid of the peer cannot be compared with the control socket, which the
+   * old process may have created before it forked. The old process checks
+   * that this socket is ours, see cmd_handoff().
+   */
+  if (ho_peer(fd, &uid, &pid) < 0)
+    die("Handoff: Cannot get peer credentials: %m");
+
+  if (uid && (uid != geteuid()))
+    die("Handoff: Connection from another user (uid %d)", (int) uid);
+
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+    die("Handoff: SO_RCVTIMEO: %m");
+
+  if (ho_read(fd, &h, sizeof(h)) < 0)
+    die("Handoff: Cannot receive state: %m");
+
+  if (memcmp(h.magic, HO_MAGIC, sizeof(h.magic)) || (h.version != HO_VERSION))
+    die("Handoff: Unsupported protocol");
+
+  if (h.ip_size != sizeof(ip_addr))
+    die("Handoff: Old BIRD is of another IP version");
+
+  while ((r = ho_recv(fd))->type != HO_END)
+  {
+    add_tail(&ho_received, &r->n);
+    count++;
+  }
+  xfree(r);
+
+  /* Until acknowledged, the old process may still continue */
+  if (ho_write(fd, "", 1) < 0)
+    die("Handoff: Cannot acknowledge: %m");
+
+  close(fd);
+  close(cfd);
+
+  log(L_INFO "Handoff: Received state of %u sessions", count);
+
+  ho_timer = tm_new(&root_pool);
+  ho_timer->hook = handoff_expire;
+  tm_start(ho_timer, HO_HOLD);
+}
+
+/**
+ * handoff_find - find a received message
+ * @type: message type
+ * @name: name of the owner
+ *
+ * Returns the message, or NULL when there is none (e.g. the daemon was not
+ * started by handoff). The message stays in the list until the caller releases
+ * it by handoff_release(). A caller taking the descriptor sets @fd to -1.
+ */
+struct handoff_rec *
+handoff_find(uint type, const char *name)
+{
+  struct handoff_rec *r;
+
+  if (!handoff_path || !ho_received.head)
+    return NULL;
+
+  WALK_LIST(r, ho_received)
+    if ((r->type == type) && !strcmp(r->name, name))
+      return r;
+
+  return NULL;
+}
+
+/* Remove a message from the list, closing its descriptor if not taken */
+void
+handoff_release(struct handoff_rec *r)
+{
+  if (r->fd >= 0)
+    close(r->fd);
+
+  rem_node(&r->n);
+  xfree(r);
+}
@@ -35,11 +35,34 @@
 #include "lib/socket.h"
 #include "lib/event.h"
 #include "lib/string.h"
+#include "lib/buffer.h"
+#include "lib/heap.h"
+#include "lib/hash.h"
+#include "lib/probe.h"
 #include "nest/iface.h"
+#include "nest/cli.h"
 
 #include "lib/unix.h"
 #include "lib/sysio.h"
 
+#ifdef CONFIG_RX_RING
+#include <sys/mman.h>
+#endif
+
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef CONFIG_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
 /* Maximum number of calls of tx handler for one socket in one
  * select iteration. Should be small enough to not monopolize CPU by
  * one protocol instance.
@@ -51,6 +74,14 @@
    this to gen small latencies */
 #define MAX_RX_STEPS 4
 
+/* Range of the adaptive limit of rx handler calls for bulk sockets, and
+   loop cycle durations considered too long (the limit is halved) and
+   short enough (the limit is increased), see io_adapt_steps() */
+#define MIN_BULK_STEPS 1
+#define MAX_BULK_STEPS 16
+#define BULK_CYCLE_HIGH (20 MS)
+#define BULK_CYCLE_LOW (5 MS)
+
 /*
  *	Tracked Files
  */
@@ -116,12 +147,27 @@ tracked_fopen(pool *p, char *name, char *mode)
  * to the handler function (@hook), data private to this function (@data),
  * time the function should be called at (@expires, 0 for inactive timers),
  * for the other fields see |timer.h|.
+ *
+ * Active timers are kept in a hierarchical timer wheel, so starting,
+ * stopping and expiration of a timer take constant time regardless of the
+ * number of timers. The wheel has %TW_LEVELS levels of %TW_SIZE slots (lists
+ * of timers), slots of level @l span %TW_SIZE^@l seconds. A timer is put to
+ * the lowest level whose range covers its expiration time. When the wheel
+ * time enters the span of a slot of a higher level, its timers are cascaded
+ * to lower levels, slots of level 0 contain just timers to be run. Timers
+ * expiring beyond the range of the wheel are cascaded from the last slot
+ * of its top level until they fit.
  */
 
-#define NEAR_TIMER_LIMIT 4
+#define TW_BITS		6
+#define TW_SIZE		(1 << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4
 
-static list near_timers, far_timers;
-static bird_clock_t first_far_timer = TIME_INFINITY;
+static list tw_slots[TW_LEVELS][TW_SIZE];
+static u64 tw_used[TW_LEVELS];		/* Slots which may be non-empty */
+static list tw_due;			/* Timers to be run */
+static bird_clock_t tw_time;		/* The wheel is processed up to this time */
 
 /* now must be different from 0, because 0 is a special value in timer->expires */
 bird_clock_t now = 1, now_real, boot_time;
@@ -161,15 +207,66 @@ update_times_gettime(void)
 
 static int clock_monotonic_available;
 
+/* In replay, the time is virtual, see trace.c */
+static void
+update_times_trace(void)
+{
+  now = trace_time TO_S;
+  now_real = trace_real + (trace_time - trace_start) TO_S;
+}
+
 static inline void
 update_times(void)
 {
-  if (clock_monotonic_available)
+  if (trace_replaying())
+    update_times_trace();
+  else if (clock_monotonic_available)
     update_times_gettime();
   else
     update_times_plain();
 }
 
+/**
+ * precise_time - read monotonic time with microsecond resolution
+ *
+ * Unlike &now, which is updated once per main loop iteration, this function
+ * reads the clock on each call, so it may be used to measure durations of
+ * individual operations. Without a monotonic clock, it falls back to &now.
+ */
+btime
+precise_time(void)
+{
+  struct timespec ts;
+
+  if (trace_replaying())
+    return trace_time;
+
+  if (!clock_monotonic_available || (clock_gettime(CLOCK_MONOTONIC, &ts) < 0))
+    return (btime) now S;
+
+  return ((s64) ts.tv_sec S) + (ts.tv_nsec / 1000);
+}
+
+/**
+ * precise_time_ns - read monotonic time with nanosecond resolution
+ *
+ * This is a variant of precise_time() for measurement of very short
+ * operations, whose durations are summed up, like filter runs.
+ */
+u64
+precise_time_ns(void)
+{
+  struct timespec ts;
+
+  if (trace_replaying())
+    return (u64) trace_time * 1000;
+
+  if (!clock_monotonic_available || (clock_gettime(CLOCK_MONOTONIC, &ts) < 0))
+    return (u64) now * 1000000000;
+
+  return ((u64) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
 static inline void
 init_times(void)
 {
@@ -225,17 +322,114 @@ timer *
 tm_new(pool *p)
 {
   timer *t = ralloc(p, &tm_class);
+  t->acct = rp_account(p);
   return t;
 }
 
-static inline void
-tm_insert_near(timer *t)
+static inline uint
+tw_shift(uint l)
+{ return TW_BITS * l; }
+
+static void
+tw_insert(timer *t)
+{
+  u64 when = t->expires;
+  u64 delta = when - tw_time;
+  uint l = 0;
+
+  if (t->expires <= tw_time)
+  {
+    add_tail(&tw_due, &t->n);
+    return;
+  }
+
+  while ((l < TW_LEVELS - 1) && (delta >= (1ULL << tw_shift(l + 1))))
+    l++;
+
+  /* Too distant timers are parked in the last slot of the wheel range */
+  if (delta >= (1ULL << tw_shift(TW_LEVELS)))
+    when = tw_time + (1ULL << tw_shift(TW_LEVELS)) - 1;
+
+  uint i = (when >> tw_shift(l)) & TW_MASK;
+  add_tail(&tw_slots[l][i], &t->n);
+  tw_used[l] |= 1ULL << i;
+}
+
+/*
+ * Lower bound of the time when the wheel has to be processed. Bits of
+ * tw_used are cleared lazily, so it may be earlier than the first timer.
+ */
+static bird_clock_t
+tw_next(void)
+{
+  bird_clock_t next = TIME_INFINITY;
+  uint l;
+
+  for (l = 0; l < TW_LEVELS; l++)
+  {
+    u64 used = tw_used[l];
+    if (!used)
+      continue;
+
+    u64 base = (u64) tw_time >> tw_shift(l);
+    uint idx = base & TW_MASK;
+    u64 later = (idx < TW_MASK) ? (used & (~0ULL << (idx + 1))) : 0;
+    u64 pos = later ?
+      (base - idx + __builtin_ctzll(later)) :
+      (base - idx + TW_SIZE + __builtin_ctzll(used));
+
+    next = MIN(next, (bird_clock_t) (pos << tw_shift(l)));
+  }
+
+  return next;
+}
+
+static void
+tw_advance(bird_clock_t t)
+{
+  node *n;
+  uint l, i;
+
+  tw_time = t;
+
+  /* Cascade slots of higher levels entered by the wheel time */
+  for (l = 1; l < TW_LEVELS; l++)
+  {
+    if ((u64) t & ((1ULL << tw_shift(l)) - 1))
+      break;
+
+    i = ((u64) t >> tw_shift(l)) & TW_MASK;
+    if (!(tw_used[l] & (1ULL << i)))
+      continue;
+
+    tw_used[l] &= ~(1ULL << i);
+    while ((n = HEAD(tw_slots[l][i]))->next)
+    {
+      rem_node(n);
+      tw_insert(SKIP_BACK(timer, n, n));
+    }
+  }
+
+  i = (u64) t & TW_MASK;
+  tw_used[0] &= ~(1ULL << i);
+  if (!EMPTY_LIST(tw_slots[0][i]))
+  {
+    add_tail_list(&tw_due, &tw_slots[0][i]);
+    init_list(&tw_slots[0][i]);
+  }
+}
+
+static void
+tw_init(void)
 {
-  node *n = HEAD(near_timers);
+  uint l, i;
 
-  while (n->next && (SKIP_BACK(timer, n, n)->expires < t->expires))
-    n = n->next;
-  insert_node(&t->n, n->prev);
+  for (l = 0; l < TW_LEVELS; l++)
+    for (i = 0; i < TW_SIZE; i++)
+      init_list(&tw_slots[l][i]);
+
+  init_list(&tw_due);
+  tw_time = now;
 }
 
 /**
@@ -268,14 +462,7 @@ tm_start(timer *t, unsigned after)
   if (t->expires)
     rem_node(&t->n);
   t->expires = when;
-  if (after <= NEAR_TIMER_LIMIT)
-    tm_insert_near(t);
-  else
-    {
-      if (!first_far_timer || first_far_timer > when)
-	first_far_timer = when;
-      add_tail(&far_timers, &t->n);
-    }
+  tw_insert(t);
 }
 
 /**
@@ -296,87 +483,261 @@ tm_stop(timer *t)
 }
 
 static void
-tm_dump_them(char *name, list *l)
+tm_dump_them(list *l)
 {
   node *n;
   timer *t;
 
-  debug("%s timers:\n", name);
   WALK_LIST(n, *l)
     {
       t = SKIP_BACK(timer, n, n);
       debug("%p ", t);
       tm_dump(&t->r);
     }
-  debug("\n");
 }
 
 void
 tm_dump_all(void)
 {
-  tm_dump_them("Near", &near_timers);
-  tm_dump_them("Far", &far_timers);
+  uint l, i;
+
+  debug("Timers:\n");
+  tm_dump_them(&tw_due);
+  for (l = 0; l < TW_LEVELS; l++)
+    for (i = 0; i < TW_SIZE; i++)
+      tm_dump_them(&tw_slots[l][i]);
+  debug("\n");
 }
 
 static inline time_t
 tm_first_shot(void)
 {
-  time_t x = first_far_timer;
+  if (!EMPTY_LIST(tw_due))
+    return tw_time;
 
-  if (!EMPTY_LIST(near_timers))
-    {
-      timer *t = SKIP_BACK(timer, n, HEAD(near_timers));
-      if (t->expires < x)
-	x = t->expires;
-    }
-  return x;
+  return tw_next();
 }
 
-void io_log_event(void *hook, void *data);
+void io_log_event(void *hook, void *data, struct cpu_account *acct);
 
 static void
 tm_shot(void)
 {
   timer *t;
-  node *n, *m;
+  node *n;
 
-  if (first_far_timer <= now)
+  for (;;)
     {
-      bird_clock_t limit = now + NEAR_TIMER_LIMIT;
-      first_far_timer = TIME_INFINITY;
-      n = HEAD(far_timers);
-      while (m = n->next)
+      while ((n = HEAD(tw_due))->next)
 	{
+	  int delay;
 	  t = SKIP_BACK(timer, n, n);
-	  if (t->expires <= limit)
+	  rem_node(n);
+	  delay = t->expires - now;
+	  t->expires = 0;
+	  if (t->recurrent)
 	    {
-	      rem_node(n);
-	      tm_insert_near(t);
+	      int i = t->recurrent - delay;
+	      if (i < 0)
+		i = 0;
+	      tm_start(t, i);
 	    }
-	  else if (t->expires < first_far_timer)
-	    first_far_timer = t->expires;
-	  n = m;
+	  io_log_event(t->hook, t->data, t->acct);
+	  if (trace_mode)
+	    trace_timer();
+
+	  /* The timer may be freed by its hook */
+	  void (*hook)(struct timer *) = t->hook;
+	  PROBE1(timer_entry, hook);
+	  hook(t);
+	  PROBE1(timer_return, hook);
 	}
+
+      if (tw_time >= now)
+	break;
+
+      /* Skip the time when no slot has to be processed */
+      tw_advance(MIN(tw_next(), now));
     }
-  while ((n = HEAD(near_timers)) -> next)
+}
+
+
+/*
+ * Precise timers
+ *
+ * Regular timers have the resolution of one second, which is too coarse for
+ * throttling of fast reactions (e.g. OSPF SPF scheduling). Precise timers
+ * (&ptimer) are similar, but their expiration time is kept in microseconds
+ * (&btime, read by precise_time()) and active ones are stored in a binary heap.
+ * The main loop sleeps until the first of them expires. Their interface is
+ * the same as of timers of the BFD loop (&timer2), including randomization and
+ * recurrence, so code may be moved between the loops.
+ */
+
+static BUFFER(ptimer *) ptimers;
+
+#define PTIMER_LESS(a,b)	((a)->expires < (b)->expires)
+#define PTIMER_SWAP(heap,a,b,t)	(t = heap[a], heap[a] = heap[b], heap[b] = t, \
+				 heap[a]->index = (a), heap[b]->index = (b))
+
+static inline uint ptimers_count(void)
+{ return ptimers.used - 1; }
+
+static void
+ptm_free(resource *r)
+{
+  ptm_stop((ptimer *) r);
+}
+
+static void
+ptm_dump(resource *r)
+{
+  ptimer *t = (ptimer *) r;
+
+  debug("(code %p, data %p, ", t->hook, t->data);
+  if (t->randomize)
+    debug("rand %u, ", t->randomize);
+  if (t->recurrent)
+    debug("recur %u, ", t->recurrent);
+  if (t->expires)
+    debug("expires in %d ms)\n", (int) ((t->expires - precise_time()) TO_MS));
+  else
+    debug("inactive)\n");
+}
+
+static struct resclass ptm_class = {
+  "Precise timer",
+  sizeof(ptimer),
+  ptm_free,
+  ptm_dump,
+  NULL,
+  NULL
+};
+
+/**
+ * ptm_new - create a precise timer
+ * @p: pool
+ *
+ * This function creates a new precise timer resource, to be started by
+ * ptm_start() after the @hook and @data fields are filled in.
+ */
+ptimer *
+ptm_new(pool *p)
+{
+  ptimer *t = ralloc(p, &ptm_class);
+  t->acct = rp_account(p);
+  return t;
+}
+
+/**
+ * ptm_set - set expiration time of a precise timer
+ * @t: timer
+ * @when: absolute expiration time, as returned by precise_time()
+ *
+ * This function starts the timer @t to be run at @when. If the timer has been
+ * already started, its expiration time is replaced by the new value. The
+ * @randomize field does not apply here, it is used for recurrent runs only.
+ */
+void
+ptm_set(ptimer *t, btime when)
+{
+  uint tc = ptimers_count();
+
+  if (!t->expires)
+  {
+    t->expires = when;
+    t->index = ++tc;
+    BUFFER_PUSH(ptimers) = t;
+    HEAP_INSERT(ptimers.data, tc, ptimer *, PTIMER_LESS, PTIMER_SWAP);
+  }
+  else if (when < t->expires)
+  {
+    t->expires = when;
+    HEAP_DECREASE(ptimers.data, tc, ptimer *, PTIMER_LESS, PTIMER_SWAP, t->index);
+  }
+  else if (when > t->expires)
+  {
+    t->expires = when;
+    HEAP_INCREASE(ptimers.data, tc, ptimer *, PTIMER_LESS, PTIMER_SWAP, t->index);
+  }
+}
+
+/**
+ * ptm_start - start a precise timer
+ * @t: timer
+ * @after: number of microseconds the timer should be run after
+ *
+ * Like tm_start(), but with microsecond resolution. If the timer has been
+ * already started, its expiration time is replaced by the new value. When the
+ * @recurrent field is set, the timer is restarted after each run with that
+ * period, increased by a random value up to @randomize.
+ */
+void
+ptm_start(ptimer *t, btime after)
+{
+  ptm_set(t, precise_time() + MAX(after, 0));
+}
+
+/**
+ * ptm_stop - stop a precise timer
+ * @t: timer
+ *
+ * This function stops a precise timer. If the timer is already stopped,
+ * nothing happens.
+ */
+void
+ptm_stop(ptimer *t)
+{
+  uint tc = ptimers_count();
+
+  if (!t->expires)
+    return;
+
+  HEAP_DELETE(ptimers.data, tc, ptimer *, PTIMER_LESS, PTIMER_SWAP, t->index);
+  BUFFER_POP(ptimers);
+  t->expires = 0;
+}
+
+static inline btime
+ptm_first_shot(void)
+{
+  return ptimers_count() ? ptimers.data[1]->expires : 0;
+}
+
+static void
+ptm_shot(void)
+{
+  btime limit = precise_time();
+  ptimer *t;
+
+  while (ptimers_count() && (ptimers.data[1]->expires <= limit))
+  {
+    t = ptimers.data[1];
+
+    if (t->recurrent)
     {
-      int delay;
-      t = SKIP_BACK(timer, n, n);
-      if (t->expires > now)
-	break;
-      rem_node(n);
-      delay = t->expires - now;
-      t->expires = 0;
-      if (t->recurrent)
-	{
-	  int i = t->recurrent - delay;
-	  if (i < 0)
-	    i = 0;
-	  tm_start(t, i);
-	}
-      io_log_event(t->hook, t->data);
-      t->hook(t);
+      btime when = t->expires + t->recurrent;
+
+      if (when <= limit)
+	when = limit + t->recurrent;
+
+      if (t->randomize)
+	when += random() % (t->randomize + 1);
+
+      ptm_set(t, when);
     }
+    else
+      ptm_stop(t);
+
+    io_log_event(t->hook, t->data, t->acct);
+    if (trace_mode)
+      trace_timer();
+
+    void (*hook)(struct ptimer *) = t->hook;
+    PROBE1(timer_entry, hook);
+    hook(t);
+    PROBE1(timer_return, hook);
+  }
 }
 
 /**
@@ -836,6 +1197,10 @@ sk_setup_multicast(sock *s)
 {
   ASSERT(s->iface);
 
+  /* Replayed sockets have no options, see sk_open_replay() */
+  if (s->flags & SKF_REPLAY)
+    return 0;
+
   if (sk_is_ipv4(s))
     return sk_setup_multicast4(s);
   else
@@ -856,6 +1221,9 @@ sk_setup_multicast(sock *s)
 int
 sk_join_group(sock *s, ip_addr maddr)
 {
+  if (s->flags & SKF_REPLAY)
+    return 0;
+
   if (sk_is_ipv4(s))
     return sk_join_group4(s, maddr);
   else
@@ -876,6 +1244,9 @@ sk_join_group(sock *s, ip_addr maddr)
 int
 sk_leave_group(sock *s, ip_addr maddr)
 {
+  if (s->flags & SKF_REPLAY)
+    return 0;
+
   if (sk_is_ipv4(s))
     return sk_leave_group4(s, maddr);
   else
@@ -898,6 +1269,9 @@ sk_setup_broadcast(sock *s)
 {
   int y = 1;
 
+  if (s->flags & SKF_REPLAY)
+    return 0;
+
   if (setsockopt(s->fd, SOL_SOCKET, SO_BROADCAST, &y, sizeof(y)) < 0)
     ERR("SO_BROADCAST");
 
@@ -920,6 +1294,9 @@ sk_set_ttl(sock *s, int ttl)
 {
   s->ttl = ttl;
 
+  if (s->flags & SKF_REPLAY)
+    return 0;
+
   if (sk_is_ipv4(s))
     return sk_set_ttl4(s, ttl);
   else
@@ -940,12 +1317,40 @@ sk_set_ttl(sock *s, int ttl)
 int
 sk_set_min_ttl(sock *s, int ttl)
 {
+  if (s->flags & SKF_REPLAY)
+    return 0;
+
   if (sk_is_ipv4(s))
     return sk_set_min_ttl4(s, ttl);
   else
     return sk_set_min_ttl6(s, ttl);
 }
 
+/**
+ * sk_set_reuseport_steering - steer packets among sockets sharing a port
+ * @s: socket
+ * @offset: offset of the key in the payload
+ * @n: number of sockets in the group
+ *
+ * Datagram sockets opened with %SKF_REUSEPORT and bound to the same port form
+ * a group, in which the kernel usually chooses the receiving socket by a hash
+ * of addresses. This function requests that a packet is received by the socket
+ * with index (in order of binding) given by the 32-bit key in network order at
+ * @offset of the payload modulo @n. Packets shorter than that are received by
+ * the first socket. It may be called for any socket of the group.
+ *
+ * Result: 0 for success, -1 for an error (e.g. unsupported by the system).
+ */
+
+int
+sk_set_reuseport_steering(sock *s, uint offset, uint n)
+{
+  if (s->flags & SKF_REPLAY)
+    return 0;
+
+  return sk_set_reuseport_steering_sys(s, offset, n);
+}
+
 #if 0
 /**
  * sk_set_md5_auth - add / remove MD5 security association for given socket
@@ -986,6 +1391,9 @@ sk_set_md5_auth(sock *s, ip_addr a, struct iface *ifa, char *passwd)
 int
 sk_set_ipv6_checksum(sock *s, int offset)
 {
+  if (s->flags & SKF_REPLAY)
+    return 0;
+
   if (setsockopt(s->fd, SOL_IPV6, IPV6_CHECKSUM, &offset, sizeof(offset)) < 0)
     ERR("IPV6_CHECKSUM");
 
@@ -998,6 +1406,9 @@ sk_set_icmp6_filter(sock *s, int p1, int p2)
   /* a bit of lame interface, but it is here only for Radv */
   struct icmp6_filter f;
 
+  if (s->flags & SKF_REPLAY)
+    return 0;
+
   ICMP6_FILTER_SETBLOCKALL(&f);
   ICMP6_FILTER_SETPASS(p1, &f);
   ICMP6_FILTER_SETPASS(p2, &f);
@@ -1023,6 +1434,7 @@ static list sock_list;
 static struct birdsock *current_sock;
 static struct birdsock *stored_sock;
 static int sock_recalc_fdsets_p;
+static BUFFER(sock *) sk_traced;	/* Traced sockets by ID, NULL if freed, see sk_trace_add() */
 
 static inline sock *
 sk_next(sock *s)
@@ -1033,45 +1445,455 @@ sk_next(sock *s)
     return SKIP_BACK(sock, n, s->n.next);
 }
 
-static void
-sk_alloc_bufs(sock *s)
-{
-  if (!s->rbuf && s->rbsize)
-    s->rbuf = s->rbuf_alloc = xmalloc(s->rbsize);
-  s->rpos = s->rbuf;
-  if (!s->tbuf && s->tbsize)
-    s->tbuf = s->tbuf_alloc = xmalloc(s->tbsize);
-  s->tpos = s->ttx = s->tbuf;
-}
+#ifdef CONFIG_EPOLL
+
+/*
+ * Sockets stay registered in the epoll set for their whole life, so the
+ * I/O loop does not walk all of them before each wait. The registered
+ * events follow sk_want_events(). They are updated after each dispatch of
+ * the socket and when sk_maybe_write() leaves data in the TX buffer.
+ * Protocols may switch rx_hook and tx_hook directly, therefore sockets
+ * with a missing hook are kept in sock_idle and rechecked before each wait.
+ * Sockets without wanted events are removed from the set, as EPOLLHUP is
+ * reported regardless of the events.
+ */
+
+#define SK_POLL_EVENTS	(EPOLLIN | EPOLLOUT)
+#define SK_POLL_IDLE	0x80000000	/* Socket is in sock_idle */
+#define SK_EVENTS_MAX	64
+
+static int sock_epoll_fd;
+static BUFFER(sock *) sock_idle;
+static struct epoll_event sock_events[SK_EVENTS_MAX];
+static int sock_events_num;		/* Valid entries of sock_events */
+
+#ifdef CONFIG_IO_URING
+
+/*
+ * With io_uring, changes of the epoll set are not done by separate epoll_ctl()
+ * calls. They are queued as %IORING_OP_EPOLL_CTL requests and all of them are
+ * submitted by one io_uring_enter() before the wait, which saves syscalls when
+ * many sessions switch between reading and writing in each loop. Requests are
+ * drained, so they are executed in order, and the kernel copies the event
+ * structures at submission. Removals of closed sockets are done directly, as
+ * the descriptor must not be reused before the queued requests are executed.
+ * When the ring cannot be set up (old kernel or restricted syscalls), plain
+ * epoll_ctl() is used.
+ */
+
+#define SK_URING_ENTRIES 256
+
+static struct sk_uring {
+  int fd;
+  uint queued;				/* Requests not submitted yet */
+  u32 *sq_tail, *sq_mask;
+  u32 *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  struct epoll_event events[SK_URING_ENTRIES];
+} sk_uring = { .fd = -1 };
 
 static void
-sk_free_bufs(sock *s)
+sk_uring_init(void)
 {
-  if (s->rbuf_alloc)
-  {
-    xfree(s->rbuf_alloc);
-    s->rbuf = s->rbuf_alloc = NULL;
-  }
-  if (s->tbuf_alloc)
+  struct sk_uring *u = &sk_uring;
+  struct io_uring_params p = {};
+  byte *sq, *cq;
+  u32 *array;
+  uint i;
+
+  int fd = syscall(__NR_io_uring_setup, SK_URING_ENTRIES, &p);
+  if (fd < 0)
+    goto err;
+
+  /* The requests are executed at submission and completions reaped right away */
+  uint sq_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+  uint cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || (p.sq_entries != SK_URING_ENTRIES))
   {
-    xfree(s->tbuf_alloc);
-    s->tbuf = s->tbuf_alloc = NULL;
+    errno = EOPNOTSUPP;
+    goto err2;
   }
+
+  sq = cq = mmap(NULL, MAX(sq_size, cq_size), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto err2;
+
+  u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    goto err2;
+
+  u->sq_tail = (u32 *) (sq + p.sq_off.tail);
+  u->sq_mask = (u32 *) (sq + p.sq_off.ring_mask);
+  u->cq_head = (u32 *) (cq + p.cq_off.head);
+  u->cq_tail = (u32 *) (cq + p.cq_off.tail);
+  u->cq_mask = (u32 *) (cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  /* Slot i of the submission queue always takes SQE i */
+  array = (u32 *) (sq + p.sq_off.array);
+  for (i = 0; i < p.sq_entries; i++)
+    array[i] = i;
+
+  u->fd = fd;
+  return;
+
+err2:
+  close(fd);
+err:
+  log(L_WARN "Cannot set up io_uring, using epoll_ctl(): %m");
 }
 
+/* Submit queued requests and wait for their completion */
 static void
-sk_free(resource *r)
+sk_uring_flush(void)
 {
-  sock *s = (sock *) r;
+  struct sk_uring *u = &sk_uring;
+  uint done = 0;
 
-  sk_free_bufs(s);
-  if (s->fd >= 0)
+  while (done < u->queued)
+  {
+    int n = syscall(__NR_io_uring_enter, u->fd, u->queued - done, u->queued - done,
+		    IORING_ENTER_GETEVENTS, NULL, 0);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      die("io_uring_enter: %m");
+    }
+    done += n;
+  }
+
+  u32 head = *u->cq_head;
+  u32 tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++)
+  {
+    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    if (cqe->res < 0)
+    {
+      errno = -cqe->res;
+      die("epoll_ctl: %m");
+    }
+  }
+
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+  u->queued = 0;
+}
+
+static void
+sk_poll_ctl(int op, int fd, struct epoll_event *ev)
+{
+  struct sk_uring *u = &sk_uring;
+
+  if (u->fd < 0)
+  {
+    if (epoll_ctl(sock_epoll_fd, op, fd, ev) < 0)
+      die("epoll_ctl: %m");
+    return;
+  }
+
+  if (u->queued == SK_URING_ENTRIES)
+    sk_uring_flush();
+
+  u32 tail = *u->sq_tail;
+  uint pos = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[pos];
+
+  u->events[pos] = *ev;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_EPOLL_CTL;
+  sqe->flags = IOSQE_IO_DRAIN;
+  sqe->fd = sock_epoll_fd;
+  sqe->off = fd;
+  sqe->len = op;
+  sqe->addr = (u64) (uintptr_t) &u->events[pos];
+
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->queued++;
+}
+
+static inline void
+sk_poll_submit(void)
+{
+  if (sk_uring.queued)
+    sk_uring_flush();
+}
+
+#else
+
+static inline void
+sk_poll_ctl(int op, int fd, struct epoll_event *ev)
+{
+  if (epoll_ctl(sock_epoll_fd, op, fd, ev) < 0)
+    die("epoll_ctl: %m");
+}
+
+static inline void sk_poll_submit(void) { }
+
+#endif
+
+static inline u32
+sk_want_events(sock *s)
+{ return (s->rx_hook ? EPOLLIN : 0) | ((s->tx_hook && (s->ttx != s->tpos)) ? EPOLLOUT : 0); }
+
+static inline int
+sk_is_idle(sock *s)
+{ return !s->rx_hook || (!s->tx_hook && (s->ttx != s->tpos)); }
+
+static void
+sk_idle_remove(sock *s)
+{
+  uint i;
+
+  for (i = 0; i < sock_idle.used; i++)
+    if (sock_idle.data[i] == s)
+    {
+      sock_idle.data[i] = sock_idle.data[sock_idle.used - 1];
+      BUFFER_POP(sock_idle);
+      break;
+    }
+
+  s->poll_events &= ~SK_POLL_IDLE;
+}
+
+static void
+sk_poll_update(sock *s)
+{
+  /* Sockets of other threads (BFD) are polled there, replayed ones not at all */
+  if (s->flags & (SKF_THREAD | SKF_REPLAY))
+    return;
+
+  u32 old = s->poll_events & SK_POLL_EVENTS;
+  u32 want = sk_want_events(s);
+  int idle = sk_is_idle(s);
+
+  if (want != old)
+  {
+    struct epoll_event ev = { .events = want, .data.ptr = s };
+    int op = !want ? EPOLL_CTL_DEL : !old ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+    sk_poll_ctl(op, s->fd, &ev);
+
+    s->poll_events = want | (s->poll_events & SK_POLL_IDLE);
+  }
+
+  if (idle && !(s->poll_events & SK_POLL_IDLE))
+  {
+    BUFFER_PUSH(sock_idle) = s;
+    s->poll_events |= SK_POLL_IDLE;
+  }
+  else if (!idle && (s->poll_events & SK_POLL_IDLE))
+    sk_idle_remove(s);
+}
+
+static void
+sk_poll_remove(sock *s)
+{
+  int i;
+
+  if (s->poll_events & SK_POLL_EVENTS)
+  {
+    sk_poll_submit();
+    epoll_ctl(sock_epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+  }
+
+  if (s->poll_events & SK_POLL_IDLE)
+    sk_idle_remove(s);
+
+  /* The socket may be freed while its events are dispatched */
+  for (i = 0; i < sock_events_num; i++)
+    if (sock_events[i].data.ptr == s)
+      sock_events[i].data.ptr = NULL;
+
+  s->poll_events = 0;
+}
+
+#else
+
+static inline void sk_poll_update(sock *s UNUSED) { }
+static inline void sk_poll_remove(sock *s UNUSED) { }
+
+#endif
+
+/*
+ *	Mirrored RX rings
+ *
+ * Stream sockets with the %SKF_RX_RING flag have their RX buffer mapped twice
+ * to consecutive virtual addresses, so @rbsize bytes starting anywhere in the
+ * first copy are contiguous in memory. The @rbuf pointer then marks the start
+ * of unprocessed data and the rx_hook moves it forward by sk_rx_consume(),
+ * while a partial message stays in place and is completed by the next read
+ * without any compaction of the buffer. When the ring cannot be allocated,
+ * the socket silently falls back to a regular buffer.
+ */
+
+#ifdef CONFIG_RX_RING
+
+static uint
+sk_ring_size(uint size)
+{
+  uint page = sysconf(_SC_PAGESIZE);
+  return (size + page - 1) / page * page;
+}
+
+static byte *
+sk_ring_alloc(uint size)
+{
+  int fd = memfd_create("bird-rx-ring", MFD_CLOEXEC);
+  byte *base;
+
+  if (fd < 0)
+    return NULL;
+
+  if (ftruncate(fd, size) < 0)
+    goto err;
+
+  /* Reserve the address range first, then map both copies to it */
+  base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    goto err;
+
+  if ((mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) ||
+      (mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED))
+  {
+    munmap(base, 2 * size);
+    goto err;
+  }
+
+  close(fd);
+  return base;
+
+err:
+  close(fd);
+  return NULL;
+}
+
+#endif
+
+static void
+sk_alloc_ring(sock *s)
+{
+#ifdef CONFIG_RX_RING
+  uint size = sk_ring_size(s->rbsize);
+  byte *ring = sk_ring_alloc(size);
+
+  if (ring)
+  {
+    s->rbuf = s->rbuf_alloc = ring;
+    s->rbuf_ring = size;
+    return;
+  }
+#endif
+
+  s->flags &= ~SKF_RX_RING;
+}
+
+static void
+sk_free_ring(sock *s)
+{
+#ifdef CONFIG_RX_RING
+  munmap(s->rbuf_alloc, 2 * s->rbuf_ring);
+#endif
+  s->rbuf = s->rbuf_alloc = NULL;
+  s->rbuf_ring = 0;
+}
+
+/**
+ * sk_rx_consume - drop processed data from RX buffer
+ * @s: stream socket
+ * @len: number of processed bytes
+ *
+ * This function is called by rx_hook to mark first @len bytes of data at
+ * @rbuf as processed. For sockets with %SKF_RX_RING, it just moves @rbuf
+ * forward and the remaining data stay in place. For regular buffers, the
+ * remaining data are moved to the start of the buffer. The rx_hook should
+ * return zero then, otherwise all data are dropped.
+ */
+void
+sk_rx_consume(sock *s, uint len)
+{
+  ASSERT(s->rbuf + len <= s->rpos);
+
+  if (!s->rbuf_ring)
+  {
+    memmove(s->rbuf, s->rbuf + len, s->rpos - s->rbuf - len);
+    s->rpos -= len;
+    return;
+  }
+
+  s->rbuf += len;
+
+  /* Switch to the first copy of the ring */
+  if (s->rbuf >= (byte *) s->rbuf_alloc + s->rbuf_ring)
+  {
+    s->rbuf -= s->rbuf_ring;
+    s->rpos -= s->rbuf_ring;
+  }
+}
+
+static void
+sk_alloc_bufs(sock *s)
+{
+  if (!s->rbuf && s->rbsize && (s->flags & SKF_RX_RING))
+    sk_alloc_ring(s);
+  if (!s->rbuf && s->rbsize)
+    s->rbuf = s->rbuf_alloc = xmalloc(s->rbsize);
+  s->rpos = s->rbuf;
+  if (!s->tbuf && s->tbsize)
+    s->tbuf = s->tbuf_alloc = xmalloc(s->tbsize);
+  s->tpos = s->ttx = s->tbuf;
+}
+
+static void
+sk_free_bufs(sock *s)
+{
+  if (s->rbuf_ring)
+    sk_free_ring(s);
+  if (s->rbuf_alloc)
+  {
+    xfree(s->rbuf_alloc);
+    s->rbuf = s->rbuf_alloc = NULL;
+  }
+  if (s->rx_batch_buf)
+  {
+    xfree(s->rx_batch_buf);
+    s->rx_batch_buf = NULL;
+    s->rx_batch_size = 0;
+  }
+  if (s->tbuf_alloc)
+  {
+    xfree(s->tbuf_alloc);
+    s->tbuf = s->tbuf_alloc = NULL;
+  }
+}
+
+static void
+sk_free(resource *r)
+{
+  sock *s = (sock *) r;
+
+  sk_free_bufs(s);
+
+  if (s->trace_id)
+    sk_traced.data[s->trace_id] = NULL;
+
+  if ((s->fd >= 0) || (s->flags & SKF_REPLAY))
   {
-    close(s->fd);
-
     /* FIXME: we should call sk_stop() for SKF_THREAD sockets */
     if (s->flags & SKF_THREAD)
+    {
+      if (s->fd >= 0)
+	close(s->fd);
       return;
+    }
+
+    sk_poll_remove(s);
+    if (s->fd >= 0)
+      close(s->fd);
 
     if (s == current_sock)
       current_sock = sk_next(s);
@@ -1085,11 +1907,28 @@ sk_free(resource *r)
 void
 sk_set_rbsize(sock *s, uint val)
 {
-  ASSERT(s->rbuf_alloc == s->rbuf);
-
   if (s->rbsize == val)
     return;
 
+  if (s->rbuf_ring)
+  {
+    /* Rings are resized keeping unprocessed data */
+    uint used = s->rpos - s->rbuf;
+    void *tmp = xmalloc(used + 1);
+    ASSERT(used <= val);
+
+    memcpy(tmp, s->rbuf, used);
+    sk_free_ring(s);
+    s->rbsize = val;
+    sk_alloc_bufs(s);
+    memcpy(s->rbuf, tmp, used);
+    s->rpos = s->rbuf + used;
+    xfree(tmp);
+    return;
+  }
+
+  ASSERT(s->rbuf_alloc == s->rbuf);
+
   s->rbsize = val;
   xfree(s->rbuf_alloc);
   s->rbuf_alloc = xmalloc(val);
@@ -1169,6 +2008,7 @@ sock_new(pool *p)
 {
   sock *s = ralloc(p, &sk_class);
   s->pool = p;
+  s->acct = rp_account(p);
   // s->saddr = s->daddr = IPA_NONE;
   s->tos = s->priority = s->ttl = -1;
   s->fd = -1;
@@ -1219,6 +2059,10 @@ sk_setup(sock *s)
     if (sk_set_priority(s, s->priority) < 0)
       return -1;
 
+  if (s->flags & SKF_TSTAMP_RX)
+    if (sk_request_cmsg_tstamp(s) < 0)
+      return -1;
+
   if (sk_is_ipv4(s))
   {
     if (s->flags & SKF_LADDR_RX)
@@ -1272,11 +2116,77 @@ sk_setup(sock *s)
   return 0;
 }
 
+/*
+ * Sockets of the main loop get IDs in the order of sk_open() and accepting,
+ * which are used by records of the input trace. Replay opens them in the same
+ * order, so their IDs correspond. Sockets of other threads are not traced.
+ */
+
+static inline int
+sk_recording(sock *s)
+{ return trace_recording() && s->trace_id; }
+
+static void
+sk_trace_error(sock *s, int err)
+{
+  if (sk_recording(s))
+    trace_write(TR_ERROR, s->trace_id, err, NULL, 0, NULL, 0);
+}
+
+static void
+sk_trace_dgram(sock *s, uint len)
+{
+  if (!sk_recording(s))
+    return;
+
+  struct tr_dgram d = {
+    .faddr = s->faddr,
+    .laddr = s->laddr,
+    .fport = s->fport,
+    .lifindex = s->lifindex,
+    .ttl = s->rcv_ttl,
+    .truncated = !!(s->flags & SKF_TRUNCATED),
+    .tstamp = s->rcv_tstamp
+  };
+
+  trace_write(TR_DGRAM, s->trace_id, 0, &d, sizeof(d), s->rbuf, len);
+}
+
+/* Record connection @t, accepted by @s or established by @s == @t */
+static void
+sk_trace_conn(sock *s, uint type, sock *t)
+{
+  if (!sk_recording(s))
+    return;
+
+  struct tr_conn c = {
+    .saddr = t->saddr,
+    .daddr = t->daddr,
+    .sport = t->sport,
+    .dport = t->dport,
+    .ifindex = t->iface ? t->iface->index : 0
+  };
+
+  trace_write(type, s->trace_id, t->trace_id, &c, sizeof(c), NULL, 0);
+}
+
+static void
+sk_trace_add(sock *s)
+{
+  if (!trace_mode || s->trace_id || (s->flags & SKF_THREAD))
+    return;
+
+  s->trace_id = sk_traced.used;
+  BUFFER_PUSH(sk_traced) = s;
+}
+
 static void
 sk_insert(sock *s)
 {
   add_tail(&sock_list, &s->n);
   sock_recalc_fdsets_p = 1;
+  sk_poll_update(s);
+  sk_trace_add(s);
 }
 
 static void
@@ -1285,15 +2195,34 @@ sk_tcp_connected(sock *s)
   sockaddr sa;
   int sa_len = sizeof(sa);
 
-  if ((getsockname(s->fd, &sa.sa, &sa_len) < 0) ||
-      (sockaddr_read(&sa, s->af, &s->saddr, &s->iface, &s->sport) < 0))
+  if (!(s->flags & SKF_REPLAY) &&
+      ((getsockname(s->fd, &sa.sa, &sa_len) < 0) ||
+       (sockaddr_read(&sa, s->af, &s->saddr, &s->iface, &s->sport) < 0)))
     log(L_WARN "SOCK: Cannot get local IP address for TCP>");
 
+  sk_trace_conn(s, TR_CONNECT, s);
+
   s->type = SK_TCP;
   sk_alloc_bufs(s);
   s->tx_hook(s);
 }
 
+static sock *
+sk_new_accepted(sock *s, int type, int fd)
+{
+  sock *t = sk_new(s->pool);
+  t->type = type;
+  t->fd = fd;
+  t->af = s->af;
+  t->ttl = s->ttl;
+  t->tos = s->tos;
+  t->rbsize = s->rbsize;
+  t->tbsize = s->tbsize;
+  t->io_class = s->io_class;
+  t->flags = s->flags & (SKF_RX_RING | SKF_REPLAY);
+  return t;
+}
+
 static int
 sk_passive_connected(sock *s, int type)
 {
@@ -1305,18 +2234,14 @@ sk_passive_connected(sock *s, int type)
   if (fd < 0)
   {
     if ((errno != EINTR) && (errno != EAGAIN))
+    {
+      sk_trace_error(s, errno);
       s->err_hook(s, errno);
+    }
     return 0;
   }
 
-  sock *t = sk_new(s->pool);
-  t->type = type;
-  t->fd = fd;
-  t->af = s->af;
-  t->ttl = s->ttl;
-  t->tos = s->tos;
-  t->rbsize = s->rbsize;
-  t->tbsize = s->tbsize;
+  sock *t = sk_new_accepted(s, type, fd);
 
   if (type == SK_TCP)
   {
@@ -1342,30 +2267,69 @@ sk_passive_connected(sock *s, int type)
 
   sk_insert(t);
   sk_alloc_bufs(t);
+  sk_trace_conn(s, TR_ACCEPT, t);
   s->rx_hook(t, 0);
   return 1;
 }
 
-/**
- * sk_open - open a socket
- * @s: socket
- *
- * This function takes a socket resource created by sk_new() and
- * initialized by the user and binds a corresponding network connection
- * to it.
- *
- * Result: 0 for success, -1 for an error.
+/*
+ * In replay, sockets are not opened. They are just inserted to the socket
+ * list, so they get the same IDs as in the trace, and io_replay() calls their
+ * hooks with recorded inputs. Internal sockets with a descriptor (pipes) stay
+ * real.
  */
-int
-sk_open(sock *s)
+static int
+sk_open_replay(sock *s)
 {
-  int af = BIRD_AF;
-  int fd = -1;
+  s->af = (s->type == SK_MAGIC) ? 0 : BIRD_AF;
+  s->flags |= SKF_REPLAY;
+
+  switch (s->type)
+  {
+  case SK_TCP_ACTIVE:
+    s->ttx = "";			/* Connected by TR_CONNECT */
+    break;
+
+  case SK_TCP_PASSIVE:
+  case SK_UNIX_PASSIVE:
+  case SK_MAGIC:
+    break;
+
+  default:
+    sk_alloc_bufs(s);
+  }
+
+  if (!(s->flags & SKF_THREAD))
+    sk_insert(s);
+  return 0;
+}
+
+/**
+ * sk_open - open a socket
+ * @s: socket
+ *
+ * This function takes a socket resource created by sk_new() and
+ * initialized by the user and binds a corresponding network connection
+ * to it.
+ *
+ * Result: 0 for success, -1 for an error.
+ */
+int
+sk_open(sock *s)
+{
+  int af = BIRD_AF;
+  int fd = -1;
   int do_bind = 0;
   int bind_port = 0;
   ip_addr bind_addr = IPA_NONE;
   sockaddr sa;
 
+  /* Even a failed socket gets an ID, so that following ones keep theirs */
+  sk_trace_add(s);
+
+  if (trace_replaying() && ((s->type != SK_MAGIC) || (s->fd < 0)))
+    return sk_open_replay(s);
+
   switch (s->type)
   {
   case SK_TCP_ACTIVE:
@@ -1422,11 +2386,12 @@ sk_open(sock *s)
 #ifdef CONFIG_NO_IFACE_BIND
       /* Workaround missing ability to bind to an iface */
       if ((s->type == SK_UDP) && s->iface && ipa_zero(bind_addr))
-      {
+	s->flags |= SKF_REUSEPORT;
+#endif
+
+      if (s->flags & SKF_REUSEPORT)
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &y, sizeof(y)) < 0)
 	  ERR2("SO_REUSEPORT");
-      }
-#endif
     }
     else
       if (s->flags & SKF_HIGH_PORT)
@@ -1483,6 +2448,11 @@ sk_open_unix(sock *s, char *name)
 
   /* We are sloppy during error (leak fd and not set s->err), but we die anyway */
 
+  sk_trace_add(s);
+
+  if (trace_replaying())
+    return sk_open_replay(s);
+
   fd = socket(AF_UNIX, SOCK_STREAM, 0);
   if (fd < 0)
     return -1;
@@ -1505,9 +2475,56 @@ sk_open_unix(sock *s, char *name)
   return 0;
 }
 
+/**
+ * sk_adopt - open a socket from a descriptor of the old process
+ * @s: socket of type %SK_TCP or %SK_TCP_PASSIVE
+ * @fd: connected or listening TCP socket, see sysdep/unix/handoff.c
+ *
+ * This is sk_open() for a socket taken over by handoff. Addresses and ports
+ * are read from @fd, other attributes of @s are applied like by sk_open(),
+ * except %SKF_V6ONLY, which cannot be changed after bind(). The descriptor
+ * is closed on error.
+ *
+ * Result: 0 for success, -1 for an error.
+ */
+int
+sk_adopt(sock *s, int fd)
+{
+  sockaddr sa;
+  int sa_len = sizeof(sa);
+
+  s->af = BIRD_AF;
+  s->fd = fd;
+  s->flags &= ~SKF_V6ONLY;
+
+  if ((getsockname(fd, &sa.sa, &sa_len) < 0) ||
+      (sockaddr_read(&sa, s->af, &s->saddr, &s->iface, &s->sport) < 0))
+    ERR2("getsockname");
+
+  sa_len = sizeof(sa);
+  if ((s->type == SK_TCP) &&
+      ((getpeername(fd, &sa.sa, &sa_len) < 0) ||
+       (sockaddr_read(&sa, s->af, &s->daddr, &s->iface, &s->dport) < 0)))
+    ERR2("getpeername");
+
+  if (sk_setup(s) < 0)
+    goto err;
+
+  if (s->type == SK_TCP)
+    sk_alloc_bufs(s);
+
+  sk_insert(s);
+  return 0;
+
+err:
+  close(fd);
+  s->fd = -1;
+  return -1;
+}
+
 
-#define CMSG_RX_SPACE MAX(CMSG4_SPACE_PKTINFO+CMSG4_SPACE_TTL, \
-			  CMSG6_SPACE_PKTINFO+CMSG6_SPACE_TTL)
+#define CMSG_RX_SPACE (MAX(CMSG4_SPACE_PKTINFO+CMSG4_SPACE_TTL, \
+			   CMSG6_SPACE_PKTINFO+CMSG6_SPACE_TTL) + CMSG_SPACE_TSTAMP)
 #define CMSG_TX_SPACE MAX(CMSG4_SPACE_PKTINFO,CMSG6_SPACE_PKTINFO)
 
 static void
@@ -1527,9 +2544,13 @@ sk_process_cmsgs(sock *s, struct msghdr *msg)
   s->laddr = IPA_NONE;
   s->lifindex = 0;
   s->rcv_ttl = -1;
+  s->rcv_tstamp = 0;
 
   for (cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm))
   {
+    if (cm->cmsg_level == SOL_SOCKET)
+      sk_process_cmsg_tstamp(s, cm);
+
     if ((cm->cmsg_level == SOL_IP) && sk_is_ipv4(s))
     {
       sk_process_cmsg4_pktinfo(s, cm);
@@ -1616,6 +2637,100 @@ sk_recvmsg(sock *s)
   return rv;
 }
 
+#ifdef CONFIG_RECVMMSG
+
+#define SK_RX_BATCH_MAX 16
+
+/*
+ * Receive up to @rx_batch datagrams by one recvmmsg() call. The first one is
+ * received directly to the receive buffer, others to @rx_batch_buf, from where
+ * they are copied to the receive buffer one by one before their rx_hook call.
+ * That keeps the usual meaning of the buffer even when the hook changes it
+ * by sk_set_rbsize(). Returns like sk_read().
+ */
+static int
+sk_recvmmsg(sock *s)
+{
+  struct mmsghdr msgs[SK_RX_BATCH_MAX];
+  struct iovec iov[SK_RX_BATCH_MAX];
+  sockaddr src[SK_RX_BATCH_MAX];
+  byte cmsg_buf[SK_RX_BATCH_MAX][CMSG_RX_SPACE];
+  uint cnt = MIN(s->rx_batch, SK_RX_BATCH_MAX);
+  uint size = s->rbsize;
+  int in_main = !(s->flags & SKF_THREAD);
+  int i, e;
+
+  if (s->rx_batch_size != (cnt - 1) * size)
+  {
+    xfree(s->rx_batch_buf);
+    s->rx_batch_size = (cnt - 1) * size;
+    s->rx_batch_buf = xmalloc(s->rx_batch_size);
+  }
+
+  for (i = 0; i < (int) cnt; i++)
+  {
+    iov[i].iov_base = i ? (byte *) s->rx_batch_buf + (i - 1) * size : s->rbuf;
+    iov[i].iov_len = size;
+
+    msgs[i].msg_hdr = (struct msghdr) {
+      .msg_name = &src[i].sa,
+      .msg_namelen = sizeof(src[i]),
+      .msg_iov = &iov[i],
+      .msg_iovlen = 1,
+      .msg_control = cmsg_buf[i],
+      .msg_controllen = sizeof(cmsg_buf[i]),
+      .msg_flags = 0
+    };
+    msgs[i].msg_len = 0;
+  }
+
+  e = recvmmsg(s->fd, msgs, cnt, 0, NULL);
+  if (e < 0)
+  {
+    if (errno != EINTR && errno != EAGAIN)
+    {
+      sk_trace_error(s, errno);
+      s->err_hook(s, errno);
+    }
+    return 0;
+  }
+
+  for (i = 0; i < e; i++)
+  {
+    uint len = msgs[i].msg_len;
+
+    if (i)
+    {
+      /* The rest of the batch is dropped if receiving was turned off */
+      if (!s->rx_hook)
+	break;
+
+      len = MIN(len, s->rbsize);
+      memcpy(s->rbuf, iov[i].iov_base, len);
+    }
+
+    sockaddr_read(&src[i], s->af, &s->faddr, NULL, &s->fport);
+    sk_process_cmsgs(s, &msgs[i].msg_hdr);
+
+    if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || (len < msgs[i].msg_len))
+      s->flags |= SKF_TRUNCATED;
+    else
+      s->flags &= ~SKF_TRUNCATED;
+
+    s->rpos = s->rbuf + len;
+    sk_trace_dgram(s, len);
+    s->rx_hook(s, len);
+
+    /* The socket could have been deleted by the hook */
+    if (in_main && (current_sock != s))
+      break;
+  }
+
+  return 1;
+}
+
+#endif
+
 
 static inline void reset_tx_buffer(sock *s) { s->ttx = s->tpos = s->tbuf; }
 
@@ -1624,6 +2739,13 @@ sk_maybe_write(sock *s)
 {
   int e;
 
+  /* Outputs of replayed sockets are dropped */
+  if (s->flags & SKF_REPLAY)
+  {
+    reset_tx_buffer(s);
+    return 1;
+  }
+
   switch (s->type)
   {
   case SK_TCP:
@@ -1639,9 +2761,11 @@ sk_maybe_write(sock *s)
 	{
 	  reset_tx_buffer(s);
 	  /* EPIPE is just a connection close notification during TX */
+	  sk_trace_error(s, (errno != EPIPE) ? errno : 0);
 	  s->err_hook(s, (errno != EPIPE) ? errno : 0);
 	  return -1;
 	}
+	sk_poll_update(s);
 	return 0;
       }
       s->ttx += e;
@@ -1662,12 +2786,15 @@ sk_maybe_write(sock *s)
 	if (errno != EINTR && errno != EAGAIN)
 	{
 	  reset_tx_buffer(s);
+	  sk_trace_error(s, errno);
 	  s->err_hook(s, errno);
 	  return -1;
 	}
 
 	if (!s->tx_hook)
 	  reset_tx_buffer(s);
+	else
+	  sk_poll_update(s);
 	return 0;
       }
       reset_tx_buffer(s);
@@ -1692,6 +2819,9 @@ sk_rx_ready(sock *s)
   timo.tv_sec = 0;
   timo.tv_usec = 0;
 
+  if (s->flags & SKF_REPLAY)
+    return 0;
+
  redo:
   rv = select(s->fd+1, &rd, &wr, NULL, &timo);
 
@@ -1744,6 +2874,174 @@ sk_send_to(sock *s, unsigned len, ip_addr addr, unsigned port)
   return sk_maybe_write(s);
 }
 
+#ifdef CONFIG_SENDMMSG
+
+#define SK_MMSG_MAX 64
+
+/* Packet i is @len bytes at @data + i * @step and it is sent to @addrs[i] */
+static int
+sk_sendmmsg(sock *s, byte *data, uint step, uint len, ip_addr *addrs, uint count)
+{
+  struct iovec iov[SK_MMSG_MAX];
+  byte cmsg_buf[CMSG_TX_SPACE];
+  struct mmsghdr msgs[SK_MMSG_MAX];
+  sockaddr dst[SK_MMSG_MAX];
+  struct msghdr msg0 = { .msg_iovlen = 1 };
+  uint i, sent;
+  int e;
+
+  if (s->flags & SKF_REPLAY)
+    return 1;
+
+  /* Control messages are the same for all packets */
+  if (s->flags & SKF_PKTINFO)
+    sk_prepare_cmsgs(s, &msg0, cmsg_buf, sizeof(cmsg_buf));
+
+  for (sent = 0; sent < count; sent += e)
+  {
+    uint n = MIN(count - sent, SK_MMSG_MAX);
+
+    for (i = 0; i < n; i++)
+    {
+      sockaddr_fill(&dst[i], s->af, addrs[sent + i], s->iface, s->dport);
+      iov[i].iov_base = data + (sent + i) * step;
+      iov[i].iov_len = len;
+      msgs[i].msg_hdr = msg0;
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_name = &dst[i].sa;
+      msgs[i].msg_hdr.msg_namelen = SA_LEN(dst[i]);
+      msgs[i].msg_len = 0;
+    }
+
+    e = sendmmsg(s->fd, msgs, n, 0);
+
+    if (e < 0)
+    {
+      if (errno == EINTR)
+	{ e = 0; continue; }
+
+      if (errno != EAGAIN)
+      {
+	sk_trace_error(s, errno);
+	s->err_hook(s, errno);
+	return -1;
+      }
+
+      /* Like sk_maybe_write() without tx_hook, the rest is dropped */
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+#endif
+
+/**
+ * sk_send_to_many - send the same data to multiple destinations
+ * @s: socket
+ * @len: number of bytes to send
+ * @addrs: array of IP addresses to send the packet to
+ * @count: number of addresses in @addrs
+ * @port: port to send the packet to
+ *
+ * This is a sk_send_to() variant for sending one packet from the transmit
+ * buffer to more destinations, e.g. to all neighbors on a non-broadcast
+ * network. Where the system supports sendmmsg(), all packets are passed in
+ * one call, otherwise they are sent one by one. Sockets with @tx_hook always
+ * use the latter, as only one packet can be queued for later transmission.
+ * Returns 1 if all packets were sent, 0 if some were not (the TX queue is
+ * full) and -1 on error.
+ */
+int
+sk_send_to_many(sock *s, uint len, ip_addr *addrs, uint count, uint port)
+{
+  uint i;
+  int rv = 1;
+
+  if (port)
+    s->dport = port;
+
+  if (!count)
+    return 1;
+
+#ifdef CONFIG_SENDMMSG
+#ifdef CONFIG_USE_HDRINCL
+  if (!(s->flags & SKF_HDRINCL))
+#endif
+  if (((s->type == SK_UDP) || (s->type == SK_IP)) && !s->tx_hook)
+  {
+    s->daddr = addrs[count - 1];
+    return sk_sendmmsg(s, s->tbuf, 0, len, addrs, count);
+  }
+#endif
+
+  for (i = 0; i < count; i++)
+  {
+    int e = sk_send_to(s, len, addrs[i], 0);
+
+    if (e < 0)
+      return -1;
+
+    if (!e)
+      rv = 0;
+  }
+
+  return rv;
+}
+
+/**
+ * sk_send_batch - send different packets to multiple destinations
+ * @s: socket
+ * @data: packets
+ * @len: length of each packet
+ * @addrs: array of IP addresses to send the packets to
+ * @count: number of packets and addresses in @addrs
+ * @port: port to send the packets to
+ *
+ * Like sk_send_to_many(), but packet i is taken from @data + i * @len instead
+ * of the transmit buffer, so each destination gets its own data, e.g. its own
+ * session state. Packets must fit into the transmit buffer. Returns 1 if all
+ * packets were sent, 0 if some were not and -1 on error.
+ */
+int
+sk_send_batch(sock *s, byte *data, uint len, ip_addr *addrs, uint count, uint port)
+{
+  uint i;
+  int rv = 1;
+
+  if (port)
+    s->dport = port;
+
+  if (!count)
+    return 1;
+
+#ifdef CONFIG_SENDMMSG
+#ifdef CONFIG_USE_HDRINCL
+  if (!(s->flags & SKF_HDRINCL))
+#endif
+  if (((s->type == SK_UDP) || (s->type == SK_IP)) && !s->tx_hook)
+  {
+    s->daddr = addrs[count - 1];
+    return sk_sendmmsg(s, data, len, len, addrs, count);
+  }
+#endif
+
+  for (i = 0; i < count; i++)
+  {
+    memcpy(s->tbuf, data + i * len, len);
+    int e = sk_send_to(s, len, addrs[i], 0);
+
+    if (e < 0)
+      return -1;
+
+    if (!e)
+      rv = 0;
+  }
+
+  return rv;
+}
+
 /*
 int
 sk_send_full(sock *s, unsigned len, struct iface *ifa,
@@ -1780,12 +3078,21 @@ sk_read(sock *s)
       if (c < 0)
       {
 	if (errno != EINTR && errno != EAGAIN)
+	{
+	  sk_trace_error(s, errno);
 	  s->err_hook(s, errno);
+	}
       }
       else if (!c)
+      {
+	sk_trace_error(s, 0);
 	s->err_hook(s, 0);
+      }
       else
       {
+	if (sk_recording(s))
+	  trace_write(TR_STREAM, s->trace_id, 0, NULL, 0, s->rpos, c);
+
 	s->rpos += c;
 	if (s->rx_hook(s, s->rpos - s->rbuf))
 	{
@@ -1803,16 +3110,25 @@ sk_read(sock *s)
 
   default:
     {
+#ifdef CONFIG_RECVMMSG
+      if (s->rx_batch > 1)
+	return sk_recvmmsg(s);
+#endif
+
       int e = sk_recvmsg(s);
 
       if (e < 0)
       {
 	if (errno != EINTR && errno != EAGAIN)
+	{
+	  sk_trace_error(s, errno);
 	  s->err_hook(s, errno);
+	}
 	return 0;
       }
 
       s->rpos = s->rbuf + e;
+      sk_trace_dgram(s, e);
       s->rx_hook(s, e);
       return 1;
     }
@@ -1832,7 +3148,10 @@ sk_write(sock *s)
       if (connect(s->fd, &sa.sa, SA_LEN(sa)) >= 0 || errno == EISCONN)
 	sk_tcp_connected(s);
       else if (errno != EINTR && errno != EAGAIN && errno != EINPROGRESS)
+      {
+	sk_trace_error(s, errno);
 	s->err_hook(s, errno);
+      }
       return 0;
     }
 
@@ -1884,6 +3203,10 @@ static int event_log_pos, event_log_num, watchdog_active;
 static btime last_time;
 static btime loop_time;
 
+static void io_account_event(void *hook, btime duration);
+
+int io_stats;				/* Loop statistics are collected */
+
 static void
 io_update_time(void)
 {
@@ -1909,29 +3232,85 @@ io_update_time(void)
   {
     event_open->duration = last_time - event_open->timestamp;
 
-    if (event_open->duration > config->latency_limit)
+    if (config->latency_debug && (event_open->duration > config->latency_limit))
       log(L_WARN "Event 0x%p 0x%p took %d ms",
 	  event_open->hook, event_open->data, (int) (event_open->duration TO_MS));
 
+    if (io_stats)
+      io_account_event(event_open->hook, event_open->duration);
+
     event_open = NULL;
   }
 }
 
+/*
+ * With 'cpu accounting' enabled, thread CPU time of each hook logged by
+ * io_log_event() is charged to the account of its socket, timer or event
+ * (see rp_set_account()), which is kept open in @cpu_open until the next
+ * event or the end of the loop cycle. Hooks without an account are not
+ * measured.
+ */
+static struct cpu_account *cpu_open;
+static u64 cpu_open_start;
+
+static inline u64
+io_cpu_time(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+    return 0;
+
+  return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+io_account_cpu(struct cpu_account *next)
+{
+  u64 t = (cpu_open || next) ? io_cpu_time() : 0;
+
+  if (cpu_open)
+    cpu_open->time += t - MIN(t, cpu_open_start);
+
+  cpu_open = next;
+  cpu_open_start = t;
+}
+
+/**
+ * cpu_account_drop - forget an account
+ * @a: CPU account
+ *
+ * Must be called before the structure containing @a is freed, as it may be
+ * freed by the hook it is charged for.
+ */
+void
+cpu_account_drop(struct cpu_account *a)
+{
+  if (cpu_open == a)
+    cpu_open = NULL;
+}
+
 /**
  * io_log_event - mark approaching event into event log
  * @hook: event hook address
  * @data: event data address
+ * @acct: account to charge for the event, may be NULL
  *
  * Store info (hook, data, timestamp) about the following internal event into
  * a circular event log (@event_log). When latency tracking is enabled, the log
  * entry is kept open (in @event_open) so the duration can be filled later.
  */
 void
-io_log_event(void *hook, void *data)
+io_log_event(void *hook, void *data, struct cpu_account *acct)
 {
-  if (config->latency_debug)
+  int timed = config->latency_debug || io_stats;
+
+  if (timed)
     io_update_time();
 
+  if (cpu_open || (acct && config->cpu_accounting))
+    io_account_cpu(config->cpu_accounting ? acct : NULL);
+
   struct event_log_entry *en = event_log + event_log_pos;
 
   en->hook = hook;
@@ -1943,7 +3322,7 @@ io_log_event(void *hook, void *data)
   event_log_pos++;
   event_log_pos %= EVENT_LOG_LENGTH;
 
-  event_open = config->latency_debug ? en : NULL;
+  event_open = timed ? en : NULL;
 }
 
 static inline void
@@ -1951,6 +3330,9 @@ io_close_event(void)
 {
   if (event_open)
     io_update_time();
+
+  if (cpu_open)
+    io_account_cpu(NULL);
 }
 
 void
@@ -1968,16 +3350,224 @@ io_log_dump(void)
   }
 }
 
-void
-watchdog_sigalrm(int sig UNUSED)
-{
-  /* Update last_time and duration, but skip latency check */
-  config->latency_limit = 0xffffffff;
-  io_update_time();
 
-  /* We want core dump */
-  abort();
-}
+/*
+ *	Loop statistics
+ *
+ * When enabled by the 'loop stats' command, durations of all events logged by
+ * io_log_event() (events, timers and socket hooks) are aggregated per hook
+ * address, and durations of whole loop cycles are aggregated too. Durations
+ * are counted in histograms of log-scale buckets, bucket @i covers durations
+ * from 2^@i to 2^(@i+1) microseconds, so percentiles are estimated within
+ * a factor of two. Hooks are shown by address, which may be resolved to
+ * a symbol by addr2line.
+ *
+ * Independently of that, durations of loop cycles are always accounted in
+ * @io_loop_totals, which are never reset and are read by io_loop_stats().
+ */
+
+struct io_hook_stats {
+  struct io_hook_stats *next;
+  void *hook;
+  u64 count;
+  btime total, max;
+  u32 hist[IO_HIST_SIZE];
+};
+
+#define IHS_KEY(n)		n->hook
+#define IHS_NEXT(n)		n->next
+#define IHS_EQ(a,b)		a == b
+#define IHS_FN(k)		u32_hash((u32) (uintptr_t) (k) ^ (u32) ((u64) (uintptr_t) (k) >> 32))
+
+#define IHS_REHASH		io_hook_stats_rehash
+#define IHS_PARAMS		/8, *2, 2, 2, 6, 16
+
+HASH_DEFINE_REHASH_FN(IHS, struct io_hook_stats)
+
+static HASH(struct io_hook_stats) io_hook_hash;
+static struct io_hook_stats io_cycle_stats;
+static pool *io_stats_pool;
+static struct io_loop_stats io_loop_totals;
+
+static inline uint
+io_hist_bucket(btime duration)
+{
+  return (duration > 1) ? MIN(u32_log2(MIN(duration, (btime) 0xffffffff)), IO_HIST_SIZE - 1) : 0;
+}
+
+static inline void
+io_stats_add(struct io_hook_stats *st, btime duration)
+{
+  uint b = io_hist_bucket(duration);
+
+  st->count++;
+  st->total += duration;
+  st->max = MAX(st->max, duration);
+  st->hist[b]++;
+}
+
+static void
+io_account_event(void *hook, btime duration)
+{
+  struct io_hook_stats *st = HASH_FIND(io_hook_hash, IHS, hook);
+
+  if (!st)
+  {
+    st = mb_allocz(io_stats_pool, sizeof(struct io_hook_stats));
+    st->hook = hook;
+    HASH_INSERT2(io_hook_hash, IHS, io_stats_pool, st);
+  }
+
+  io_stats_add(st, duration);
+}
+
+static inline void
+io_account_cycle(btime duration)
+{
+  struct io_loop_stats *lt = &io_loop_totals;
+
+  lt->cycles++;
+  lt->total += duration;
+  lt->max = MAX(lt->max, duration);
+  lt->hist[io_hist_bucket(duration)]++;
+
+  if (io_stats)
+    io_stats_add(&io_cycle_stats, duration);
+}
+
+/**
+ * io_loop_stats - get durations of loop cycles
+ * @s: structure to be filled
+ *
+ * This function fills @s with cumulative statistics of loop cycles since
+ * the start of the daemon. They are collected regardless of the 'loop stats'
+ * command.
+ */
+void
+io_loop_stats(struct io_loop_stats *s)
+{
+  *s = io_loop_totals;
+}
+
+/**
+ * io_stats_reset - clear loop statistics
+ *
+ * This function drops all statistics collected for hooks and loop cycles.
+ */
+void
+io_stats_reset(void)
+{
+  if (io_stats_pool)
+    rfree(io_stats_pool);
+
+  io_stats_pool = rp_new(&root_pool, "Loop statistics");
+  HASH_INIT(io_hook_hash, io_stats_pool, 6);
+  memset(&io_cycle_stats, 0, sizeof(io_cycle_stats));
+}
+
+/**
+ * io_stats_set - enable or disable collection of loop statistics
+ * @enable: new state
+ */
+void
+io_stats_set(int enable)
+{
+  if (enable && !io_stats_pool)
+    io_stats_reset();
+
+  io_stats = enable;
+}
+
+/* Upper bound of the bucket where the percentile @pc of durations is */
+static btime
+io_stats_percentile(struct io_hook_stats *st, uint pc)
+{
+  u64 limit = (st->count * pc + 99) / 100;
+  u64 sum = 0;
+  uint i;
+
+  for (i = 0; i < IO_HIST_SIZE - 1; i++)
+    if ((sum += st->hist[i]) >= limit)
+      return MIN((btime) 2 << i, st->max);
+
+  return st->max;
+}
+
+static void
+io_stats_show_line(const char *name, struct io_hook_stats *st)
+{
+  cli_msg(-1024, "%-18s %10lu %12lu %8lu %8lu %8lu %8lu",
+	  name, (unsigned long) st->count, (unsigned long) st->total,
+	  (unsigned long) (st->count ? st->total / st->count : 0),
+	  (unsigned long) io_stats_percentile(st, 50),
+	  (unsigned long) io_stats_percentile(st, 99),
+	  (unsigned long) st->max);
+}
+
+static int
+io_stats_cmp(const void *a, const void *b)
+{
+  btime x = (*(struct io_hook_stats **) a)->total;
+  btime y = (*(struct io_hook_stats **) b)->total;
+  return (x < y) - (x > y);
+}
+
+/**
+ * io_stats_show - show loop statistics
+ * @max: number of hooks to show, zero for all
+ *
+ * This function prints statistics of loop cycles and of the most expensive
+ * hooks by cumulative time. All times are in microseconds.
+ */
+void
+io_stats_show(uint max)
+{
+  struct io_hook_stats **hooks;
+  char name[24];
+  uint i, n = 0;
+
+  cli_msg(-1024, "Loop statistics are %s", io_stats ? "enabled" : "disabled");
+  if (!io_stats_pool)
+  {
+    cli_msg(0, "");
+    return;
+  }
+
+  cli_msg(-1024, "%-18s %10s %12s %8s %8s %8s %8s",
+	  "Hook", "Count", "Total [us]", "Avg", "p50", "p99", "Max");
+  io_stats_show_line("Loop cycle", &io_cycle_stats);
+
+  hooks = xmalloc((io_hook_hash.count + 1) * sizeof(struct io_hook_stats *));
+  HASH_WALK(io_hook_hash, next, st)
+    hooks[n++] = st;
+  HASH_WALK_END;
+
+  qsort(hooks, n, sizeof(struct io_hook_stats *), io_stats_cmp);
+
+  if (max && (n > max))
+    n = max;
+
+  for (i = 0; i < n; i++)
+  {
+    bsprintf(name, "0x%p", hooks[i]->hook);
+    io_stats_show_line(name, hooks[i]);
+  }
+
+  xfree(hooks);
+  cli_msg(0, "");
+}
+
+
+void
+watchdog_sigalrm(int sig UNUSED)
+{
+  /* Update last_time and duration, but skip latency check */
+  config->latency_limit = 0xffffffff;
+  io_update_time();
+
+  /* We want core dump */
+  abort();
+}
 
 static inline void
 watchdog_start1(void)
@@ -2002,7 +3592,7 @@ watchdog_start(void)
   }
 }
 
-static inline void
+static inline btime
 watchdog_stop(void)
 {
   io_update_time();
@@ -2014,11 +3604,191 @@ watchdog_stop(void)
   }
 
   btime duration = last_time - loop_time;
+  io_account_cycle(duration);
+
   if (duration > config->watchdog_warning)
     log(L_WARN "I/O loop cycle took %d ms for %d events",
 	(int) (duration TO_MS), event_log_num);
+
+  return duration;
+}
+
+
+/*
+ *	Pipes for wakeup of event loops
+ */
+
+void
+pipe_new(int *pfds)
+{
+  int rv = pipe(pfds);
+  if (rv < 0)
+    die("pipe: %m");
+
+  if (fcntl(pfds[0], F_SETFL, O_NONBLOCK) < 0)
+    die("fcntl(O_NONBLOCK): %m");
+
+  if (fcntl(pfds[1], F_SETFL, O_NONBLOCK) < 0)
+    die("fcntl(O_NONBLOCK): %m");
+}
+
+void
+pipe_drain(int fd)
+{
+  char buf[64];
+  int rv;
+
+ try:
+  rv = read(fd, buf, 64);
+  if (rv < 0)
+  {
+    if (errno == EINTR)
+      goto try;
+    if (errno == EAGAIN)
+      return;
+    die("wakeup read: %m");
+  }
+  if (rv == 64)
+    goto try;
+}
+
+void
+pipe_kick(int fd)
+{
+  u64 v = 1;
+  int rv;
+
+ try:
+  rv = write(fd, &v, sizeof(u64));
+  if (rv < 0)
+  {
+    if (errno == EINTR)
+      goto try;
+    if (errno == EAGAIN)
+      return;
+    die("wakeup write: %m");
+  }
+}
+
+
+/*
+ *	Events sent from other threads
+ *
+ * Threads running their own event loop (&birdloop of BFD) cannot touch the
+ * data of the main loop, like routing tables or protocol states. They pass
+ * such work to the main loop by ev_send_main(), which queues the event to a
+ * locked mailbox and wakes up the main loop by a pipe. Such events must not be
+ * scheduled by ev_schedule(), as their node is protected by the mailbox lock.
+ */
+
+#ifdef USE_PTHREADS
+
+static pthread_mutex_t main_mailbox_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list main_mailbox;
+static int main_mailbox_fds[2];
+static int main_mailbox_kicked;
+
+/**
+ * ev_send_main - schedule an event in the main loop from any thread
+ * @e: an event
+ *
+ * This function queues the event @e to be run by the main loop. It may be
+ * called from any thread. If the event is already queued, nothing happens.
+ */
+void
+ev_send_main(event *e)
+{
+  int kick;
+
+  pthread_mutex_lock(&main_mailbox_mutex);
+  if (!ev_active(e))
+    add_tail(&main_mailbox, &e->n);
+  kick = !main_mailbox_kicked;
+  main_mailbox_kicked = 1;
+  pthread_mutex_unlock(&main_mailbox_mutex);
+
+  if (kick)
+    pipe_kick(main_mailbox_fds[1]);
+}
+
+/**
+ * ev_postpone_main - remove an event from the main loop mailbox
+ * @e: an event
+ *
+ * This function cancels the event @e sent by ev_send_main(). It must be called
+ * from the main loop before the event is freed.
+ */
+void
+ev_postpone_main(event *e)
+{
+  pthread_mutex_lock(&main_mailbox_mutex);
+  ev_postpone(e);
+  pthread_mutex_unlock(&main_mailbox_mutex);
+}
+
+static int
+main_mailbox_hook(sock *sk, int size UNUSED)
+{
+  event *e;
+  node *n;
+
+  pthread_mutex_lock(&main_mailbox_mutex);
+  main_mailbox_kicked = 0;
+  pthread_mutex_unlock(&main_mailbox_mutex);
+
+  pipe_drain(sk->fd);
+
+  for (;;)
+  {
+    pthread_mutex_lock(&main_mailbox_mutex);
+    n = HEAD(main_mailbox);
+    if (!n->next)
+    {
+      pthread_mutex_unlock(&main_mailbox_mutex);
+      return 0;
+    }
+    e = SKIP_BACK(event, n, n);
+    ev_postpone(e);
+    pthread_mutex_unlock(&main_mailbox_mutex);
+
+    io_log_event(e->hook, e->data, e->acct);
+    e->hook(e->data);
+  }
+}
+
+static void
+main_mailbox_err(sock *sk UNUSED, int err)
+{
+  log(L_ERR "Main loop mailbox error: %M", err);
 }
 
+static void
+main_mailbox_init(void)
+{
+  sock *sk;
+
+  init_list(&main_mailbox);
+  pipe_new(main_mailbox_fds);
+
+  /* Only the read end is polled, the write end is used directly */
+  sk = sk_new(&root_pool);
+  sk->type = SK_MAGIC;
+  sk->rx_hook = main_mailbox_hook;
+  sk->err_hook = main_mailbox_err;
+  sk->fd = main_mailbox_fds[0];
+  if (sk_open(sk) < 0)
+    die("Cannot open main loop mailbox");
+}
+
+#else
+
+void ev_send_main(event *e) { ev_schedule(e); }
+void ev_postpone_main(event *e) { ev_postpone(e); }
+
+static inline void main_mailbox_init(void) { }
+
+#endif
+
 
 /*
  *	Main I/O Loop
@@ -2030,35 +3800,534 @@ volatile int async_dump_flag;
 void
 io_init(void)
 {
-  init_list(&near_timers);
-  init_list(&far_timers);
+  BUFFER_INIT(ptimers, &root_pool, 4);
+  BUFFER_PUSH(ptimers) = NULL;
   init_list(&sock_list);
+#ifdef CONFIG_EPOLL
+  sock_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (sock_epoll_fd < 0)
+    die("epoll_create1: %m");
+  BUFFER_INIT(sock_idle, &root_pool, 16);
+#endif
+#ifdef CONFIG_IO_URING
+  sk_uring_init();
+#endif
   init_list(&global_event_list);
+  init_list(&global_work_list);
+  init_list(&global_cli_list);
   krt_io_init();
   init_times();
+  trace_init();
+  if (trace_mode)
+  {
+    BUFFER_INIT(sk_traced, &root_pool, 64);
+    BUFFER_PUSH(sk_traced) = NULL;	/* ID 0 is not used */
+  }
   update_times();
+  tw_init();
   boot_time = now;
-  srandom((int) now_real);
+  srandom(trace_mode ? trace_seed : (uint) now_real);
+  main_mailbox_init();
 }
 
 static int short_loops = 0;
 #define SHORT_LOOP_MAX 10
+#define WORK_EVENTS_MAX 1000
+
+/*
+ * Reads of regular sockets are scheduled in classes. Sockets of types above
+ * %SK_MAGIC (internal ones and CLI) are served first, together with all
+ * writes. Then control sockets get up to %MAX_RX_STEPS reads in each loop,
+ * even when events are pending. Bulk sockets (BGP sessions) are postponed by
+ * pending events for up to %SHORT_LOOP_MAX loops, and their number of reads
+ * adapts to the measured duration of loop cycles. It is halved when a cycle
+ * takes long, so control traffic and timers are not starved by bulk updates,
+ * and grows again slowly when cycles are short.
+ */
+
+static uint bulk_steps = MAX_RX_STEPS;
+
+static void
+io_adapt_steps(btime cycle)
+{
+  if (cycle > BULK_CYCLE_HIGH)
+    bulk_steps = MAX(bulk_steps / 2, MIN_BULK_STEPS);
+  else if ((cycle < BULK_CYCLE_LOW) && (bulk_steps < MAX_BULK_STEPS))
+    bulk_steps++;
+}
+
+static inline void
+io_init_steps(uint *steps, int events)
+{
+  steps[SK_CLASS_CONTROL] = MAX_RX_STEPS;
+  steps[SK_CLASS_BULK] = 0;
+
+  short_loops++;
+  if (events && (short_loops < SHORT_LOOP_MAX))
+    return;
+  short_loops = 0;
+
+  steps[SK_CLASS_BULK] = bulk_steps;
+}
+
+static inline uint
+sk_get_class(sock *s)
+{
+  return (s->io_class < SK_CLASS_MAX) ? s->io_class : SK_CLASS_CONTROL;
+}
+
+#ifdef CONFIG_EPOLL
+
+static void
+io_poll(struct timeval *timo, int events)
+{
+  int i, n;
+
+  /* Update sockets dispatched in the last round and those with changed hooks */
+  for (i = 0; i < sock_events_num; i++)
+    if (sock_events[i].data.ptr)
+      sk_poll_update(sock_events[i].data.ptr);
+  sock_events_num = 0;
+
+  for (i = sock_idle.used; i--; )
+    sk_poll_update(sock_idle.data[i]);
+
+  sk_poll_submit();
+
+  io_adapt_steps(watchdog_stop());
+  n = epoll_wait(sock_epoll_fd, sock_events, SK_EVENTS_MAX,
+		 timo->tv_sec * 1000 + (timo->tv_usec + 999) / 1000);
+  watchdog_start();
+
+  if (n < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+	return;
+      die("epoll_wait: %m");
+    }
+  if (!n)
+    return;
+
+  sock_events_num = n;
+
+  for (i = 0; i < n; i++)
+    {
+      sock *s = sock_events[i].data.ptr;
+      u32 ev = sock_events[i].events;
+      int e;
+      int steps;
+
+      if (!s)
+	continue;
+
+      current_sock = s;
+
+      steps = MAX_STEPS;
+      if ((s->type >= SK_MAGIC) && (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) && s->rx_hook)
+	do
+	  {
+	    steps--;
+	    io_log_event(s->rx_hook, s->data, s->acct);
+	    e = sk_read(s);
+	    if (s != current_sock)
+	      goto next;
+	  }
+	while (e && s->rx_hook && steps);
+
+      steps = MAX_STEPS;
+      if ((ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && (s->poll_events & EPOLLOUT))
+	do
+	  {
+	    steps--;
+	    io_log_event(s->tx_hook, s->data, s->acct);
+	    e = sk_write(s);
+	    if (s != current_sock)
+	      goto next;
+	  }
+	while (e && steps);
+    next: ;
+    }
+  current_sock = NULL;
+
+  /*
+   * Level-triggered events of sockets skipped due to exhausted steps are
+   * reported first by the next wait, which keeps the round-robin order.
+   */
+  uint steps[SK_CLASS_MAX];
+  io_init_steps(steps, events);
+
+  for (i = 0; i < n; i++)
+    {
+      sock *s = sock_events[i].data.ptr;
+      int e UNUSED;
+
+      if (s && (s->type < SK_MAGIC) && (sock_events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && s->rx_hook)
+	{
+	  uint c = sk_get_class(s);
+	  if (!steps[c])
+	    continue;
+
+	  steps[c]--;
+	  current_sock = s;
+	  io_log_event(s->rx_hook, s->data, s->acct);
+	  e = sk_read(s);
+	}
+    }
+  current_sock = NULL;
+}
+
+#else
+
+static void
+io_poll(struct timeval *timo, int events)
+{
+  static fd_set rd, wr;
+  int hi;
+  sock *s;
+  node *n;
+
+  if (sock_recalc_fdsets_p)
+    {
+      sock_recalc_fdsets_p = 0;
+      FD_ZERO(&rd);
+      FD_ZERO(&wr);
+    }
+
+  hi = 0;
+  WALK_LIST(n, sock_list)
+    {
+      s = SKIP_BACK(sock, n, n);
+      if (s->flags & SKF_REPLAY)
+	continue;
+      if (s->rx_hook)
+	{
+	  FD_SET(s->fd, &rd);
+	  if (s->fd > hi)
+	    hi = s->fd;
+	}
+      else
+	FD_CLR(s->fd, &rd);
+      if (s->tx_hook && s->ttx != s->tpos)
+	{
+	  FD_SET(s->fd, &wr);
+	  if (s->fd > hi)
+	    hi = s->fd;
+	}
+      else
+	FD_CLR(s->fd, &wr);
+    }
+
+  io_adapt_steps(watchdog_stop());
+  hi = select(hi+1, &rd, &wr, NULL, timo);
+  watchdog_start();
+
+  if (hi < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+	return;
+      die("select: %m");
+    }
+  if (hi)
+    {
+      /* guaranteed to be non-empty */
+      current_sock = SKIP_BACK(sock, n, HEAD(sock_list));
+
+      while (current_sock)
+	{
+	  sock *s = current_sock;
+	  int e;
+	  int steps;
+
+	  if (s->flags & SKF_REPLAY)
+	    goto skip;
+
+	  steps = MAX_STEPS;
+	  if ((s->type >= SK_MAGIC) && FD_ISSET(s->fd, &rd) && s->rx_hook)
+	    do
+	      {
+		steps--;
+		io_log_event(s->rx_hook, s->data, s->acct);
+		e = sk_read(s);
+		if (s != current_sock)
+		  goto next;
+	      }
+	    while (e && s->rx_hook && steps);
+
+	  steps = MAX_STEPS;
+	  if (FD_ISSET(s->fd, &wr))
+	    do
+	      {
+		steps--;
+		io_log_event(s->tx_hook, s->data, s->acct);
+		e = sk_write(s);
+		if (s != current_sock)
+		  goto next;
+	      }
+	    while (e && steps);
+	skip:
+	  current_sock = sk_next(s);
+	next: ;
+	}
+
+      uint steps[SK_CLASS_MAX];
+      io_init_steps(steps, events);
+
+      current_sock = stored_sock;
+      if (current_sock == NULL)
+	current_sock = SKIP_BACK(sock, n, HEAD(sock_list));
+
+      while (current_sock && (steps[SK_CLASS_CONTROL] || steps[SK_CLASS_BULK]))
+	{
+	  sock *s = current_sock;
+	  int e UNUSED;
+
+	  if ((s->type < SK_MAGIC) && !(s->flags & SKF_REPLAY) && FD_ISSET(s->fd, &rd) && s->rx_hook && steps[sk_get_class(s)])
+	    {
+	      steps[sk_get_class(s)]--;
+	      io_log_event(s->rx_hook, s->data, s->acct);
+	      e = sk_read(s);
+	      if (s != current_sock)
+		  goto next2;
+	    }
+	  current_sock = sk_next(s);
+	next2: ;
+	}
+
+      stored_sock = current_sock;
+    }
+}
+
+#endif
+
+/*
+ * Replay does not wait for sockets. When there is nothing else to do, the
+ * virtual time jumps to the next input of the trace, or by the timeout to
+ * the next timer if that comes first. The input is then passed to the hooks
+ * of its socket in the same way as by sk_read(). Inputs due at the current
+ * time are dispatched even when events are pending, one per loop, like reads
+ * of sockets. Internal sockets with descriptors are still polled.
+ */
+
+static void
+sk_replay(struct tr_record *r)
+{
+  sock *s = (r->sock < sk_traced.used) ? sk_traced.data[r->sock] : NULL;
+  byte *data = (byte *) (r + 1);
+  u64 count = trace_count;
+
+  if (!s)
+    goto skip;
+
+  current_sock = s;
+
+  switch (r->type)
+  {
+  case TR_STREAM:
+    if (((s->type != SK_TCP) && (s->type != SK_UNIX)) || !s->rx_hook ||
+	(r->len > (uint) (s->rbuf + s->rbsize - s->rpos)))
+      goto skip;
+
+    memcpy(s->rpos, data, r->len);
+    s->rpos += r->len;
+    trace_next();
+
+    io_log_event(s->rx_hook, s->data, s->acct);
+    if (s->rx_hook(s, s->rpos - s->rbuf) && (current_sock == s))
+      s->rpos = s->rbuf;
+    break;
+
+  case TR_DGRAM:
+    {
+      struct tr_dgram *d = (void *) data;
+      uint len = r->len - sizeof(struct tr_dgram);
+
+      if (((s->type != SK_UDP) && (s->type != SK_IP)) || !s->rx_hook || (len > s->rbsize))
+	goto skip;
+
+      memcpy(s->rbuf, d + 1, len);
+      s->faddr = d->faddr;
+      s->laddr = d->laddr;
+      s->fport = d->fport;
+      s->lifindex = d->lifindex;
+      s->rcv_ttl = d->ttl;
+      s->rcv_tstamp = d->tstamp;
+      s->flags = d->truncated ? (s->flags | SKF_TRUNCATED) : (s->flags & ~SKF_TRUNCATED);
+      s->rpos = s->rbuf + len;
+      trace_next();
+
+      io_log_event(s->rx_hook, s->data, s->acct);
+      s->rx_hook(s, len);
+      break;
+    }
+
+  case TR_ACCEPT:
+    {
+      struct tr_conn *c = (void *) data;
+      int type = (s->type == SK_TCP_PASSIVE) ? SK_TCP : SK_UNIX;
+
+      if (((s->type != SK_TCP_PASSIVE) && (s->type != SK_UNIX_PASSIVE)) || !s->rx_hook)
+	goto skip;
+
+      sock *t = sk_new_accepted(s, type, -1);
+      t->saddr = c->saddr;
+      t->daddr = c->daddr;
+      t->sport = c->sport;
+      t->dport = c->dport;
+      t->iface = c->ifindex ? if_find_by_index(c->ifindex) : NULL;
+      trace_next();
+
+      sk_insert(t);
+      sk_alloc_bufs(t);
+      io_log_event(s->rx_hook, s->data, s->acct);
+      s->rx_hook(t, 0);
+      break;
+    }
+
+  case TR_CONNECT:
+    {
+      struct tr_conn *c = (void *) data;
+
+      if (s->type != SK_TCP_ACTIVE)
+	goto skip;
+
+      s->saddr = c->saddr;
+      s->sport = c->sport;
+      trace_next();
+
+      io_log_event(s->tx_hook, s->data, s->acct);
+      sk_tcp_connected(s);
+      break;
+    }
+
+  case TR_ERROR:
+  case TR_KERNEL:
+    /* Kernel messages are read by the hook, see trace_read() */
+    if (s->type == SK_MAGIC)
+    {
+      if (!s->rx_hook)
+	goto skip;
+
+      io_log_event(s->rx_hook, s->data, s->acct);
+      s->rx_hook(s, 0);
+      if (trace_count == count)
+	goto skip;
+      break;
+    }
+
+    if ((r->type != TR_ERROR) || !s->err_hook)
+      goto skip;
+
+    trace_next();
+    s->err_hook(s, r->arg);
+    break;
+
+  default:
+    goto skip;
+  }
+
+  current_sock = NULL;
+  return;
+
+skip:
+  current_sock = NULL;
+  trace_skip();
+}
+
+static void
+io_replay(struct timeval *timo, int events)
+{
+  struct timeval zero = { 0, 0 };
+  btime wait = (btime) timo->tv_sec S + timo->tv_usec;
+  struct tr_record *r;
+
+  io_poll(&zero, events);
+
+  r = trace_peek();
+  if (!r)
+  {
+    /* Timers recorded after the last input should fire too */
+    if (trace_time < trace_end)
+      trace_time = MIN(trace_time + wait, trace_end);
+    else
+    {
+      if (wait)
+	trace_done();
+
+      trace_time += wait;
+    }
+    return;
+  }
+
+  if (r->time > trace_time)
+  {
+    if (!wait)
+      return;
+
+    if (r->time > trace_time + wait)
+    {
+      trace_time += wait;
+      return;
+    }
+
+    trace_time = r->time;
+  }
+
+  sk_replay(r);
+}
+
+/*
+ * Bulk work events have lower priority than regular events, timers and
+ * sockets. In each loop cycle, they are run one by one until the time slice of
+ * config->work_budget is exhausted, but always at least one of them. Events
+ * enqueued during the slice are run in it too, %WORK_EVENTS_MAX just limits
+ * the overhead of events that do nothing. Returns nonzero if some work is
+ * still pending.
+ */
+static int
+io_run_work(void)
+{
+  btime deadline = precise_time() + config->work_budget;
+  uint n = 0;
+
+  while (ev_run_list_limited(&global_work_list, 1))
+    if ((++n >= WORK_EVENTS_MAX) || (precise_time() >= deadline))
+      return 1;
+
+  return 0;
+}
+
+/*
+ * CLI events are run after bulk work in the same way, in a time slice of
+ * config->cli_budget. When bulk work is still pending, just one of them is run.
+ */
+static int
+io_run_cli(int work)
+{
+  btime deadline = precise_time() + config->cli_budget;
+  uint n = 0;
+
+  while (ev_run_list_limited(&global_cli_list, 1))
+    if (work || (++n >= WORK_EVENTS_MAX) || (precise_time() >= deadline))
+      return 1;
+
+  return 0;
+}
 
 void
 io_loop(void)
 {
-  fd_set rd, wr;
   struct timeval timo;
   time_t tout;
-  int hi, events;
-  sock *s;
-  node *n;
+  btime ptout;
+  int events, work, cli;
 
   watchdog_start1();
   sock_recalc_fdsets_p = 1;
   for(;;)
     {
       events = ev_run_list(&global_event_list);
+      work = io_run_work();
+      cli = io_run_cli(work);
       update_times();
       tout = tm_first_shot();
       if (tout <= now)
@@ -2066,145 +4335,64 @@ io_loop(void)
 	  tm_shot();
 	  continue;
 	}
-      timo.tv_sec = events ? 0 : MIN(tout - now, 3);
-      timo.tv_usec = 0;
-
-      io_close_event();
-
-      if (sock_recalc_fdsets_p)
+      ptout = ptm_first_shot();
+      if (ptout && (ptout <= precise_time()))
 	{
-	  sock_recalc_fdsets_p = 0;
-	  FD_ZERO(&rd);
-	  FD_ZERO(&wr);
+	  ptm_shot();
+	  continue;
 	}
-
-      hi = 0;
-      WALK_LIST(n, sock_list)
+      /* Pending bulk work does not postpone regular sockets, see below */
+      timo.tv_sec = (events || work || cli) ? 0 : MIN(tout - now, 3);
+      timo.tv_usec = 0;
+      if (ptout && timo.tv_sec)
 	{
-	  s = SKIP_BACK(sock, n, n);
-	  if (s->rx_hook)
-	    {
-	      FD_SET(s->fd, &rd);
-	      if (s->fd > hi)
-		hi = s->fd;
-	    }
-	  else
-	    FD_CLR(s->fd, &rd);
-	  if (s->tx_hook && s->ttx != s->tpos)
+	  btime pdelta = ptout - precise_time();
+	  if (pdelta < (btime) timo.tv_sec S)
 	    {
-	      FD_SET(s->fd, &wr);
-	      if (s->fd > hi)
-		hi = s->fd;
+	      timo.tv_sec = pdelta TO_S;
+	      timo.tv_usec = pdelta % (1 S);
 	    }
-	  else
-	    FD_CLR(s->fd, &wr);
 	}
 
+      io_close_event();
+
       /*
        * Yes, this is racy. But even if the signal comes before this test
-       * and entering select(), it gets caught on the next timer tick.
+       * and entering the wait, it gets caught on the next timer tick.
        */
 
       if (async_config_flag)
 	{
-	  io_log_event(async_config, NULL);
+	  io_log_event(async_config, NULL, NULL);
 	  async_config();
 	  async_config_flag = 0;
 	  continue;
 	}
       if (async_dump_flag)
 	{
-	  io_log_event(async_dump, NULL);
+	  io_log_event(async_dump, NULL, NULL);
 	  async_dump();
 	  async_dump_flag = 0;
 	  continue;
 	}
       if (async_shutdown_flag)
 	{
-	  io_log_event(async_shutdown, NULL);
+	  io_log_event(async_shutdown, NULL, NULL);
 	  async_shutdown();
 	  async_shutdown_flag = 0;
 	  continue;
 	}
 
-      /* And finally enter select() to find active sockets */
-      watchdog_stop();
-      hi = select(hi+1, &rd, &wr, NULL, &timo);
-      watchdog_start();
-
-      if (hi < 0)
-	{
-	  if (errno == EINTR || errno == EAGAIN)
-	    continue;
-	  die("select: %m");
-	}
-      if (hi)
-	{
-	  /* guaranteed to be non-empty */
-	  current_sock = SKIP_BACK(sock, n, HEAD(sock_list));
-
-	  while (current_sock)
-	    {
-	      sock *s = current_sock;
-	      int e;
-	      int steps;
-
-	      steps = MAX_STEPS;
-	      if ((s->type >= SK_MAGIC) && FD_ISSET(s->fd, &rd) && s->rx_hook)
-		do
-		  {
-		    steps--;
-		    io_log_event(s->rx_hook, s->data);
-		    e = sk_read(s);
-		    if (s != current_sock)
-		      goto next;
-		  }
-		while (e && s->rx_hook && steps);
-
-	      steps = MAX_STEPS;
-	      if (FD_ISSET(s->fd, &wr))
-		do
-		  {
-		    steps--;
-		    io_log_event(s->tx_hook, s->data);
-		    e = sk_write(s);
-		    if (s != current_sock)
-		      goto next;
-		  }
-		while (e && steps);
-	      current_sock = sk_next(s);
-	    next: ;
-	    }
-
-	  short_loops++;
-	  if (events && (short_loops < SHORT_LOOP_MAX))
-	    continue;
-	  short_loops = 0;
-
-	  int count = 0;
-	  current_sock = stored_sock;
-	  if (current_sock == NULL)
-	    current_sock = SKIP_BACK(sock, n, HEAD(sock_list));
-
-	  while (current_sock && count < MAX_RX_STEPS)
-	    {
-	      sock *s = current_sock;
-	      int e UNUSED;
-
-	      if ((s->type < SK_MAGIC) && FD_ISSET(s->fd, &rd) && s->rx_hook)
-		{
-		  count++;
-		  io_log_event(s->rx_hook, s->data);
-		  e = sk_read(s);
-		  if (s != current_sock)
-		      goto next2;
-		}
-	      current_sock = sk_next(s);
-	    next2: ;
-	    }
+      /* And finally wait for active sockets */
+      if (trace_replaying())
+	io_replay(&timo, events);
+      else
+      {
+	if (trace_recording() && (timo.tv_sec || timo.tv_usec))
+	  trace_flush();
 
-	  stored_sock = current_sock;
-	}
+	io_poll(&timo, events);
+      }
     }
 }
 
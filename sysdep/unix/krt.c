@@ -27,9 +27,20 @@
  * In this case, we keep only a single scan timer.
  *
  * We use FIB node flags in the routing table to keep track of route
- * synchronization status. We also attach temporary &rte's to the routing table,
- * but it cannot do any harm to the rest of BIRD since table synchronization is
- * an atomic process.
+ * synchronization status. Kernel routes which are to be updated or deleted are
+ * kept in a per-protocol hash until the table is pruned.
+ *
+ * Except for the first scan of a protocol, tables are pruned in steps by a work
+ * event. With incremental scan, the back end passes changes of our routes in the
+ * kernel learned from async notifications and also the rare periodic reading of
+ * kernel tables is done in steps. Nets changed by BIRD during a running scan
+ * are ignored by it.
+ *
+ * Optionally, routes are aggregated before installing. A route is then not
+ * installed when the nearest covering network in the table has an exported
+ * route with the same forwarding. Nets of exported routes are marked by
+ * %KRF_EXPORTED and just the installed subset by %KRF_INSTALLED, therefore scans
+ * work with aggregation without changes.
  *
  * When starting up, we cheat by looking if there is another
  * KRT instance to be initialized later and performing table scan
@@ -57,6 +68,8 @@
 #include "nest/protocol.h"
 #include "filter/filter.h"
 #include "lib/timer.h"
+#include "lib/event.h"
+#include "lib/probe.h"
 #include "conf/conf.h"
 #include "lib/string.h"
 
@@ -297,14 +310,14 @@ static inline void
 krt_trace_in(struct krt_proto *p, rte *e, char *msg)
 {
   if (p->p.debug & D_PACKETS)
-    log(L_TRACE "%s: %I/%d: %s", p->p.name, e->net->n.prefix, e->net->n.pxlen, msg);
+    log(L_TRACE "%s: %N: %s", p->p.name, e->net->n.prefix, e->net->n.pxlen, msg);
 }
 
 static inline void
 krt_trace_in_rl(struct tbf *f, struct krt_proto *p, rte *e, char *msg)
 {
   if (p->p.debug & D_PACKETS)
-    log_rl(f, L_TRACE "%s: %I/%d: %s", p->p.name, e->net->n.prefix, e->net->n.pxlen, msg);
+    log_rl(f, L_TRACE "%s: %N: %s", p->p.name, e->net->n.prefix, e->net->n.pxlen, msg);
 }
 
 /*
@@ -341,8 +354,9 @@ krt_uptodate(rte *a, rte *b)
   return 1;
 }
 
+/* Learned routes are announced through batch @b, or directly if @b is NULL */
 static void
-krt_learn_announce_update(struct krt_proto *p, rte *e)
+krt_learn_announce_update(struct krt_proto *p, struct rte_batch *b, rte *e)
 {
   net *n = e->net;
   rta *aa = rta_clone(e->attrs);
@@ -352,14 +366,20 @@ krt_learn_announce_update(struct krt_proto *p, rte *e)
   ee->pflags = 0;
   ee->pref = p->p.preference;
   ee->u.krt = e->u.krt;
-  rte_update(&p->p, nn, ee);
+  if (b)
+    rte_batch_update(b, nn, ee, p->p.main_source);
+  else
+    rte_update(&p->p, nn, ee);
 }
 
 static void
-krt_learn_announce_delete(struct krt_proto *p, net *n)
+krt_learn_announce_delete(struct krt_proto *p, struct rte_batch *b, net *n)
 {
   n = net_find(p->p.table, n->n.prefix, n->n.pxlen);
-  rte_update(&p->p, n, NULL);
+  if (b)
+    rte_batch_update(b, n, NULL, p->p.main_source);
+  else
+    rte_update(&p->p, n, NULL);
 }
 
 /* Called when alien route is discovered during scan */
@@ -406,9 +426,11 @@ krt_learn_prune(struct krt_proto *p)
 {
   struct fib *fib = &p->krt_table.fib;
   struct fib_iterator fit;
+  struct rte_batch batch;
 
   KRT_TRACE(p, D_EVENTS, "Pruning inherited routes");
 
+  rte_batch_start(&batch, p->p.main_ahook);
   FIB_ITERATE_INIT(&fit, fib);
 again:
   FIB_ITERATE_START(fib, &fit, f)
@@ -441,7 +463,7 @@ again:
 	  DBG("%I/%d: deleting\n", n->n.prefix, n->n.pxlen);
 	  if (old_best)
 	    {
-	      krt_learn_announce_delete(p, n);
+	      krt_learn_announce_delete(p, &batch, n);
 	      n->n.flags &= ~KRF_INSTALLED;
 	    }
 	  FIB_ITERATE_PUT(&fit, f);
@@ -454,13 +476,14 @@ again:
       if (best != old_best || !(n->n.flags & KRF_INSTALLED) || p->reload)
 	{
 	  DBG("%I/%d: announcing (metric=%d)\n", n->n.prefix, n->n.pxlen, best->u.krt.metric);
-	  krt_learn_announce_update(p, best);
+	  krt_learn_announce_update(p, &batch, best);
 	  n->n.flags |= KRF_INSTALLED;
 	}
       else
 	DBG("%I/%d: uptodate (metric=%d)\n", n->n.prefix, n->n.pxlen, best->u.krt.metric);
     }
   FIB_ITERATE_END(f);
+  rte_batch_end(&batch);
 
   p->reload = 0;
 }
@@ -495,6 +518,10 @@ krt_learn_async(struct krt_proto *p, rte *e, int new)
       else
 	krt_trace_in(p, e, "[alien async] created");
 
+      /* Running stepped scan may have already passed the route */
+      if (p->scanning)
+	e->u.krt.seen = 1;
+
       e->next = n->routes;
       n->routes = e;
     }
@@ -530,13 +557,13 @@ krt_learn_async(struct krt_proto *p, rte *e, int new)
       DBG("krt_learn_async: distributing change\n");
       if (best)
 	{
-	  krt_learn_announce_update(p, best);
+	  krt_learn_announce_update(p, NULL, best);
 	  n->n.flags |= KRF_INSTALLED;
 	}
       else
 	{
 	  n->routes = NULL;
-	  krt_learn_announce_delete(p, n);
+	  krt_learn_announce_delete(p, NULL, n);
 	  n->n.flags &= ~KRF_INSTALLED;
 	}
     }
@@ -635,10 +662,8 @@ reject:
 }
 
 static int
-krt_same_dest(rte *k, rte *e)
+krt_same_fwd(rta *ka, rta *ea)
 {
-  rta *ka = k->attrs, *ea = e->attrs;
-
   if (ka->dest != ea->dest)
     return 0;
   switch (ka->dest)
@@ -654,6 +679,29 @@ krt_same_dest(rte *k, rte *e)
     }
 }
 
+static inline int
+krt_same_dest(rte *k, rte *e)
+{
+  return krt_same_fwd(k->attrs, e->attrs);
+}
+
+/*
+ *  Kernel routes to be updated or deleted are kept in scan_nets hash of the
+ *  protocol until the table is pruned. They are keyed by prefix, as the net
+ *  itself may be removed from the table during stepped scan.
+ */
+
+#define KSN_KEY(n)		n->prefix, n->pxlen
+#define KSN_NEXT(n)		n->next
+#define KSN_EQ(a1,l1,a2,l2)	ipa_equal(a1, a2) && l1 == l2
+#define KSN_FN(a,l)		(ipa_hash32(a) ^ l)
+#define KSN_ORDER		6
+
+#define KSN_REHASH		krt_scan_rehash
+#define KSN_PARAMS		/8, *2, 2, 2, 6, 20
+
+HASH_DEFINE_REHASH_FN(KSN, struct krt_scan_net)
+
 /*
  *  This gets called back when the low-level scanning code discovers a route.
  *  We expect that the route is a temporary rte and its attributes are uncached.
@@ -665,6 +713,13 @@ krt_got_route(struct krt_proto *p, rte *e)
   net *net = e->net;
   int verdict;
 
+  if (!p->scanning)
+    {
+      /* Protocol started during running scan */
+      rte_free(e);
+      return;
+    }
+
 #ifdef KRT_ALLOW_LEARN
   switch (e->u.krt.src)
     {
@@ -733,85 +788,141 @@ krt_got_route(struct krt_proto *p, rte *e)
   net->n.flags = (net->n.flags & ~KRF_VERDICT_MASK) | verdict;
   if (verdict == KRF_UPDATE || verdict == KRF_DELETE)
     {
-      /* Get a cached copy of attributes and temporarily link the route */
+      /* Get a cached copy of attributes and keep the route for krt_prune_net() */
+      struct krt_scan_net *s = sl_alloc(p->scan_slab);
       rta *a = e->attrs;
       a->source = RTS_DUMMY;
       e->attrs = rta_lookup(a);
-      e->next = net->routes;
-      net->routes = e;
+      s->prefix = net->n.prefix;
+      s->pxlen = net->n.pxlen;
+      s->old = e;
+      HASH_INSERT2(p->scan_nets, KSN, p->p.pool, s);
     }
   else
     rte_free(e);
 }
 
+static rte *
+krt_scan_take(struct krt_proto *p, ip_addr prefix, uint pxlen)
+{
+  struct krt_scan_net *s = HASH_FIND(p->scan_nets, KSN, prefix, pxlen);
+  rte *old;
+
+  if (!s)
+    return NULL;
+
+  old = s->old;
+  HASH_REMOVE2(p->scan_nets, KSN, p->p.pool, s);
+  sl_free(p->scan_slab, s);
+  return old;
+}
+
+/*
+ * Route in @n was changed by BIRD while the scan is running, so the verdict
+ * based on the scanned kernel route may be stale. The change itself is already
+ * passed to the kernel, therefore the network is just ignored by the scan. Nets
+ * not yet seen in the scan are marked only in the reading phase, as they may
+ * already be pruned later.
+ */
 static void
-krt_prune(struct krt_proto *p)
+krt_scan_touch(struct krt_proto *p, net *n)
 {
-  struct rtable *t = p->p.table;
+  int verdict = n->n.flags & KRF_VERDICT_MASK;
 
-  KRT_TRACE(p, D_EVENTS, "Pruning table %s", t->name);
-  FIB_WALK(&t->fib, f)
+  if (verdict == KRF_UPDATE || verdict == KRF_DELETE)
+    rte_free(krt_scan_take(p, n->n.prefix, n->n.pxlen));
+  else if (p->scanning != 1)
+    return;
+
+  n->n.flags = (n->n.flags & ~KRF_VERDICT_MASK) | KRF_IGNORE;
+}
+
+static void
+krt_prune_net(struct krt_proto *p, net *n)
+{
+  struct fib_node *f = &n->n;
+  int verdict = f->flags & KRF_VERDICT_MASK;
+  rte *new, *old, *rt_free = NULL;
+  ea_list *tmpa = NULL;
+
+  if (verdict == KRF_UPDATE || verdict == KRF_DELETE)
     {
-      net *n = (net *) f;
-      int verdict = f->flags & KRF_VERDICT_MASK;
-      rte *new, *old, *rt_free = NULL;
-      ea_list *tmpa = NULL;
+      /* Get a dummy route from krt_got_route() */
+      old = krt_scan_take(p, f->prefix, f->pxlen);
+      ASSERT(old);
+      old->net = n;
+    }
+  else
+    old = NULL;
 
-      if (verdict == KRF_UPDATE || verdict == KRF_DELETE)
-	{
-	  /* Get a dummy route from krt_got_route() */
-	  old = n->routes;
-	  n->routes = old->next;
-	}
+  if (verdict == KRF_CREATE || verdict == KRF_UPDATE)
+    {
+      /* We have to run export filter to get proper 'new' route */
+      new = krt_export_net(p, n, &rt_free, &tmpa);
+
+      if (!new)
+	verdict = (verdict == KRF_CREATE) ? KRF_IGNORE : KRF_DELETE;
       else
-	old = NULL;
+	tmpa = ea_append(tmpa, new->attrs->eattrs);
+    }
+  else
+    new = NULL;
 
-      if (verdict == KRF_CREATE || verdict == KRF_UPDATE)
+  switch (verdict)
+    {
+    case KRF_CREATE:
+      if (new && (f->flags & KRF_INSTALLED))
 	{
-	  /* We have to run export filter to get proper 'new' route */
-	  new = krt_export_net(p, n, &rt_free, &tmpa);
-
-	  if (!new)
-	    verdict = (verdict == KRF_CREATE) ? KRF_IGNORE : KRF_DELETE;
-	  else
-	    tmpa = ea_append(tmpa, new->attrs->eattrs);
+	  krt_trace_in(p, new, "reinstalling");
+	  krt_replace_rte(p, n, new, NULL, tmpa);
 	}
-      else
-	new = NULL;
+      break;
+    case KRF_SEEN:
+    case KRF_IGNORE:
+      /* Nothing happens */
+      break;
+    case KRF_UPDATE:
+      krt_trace_in(p, new, "updating");
+      krt_replace_rte(p, n, new, old, tmpa);
+      break;
+    case KRF_DELETE:
+      krt_trace_in(p, old, "deleting");
+      krt_replace_rte(p, n, NULL, old, NULL);
+      break;
+    default:
+      bug("krt_prune: invalid route status");
+    }
 
-      switch (verdict)
+  if (old)
+    rte_free(old);
+  if (rt_free)
+    rte_free(rt_free);
+  lp_flush(krt_filter_lp);
+  f->flags &= ~KRF_VERDICT_MASK;
+}
+
+static void
+krt_prune_finish(struct krt_proto *p)
+{
+  /* Nets of remaining routes were removed from the table during stepped scan */
+  HASH_WALK_DELSAFE(p->scan_nets, next, s)
+    {
+      net *n = net_get(p->p.table, s->prefix, s->pxlen);
+      rte *old = s->old;
+
+      old->net = n;
+      if (!(n->n.flags & KRF_INSTALLED))
 	{
-	case KRF_CREATE:
-	  if (new && (f->flags & KRF_INSTALLED))
-	    {
-	      krt_trace_in(p, new, "reinstalling");
-	      krt_replace_rte(p, n, new, NULL, tmpa);
-	    }
-	  break;
-	case KRF_SEEN:
-	case KRF_IGNORE:
-	  /* Nothing happens */
-	  break;
-	case KRF_UPDATE:
-	  krt_trace_in(p, new, "updating");
-	  krt_replace_rte(p, n, new, old, tmpa);
-	  break;
-	case KRF_DELETE:
 	  krt_trace_in(p, old, "deleting");
 	  krt_replace_rte(p, n, NULL, old, NULL);
-	  break;
-	default:
-	  bug("krt_prune: invalid route status");
 	}
+      rte_free(old);
 
-      if (old)
-	rte_free(old);
-      if (rt_free)
-	rte_free(rt_free);
-      lp_flush(krt_filter_lp);
-      f->flags &= ~KRF_VERDICT_MASK;
+      HASH_REMOVE(p->scan_nets, KSN, s);
+      sl_free(p->scan_slab, s);
     }
-  FIB_WALK_END;
+  HASH_WALK_DELSAFE_END;
+  HASH_MAY_RESIZE_DOWN(p->scan_nets, KSN, p->p.pool);
 
 #ifdef KRT_ALLOW_LEARN
   if (KRT_CF->learn)
@@ -820,6 +931,83 @@ krt_prune(struct krt_proto *p)
 
   if (p->ready)
     p->initialized = 1;
+
+  p->scanning = 0;
+}
+
+static void
+krt_prune(struct krt_proto *p)
+{
+  struct rtable *t = p->p.table;
+
+  KRT_TRACE(p, D_EVENTS, "Pruning table %s", t->name);
+  PROBE2(krt_prune_entry, p->p.name, t->fib.entries);
+
+  FIB_WALK(&t->fib, f)
+    krt_prune_net(p, (net *) f);
+  FIB_WALK_END;
+
+  krt_prune_finish(p);
+  PROBE1(krt_prune_return, p->p.name);
+}
+
+/* Prune at most @limit nets of the table, returns 1 when finished */
+static int
+krt_prune_step(struct krt_proto *p, int limit)
+{
+  struct fib *fib = &p->p.table->fib;
+
+  if (p->scanning == 1)
+    {
+      KRT_TRACE(p, D_EVENTS, "Pruning table %s", p->p.table->name);
+      FIB_ITERATE_INIT(&p->scan_fit, fib);
+      p->scanning = 2;
+    }
+
+  FIB_ITERATE_START(fib, &p->scan_fit, f)
+    {
+      if (limit-- <= 0)
+	{
+	  FIB_ITERATE_PUT(&p->scan_fit, f);
+	  return 0;
+	}
+
+      krt_prune_net(p, (net *) f);
+    }
+  FIB_ITERATE_END(f);
+
+  krt_prune_finish(p);
+  return 1;
+}
+
+static void
+krt_clear_flags(struct fib_node *f, void *data, uint job UNUSED)
+{
+  f->flags &= ~*(byte *) data;
+}
+
+/* Protocol is going down during a scan */
+static void
+krt_scan_abort(struct krt_proto *p)
+{
+  if (!p->scanning)
+    return;
+
+  if (p->scanning == 2)
+    fit_get(&p->p.table->fib, &p->scan_fit);
+
+  HASH_WALK_DELSAFE(p->scan_nets, next, s)
+    {
+      rte_free(s->old);
+      HASH_REMOVE(p->scan_nets, KSN, s);
+      sl_free(p->scan_slab, s);
+    }
+  HASH_WALK_DELSAFE_END;
+
+  byte mask = KRF_VERDICT_MASK;
+  fib_walk_parallel(&p->p.table->fib, rt_workers, krt_clear_flags, &mask);
+
+  p->scanning = 0;
 }
 
 void
@@ -830,7 +1018,42 @@ krt_got_route_async(struct krt_proto *p, rte *e, int new)
   switch (e->u.krt.src)
     {
     case KRT_SRC_BIRD:
-      ASSERT(0);			/* Should be filtered by the back end */
+      /* Passed by the back end only in incremental mode, when our route changed */
+      if (!p->initialized)
+	break;
+
+      if (p->scanning)
+	krt_scan_touch(p, net);
+
+      if (net->n.flags & KRF_INSTALLED)
+	{
+	  rte *rt, *rt_free;
+	  ea_list *tmpa;
+
+	  rt = krt_export_net(p, net, &rt_free, &tmpa);
+
+	  if (!rt && new)
+	    {
+	      krt_trace_in(p, e, "deleting");
+	      krt_replace_rte(p, net, NULL, e, NULL);
+	    }
+	  else if (rt && (!new || !krt_same_dest(e, rt)))
+	    {
+	      krt_trace_in(p, rt, new ? "updating" : "reinstalling");
+	      krt_replace_rte(p, net, rt, new ? e : NULL, ea_append(tmpa, rt->attrs->eattrs));
+	    }
+
+	  if (rt_free)
+	    rte_free(rt_free);
+
+	  lp_flush(krt_filter_lp);
+	}
+      else if (new)
+	{
+	  krt_trace_in(p, e, "deleting");
+	  krt_replace_rte(p, net, NULL, e, NULL);
+	}
+      break;
 
     case KRT_SRC_REDIRECT:
       if (new)
@@ -858,15 +1081,98 @@ krt_got_route_async(struct krt_proto *p, rte *e, int new)
  */
 
 
+/*
+ * Scanned tables of initialized protocols are pruned in steps by a work event,
+ * so large tables do not block the main loop and kernel updates are written in
+ * the meantime. Routes changed by BIRD during pruning are marked by
+ * krt_scan_touch(). Protocols waiting for their first scan do not pass route
+ * changes to the kernel yet, so they are pruned at once.
+ */
+
+#define KRT_SCAN_STEP	1000		/* Routes read or nets pruned in one step */
+
 #ifdef CONFIG_ALL_TABLES_AT_ONCE
 
 static timer *krt_scan_timer;
 static int krt_scan_count;
+static event *krt_scan_event;		/* Runs stepped scan */
+static int krt_scan_phase;		/* 1 reading kernel tables, 2 pruning */
+static int krt_scan_again;		/* Scan requested while running */
+
+/*
+ * With incremental scan, changes of kernel tables are followed by async
+ * notifications and the periodic scan is just a consistency check, so even
+ * the kernel tables are read in steps.
+ */
+
+static void
+krt_scan_step(void *data UNUSED)
+{
+  struct krt_proto *p;
+  void *q;
+
+#ifdef CONFIG_KRT_INCREMENTAL
+  if (krt_scan_phase == 1)
+  {
+    if (krt_sys_scan_step(KRT_SCAN_STEP))
+    {
+      ev_schedule_work(krt_scan_event);
+      return;
+    }
+
+    krt_scan_phase = 2;
+  }
+#endif
+
+  WALK_LIST(q, krt_proto_list)
+  {
+    p = SKIP_BACK(struct krt_proto, krt_node, q);
+    if (p->scanning && !krt_prune_step(p, KRT_SCAN_STEP))
+    {
+      ev_schedule_work(krt_scan_event);
+      return;
+    }
+  }
+
+  krt_scan_phase = 0;
+
+  if (krt_scan_again && krt_scan_timer)
+    tm_start(krt_scan_timer, 0);
+  krt_scan_again = 0;
+}
+
+#ifdef CONFIG_KRT_INCREMENTAL
+
+/* The first scan of a protocol is always done at once, see krt_rt_notify() */
+static int
+krt_scan_incremental(void)
+{
+  struct krt_proto *p;
+  void *q;
+  int incremental = 0;
+
+  WALK_LIST(q, krt_proto_list)
+  {
+    p = SKIP_BACK(struct krt_proto, krt_node, q);
+    if (!p->initialized)
+      return 0;
+
+    incremental |= KRT_CF->incremental;
+  }
+
+  return incremental;
+}
+
+#endif
 
 static void
 krt_scan(timer *t UNUSED)
 {
   struct krt_proto *p;
+  void *q;
+
+  if (krt_scan_phase)
+    return;
 
   kif_force_scan();
 
@@ -874,14 +1180,30 @@ krt_scan(timer *t UNUSED)
   p = SKIP_BACK(struct krt_proto, krt_node, HEAD(krt_proto_list));
   KRT_TRACE(p, D_EVENTS, "Scanning routing table");
 
+  WALK_LIST(q, krt_proto_list)
+    SKIP_BACK(struct krt_proto, krt_node, q)->scanning = 1;
+
+#ifdef CONFIG_KRT_INCREMENTAL
+  if (krt_scan_incremental())
+  {
+    krt_sys_scan_start();
+    krt_scan_phase = 1;
+    ev_schedule_work(krt_scan_event);
+    return;
+  }
+#endif
+
   krt_do_scan(NULL);
 
-  void *q;
   WALK_LIST(q, krt_proto_list)
   {
     p = SKIP_BACK(struct krt_proto, krt_node, q);
-    krt_prune(p);
+    if (!p->initialized)
+      krt_prune(p);
   }
+
+  krt_scan_phase = 2;
+  krt_scan_step(NULL);
 }
 
 static void
@@ -890,6 +1212,12 @@ krt_scan_timer_start(struct krt_proto *p)
   if (!krt_scan_count)
     krt_scan_timer = tm_new_set(krt_pool, krt_scan, NULL, 0, KRT_CF->scan_time);
 
+  if (!krt_scan_event)
+  {
+    krt_scan_event = ev_new(krt_pool);
+    krt_scan_event->hook = krt_scan_step;
+  }
+
   krt_scan_count++;
 
   tm_start(krt_scan_timer, 1);
@@ -910,27 +1238,60 @@ krt_scan_timer_stop(struct krt_proto *p)
 static void
 krt_scan_timer_kick(struct krt_proto *p UNUSED)
 {
+  if (krt_scan_phase)
+  {
+    krt_scan_again = 1;
+    return;
+  }
+
   tm_start(krt_scan_timer, 0);
 }
 
 #else
 
+static void
+krt_scan_step(void *data)
+{
+  struct krt_proto *p = data;
+
+  if (!krt_prune_step(p, KRT_SCAN_STEP))
+  {
+    ev_schedule_work(p->scan_event);
+    return;
+  }
+
+  if (p->scan_again)
+    tm_start(p->scan_timer, 0);
+  p->scan_again = 0;
+}
+
 static void
 krt_scan(timer *t)
 {
   struct krt_proto *p = t->data;
 
+  if (p->scanning)
+    return;
+
   kif_force_scan();
 
   KRT_TRACE(p, D_EVENTS, "Scanning routing table");
+  p->scanning = 1;
   krt_do_scan(p);
-  krt_prune(p);
+
+  if (p->initialized)
+    krt_scan_step(p);
+  else
+    krt_prune(p);
 }
 
 static void
 krt_scan_timer_start(struct krt_proto *p)
 {
   p->scan_timer = tm_new_set(p->p.pool, krt_scan, p, 0, KRT_CF->scan_time);
+  p->scan_event = ev_new(p->p.pool);
+  p->scan_event->hook = krt_scan_step;
+  p->scan_event->data = p;
   tm_start(p->scan_timer, 1);
 }
 
@@ -938,16 +1299,36 @@ static void
 krt_scan_timer_stop(struct krt_proto *p)
 {
   tm_stop(p->scan_timer);
+  ev_postpone(p->scan_event);
+  p->scan_again = 0;
 }
 
 static void
 krt_scan_timer_kick(struct krt_proto *p)
 {
+  if (p->scanning)
+  {
+    p->scan_again = 1;
+    return;
+  }
+
   tm_start(p->scan_timer, 0);
 }
 
 #endif
 
+/**
+ * krt_request_scan - schedule a kernel table scan
+ * @p: kernel protocol
+ *
+ * The sysdep code calls this when it may have missed some changes, e.g.
+ * when the kernel dropped async notifications.
+ */
+void
+krt_request_scan(struct krt_proto *p)
+{
+  krt_scan_timer_kick(p);
+}
 
 
 
@@ -1020,21 +1401,142 @@ krt_import_control(struct proto *P, rte **new, ea_list **attrs, struct linpool *
 }
 
 static void
-krt_rt_notify(struct proto *P, struct rtable *table UNUSED, net *net,
-	      rte *new, rte *old, struct ea_list *eattrs)
+krt_update_net(struct krt_proto *p, net *net, rte *new, rte *old, struct ea_list *eattrs)
 {
-  struct krt_proto *p = (struct krt_proto *) P;
-
-  if (config->shutdown)
-    return;
   if (!(net->n.flags & KRF_INSTALLED))
     old = NULL;
   if (new)
     net->n.flags |= KRF_INSTALLED;
   else
     net->n.flags &= ~KRF_INSTALLED;
-  if (p->initialized)		/* Before first scan we don't touch the routes */
+  if (p->initialized && (new || old))	/* Before first scan we don't touch the routes */
+  {
+    if (p->scanning)
+      krt_scan_touch(p, net);
     krt_replace_rte(p, net, new, old, eattrs);
+  }
+}
+
+/*
+ *  FIB aggregation
+ *
+ *  A route is suppressed when the nearest covering net with a route in the table
+ *  has an exported route with the same forwarding, as the kernel would use that
+ *  one instead (level-1 aggregation). Covering nets with routes rejected by the
+ *  export filter (e.g. learned kernel routes) just stop the aggregation, as the
+ *  kernel may have a different route for them. When forwarding of a net
+ *  changes, nets directly below it in the table trie are reconsidered.
+ */
+
+static int
+krt_agg_covering(struct fib_node *f)
+{
+  return (f->flags & KRF_EXPORTED) || rte_is_valid(((net *) f)->routes);
+}
+
+/* Find forwarding of the route covering @n, only fields used by krt_same_fwd() are valid */
+static int
+krt_agg_parent(struct krt_proto *p, net *n, rta *a)
+{
+  net *c;
+  rte *rt, *rt_free;
+  ea_list *tmpa;
+
+  if (!n->n.pxlen)
+    return 0;
+
+  c = fib_route_valid(&p->p.table->fib, n->n.prefix, n->n.pxlen - 1, krt_agg_covering);
+  if (!c || !(c->n.flags & KRF_EXPORTED))
+    return 0;
+
+  rt = krt_export_net(p, c, &rt_free, &tmpa);
+  if (rt)
+    *a = *rt->attrs;
+
+  if (rt_free)
+    rte_free(rt_free);
+  lp_flush(krt_filter_lp);
+
+  return !!rt;
+}
+
+struct krt_agg_walk {
+  struct krt_proto *p;
+  rta *parent;			/* Forwarding of the covering route, or NULL */
+};
+
+static int
+krt_agg_below(struct fib_node *f, void *data)
+{
+  struct krt_agg_walk *w = data;
+  struct krt_proto *p = w->p;
+  net *n = (net *) f;
+  rte *rt, *rt_free;
+  ea_list *tmpa;
+
+  if (!krt_agg_covering(f))
+    return 0;
+
+  if (!(f->flags & KRF_EXPORTED))
+    return 1;
+
+  /* If the exported route changed meanwhile, its pending notification fixes it */
+  rt = krt_export_net(p, n, &rt_free, &tmpa);
+  if (rt)
+  {
+    int install = !w->parent || !krt_same_fwd(rt->attrs, w->parent);
+
+    if (install != !!(f->flags & KRF_INSTALLED))
+      krt_update_net(p, n, install ? rt : NULL, rt, ea_append(tmpa, rt->attrs->eattrs));
+  }
+
+  if (rt_free)
+    rte_free(rt_free);
+  lp_flush(krt_filter_lp);
+
+  return 1;
+}
+
+static void
+krt_agg_notify(struct krt_proto *p, net *net, rte *new, rte *old, struct ea_list *eattrs)
+{
+  rta pa;
+  int parent = krt_agg_parent(p, net, &pa);
+
+  if (new)
+    net->n.flags |= KRF_EXPORTED;
+  else
+    net->n.flags &= ~KRF_EXPORTED;
+
+  if (new && parent && krt_same_fwd(new->attrs, &pa))
+    krt_update_net(p, net, NULL, old, NULL);
+  else
+    krt_update_net(p, net, new, old, eattrs);
+
+  if (new && old && krt_same_dest(new, old))
+    return;
+
+  /* Without exported route, the net may still cover nets below */
+  struct krt_agg_walk w = { p, new ? new->attrs : NULL };
+  if (!new && !rte_is_valid(net->routes) && parent)
+    w.parent = &pa;
+
+  fib_walk_below(&p->p.table->fib, net->n.prefix, net->n.pxlen, krt_agg_below, &w);
+}
+
+static void
+krt_rt_notify(struct proto *P, struct rtable *table UNUSED, net *net,
+	      rte *new, rte *old, struct ea_list *eattrs)
+{
+  struct krt_proto *p = (struct krt_proto *) P;
+
+  if (config->shutdown)
+    return;
+
+  if (KRT_CF->aggregate)
+    krt_agg_notify(p, net, new, old, eattrs);
+  else
+    krt_update_net(p, net, new, old, eattrs);
 }
 
 static void
@@ -1122,10 +1624,16 @@ krt_start(struct proto *P)
 
   add_tail(&krt_proto_list, &p->krt_node);
 
+  HASH_INIT(p->scan_nets, P->pool, KSN_ORDER);
+  p->scan_slab = sl_new(P->pool, sizeof(struct krt_scan_net));
+
 #ifdef KRT_ALLOW_LEARN
   krt_learn_init(p);
 #endif
 
+  if (KRT_CF->aggregate)
+    fib_enable_trie(&P->table->fib);
+
   krt_sys_start(p);
 
   krt_scan_timer_start(p);
@@ -1142,11 +1650,18 @@ krt_shutdown(struct proto *P)
   struct krt_proto *p = (struct krt_proto *) P;
 
   krt_scan_timer_stop(p);
+  krt_scan_abort(p);
 
   /* FIXME we should flush routes even when persist during reconfiguration */
   if (p->initialized && !KRT_CF->persist)
     krt_flush_routes(p);
 
+  if (KRT_CF->aggregate)
+  {
+    byte mask = KRF_EXPORTED;
+    fib_walk_parallel(&p->p.table->fib, rt_workers, krt_clear_flags, &mask);
+  }
+
   p->ready = 0;
   p->initialized = 0;
 
@@ -1168,7 +1683,8 @@ krt_reconfigure(struct proto *p, struct proto_config *new)
 
   /* persist, graceful restart need not be the same */
   return o->scan_time == n->scan_time && o->learn == n->learn &&
-    o->devroutes == n->devroutes && o->merge_paths == n->merge_paths;
+    o->devroutes == n->devroutes && o->merge_paths == n->merge_paths &&
+    o->incremental == n->incremental && o->aggregate == n->aggregate;
 }
 
 static void
@@ -16,15 +16,18 @@ struct kif_config;
 struct kif_proto;
 
 #include "lib/krt-sys.h"
+#include "lib/hash.h"
+#include "lib/event.h"
 
 /* Flags stored in net->n.flags, rest are in nest/route.h */
 
-#define KRF_VERDICT_MASK 0x0f
+#define KRF_VERDICT_MASK 0x07
 #define KRF_CREATE 0			/* Not seen in kernel table */
 #define KRF_SEEN 1			/* Seen in kernel table during last scan */
 #define KRF_UPDATE 2			/* Need to update this entry */
 #define KRF_DELETE 3			/* Should be deleted */
 #define KRF_IGNORE 4			/* To be ignored */
+#define KRF_EXPORTED 0x08		/* Route is exported to us, used by aggregation */
 
 #define KRT_DEFAULT_ECMP_LIMIT	16
 
@@ -50,6 +53,15 @@ struct krt_config {
   int devroutes;		/* Allow export of device routes */
   int graceful_restart;		/* Regard graceful restart recovery */
   int merge_paths;		/* Exported routes are merged for ECMP */
+  int incremental;		/* Follow kernel notifications, scan in steps */
+  int aggregate;		/* Do not install routes covered by the same forwarding */
+};
+
+struct krt_scan_net {
+  struct krt_scan_net *next;	/* Next in scan_nets hash chain */
+  ip_addr prefix;
+  uint pxlen;
+  rte *old;			/* Kernel route to be updated or deleted */
 };
 
 struct krt_proto {
@@ -62,9 +74,16 @@ struct krt_proto {
 
 #ifndef CONFIG_ALL_TABLES_AT_ONCE
   timer *scan_timer;
+  event *scan_event;		/* Runs stepped pruning */
+  byte scan_again;		/* Scan requested while running */
 #endif
 
+  HASH(struct krt_scan_net) scan_nets;	/* Kernel routes with KRF_UPDATE or KRF_DELETE verdict */
+  slab *scan_slab;
+  struct fib_iterator scan_fit;	/* Position of stepped pruning */
+
   node krt_node;		/* Node in krt_proto_list */
+  byte scanning;		/* Scan is running, 2 if pruning by scan_fit */
   byte ready;			/* Initial feed has been finished */
   byte initialized;		/* First scan has been finished */
   byte reload;			/* Next scan is doing reload */
@@ -83,6 +102,7 @@ struct proto_config * kif_init_config(int class);
 void kif_request_scan(void);
 void krt_got_route(struct krt_proto *p, struct rte *e);
 void krt_got_route_async(struct krt_proto *p, struct rte *e, int new);
+void krt_request_scan(struct krt_proto *p);
 
 /* Values for rte->u.krt_sync.src */
 #define KRT_SRC_UNKNOWN	-1	/* Nobody knows */
@@ -131,6 +151,8 @@ void krt_sys_copy_config(struct krt_config *, struct krt_config *);
 
 int  krt_capable(rte *e);
 void krt_do_scan(struct krt_proto *);
+void krt_sys_scan_start(void);
+int krt_sys_scan_step(uint max);
 void krt_replace_rte(struct krt_proto *p, net *n, rte *new, rte *old, struct ea_list *eattrs);
 int krt_sys_get_attr(eattr *a, byte *buf, int buflen);
 
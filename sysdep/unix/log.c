@@ -13,6 +13,15 @@
  * messages to system logs and to the debug output. Message classes
  * used by this module are described in |birdlib.h| and also in the
  * user's manual.
+ *
+ * With POSIX threads, messages are written to log files and syslog by a
+ * dedicated writer thread started by log_start_writer(). log_commit() just
+ * formats the message, puts it to a lock-free ring buffer and wakes up the
+ * writer if it sleeps, so a slow disk never stalls the main loop. The writer
+ * drains the ring in batches and flushes files once per batch. When the ring
+ * is full, messages are dropped and counted, and the writer reports the count
+ * later. Fatal errors and bugs are written synchronously after the ring is
+ * drained, as the process ends right after them.
  */
 
 #include <stdio.h>
@@ -27,6 +36,7 @@
 #include "lib/string.h"
 #include "lib/lists.h"
 #include "lib/unix.h"
+#include "lib/worker.h"
 
 static FILE *dbgf;
 static list *current_log_list;
@@ -45,6 +55,8 @@ static pthread_t main_thread;
 void main_thread_init(void) { main_thread = pthread_self(); }
 static int main_thread_self(void) { return pthread_equal(pthread_self(), main_thread); }
 
+#define LOG_TLS __thread
+
 #else
 
 static inline void log_lock(void) {  }
@@ -52,6 +64,8 @@ static inline void log_unlock(void) {  }
 void main_thread_init(void) { }
 static int main_thread_self(void) { return 1; }
 
+#define LOG_TLS
+
 #endif
 
 
@@ -86,6 +100,266 @@ static char *class_names[] = {
 };
 
 
+/*
+ * Timestamps are formatted by the thread logging the message, so the writer
+ * does not touch the configuration. They change once per second, therefore
+ * each thread keeps the last one. The cache is also invalidated by log_switch(),
+ * as the time format may have been changed by reconfiguration.
+ */
+static uint log_time_gen;		/* Bumped by log_switch() */
+static int log_need_time;		/* Some log file needs timestamps */
+
+static const char *
+log_format_time(void)
+{
+  static LOG_TLS char tbuf[TM_DATETIME_BUFFER_SIZE];
+  static LOG_TLS bird_clock_t last_time;
+  static LOG_TLS uint last_gen;
+
+  if (!log_need_time || !config)
+    return "";
+
+  if (!tbuf[0] || (last_time != now_real) || (last_gen != log_time_gen))
+    {
+      tm_format_datetime(tbuf, &config->tf_log, now);
+      last_time = now_real;
+      last_gen = log_time_gen;
+    }
+
+  return tbuf;
+}
+
+/* Called with the log lock held */
+static void
+log_write(int class, const char *tbuf, const char *msg, int flush)
+{
+  struct log_config *l;
+
+  WALK_LIST(l, *current_log_list)
+    {
+      if (!(l->mask & (1 << class)))
+	continue;
+      if (l->fh)
+	{
+	  if (l->terminal_flag)
+	    fputs("bird: ", l->fh);
+	  else
+	    fprintf(l->fh, "%s <%s> ", tbuf, class_names[class]);
+	  fputs(msg, l->fh);
+	  fputc('\n', l->fh);
+	  if (flush)
+	    fflush(l->fh);
+	}
+#ifdef HAVE_SYSLOG
+      else
+	syslog(syslog_priorities[class], "%s", msg);
+#endif
+    }
+}
+
+
+#ifdef USE_PTHREADS
+
+/*
+ * The ring is a bounded multi-producer queue of fixed-size slots. Each slot has
+ * a sequence number telling whether it is free for the producer at position
+ * @seq, or filled for the consumer at position @seq - 1. Producers claim
+ * positions by moving the head, the writer thread is the only consumer.
+ */
+
+#define LOG_RING_ORDER	9
+#define LOG_RING_SIZE	(1 << LOG_RING_ORDER)
+
+struct log_slot {
+  u32 seq;
+  byte class;
+  char tbuf[TM_DATETIME_BUFFER_SIZE];
+  char msg[LOG_BUFFER_SIZE];
+};
+
+static struct log_slot *log_ring;	/* NULL if the writer is not running */
+static u32 log_head;			/* Next position to be claimed by a producer */
+static u32 log_tail;			/* Next position to be read by the writer */
+static u32 log_dropped;			/* Messages dropped since the last report */
+
+static pthread_t log_writer_thread;
+static pthread_mutex_t log_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_drained = PTHREAD_COND_INITIALIZER;
+static int log_writer_sleeping;	/* Writer waits for log_wakeup */
+
+static inline struct log_slot *
+log_ring_ready(void)
+{
+  struct log_slot *s = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+  return (__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) == log_tail + 1) ? s : NULL;
+}
+
+static void
+log_flush_files(void)
+{
+  struct log_config *l;
+
+  WALK_LIST(l, *current_log_list)
+    if (l->fh)
+      fflush(l->fh);
+}
+
+static void *
+log_writer_main(void *arg UNUSED)
+{
+  char tbuf[TM_DATETIME_BUFFER_SIZE] = "";
+  struct log_slot *s;
+  u32 dropped;
+
+  thread_start(THREAD_LOG);
+
+  for (;;)
+    {
+      log_lock();
+      while (s = log_ring_ready())
+	{
+	  strcpy(tbuf, s->tbuf);
+	  log_write(s->class, s->tbuf, s->msg, 0);
+	  __atomic_store_n(&s->seq, log_tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+	  __atomic_store_n(&log_tail, log_tail + 1, __ATOMIC_RELEASE);
+	}
+
+      if (dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED))
+	{
+	  char msg[64];
+	  bsprintf(msg, "... %u log messages dropped", dropped);
+	  log_write(L_WARN[0], tbuf, msg, 0);
+	}
+
+      log_flush_files();
+      log_unlock();
+
+      pthread_mutex_lock(&log_wait_mutex);
+      __atomic_store_n(&log_writer_sleeping, 1, __ATOMIC_SEQ_CST);
+      while (!log_ring_ready())
+	{
+	  pthread_cond_broadcast(&log_drained);
+	  pthread_cond_wait(&log_wakeup, &log_wait_mutex);
+	}
+      __atomic_store_n(&log_writer_sleeping, 0, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&log_wait_mutex);
+    }
+
+  return NULL;
+}
+
+/* Wait until all queued messages are written */
+static void
+log_drain(void)
+{
+  if (!log_ring)
+    return;
+
+  pthread_mutex_lock(&log_wait_mutex);
+  while ((__atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&log_head, __ATOMIC_ACQUIRE)) ||
+	 !__atomic_load_n(&log_writer_sleeping, __ATOMIC_SEQ_CST))
+    pthread_cond_wait(&log_drained, &log_wait_mutex);
+  pthread_mutex_unlock(&log_wait_mutex);
+}
+
+static int
+log_queue(int class, const char *tbuf, const char *msg)
+{
+  struct log_slot *s;
+  u32 pos;
+
+  if (!log_ring)
+    return 0;
+
+  /* The process ends right after these, so they are written directly */
+  if (class >= L_FATAL[0])
+    {
+      log_drain();
+      return 0;
+    }
+
+  pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  for (;;)
+    {
+      s = &log_ring[pos & (LOG_RING_SIZE - 1)];
+      s32 dif = (s32) (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+
+      if (dif < 0)
+	{
+	  /* The ring is full */
+	  __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+	  return 1;
+	}
+
+      if (dif > 0)
+	pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+      else if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	break;
+    }
+
+  uint len = MIN(strlen(msg), LOG_BUFFER_SIZE - 1);
+  s->class = class;
+  strcpy(s->tbuf, tbuf);
+  memcpy(s->msg, msg, len);
+  s->msg[len] = 0;
+  __atomic_store_n(&s->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+  /* The writer checks the ring after it announces sleeping, so no wakeup is lost */
+  if (__atomic_load_n(&log_writer_sleeping, __ATOMIC_SEQ_CST))
+    {
+      pthread_mutex_lock(&log_wait_mutex);
+      pthread_cond_signal(&log_wakeup);
+      pthread_mutex_unlock(&log_wait_mutex);
+    }
+
+  return 1;
+}
+
+/**
+ * log_start_writer - start the log writer thread
+ *
+ * From now on, log messages are written asynchronously by a dedicated thread.
+ * It has to be called after the daemon has forked. If the thread cannot be
+ * started, messages are still written synchronously.
+ */
+void
+log_start_writer(void)
+{
+  struct log_slot *ring;
+  uint i;
+
+  if (log_ring)
+    return;
+
+  ring = xmalloc(LOG_RING_SIZE * sizeof(struct log_slot));
+  for (i = 0; i < LOG_RING_SIZE; i++)
+    ring[i].seq = i;
+
+  log_head = log_tail = 0;
+  log_writer_sleeping = 0;
+  log_ring = ring;
+
+  int rv = pthread_create(&log_writer_thread, NULL, log_writer_main, NULL);
+  if (rv)
+    {
+      log_ring = NULL;
+      xfree(ring);
+      log(L_WARN "Cannot start log writer thread: %M", rv);
+      return;
+    }
+
+  atexit(log_drain);
+}
+
+#else
+
+static inline int log_queue(int class UNUSED, const char *tbuf UNUSED, const char *msg UNUSED) { return 0; }
+void log_start_writer(void) { }
+
+#endif
+
+
 /**
  * log_commit - commit a log message
  * @class: message class information (%L_DEBUG to %L_BUG, see |lib/birdlib.h|)
@@ -93,7 +367,8 @@ static char *class_names[] = {
  * This function writes a message prepared in the log buffer to the
  * log file (as specified in the configuration). The log buffer is
  * reset after that. The log message is a full line, log_commit()
- * terminates it.
+ * terminates it. When the log writer thread runs, the message is just
+ * queued for it.
  *
  * The message class is an integer, not a first char of a string like
  * in log(), so it should be written like *L_INFO.
@@ -101,36 +376,18 @@ static char *class_names[] = {
 void
 log_commit(int class, buffer *buf)
 {
-  struct log_config *l;
+  const char *tbuf;
 
   if (buf->pos == buf->end)
     strcpy(buf->end - 100, " ... <too long>");
 
-  log_lock();
-  WALK_LIST(l, *current_log_list)
+  tbuf = log_format_time();
+  if (!log_queue(class, tbuf, buf->start))
     {
-      if (!(l->mask & (1 << class)))
-	continue;
-      if (l->fh)
-	{
-	  if (l->terminal_flag)
-	    fputs("bird: ", l->fh);
-	  else
-	    {
-	      byte tbuf[TM_DATETIME_BUFFER_SIZE];
-	      tm_format_datetime(tbuf, &config->tf_log, now);
-	      fprintf(l->fh, "%s <%s> ", tbuf, class_names[class]);
-	    }
-	  fputs(buf->start, l->fh);
-	  fputc('\n', l->fh);
-	  fflush(l->fh);
-	}
-#ifdef HAVE_SYSLOG
-      else
-	syslog(syslog_priorities[class], "%s", buf->start);
-#endif
+      log_lock();
+      log_write(class, tbuf, buf->start, 1);
+      log_unlock();
     }
-  log_unlock();
 
   /* cli_echo is not thread-safe, so call it just from the main thread */
   if (main_thread_self())
@@ -278,10 +535,22 @@ default_log_list(int debug, int init, char **syslog_name)
 void
 log_switch(int debug, list *l, char *new_syslog_name)
 {
+  struct log_config *lc;
+  int need_time = 0;
+
   if (!l || EMPTY_LIST(*l))
     l = default_log_list(debug, !l, &new_syslog_name);
 
+  WALK_LIST(lc, *l)
+    if (lc->fh && !lc->terminal_flag)
+      need_time = 1;
+
+  /* The writer thread does not use the list while it is unlocked */
+  log_lock();
   current_log_list = l;
+  log_need_time = need_time;
+  log_time_gen++;
+  log_unlock();
 
 #ifdef HAVE_SYSLOG
   if (current_syslog_name && new_syslog_name &&
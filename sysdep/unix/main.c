@@ -26,6 +26,7 @@
 #include "lib/socket.h"
 #include "lib/event.h"
 #include "lib/string.h"
+#include "lib/worker.h"
 #include "nest/route.h"
 #include "nest/protocol.h"
 #include "nest/iface.h"
@@ -116,14 +117,21 @@ read_iproute_table(char *file, char *prefix, int max)
   strcpy(namebuf, prefix);
   name = namebuf + strlen(prefix);
 
+  struct cf_file *cf = cf_add_file(new_config, file);
+
   fp = fopen(file, "r");
   if (!fp)
+  {
+    cf->missing = 1;
     return;
+  }
 
   while (fgets(buf, sizeof(buf), fp))
   {
     char *p = buf;
 
+    cf->hash = cf_hash_data(cf->hash, buf, strlen(buf));
+
     while (*p == ' ' || *p == '\t')
       p++;
 
@@ -167,9 +175,12 @@ void
 sysdep_preconfig(struct config *c)
 {
   init_list(&c->logfiles);
+  init_list(&c->affinity);
 
   c->latency_limit = UNIX_DEFAULT_LATENCY_LIMIT;
   c->watchdog_warning = UNIX_DEFAULT_WATCHDOG_WARNING;
+  c->work_budget = UNIX_DEFAULT_WORK_BUDGET;
+  c->cli_budget = UNIX_DEFAULT_CLI_BUDGET;
 
 #ifdef PATH_IPROUTE_DIR
   read_iproute_table(PATH_IPROUTE_DIR "/rt_protos", "ipp_", 256);
@@ -183,6 +194,7 @@ int
 sysdep_commit(struct config *new, struct config *old UNUSED)
 {
   log_switch(debug_flag, &new->logfiles, new->syslog_name);
+  thread_set_affinity(&new->affinity);
   return 0;
 }
 
@@ -202,6 +214,45 @@ unix_read_config(struct config **cp, char *name)
   return ret;
 }
 
+/*
+ * Files of the current config were not changed since it was read, therefore
+ * reconfiguration from @name would give the same config. Files found by
+ * wildcard includes cannot be checked, as new ones may have been added.
+ */
+static int
+unix_config_unchanged(char *name)
+{
+  struct cf_file *f;
+  byte buf[16384];
+  int fd, l;
+  u64 h;
+
+  if (!config->skip_unchanged || config->files_globbed || EMPTY_LIST(config->files) ||
+      strcmp(name, config->file_name))
+    return 0;
+
+  WALK_LIST(f, config->files)
+    {
+      fd = open(f->name, O_RDONLY);
+      if (fd < 0)
+	{
+	  if (f->missing)
+	    continue;
+	  return 0;
+	}
+
+      h = 0xcbf29ce484222325ULL;
+      while ((l = read(fd, buf, sizeof(buf))) > 0)
+	h = cf_hash_data(h, buf, l);
+      close(fd);
+
+      if ((l < 0) || f->missing || (h != f->hash))
+	return 0;
+    }
+
+  return 1;
+}
+
 static struct config *
 read_config(void)
 {
@@ -224,6 +275,12 @@ async_config(void)
   struct config *conf;
 
   log(L_INFO "Reconfiguration requested by SIGHUP");
+  if (unix_config_unchanged(config_name) && config_keep())
+    {
+      log(L_INFO "Configuration files unchanged, reconfiguration skipped");
+      return;
+    }
+
   if (!unix_read_config(&conf, config_name))
     {
       if (conf->err_msg)
@@ -269,6 +326,54 @@ cmd_check_config(char *name)
   config_free(conf);
 }
 
+#define CLI_BATCH_MAX_SIZE	(16 << 20)
+
+void
+cmd_batch(char *name)
+{
+  struct stat st;
+  byte *buf;
+  int fd, n = 0;
+  uint len = 0;
+
+  if (cli_access_restricted())
+    return;
+
+  if (this_cli->batch)
+    {
+      cli_msg(8010, "Nested batch not allowed");
+      return;
+    }
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0)
+    {
+      cli_msg(8010, "Cannot open batch file %s: %m", name);
+      return;
+    }
+
+  if ((fstat(fd, &st) < 0) || (st.st_size > CLI_BATCH_MAX_SIZE))
+    {
+      cli_msg(8010, "Batch file %s too large", name);
+      close(fd);
+      return;
+    }
+
+  buf = mb_alloc(this_cli->pool, st.st_size + 1);
+  while ((len < st.st_size) && ((n = read(fd, buf + len, st.st_size - len)) > 0))
+    len += n;
+  close(fd);
+
+  if (n < 0)
+    {
+      cli_msg(8010, "Cannot read batch file %s: %m", name);
+      mb_free(buf);
+      return;
+    }
+
+  cli_batch(this_cli, buf, len);
+}
+
 static void
 cmd_reconfig_msg(int r)
 {
@@ -305,6 +410,12 @@ cmd_reconfig(char *name, int type, int timeout)
   if (cli_access_restricted())
     return;
 
+  if ((timeout <= 0) && unix_config_unchanged(name ? : config_name) && config_keep())
+    {
+      cli_msg(3, "Reconfigured, configuration files unchanged");
+      return;
+    }
+
   struct config *conf = cmd_read_config(name);
   if (!conf)
     return;
@@ -392,9 +503,8 @@ cli_tx(sock *s)
 int
 cli_get_command(cli *c)
 {
-  sock *s = c->priv;
-  byte *t = c->rx_aux ? : s->rbuf;
-  byte *tend = s->rpos;
+  byte *t = c->rx_queue.data + c->rx_qpos;
+  byte *tend = c->rx_queue.data + c->rx_queue.used;
   byte *d = c->rx_pos;
   byte *dend = c->rx_buf + CLI_RX_BUF_SIZE - 2;
 
@@ -406,23 +516,52 @@ cli_get_command(cli *c)
 	{
 	  t++;
 	  c->rx_pos = c->rx_buf;
-	  c->rx_aux = t;
+	  c->rx_qpos = t - c->rx_queue.data;
 	  *d = 0;
 	  return (d < dend) ? 1 : -1;
 	}
       else if (d < dend)
 	*d++ = *t++;
+      else
+	t++;
     }
-  c->rx_aux = s->rpos = s->rbuf;
+  BUFFER_FLUSH(c->rx_queue);
+  c->rx_qpos = 0;
   c->rx_pos = d;
   return 0;
 }
 
+/*
+ * Received data are moved from the socket buffer to the input queue of the CLI,
+ * as clients may send more commands without waiting for replies. Commands are
+ * read from the queue one by one, after the reply to the previous one is sent.
+ */
+#define CLI_RX_QUEUE_MAX	(1 << 20)
+
 static int
 cli_rx(sock *s, int size UNUSED)
 {
-  cli_kick(s->data);
-  return 0;
+  cli *c = s->data;
+  uint len = s->rpos - s->rbuf;
+
+  /* Drop already processed data */
+  if (c->rx_qpos > c->rx_queue.used / 2)
+    {
+      memmove(c->rx_queue.data, c->rx_queue.data + c->rx_qpos, c->rx_queue.used - c->rx_qpos);
+      c->rx_queue.used -= c->rx_qpos;
+      c->rx_qpos = 0;
+    }
+
+  if (c->rx_queue.used - c->rx_qpos + len > CLI_RX_QUEUE_MAX)
+    {
+      log(L_WARN "CLI connection dropped: Too many pending commands");
+      cli_free(c);
+      return 0;
+    }
+
+  memcpy(BUFFER_INC(c->rx_queue, len), s->rbuf, len);
+  cli_kick(c);
+  return 1;
 }
 
 static void
@@ -451,7 +590,8 @@ cli_connect(sock *s, int size UNUSED)
   s->data = c = cli_new(s);
   s->pool = c->pool;		/* We need to have all the socket buffers allocated in the cli pool */
   c->rx_pos = c->rx_buf;
-  c->rx_aux = NULL;
+  BUFFER_INIT(c->rx_queue, c->pool, CLI_RX_BUF_SIZE);
+  c->rx_qpos = 0;
   rmove(s, c->pool);
   return 1;
 }
@@ -467,6 +607,13 @@ cli_init_unix(uid_t use_uid, gid_t use_gid)
   s->rx_hook = cli_connect;
   s->rbsize = 1024;
 
+  /* In replay, CLI sessions come from the trace and the socket is not created */
+  if (trace_replaying())
+  {
+    sk_open_unix(s, path_control_socket);
+    return;
+  }
+
   /* Return value intentionally ignored */
   unlink(path_control_socket);
 
@@ -558,7 +705,8 @@ void
 sysdep_shutdown_done(void)
 {
   unlink_pid_file();
-  unlink(path_control_socket);
+  if (!trace_replaying())
+    unlink(path_control_socket);
   log_msg(L_FATAL "Shutdown completed");
   exit(0);
 }
@@ -615,7 +763,7 @@ signal_init(void)
  *	Parsing of command-line arguments
  */
 
-static char *opt_list = "c:dD:ps:P:u:g:fR";
+static char *opt_list = "c:dD:ps:P:u:g:fRt:T:H:";
 static int parse_and_exit;
 char *bird_name;
 static char *use_user;
@@ -625,7 +773,7 @@ static int run_in_foreground = 0;
 static void
 usage(void)
 {
-  fprintf(stderr, "Usage: %s [-c <config-file>] [-d] [-D <debug-file>] [-p] [-s <control-socket>] [-P <pid-file>] [-u <user>] [-g <group>] [-f] [-R]\n", bird_name);
+  fprintf(stderr, "Usage: %s [-c <config-file>] [-d] [-D <debug-file>] [-p] [-s <control-socket>] [-P <pid-file>] [-u <user>] [-g <group>] [-f] [-R] [-t|-T <trace-file>] [-H <handoff-socket>]\n", bird_name);
   exit(1);
 }
 
@@ -739,11 +887,26 @@ parse_args(int argc, char **argv)
       case 'R':
 	graceful_restart_recovery();
 	break;
+      case 't':
+	trace_mode = TRACE_RECORD;
+	trace_name = optarg;
+	break;
+      case 'T':
+	trace_mode = TRACE_REPLAY;
+	trace_name = optarg;
+	run_in_foreground = 1;
+	break;
+      case 'H':
+	handoff_path = optarg;
+	graceful_restart_recovery();
+	break;
       default:
 	usage();
       }
   if (optind < argc)
     usage();
+  if (handoff_path && trace_mode)
+    die("Handoff cannot be traced");
 }
 
 /*
@@ -764,6 +927,7 @@ main(int argc, char **argv)
   log_switch(debug_flag, NULL, NULL);
 
   resource_init();
+  thread_start(THREAD_MAIN);
   olock_init();
   io_init();
   rt_init();
@@ -774,9 +938,11 @@ main(int argc, char **argv)
   uid_t use_uid = get_uid(use_user);
   gid_t use_gid = get_gid(use_group);
 
-  if (!parse_and_exit)
+  /* With handoff, the control socket is taken over after the config is read */
+  if (!parse_and_exit && !handoff_path)
   {
-    test_old_bird(path_control_socket);
+    if (!trace_replaying())
+      test_old_bird(path_control_socket);
     cli_init_unix(use_uid, use_gid);
   }
 
@@ -798,6 +964,12 @@ main(int argc, char **argv)
   if (parse_and_exit)
     exit(0);
 
+  if (handoff_path)
+  {
+    handoff_receive(handoff_path, path_control_socket);
+    cli_init_unix(use_uid, use_gid);
+  }
+
   if (!(debug_flag||run_in_foreground))
     {
       pid_t pid = fork();
@@ -814,6 +986,7 @@ main(int argc, char **argv)
     }
 
   main_thread_init();
+  log_start_writer();
 
   write_pid_file();
 
@@ -23,6 +23,7 @@ typedef struct timer {
   unsigned recurrent;			/* Timer recurrence */
   node n;				/* Internal link */
   bird_clock_t expires;			/* 0=inactive */
+  struct cpu_account *acct;		/* Charged for the hook, from the pool */
 } timer;
 
 timer *tm_new(pool *);
@@ -65,6 +66,63 @@ tm_new_set(pool *p, void (*hook)(struct timer *), void *data, unsigned rand, uns
 }
 
 
+/* Timers with microsecond resolution, see sysdep/unix/io.c */
+
+typedef struct ptimer {
+  resource r;
+  void (*hook)(struct ptimer *);
+  void *data;
+  btime expires;			/* 0=inactive */
+  uint randomize;			/* Amount of randomization (in us) */
+  uint recurrent;			/* Timer recurrence (in us) */
+  uint index;				/* Position in the heap of active timers */
+  struct cpu_account *acct;		/* Charged for the hook, from the pool */
+} ptimer;
+
+ptimer *ptm_new(pool *);
+void ptm_set(ptimer *, btime when);
+void ptm_start(ptimer *, btime after);
+void ptm_stop(ptimer *);
+
+static inline int
+ptm_active(ptimer *t)
+{
+  return t->expires != 0;
+}
+
+static inline btime
+ptm_remains(ptimer *t)
+{
+  btime now = precise_time();
+  return (t->expires > now) ? (t->expires - now) : 0;
+}
+
+static inline void
+ptm_start_max(ptimer *t, btime after)
+{
+  btime rem = ptm_remains(t);
+  ptm_start(t, (rem > after) ? rem : after);
+}
+
+static inline ptimer *
+ptm_new_set(pool *p, void (*hook)(struct ptimer *), void *data)
+{
+  ptimer *t = ptm_new(p);
+  t->hook = hook;
+  t->data = data;
+  return t;
+}
+
+static inline ptimer *
+ptm_new_init(pool *p, void (*hook)(struct ptimer *), void *data, uint rec, uint rand)
+{
+  ptimer *t = ptm_new_set(p, hook, data);
+  t->recurrent = rec;
+  t->randomize = rand;
+  return t;
+}
+
+
 struct timeformat {
   char *fmt1, *fmt2;
   bird_clock_t limit;
@@ -0,0 +1,318 @@
+/*
+ *	BIRD -- Recording and Replay of Inputs
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Input traces
+ *
+ * With the -t option, all inputs of the main loop are recorded to a trace
+ * file: data read from sockets (including CLI commands), accepted and
+ * established connections, socket errors, messages from the kernel and firings
+ * of timers, each stamped with the monotonic time. With the -T option, such
+ * a trace is replayed instead of real I/O. Sockets get no file descriptors,
+ * their inputs are taken from the trace and their outputs are dropped, as are
+ * requests for kernel route updates, which always succeed. The time is
+ * virtual, it jumps to the next input or timer, so the same event (e.g. a
+ * convergence after a session reset) may be processed repeatedly at full
+ * speed by a profiler. Random numbers use the recorded seed.
+ *
+ * Replay stays in sync as long as the daemon reacts to the inputs in the same
+ * way, that is with the same binary and configuration. Inputs that cannot be
+ * delivered (e.g. for a socket that is already closed) are skipped and
+ * counted. Durations measured by precise_time() are zero in replay, real
+ * processing time is reported at the end of the trace, when BIRD shuts down.
+ *
+ * The file starts with &tr_header followed by &tr_record entries with their
+ * data. It is in the host byte order and specific to the IP version.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nest/bird.h"
+#include "lib/resource.h"
+#include "lib/timer.h"
+#include "lib/unix.h"
+
+#define TR_MAGIC	"BIRDTRC"
+#define TR_VERSION	1
+#define TR_BUFFER	(1 << 20)
+
+struct tr_header {
+  char magic[8];
+  u32 version;
+  u32 ip_size;				/* sizeof(ip_addr) */
+  u32 seed;				/* Seed of random() */
+  u32 reserved;
+  btime start;				/* Monotonic time at the start */
+  s64 real;				/* Real time at the start */
+};
+
+int trace_mode;
+char *trace_name;
+u32 trace_seed;
+btime trace_time, trace_start, trace_end;
+s64 trace_real;
+u64 trace_count;
+
+static FILE *trace_fh;
+static struct tr_record *trace_rec;	/* Read buffer in replay */
+static uint trace_rec_size;
+static int trace_valid, trace_eof;
+static uint trace_skipped, trace_timers, trace_fired;
+static struct timespec trace_clock;	/* Real time of the start of replay */
+
+static void
+trace_close(void)
+{
+  if (trace_fh)
+    fclose(trace_fh);
+  trace_fh = NULL;
+}
+
+/**
+ * trace_init - open the trace file
+ *
+ * Called from io_init() before the first update of time, when @trace_mode
+ * and @trace_name are set from the command line. In replay, it sets the
+ * virtual time to the start of the trace.
+ */
+void
+trace_init(void)
+{
+  struct tr_header h;
+
+  if (!trace_mode)
+    return;
+
+  trace_fh = fopen(trace_name, trace_recording() ? "w" : "r");
+  if (!trace_fh)
+    die("Cannot open trace file %s: %m", trace_name);
+  setvbuf(trace_fh, NULL, _IOFBF, TR_BUFFER);
+
+  if (trace_recording())
+  {
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TR_MAGIC, sizeof(h.magic));
+    h.version = TR_VERSION;
+    h.ip_size = sizeof(ip_addr);
+    h.seed = trace_seed = time(NULL);
+    h.start = precise_time();
+    h.real = time(NULL);
+
+    /* Written immediately, so the buffer is empty when the daemon forks */
+    if ((fwrite(&h, sizeof(h), 1, trace_fh) != 1) || fflush(trace_fh))
+      die("Cannot write trace file %s: %m", trace_name);
+
+    atexit(trace_close);
+    return;
+  }
+
+  if (fread(&h, sizeof(h), 1, trace_fh) != 1)
+    die("Cannot read trace file %s", trace_name);
+  if (memcmp(h.magic, TR_MAGIC, sizeof(h.magic)) || (h.version != TR_VERSION))
+    die("%s is not a BIRD trace file", trace_name);
+  if (h.ip_size != sizeof(ip_addr))
+    die("Trace file %s was recorded by another IP version", trace_name);
+
+  trace_seed = h.seed;
+  trace_time = trace_start = h.start;
+  trace_real = h.real;
+  clock_gettime(CLOCK_MONOTONIC, &trace_clock);
+}
+
+/**
+ * trace_flush - write buffered records
+ *
+ * Called by the main loop before it waits, so the trace is complete up to
+ * the last input when the daemon is killed.
+ */
+void
+trace_flush(void)
+{
+  if (trace_fh && fflush(trace_fh))
+    die("Cannot write trace file %s: %m", trace_name);
+}
+
+/**
+ * trace_write - record an input
+ * @type: record type (TR_*)
+ * @sock: socket ID
+ * @arg: type specific argument
+ * @hdr: type specific header of the data, may be NULL
+ * @hlen: length of @hdr
+ * @data: the data, may be NULL
+ * @len: length of @data
+ *
+ * Must be called only from the main thread.
+ */
+void
+trace_write(uint type, u32 sock, int arg, const void *hdr, uint hlen, const void *data, uint len)
+{
+  struct tr_record r = {
+    .type = type,
+    .len = hlen + len,
+    .sock = sock,
+    .arg = arg,
+    .time = precise_time()
+  };
+
+  if ((fwrite(&r, sizeof(r), 1, trace_fh) != 1) ||
+      (hlen && (fwrite(hdr, hlen, 1, trace_fh) != 1)) ||
+      (len && (fwrite(data, len, 1, trace_fh) != 1)))
+    die("Cannot write trace file %s: %m", trace_name);
+}
+
+static int
+trace_load(void)
+{
+  struct tr_record r;
+
+  if (fread(&r, sizeof(r), 1, trace_fh) != 1)
+    return 0;
+
+  if (sizeof(r) + r.len > trace_rec_size)
+  {
+    trace_rec_size = MAX(2 * trace_rec_size, sizeof(r) + r.len);
+    xfree(trace_rec);
+    trace_rec = xmalloc(trace_rec_size);
+  }
+
+  *trace_rec = r;
+  trace_end = r.time;
+  if (r.len && (fread(trace_rec + 1, r.len, 1, trace_fh) != 1))
+  {
+    log(L_WARN "Trace file %s is truncated", trace_name);
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * trace_peek - get the next input in replay
+ *
+ * Returns the next record with its data following it, or NULL at the end of
+ * the trace. The record is valid until trace_next(). Firings of timers are
+ * just counted and skipped, as timers fire by the virtual time anyway.
+ */
+struct tr_record *
+trace_peek(void)
+{
+  while (!trace_valid && !trace_eof)
+  {
+    if (!trace_load())
+      trace_eof = 1;
+    else if (trace_rec->type == TR_TIMER)
+      trace_timers++;
+    else
+      trace_valid = 1;
+  }
+
+  return trace_valid ? trace_rec : NULL;
+}
+
+/* Consume the record returned by trace_peek() */
+void
+trace_next(void)
+{
+  trace_valid = 0;
+  trace_count++;
+}
+
+/* Consume the record returned by trace_peek(), which could not be delivered */
+void
+trace_skip(void)
+{
+  struct tr_record *r = trace_rec;
+
+  if (!trace_skipped++)
+    log(L_WARN "Replay diverged, skipping record of type %u for socket %u", r->type, r->sock);
+
+  trace_next();
+}
+
+/**
+ * trace_read - get a kernel message in replay
+ * @sock: socket ID, 0 for replies to requests
+ * @buf: buffer
+ * @size: size of @buf
+ *
+ * It is a replacement of recvmsg() for kernel messages, which are read
+ * directly by the sysdep code. Returns the length of the message, or -1 with
+ * errno set when the next input is a recorded error or no message for @sock.
+ * Notifications (nonzero @sock) are returned only when their time has come,
+ * replies to requests are returned immediately, as they were waited for.
+ */
+int
+trace_read(u32 sock, void *buf, uint size)
+{
+  struct tr_record *r = trace_peek();
+
+  if (!r || (r->sock != sock) || ((r->type != TR_KERNEL) && (r->type != TR_ERROR)) ||
+      (sock && (r->time > trace_time)))
+  {
+    errno = sock ? EAGAIN : ENOMSG;
+    return -1;
+  }
+
+  trace_time = MAX(trace_time, r->time);
+  trace_next();
+
+  if (r->type == TR_ERROR)
+  {
+    errno = r->arg;
+    return -1;
+  }
+
+  if (r->len > size)
+  {
+    trace_skipped++;
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  memcpy(buf, r + 1, r->len);
+  return r->len;
+}
+
+/* Called by the main loop for each fired timer */
+void
+trace_timer(void)
+{
+  if (trace_recording())
+    trace_write(TR_TIMER, 0, 0, NULL, 0, NULL, 0);
+  else
+    trace_fired++;
+}
+
+/**
+ * trace_done - finish replay
+ *
+ * Called by the main loop when it has nothing to do after the last input of
+ * the trace. It reports statistics and shuts BIRD down.
+ */
+void
+trace_done(void)
+{
+  static int done;
+  struct timespec ts;
+
+  if (done)
+    return;
+  done = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  btime real = (ts.tv_sec - trace_clock.tv_sec) S + (ts.tv_nsec - trace_clock.tv_nsec) / 1000;
+
+  log(L_INFO "Replay finished: %lu inputs, %u skipped, %u timers recorded, %u fired, %u ms of trace in %u ms",
+      (unsigned long) trace_count, trace_skipped, trace_timers, trace_fired,
+      (uint) ((trace_time - trace_start) TO_MS), (uint) (real TO_MS));
+
+  async_shutdown();
+}
@@ -22,6 +22,7 @@ void async_config(void);
 void async_dump(void);
 void async_shutdown(void);
 void cmd_check_config(char *name);
+void cmd_batch(char *name);
 void cmd_reconfig(char *name, int type, int timeout);
 void cmd_reconfig_confirm(void);
 void cmd_reconfig_undo(void);
@@ -31,6 +32,8 @@ void cmd_shutdown(void);
 
 #define UNIX_DEFAULT_LATENCY_LIMIT	(1 S_)
 #define UNIX_DEFAULT_WATCHDOG_WARNING	(5 S_)
+#define UNIX_DEFAULT_WORK_BUDGET	(5 MS_)
+#define UNIX_DEFAULT_CLI_BUDGET		(5 MS_)
 
 /* io.c */
 
@@ -102,10 +105,123 @@ volatile int async_shutdown_flag;
 void io_init(void);
 void io_loop(void);
 void io_log_dump(void);
+void io_stats_set(int enable);
+void io_stats_reset(void);
+void io_stats_show(uint max);
+
+#define IO_HIST_SIZE	24		/* The last bucket takes all above 8 s */
+
+struct io_loop_stats {
+  u64 cycles;				/* Finished loop cycles */
+  btime total, max;			/* Sum and maximum of cycle durations */
+  u64 hist[IO_HIST_SIZE];		/* Bucket i counts durations in [2^i, 2^(i+1)) us */
+};
+
+void io_loop_stats(struct io_loop_stats *s);
 int sk_open_unix(struct birdsock *s, char *name);
 void *tracked_fopen(struct pool *, char *name, char *mode);
 void test_old_bird(char *path);
 
+void pipe_new(int *pfds);
+void pipe_drain(int fd);
+void pipe_kick(int fd);
+
+
+/* trace.c */
+
+#define TRACE_RECORD	1		/* Inputs are recorded to the trace file */
+#define TRACE_REPLAY	2		/* Inputs are replayed from the trace file */
+
+/* Record types */
+#define TR_STREAM	1		/* Data read from a stream socket */
+#define TR_DGRAM	2		/* Received datagram, &tr_dgram and data */
+#define TR_ACCEPT	3		/* Accepted connection, &tr_conn, arg is its socket ID */
+#define TR_CONNECT	4		/* Outgoing connection established, &tr_conn */
+#define TR_ERROR	5		/* Socket error, arg is errno or 0 for EOF */
+#define TR_KERNEL	6		/* Kernel message, socket ID 0 for replies to requests */
+#define TR_TIMER	7		/* Timer fired */
+
+struct tr_record {
+  u16 type;				/* TR_* */
+  u16 reserved;
+  u32 len;				/* Length of data following the record */
+  u32 sock;				/* Socket ID, see sk_trace_add() */
+  s32 arg;
+  btime time;				/* Monotonic time of the input */
+};
+
+struct tr_dgram {
+  ip_addr faddr, laddr;
+  u32 fport, lifindex;
+  s32 ttl;
+  u32 truncated;
+  btime tstamp;
+};
+
+struct tr_conn {
+  ip_addr saddr, daddr;
+  u32 sport, dport;
+  u32 ifindex;
+  u32 reserved;
+};
+
+extern int trace_mode;			/* 0 or TRACE_* */
+extern char *trace_name;
+extern u32 trace_seed;
+extern btime trace_time, trace_start;	/* Virtual monotonic time in replay */
+extern btime trace_end;			/* Time of the last record read */
+extern s64 trace_real;			/* Real time at the start of the trace */
+extern u64 trace_count;			/* Consumed records */
+
+void trace_init(void);
+void trace_flush(void);
+void trace_write(uint type, u32 sock, int arg, const void *hdr, uint hlen, const void *data, uint len);
+struct tr_record *trace_peek(void);
+void trace_next(void);
+void trace_skip(void);
+int trace_read(u32 sock, void *buf, uint size);
+void trace_timer(void);
+void trace_done(void);
+
+static inline int trace_recording(void)
+{ return trace_mode == TRACE_RECORD; }
+
+static inline int trace_replaying(void)
+{ return trace_mode == TRACE_REPLAY; }
+
+/* Record of data from the kernel, @sock is 0 for replies to requests */
+static inline void trace_kernel(u32 sock, void *data, uint len)
+{ if (trace_recording()) trace_write(TR_KERNEL, sock, 0, NULL, 0, data, len); }
+
+static inline void trace_kernel_error(u32 sock, int err)
+{ if (trace_recording()) trace_write(TR_ERROR, sock, err, NULL, 0, NULL, 0); }
+
+
+/* handoff.c */
+
+#define HO_NAME_SIZE	64		/* Enough for protocol names */
+
+/* Message types */
+#define HO_BGP_LISTEN	1		/* BGP listening socket */
+#define HO_BGP_SESSION	2		/* Established BGP session, see bgp_handoff() */
+
+struct handoff_rec {
+  node n;
+  uint type;				/* HO_* */
+  int fd;				/* Passed descriptor, -1 if none or taken */
+  char name[HO_NAME_SIZE];		/* Owner, usually a protocol instance */
+  uint len;
+  byte data[0];
+};
+
+extern char *handoff_path;		/* Set by the -H option */
+
+void cmd_handoff(char *path);
+int handoff_put(uint type, const char *name, int fd, const void *data, uint len);
+void handoff_receive(char *path, char *ctl);
+struct handoff_rec *handoff_find(uint type, const char *name);
+void handoff_release(struct handoff_rec *r);
+
 
 /* krt.c bits */
 
@@ -114,6 +230,7 @@ void krt_io_init(void);
 /* log.c */
 
 void main_thread_init(void);
+void log_start_writer(void);		/* Write log messages by a separate thread */
 void log_init_debug(char *);		/* Initialize debug dump to given file (NULL=stderr, ""=off) */
 void log_switch(int debug, list *l, char *); /* Use l=NULL for initial switch */
 
@@ -0,0 +1,442 @@
+/*
+ *	BIRD -- Pool of Worker Threads
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Worker threads
+ *
+ * A worker pool runs batches of independent jobs in parallel. It is intended
+ * for parts of computations that only read shared data structures and write
+ * to their own private results, which are merged afterwards. wp_run() is
+ * called from the main thread, it calls the hook for each job in the worker
+ * threads and in the calling thread and returns after all jobs are finished.
+ * Therefore the rest of BIRD still sees just one thread.
+ *
+ * The hooks must not use resources shared with the main thread (pools, slabs,
+ * events, timers, sockets, lists of them), except the ones allocated for the
+ * job before wp_run() and not used elsewhere for its duration. Logging is safe.
+ *
+ * Without POSIX threads, wp_run() just calls the hook for all jobs in sequence.
+ */
+
+/**
+ * DOC: CPU affinity of threads
+ *
+ * Threads of BIRD belong to classes (%THREAD_MAIN, %THREAD_BFD etc.), which
+ * may be bound to configured sets of CPUs, e.g. to keep them on one socket of
+ * a NUMA machine. Each thread calls thread_start() when it starts and
+ * thread_stop() before it exits, so it is registered and bound to the CPU set
+ * of its class. When the configuration changes, thread_set_affinity() rebinds
+ * all registered threads whose set has changed. Classes without a configured
+ * set use the CPUs the daemon was started with.
+ *
+ * Pages for slabs are allocated from the NUMA node of the CPU the allocating
+ * thread runs on (see alloc_page()), so bound threads work mostly with local
+ * memory. Linear pools and other memory come from malloc(), which keeps
+ * per-thread arenas and gets node-local pages by the default first-touch
+ * policy of the kernel.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>
+
+#include "nest/bird.h"
+#include "lib/resource.h"
+#include "lib/worker.h"
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#ifdef CONFIG_CPU_AFFINITY
+#include <sched.h>
+#endif
+
+struct worker_pool
+{
+  resource r;
+  uint threads;
+#ifdef USE_PTHREADS
+  pthread_t *thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;		/* New batch or stop request */
+  pthread_cond_t done_cond;		/* All jobs of the batch finished */
+  work_hook hook;
+  void *data;
+  uint count, next, pending;		/* Jobs in the batch, next to start, not finished */
+  uint batch;				/* Sequence number of the current batch */
+  int stop;
+#endif
+};
+
+#ifdef USE_PTHREADS
+
+/* Called and returns with the mutex locked */
+static void
+wp_do_jobs(worker_pool *wp)
+{
+  while (wp->next < wp->count)
+  {
+    uint i = wp->next++;
+
+    pthread_mutex_unlock(&wp->mutex);
+    wp->hook(wp->data, i);
+    pthread_mutex_lock(&wp->mutex);
+
+    if (!--wp->pending)
+      pthread_cond_signal(&wp->done_cond);
+  }
+}
+
+static void *
+wp_main(void *arg)
+{
+  worker_pool *wp = arg;
+  uint batch = 0;
+
+  thread_start(THREAD_WORKER);
+
+  pthread_mutex_lock(&wp->mutex);
+  while (1)
+  {
+    while (!wp->stop && (wp->batch == batch))
+      pthread_cond_wait(&wp->work_cond, &wp->mutex);
+
+    if (wp->stop)
+      break;
+
+    batch = wp->batch;
+    wp_do_jobs(wp);
+  }
+  pthread_mutex_unlock(&wp->mutex);
+
+  thread_stop();
+  return NULL;
+}
+
+#endif
+
+static void
+wp_free(resource *r)
+{
+#ifdef USE_PTHREADS
+  worker_pool *wp = (worker_pool *) r;
+  uint i;
+
+  pthread_mutex_lock(&wp->mutex);
+  wp->stop = 1;
+  pthread_cond_broadcast(&wp->work_cond);
+  pthread_mutex_unlock(&wp->mutex);
+
+  for (i = 0; i < wp->threads; i++)
+  {
+    int rv = pthread_join(wp->thread[i], NULL);
+    if (rv)
+      die("pthread_join(): %M", rv);
+  }
+
+  pthread_cond_destroy(&wp->done_cond);
+  pthread_cond_destroy(&wp->work_cond);
+  pthread_mutex_destroy(&wp->mutex);
+  xfree(wp->thread);
+#endif
+}
+
+static void
+wp_dump(resource *r)
+{
+  worker_pool *wp = (worker_pool *) r;
+
+  debug("(threads %u)\n", wp->threads);
+}
+
+static struct resclass wp_class = {
+  "Worker pool",
+  sizeof(worker_pool),
+  wp_free,
+  wp_dump,
+  NULL,
+  NULL
+};
+
+/**
+ * wp_new - create a worker pool
+ * @p: resource pool
+ * @threads: number of worker threads
+ *
+ * This function starts @threads worker threads, which wait for jobs passed by
+ * wp_run(). As the calling thread also runs jobs, @threads is the number of
+ * jobs that may run in parallel minus one. Without POSIX threads, no worker
+ * threads are started. The threads are stopped when the pool is freed.
+ */
+worker_pool *
+wp_new(pool *p, uint threads)
+{
+  worker_pool *wp = ralloc(p, &wp_class);
+
+#ifdef USE_PTHREADS
+  uint i;
+
+  pthread_mutex_init(&wp->mutex, NULL);
+  pthread_cond_init(&wp->work_cond, NULL);
+  pthread_cond_init(&wp->done_cond, NULL);
+  wp->thread = xmalloc(MAX(threads, 1) * sizeof(pthread_t));
+
+  for (i = 0; i < threads; i++)
+  {
+    int rv = pthread_create(&wp->thread[i], NULL, wp_main, wp);
+    if (rv)
+      die("pthread_create(): %M", rv);
+
+    wp->threads++;
+  }
+#endif
+
+  return wp;
+}
+
+/**
+ * wp_run - run a batch of jobs
+ * @wp: worker pool
+ * @hook: job function
+ * @data: argument passed to the job function
+ * @count: number of jobs
+ *
+ * This function calls @hook(@data, i) for each i from 0 to @count - 1, in
+ * parallel in the worker threads and in the calling thread. Jobs are started
+ * in the order of their numbers, so longer jobs should have lower numbers.
+ * The function returns after all jobs are finished.
+ */
+void
+wp_run(worker_pool *wp, work_hook hook, void *data, uint count)
+{
+  uint i;
+
+  if (!wp->threads || (count < 2))
+  {
+    for (i = 0; i < count; i++)
+      hook(data, i);
+    return;
+  }
+
+#ifdef USE_PTHREADS
+  pthread_mutex_lock(&wp->mutex);
+  wp->hook = hook;
+  wp->data = data;
+  wp->count = count;
+  wp->next = 0;
+  wp->pending = count;
+  wp->batch++;
+  pthread_cond_broadcast(&wp->work_cond);
+
+  wp_do_jobs(wp);
+
+  while (wp->pending)
+    pthread_cond_wait(&wp->done_cond, &wp->mutex);
+  pthread_mutex_unlock(&wp->mutex);
+#endif
+}
+
+/**
+ * wp_threads - number of worker threads
+ * @wp: worker pool
+ */
+uint
+wp_threads(worker_pool *wp)
+{
+  return wp->threads;
+}
+
+
+/**
+ * thread_parse_cpus - parse a list of CPUs
+ * @s: list of CPU numbers and ranges, e.g. "0-3,8,10-11"
+ * @cpus: bitmap of %THREAD_MAX_CPUS bits to be filled
+ *
+ * The format is the same as used by the kernel (e.g. for cpulist files in
+ * sysfs). Returns 0 on success, -1 for an invalid or empty list.
+ */
+int
+thread_parse_cpus(const char *s, u64 *cpus)
+{
+  bzero(cpus, THREAD_MAX_CPUS / 8);
+
+  while (*s && (*s != '\n'))
+  {
+    char *e;
+    ulong a = strtoul(s, &e, 10), b = a;
+
+    if (e == s)
+      return -1;
+
+    if (*e == '-')
+    {
+      s = e + 1;
+      b = strtoul(s, &e, 10);
+      if ((e == s) || (b < a))
+	return -1;
+    }
+
+    if (b >= THREAD_MAX_CPUS)
+      return -1;
+
+    for (; a <= b; a++)
+      cpus[a / 64] |= 1ULL << (a % 64);
+
+    s = e;
+    if (*s == ',')
+      s++;
+    else if (*s && (*s != '\n'))
+      return -1;
+  }
+
+  for (uint i = 0; i < THREAD_MAX_CPUS / 64; i++)
+    if (cpus[i])
+      return 0;
+
+  return -1;
+}
+
+#ifdef USE_PTHREADS
+
+struct thread_rec {
+  node n;
+  pthread_t id;
+  uint class;
+};
+
+static list thread_list;		/* Running threads (struct thread_rec) */
+static pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct thread_rec thread_self;
+static int thread_init_done;
+
+#ifdef CONFIG_CPU_AFFINITY
+
+static const char * const thread_class_name[THREAD_MAX] = {
+  [THREAD_MAIN] = "main",
+  [THREAD_BFD] = "BFD",
+  [THREAD_BGP] = "BGP",
+  [THREAD_OSPF] = "OSPF",
+  [THREAD_WORKER] = "worker",
+  [THREAD_LOG] = "log",
+  [THREAD_KERNEL] = "kernel",
+  [THREAD_METRICS] = "metrics",
+};
+
+static cpu_set_t thread_cpus[THREAD_MAX];	/* Configured sets, empty if none */
+static cpu_set_t thread_default_cpus;	/* Affinity the daemon was started with */
+
+/* Called with thread_mutex locked */
+static void
+thread_bind(struct thread_rec *t)
+{
+  cpu_set_t *set = CPU_COUNT(&thread_cpus[t->class]) ? &thread_cpus[t->class] : &thread_default_cpus;
+
+  int rv = pthread_setaffinity_np(t->id, sizeof(cpu_set_t), set);
+  if (rv)
+    log(L_WARN "Cannot set CPU affinity of %s thread: %M", thread_class_name[t->class], rv);
+}
+
+#endif
+
+/**
+ * thread_start - register the calling thread
+ * @class: thread class (%THREAD_*)
+ *
+ * Called at the start of each thread, the main thread registers itself before
+ * any other thread is started. The thread is bound to the CPU set of its class.
+ */
+void
+thread_start(uint class)
+{
+  thread_self.id = pthread_self();
+  thread_self.class = class;
+
+  pthread_mutex_lock(&thread_mutex);
+
+  if (!thread_init_done)
+  {
+    init_list(&thread_list);
+#ifdef CONFIG_CPU_AFFINITY
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &thread_default_cpus) < 0)
+      CPU_ZERO(&thread_default_cpus);
+#endif
+    thread_init_done = 1;
+  }
+
+  add_tail(&thread_list, &thread_self.n);
+
+#ifdef CONFIG_CPU_AFFINITY
+  if (CPU_COUNT(&thread_cpus[class]))
+    thread_bind(&thread_self);
+#endif
+
+  pthread_mutex_unlock(&thread_mutex);
+}
+
+/**
+ * thread_stop - unregister the calling thread
+ *
+ * Called by a thread registered by thread_start() before it exits.
+ */
+void
+thread_stop(void)
+{
+  pthread_mutex_lock(&thread_mutex);
+  rem_node(&thread_self.n);
+  pthread_mutex_unlock(&thread_mutex);
+}
+
+/**
+ * thread_set_affinity - apply configured CPU sets
+ * @l: list of &thread_affinity, at most one for each class
+ *
+ * Called from the main thread when a new configuration is committed. Threads
+ * of classes whose CPU set has changed are rebound, threads started later are
+ * bound by thread_start().
+ */
+void
+thread_set_affinity(list *l)
+{
+#ifdef CONFIG_CPU_AFFINITY
+  cpu_set_t cpus[THREAD_MAX];
+  struct thread_affinity *a;
+  struct thread_rec *t;
+  uint i, j;
+
+  for (i = 0; i < THREAD_MAX; i++)
+    CPU_ZERO(&cpus[i]);
+
+  WALK_LIST(a, *l)
+    for (j = 0; j < MIN(THREAD_MAX_CPUS, CPU_SETSIZE); j++)
+      if (a->cpus[j / 64] & (1ULL << (j % 64)))
+	CPU_SET(j, &cpus[a->class]);
+
+  pthread_mutex_lock(&thread_mutex);
+
+  int changed[THREAD_MAX];
+  for (i = 0; i < THREAD_MAX; i++)
+  {
+    changed[i] = !CPU_EQUAL(&cpus[i], &thread_cpus[i]);
+    thread_cpus[i] = cpus[i];
+  }
+
+  if (thread_init_done)
+    WALK_LIST(t, thread_list)
+      if (changed[t->class])
+	thread_bind(t);
+
+  pthread_mutex_unlock(&thread_mutex);
+#endif
+}
+
+#else
+
+void thread_start(uint class UNUSED) { }
+void thread_stop(void) { }
+void thread_set_affinity(list *l UNUSED) { }
+
+#endif